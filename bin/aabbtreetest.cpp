@@ -0,0 +1,421 @@
+#include <rlpbr.hpp>
+#include <rlpbr/aabb_tree.hpp>
+
+#include "test_scene.hpp"
+#include "test_util.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+using namespace RLpbr;
+
+struct Box {
+    glm::vec3 min;
+    glm::vec3 max;
+};
+
+static bool boxesOverlap(const Box &a, const Box &b)
+{
+    return glm::all(glm::lessThanEqual(a.min, b.max)) &&
+        glm::all(glm::lessThanEqual(b.min, a.max));
+}
+
+static Box randomBox(mt19937 &rng, float extent, float max_size)
+{
+    uniform_real_distribution<float> pos(-extent, extent);
+    uniform_real_distribution<float> size(0.f, max_size);
+
+    glm::vec3 min(pos(rng), pos(rng), pos(rng));
+    return { min, min + glm::vec3(size(rng), size(rng), size(rng)) };
+}
+
+static glm::vec3 randomDir(mt19937 &rng)
+{
+    uniform_real_distribution<float> unit(-1.f, 1.f);
+    glm::vec3 dir(unit(rng), unit(rng), unit(rng));
+
+    // Axis aligned rays exercise the infinite inverse direction
+    uint32_t flat = rng() % 8;
+    if (flat < 3) {
+        dir[flat] = 0.f;
+    }
+
+    return glm::normalize(dir + glm::vec3(1e-3f));
+}
+
+static bool sameSet(vector<uint32_t> a, vector<uint32_t> b)
+{
+    sort(a.begin(), a.end());
+    sort(b.begin(), b.end());
+    return a == b;
+}
+
+static bool hasDuplicates(vector<uint32_t> ids)
+{
+    sort(ids.begin(), ids.end());
+    return adjacent_find(ids.begin(), ids.end()) != ids.end();
+}
+
+// The tree on its own: random inserts, removes and updates, each query
+// compared with testing every live box
+static bool testTree(float margin, uint32_t seed)
+{
+    bool passed = true;
+
+    mt19937 rng(seed);
+    AABBTree tree(margin);
+
+    // user data -> (leaf, exact box)
+    unordered_map<uint32_t, pair<uint32_t, Box>> live;
+    uint32_t next_id = 0;
+
+    bool counts_match = true;
+    bool overlap_match = true;
+    bool candidates_superset = true;
+    bool raycast_match = true;
+    bool no_duplicates = true;
+
+    for (uint32_t iter = 0; iter < 3000; iter++) {
+        uint32_t op = rng() % 10;
+
+        if (live.size() < 20 || op < 3) {
+            Box box = randomBox(rng, 50.f, 4.f);
+            uint32_t id = next_id++;
+            live[id] = { tree.insert(box.min, box.max, id), box };
+        } else if (op < 5) {
+            auto iter_live = next(live.begin(), rng() % live.size());
+            tree.remove(iter_live->second.first);
+            live.erase(iter_live);
+        } else {
+            // Mostly small moves that stay inside the enlarged box
+            auto iter_live = next(live.begin(), rng() % live.size());
+            Box &box = iter_live->second.second;
+            uniform_real_distribution<float> jitter(-0.08f, 0.08f);
+            glm::vec3 delta(jitter(rng), jitter(rng), jitter(rng));
+            if (op == 9) {
+                delta *= 100.f;
+            }
+            box.min += delta;
+            box.max += delta;
+            tree.update(iter_live->second.first, box.min, box.max);
+        }
+
+        counts_match &= tree.getNumLeaves() == live.size();
+
+        if (iter % 10 != 9) {
+            continue;
+        }
+
+        // Box query, raw candidates and exact results
+        Box query = randomBox(rng, 50.f, 30.f);
+        vector<uint32_t> candidates, found;
+        tree.query([&](const glm::vec3 &min, const glm::vec3 &max) {
+            return boxesOverlap({ min, max }, query);
+        }, [&](uint32_t id) {
+            candidates.push_back(id);
+            if (boxesOverlap(live.at(id).second, query)) {
+                found.push_back(id);
+            }
+        });
+
+        vector<uint32_t> expected;
+        for (const auto &[id, entry] : live) {
+            if (boxesOverlap(entry.second, query)) {
+                expected.push_back(id);
+            }
+        }
+
+        no_duplicates &= !hasDuplicates(candidates);
+        overlap_match &= sameSet(found, expected);
+        for (uint32_t id : expected) {
+            candidates_superset &= find(candidates.begin(), candidates.end(),
+                                        id) != candidates.end();
+        }
+
+        // Closest hit with pruning against every box
+        uniform_real_distribution<float> pos(-60.f, 60.f);
+        glm::vec3 origin(pos(rng), pos(rng), pos(rng));
+        glm::vec3 dir = randomDir(rng);
+        glm::vec3 inv_dir = 1.f / dir;
+        float max_t = rng() % 2 ? 200.f : 40.f;
+
+        float closest_t = max_t;
+        bool tree_hit = false;
+        tree.raycast(origin, dir, max_t, [&](uint32_t id) {
+            const Box &box = live.at(id).second;
+            float t;
+            if (AABBTree::intersectRay(box.min, box.max, origin, inv_dir,
+                                       closest_t, t)) {
+                closest_t = min(closest_t, t);
+                tree_hit = true;
+            }
+            return closest_t;
+        });
+
+        float brute_t = max_t;
+        bool brute_hit = false;
+        for (const auto &[id, entry] : live) {
+            float t;
+            if (AABBTree::intersectRay(entry.second.min, entry.second.max,
+                                       origin, inv_dir, max_t, t)) {
+                brute_t = min(brute_t, t);
+                brute_hit = true;
+            }
+        }
+
+        raycast_match &= tree_hit == brute_hit &&
+            (!brute_hit || closest_t == brute_t);
+    }
+
+    // Emptying the tree, then reusing it
+    for (const auto &[id, entry] : live) {
+        tree.remove(entry.first);
+    }
+    bool empty_visited = false;
+    tree.query([](const glm::vec3 &, const glm::vec3 &) { return true; },
+               [&](uint32_t) { empty_visited = true; });
+    counts_match &= tree.getNumLeaves() == 0 && !empty_visited;
+
+    tree.insert(glm::vec3(0.f), glm::vec3(1.f), 7);
+    vector<uint32_t> single;
+    tree.query([](const glm::vec3 &, const glm::vec3 &) { return true; },
+               [&](uint32_t id) { single.push_back(id); });
+    counts_match &= single == vector<uint32_t> { 7 };
+
+    passed &= check(counts_match, "tree leaf counts");
+    passed &= check(no_duplicates, "each leaf visited once");
+    passed &= check(candidates_superset, "candidates cover exact overlaps");
+    passed &= check(overlap_match, "filtered query matches brute force");
+    passed &= check(raycast_match, "closest raycast matches brute force");
+
+    return passed;
+}
+
+// Same bounds as the environment computes: transformed center, extents
+// projected onto the world axes
+static Box instanceBounds(const Environment &env, uint32_t idx)
+{
+    const glm::mat4x3 &txfm = env.getTransforms()[idx].mat;
+    const AABB &bounds = env.getScene()->envInit.objectBounds[
+        env.getInstances()[idx].objectIndex];
+
+    glm::vec3 center = 0.5f * (bounds.pMin + bounds.pMax);
+    glm::vec3 extent = 0.5f * (bounds.pMax - bounds.pMin);
+
+    glm::vec3 world_center = txfm * glm::vec4(center, 1.f);
+    glm::vec3 world_extent =
+        glm::abs(txfm[0]) * extent.x +
+        glm::abs(txfm[1]) * extent.y +
+        glm::abs(txfm[2]) * extent.z;
+
+    return { world_center - world_extent, world_center + world_extent };
+}
+
+template <typename Fn>
+static vector<uint32_t> bruteForce(const Environment &env, Fn &&matches)
+{
+    vector<uint32_t> ids;
+    for (uint32_t idx = 0; idx < env.getNumInstances(); idx++) {
+        if (matches(instanceBounds(env, idx))) {
+            ids.push_back(env.getInstanceID(idx));
+        }
+    }
+
+    return ids;
+}
+
+// Environment queries while instances move, so the tree is updated
+// incrementally between queries rather than rebuilt
+static bool testEnvironment(Renderer &renderer)
+{
+    bool passed = true;
+
+    mt19937 rng(77);
+    uniform_real_distribution<float> unit(-1.f, 1.f);
+
+    auto scene = makeTestScene({ 7, 3, 300, 20.f, 8, {}, false });
+    Environment env = renderer.makeEnvironment(scene);
+
+    bool overlap_match = true;
+    bool radius_match = true;
+    bool planes_match = true;
+    bool camera_match = true;
+    bool pick_match = true;
+
+    for (uint32_t iter = 0; iter < 400; iter++) {
+        // A few edits between queries
+        for (uint32_t edit = 0; edit < 6; edit++) {
+            uint32_t op = rng() % 10;
+            uint32_t num_instances = env.getNumInstances();
+
+            if (op == 0 || num_instances < 50) {
+                uint32_t obj_idx = rng() % scene->objectInfo.size();
+                uint32_t mats[3] = { 0, 1, 2 };
+                env.addInstance(obj_idx, mats,
+                    scene->objectInfo[obj_idx].numMeshes,
+                    20.f * glm::vec3(unit(rng), unit(rng), unit(rng)),
+                    glm::normalize(glm::quat(unit(rng), unit(rng),
+                                             unit(rng), unit(rng))));
+            } else if (op == 1) {
+                env.deleteInstance(env.getInstanceID(rng() % num_instances));
+            } else if (op < 6) {
+                uint32_t inst_id = env.getInstanceID(rng() % num_instances);
+                float scale = op == 5 ? 10.f : 0.05f;
+                env.moveInstance(inst_id, scale * glm::vec3(
+                    unit(rng), unit(rng), unit(rng)));
+            } else if (op < 8) {
+                env.rotateInstance(env.getInstanceID(rng() % num_instances),
+                    glm::angleAxis(unit(rng), glm::vec3(0.f, 1.f, 0.f)));
+            } else if (op == 8) {
+                // Children move through the hierarchy, which has to mark
+                // them for the spatial index too
+                env.setInstanceParent(
+                    env.getInstanceID(rng() % num_instances),
+                    rng() % 3 == 0 ? Environment::noParent :
+                        env.getInstanceID(rng() % num_instances));
+            } else {
+                glm::vec3 pos = 20.f * glm::vec3(unit(rng), unit(rng),
+                                                 unit(rng));
+                env.setInstanceTransform(
+                    env.getInstanceID(rng() % num_instances), pos,
+                    glm::quat(1.f, 0.f, 0.f, 0.f));
+            }
+        }
+
+        vector<uint32_t> found;
+
+        Box query = randomBox(rng, 25.f, 15.f);
+        env.queryInstancesOverlap(query.min, query.max, found);
+        overlap_match &= !hasDuplicates(found) &&
+            sameSet(found, bruteForce(env, [&](const Box &box) {
+                return boxesOverlap(box, query);
+            }));
+
+        glm::vec3 center = 20.f * glm::vec3(unit(rng), unit(rng), unit(rng));
+        float radius = 8.f * (unit(rng) + 1.f);
+        found.clear();
+        env.queryInstancesRadius(center, radius, found);
+        radius_match &= sameSet(found, bruteForce(env, [&](const Box &box) {
+            glm::vec3 delta = glm::clamp(center, box.min, box.max) - center;
+            return glm::dot(delta, delta) <= radius * radius;
+        }));
+
+        // Random half spaces
+        uint32_t num_planes = 1 + rng() % 4;
+        glm::vec4 planes[4];
+        for (uint32_t i = 0; i < num_planes; i++) {
+            glm::vec3 normal = randomDir(rng);
+            planes[i] = glm::vec4(normal, 15.f * unit(rng));
+        }
+        found.clear();
+        env.queryInstancesFrustum(planes, num_planes, found);
+        planes_match &= sameSet(found, bruteForce(env, [&](const Box &box) {
+            for (uint32_t i = 0; i < num_planes; i++) {
+                glm::vec3 normal(planes[i]);
+                float best = 0.f;
+                for (int axis = 0; axis < 3; axis++) {
+                    best += normal[axis] * (normal[axis] >= 0.f ?
+                        box.max[axis] : box.min[axis]);
+                }
+                if (best + planes[i].w < 0.f) {
+                    return false;
+                }
+            }
+            return true;
+        }));
+
+        // Camera frustum: everything with its center well inside is
+        // found, nothing entirely behind the camera is
+        Camera cam(20.f * glm::vec3(unit(rng), unit(rng), unit(rng)),
+                   glm::vec3(0.f), glm::vec3(0.f, 1.f, 0.f), 70.f, 1.5f);
+        float far_dist = 30.f;
+        found.clear();
+        env.queryInstancesFrustum(cam, far_dist, found);
+
+        for (uint32_t idx = 0; idx < env.getNumInstances(); idx++) {
+            Box box = instanceBounds(env, idx);
+            glm::vec3 to_center = 0.5f * (box.min + box.max) - cam.position;
+            float depth = glm::dot(to_center, cam.view);
+            float x = glm::dot(to_center, cam.right) /
+                (depth * cam.tanFOV * cam.aspectRatio);
+            float y = glm::dot(to_center, cam.up) / (depth * cam.tanFOV);
+
+            bool inside = depth > 0.1f && depth < far_dist - 0.1f &&
+                fabsf(x) < 0.95f && fabsf(y) < 0.95f;
+
+            glm::vec3 far_corner = glm::mix(box.min, box.max,
+                glm::greaterThanEqual(cam.view, glm::vec3(0.f)));
+            bool behind =
+                glm::dot(far_corner - cam.position, cam.view) < 0.f;
+
+            bool was_found = find(found.begin(), found.end(),
+                env.getInstanceID(idx)) != found.end();
+            camera_match &= (!inside || was_found) && !(behind && was_found);
+        }
+
+        // Closest picks, distance ties may pick either instance
+        glm::vec3 origin = 30.f * glm::vec3(unit(rng), unit(rng), unit(rng));
+        glm::vec3 dir = randomDir(rng) * (rng() % 2 ? 1.f : 2.5f);
+        glm::vec3 inv_dir = 1.f / dir;
+        float max_t = rng() % 3 == 0 ? 10.f :
+            numeric_limits<float>::infinity();
+
+        float hit_t = -1.f;
+        uint32_t picked = env.pickInstance(origin, dir, max_t, &hit_t);
+
+        float brute_t = max_t;
+        bool brute_hit = false;
+        for (uint32_t idx = 0; idx < env.getNumInstances(); idx++) {
+            Box box = instanceBounds(env, idx);
+            float t;
+            if (AABBTree::intersectRay(box.min, box.max, origin, inv_dir,
+                                       max_t, t)) {
+                brute_t = min(brute_t, t);
+                brute_hit = true;
+            }
+        }
+
+        if (!brute_hit) {
+            pick_match &= picked == ~0u && hit_t == -1.f;
+        } else if (picked == ~0u || !env.isValidInstance(picked)) {
+            pick_match = false;
+        } else {
+            Box box = instanceBounds(env, env.getInstanceIndex(picked));
+            float t;
+            pick_match &= hit_t == brute_t &&
+                AABBTree::intersectRay(box.min, box.max, origin, inv_dir,
+                                       max_t, t) && t == brute_t;
+        }
+    }
+
+    passed &= check(overlap_match, "overlap queries match brute force");
+    passed &= check(radius_match, "radius queries match brute force");
+    passed &= check(planes_match, "plane queries match brute force");
+    passed &= check(camera_match, "camera frustum queries");
+    passed &= check(pick_match, "picks match brute force");
+
+    return passed;
+}
+
+int main()
+{
+    bool passed = true;
+
+    passed &= check(testTree(0.1f, 1), "tree with margin");
+    passed &= check(testTree(0.f, 2), "tree without margin");
+
+    Renderer renderer(testRenderConfig());
+    passed &= check(testEnvironment(renderer), "environment queries");
+
+    if (!passed) {
+        return EXIT_FAILURE;
+    }
+
+    cout << "All AABB tree checks passed" << endl;
+}
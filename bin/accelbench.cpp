@@ -0,0 +1,248 @@
+#include <rlpbr.hpp>
+#include <cpu/scene.hpp>
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include <glm/gtc/quaternion.hpp>
+
+using namespace std;
+using namespace RLpbr;
+using namespace RLpbr::cpu;
+
+// Every triangle of every instance matching mask. Rays are transformed
+// into object space like TLAS::traceRay does, so both see the same
+// triangle tests and only the BVHs are checked.
+static bool bruteForceTrace(const CPUScene &scene, const Environment &env,
+                            const glm::vec3 &origin, const glm::vec3 &dir,
+                            float max_t, uint32_t mask, RayHit &hit)
+{
+    const CowArray<ObjectInstance> &instances = env.getInstances();
+    const CowArray<InstanceTransform> &transforms = env.getTransforms();
+    const CowArray<InstanceFlags> &flags = env.getInstanceFlags();
+
+    bool found = false;
+    for (uint32_t inst_idx = 0; inst_idx < env.getNumInstances();
+         inst_idx++) {
+        if ((instanceMask(flags[inst_idx]) & mask) == 0) {
+            continue;
+        }
+
+        const ObjectAccel &obj =
+            scene.objectAccels[instances[inst_idx].objectIndex];
+        const glm::mat4x3 &w2o = transforms[inst_idx].inv;
+
+        glm::vec3 obj_origin = w2o * glm::vec4(origin, 1.f);
+        glm::vec3 obj_dir = w2o * glm::vec4(dir, 0.f);
+
+        for (const ObjectTriangle &tri : obj.triangles) {
+            float t;
+            glm::vec2 barys;
+            if (intersectTriangle(tri, obj_origin, obj_dir, max_t, t,
+                                  barys)) {
+                found = true;
+                max_t = t;
+                hit = RayHit {
+                    t,
+                    inst_idx,
+                    tri.geoIdx,
+                    tri.triIdx,
+                    barys,
+                };
+            }
+        }
+    }
+
+    return found;
+}
+
+// Random rays from inside the scene bounds, each traced with every mask
+// one at a time and in batches through Environment. Every other group of
+// rayPacketSize rays shares its origin.
+static uint32_t checkRays(const CPUScene &scene, Environment &env,
+                          const TLAS &tlas, mt19937 &rng, uint32_t num_rays)
+{
+    const AABB &bbox = scene.envInit.defaultBBox;
+    float diagonal = glm::length(bbox.pMax - bbox.pMin);
+    uniform_real_distribution<float> unit(0.f, 1.f);
+    normal_distribution<float> gauss;
+
+    vector<RayQuery> queries;
+    queries.reserve(3 * num_rays);
+    glm::vec3 origin;
+    for (uint32_t ray_idx = 0; ray_idx < num_rays; ray_idx++) {
+        if (ray_idx % (2 * rayPacketSize) < rayPacketSize ||
+            ray_idx % rayPacketSize == 0) {
+            origin = bbox.pMin + (bbox.pMax - bbox.pMin) *
+                glm::vec3(unit(rng), unit(rng), unit(rng));
+        }
+
+        glm::vec3 dir = glm::normalize(
+            glm::vec3(gauss(rng), gauss(rng), gauss(rng)));
+        // Some rays end inside the scene
+        float max_t = (ray_idx % 3 == 0) ? unit(rng) * diagonal : 1e16f;
+
+        for (uint32_t mask : { VisibilityMask::opaque,
+                               VisibilityMask::transparent,
+                               VisibilityMask::all }) {
+            queries.push_back({ origin, max_t, dir, mask });
+        }
+    }
+
+    vector<RayQueryHit> batch_hits(queries.size());
+    vector<uint8_t> batch_occluded(queries.size());
+    env.traceRays(queries.data(), queries.size(), batch_hits.data());
+    env.traceOcclusion(queries.data(), queries.size(),
+                       batch_occluded.data());
+
+    uint32_t num_mismatches = 0;
+    for (uint32_t i = 0; i < queries.size(); i++) {
+        const RayQuery &query = queries[i];
+
+        RayHit ref_hit {}, hit {};
+        bool ref_found = bruteForceTrace(scene, env, query.origin,
+            query.direction, query.maxT, query.visibilityMask, ref_hit);
+        bool found = tlas.traceRay<false>(scene.objectAccels.data(),
+            env.getInstances(), env.getTransforms(), query.origin,
+            query.direction, query.maxT, query.visibilityMask, &hit);
+        bool any_found = tlas.traceRay<true>(scene.objectAccels.data(),
+            env.getInstances(), env.getTransforms(), query.origin,
+            query.direction, query.maxT, query.visibilityMask, nullptr);
+
+        const RayQueryHit &batch_hit = batch_hits[i];
+        bool batch_found = batch_hit.instanceID != ~0u;
+
+        bool match = found == ref_found && any_found == ref_found &&
+            batch_found == ref_found && bool(batch_occluded[i]) == ref_found;
+        if (match && ref_found) {
+            match = hit.t == ref_hit.t && batch_hit.t == ref_hit.t &&
+                glm::dot(batch_hit.normal, query.direction) <= 0.f;
+        } else if (match) {
+            match = batch_hit.t == query.maxT;
+        }
+
+        if (!match) {
+            num_mismatches++;
+        }
+    }
+
+    return num_mismatches;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        cerr << argv[0] << " scene.bps [num_steps] [rays_per_step]" << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t num_steps = 100;
+    uint32_t rays_per_step = 100;
+    if (argc > 2) {
+        num_steps = stoul(argv[2]);
+    }
+    if (argc > 3) {
+        rays_per_step = stoul(argv[3]);
+    }
+
+    Renderer renderer({0, 1, 1, 64, 64, 1, 1, 0,
+        RenderMode::PathTracer, {}, 0.f, BackendSelect::CPU});
+
+    auto loader = renderer.makeLoader();
+    auto scene = loader.loadScene(argv[1]);
+    const CPUScene &cpu_scene = *static_cast<const CPUScene *>(scene.get());
+
+    Environment env = renderer.makeEnvironment(scene);
+    auto &env_backend = *static_cast<CPUEnvironment *>(env.getBackend());
+    const TLAS &tlas = env_backend.tlas;
+
+    uint64_t num_tris = 0;
+    for (const ObjectAccel &obj : cpu_scene.objectAccels) {
+        num_tris += obj.triangles.size();
+    }
+
+    cout << env.getNumInstances() << " instances, "
+         << cpu_scene.objectAccels.size() << " objects, " << num_tris
+         << " object triangles" << endl;
+
+    mt19937 rng(0);
+    uniform_real_distribution<float> unit(0.f, 1.f);
+
+    const AABB &bbox = scene->envInit.defaultBBox;
+    float step_size = 0.01f * glm::length(bbox.pMax - bbox.pMin);
+
+    uint32_t num_builds = 0, num_refits = 0;
+    double build_secs = 0.0, refit_secs = 0.0;
+    uint32_t num_mismatches = 0;
+
+    for (uint32_t step = 0; step <= num_steps; step++) {
+        uint32_t num_instances = env.getNumInstances();
+
+        // Step 0 is the initial build
+        if (step > 0 && num_instances > 0) {
+            // Instances drifting away from where the TLAS was built
+            uint32_t num_moved = max(num_instances / 10, 1u);
+            for (uint32_t i = 0; i < num_moved; i++) {
+                uint32_t inst_idx = rng() % num_instances;
+                uint32_t inst_id = env.getInstanceID(inst_idx);
+
+                env.moveInstance(inst_id, step_size * glm::vec3(
+                    unit(rng) - 0.5f, unit(rng) - 0.5f, unit(rng) - 0.5f));
+                env.rotateInstance(inst_id, glm::angleAxis(unit(rng),
+                    glm::vec3(0.f, 1.f, 0.f)));
+            }
+
+            // Occasionally replace an instance, which needs a rebuild
+            if (step % 16 == 0) {
+                uint32_t inst_idx = rng() % num_instances;
+                uint32_t obj_idx = env.getInstances()[inst_idx].objectIndex;
+                uint32_t mat_idx = env.getInstanceMaterials()[
+                    env.getInstances()[inst_idx].materialOffset];
+
+                env.deleteInstance(env.getInstanceID(inst_idx));
+                env.addInstance(obj_idx, &mat_idx, 1,
+                    bbox.pMin + (bbox.pMax - bbox.pMin) *
+                        glm::vec3(unit(rng), unit(rng), unit(rng)),
+                    glm::quat(1.f, 0.f, 0.f, 0.f));
+            }
+        }
+
+        uint32_t prev_refits = tlas.numRefits;
+
+        auto start = chrono::steady_clock::now();
+        env_backend.updateAccel(env);
+        auto end = chrono::steady_clock::now();
+        double secs = chrono::duration<double>(end - start).count();
+
+        if (tlas.numRefits > prev_refits) {
+            num_refits++;
+            refit_secs += secs;
+        } else {
+            num_builds++;
+            build_secs += secs;
+        }
+
+        num_mismatches += checkRays(cpu_scene, env, tlas, rng,
+                                    rays_per_step);
+    }
+
+    TLAS rebuilt;
+    rebuilt.build(cpu_scene.objectAccels.data(), env.getInstances(),
+                  env.getTransforms(), env.getInstanceFlags(),
+                  env.getNumInstances());
+
+    cout << num_builds << " builds (" << 1000.0 * build_secs /
+        max(num_builds, 1u) << "ms avg), " << num_refits << " refits ("
+         << 1000.0 * refit_secs / max(num_refits, 1u) << "ms avg)" << endl;
+    cout << "Final SAH cost " << tlas.bvh.sahCost() << ", rebuilt "
+         << rebuilt.bvh.sahCost() << endl;
+    cout << num_mismatches << " mismatches against brute force over "
+         << 3 * (num_steps + 1) * rays_per_step << " queries" << endl;
+
+    if (num_mismatches > 0) {
+        return EXIT_FAILURE;
+    }
+}
@@ -0,0 +1,225 @@
+#include <rlpbr.hpp>
+#include <cpu/scene.hpp>
+
+#include "test_scene.hpp"
+#include "test_util.hpp"
+
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+using namespace std;
+using namespace RLpbr;
+using namespace RLpbr::cpu;
+
+// Every triangle of every instance matching mask. Rays are transformed
+// into object space like TLAS::traceRay does, so both see the same
+// triangle tests and only the BVHs are checked.
+static bool bruteForceTrace(const CPUScene &scene, const Environment &env,
+                            const glm::vec3 &origin, const glm::vec3 &dir,
+                            float max_t, uint32_t mask, RayHit &hit)
+{
+    const CowArray<ObjectInstance> &instances = env.getInstances();
+    const CowArray<InstanceTransform> &transforms = env.getTransforms();
+    const CowArray<InstanceFlags> &flags = env.getInstanceFlags();
+
+    bool found = false;
+    for (uint32_t inst_idx = 0; inst_idx < env.getNumInstances();
+         inst_idx++) {
+        if ((instanceMask(flags[inst_idx]) & mask) == 0) {
+            continue;
+        }
+
+        const ObjectAccel &obj =
+            scene.objectAccels[instances[inst_idx].objectIndex];
+        const glm::mat4x3 &w2o = transforms[inst_idx].inv;
+
+        glm::vec3 obj_origin = w2o * glm::vec4(origin, 1.f);
+        glm::vec3 obj_dir = w2o * glm::vec4(dir, 0.f);
+
+        for (const ObjectTriangle &tri : obj.triangles) {
+            float t;
+            glm::vec2 barys;
+            if (intersectTriangle(tri, obj_origin, obj_dir, max_t, t,
+                                  barys)) {
+                found = true;
+                max_t = t;
+                hit = RayHit {
+                    t,
+                    inst_idx,
+                    tri.geoIdx,
+                    tri.triIdx,
+                    barys,
+                };
+            }
+        }
+    }
+
+    return found;
+}
+
+// Random rays from inside the scene bounds, each traced with every mask
+// through Environment::traceRays / traceOcclusion, so the TLAS is brought
+// up to date first. Every other group of rayPacketSize rays shares its
+// origin. Returns whether every query matched brute force.
+static bool checkRays(const CPUScene &scene, Environment &env,
+                      mt19937 &rng, uint32_t num_rays)
+{
+    const AABB &bbox = scene.envInit.defaultBBox;
+    float diagonal = glm::length(bbox.pMax - bbox.pMin);
+    uniform_real_distribution<float> unit(0.f, 1.f);
+    normal_distribution<float> gauss;
+
+    vector<RayQuery> queries;
+    queries.reserve(3 * num_rays);
+    glm::vec3 origin;
+    for (uint32_t ray_idx = 0; ray_idx < num_rays; ray_idx++) {
+        if (ray_idx % (2 * rayPacketSize) < rayPacketSize ||
+            ray_idx % rayPacketSize == 0) {
+            origin = bbox.pMin + (bbox.pMax - bbox.pMin) *
+                glm::vec3(unit(rng), unit(rng), unit(rng));
+        }
+
+        glm::vec3 dir = glm::normalize(
+            glm::vec3(gauss(rng), gauss(rng), gauss(rng)));
+        // Some rays end inside the scene
+        float max_t = (ray_idx % 3 == 0) ? unit(rng) * diagonal : 1e16f;
+
+        for (uint32_t mask : { VisibilityMask::opaque,
+                               VisibilityMask::transparent,
+                               VisibilityMask::all }) {
+            queries.push_back({ origin, max_t, dir, mask });
+        }
+    }
+
+    vector<RayQueryHit> hits(queries.size());
+    vector<uint8_t> occluded(queries.size());
+    env.traceRays(queries.data(), queries.size(), hits.data());
+    env.traceOcclusion(queries.data(), queries.size(), occluded.data());
+
+    bool matches = true;
+    for (uint32_t i = 0; i < queries.size(); i++) {
+        const RayQuery &query = queries[i];
+
+        RayHit ref_hit {};
+        bool ref_found = bruteForceTrace(scene, env, query.origin,
+            query.direction, query.maxT, query.visibilityMask, ref_hit);
+
+        const RayQueryHit &hit = hits[i];
+        bool found = hit.instanceID != ~0u;
+
+        bool match = found == ref_found && bool(occluded[i]) == ref_found;
+        if (match && ref_found) {
+            match = hit.t == ref_hit.t &&
+                hit.instanceID == env.getInstanceID(ref_hit.instIdx) &&
+                glm::dot(hit.normal, query.direction) <= 0.f;
+        } else if (match) {
+            match = hit.t == query.maxT;
+        }
+
+        matches &= match;
+    }
+
+    return matches;
+}
+
+int main()
+{
+    bool passed = true;
+
+    auto scene = makeTestScene({ 9, 4, 300, 8.f, 17, {}, false });
+    const CPUScene &cpu_scene = *static_cast<const CPUScene *>(scene.get());
+    Renderer renderer(testRenderConfig());
+
+    Environment env = renderer.makeEnvironment(scene);
+    auto &env_backend = *static_cast<CPUEnvironment *>(env.getBackend());
+    const TLAS &tlas = env_backend.tlas;
+
+    mt19937 rng(4);
+    uniform_real_distribution<float> unit(-1.f, 1.f);
+    constexpr uint32_t rays_per_step = 400;
+
+    auto tlasValid = [&]() {
+        return tlas.bvh.validate(env.getNumInstances(),
+                                 tlas.instanceBounds.data());
+    };
+
+    passed &= check(checkRays(cpu_scene, env, rng, rays_per_step) &&
+                    tlasValid() && tlas.numRefits == 0,
+                    "initial build matches brute force");
+
+    // Moves of a few instances keep refitting the tree built above
+    bool small_refit = true;
+    bool small_match = true;
+    for (uint32_t step = 1; step <= 4; step++) {
+        for (uint32_t i = 0; i < 10; i++) {
+            uint32_t inst_idx = rng() % env.getNumInstances();
+            env.moveInstance(env.getInstanceID(inst_idx),
+                1.5f * glm::vec3(unit(rng), unit(rng), unit(rng)));
+        }
+
+        small_match &= checkRays(cpu_scene, env, rng, rays_per_step) &&
+            tlasValid();
+        small_refit &= tlas.numRefits == step;
+    }
+    passed &= check(small_refit, "small moves refit the TLAS");
+    passed &= check(small_match, "refit TLAS matches brute force");
+
+    // Scattering every instance far from where the tree was built makes
+    // the refit tree too costly, so it's rebuilt
+    for (uint32_t inst_idx = 0; inst_idx < env.getNumInstances();
+         inst_idx++) {
+        env.moveInstance(env.getInstanceID(inst_idx),
+            40.f * glm::vec3(unit(rng), unit(rng), unit(rng)));
+    }
+    passed &= check(checkRays(cpu_scene, env, rng, rays_per_step) &&
+                    tlasValid() && tlas.numRefits == 0,
+                    "large moves rebuild the TLAS");
+
+    // Adds and removes are structural, the TLAS is rebuilt over the new
+    // instance count
+    bool structural_rebuild = true;
+    bool structural_match = true;
+    for (uint32_t step = 0; step < 6; step++) {
+        // Let a refit happen first, so a rebuild is observable
+        env.moveInstance(env.getInstanceID(0), glm::vec3(0.01f));
+        env_backend.updateAccel(env);
+        structural_rebuild &= tlas.numRefits == 1;
+
+        if (step % 2 == 0) {
+            for (uint32_t i = 0; i < 25; i++) {
+                uint32_t obj_idx = rng() % scene->objectInfo.size();
+                uint32_t mats[3] = { 0, 1, 2 };
+                env.addInstance(obj_idx, mats,
+                    scene->objectInfo[obj_idx].numMeshes,
+                    8.f * glm::vec3(unit(rng), unit(rng), unit(rng)),
+                    glm::quat(1.f, 0.f, 0.f, 0.f));
+            }
+        } else {
+            for (uint32_t i = 0; i < 40; i++) {
+                env.deleteInstance(
+                    env.getInstanceID(rng() % env.getNumInstances()));
+            }
+        }
+
+        structural_match &= checkRays(cpu_scene, env, rng, rays_per_step) &&
+            tlasValid();
+        structural_rebuild &= tlas.numRefits == 0 &&
+            tlas.instanceBounds.size() == env.getNumInstances();
+    }
+    passed &= check(structural_rebuild, "adds and removes rebuild the TLAS");
+    passed &= check(structural_match,
+                    "TLAS after adds and removes matches brute force");
+
+    // Back to the scene defaults
+    env.reset();
+    passed &= check(checkRays(cpu_scene, env, rng, rays_per_step) &&
+                    tlasValid(), "reset matches brute force");
+
+    if (!passed) {
+        return EXIT_FAILURE;
+    }
+
+    cout << "All accel checks passed" << endl;
+}
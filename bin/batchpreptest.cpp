@@ -0,0 +1,399 @@
+#include <rlpbr.hpp>
+#include <rlpbr_core/batch_prep.hpp>
+
+#include "test_scene.hpp"
+#include "test_util.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <vector>
+
+using namespace std;
+using namespace RLpbr;
+
+// One modification, applied the same way to every copy of an environment
+struct EnvOp {
+    enum class Type {
+        Move,
+        Rotate,
+        SetMaterial,
+        Add,
+        Delete,
+    };
+
+    Type type;
+    uint32_t instanceIdx;
+    uint32_t value;
+    glm::vec3 vec;
+};
+
+// A batch of environments with its own staging memory and caches, staged
+// like the Vulkan backend stages a render call: every slot gets a region,
+// inactive slots are skipped, active ones staged on the pool
+struct World {
+    vector<Environment> envs;
+    vector<EnvStagingCache> caches;
+    vector<CompactTransform> transforms;
+    vector<uint32_t> materials;
+    unique_ptr<BatchPrepPool> pool;
+    uint32_t minShardItems;
+};
+
+static constexpr uint32_t maxStagedInstances = 1 << 14;
+static constexpr uint32_t maxStagedMaterials = 1 << 15;
+
+static void applyOp(Environment &env, const EnvOp &op)
+{
+    uint32_t inst_id = env.getInstanceID(op.instanceIdx);
+
+    switch (op.type) {
+        case EnvOp::Type::Move: {
+            env.moveInstance(inst_id, op.vec);
+        } break;
+        case EnvOp::Type::Rotate: {
+            env.rotateInstance(inst_id, glm::angleAxis(op.vec.x,
+                glm::normalize(glm::vec3(op.vec.y, 1.f, op.vec.z))));
+        } break;
+        case EnvOp::Type::SetMaterial: {
+            const ObjectInstance &inst =
+                env.getInstances()[op.instanceIdx];
+            uint32_t num_meshes =
+                env.getScene()->objectInfo[inst.objectIndex].numMeshes;
+            uint32_t mats[3] = { op.value, op.value, op.value };
+            env.setInstanceMaterials(&inst_id, mats, num_meshes, 1);
+        } break;
+        case EnvOp::Type::Add: {
+            uint32_t obj_idx = op.value % 4;
+            uint32_t mats[3] = { op.value, op.value, op.value };
+            env.addInstance(obj_idx, mats,
+                env.getScene()->objectInfo[obj_idx].numMeshes, op.vec,
+                glm::quat(1.f, 0.f, 0.f, 0.f));
+        } break;
+        case EnvOp::Type::Delete: {
+            env.deleteInstance(inst_id);
+        } break;
+    }
+}
+
+static void stageWorld(World &world, const vector<uint32_t> &active)
+{
+    uint32_t batch_size = world.envs.size();
+
+    vector<uint32_t> inst_offsets(batch_size);
+    vector<uint32_t> material_offsets(batch_size);
+
+    uint32_t inst_offset = 0;
+    uint32_t material_offset = 0;
+    uint32_t next_active = 0;
+    for (uint32_t batch_idx = 0; batch_idx < batch_size; batch_idx++) {
+        const Environment &env = world.envs[batch_idx];
+        inst_offsets[batch_idx] = inst_offset;
+        material_offsets[batch_idx] = material_offset;
+
+        inst_offset += env.getNumInstances();
+        material_offset += env.getInstanceMaterials().size();
+
+        if (next_active < active.size() &&
+            active[next_active] == batch_idx) {
+            next_active++;
+        } else {
+            skipEnvironment(env, world.caches[batch_idx],
+                            inst_offsets[batch_idx],
+                            material_offsets[batch_idx]);
+        }
+    }
+
+    auto stageRange = [&](uint32_t begin, uint32_t end) {
+        for (uint32_t i = begin; i < end; i++) {
+            uint32_t batch_idx = active[i];
+            stageEnvironment(world.envs[batch_idx], world.caches[batch_idx],
+                             world.transforms.data(), world.materials.data(),
+                             inst_offsets[batch_idx],
+                             material_offsets[batch_idx]);
+        }
+    };
+
+    if (world.pool) {
+        world.pool->run(active.size(), stageRange, world.minShardItems);
+    } else {
+        stageRange(0, active.size());
+    }
+}
+
+// Active slots hold exactly what a from scratch staging would write
+static bool checkActive(const World &world, const vector<uint32_t> &active)
+{
+    uint32_t inst_offset = 0;
+    uint32_t material_offset = 0;
+    uint32_t next_active = 0;
+
+    for (uint32_t batch_idx = 0; batch_idx < world.envs.size();
+         batch_idx++) {
+        const Environment &env = world.envs[batch_idx];
+        uint32_t num_instances = env.getNumInstances();
+        uint32_t num_materials = env.getInstanceMaterials().size();
+
+        if (next_active < active.size() &&
+            active[next_active] == batch_idx) {
+            next_active++;
+
+            vector<CompactTransform> transforms(num_instances);
+            stageTransforms(env.getTransforms(), transforms.data(), 0,
+                            num_instances);
+            vector<uint32_t> materials(num_materials);
+            env.getInstanceMaterials().copyTo(materials.data());
+
+            if (memcmp(transforms.data(), &world.transforms[inst_offset],
+                       num_instances * sizeof(CompactTransform)) != 0 ||
+                memcmp(materials.data(), &world.materials[material_offset],
+                       num_materials * sizeof(uint32_t)) != 0) {
+                return false;
+            }
+        }
+
+        inst_offset += num_instances;
+        material_offset += num_materials;
+    }
+
+    return true;
+}
+
+static bool sameBytes(const World &a, const World &b)
+{
+    return memcmp(a.transforms.data(), b.transforms.data(),
+                  a.transforms.size() * sizeof(CompactTransform)) == 0 &&
+        a.materials == b.materials;
+}
+
+// Sparse batches over several frames, staged one environment at a time:
+// skipping leaves the dirty flag alone, staging clears it and writes
+// exactly what a from scratch staging would, and activeRanges covers the
+// active slots exactly
+static bool checkSparseStaging(Renderer &renderer,
+                               const shared_ptr<Scene> &scene,
+                               mt19937 &rng)
+{
+    constexpr uint32_t num_slots = 64;
+    constexpr uint32_t num_frames = 32;
+
+    vector<Environment> envs;
+    envs.reserve(num_slots);
+    for (uint32_t slot = 0; slot < num_slots; slot++) {
+        envs.emplace_back(renderer.makeEnvironment(scene));
+    }
+
+    vector<EnvStagingCache> caches(num_slots, EnvStagingCache {});
+    vector<uint32_t> inst_offsets(num_slots);
+    vector<uint32_t> material_offsets(num_slots);
+    vector<CompactTransform> staged_transforms;
+    vector<uint32_t> staged_materials;
+    vector<CompactTransform> expected_transforms;
+    vector<uint32_t> expected_materials;
+    vector<BatchRange> ranges;
+
+    uniform_real_distribution<float> pos_dist(-10.f, 10.f);
+
+    bool passed = true;
+    for (uint32_t frame = 0; frame < num_frames; frame++) {
+        vector<uint32_t> active;
+        for (uint32_t slot = 0; slot < num_slots; slot++) {
+            Environment &env = envs[slot];
+
+            // Structural changes move the regions of later slots. Object 0
+            // has a single mesh.
+            uint32_t change = rng() % 8;
+            if (change == 0) {
+                uint32_t mat_idx = 0;
+                env.addInstance(0, &mat_idx, 1, glm::vec3(pos_dist(rng)),
+                                glm::quat(1.f, 0.f, 0.f, 0.f));
+            } else if (change == 1 && env.getNumInstances() > 1) {
+                env.deleteInstance(env.getInstanceID(0));
+            } else if (change < 5) {
+                uint32_t idx = rng() % env.getNumInstances();
+                env.setInstanceTransform(env.getInstanceID(idx),
+                                         glm::vec3(pos_dist(rng)),
+                                         glm::quat(1.f, 0.f, 0.f, 0.f));
+            }
+
+            if (frame == 0 || rng() % 3 == 0) {
+                active.push_back(slot);
+            }
+        }
+
+        uint32_t inst_offset = 0;
+        uint32_t material_offset = 0;
+        for (uint32_t slot = 0; slot < num_slots; slot++) {
+            inst_offsets[slot] = inst_offset;
+            material_offsets[slot] = material_offset;
+            inst_offset += envs[slot].getNumInstances();
+            material_offset += envs[slot].getInstanceMaterials().size();
+        }
+        staged_transforms.resize(inst_offset);
+        staged_materials.resize(material_offset);
+
+        uint32_t next_active = 0;
+        for (uint32_t slot = 0; slot < num_slots; slot++) {
+            const Environment &env = envs[slot];
+            if (next_active < active.size() && active[next_active] == slot) {
+                next_active++;
+                stageEnvironment(env, caches[slot], staged_transforms.data(),
+                                 staged_materials.data(), inst_offsets[slot],
+                                 material_offsets[slot]);
+            } else {
+                bool dirty = env.isDirty();
+                skipEnvironment(env, caches[slot], inst_offsets[slot],
+                                material_offsets[slot]);
+                passed &= env.isDirty() == dirty;
+            }
+        }
+
+        for (uint32_t slot : active) {
+            const Environment &env = envs[slot];
+            uint32_t num_instances = env.getNumInstances();
+            uint32_t num_materials = env.getInstanceMaterials().size();
+
+            expected_transforms.resize(num_instances);
+            stageTransforms(env.getTransforms(), expected_transforms.data(),
+                            0, num_instances);
+            expected_materials.resize(num_materials);
+            env.getInstanceMaterials().copyTo(expected_materials.data());
+
+            passed &= !env.isDirty() &&
+                memcmp(&staged_transforms[inst_offsets[slot]],
+                       expected_transforms.data(),
+                       sizeof(CompactTransform) * num_instances) == 0 &&
+                memcmp(&staged_materials[material_offsets[slot]],
+                       expected_materials.data(),
+                       sizeof(uint32_t) * num_materials) == 0;
+        }
+
+        activeRanges(active.data(), active.size(), ranges);
+        uint32_t num_covered = 0;
+        for (const BatchRange &range : ranges) {
+            for (uint32_t slot = range.begin; slot < range.end; slot++) {
+                passed &= num_covered < active.size() &&
+                    active[num_covered] == slot;
+                num_covered++;
+            }
+        }
+        passed &= num_covered == active.size();
+    }
+
+    return passed;
+}
+
+int main()
+{
+    bool passed = true;
+
+    auto scene = makeTestScene({ 6, 5, 60, 5.f, 11, {}, false });
+    Renderer renderer(testRenderConfig());
+
+    const uint32_t batch_size = 48;
+
+    auto makeWorld = [&](uint32_t num_threads, uint32_t min_shard_items) {
+        World world;
+        for (uint32_t i = 0; i < batch_size; i++) {
+            world.envs.emplace_back(renderer.makeEnvironment(scene));
+        }
+        world.caches.resize(batch_size, EnvStagingCache {});
+
+        // Garbage, so a region that should have been written but wasn't
+        // shows up
+        world.transforms.resize(maxStagedInstances);
+        memset(world.transforms.data(), 0xAB,
+               maxStagedInstances * sizeof(CompactTransform));
+        world.materials.resize(maxStagedMaterials, 0xABABABAB);
+
+        if (num_threads > 0) {
+            world.pool = make_unique<BatchPrepPool>(num_threads);
+        }
+        world.minShardItems = min_shard_items;
+
+        return world;
+    };
+
+    // Serial staging is the reference, the pools shard down to single
+    // environments and at the default granularity
+    vector<World> worlds;
+    worlds.push_back(makeWorld(0, 1));
+    worlds.push_back(makeWorld(2, 1));
+    worlds.push_back(makeWorld(5, 1));
+    worlds.push_back(makeWorld(8, 1));
+    worlds.push_back(makeWorld(4, BatchPrepPool::defaultShardItems));
+
+    passed &= check(worlds[3].pool->numThreads() == 8, "pool thread count");
+
+    mt19937 rng(99);
+    uniform_real_distribution<float> unit(-1.f, 1.f);
+
+    bool active_match = true;
+    bool worlds_match = true;
+
+    for (uint32_t frame = 0; frame < 150; frame++) {
+        // Modify some environments, identically in every world
+        for (uint32_t batch_idx = 0; batch_idx < batch_size; batch_idx++) {
+            uint32_t num_ops = rng() % 4 == 0 ? rng() % 6 : 0;
+            for (uint32_t op_idx = 0; op_idx < num_ops; op_idx++) {
+                const Environment &env = worlds[0].envs[batch_idx];
+                uint32_t num_instances = env.getNumInstances();
+
+                EnvOp op;
+                uint32_t type = rng() % 10;
+                if (num_instances < 5 || type == 0) {
+                    op.type = EnvOp::Type::Add;
+                } else if (type == 1) {
+                    op.type = EnvOp::Type::Delete;
+                } else if (type < 5) {
+                    op.type = EnvOp::Type::Move;
+                } else if (type < 8) {
+                    op.type = EnvOp::Type::Rotate;
+                } else {
+                    op.type = EnvOp::Type::SetMaterial;
+                }
+
+                op.instanceIdx = num_instances > 0 ?
+                    rng() % num_instances : 0;
+                op.value = rng() % 5;
+                op.vec = glm::vec3(unit(rng), unit(rng), unit(rng));
+
+                for (World &world : worlds) {
+                    applyOp(world.envs[batch_idx], op);
+                }
+            }
+        }
+
+        // Mostly full batches, sometimes sparse ones
+        vector<uint32_t> active;
+        uint32_t skip_chance = frame % 3 == 0 ? 3 : 0;
+        for (uint32_t batch_idx = 0; batch_idx < batch_size; batch_idx++) {
+            if (skip_chance == 0 || rng() % skip_chance != 0) {
+                active.push_back(batch_idx);
+            }
+        }
+
+        for (World &world : worlds) {
+            stageWorld(world, active);
+            active_match &= checkActive(world, active);
+        }
+
+        for (uint32_t world_idx = 1; world_idx < worlds.size();
+             world_idx++) {
+            worlds_match &= sameBytes(worlds[0], worlds[world_idx]);
+        }
+    }
+
+    passed &= check(active_match, "active slots match full staging");
+    passed &= check(worlds_match, "parallel staging matches serial bytes");
+    passed &= check(checkSparseStaging(renderer, scene, rng),
+                    "sparse batches staged one environment at a time");
+
+    if (!passed) {
+        return EXIT_FAILURE;
+    }
+
+    cout << "All batch prep checks passed" << endl;
+}
@@ -0,0 +1,139 @@
+#include <rlpbr_core/batch_prep.hpp>
+#include <rlpbr_core/bvh.hpp>
+#include <rlpbr_core/scene.hpp>
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+using namespace std;
+using namespace RLpbr;
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        cerr << argv[0] << " scene.bps [num_threads]" << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t num_threads = 0;
+    if (argc > 2) {
+        num_threads = stoul(argv[2]);
+    }
+
+    SceneLoadData load_data = SceneLoadData::loadFromDisk(argv[1], true);
+    const StagingHeader &hdr = load_data.hdr;
+
+    vector<char> data(hdr.totalBytes);
+    load_data.readData(data.data());
+
+    auto vertices = (const PackedVertex *)data.data();
+    auto indices = (const uint32_t *)(data.data() + hdr.indexOffset);
+
+    vector<vector<AABB>> mesh_tri_bounds;
+    mesh_tri_bounds.reserve(load_data.meshInfo.size());
+    uint64_t num_tris = 0;
+    for (const MeshInfo &mesh : load_data.meshInfo) {
+        vector<AABB> &tri_bounds = mesh_tri_bounds.emplace_back();
+        tri_bounds.reserve(mesh.numTriangles);
+
+        for (uint32_t tri_idx = 0; tri_idx < mesh.numTriangles; tri_idx++) {
+            const uint32_t *tri_indices =
+                indices + mesh.indexOffset + 3 * tri_idx;
+
+            glm::vec3 a = vertices[tri_indices[0]].position;
+            glm::vec3 b = vertices[tri_indices[1]].position;
+            glm::vec3 c = vertices[tri_indices[2]].position;
+
+            tri_bounds.push_back({
+                glm::min(a, glm::min(b, c)),
+                glm::max(a, glm::max(b, c)),
+            });
+        }
+
+        num_tris += mesh.numTriangles;
+    }
+
+    cout << load_data.meshInfo.size() << " meshes, " << num_tris
+         << " triangles" << endl;
+
+    uint32_t num_failures = 0;
+
+    // SAH cost summed over meshes, weighted by triangle count
+    auto weightedCost = [&](const vector<BVH> &bvhs) {
+        double cost = 0.0;
+        for (uint32_t i = 0; i < bvhs.size(); i++) {
+            cost += double(bvhs[i].sahCost()) * mesh_tri_bounds[i].size();
+        }
+
+        return num_tris > 0 ? cost / num_tris : 0.0;
+    };
+
+    vector<BVH> stored = load_data.readMeshBVHs();
+    if (stored.empty()) {
+        cout << "No stored BVHs (scene predates them)" << endl;
+    } else {
+        for (uint32_t i = 0; i < stored.size(); i++) {
+            if (!stored[i].validate(mesh_tri_bounds[i].size(),
+                                    mesh_tri_bounds[i].data())) {
+                cerr << "Stored BVH of mesh " << i << " is invalid" << endl;
+                num_failures++;
+            }
+        }
+
+        cout << "Stored: width " << stored[0].width << ", SAH cost "
+             << weightedCost(stored) << endl;
+    }
+
+    BatchPrepPool pool(num_threads);
+
+    auto buildAll = [&](const BVHBuildConfig &cfg, BatchPrepPool *build_pool,
+                        double &secs) {
+        vector<BVH> bvhs;
+        bvhs.reserve(mesh_tri_bounds.size());
+
+        auto start = chrono::steady_clock::now();
+        for (const vector<AABB> &tri_bounds : mesh_tri_bounds) {
+            bvhs.push_back(BVH::build(tri_bounds.data(), tri_bounds.size(),
+                                      cfg, build_pool));
+        }
+        auto end = chrono::steady_clock::now();
+
+        secs = chrono::duration<double>(end - start).count();
+
+        return bvhs;
+    };
+
+    for (uint32_t width : { 2u, 4u, 8u }) {
+        BVHBuildConfig cfg = BVH::defaultConfig();
+        cfg.width = width;
+
+        double serial_secs, parallel_secs;
+        vector<BVH> serial = buildAll(cfg, nullptr, serial_secs);
+        vector<BVH> parallel = buildAll(cfg, &pool, parallel_secs);
+
+        for (uint32_t i = 0; i < parallel.size(); i++) {
+            const vector<AABB> &tri_bounds = mesh_tri_bounds[i];
+            if (!serial[i].validate(tri_bounds.size(), tri_bounds.data()) ||
+                !parallel[i].validate(tri_bounds.size(),
+                                      tri_bounds.data())) {
+                cerr << "Width " << width << " BVH of mesh " << i
+                     << " is invalid" << endl;
+                num_failures++;
+            }
+        }
+
+        cout << "Width " << width << ": SAH cost "
+             << weightedCost(serial) << " serial / "
+             << weightedCost(parallel) << " parallel, built in "
+             << serial_secs << "s serial (" << num_tris / serial_secs
+             << " tris/s), " << parallel_secs << "s on "
+             << pool.numThreads() << " threads ("
+             << num_tris / parallel_secs << " tris/s)" << endl;
+    }
+
+    if (num_failures > 0) {
+        return EXIT_FAILURE;
+    }
+}
@@ -0,0 +1,170 @@
+#include <rlpbr_core/bvh.hpp>
+
+#include "test_util.hpp"
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <vector>
+
+using namespace std;
+using namespace RLpbr;
+
+static vector<AABB> randomBounds(mt19937 &rng, uint32_t num_prims)
+{
+    uniform_real_distribution<float> pos(-10.f, 10.f);
+    uniform_real_distribution<float> size(0.f, 1.f);
+
+    vector<AABB> bounds;
+    bounds.reserve(num_prims);
+    for (uint32_t i = 0; i < num_prims; i++) {
+        glm::vec3 min(pos(rng), pos(rng), pos(rng));
+        bounds.push_back({
+            min,
+            min + glm::vec3(size(rng), size(rng), size(rng)),
+        });
+    }
+
+    return bounds;
+}
+
+static string serialize(const BVH &bvh)
+{
+    ostringstream out;
+    writeBVH(out, bvh);
+
+    return out.str();
+}
+
+// What readMeshBVHs accepts
+static bool loads(const string &data, uint32_t num_prims)
+{
+    istringstream in(data);
+    BVH bvh = readBVH(in);
+
+    return in && bvh.validate(num_prims);
+}
+
+int main()
+{
+    bool passed = true;
+
+    mt19937 rng(3);
+    vector<AABB> bounds = randomBounds(rng, 500);
+
+    bool builds_valid = true;
+    bool round_trips = true;
+    for (uint32_t width : { 2u, 4u, 8u }) {
+        BVHBuildConfig cfg = BVH::defaultConfig();
+        cfg.width = width;
+
+        BVH bvh = BVH::build(bounds.data(), bounds.size(), cfg);
+        builds_valid &= bvh.validate(bounds.size(), bounds.data());
+
+        string data = serialize(bvh);
+        istringstream in(data);
+        BVH read = readBVH(in);
+        round_trips &= in && read.validate(bounds.size(), bounds.data()) &&
+            serialize(read) == data;
+    }
+    passed &= check(builds_valid, "built BVHs are valid");
+    passed &= check(round_trips, "writeBVH / readBVH round trip");
+
+    BVH bvh = BVH::build(bounds.data(), bounds.size());
+    passed &= check(!bvh.validate(bounds.size() + 1) &&
+                    !bvh.validate(bounds.size() - 1),
+                    "primitive count mismatch rejected");
+
+    // Header is width, node count, primitive count
+    string data = serialize(bvh);
+    constexpr size_t children_offset = 3 * sizeof(uint32_t);
+    size_t prims_offset =
+        children_offset + bvh.children.size() * sizeof(BVHChild);
+
+    auto setWord = [](string &str, size_t offset, uint32_t value) {
+        memcpy(&str[offset], &value, sizeof(uint32_t));
+    };
+
+    bool widths_rejected = true;
+    for (uint32_t width : { 0u, 1u, 9u, 64u, ~0u }) {
+        string bad = data;
+        setWord(bad, 0, width);
+        widths_rejected &= !loads(bad, bounds.size());
+    }
+    passed &= check(widths_rejected, "bad widths rejected");
+
+    {
+        string bad = data;
+        setWord(bad, sizeof(uint32_t), ~0u);
+        passed &= check(!loads(bad, bounds.size()),
+                        "node count past the end of the data rejected");
+    }
+
+    bool truncation_rejected = true;
+    for (size_t num_bytes = 0; num_bytes < data.size(); num_bytes += 7) {
+        truncation_rejected &= !loads(data.substr(0, num_bytes),
+                                      bounds.size());
+    }
+    passed &= check(truncation_rejected, "truncated BVHs rejected");
+
+    // Child offsets of every interior and leaf slot, and every primitive
+    // index
+    bool child_offsets_rejected = true;
+    for (uint32_t slot = 0; slot < bvh.children.size(); slot++) {
+        const BVHChild &child = bvh.children[slot];
+        if (child.isEmpty()) {
+            continue;
+        }
+
+        size_t slot_offset = children_offset + slot * sizeof(BVHChild);
+        size_t offset = slot_offset + offsetof(BVHChild, offset);
+
+        uint32_t past_end = child.isLeaf() ?
+            uint32_t(bvh.primIndices.size()) : bvh.numNodes();
+
+        for (uint32_t value : { past_end, ~0u }) {
+            string bad = data;
+            setWord(bad, offset, value);
+            child_offsets_rejected &= !loads(bad, bounds.size());
+        }
+
+        // Pointing back at the root, or a leaf running past primIndices
+        string bad = data;
+        if (child.isLeaf()) {
+            setWord(bad, slot_offset + offsetof(BVHChild, numPrims),
+                    past_end + 1);
+        } else {
+            setWord(bad, offset, 0);
+        }
+        child_offsets_rejected &= !loads(bad, bounds.size());
+    }
+    passed &= check(child_offsets_rejected, "bad child offsets rejected");
+
+    bool prim_indices_rejected = true;
+    for (uint32_t i = 0; i < bvh.primIndices.size(); i++) {
+        for (uint32_t value : { uint32_t(bounds.size()), ~0u,
+                                bvh.primIndices[(i + 1) %
+                                    bvh.primIndices.size()] }) {
+            string bad = data;
+            setWord(bad, prims_offset + i * sizeof(uint32_t), value);
+            prim_indices_rejected &= !loads(bad, bounds.size());
+        }
+    }
+    passed &= check(prim_indices_rejected, "bad primitive indices rejected");
+
+    {
+        BVH empty;
+        empty.width = 4;
+        passed &= check(empty.validate(0) && !empty.validate(1),
+                        "empty BVH");
+    }
+
+    if (!passed) {
+        return EXIT_FAILURE;
+    }
+
+    cout << "All BVH checks passed" << endl;
+}
@@ -0,0 +1,154 @@
+#include <rlpbr.hpp>
+#include <rlpbr_core/scene.hpp>
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include <glm/gtc/quaternion.hpp>
+#include <glm/gtx/transform.hpp>
+
+using namespace std;
+using namespace RLpbr;
+
+template <typename Fn>
+static double timeIters(uint32_t num_iters, Fn &&fn)
+{
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < (int)num_iters; i++) {
+        fn();
+    }
+    auto end = chrono::steady_clock::now();
+
+    return chrono::duration<double>(end - start).count();
+}
+
+static bool camerasMatch(const Camera &a, const Camera &b)
+{
+    auto close = [](const glm::vec3 &x, const glm::vec3 &y) {
+        return glm::all(glm::lessThan(glm::abs(x - y), glm::vec3(1e-4f)));
+    };
+
+    return close(a.position, b.position) && close(a.view, b.view) &&
+        close(a.up, b.up) && close(a.right, b.right);
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t num_envs = 1024;
+    uint32_t num_iters = 1000;
+    if (argc > 1) {
+        num_envs = stoul(argv[1]);
+    }
+    if (argc > 2) {
+        num_iters = stoul(argv[2]);
+    }
+
+    // Environments without a render backend, only the host side camera
+    // update is measured
+    auto scene = make_shared<Scene>(Scene {
+        {},
+        {},
+        EnvironmentInit(AABB { glm::vec3(-1.f), glm::vec3(1.f) },
+                        {}, {}, {}, {}, {}),
+        1,
+    });
+
+    Camera cam(glm::vec3(0.f), glm::vec3(0.f, 0.f, 1.f),
+               glm::vec3(0.f, 1.f, 0.f), 90.f, 1.f);
+
+    RenderBatch batch(RenderBatch::Handle(nullptr, BatchDeleter {}),
+                      num_envs);
+    RenderBatch loop_batch(RenderBatch::Handle(nullptr, BatchDeleter {}),
+                           num_envs);
+    for (int i = 0; i < (int)num_envs; i++) {
+        batch.initEnvironment(i, Environment(
+            EnvironmentImpl(nullptr, nullptr, nullptr, nullptr,
+                            nullptr, nullptr, nullptr, nullptr),
+            scene, cam));
+        loop_batch.initEnvironment(i, Environment(
+            EnvironmentImpl(nullptr, nullptr, nullptr, nullptr,
+                            nullptr, nullptr, nullptr, nullptr),
+            scene, cam));
+    }
+
+    mt19937 rand_gen(0);
+    uniform_real_distribution<float> rand_dist(-1.f, 1.f);
+
+    vector<glm::vec3> positions(num_envs);
+    vector<glm::quat> rotations(num_envs);
+    vector<glm::mat4> matrices(num_envs);
+    for (int i = 0; i < (int)num_envs; i++) {
+        positions[i] = glm::vec3(rand_dist(rand_gen), rand_dist(rand_gen),
+                                 rand_dist(rand_gen));
+        rotations[i] = glm::normalize(glm::quat(
+            rand_dist(rand_gen), rand_dist(rand_gen),
+            rand_dist(rand_gen), rand_dist(rand_gen)));
+        matrices[i] = glm::translate(positions[i]) *
+            glm::mat4_cast(rotations[i]);
+    }
+
+    // What a trainer had to do before: convert and set each camera
+    double loop_quat_secs = timeIters(num_iters, [&]() {
+        for (int i = 0; i < (int)num_envs; i++) {
+            loop_batch.getEnvironment(i).setCameraView(
+                glm::translate(positions[i]) * glm::mat4_cast(rotations[i]));
+        }
+    });
+
+    double batch_quat_secs = timeIters(num_iters, [&]() {
+        batch.setCameraViews(positions.data(), rotations.data(), num_envs);
+    });
+
+    uint32_t num_mismatched = 0;
+    for (int i = 0; i < (int)num_envs; i++) {
+        if (!camerasMatch(batch.getEnvironment(i).getCamera(),
+                          loop_batch.getEnvironment(i).getCamera())) {
+            num_mismatched++;
+        }
+    }
+
+    double loop_mat_secs = timeIters(num_iters, [&]() {
+        for (int i = 0; i < (int)num_envs; i++) {
+            loop_batch.getEnvironment(i).setCameraView(matrices[i]);
+        }
+    });
+
+    double batch_mat_secs = timeIters(num_iters, [&]() {
+        batch.setCameraViews(matrices.data(), num_envs);
+    });
+
+    for (int i = 0; i < (int)num_envs; i++) {
+        if (!camerasMatch(batch.getEnvironment(i).getCamera(),
+                          loop_batch.getEnvironment(i).getCamera())) {
+            num_mismatched++;
+        }
+    }
+
+    double ns = 1e9 / (double(num_iters) * num_envs);
+
+    cout << num_envs << " environments, " << num_iters << " iterations"
+         << endl;
+    cout << "Position + rotation: loop " << loop_quat_secs * ns
+         << " ns / env, batched " << batch_quat_secs * ns << " ns / env"
+         << endl;
+    cout << "Matrix: loop " << loop_mat_secs * ns
+         << " ns / env, batched " << batch_mat_secs * ns << " ns / env"
+         << endl;
+
+    // Degenerate poses are skipped
+    rotations[0] = glm::quat(0.f, 0.f, 0.f, 0.f);
+    positions[num_envs - 1].x = numeric_limits<float>::quiet_NaN();
+    uint32_t num_rejected =
+        batch.setCameraViews(positions.data(), rotations.data(), num_envs);
+    uint32_t expected_rejected = num_envs > 1 ? 2 : 1;
+
+    if (num_mismatched > 0 || num_rejected != expected_rejected) {
+        cerr << num_mismatched << " cameras differ from the per environment "
+             << "loop, " << num_rejected << " poses rejected" << endl;
+        return EXIT_FAILURE;
+    }
+}
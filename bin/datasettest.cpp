@@ -0,0 +1,381 @@
+#include <rlpbr_core/batch_prep.hpp>
+#include <rlpbr_core/dataset.hpp>
+
+#include "test_util.hpp"
+
+#include <glm/gtc/packing.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <vector>
+
+using namespace std;
+using namespace RLpbr;
+
+namespace fs = std::filesystem;
+
+struct Sample {
+    SampleMetadata metadata;
+    vector<uint8_t> color;
+    vector<uint8_t> mask;
+};
+
+// Smooth half color with some noise and a random 8 bit mask, identified by
+// randomKey.envIdx
+static Sample makeSample(const DatasetSchema &schema, uint32_t id)
+{
+    mt19937 rng(id);
+    uniform_real_distribution<float> unit(0.f, 1.f);
+
+    const DatasetTensor &color = schema.tensors[0];
+    const DatasetTensor &mask = schema.tensors[1];
+
+    Sample sample;
+    sample.metadata = {
+        "scene_" + to_string(id % 3) + ".bps",
+        glm::vec3(unit(rng), unit(rng), unit(rng)),
+        glm::vec3(0.f, 0.f, 1.f),
+        glm::vec3(0.f, 1.f, 0.f),
+        glm::vec3(-1.f, 0.f, 0.f),
+        1u << (id % 4),
+        { 1234, id, id / 7 },
+    };
+
+    float phase = unit(rng) * 10.f;
+    sample.color.resize(tensorBytes(color));
+    for (uint32_t i = 0; i < sample.color.size() / 2; i++) {
+        uint32_t pixel = i / color.numChannels;
+        float v = sinf(phase + float(pixel % color.width) * 0.1f) +
+            float(pixel / color.width) * 0.05f + unit(rng) * 0.01f;
+        uint16_t h = glm::packHalf1x16(v);
+        memcpy(&sample.color[i * 2], &h, sizeof(uint16_t));
+    }
+
+    sample.mask.resize(tensorBytes(mask));
+    for (uint8_t &v : sample.mask) {
+        v = uint8_t(rng());
+    }
+
+    return sample;
+}
+
+static uint64_t append(DatasetWriter &writer, const Sample &sample)
+{
+    const void *tensors[] = { sample.color.data(), sample.mask.data() };
+    return writer.append(sample.metadata, tensors);
+}
+
+// Every sample of the reader against makeSample for its envIdx
+static bool checkContents(const DatasetReader &reader,
+                          const DatasetSchema &schema,
+                          uint64_t num_expected, mt19937 &rng)
+{
+    if (reader.numSamples() != num_expected) {
+        cerr << reader.numSamples() << " samples, expected " <<
+            num_expected << endl;
+        return false;
+    }
+
+    vector<uint64_t> order(num_expected);
+    for (uint64_t i = 0; i < num_expected; i++) {
+        order[i] = i;
+    }
+    shuffle(order.begin(), order.end(), rng);
+
+    vector<bool> seen(num_expected, false);
+    bool matches = true;
+    for (uint64_t idx : order) {
+        SampleMetadata metadata = reader.getMetadata(idx);
+        uint32_t id = metadata.randomKey.envIdx;
+        if (id >= num_expected || seen[id]) {
+            return false;
+        }
+        seen[id] = true;
+
+        Sample expected = makeSample(schema, id);
+        const SampleMetadata &ref = expected.metadata;
+
+        matches &= metadata.scene == ref.scene &&
+            metadata.position == ref.position &&
+            metadata.view == ref.view && metadata.up == ref.up &&
+            metadata.right == ref.right && metadata.spp == ref.spp &&
+            metadata.randomKey.seed == ref.randomKey.seed &&
+            metadata.randomKey.episode == ref.randomKey.episode;
+
+        vector<uint8_t> color(expected.color.size());
+        vector<uint8_t> mask(expected.mask.size());
+        matches &= reader.read(idx, 0, color.data());
+        matches &= reader.read(idx, 1, mask.data());
+        matches &= color == expected.color && mask == expected.mask;
+    }
+
+    return matches;
+}
+
+// Random lengths and alignments, so both the 8 byte words and the byte
+// tail are covered
+static bool checkCRC(mt19937 &rng)
+{
+    vector<uint8_t> data(4096 + 16);
+    for (uint8_t &v : data) {
+        v = uint8_t(rng());
+    }
+
+    bool matches = true;
+    for (uint32_t i = 0; i < 200; i++) {
+        uint32_t start = rng() % 16;
+        uint32_t num_bytes = rng() % 4097;
+        matches &= crc32c(data.data() + start, num_bytes) ==
+            crc32c(data.data() + start, num_bytes, false);
+    }
+
+    return matches;
+}
+
+static fs::path lastShard(const fs::path &dir)
+{
+    fs::path last_shard;
+    for (const auto &entry : fs::directory_iterator(dir)) {
+        if (entry.path().filename().string().rfind("shard_", 0) == 0 &&
+            entry.path() > last_shard) {
+            last_shard = entry.path();
+        }
+    }
+
+    return last_shard;
+}
+
+int main()
+{
+    bool passed = true;
+    mt19937 rng(0);
+
+    passed &= check(crc32c("123456789", 9) == 0xE3069283 &&
+                    crc32c("123456789", 9, false) == 0xE3069283, "CRC32C");
+    passed &= check(checkCRC(rng), "hardware CRC32C matches the table");
+
+    fs::path dir = fs::temp_directory_path() /
+        ("rlpbr_datasettest_" + to_string(random_device()()));
+    fs::remove_all(dir);
+
+    DatasetCodec codec = datasetCodecSupported(DatasetCodec::Deflate) ?
+        DatasetCodec::Deflate : DatasetCodec::None;
+
+    // Small shards so samples span several
+    DatasetSchema schema {
+        {
+            { "color", DatasetType::Float16, codec, 48, 32, 3 },
+            { "mask", DatasetType::Uint8, DatasetCodec::None, 48, 32, 1 },
+        },
+        64 * 1024,
+    };
+
+    const uint32_t num_first = 40, num_second = 30, num_threaded = 64,
+        num_batched = 24;
+
+    {
+        DatasetWriter writer(dir.string(), schema);
+        for (uint32_t i = 0; i < num_first; i++) {
+            passed &= check(append(writer, makeSample(schema, i)) == i,
+                            "sequential indices");
+        }
+    }
+
+    passed &= check(fs::exists(dir / "shard_00001.bin"), "shard rollover");
+
+    if (codec == DatasetCodec::Deflate) {
+        uint64_t raw_bytes = num_first * (tensorBytes(schema.tensors[0]) +
+                                          tensorBytes(schema.tensors[1]));
+        uint64_t stored_bytes = 0;
+        for (const auto &entry : fs::directory_iterator(dir)) {
+            if (entry.path().filename().string().rfind("shard_", 0) == 0) {
+                stored_bytes += entry.file_size();
+            }
+        }
+        passed &= check(stored_bytes < raw_bytes, "compression");
+    }
+
+    // Reopening appends
+    {
+        DatasetWriter writer(dir.string(), schema);
+        passed &= check(writer.numSamples() == num_first, "reopen count");
+        for (uint32_t i = num_first; i < num_first + num_second; i++) {
+            append(writer, makeSample(schema, i));
+        }
+        writer.sync();
+    }
+
+    {
+        DatasetReader reader(dir.string());
+        passed &= check(checkContents(reader, schema,
+                                      num_first + num_second, rng),
+                        "contents after append");
+    }
+
+    // A crash mid append: junk in the shard and half an index record
+    uint64_t num_samples = num_first + num_second;
+    {
+        vector<char> junk(100, 'x');
+        for (const char *name : { "index.bin", "shard_00000.bin" }) {
+            ofstream file(dir / name, ios::binary | ios::app);
+            file.write(junk.data(), junk.size());
+        }
+    }
+
+    {
+        DatasetReader reader(dir.string());
+        passed &= check(reader.numSamples() == num_samples,
+                        "partial record ignored");
+    }
+
+    // The last sample's record reached the disk but not all of its data.
+    // The writer drops it and cuts the shard back to where it began.
+    {
+        fs::path shard = lastShard(dir);
+        uint64_t cut_bytes = fs::file_size(shard) - 10;
+        fs::resize_file(shard, cut_bytes);
+
+        DatasetWriter writer(dir.string(), schema);
+        passed &= check(writer.numSamples() == num_samples - 1 &&
+                        fs::file_size(shard) < cut_bytes,
+                        "incomplete last sample dropped");
+
+        passed &= check(append(writer, makeSample(schema, num_samples - 1)) ==
+                        num_samples - 1, "incomplete last sample rewritten");
+    }
+
+    {
+        DatasetReader reader(dir.string());
+        passed &= check(checkContents(reader, schema, num_samples, rng),
+                        "contents after rewrite");
+    }
+
+    // Power loss with neither file synced: the index kept records whose
+    // data is gone. Emptying the last shard and halving the one before it
+    // drops several samples.
+    {
+        vector<fs::path> shards;
+        for (const auto &entry : fs::directory_iterator(dir)) {
+            if (entry.path().filename().string().rfind("shard_", 0) == 0) {
+                shards.push_back(entry.path());
+            }
+        }
+        sort(shards.begin(), shards.end());
+
+        fs::path last = shards.back(), prev = shards[shards.size() - 2];
+        uint64_t prev_bytes = fs::file_size(prev) / 2;
+        fs::resize_file(last, 0);
+        fs::resize_file(prev, prev_bytes);
+
+        uint64_t num_kept;
+        {
+            DatasetReader reader(dir.string());
+            num_kept = reader.numSamples();
+            passed &= check(num_kept + 2 < num_samples &&
+                            checkContents(reader, schema, num_kept, rng),
+                            "samples past truncated shards dropped");
+        }
+
+        DatasetWriter writer(dir.string(), schema);
+        passed &= check(writer.numSamples() == num_kept &&
+                        fs::file_size(prev) <= prev_bytes,
+                        "writer drops samples past truncated shards");
+
+        for (uint64_t i = num_kept; i < num_samples; i++) {
+            append(writer, makeSample(schema, i));
+        }
+    }
+
+    {
+        DatasetReader reader(dir.string());
+        passed &= check(checkContents(reader, schema, num_samples, rng),
+                        "contents after rewriting dropped samples");
+    }
+
+    // Concurrent appends after the crash
+    {
+        DatasetWriter writer(dir.string(), schema);
+        BatchPrepPool pool(4);
+        pool.run(num_threaded, [&](uint32_t begin, uint32_t end) {
+            for (uint32_t i = begin; i < end; i++) {
+                append(writer, makeSample(schema, num_samples + i));
+            }
+        }, 1);
+    }
+    num_samples += num_threaded;
+
+    // Batches are encoded in parallel but keep their order
+    {
+        DatasetWriter writer(dir.string(), schema);
+        BatchPrepPool pool(4);
+
+        vector<Sample> samples;
+        vector<SampleMetadata> metadata;
+        vector<const void *> tensors;
+        for (uint32_t i = 0; i < num_batched; i++) {
+            samples.push_back(makeSample(schema, num_samples + i));
+        }
+        for (const Sample &sample : samples) {
+            metadata.push_back(sample.metadata);
+            tensors.push_back(sample.color.data());
+            tensors.push_back(sample.mask.data());
+        }
+
+        passed &= check(writer.appendBatch(metadata.data(), tensors.data(),
+                                           num_batched, pool) == num_samples,
+                        "batch index");
+    }
+
+    {
+        DatasetReader reader(dir.string());
+        bool ordered = reader.numSamples() == num_samples + num_batched;
+        for (uint32_t i = 0; ordered && i < num_batched; i++) {
+            ordered &= reader.getMetadata(num_samples + i).randomKey.envIdx ==
+                num_samples + i;
+        }
+        passed &= check(ordered, "batch order");
+    }
+    num_samples += num_batched;
+
+    {
+        DatasetReader reader(dir.string());
+        passed &= check(checkContents(reader, schema, num_samples, rng),
+                        "contents after concurrent append");
+    }
+
+    // Flip a stored byte of the last sample's color
+    {
+        fstream shard(lastShard(dir), ios::binary | ios::in | ios::out);
+        shard.seekg(0, ios::end);
+        streamoff pos = streamoff(shard.tellg()) -
+            streamoff(tensorBytes(schema.tensors[1])) - 5;
+        shard.seekg(pos);
+        char c = shard.get();
+        shard.seekp(pos);
+        shard.put(c ^ 1);
+    }
+
+    {
+        DatasetReader reader(dir.string());
+        vector<uint8_t> color(tensorBytes(schema.tensors[0]));
+        vector<uint8_t> mask(tensorBytes(schema.tensors[1]));
+        passed &= check(!reader.read(num_samples - 1, 0, color.data()),
+                        "checksum mismatch detected");
+        passed &= check(reader.read(num_samples - 1, 1, mask.data()),
+                        "undamaged tensor still readable");
+    }
+
+    fs::remove_all(dir);
+
+    if (!passed) {
+        return EXIT_FAILURE;
+    }
+
+    cout << "All dataset checks passed" << endl;
+}
@@ -0,0 +1,232 @@
+#include <rlpbr.hpp>
+#include <rlpbr_core/batch_prep.hpp>
+#include <rlpbr_core/scene.hpp>
+#include <rlpbr_core/transforms.hpp>
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include <glm/gtc/quaternion.hpp>
+
+using namespace std;
+using namespace RLpbr;
+
+static shared_ptr<Scene> makeHostScene(uint32_t num_instances)
+{
+    vector<ObjectInstance> instances;
+    vector<uint32_t> instance_materials;
+    vector<InstanceTransform> transforms;
+    vector<InstanceFlags> flags;
+
+    for (int i = 0; i < (int)num_instances; i++) {
+        instances.push_back({0, uint32_t(i)});
+        instance_materials.push_back(0);
+        transforms.push_back({glm::mat4x3(1.f), glm::mat4x3(1.f)});
+        flags.push_back(InstanceFlags {});
+    }
+
+    return make_shared<Scene>(Scene {
+        {},
+        { ObjectInfo { 0, 1 } },
+        EnvironmentInit(AABB { glm::vec3(-1.f), glm::vec3(1.f) },
+                        move(instances), move(instance_materials),
+                        move(transforms), move(flags), {}),
+        1,
+    });
+}
+
+// What every environment used to copy out of EnvironmentInit
+static size_t fullCopyBytes(const EnvironmentInit &init)
+{
+    return init.defaultInstances.size() * sizeof(ObjectInstance) +
+        init.defaultInstanceMaterials.size() * sizeof(uint32_t) +
+        init.defaultTransforms.size() * sizeof(InstanceTransform) +
+        init.defaultInstanceFlags.size() * sizeof(InstanceFlags) +
+        init.indexMap.size() * sizeof(uint32_t) +
+        init.reverseIDMap.size() * sizeof(uint32_t) +
+        init.lightIDs.size() * sizeof(uint32_t) +
+        init.lightReverseIDs.size() * sizeof(uint32_t);
+}
+
+template <typename Fn>
+static double timeSecs(Fn &&fn)
+{
+    auto start = chrono::steady_clock::now();
+    fn();
+    auto end = chrono::steady_clock::now();
+
+    return chrono::duration<double>(end - start).count();
+}
+
+static size_t totalOverrideBytes(const vector<Environment> &envs)
+{
+    size_t num_bytes = 0;
+    for (const Environment &env : envs) {
+        num_bytes += env.getOverrideBytes();
+    }
+
+    return num_bytes;
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t num_envs = 1024;
+    uint32_t num_instances = 10000;
+    uint32_t num_modified = 100;
+    if (argc > 1) {
+        num_envs = stoul(argv[1]);
+    }
+    if (argc > 2) {
+        num_instances = stoul(argv[2]);
+    }
+    if (argc > 3) {
+        num_modified = stoul(argv[3]);
+    }
+
+    auto scene = makeHostScene(num_instances);
+    Camera cam(glm::vec3(0.f), glm::vec3(0.f, 0.f, 1.f),
+               glm::vec3(0.f, 1.f, 0.f), 90.f, 1.f);
+
+    vector<Environment> envs;
+    envs.reserve(num_envs);
+
+    double create_secs = timeSecs([&]() {
+        for (int i = 0; i < (int)num_envs; i++) {
+            envs.emplace_back(
+                EnvironmentImpl(nullptr, nullptr, nullptr, nullptr,
+                                nullptr, nullptr, nullptr, nullptr),
+                scene, cam);
+        }
+    });
+
+    double mib = 1024.0 * 1024.0;
+    double full_copy_mib =
+        double(fullCopyBytes(scene->envInit)) * num_envs / mib;
+
+    cout << num_envs << " environments, " << num_instances
+         << " instances, " << num_modified << " modified per env" << endl;
+    cout << "Full copy state: " << full_copy_mib << " MiB" << endl;
+    cout << "Created in " << create_secs * 1e6 / num_envs
+         << " us / env, override state "
+         << double(totalOverrideBytes(envs)) / mib << " MiB" << endl;
+
+    mt19937 rand_gen(0);
+    uniform_int_distribution<uint32_t> inst_dist(0, num_instances - 1);
+    uniform_real_distribution<float> pos_dist(-10.f, 10.f);
+
+    auto modifyEnvs = [&]() {
+        for (Environment &env : envs) {
+            for (int i = 0; i < (int)num_modified; i++) {
+                env.setInstanceTransform(
+                    env.getInstanceID(inst_dist(rand_gen)),
+                    glm::vec3(pos_dist(rand_gen)),
+                    glm::quat(1.f, 0.f, 0.f, 0.f));
+            }
+        }
+    };
+
+    modifyEnvs();
+
+    cout << "After modification, override state "
+         << double(totalOverrideBytes(envs)) / mib << " MiB" << endl;
+
+    double reset_secs = timeSecs([&]() {
+        for (Environment &env : envs) {
+            env.reset();
+        }
+    });
+
+    // Old reset cost: copying the defaults out of EnvironmentInit
+    const EnvironmentInit &init = scene->envInit;
+    vector<ObjectInstance> instances;
+    vector<uint32_t> materials;
+    vector<InstanceTransform> transforms;
+    vector<InstanceFlags> flags;
+    double copy_secs = timeSecs([&]() {
+        for (int i = 0; i < (int)num_envs; i++) {
+            instances = init.defaultInstances;
+            materials = init.defaultInstanceMaterials;
+            transforms = init.defaultTransforms;
+            flags = init.defaultInstanceFlags;
+        }
+    });
+
+    cout << "Reset: " << reset_secs * 1e6 / num_envs << " us / env (full copy "
+         << copy_secs * 1e6 / num_envs << " us / env)" << endl;
+    cout << "After reset, override state "
+         << double(totalOverrideBytes(envs)) / mib << " MiB" << endl;
+
+    modifyEnvs();
+
+    // Full upload of every environment's transforms, as after a
+    // structural change. Environments share one staging area, only the
+    // conversion cost matters here.
+    vector<InstanceTransform> staged_matrices(num_instances);
+    vector<CompactTransform> staged_compact(num_instances);
+    vector<uint32_t> staged_materials(num_instances);
+
+    double matrix_stage_secs = timeSecs([&]() {
+        for (const Environment &env : envs) {
+            env.getTransforms().copyTo(staged_matrices.data());
+            env.getInstanceMaterials().copyTo(staged_materials.data());
+        }
+    });
+
+    double compact_stage_secs = timeSecs([&]() {
+        for (const Environment &env : envs) {
+            EnvStagingCache cache {};
+            stageEnvironment(env, cache, staged_compact.data(),
+                             staged_materials.data(), 0, 0);
+        }
+    });
+
+    double batch_instances = double(num_envs) * num_instances;
+    cout << "Transform upload: "
+         << batch_instances * sizeof(InstanceTransform) / mib
+         << " MiB as matrices in " << matrix_stage_secs * 1e6 / num_envs
+         << " us / env, " << batch_instances * sizeof(CompactTransform) / mib
+         << " MiB packed in " << compact_stage_secs * 1e6 / num_envs
+         << " us / env" << endl;
+
+    modifyEnvs();
+
+    vector<EnvironmentSnapshot> snapshots(num_envs);
+    double snapshot_secs = timeSecs([&]() {
+        for (int i = 0; i < (int)num_envs; i++) {
+            snapshots[i] = envs[i].snapshot();
+        }
+    });
+
+    size_t snapshot_bytes = 0;
+    for (const EnvironmentSnapshot &snapshot : snapshots) {
+        snapshot_bytes += snapshot.data.size();
+    }
+
+    vector<Environment> forks;
+    forks.reserve(num_envs);
+    double fork_secs = timeSecs([&]() {
+        for (const Environment &env : envs) {
+            forks.push_back(env.fork(
+                EnvironmentImpl(nullptr, nullptr, nullptr, nullptr,
+                                nullptr, nullptr, nullptr, nullptr)));
+        }
+    });
+
+    for (Environment &env : envs) {
+        env.reset();
+    }
+
+    double restore_secs = timeSecs([&]() {
+        for (int i = 0; i < (int)num_envs; i++) {
+            envs[i].restore(snapshots[i]);
+        }
+    });
+
+    cout << "Snapshot: " << snapshot_secs * 1e6 / num_envs << " us / env, "
+         << double(snapshot_bytes) / num_envs << " bytes / env" << endl;
+    cout << "Restore: " << restore_secs * 1e6 / num_envs << " us / env"
+         << endl;
+    cout << "Fork: " << fork_secs * 1e6 / num_envs << " us / env" << endl;
+}
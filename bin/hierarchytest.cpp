@@ -0,0 +1,440 @@
+#include <rlpbr.hpp>
+
+#include "test_scene.hpp"
+#include "test_util.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+using namespace RLpbr;
+
+static constexpr uint32_t noParent = Environment::noParent;
+
+static glm::mat4 rigid(const glm::vec3 &pos, const glm::quat &rot)
+{
+    return glm::translate(pos) * glm::mat4_cast(rot);
+}
+
+static glm::mat4 toMat4(const glm::mat4x3 &m)
+{
+    return glm::mat4(glm::vec4(m[0], 0.f), glm::vec4(m[1], 0.f),
+                     glm::vec4(m[2], 0.f), glm::vec4(m[3], 1.f));
+}
+
+static bool nearlyEqual(const glm::mat4 &a, const glm::mat4 &b)
+{
+    for (int c = 0; c < 4; c++) {
+        for (int r = 0; r < 3; r++) {
+            float diff = fabsf(a[c][r] - b[c][r]);
+            if (diff > 1e-3f * (1.f + fabsf(b[c][r]))) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// Mirror of the documented hierarchy semantics. World
+// transforms are what getTransforms() stores: a child written directly
+// keeps that world transform and its local one follows at the next update,
+// otherwise the update recomputes world = parent * local top down.
+struct HierarchyModel {
+    struct Node {
+        uint32_t parent;
+        glm::mat4 world;
+        glm::mat4 local;
+        bool worldSet;
+    };
+
+    unordered_map<uint32_t, Node> nodes;
+
+    bool hasChildren(uint32_t inst_id) const
+    {
+        for (const auto &[id, node] : nodes) {
+            if (node.parent == inst_id) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    uint32_t depth(uint32_t inst_id) const
+    {
+        uint32_t d = 0;
+        while (nodes.at(inst_id).parent != noParent) {
+            inst_id = nodes.at(inst_id).parent;
+            d++;
+        }
+
+        return d;
+    }
+
+    void update()
+    {
+        vector<pair<uint32_t, uint32_t>> order;
+        for (const auto &[id, node] : nodes) {
+            order.emplace_back(depth(id), id);
+        }
+        sort(order.begin(), order.end());
+
+        for (auto [d, id] : order) {
+            Node &node = nodes.at(id);
+            if (node.parent != noParent) {
+                const glm::mat4 &parent_world = nodes.at(node.parent).world;
+                if (node.worldSet) {
+                    node.local = glm::inverse(parent_world) * node.world;
+                } else {
+                    node.world = parent_world * node.local;
+                }
+            }
+        }
+
+        for (auto &[id, node] : nodes) {
+            node.worldSet = false;
+        }
+    }
+
+    void setWorld(uint32_t inst_id, const glm::mat4 &world)
+    {
+        Node &node = nodes.at(inst_id);
+        node.world = world;
+        node.worldSet = true;
+    }
+
+    void setLocal(uint32_t inst_id, const glm::mat4 &local)
+    {
+        Node &node = nodes.at(inst_id);
+        if (node.parent == noParent) {
+            setWorld(inst_id, local);
+        } else {
+            node.local = local;
+        }
+    }
+
+    bool setParent(uint32_t child_id, uint32_t parent_id)
+    {
+        for (uint32_t ancestor = parent_id; ancestor != noParent;
+             ancestor = nodes.at(ancestor).parent) {
+            if (ancestor == child_id) {
+                return false;
+            }
+        }
+
+        update();
+
+        Node &child = nodes.at(child_id);
+        if (child.parent == parent_id) {
+            return true;
+        }
+
+        child.parent = parent_id;
+        if (parent_id != noParent) {
+            child.local =
+                glm::inverse(nodes.at(parent_id).world) * child.world;
+        }
+
+        return true;
+    }
+
+    void remove(uint32_t inst_id)
+    {
+        if (nodes.at(inst_id).parent != noParent || hasChildren(inst_id)) {
+            update();
+        }
+
+        for (auto &[id, node] : nodes) {
+            if (node.parent == inst_id) {
+                node.parent = noParent;
+            }
+        }
+
+        nodes.erase(inst_id);
+    }
+};
+
+static HierarchyModel modelFromEnv(const Environment &env)
+{
+    HierarchyModel model;
+    for (uint32_t idx = 0; idx < env.getNumInstances(); idx++) {
+        model.nodes[env.getInstanceID(idx)] = {
+            noParent,
+            toMat4(env.getTransforms()[idx].mat),
+            glm::mat4(1.f),
+            false,
+        };
+    }
+
+    for (auto &[id, node] : model.nodes) {
+        node.parent = env.getInstanceParent(id);
+        if (node.parent != noParent) {
+            node.local = glm::inverse(model.nodes.at(node.parent).world) *
+                node.world;
+        }
+    }
+
+    return model;
+}
+
+static bool checkModel(Environment &env, HierarchyModel &model)
+{
+    env.updateHierarchy();
+    model.update();
+
+    if (env.getNumInstances() != model.nodes.size()) {
+        return false;
+    }
+
+    for (uint32_t idx = 0; idx < env.getNumInstances(); idx++) {
+        uint32_t inst_id = env.getInstanceID(idx);
+        auto iter = model.nodes.find(inst_id);
+        if (iter == model.nodes.end() ||
+            env.getInstanceParent(inst_id) != iter->second.parent ||
+            !nearlyEqual(toMat4(env.getTransforms()[idx].mat),
+                         iter->second.world)) {
+            return false;
+        }
+
+        // The inverse stays consistent with the propagated transform, up
+        // to rounding scaled by the distance from the origin
+        const InstanceTransform &txfm = env.getTransforms()[idx];
+        glm::mat4 round_trip = toMat4(txfm.inv) * toMat4(txfm.mat);
+        float scale = 1.f + glm::length(glm::vec3(txfm.mat[3]));
+        round_trip[3] /= scale;
+        round_trip[3][3] = 1.f;
+        if (!nearlyEqual(round_trip, glm::mat4(1.f))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static glm::quat randomRotation(mt19937 &rng)
+{
+    uniform_real_distribution<float> unit(-1.f, 1.f);
+    return glm::normalize(glm::quat(unit(rng), unit(rng), unit(rng),
+                                    unit(rng)));
+}
+
+int main()
+{
+    bool passed = true;
+
+    Renderer renderer(testRenderConfig());
+    mt19937 rng(4321);
+    uniform_real_distribution<float> unit(-1.f, 1.f);
+
+    // Deep chain from the scene's own hierarchy: instance i is parented to
+    // i - 1, and a second shallow tree hangs off instance 10
+    {
+        const uint32_t chain_len = 96;
+        vector<uint32_t> parents(chain_len + 8);
+        for (uint32_t i = 0; i < chain_len; i++) {
+            parents[i] = i == 0 ? noParent : i - 1;
+        }
+        for (uint32_t i = chain_len; i < parents.size(); i++) {
+            parents[i] = 10;
+        }
+
+        auto scene = makeTestScene({ 4, 3, uint32_t(parents.size()), 2.f, 5,
+                                     parents, false });
+        Environment env = renderer.makeEnvironment(scene);
+        HierarchyModel model = modelFromEnv(env);
+
+        uint32_t root = env.getInstanceID(0);
+        uint32_t leaf = env.getInstanceID(chain_len - 1);
+        passed &= check(env.getInstanceParent(root) == noParent &&
+                        env.getInstanceParent(leaf) ==
+                            env.getInstanceID(chain_len - 2),
+                        "scene hierarchy parents");
+
+        // Defaults are world transforms, nothing moves on the first update
+        passed &= check(checkModel(env, model), "scene chain defaults");
+
+        // Moving the root carries the whole chain
+        glm::vec3 delta(1.f, 2.f, 3.f);
+        glm::mat4 leaf_before = model.nodes.at(leaf).world;
+        env.moveInstance(root, delta);
+        model.setWorld(root, glm::translate(delta) *
+                       model.nodes.at(root).world);
+        passed &= check(checkModel(env, model), "move chain root");
+
+        glm::mat4 leaf_after =
+            toMat4(env.getTransforms()[env.getInstanceIndex(leaf)].mat);
+        passed &= check(nearlyEqual(leaf_after,
+                                    glm::translate(delta) * leaf_before),
+                        "chain leaf translated with root");
+
+        // Rotations compose along the chain
+        env.rotateInstance(root, glm::angleAxis(0.3f, glm::vec3(0, 1, 0)));
+        model.setWorld(root,
+            toMat4(env.getTransforms()[env.getInstanceIndex(root)].mat));
+        glm::quat mid_rot = randomRotation(rng);
+        uint32_t mid = env.getInstanceID(chain_len / 2);
+        env.setInstanceLocalTransform(mid, glm::vec3(0.f, 1.f, 0.f), mid_rot);
+        model.setLocal(mid, rigid(glm::vec3(0.f, 1.f, 0.f), mid_rot));
+        passed &= check(checkModel(env, model), "rotate root, set mid local");
+
+        // A directly set child transform wins over its local transform,
+        // descendants follow it
+        uint32_t lower = env.getInstanceID(chain_len - 10);
+        glm::quat lower_rot = randomRotation(rng);
+        env.setInstanceTransform(lower, glm::vec3(5.f, 0.f, 0.f), lower_rot);
+        model.setWorld(lower, rigid(glm::vec3(5.f, 0.f, 0.f), lower_rot));
+        passed &= check(checkModel(env, model), "set child world transform");
+
+        // Cycles are rejected anywhere along the chain
+        passed &= check(!env.setInstanceParent(root, leaf) &&
+                        !env.setInstanceParent(mid, leaf) &&
+                        !env.setInstanceParent(leaf, leaf),
+                        "chain cycles rejected");
+
+        // Reparent the lower half of the chain onto the shallow tree,
+        // everything stays where it is
+        uint32_t shallow = env.getInstanceID(chain_len + 3);
+        passed &= check(env.setInstanceParent(mid, shallow) &&
+                        model.setParent(mid, shallow),
+                        "reparent subtree");
+        passed &= check(checkModel(env, model), "reparent keeps transforms");
+
+        // The moved half follows its new parent, the old one doesn't
+        // affect it anymore
+        env.moveInstance(shallow, glm::vec3(-2.f, 0.f, 1.f));
+        model.setWorld(shallow, glm::translate(glm::vec3(-2.f, 0.f, 1.f)) *
+                       model.nodes.at(shallow).world);
+        env.moveInstance(env.getInstanceID(5), glm::vec3(0.f, 4.f, 0.f));
+        uint32_t fifth = env.getInstanceID(5);
+        model.setWorld(fifth, glm::translate(glm::vec3(0.f, 4.f, 0.f)) *
+                       model.nodes.at(fifth).world);
+        passed &= check(checkModel(env, model), "reparented subtree follows");
+
+        // The shallow tree hangs off instance 10, which is now an ancestor
+        // of the moved half
+        passed &= check(!env.setInstanceParent(env.getInstanceID(10), leaf),
+                        "cycle through reparented subtree");
+
+        // Deleting an inner node turns its children into roots in place
+        uint32_t inner = env.getInstanceID(20);
+        uint32_t inner_child = env.getInstanceID(21);
+        env.moveInstance(root, glm::vec3(0.5f, 0.f, 0.f));
+        model.setWorld(root, glm::translate(glm::vec3(0.5f, 0.f, 0.f)) *
+                       model.nodes.at(root).world);
+        env.deleteInstance(inner);
+        model.remove(inner);
+        passed &= check(env.getInstanceParent(inner_child) == noParent,
+                        "orphaned child is a root");
+        passed &= check(checkModel(env, model), "delete inner chain node");
+
+        // Unlinking keeps the world transform
+        passed &= check(env.setInstanceParent(leaf, noParent) &&
+                        model.setParent(leaf, noParent),
+                        "unlink leaf");
+        env.moveInstance(mid, glm::vec3(1.f, 1.f, 1.f));
+        model.setWorld(mid, glm::translate(glm::vec3(1.f, 1.f, 1.f)) *
+                       model.nodes.at(mid).world);
+        passed &= check(checkModel(env, model), "unlinked leaf stays put");
+    }
+
+    // Random links, reparenting and edits against the model, on scenes
+    // without a hierarchy of their own. Transforms and their inverses are
+    // stored separately in single precision, so rounding error builds up
+    // through every relink; fresh environments keep it bounded.
+    bool links_match = true;
+    bool model_matches = true;
+    uint32_t max_depth = 0;
+
+    for (uint32_t round = 0; round < 8; round++) {
+        auto scene = makeTestScene({ 5, 3, 40, 4.f, 6 + round, {}, false });
+        Environment env = renderer.makeEnvironment(scene);
+        HierarchyModel model = modelFromEnv(env);
+
+        vector<uint32_t> stale;
+
+        auto randomLive = [&]() {
+            return env.getInstanceID(rng() % env.getNumInstances());
+        };
+
+        for (uint32_t iter = 0; iter < 500; iter++) {
+            uint32_t op = rng() % 16;
+            uint32_t num_instances = env.getNumInstances();
+
+            if (num_instances < 8 || op == 0) {
+                uint32_t obj_idx = rng() % scene->objectInfo.size();
+                uint32_t mats[3] = { 0, 1, 2 };
+                glm::vec3 pos = 4.f * glm::vec3(unit(rng), unit(rng),
+                                                unit(rng));
+                glm::quat rot = randomRotation(rng);
+                uint32_t inst_id = env.addInstance(obj_idx, mats,
+                    scene->objectInfo[obj_idx].numMeshes, pos, rot);
+                model.nodes[inst_id] = {
+                    noParent, rigid(pos, rot), glm::mat4(1.f), false };
+            } else if (op == 1) {
+                uint32_t inst_id = randomLive();
+                env.deleteInstance(inst_id);
+                model.remove(inst_id);
+                stale.push_back(inst_id);
+            } else if (op < 6) {
+                uint32_t child = randomLive();
+                uint32_t parent = rng() % 6 == 0 ? noParent : randomLive();
+                links_match &= env.setInstanceParent(child, parent) ==
+                    model.setParent(child, parent);
+            } else if (op < 9) {
+                uint32_t inst_id = randomLive();
+                glm::vec3 delta(unit(rng), unit(rng), unit(rng));
+                env.moveInstance(inst_id, delta);
+                model.setWorld(inst_id, glm::translate(delta) *
+                               model.nodes.at(inst_id).world);
+            } else if (op < 11) {
+                uint32_t inst_id = randomLive();
+                glm::quat rot = randomRotation(rng);
+                env.rotateInstance(inst_id, rot);
+                glm::mat4 world = model.nodes.at(inst_id).world;
+                glm::mat4 rotated(glm::mat3(glm::mat3_cast(rot)) *
+                                   glm::mat3(world));
+                rotated[3] = world[3];
+                model.setWorld(inst_id, rotated);
+            } else if (op < 13) {
+                uint32_t inst_id = randomLive();
+                glm::vec3 pos(unit(rng), unit(rng), unit(rng));
+                glm::quat rot = randomRotation(rng);
+                env.setInstanceLocalTransform(inst_id, pos, rot);
+                model.setLocal(inst_id, rigid(pos, rot));
+            } else if (op == 13 && !stale.empty()) {
+                uint32_t inst_id = stale[rng() % stale.size()];
+                links_match &= !env.setInstanceParent(inst_id, noParent) &&
+                    !env.setInstanceParent(randomLive(), inst_id);
+                env.setInstanceLocalTransform(inst_id, glm::vec3(9.f),
+                                              glm::quat(1.f, 0.f, 0.f, 0.f));
+            } else if (op == 14) {
+                env.updateHierarchy();
+                model.update();
+            }
+
+            if (iter % 40 == 39) {
+                model_matches &= checkModel(env, model);
+
+                for (const auto &[id, node] : model.nodes) {
+                    max_depth = max(max_depth, model.depth(id));
+                }
+            }
+        }
+    }
+
+    passed &= check(links_match, "link results match model");
+    passed &= check(model_matches, "random hierarchy matches model");
+    passed &= check(max_depth >= 4, "random hierarchy grew deep chains");
+
+    if (!passed) {
+        return EXIT_FAILURE;
+    }
+
+    cout << "All hierarchy checks passed" << endl;
+}
@@ -0,0 +1,243 @@
+#include "image_writer.hpp"
+#include "oiio_bridge.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+using namespace std;
+
+namespace RLpbr {
+
+static uint64_t imageBytes(ImageFileFormat format, uint32_t width,
+                           uint32_t height, uint32_t num_channels)
+{
+    uint64_t num_values = uint64_t(width) * height * num_channels;
+
+    switch (format) {
+        case ImageFileFormat::EXR: return num_values * sizeof(uint16_t);
+        case ImageFileFormat::PNG: return num_values;
+        default: return 0;
+    }
+}
+
+AsyncImageWriter::AsyncImageWriter(uint32_t num_threads,
+                                   uint32_t max_queued,
+                                   Callback on_complete)
+    : lock_(),
+      work_cv_(),
+      space_cv_(),
+      done_cv_(),
+      max_queued_(),
+      on_complete_(move(on_complete)),
+      exit_(false),
+      queue_(),
+      free_buffers_(),
+      results_(),
+      next_id_(0),
+      next_delivered_(0),
+      delivering_(false),
+      num_failed_(0),
+      workers_()
+{
+    if (num_threads == 0) {
+        num_threads = max(thread::hardware_concurrency(), 1u);
+    }
+
+    max_queued_ = max_queued == 0 ? 4 * num_threads : max_queued;
+
+    workers_.reserve(num_threads);
+    for (uint32_t i = 0; i < num_threads; i++) {
+        workers_.emplace_back([this]() {
+            workerLoop();
+        });
+    }
+}
+
+AsyncImageWriter::~AsyncImageWriter()
+{
+    flush();
+
+    {
+        lock_guard<mutex> lock(lock_);
+        exit_ = true;
+    }
+    work_cv_.notify_all();
+
+    for (thread &t : workers_) {
+        t.join();
+    }
+}
+
+uint64_t AsyncImageWriter::write(string path, ImageFileFormat format,
+                                 uint32_t width, uint32_t height,
+                                 uint32_t num_channels, const void *data)
+{
+    if (format == ImageFileFormat::Raw) {
+        cerr << "AsyncImageWriter: use writeRaw for raw images" << endl;
+        abort();
+    }
+
+    return submit(move(path), format, width, height, num_channels, data,
+                  imageBytes(format, width, height, num_channels));
+}
+
+uint64_t AsyncImageWriter::writeRaw(string path, const void *data,
+                                    uint64_t num_bytes)
+{
+    return submit(move(path), ImageFileFormat::Raw, 0, 0, 0, data,
+                  num_bytes);
+}
+
+uint64_t AsyncImageWriter::submit(string path, ImageFileFormat format,
+                                  uint32_t width, uint32_t height,
+                                  uint32_t num_channels, const void *data,
+                                  uint64_t num_bytes)
+{
+    Job job {
+        0,
+        move(path),
+        format,
+        width,
+        height,
+        num_channels,
+        {},
+    };
+
+    unique_lock<mutex> lock(lock_);
+    space_cv_.wait(lock, [this]() {
+        return next_id_ - next_delivered_ < max_queued_;
+    });
+
+    job.id = next_id_++;
+    results_.push_back({ job.path, false, false });
+
+    if (!free_buffers_.empty()) {
+        job.data = move(free_buffers_.back());
+        free_buffers_.pop_back();
+    }
+
+    // The slot is reserved, copy without blocking the workers
+    lock.unlock();
+    job.data.resize(num_bytes);
+    memcpy(job.data.data(), data, num_bytes);
+    lock.lock();
+
+    uint64_t id = job.id;
+    queue_.push_back(move(job));
+    lock.unlock();
+
+    work_cv_.notify_one();
+
+    return id;
+}
+
+bool AsyncImageWriter::flush()
+{
+    unique_lock<mutex> lock(lock_);
+    done_cv_.wait(lock, [this]() {
+        return next_delivered_ == next_id_ && !delivering_;
+    });
+
+    bool success = num_failed_ == 0;
+    num_failed_ = 0;
+
+    return success;
+}
+
+void AsyncImageWriter::workerLoop()
+{
+    unique_lock<mutex> lock(lock_);
+
+    while (true) {
+        work_cv_.wait(lock, [this]() {
+            return exit_ || !queue_.empty();
+        });
+
+        if (queue_.empty()) {
+            return;
+        }
+
+        Job job = move(queue_.front());
+        queue_.pop_front();
+        lock.unlock();
+
+        bool success = writeJob(job);
+
+        lock.lock();
+        Result &result = results_[job.id - next_delivered_];
+        result.done = true;
+        result.success = success;
+
+        free_buffers_.push_back(move(job.data));
+
+        deliverCompleted(lock);
+    }
+}
+
+bool AsyncImageWriter::writeJob(const Job &job)
+{
+    const char *path = job.path.c_str();
+
+    switch (job.format) {
+        case ImageFileFormat::EXR: {
+            return saveHDR(path, job.width, job.height, job.data.data(),
+                           true, job.numChannels);
+        }
+        case ImageFileFormat::PNG: {
+            return saveSDR(path, job.width, job.height, job.data.data(),
+                           job.numChannels);
+        }
+        case ImageFileFormat::Raw: {
+            ofstream file(job.path, ios::binary);
+            file.write(reinterpret_cast<const char *>(job.data.data()),
+                       job.data.size());
+            file.close();
+
+            if (!file) {
+                cerr << "Failed to write " << job.path << endl;
+                return false;
+            }
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Runs callbacks for the finished prefix of results_. Only one thread
+// delivers at a time so callbacks stay ordered; images finishing while
+// a callback runs are picked up by the same loop.
+void AsyncImageWriter::deliverCompleted(unique_lock<mutex> &lock)
+{
+    if (delivering_) {
+        return;
+    }
+
+    delivering_ = true;
+
+    while (!results_.empty() && results_.front().done) {
+        Result result = move(results_.front());
+        results_.pop_front();
+        uint64_t id = next_delivered_++;
+
+        if (!result.success) {
+            num_failed_++;
+        }
+
+        space_cv_.notify_all();
+
+        if (on_complete_) {
+            lock.unlock();
+            on_complete_(id, result.path, result.success);
+            lock.lock();
+        }
+    }
+
+    delivering_ = false;
+    done_cv_.notify_all();
+}
+
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace RLpbr {
+
+enum class ImageFileFormat : uint32_t {
+    // Half channels
+    EXR,
+    // 8 bit channels
+    PNG,
+    // Bytes written as given, no header
+    Raw,
+};
+
+// Writes images to disk on a pool of worker threads so the render loop
+// only pays for a copy. At most maxQueued images are in flight: write()
+// blocks until one finishes when the queue is full.
+class AsyncImageWriter {
+public:
+    // Called once per image, in submission order and never concurrently,
+    // on whichever worker (or flushing thread) completes the oldest
+    // outstanding image.
+    typedef std::function<void(uint64_t id, const std::string &path,
+                               bool success)> Callback;
+
+    // num_threads = 0 uses one per hardware thread, max_queued = 0 allows
+    // 4 queued images per thread
+    AsyncImageWriter(uint32_t num_threads = 0, uint32_t max_queued = 0,
+                     Callback on_complete = nullptr);
+    AsyncImageWriter(const AsyncImageWriter &) = delete;
+    // Flushes
+    ~AsyncImageWriter();
+
+    // Copies data, which is width * height * num_channels halves for EXR
+    // or bytes for PNG. Returns the image's id, ids count up from 0.
+    uint64_t write(std::string path, ImageFileFormat format,
+                   uint32_t width, uint32_t height, uint32_t num_channels,
+                   const void *data);
+
+    uint64_t writeRaw(std::string path, const void *data,
+                      uint64_t num_bytes);
+
+    // Blocks until every image submitted so far is written and its
+    // callback has returned. False if any write failed since the last
+    // flush.
+    bool flush();
+
+    inline uint32_t numThreads() const { return workers_.size(); }
+    inline uint32_t maxQueued() const { return max_queued_; }
+
+private:
+    struct Job {
+        uint64_t id;
+        std::string path;
+        ImageFileFormat format;
+        uint32_t width;
+        uint32_t height;
+        uint32_t numChannels;
+        std::vector<uint8_t> data;
+    };
+
+    struct Result {
+        std::string path;
+        bool done;
+        bool success;
+    };
+
+    uint64_t submit(std::string path, ImageFileFormat format,
+                    uint32_t width, uint32_t height, uint32_t num_channels,
+                    const void *data, uint64_t num_bytes);
+    void workerLoop();
+    static bool writeJob(const Job &job);
+    void deliverCompleted(std::unique_lock<std::mutex> &lock);
+
+    std::mutex lock_;
+    std::condition_variable work_cv_;
+    std::condition_variable space_cv_;
+    std::condition_variable done_cv_;
+
+    uint32_t max_queued_;
+    Callback on_complete_;
+    bool exit_;
+
+    std::deque<Job> queue_;
+    // Buffers of finished jobs, reused by later writes
+    std::vector<std::vector<uint8_t>> free_buffers_;
+
+    // results_[i] belongs to image next_delivered_ + i
+    std::deque<Result> results_;
+    uint64_t next_id_;
+    uint64_t next_delivered_;
+    bool delivering_;
+    uint64_t num_failed_;
+
+    std::vector<std::thread> workers_;
+};
+
+}
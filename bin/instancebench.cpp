@@ -0,0 +1,151 @@
+#include <rlpbr.hpp>
+#include <rlpbr_core/scene.hpp>
+#include <rlpbr_core/transforms.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include <glm/gtc/quaternion.hpp>
+
+using namespace std;
+using namespace RLpbr;
+
+// Builds an environment without a render backend, only the host side
+// instance state is exercised
+static Environment makeHostEnvironment(uint32_t num_instances)
+{
+    vector<ObjectInstance> instances;
+    vector<uint32_t> instance_materials;
+    vector<InstanceTransform> transforms;
+    vector<InstanceFlags> flags;
+
+    for (int i = 0; i < (int)num_instances; i++) {
+        instances.push_back({0, uint32_t(i)});
+        instance_materials.push_back(0);
+        transforms.push_back({glm::mat4x3(1.f), glm::mat4x3(1.f)});
+        flags.push_back(InstanceFlags {});
+    }
+
+    auto scene = make_shared<Scene>(Scene {
+        {},
+        { ObjectInfo { 0, 1 } },
+        EnvironmentInit(AABB { glm::vec3(-1.f), glm::vec3(1.f) },
+                        move(instances), move(instance_materials),
+                        move(transforms), move(flags), {}),
+        1,
+    });
+
+    return Environment(EnvironmentImpl(nullptr, nullptr, nullptr, nullptr,
+                                       nullptr, nullptr, nullptr, nullptr),
+                       scene, Camera(glm::vec3(0.f), glm::vec3(0.f, 0.f, 1.f),
+                                     glm::vec3(0.f, 1.f, 0.f), 90.f, 1.f));
+}
+
+template <typename Fn>
+static double timeIters(uint32_t num_iters, Fn &&fn)
+{
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < (int)num_iters; i++) {
+        fn();
+    }
+    auto end = chrono::steady_clock::now();
+
+    return chrono::duration<double>(end - start).count();
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t num_instances = 10000;
+    uint32_t num_iters = 1000;
+    if (argc > 1) {
+        num_instances = stoul(argv[1]);
+    }
+    if (argc > 2) {
+        num_iters = stoul(argv[2]);
+    }
+
+    Environment env = makeHostEnvironment(num_instances);
+
+    mt19937 rand_gen(0);
+    uniform_real_distribution<float> rand_dist(-1.f, 1.f);
+
+    vector<uint32_t> ids(num_instances);
+    vector<glm::vec3> positions(num_instances);
+    vector<glm::quat> rotations(num_instances);
+    vector<uint32_t> materials(num_instances);
+
+    for (int i = 0; i < (int)num_instances; i++) {
+        ids[i] = env.getInstanceID(i);
+        positions[i] = glm::vec3(rand_dist(rand_gen), rand_dist(rand_gen),
+                                 rand_dist(rand_gen)) * 10.f;
+        rotations[i] = glm::normalize(glm::quat(
+            rand_dist(rand_gen), rand_dist(rand_gen),
+            rand_dist(rand_gen), rand_dist(rand_gen)));
+        materials[i] = 0;
+    }
+    shuffle(ids.begin(), ids.end(), rand_gen);
+
+    double per_call_secs = timeIters(num_iters, [&]() {
+        for (int i = 0; i < (int)num_instances; i++) {
+            env.setInstanceTransform(ids[i], positions[i], rotations[i]);
+            env.setInstanceMaterial<1>(ids[i], { materials[i] });
+        }
+        env.clearDirty();
+    });
+
+    double batched_secs = timeIters(num_iters, [&]() {
+        env.setInstanceTransforms(ids.data(), positions.data(),
+                                  rotations.data(), num_instances);
+        env.setInstanceMaterials(ids.data(), materials.data(), 1,
+                                 num_instances);
+        env.clearDirty();
+    });
+
+    double total_updates = double(num_instances) * num_iters;
+
+    cout << num_instances << " instances, " << num_iters << " iterations"
+         << endl;
+    cout << "Per call: " << per_call_secs * 1e9 / total_updates
+         << " ns / instance" << endl;
+    cout << "Batched: " << batched_secs * 1e9 / total_updates
+         << " ns / instance" << endl;
+    cout << "Speedup: " << per_call_secs / batched_secs << "x" << endl;
+
+    // Compact transforms, checked by instancetest
+    uniform_real_distribution<float> scale_dist(0.1f, 4.f);
+    vector<CompactTransform> compact(num_instances);
+    for (int i = 0; i < (int)num_instances; i++) {
+        InstanceTransform txfm;
+        computeRigidTransform(positions[i], rotations[i], txfm);
+        packTransforms(&txfm, &compact[i], 1);
+        compact[i].scale = glm::vec3(scale_dist(rand_gen),
+                                     scale_dist(rand_gen),
+                                     scale_dist(rand_gen));
+    }
+
+    vector<InstanceTransform> expanded(num_instances);
+    vector<InstanceTransform *> expanded_ptrs(num_instances);
+    for (int i = 0; i < (int)num_instances; i++) {
+        expanded_ptrs[i] = &expanded[i];
+    }
+
+    vector<CompactTransform> repacked(num_instances);
+
+    double expand_secs = timeIters(num_iters, [&]() {
+        expandTransforms(compact.data(), expanded_ptrs.data(),
+                         num_instances);
+    });
+
+    double pack_secs = timeIters(num_iters, [&]() {
+        packTransforms(expanded.data(), repacked.data(), num_instances);
+    });
+
+    cout << "Compact: " << sizeof(CompactTransform) << " bytes vs "
+         << sizeof(InstanceTransform) << ", expand "
+         << expand_secs * 1e9 / total_updates << " ns / instance, pack "
+         << pack_secs * 1e9 / total_updates << " ns / instance" << endl;
+}
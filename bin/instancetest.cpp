@@ -0,0 +1,292 @@
+#include <rlpbr.hpp>
+#include <rlpbr_core/transforms.hpp>
+
+#include "test_scene.hpp"
+#include "test_util.hpp"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+using namespace RLpbr;
+
+static bool nearlyEqual(const glm::mat4 &a, const glm::mat4 &b,
+                        float eps = 1e-4f)
+{
+    for (int c = 0; c < 4; c++) {
+        for (int r = 0; r < 4; r++) {
+            if (fabsf(a[c][r] - b[c][r]) > eps) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+static glm::mat4 toMat4(const glm::mat4x3 &m)
+{
+    return glm::mat4(glm::vec4(m[0], 0.f), glm::vec4(m[1], 0.f),
+                     glm::vec4(m[2], 0.f), glm::vec4(m[3], 1.f));
+}
+
+// The transform matches expected and its inverse is the real inverse
+static bool checkTransform(const InstanceTransform &txfm,
+                           const glm::mat4 &expected)
+{
+    glm::mat4 mat = toMat4(txfm.mat);
+    glm::mat4 inv = toMat4(txfm.inv);
+
+    return nearlyEqual(mat, expected) &&
+        nearlyEqual(inv * mat, glm::mat4(1.f));
+}
+
+static glm::quat randomRotation(mt19937 &rng)
+{
+    uniform_real_distribution<float> unit(-1.f, 1.f);
+    return glm::normalize(glm::quat(unit(rng), unit(rng), unit(rng),
+                                    unit(rng)));
+}
+
+int main()
+{
+    bool passed = true;
+
+    auto scene = makeTestScene({ 6, 4, 20, 5.f, 1, {}, false });
+    Renderer renderer(testRenderConfig());
+    Environment env = renderer.makeEnvironment(scene);
+
+    passed &= check(env.getNumInstances() == 20, "default instances");
+
+    env.clearDirty();
+    passed &= check(!env.isDirty(), "clean after clearDirty");
+
+    // Single updates
+    {
+        uint32_t inst_id = env.getInstanceID(7);
+        glm::mat4 expected = toMat4(env.getTransforms()[7].mat);
+
+        glm::vec3 delta(0.5f, -1.f, 2.f);
+        env.moveInstance(inst_id, delta);
+        expected = glm::translate(delta) * expected;
+
+        const EnvironmentUpdates &updates = env.getUpdates();
+        passed &= check(checkTransform(env.getTransforms()[7], expected),
+                        "moveInstance transform");
+        passed &= check(updates.transforms.begin == 7 &&
+                        updates.transforms.end == 8 &&
+                        updates.materials.empty() &&
+                        updates.flags.empty() && !updates.structural,
+                        "moveInstance dirty range");
+
+        // Rotates in place: the translation stays, the linear part is
+        // premultiplied
+        glm::quat rot = glm::angleAxis(0.7f, glm::normalize(
+            glm::vec3(1.f, 2.f, 0.5f)));
+        glm::mat4 before = toMat4(env.getTransforms()[3].mat);
+        env.rotateInstance(env.getInstanceID(3), rot);
+        glm::mat4 after(glm::mat3_cast(rot) * glm::mat3(before));
+        after[3] = before[3];
+        passed &= check(checkTransform(env.getTransforms()[3], after),
+                        "rotateInstance transform");
+        passed &= check(updates.transforms.begin == 3 &&
+                        updates.transforms.end == 8,
+                        "rotateInstance extends range");
+
+        // Through a const reference, the non-const getter marks every
+        // material dirty
+        const Environment &const_env = env;
+
+        env.clearDirty();
+        const ObjectInstance &inst = env.getInstances()[11];
+        uint32_t mat_offset = inst.materialOffset;
+        uint32_t num_meshes = scene->objectInfo[inst.objectIndex].numMeshes;
+        uint32_t new_mat =
+            (const_env.getInstanceMaterials()[mat_offset] + 1) % 4;
+        vector<uint32_t> mats(num_meshes, new_mat);
+        uint32_t mat_inst_id = env.getInstanceID(11);
+        env.setInstanceMaterials(&mat_inst_id, mats.data(), num_meshes, 1);
+        passed &= check(const_env.getInstanceMaterials()[mat_offset] ==
+                            new_mat &&
+                        updates.materials.begin == mat_offset &&
+                        updates.materials.end == mat_offset + num_meshes &&
+                        updates.transforms.empty(),
+                        "setInstanceMaterials dirty range");
+
+        env.clearDirty();
+        glm::quat abs_rot = glm::angleAxis(-1.2f, glm::vec3(0.f, 1.f, 0.f));
+        glm::vec3 abs_pos(1.f, 2.f, 3.f);
+        env.setInstanceTransform(env.getInstanceID(0), abs_pos, abs_rot);
+        passed &= check(checkTransform(env.getTransforms()[0],
+                            glm::translate(abs_pos) * glm::mat4_cast(abs_rot)),
+                        "setInstanceTransform transform");
+        passed &= check(updates.transforms.begin == 0 &&
+                        updates.transforms.end == 1,
+                        "setInstanceTransform dirty range");
+    }
+
+    // Mixed add / move / rotate / delete against a reference model keyed
+    // by InstanceID. Between structural changes the dirty range must be
+    // exactly the span of the touched indices.
+    {
+        mt19937 rng(1234);
+        uniform_real_distribution<float> unit(-1.f, 1.f);
+
+        unordered_map<uint32_t, glm::mat4> reference;
+        for (uint32_t idx = 0; idx < env.getNumInstances(); idx++) {
+            reference[env.getInstanceID(idx)] =
+                toMat4(env.getTransforms()[idx].mat);
+        }
+
+        env.clearDirty();
+        bool structural = false;
+        uint32_t min_touched = ~0u, max_touched = 0;
+
+        bool transforms_match = true;
+        bool ranges_match = true;
+
+        for (uint32_t iter = 0; iter < 2000; iter++) {
+            uint32_t op = rng() % 10;
+            uint32_t num_instances = env.getNumInstances();
+
+            if (op == 0 || num_instances == 0) {
+                uint32_t obj_idx = rng() % scene->objectInfo.size();
+                uint32_t mats[3] = { 0, 1, 2 };
+                glm::vec3 pos = 5.f * glm::vec3(unit(rng), unit(rng),
+                                                unit(rng));
+                glm::quat rot = randomRotation(rng);
+
+                uint32_t inst_id = env.addInstance(obj_idx, mats,
+                    scene->objectInfo[obj_idx].numMeshes, pos, rot);
+                reference[inst_id] =
+                    glm::translate(pos) * glm::mat4_cast(rot);
+                structural = true;
+            } else if (op == 1) {
+                uint32_t inst_id = env.getInstanceID(rng() % num_instances);
+                env.deleteInstance(inst_id);
+                reference.erase(inst_id);
+                structural = true;
+            } else {
+                uint32_t idx = rng() % num_instances;
+                uint32_t inst_id = env.getInstanceID(idx);
+                glm::mat4 &ref = reference[inst_id];
+
+                if (op < 6) {
+                    glm::vec3 delta(unit(rng), unit(rng), unit(rng));
+                    env.moveInstance(inst_id, delta);
+                    ref = glm::translate(delta) * ref;
+                } else {
+                    glm::quat rot = randomRotation(rng);
+                    env.rotateInstance(inst_id, rot);
+                    glm::mat4 rotated(glm::mat3_cast(rot) * glm::mat3(ref));
+                    rotated[3] = ref[3];
+                    ref = rotated;
+                }
+
+                min_touched = min(min_touched, idx);
+                max_touched = max(max_touched, idx);
+            }
+
+            const EnvironmentUpdates &updates = env.getUpdates();
+            if (structural) {
+                ranges_match &= updates.structural;
+            } else if (min_touched <= max_touched) {
+                ranges_match &= updates.transforms.begin == min_touched &&
+                    updates.transforms.end == max_touched + 1 &&
+                    updates.materials.empty() && updates.flags.empty();
+            }
+
+            if (iter % 50 == 49) {
+                transforms_match &=
+                    reference.size() == env.getNumInstances();
+                for (uint32_t idx = 0; idx < env.getNumInstances(); idx++) {
+                    auto iter_ref = reference.find(env.getInstanceID(idx));
+                    transforms_match &= iter_ref != reference.end() &&
+                        checkTransform(env.getTransforms()[idx],
+                                       iter_ref->second);
+                }
+            }
+
+            // Like a render consuming the updates
+            if (iter % 7 == 6) {
+                env.clearDirty();
+                structural = false;
+                min_touched = ~0u;
+                max_touched = 0;
+            }
+        }
+
+        passed &= check(transforms_match, "transforms match reference");
+        passed &= check(ranges_match, "dirty ranges match touched spans");
+    }
+
+    // Compact transforms: expanding gives T * R * S and its inverse, and
+    // packing the expansion again reproduces position and rotation bit
+    // for bit. An odd count covers the scalar tail of the SIMD loops.
+    {
+        mt19937 rng(7);
+        uniform_real_distribution<float> unit(-1.f, 1.f);
+        uniform_real_distribution<float> scale_dist(0.1f, 4.f);
+
+        const uint32_t num_transforms = 1003;
+        vector<CompactTransform> compact(num_transforms);
+        vector<glm::mat4> expected(num_transforms);
+        for (uint32_t i = 0; i < num_transforms; i++) {
+            InstanceTransform txfm;
+            computeRigidTransform(10.f * glm::vec3(unit(rng), unit(rng),
+                                                   unit(rng)),
+                                  randomRotation(rng), txfm);
+            packTransforms(&txfm, &compact[i], 1);
+            compact[i].scale = glm::vec3(scale_dist(rng), scale_dist(rng),
+                                         scale_dist(rng));
+
+            const int16_t *q = compact[i].rotation;
+            glm::quat rot = glm::normalize(glm::quat(q[3], q[0], q[1], q[2]));
+            expected[i] = glm::translate(compact[i].position) *
+                glm::mat4_cast(rot) * glm::scale(compact[i].scale);
+        }
+
+        vector<InstanceTransform> expanded(num_transforms);
+        vector<InstanceTransform *> expanded_ptrs(num_transforms);
+        for (uint32_t i = 0; i < num_transforms; i++) {
+            expanded_ptrs[i] = &expanded[i];
+        }
+        expandTransforms(compact.data(), expanded_ptrs.data(),
+                         num_transforms);
+
+        vector<CompactTransform> repacked(num_transforms);
+        packTransforms(expanded.data(), repacked.data(), num_transforms);
+
+        bool expanded_match = true;
+        bool exact_match = true;
+        float max_scale_err = 0.f;
+        for (uint32_t i = 0; i < num_transforms; i++) {
+            expanded_match &= checkTransform(expanded[i], expected[i]);
+
+            const CompactTransform &a = compact[i];
+            const CompactTransform &b = repacked[i];
+            exact_match &=
+                memcmp(&a.position, &b.position, sizeof(glm::vec3)) == 0 &&
+                memcmp(a.rotation, b.rotation, sizeof(a.rotation)) == 0;
+
+            glm::vec3 rel_err = glm::abs(a.scale - b.scale) / a.scale;
+            max_scale_err = max(max_scale_err,
+                max(rel_err.x, max(rel_err.y, rel_err.z)));
+        }
+
+        passed &= check(expanded_match, "expanded compact transforms");
+        passed &= check(exact_match, "compact round trip position / rotation");
+        passed &= check(max_scale_err <= 1e-6f, "compact round trip scale");
+    }
+
+    if (!passed) {
+        return EXIT_FAILURE;
+    }
+
+    cout << "All instance checks passed" << endl;
+}
@@ -0,0 +1,251 @@
+#include <rlpbr_core/io.hpp>
+
+#include "test_util.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+using namespace std;
+using namespace RLpbr;
+
+namespace fs = std::filesystem;
+
+static vector<uint8_t> makeContents(uint64_t num_bytes, uint32_t seed)
+{
+    mt19937 rng(seed);
+    vector<uint8_t> contents(num_bytes);
+    for (uint8_t &v : contents) {
+        v = uint8_t(rng());
+    }
+
+    return contents;
+}
+
+static void writeFile(const fs::path &path, const vector<uint8_t> &contents)
+{
+    ofstream file(path, ios::binary);
+    file.write((const char *)contents.data(), contents.size());
+}
+
+// Files on tmpfs so the test exercises the engine rather than the disk
+static fs::path makeTestDir()
+{
+    fs::path base = fs::exists("/dev/shm") ?
+        fs::path("/dev/shm") : fs::temp_directory_path();
+
+    fs::path dir = base / ("rlpbr_iotest_" + to_string(random_device()()));
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+
+    return dir;
+}
+
+static bool testEngine(IOEngine &io, const fs::path &dir)
+{
+    bool passed = true;
+    struct stat file_stat;
+
+    const uint32_t num_files = 64;
+    vector<vector<uint8_t>> contents;
+    vector<IOFile> files;
+    for (uint32_t i = 0; i < num_files; i++) {
+        contents.push_back(makeContents(1000 + i * 4099, i));
+        fs::path path = dir / ("file_" + to_string(i) + ".bin");
+        writeFile(path, contents.back());
+        files.emplace_back(path.string());
+    }
+
+    passed &= check(files[3].numBytes() == contents[3].size(), "file size");
+
+    // Self move keeps the file open
+    {
+        IOFile &self = files[3];
+        files[3] = std::move(self);
+        passed &= check(files[3].getFD() != -1 &&
+                        fstat(files[3].getFD(), &file_stat) == 0,
+                        "self move assignment");
+    }
+
+    // Every file in one submission, with completion callbacks
+    {
+        vector<vector<uint8_t>> dsts(num_files);
+        vector<IORead> reads;
+        atomic_uint32_t num_callbacks(0);
+        for (uint32_t i = 0; i < num_files; i++) {
+            dsts[i].resize(contents[i].size());
+            reads.push_back({
+                files[i].getFD(),
+                dsts[i].data(),
+                0,
+                dsts[i].size(),
+                [&num_callbacks]() { num_callbacks++; },
+            });
+        }
+
+        IOBatch batch;
+        io.submit(batch, reads.data(), reads.size());
+        passed &= check(batch.wait(), "batched reads succeed");
+        passed &= check(num_callbacks == num_files, "completion callbacks");
+        passed &= check(dsts == contents, "batched read contents");
+    }
+
+    // Callbacks submitting more reads than the queue depth into the same
+    // batch, which must not block the engine thread running them
+    {
+        const uint32_t num_followups = 8;
+        vector<vector<uint8_t>> dsts(num_files);
+        vector<vector<uint8_t>> followup_dsts(num_files * num_followups);
+        vector<IORead> reads;
+        IOBatch batch;
+        atomic_uint32_t num_callbacks(0);
+        for (uint32_t i = 0; i < num_files; i++) {
+            dsts[i].resize(contents[i].size());
+            reads.push_back({
+                files[i].getFD(),
+                dsts[i].data(),
+                0,
+                dsts[i].size(),
+                [&, i]() {
+                    vector<IORead> followups;
+                    for (uint32_t j = 0; j < num_followups; j++) {
+                        auto &dst = followup_dsts[i * num_followups + j];
+                        dst.resize(contents[i].size());
+                        followups.push_back({
+                            files[i].getFD(),
+                            dst.data(),
+                            0,
+                            dst.size(),
+                            [&num_callbacks]() { num_callbacks++; },
+                        });
+                    }
+                    io.submit(batch, followups.data(), followups.size());
+                },
+            });
+        }
+
+        io.submit(batch, reads.data(), reads.size());
+        passed &= check(batch.wait(), "reads submitted from callbacks");
+        passed &= check(num_callbacks == num_files * num_followups,
+                        "callbacks of reads submitted from callbacks");
+
+        bool matches = dsts == contents;
+        for (uint32_t i = 0; i < followup_dsts.size(); i++) {
+            matches &= followup_dsts[i] == contents[i / num_followups];
+        }
+        passed &= check(matches, "contents of reads submitted from callbacks");
+    }
+
+    // Reads from several submissions attached to one batch, at offsets
+    {
+        vector<uint8_t> dst(num_files * 16);
+        IOBatch batch;
+        for (uint32_t i = 0; i < num_files; i++) {
+            IORead read {
+                files[i].getFD(),
+                dst.data() + i * 16,
+                500,
+                16,
+                {},
+            };
+            io.submit(batch, &read, 1);
+        }
+        passed &= check(batch.wait(), "multi submit batch succeeds");
+
+        bool matches = true;
+        for (uint32_t i = 0; i < num_files; i++) {
+            matches &= equal(dst.begin() + i * 16, dst.begin() + i * 16 + 16,
+                             contents[i].begin() + 500);
+        }
+        passed &= check(matches, "offset read contents");
+    }
+
+    // Larger than a chunk, so the read is split
+    {
+        vector<uint8_t> large = makeContents(9 * 1024 * 1024 + 123, 1234);
+        fs::path path = dir / "large.bin";
+        writeFile(path, large);
+        IOFile file(path.string());
+
+        vector<uint8_t> dst(large.size() - 7);
+        io.read(file.getFD(), dst.data(), 7, dst.size());
+        passed &= check(equal(dst.begin(), dst.end(), large.begin() + 7),
+                        "chunked read contents");
+    }
+
+    // Reading past the end fails, without running the callback
+    {
+        vector<uint8_t> dst(contents[0].size() + 1);
+        bool callback_ran = false;
+        IORead read {
+            files[0].getFD(),
+            dst.data(),
+            0,
+            dst.size(),
+            [&callback_ran]() { callback_ran = true; },
+        };
+
+        IOBatch batch;
+        io.submit(batch, &read, 1);
+        passed &= check(!batch.wait(), "read past EOF fails");
+        passed &= check(!callback_ran, "no callback for failed read");
+    }
+
+    // A zero byte read succeeds, even at the end of the file
+    {
+        uint8_t dst;
+        bool callback_ran = false;
+        IORead read {
+            files[1].getFD(),
+            &dst,
+            contents[1].size(),
+            0,
+            [&callback_ran]() { callback_ran = true; },
+        };
+
+        IOBatch batch;
+        io.submit(batch, &read, 1);
+        passed &= check(batch.wait(), "zero byte read succeeds");
+        passed &= check(callback_ran, "callback for zero byte read");
+    }
+
+    return passed;
+}
+
+int main()
+{
+    bool passed = true;
+    fs::path dir = makeTestDir();
+
+    {
+        IOEngine io(IOEngine::Mode::ThreadPool);
+        passed &= check(io.getMode() == IOEngine::Mode::ThreadPool,
+                        "thread pool mode");
+        passed &= check(testEngine(io, dir), "thread pool engine");
+    }
+
+    // Falls back to the thread pool without io_uring support
+    {
+        IOEngine io(IOEngine::Mode::IOURing, 16);
+        if (io.getMode() != IOEngine::Mode::IOURing) {
+            cout << "io_uring unavailable, tested the fallback" << endl;
+        }
+        passed &= check(testEngine(io, dir), "io_uring engine");
+    }
+
+    fs::remove_all(dir);
+
+    if (!passed) {
+        return EXIT_FAILURE;
+    }
+
+    cout << "All I/O checks passed" << endl;
+}
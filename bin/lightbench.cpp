@@ -0,0 +1,68 @@
+#include <rlpbr/light_sampler.hpp>
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <vector>
+
+using namespace std;
+using namespace RLpbr;
+
+template <typename Fn>
+static double timeIters(uint32_t num_iters, Fn &&fn)
+{
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < (int)num_iters; i++) {
+        fn();
+    }
+    auto end = chrono::steady_clock::now();
+
+    return chrono::duration<double>(end - start).count();
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t num_lights = 10000;
+    uint32_t num_iters = 1000;
+    if (argc > 1) {
+        num_lights = stoul(argv[1]);
+    }
+    if (argc > 2) {
+        num_iters = stoul(argv[2]);
+    }
+
+    mt19937 rand_gen(0);
+    uniform_real_distribution<float> power_dist(0.f, 10.f);
+
+    auto randomPower = [&]() {
+        return rand_gen() % 5 == 0 ? 0.f : power_dist(rand_gen);
+    };
+
+    vector<float> scene_powers(num_lights);
+    for (float &power : scene_powers) {
+        power = randomPower();
+    }
+
+    LightSamplerInit init(scene_powers);
+    LightSampler sampler(init);
+
+    // Recolouring one light per frame: incremental vs rebuilding the
+    // tables from scratch
+    double incremental_secs = timeIters(num_iters, [&]() {
+        uint32_t idx = rand_gen() % sampler.size();
+        sampler.set(idx, randomPower());
+        sampler.update();
+    });
+
+    vector<AliasEntry> full_table(num_lights);
+    double rebuild_secs = timeIters(num_iters, [&]() {
+        scene_powers[rand_gen() % num_lights] = randomPower();
+        buildAliasTable(scene_powers.data(), num_lights, full_table.data());
+    });
+
+    double us = 1e6 / double(num_iters);
+
+    cout << num_lights << " lights, " << num_iters << " iterations" << endl;
+    cout << "Single light change: incremental " << incremental_secs * us
+         << " us, full rebuild " << rebuild_secs * us << " us" << endl;
+}
@@ -0,0 +1,362 @@
+#include <rlpbr.hpp>
+#include <rlpbr/light_sampler.hpp>
+#include <cpu/scene.hpp>
+
+#include "test_scene.hpp"
+#include "test_util.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <vector>
+
+using namespace std;
+using namespace RLpbr;
+
+// What the backend should hold at one dense light index
+struct RefLight {
+    uint32_t id;
+    // ~0u for lights from addLight
+    uint32_t sceneLightIdx;
+    glm::vec3 position;
+    glm::vec3 color;
+};
+
+// Dense light order, mirroring the environment's swap removes
+struct Model {
+    vector<RefLight> lights;
+
+    void add(uint32_t id, const glm::vec3 &position, const glm::vec3 &color)
+    {
+        lights.push_back({ id, ~0u, position, color });
+    }
+
+    void remove(uint32_t id)
+    {
+        for (uint32_t idx = 0; idx < lights.size(); idx++) {
+            if (lights[idx].id == id) {
+                lights[idx] = lights.back();
+                lights.pop_back();
+                return;
+            }
+        }
+    }
+};
+
+static Model sceneModel(const Scene &scene)
+{
+    Model model;
+    for (uint32_t idx = 0; idx < scene.envInit.lights.size(); idx++) {
+        model.lights.push_back({ idx, idx, glm::vec3(0.f), glm::vec3(0.f) });
+    }
+
+    return model;
+}
+
+static bool checkModel(const Environment &env, const Model &model)
+{
+    const auto &backend =
+        *static_cast<const cpu::CPUEnvironment *>(env.getBackend());
+    const auto &scene_lights = env.getScene()->envInit.lights;
+
+    if (backend.lights.size() != model.lights.size() ||
+        env.getNumLights() != model.lights.size() ||
+        env.getLightSampler().getPowers().size() != model.lights.size()) {
+        return false;
+    }
+
+    for (uint32_t idx = 0; idx < model.lights.size(); idx++) {
+        const RefLight &ref = model.lights[idx];
+        const cpu::CPULight &light = backend.lights[idx];
+
+        if (!env.isValidLight(ref.id)) {
+            return false;
+        }
+
+        if (ref.sceneLightIdx != ~0u) {
+            auto props = get_if<LightProperties>(&light);
+            if (!props || memcmp(props, &scene_lights[ref.sceneLightIdx],
+                                 sizeof(LightProperties)) != 0) {
+                return false;
+            }
+        } else {
+            auto point = get_if<cpu::PointLight>(&light);
+            if (!point || point->position != ref.position ||
+                point->color != ref.color) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// Largest difference between the selection probabilities implied by the
+// sampler's tables (and its pdf()) and powers / sum. Tables that alias
+// outside of their block fail outright.
+static double maxError(const LightSampler &sampler,
+                       const vector<float> &powers)
+{
+    uint32_t num_lights = sampler.size();
+    uint32_t num_blocks = sampler.numBlocks();
+    if (num_lights != powers.size()) {
+        return INFINITY;
+    }
+
+    vector<double> block_probs(num_blocks, 0.0);
+    for (uint32_t block_idx = 0; block_idx < num_blocks; block_idx++) {
+        const AliasEntry &entry = sampler.getBlockEntries()[block_idx];
+        if (entry.alias >= num_blocks) {
+            return INFINITY;
+        }
+
+        block_probs[block_idx] += entry.keep / double(num_blocks);
+        block_probs[entry.alias] += (1.0 - entry.keep) / double(num_blocks);
+    }
+
+    vector<double> probs(num_lights, 0.0);
+    for (uint32_t block_idx = 0; block_idx < num_blocks; block_idx++) {
+        uint32_t begin = block_idx * LightSampler::blockSize;
+        uint32_t len = min(num_lights - begin, LightSampler::blockSize);
+
+        for (uint32_t i = begin; i < begin + len; i++) {
+            const AliasEntry &entry = sampler.getEntries()[i];
+            if (entry.alias < begin || entry.alias >= begin + len) {
+                return INFINITY;
+            }
+
+            probs[i] += block_probs[block_idx] * entry.keep / len;
+            probs[entry.alias] +=
+                block_probs[block_idx] * (1.0 - entry.keep) / len;
+        }
+    }
+
+    double sum = 0.0;
+    for (float power : powers) {
+        sum += power;
+    }
+
+    double max_err = 0.0;
+    for (uint32_t i = 0; i < num_lights; i++) {
+        double expected = sum > 0.0 ? powers[i] / sum : 1.0 / num_lights;
+        max_err = max(max_err, fabs(probs[i] - expected));
+        max_err = max(max_err, fabs(sampler.pdf(i) - expected));
+    }
+
+    return max_err;
+}
+
+// Alias tables against the powers they were built from: built from the
+// scene, after incremental block updates, assigned, forked and reset
+static bool checkAliasTables(mt19937 &rng)
+{
+    constexpr uint32_t num_lights = 3000;
+    constexpr double tolerance = 1e-5;
+
+    uniform_real_distribution<float> power_dist(0.f, 10.f);
+
+    // Some unlit lights, so zero weight slots are covered
+    auto randomPower = [&]() {
+        return rng() % 5 == 0 ? 0.f : power_dist(rng);
+    };
+
+    vector<float> scene_powers(num_lights);
+    for (float &power : scene_powers) {
+        power = randomPower();
+    }
+
+    LightSamplerInit init(scene_powers);
+    LightSampler sampler(init);
+
+    bool passed = true;
+    auto matches = [&](const char *what, const LightSampler &s,
+                       const vector<float> &expected) {
+        passed &= check(maxError(s, expected) <= tolerance, what);
+    };
+
+    matches("alias tables for the scene lights", sampler, scene_powers);
+
+    // Random edits, mirrored on a plain vector in the same swap remove
+    // order the backends use
+    vector<float> powers = scene_powers;
+    bool incremental_match = true;
+    for (int i = 0; i < 5000; i++) {
+        uint32_t op = rng() % 3;
+        if (op == 0 || powers.size() < 2) {
+            float power = randomPower();
+            sampler.push(power);
+            powers.push_back(power);
+        } else if (op == 1) {
+            uint32_t idx = rng() % powers.size();
+            float power = randomPower();
+            sampler.set(idx, power);
+            powers[idx] = power;
+        } else {
+            uint32_t idx = rng() % powers.size();
+            sampler.swapRemove(idx);
+            powers[idx] = powers.back();
+            powers.pop_back();
+        }
+
+        if (i % 97 == 0) {
+            sampler.update();
+            incremental_match &= maxError(sampler, powers) <= tolerance;
+        }
+    }
+    sampler.update();
+    incremental_match &= maxError(sampler, powers) <= tolerance;
+    passed &= check(incremental_match, "incremental alias table updates");
+
+    LightSampler restored(init);
+    restored.assign(sampler.getPowers().fork());
+    restored.update();
+    matches("alias tables after assign", restored, powers);
+
+    LightSampler forked = sampler.fork();
+    forked.set(0, 100.f);
+    forked.update();
+    vector<float> forked_powers = powers;
+    forked_powers[0] = 100.f;
+    matches("alias tables of a fork", forked, forked_powers);
+    matches("alias tables of the fork source", sampler, powers);
+
+    // Selection frequencies, 5 sigma per light
+    uint32_t num_samples = 100 * forked.size();
+    uniform_real_distribution<float> unit_dist(0.f, 1.f);
+    vector<uint32_t> counts(forked.size(), 0);
+    for (uint32_t i = 0; i < num_samples; i++) {
+        counts[forked.sample(unit_dist(rng), unit_dist(rng))]++;
+    }
+
+    uint32_t num_outliers = 0;
+    for (uint32_t i = 0; i < forked.size(); i++) {
+        double expected = forked.pdf(i) * num_samples;
+        if (fabs(counts[i] - expected) > 5.0 * sqrt(expected) + 1.0) {
+            num_outliers++;
+        }
+    }
+    passed &= check(num_outliers == 0, "light selection frequencies");
+
+    sampler.reset();
+    matches("alias tables after reset", sampler, scene_powers);
+
+    vector<float> unlit(LightSampler::blockSize * 2 + 3, 0.f);
+    LightSamplerInit unlit_init(unlit);
+    LightSampler unlit_sampler(unlit_init);
+    matches("alias tables with every light unlit", unlit_sampler, unlit);
+
+    return passed;
+}
+
+int main()
+{
+    bool passed = true;
+
+    auto scene = makeTestScene({ 4, 3, 10, 5.f, 6, {}, true });
+    Renderer renderer(testRenderConfig());
+
+    Environment env = renderer.makeEnvironment(scene);
+    Model model = sceneModel(*scene);
+    passed &= check(checkModel(env, model), "initial scene lights");
+
+    // Removing the sphere light moves the portal in front of the
+    // triangle, and the point light reuses the sphere's ID
+    env.removeLight(0);
+    model.remove(0);
+
+    glm::vec3 point_pos(1.f, 2.f, 3.f);
+    glm::vec3 point_color(4.f, 5.f, 6.f);
+    uint32_t point_id = env.addLight(point_pos, point_color);
+    model.add(point_id, point_pos, point_color);
+
+    passed &= check(point_id == 0 && checkModel(env, model),
+                    "removed scene light");
+
+    EnvironmentSnapshot snapshot = env.snapshot();
+
+    {
+        Environment restored = renderer.makeEnvironment(scene);
+        passed &= check(restored.restore(snapshot) &&
+                        checkModel(restored, model),
+                        "restore keeps scene light descriptors");
+    }
+
+    {
+        Environment forked = renderer.forkEnvironment(env);
+        passed &= check(checkModel(forked, model),
+                        "fork keeps scene light descriptors");
+    }
+
+    // Restoring over an environment whose lights diverged differently
+    {
+        Environment other = renderer.makeEnvironment(scene);
+        other.removeLight(2);
+        other.addLight(glm::vec3(7.f), glm::vec3(8.f));
+        other.removeLight(1);
+
+        passed &= check(other.restore(snapshot) && checkModel(other, model),
+                        "restore over diverged lights");
+
+        other.reset();
+        passed &= check(checkModel(other, sceneModel(*scene)),
+                        "reset returns to scene lights");
+    }
+
+    // Random edits, checkpoints and forks
+    {
+        mt19937 rng(21);
+        uniform_real_distribution<float> unit(0.f, 1.f);
+
+        Environment cur = renderer.makeEnvironment(scene);
+        Model cur_model = sceneModel(*scene);
+
+        EnvironmentSnapshot checkpoint = cur.snapshot();
+        Model checkpoint_model = cur_model;
+
+        bool matches = true;
+        for (uint32_t iter = 0; iter < 2000; iter++) {
+            uint32_t op = rng() % 10;
+            uint32_t num_lights = cur_model.lights.size();
+
+            if (op < 3 || num_lights == 0) {
+                glm::vec3 pos(unit(rng), unit(rng), unit(rng));
+                glm::vec3 color(unit(rng), unit(rng), unit(rng));
+                uint32_t id = cur.addLight(pos, color);
+                cur_model.add(id, pos, color);
+            } else if (op < 6) {
+                uint32_t id = cur_model.lights[rng() % num_lights].id;
+                cur.removeLight(id);
+                cur_model.remove(id);
+            } else if (op == 6) {
+                checkpoint = cur.snapshot();
+                checkpoint_model = cur_model;
+            } else if (op == 7) {
+                matches &= cur.restore(checkpoint);
+                cur_model = checkpoint_model;
+            } else if (op == 8) {
+                cur = renderer.forkEnvironment(cur);
+            } else {
+                cur.reset();
+                cur_model = sceneModel(*scene);
+            }
+
+            matches &= checkModel(cur, cur_model);
+        }
+
+        passed &= check(matches, "random light edits, restores and forks");
+    }
+
+    {
+        mt19937 rng(0);
+        passed &= checkAliasTables(rng);
+    }
+
+    if (!passed) {
+        return EXIT_FAILURE;
+    }
+
+    cout << "All light checks passed" << endl;
+}
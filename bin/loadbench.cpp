@@ -0,0 +1,67 @@
+#include <rlpbr.hpp>
+#include <rlpbr_core/load_pipeline.hpp>
+
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+using namespace std;
+using namespace RLpbr;
+
+static void printStage(const char *name, const LoadStageStats &stage,
+                       uint32_t num_workers, double total_secs)
+{
+    double mib = double(stage.numBytes) / (1024.0 * 1024.0);
+
+    cout << name << ": " << stage.numItems << " items, " << mib << " MiB, "
+         << num_workers << " workers, busy " << stage.busySeconds << "s, "
+         << (stage.busySeconds > 0 ? mib / stage.busySeconds : 0.0)
+         << " MiB/s per worker, "
+         << stage.numItems / total_secs << " items/s overall"
+         << endl;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 7) {
+        cerr << argv[0] <<
+            " null|vulkan read_workers decode_workers stage_workers " <<
+            "max_in_flight scenes..." << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    bool null_upload = !strcmp(argv[1], "null");
+
+    LoadPipelineConfig cfg {
+        (uint32_t)stoul(argv[2]),
+        (uint32_t)stoul(argv[3]),
+        (uint32_t)stoul(argv[4]),
+        (uint32_t)stoul(argv[5]),
+    };
+
+    uint32_t num_scenes = argc - 6;
+    const char **scene_paths = (const char **)argv + 6;
+
+    LoadPipelineStats stats;
+    if (null_upload) {
+        // Exercises read / decode / stage without touching the GPU
+        NullUploadSink sink(~0u);
+        SceneLoadPipeline pipeline(sink, cfg);
+        pipeline.load(scene_paths, num_scenes, &stats);
+    } else {
+        Renderer renderer({0, 1, 1, 64, 64, 1, 1, 0,
+            RenderMode::PathTracer, {}, 0.f, BackendSelect::Vulkan});
+
+        auto loader = renderer.makeLoader();
+        auto scenes = loader.loadScenes(scene_paths, num_scenes, cfg, &stats);
+    }
+
+    cout << "Loaded " << num_scenes << " scenes in " << stats.totalSeconds
+         << "s (" << num_scenes / stats.totalSeconds << " scenes/s)" << endl;
+
+    printStage("Read", stats.read, cfg.numReadWorkers, stats.totalSeconds);
+    printStage("Decode", stats.decode, cfg.numDecodeWorkers,
+               stats.totalSeconds);
+    printStage("Stage", stats.stage, cfg.numStageWorkers, stats.totalSeconds);
+    printStage("Upload", stats.upload, 1, stats.totalSeconds);
+}
@@ -1,4 +1,5 @@
 #include <rlpbr.hpp>
+#include <rlpbr_core/tonemap.hpp>
 #include <iostream>
 #include <fstream>
 #include <cstdlib>
@@ -28,31 +29,6 @@ static vector<T> copyToHost(const T *dev_ptr, uint32_t width,
     return buffer;
 }
 
-float toSRGB(float v)
-{
-    if (v <= 0.00031308f) {
-        return 12.92f * v;
-    } else {
-        return 1.055f*powf(v,(1.f / 2.4f)) - 0.055f;
-    }
-}
-
-glm::vec3 tonemap(glm::vec3 v)
-{
-    //v *= 0.6;
-
-    //float A = 2.51f;
-    //float B = 0.03f;
-    //float C = 2.43f;
-    //float D = 0.59f;
-    //float E = 0.14f;
-
-    //v = clamp((v*(A*v+B))/(v*(C*v+D)+E), 0.f, 1.f);
-    //return v;
-    
-    return v * (1.f + (v / 0.15f)) / (1.f + v);
-}
-
 void saveFrame(const char *fname, const half *dev_ptr,
                uint32_t width, uint32_t height, uint32_t num_channels)
 {
@@ -73,9 +49,9 @@ void saveFrame(const char *fname, const half *dev_ptr,
 
         assert(rgb.r >= 0 && rgb.g >= 0 && rgb.b >= 0);
 
-        glm::vec3 tonemapped = tonemap(rgb);
+        glm::vec3 tonemapped = reinhardChannelTonemap(rgb, 0.15f);
         for (int j = 0; j < 3; j++) {
-            float v = toSRGB(tonemapped[j]);
+            float v = linearToSRGB(tonemapped[j]);
             if (v < 0) v = 0.f;
             if (v > 1) v = 1.f;
             sdr_buffer[k + j] = uint8_t(v * 255.f);
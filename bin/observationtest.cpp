@@ -0,0 +1,296 @@
+#include <rlpbr_core/batch_prep.hpp>
+#include <rlpbr_core/observations.hpp>
+#include <rlpbr_core/tonemap.hpp>
+
+#include "test_util.hpp"
+
+#include <glm/gtc/packing.hpp>
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <vector>
+
+using namespace std;
+using namespace RLpbr;
+
+static uint32_t floatBits(float v)
+{
+    uint32_t bits;
+    memcpy(&bits, &v, sizeof(uint32_t));
+    return bits;
+}
+
+// Vector is the AVX2 + F16C kernels where the CPU supports them, so both
+// sets are checked against the scalar reference
+static const ObservationKernels vector_kernels[] {
+    ObservationKernels::Baseline,
+    ObservationKernels::Vector,
+};
+
+static bool checkHalfToFloat()
+{
+    vector<uint16_t> halves(1 << 16);
+    for (uint32_t i = 0; i < halves.size(); i++) {
+        halves[i] = uint16_t(i);
+    }
+
+    // Odd count leaves a scalar tail after the vector loop
+    uint32_t num_values = halves.size() - 3;
+    vector<float> simd(num_values), scalar(num_values);
+    halfToFloat(halves.data(), num_values, scalar.data(),
+                ObservationKernels::Scalar);
+
+    bool bit_exact = true, matches_glm = true;
+    for (ObservationKernels kernels : vector_kernels) {
+        halfToFloat(halves.data(), num_values, simd.data(), kernels);
+        for (uint32_t i = 0; i < num_values; i++) {
+            bit_exact &= floatBits(simd[i]) == floatBits(scalar[i]);
+        }
+    }
+
+    for (uint32_t i = 0; i < num_values; i++) {
+        if (!isnan(scalar[i])) {
+            matches_glm &= floatBits(scalar[i]) ==
+                floatBits(glm::unpackHalf1x16(halves[i]));
+        }
+    }
+
+    bool passed = true;
+    passed &= check(bit_exact, "vector half conversion");
+    passed &= check(matches_glm, "scalar half conversion");
+
+    return passed;
+}
+
+// Edge cases followed by random values around [0, 1]
+static vector<float> quantizeInputs(mt19937 &rng)
+{
+    vector<float> values {
+        0.f, -0.f, 1.f, -1.f, 2.f, 0.5f, 0.5f / 255.f, 1.5f / 255.f,
+        254.5f / 255.f, 1e-30f, 1e-3f, 0.0031308f, 0.04045f,
+        numeric_limits<float>::infinity(),
+        -numeric_limits<float>::infinity(),
+        numeric_limits<float>::quiet_NaN(),
+        numeric_limits<float>::denorm_min(),
+    };
+
+    for (uint32_t i = 0; i < 256; i++) {
+        values.push_back((float(i) + 0.5f) / 255.f);
+    }
+
+    uniform_real_distribution<float> dist(-0.1f, 1.1f);
+    uniform_real_distribution<float> log_dist(-20.f, 0.f);
+    for (int i = 0; i < 100000; i++) {
+        values.push_back(dist(rng));
+        values.push_back(exp2f(log_dist(rng)));
+    }
+    values.push_back(0.25f);
+
+    return values;
+}
+
+static bool checkQuantize(mt19937 &rng)
+{
+    bool passed = true;
+
+    vector<float> values = quantizeInputs(rng);
+    uint32_t num_values = values.size();
+
+    vector<uint8_t> simd(num_values), scalar(num_values);
+
+    quantizeUnorm8(values.data(), num_values, scalar.data(),
+                   ObservationKernels::Scalar);
+    for (ObservationKernels kernels : vector_kernels) {
+        quantizeUnorm8(values.data(), num_values, simd.data(), kernels);
+        passed &= check(simd == scalar, "vector unorm8");
+    }
+    passed &= check(scalar[0] == 0 && scalar[2] == 255 &&
+                    scalar[3] == 0 && scalar[4] == 255 &&
+                    scalar[5] == 128 && scalar[15] == 0,
+                    "unorm8 values");
+
+    quantizeSRGB8(values.data(), num_values, scalar.data(),
+                  ObservationKernels::Scalar);
+    for (ObservationKernels kernels : vector_kernels) {
+        quantizeSRGB8(values.data(), num_values, simd.data(), kernels);
+        passed &= check(simd == scalar, "vector sRGB8");
+    }
+
+    // Against the exact curve
+    uint32_t max_error = 0, num_off = 0, num_checked = 0;
+    for (uint32_t i = 0; i < num_values; i++) {
+        float v = values[i];
+        if (isnan(v)) {
+            passed &= check(scalar[i] == 0, "sRGB8 NaN");
+            continue;
+        }
+
+        float clamped = min(max(v, 0.f), 1.f);
+        int exact = int(linearToSRGB(clamped) * 255.f + 0.5f);
+        uint32_t error = abs(exact - int(scalar[i]));
+        max_error = max(max_error, error);
+        num_off += error != 0;
+        num_checked++;
+    }
+
+    passed &= check(max_error <= 1, "sRGB8 error");
+    passed &= check(num_off * 1000 < num_checked, "sRGB8 rounding");
+
+    // Monotonic over [0, 1]
+    vector<float> ramp(1 << 16);
+    for (uint32_t i = 0; i < ramp.size(); i++) {
+        ramp[i] = float(i) / float(ramp.size() - 1);
+    }
+    vector<uint8_t> ramp_out(ramp.size());
+    quantizeSRGB8(ramp.data(), ramp.size(), ramp_out.data());
+
+    bool monotonic = true;
+    for (uint32_t i = 1; i < ramp.size(); i++) {
+        monotonic &= ramp_out[i] >= ramp_out[i - 1];
+    }
+    passed &= check(monotonic && ramp_out.front() == 0 &&
+                    ramp_out.back() == 255, "sRGB8 ramp");
+
+    return passed;
+}
+
+// Random half images: mostly values in [0, 2), some specials
+static vector<uint16_t> makeSource(mt19937 &rng, uint32_t num_values)
+{
+    uniform_real_distribution<float> dist(0.f, 2.f);
+    uniform_int_distribution<uint32_t> special(0, 99);
+    uniform_int_distribution<uint32_t> bits(0, 0xFFFF);
+
+    vector<uint16_t> data(num_values);
+    for (uint16_t &v : data) {
+        v = special(rng) == 0 ? uint16_t(bits(rng)) :
+            glm::packHalf1x16(dist(rng));
+    }
+
+    return data;
+}
+
+static bool checkConvert(mt19937 &rng, BatchPrepPool &pool)
+{
+    bool passed = true;
+
+    ObservationSource src;
+    src.batchSize = 5;
+    src.width = 38;
+    src.height = 22;
+    src.numChannels = 4;
+
+    vector<uint16_t> data = makeSource(
+        rng, src.batchSize * src.width * src.height * src.numChannels);
+    src.data = data.data();
+
+    ObservationFormat formats[] {
+        { ObservationType::Float32, ObservationLayout::HWC,
+          { 0, 1, 2, 3 }, 4, 1, -1, 0.f, 0.f },
+        { ObservationType::Float32, ObservationLayout::CHW,
+          { 2, 1, 0 }, 3, 2, -1, 0.f, 0.f },
+        { ObservationType::Unorm8, ObservationLayout::HWC,
+          { 0, 1, 2 }, 3, 1, -1, 0.f, 0.f },
+        { ObservationType::Unorm8, ObservationLayout::CHW,
+          { 0 }, 1, 2, 0, 0.5f, 1.5f },
+        { ObservationType::SRGB8, ObservationLayout::HWC,
+          { 0, 1, 2 }, 3, 2, -1, 0.f, 0.f },
+        { ObservationType::SRGB8, ObservationLayout::CHW,
+          { 1, 0 }, 2, 1, -1, 0.f, 0.f },
+        { ObservationType::Float32, ObservationLayout::CHW,
+          { 0 }, 1, 1, 0, 0.f, 2.f },
+    };
+
+    for (const ObservationFormat &fmt : formats) {
+        uint64_t num_bytes = observationBytes(src, fmt);
+        vector<uint8_t> simd(num_bytes), scalar(num_bytes);
+
+        convertObservationsScalar(src, fmt, scalar.data());
+
+        for (ObservationKernels kernels : vector_kernels) {
+            convertObservations(src, fmt, simd.data(), pool, kernels);
+            passed &= check(simd == scalar, "batch conversion");
+        }
+    }
+
+    // Layouts, channel selection, downsampling and depth on known values
+    src.batchSize = 2;
+    src.width = 4;
+    src.height = 2;
+    src.numChannels = 3;
+
+    vector<uint16_t> known(src.batchSize * src.width * src.height * 3);
+    for (uint32_t i = 0; i < known.size(); i++) {
+        known[i] = glm::packHalf1x16(float(i));
+    }
+    src.data = known.data();
+
+    ObservationFormat hwc { ObservationType::Float32,
+        ObservationLayout::HWC, { 2, 0 }, 2, 1, -1, 0.f, 0.f };
+    ObservationFormat chw = hwc;
+    chw.layout = ObservationLayout::CHW;
+
+    vector<float> hwc_out(observationBytes(src, hwc) / sizeof(float));
+    vector<float> chw_out(hwc_out.size());
+    convertObservations(src, hwc, hwc_out.data(), pool);
+    convertObservations(src, chw, chw_out.data(), pool);
+
+    bool layouts = true;
+    for (uint32_t b = 0; b < src.batchSize; b++) {
+        for (uint32_t p = 0; p < src.width * src.height; p++) {
+            for (uint32_t c = 0; c < 2; c++) {
+                float expected =
+                    float((b * src.width * src.height + p) * 3 +
+                          hwc.channels[c]);
+                layouts &= hwc_out[(b * 8 + p) * 2 + c] == expected;
+                layouts &= chw_out[(b * 2 + c) * 8 + p] == expected;
+            }
+        }
+    }
+    passed &= check(layouts, "HWC and CHW layouts");
+
+    ObservationFormat box { ObservationType::Float32,
+        ObservationLayout::CHW, { 1 }, 1, 2, -1, 0.f, 0.f };
+    vector<float> box_out(observationBytes(src, box) / sizeof(float));
+    convertObservations(src, box, box_out.data(), pool);
+
+    // Pixel (x, y) of image 0 holds (y * 4 + x) * 3 + c
+    float box_expected = ((0 + 1 + 4 + 5) * 3 + 4 * 1) / 4.f;
+    passed &= check(box_out.size() == 4 && box_out[0] == box_expected,
+                    "box downsample");
+
+    ObservationFormat depth { ObservationType::Float32,
+        ObservationLayout::CHW, { 0 }, 1, 1, 0, 3.f, 7.f };
+    vector<float> depth_out(observationBytes(src, depth) / sizeof(float));
+    convertObservations(src, depth, depth_out.data(), pool);
+
+    // Depths 0 (miss), 3, 6, 9, ...
+    passed &= check(depth_out[0] == 1.f && depth_out[1] == 0.f &&
+                    depth_out[2] == 0.75f && depth_out[3] == 1.f,
+                    "depth normalization");
+
+    return passed;
+}
+
+int main()
+{
+    mt19937 rng(0);
+    BatchPrepPool pool(4);
+
+    bool passed = true;
+    passed &= checkHalfToFloat();
+    passed &= checkQuantize(rng);
+    passed &= checkConvert(rng, pool);
+
+    if (!passed) {
+        return EXIT_FAILURE;
+    }
+
+    cout << "All observation checks passed (" <<
+        (observationKernelsAVX2() ? "AVX2" : "baseline") <<
+        " vector kernels)" << endl;
+}
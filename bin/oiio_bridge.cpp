@@ -5,45 +5,50 @@ using namespace std;
 
 namespace RLpbr {
 
-void saveSDR(const char *fname, uint32_t width, uint32_t height,
-             const uint8_t *data)
+static bool saveImage(const char *fname, uint32_t width, uint32_t height,
+                      uint32_t num_channels, OIIO::TypeDesc type,
+                      const void *data)
 {
     using namespace OIIO;
 
-    auto png_out = ImageOutput::create(fname);
-    if (!png_out) {
-        cerr << "Failed to write SDR image" << endl;
-        return;
+    auto out = ImageOutput::create(fname);
+    if (!out) {
+        cerr << "Failed to write " << fname << ": " << OIIO::geterror()
+             << endl;
+        return false;
     }
 
-    ImageSpec spec(width, height, 3, TypeDesc::UINT8);
-    png_out->open(fname, spec);
-    png_out->write_image(TypeDesc::UINT8, data);
-    png_out->close();
+    ImageSpec spec(width, height, num_channels, type);
+    bool success = out->open(fname, spec) &&
+        out->write_image(type, data) &&
+        out->close();
+
+    if (!success) {
+        cerr << "Failed to write " << fname << ": " << out->geterror()
+             << endl;
+    }
+
+    return success;
 }
 
-void saveHDR(const char *fname, uint32_t width, uint32_t height,
-             const void *data, bool half)
+bool saveSDR(const char *fname, uint32_t width, uint32_t height,
+             const uint8_t *data, uint32_t num_channels)
 {
-    using namespace OIIO;
-
-    auto hdr_out = ImageOutput::create(fname);
-    if (!hdr_out) {
-        cerr << "Failed to write SDR image" << endl;
-        return;
-    }
+    return saveImage(fname, width, height, num_channels,
+                     OIIO::TypeDesc::UINT8, data);
+}
 
-    TypeDesc type;
+bool saveHDR(const char *fname, uint32_t width, uint32_t height,
+             const void *data, bool half, uint32_t num_channels)
+{
+    OIIO::TypeDesc type;
     if (half) {
-        type = TypeDesc::HALF;
+        type = OIIO::TypeDesc::HALF;
     } else {
-        type = TypeDesc::FLOAT;
+        type = OIIO::TypeDesc::FLOAT;
     }
 
-    ImageSpec spec(width, height, 3, type);
-    hdr_out->open(fname, spec);
-    hdr_out->write_image(type, data);
-    hdr_out->close();
+    return saveImage(fname, width, height, num_channels, type, data);
 }
 
 }
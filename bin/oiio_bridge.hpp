@@ -1,11 +1,15 @@
 #pragma once
 
+#include <cstdint>
+
 namespace RLpbr {
 
-void saveSDR(const char *fname, uint32_t width, uint32_t height,
-             const uint8_t *data);
+// Both return false and print the error on failure
+
+bool saveSDR(const char *fname, uint32_t width, uint32_t height,
+             const uint8_t *data, uint32_t num_channels = 3);
 
-void saveHDR(const char *fname, uint32_t width, uint32_t height,
-             const void *data, bool half);
+bool saveHDR(const char *fname, uint32_t width, uint32_t height,
+             const void *data, bool half, uint32_t num_channels = 3);
 
 }
@@ -0,0 +1,366 @@
+#include <rlpbr_core/load_pipeline.hpp>
+#include <rlpbr_core/textures.hpp>
+#include <rlpbr_core/utils.hpp>
+
+#include "test_util.hpp"
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+
+using namespace std;
+using namespace RLpbr;
+
+namespace fs = std::filesystem;
+
+// Texel (x, y) of level of texture id
+static uint8_t texelValue(uint32_t id, uint32_t level, uint32_t x,
+                          uint32_t y, uint32_t channel)
+{
+    return uint8_t(id * 31 + level * 67 + x * 3 + y * 5 + channel * 11);
+}
+
+// .tex file with num_levels square levels halving from res. Levels are
+// stored as binary PPMs, which stb decodes like the PNGs the
+// preprocessor writes (alpha reads back as 255).
+static void writeTexture(const fs::path &path, uint32_t id, uint32_t res,
+                         uint32_t num_levels)
+{
+    vector<string> levels;
+    for (uint32_t level = 0; level < num_levels; level++) {
+        uint32_t level_res = res >> level;
+        string ppm = "P6\n" + to_string(level_res) + " " +
+            to_string(level_res) + "\n255\n";
+        for (uint32_t y = 0; y < level_res; y++) {
+            for (uint32_t x = 0; x < level_res; x++) {
+                for (uint32_t c = 0; c < 3; c++) {
+                    ppm.push_back(char(texelValue(id, level, x, y, c)));
+                }
+            }
+        }
+        levels.push_back(move(ppm));
+    }
+
+    vector<uint32_t> header { 0x50505050, num_levels };
+    uint32_t offset = 0;
+    for (uint32_t level = 0; level < num_levels; level++) {
+        uint32_t level_res = res >> level;
+        header.insert(header.end(), {
+            level_res, level_res, offset, uint32_t(levels[level].size()) });
+        offset += levels[level].size();
+    }
+
+    ofstream file(path, ios::binary);
+    file.write((const char *)header.data(), header.size() * sizeof(uint32_t));
+    for (const string &level : levels) {
+        file.write(level.data(), level.size());
+    }
+}
+
+// Checks a decoded texture against writeTexture's contents, starting at
+// first_level
+static bool checkDecoded(const DecodedTexture &tex, uint32_t id,
+                         uint32_t res, uint32_t num_levels,
+                         uint32_t first_level, uint32_t texel_bytes)
+{
+    if (tex.numLevels != num_levels - first_level ||
+        tex.texelBytes != texel_bytes ||
+        tex.dims.x != (res >> first_level) ||
+        tex.bias != -float(first_level)) {
+        return false;
+    }
+
+    uint32_t offset = 0;
+    for (uint32_t level = first_level; level < num_levels; level++) {
+        offset = alignOffset(offset, max(texel_bytes, 4u));
+        uint32_t level_res = res >> level;
+        for (uint32_t y = 0; y < level_res; y++) {
+            for (uint32_t x = 0; x < level_res; x++) {
+                for (uint32_t c = 0; c < texel_bytes; c++) {
+                    uint8_t expected = c < 3 ?
+                        texelValue(id, level, x, y, c) : 255;
+                    if (tex.data[offset++] != expected) {
+                        return false;
+                    }
+                }
+            }
+        }
+    }
+
+    return offset == tex.numBytes;
+}
+
+// A scene in the oldest .bps layout with no geometry, only textures and
+// num_staging_bytes of staging data. Texture ids are the scene index times
+// 100 plus the position in the list.
+struct TestScene {
+    string path;
+    uint32_t sceneIdx;
+    vector<uint8_t> staging;
+    // Texel bytes of each texture in getSceneTextureRequests order
+    vector<uint32_t> texelBytes;
+};
+
+static TestScene writeScene(const fs::path &dir, uint32_t scene_idx,
+                            uint32_t num_base, uint32_t num_mr,
+                            uint32_t num_transmission,
+                            uint32_t num_staging_bytes)
+{
+    TestScene scene;
+    scene.path = (dir / ("scene_" + to_string(scene_idx) + ".bps")).string();
+    scene.sceneIdx = scene_idx;
+
+    mt19937 rng(scene_idx);
+    scene.staging.resize(num_staging_bytes);
+    for (uint8_t &v : scene.staging) {
+        v = uint8_t(rng());
+    }
+
+    ofstream file(scene.path, ios::binary);
+
+    auto write = [&](const void *data, size_t num_bytes) {
+        file.write((const char *)data, num_bytes);
+    };
+    auto writeUint = [&](uint32_t v) {
+        write(&v, sizeof(uint32_t));
+    };
+    auto writeString = [&](const string &str) {
+        write(str.c_str(), str.size() + 1);
+    };
+    auto alignPad = [&]() {
+        while (file.tellp() % 256 != 0) {
+            file.put(0);
+        }
+    };
+
+    writeUint(0x55555555);
+
+    StagingHeader hdr {};
+    hdr.totalBytes = num_staging_bytes;
+    write(&hdr, sizeof(StagingHeader));
+    alignPad();
+
+    // No meshes, objects or lights
+    writeUint(0);
+
+    writeString("textures/");
+    writeString("");
+
+    uint32_t tex_id = scene_idx * 100;
+    auto writeNames = [&](uint32_t num_textures, uint32_t texel_bytes) {
+        writeUint(num_textures);
+        for (uint32_t i = 0; i < num_textures; i++) {
+            string name = to_string(tex_id++) + ".tex";
+            writeString(name);
+            scene.texelBytes.push_back(texel_bytes);
+        }
+    };
+
+    // base, metallicRoughness, specular, normal, emittance, transmission,
+    // clearcoat, anisotropic
+    writeNames(num_base, 4);
+    writeNames(num_mr, 2);
+    writeNames(0, 4);
+    writeNames(0, 2);
+    writeNames(0, 4);
+    writeNames(num_transmission, 1);
+    writeNames(0, 2);
+    writeNames(0, 2);
+
+    // Instance materials, default bbox, instances, physics, SDFs
+    writeUint(0);
+    AABB bbox {};
+    write(&bbox, sizeof(AABB));
+    writeUint(0);
+    writeUint(0);
+    writeUint(0);
+    writeUint(0);
+    alignPad();
+
+    write(scene.staging.data(), scene.staging.size());
+
+    return scene;
+}
+
+constexpr uint32_t texRes = 32;
+constexpr uint32_t texLevels = 4;
+
+static void writeSceneTextures(const fs::path &dir, const TestScene &scene)
+{
+    for (uint32_t i = 0; i < scene.texelBytes.size(); i++) {
+        uint32_t id = scene.sceneIdx * 100 + i;
+        writeTexture(dir / "textures" / (to_string(id) + ".tex"), id,
+                     texRes, texLevels);
+    }
+}
+
+// Checks everything the CPU stages produce, then lets NullUploadSink
+// stage it as usual
+class CheckingSink : public NullUploadSink {
+public:
+    CheckingSink(const vector<TestScene> &scenes,
+                 uint32_t max_texture_resolution)
+        : NullUploadSink(max_texture_resolution),
+          scenes_(scenes),
+          first_level_(0),
+          num_staged_(0),
+          num_failed_(0)
+    {
+        while ((texRes >> first_level_) > max_texture_resolution) {
+            first_level_++;
+        }
+    }
+
+    void stage(PreparedScene &scene) override
+    {
+        const TestScene *expected = nullptr;
+        for (const TestScene &candidate : scenes_) {
+            if (scene.loadData.scenePath == candidate.path) {
+                expected = &candidate;
+            }
+        }
+
+        bool matches = expected != nullptr &&
+            scene.textures.size() == expected->texelBytes.size();
+
+        for (uint32_t i = 0; matches && i < scene.textures.size(); i++) {
+            matches &= checkDecoded(scene.textures[i],
+                                    expected->sceneIdx * 100 + i,
+                                    texRes, texLevels, first_level_,
+                                    expected->texelBytes[i]);
+        }
+
+        if (matches) {
+            vector<uint8_t> staging(scene.loadData.hdr.totalBytes);
+            scene.loadData.readData(staging.data());
+            matches &= staging == expected->staging;
+        }
+
+        if (!matches) {
+            num_failed_++;
+        }
+        num_staged_++;
+
+        NullUploadSink::stage(scene);
+    }
+
+    uint32_t numStaged() const { return num_staged_; }
+    uint32_t numFailed() const { return num_failed_; }
+
+private:
+    const vector<TestScene> &scenes_;
+    uint32_t first_level_;
+    atomic_uint32_t num_staged_;
+    atomic_uint32_t num_failed_;
+};
+
+int main()
+{
+    bool passed = true;
+
+    fs::path dir = fs::temp_directory_path() /
+        ("rlpbr_pipelinetest_" + to_string(random_device()()));
+    fs::remove_all(dir);
+    fs::create_directories(dir / "textures");
+
+    // readTextures on its own, with more textures than the process may
+    // have files open
+    {
+        const uint32_t num_textures = 200;
+        vector<TextureLoadRequest> reqs;
+        for (uint32_t i = 0; i < num_textures; i++) {
+            fs::path path = dir / "textures" / ("single_" + to_string(i) +
+                                                ".tex");
+            writeTexture(path, i, texRes, texLevels);
+            reqs.push_back({ path.string(), i % 2 == 0 ? 4u : 1u });
+        }
+
+        rlimit orig_limit;
+        getrlimit(RLIMIT_NOFILE, &orig_limit);
+        rlimit low_limit = orig_limit;
+        low_limit.rlim_cur = min<rlim_t>(orig_limit.rlim_cur, 64);
+        setrlimit(RLIMIT_NOFILE, &low_limit);
+
+        vector<CompressedTexture> compressed =
+            readTextures(reqs.data(), num_textures, texRes / 2, 16);
+
+        setrlimit(RLIMIT_NOFILE, &orig_limit);
+
+        bool matches = compressed.size() == num_textures;
+        for (uint32_t i = 0; matches && i < num_textures; i++) {
+            DecodedTexture decoded = decodeTexture(compressed[i]);
+            matches &= checkDecoded(decoded, i, texRes, texLevels, 1,
+                                    reqs[i].texelBytes);
+            free(decoded.data);
+        }
+        passed &= check(matches, "bounded readTextures contents");
+    }
+
+    vector<TestScene> scenes;
+    for (uint32_t i = 0; i < 12; i++) {
+        scenes.push_back(writeScene(dir, i, 1 + i % 3, i % 2, i % 4 == 0,
+                                    4096 + i * 1000));
+        writeSceneTextures(dir, scenes.back());
+    }
+
+    // No textures at all
+    scenes.push_back(writeScene(dir, 12, 0, 0, 0, 100));
+
+    vector<const char *> scene_paths;
+    uint64_t num_textures = 0;
+    for (const TestScene &scene : scenes) {
+        scene_paths.push_back(scene.path.c_str());
+        num_textures += scene.texelBytes.size();
+    }
+
+    const LoadPipelineConfig configs[] = {
+        { 1, 1, 1, 1 },
+        { 2, 3, 2, 4 },
+        { 4, 8, 4, 13 },
+    };
+
+    for (uint32_t max_res : { ~0u, texRes / 4 }) {
+        for (const LoadPipelineConfig &cfg : configs) {
+            CheckingSink sink(scenes, max_res);
+            SceneLoadPipeline pipeline(sink, cfg);
+
+            LoadPipelineStats stats;
+            vector<shared_ptr<Scene>> loaded =
+                pipeline.load(scene_paths.data(), scene_paths.size(),
+                              &stats);
+
+            passed &= check(loaded.size() == scenes.size(),
+                            "one result per scene");
+            passed &= check(sink.numStaged() == scenes.size(),
+                            "every scene staged");
+            passed &= check(sink.numFailed() == 0,
+                            "decoded textures and staging data");
+            passed &= check(stats.read.numItems == scenes.size() &&
+                            stats.decode.numItems == num_textures &&
+                            stats.stage.numItems == scenes.size() &&
+                            stats.upload.numItems == scenes.size(),
+                            "stage item counts");
+            passed &= check(stats.read.numBytes > 0 &&
+                            stats.decode.numBytes > 0 &&
+                            stats.stage.numBytes == stats.upload.numBytes,
+                            "stage byte counts");
+        }
+    }
+
+    fs::remove_all(dir);
+
+    if (!passed) {
+        return EXIT_FAILURE;
+    }
+
+    cout << "All load pipeline checks passed" << endl;
+}
@@ -10,7 +10,7 @@ using namespace std;
 int main(int argc, const char *argv[]) {
     if (argc < 3) {
         cerr << argv[0] << " SRC DST [X_AXIS Y_AXIS Z_AXIS] [DATA_DIR]"
-             << " [--process-textures] [--build-sdfs]"
+             << " [--process-textures] [--build-sdfs] [--keep-hierarchy]"
              << endl;
         exit(EXIT_FAILURE);
     }
@@ -62,6 +62,7 @@ int main(int argc, const char *argv[]) {
 
     bool process_textures = false;
     bool build_sdfs = false;
+    bool keep_hierarchy = false;
 
     auto setDumpArgs = [&](const char *argument) {
         if (!strcmp(argument, "--process-textures")) {
@@ -70,19 +71,20 @@ int main(int argc, const char *argv[]) {
         if (!strcmp(argument, "--build-sdfs")) {
             build_sdfs = true;
         }
+        if (!strcmp(argument, "--keep-hierarchy")) {
+            keep_hierarchy = true;
+        }
     };
 
-    if (argc > 7) {
-        setDumpArgs(argv[7]);
-    }
-    if (argc > 8) {
-        setDumpArgs(argv[8]);
+    for (int arg_idx = 7; arg_idx < argc; arg_idx++) {
+        setDumpArgs(argv[arg_idx]);
     }
 
     cout << "Transform:\n" << glm::to_string(base_txfm) << endl;
 
     RLpbr::ScenePreprocessor dumper(argv[1], base_txfm, data_dir,
-                                    process_textures, build_sdfs);
+                                    process_textures, build_sdfs,
+                                    keep_hierarchy);
 
     dumper.dump(argv[2]);
 
@@ -0,0 +1,255 @@
+#include <rlpbr.hpp>
+#include <rlpbr_core/random.hpp>
+
+#include "test_scene.hpp"
+#include "test_util.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace RLpbr;
+
+// Known answers from the Random123 distribution (kat_vectors)
+static bool checkKnownAnswers()
+{
+    struct KnownAnswer {
+        uint32_t counter[4];
+        uint32_t key[2];
+        uint32_t expected[4];
+    };
+
+    const KnownAnswer answers[] = {
+        {
+            { 0, 0, 0, 0 },
+            { 0, 0 },
+            { 0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8 },
+        },
+        {
+            { ~0u, ~0u, ~0u, ~0u },
+            { ~0u, ~0u },
+            { 0x408f276d, 0x41c83b0e, 0xa20bc7c6, 0x6d5451fd },
+        },
+        {
+            { 0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344 },
+            { 0xa4093822, 0x299f31d0 },
+            { 0xd16cfe09, 0x94fdcceb, 0x5001e420, 0x24126ea1 },
+        },
+    };
+
+    for (const KnownAnswer &answer : answers) {
+        uint32_t out[4];
+        philox4x32(answer.counter, answer.key, out);
+        if (!equal(out, out + 4, answer.expected)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static vector<uint32_t> drawStream(const RandomKey &key,
+                                   RandomPurpose purpose, uint32_t num_draws)
+{
+    RandomStream rng(key, purpose);
+    vector<uint32_t> draws(num_draws);
+    for (uint32_t &v : draws) {
+        v = rng.next();
+    }
+
+    return draws;
+}
+
+// Runs fn(i) for i in [0, num_items) on num_threads threads, each taking
+// every num_threads'th item
+template <typename Fn>
+static void parallelFor(uint32_t num_items, uint32_t num_threads, Fn &&fn)
+{
+    vector<thread> threads;
+    for (uint32_t thread_idx = 0; thread_idx < num_threads; thread_idx++) {
+        threads.emplace_back([&, thread_idx]() {
+            for (uint32_t i = thread_idx; i < num_items; i += num_threads) {
+                fn(i);
+            }
+        });
+    }
+
+    for (thread &t : threads) {
+        t.join();
+    }
+}
+
+static vector<uint32_t> materialsOf(const Environment &env)
+{
+    const auto &materials = env.getInstanceMaterials();
+    return vector<uint32_t>(materials.begin(), materials.end());
+}
+
+int main()
+{
+    bool passed = true;
+
+    passed &= check(checkKnownAnswers(), "philox4x32-10 known answers");
+
+    // Streams only depend on key and purpose
+    {
+        const uint32_t num_streams = 64;
+        const uint32_t num_draws = 1000;
+
+        auto keyFor = [](uint32_t i) {
+            return RandomKey { 0x1234567890abcdefull, i / 4, i % 4 };
+        };
+
+        vector<vector<uint32_t>> serial(num_streams);
+        for (uint32_t i = 0; i < num_streams; i++) {
+            serial[i] = drawStream(keyFor(i), RandomPurpose::Domain,
+                                   num_draws);
+        }
+
+        bool matches = true;
+        for (uint32_t num_threads : { 2u, 3u, 8u }) {
+            vector<vector<uint32_t>> parallel(num_streams);
+            parallelFor(num_streams, num_threads, [&](uint32_t i) {
+                parallel[i] = drawStream(keyFor(i), RandomPurpose::Domain,
+                                         num_draws);
+            });
+            matches &= parallel == serial;
+        }
+        passed &= check(matches, "streams independent of thread count");
+
+        // Interleaving draws from two streams doesn't change either
+        RandomStream a(keyFor(5), RandomPurpose::Domain);
+        RandomStream b(keyFor(5), RandomPurpose::InstanceMaterials);
+        bool interleaved = true;
+        for (uint32_t i = 0; i < num_draws; i++) {
+            interleaved &= a.next() == serial[5][i];
+            b.next();
+        }
+        passed &= check(interleaved, "streams independent of each other");
+
+        vector<uint32_t> other_purpose = drawStream(
+            keyFor(5), RandomPurpose::InstanceMaterials, num_draws);
+        vector<uint32_t> other_episode = drawStream(
+            RandomKey { 0x1234567890abcdefull, 1, 2 },
+            RandomPurpose::Domain, num_draws);
+        passed &= check(other_purpose != serial[5] &&
+                        other_episode != serial[5],
+                        "purpose and episode select different streams");
+
+        RandomStream ranged(keyFor(0), RandomPurpose::Domain);
+        bool in_range = true;
+        for (uint32_t i = 0; i < num_draws; i++) {
+            float f = ranged.uniform();
+            in_range &= f >= 0.f && f < 1.f;
+            in_range &= ranged.uniformInt(7) < 7;
+        }
+        passed &= check(in_range, "uniform and uniformInt ranges");
+    }
+
+    // Randomized materials of environments, created in different orders
+    // and redrawn on different numbers of threads
+    {
+        RenderConfig cfg = testRenderConfig();
+        cfg.flags = RenderFlags::RandomizeMaterials;
+        Renderer renderer(cfg);
+
+        auto scene = makeTestScene({ 5, 9, 40, 5.f, 4, {}, false });
+
+        const uint32_t num_envs = 24;
+        const uint64_t seed = 42;
+
+        // Creation order numbering through setRandomSeed
+        renderer.setRandomSeed(seed);
+        vector<Environment> envs;
+        for (uint32_t i = 0; i < num_envs; i++) {
+            envs.emplace_back(renderer.makeEnvironment(scene));
+        }
+
+        vector<vector<uint32_t>> reference;
+        for (const Environment &env : envs) {
+            reference.push_back(materialsOf(env));
+        }
+
+        bool all_same = true;
+        for (uint32_t i = 1; i < num_envs; i++) {
+            all_same &= reference[i] == reference[0];
+        }
+        passed &= check(!all_same, "environments draw different materials");
+
+        renderer.setRandomSeed(seed);
+        bool recreated = true;
+        for (uint32_t i = 0; i < num_envs; i++) {
+            Environment env = renderer.makeEnvironment(scene);
+            recreated &= env.getRandomKey().envIdx == i &&
+                materialsOf(env) == reference[i];
+        }
+        passed &= check(recreated, "same seed reproduces environments");
+
+        mt19937 shuffle_rng(7);
+        for (uint32_t num_threads : { 1u, 2u, 5u, 8u }) {
+            vector<uint32_t> order(num_envs);
+            for (uint32_t i = 0; i < num_envs; i++) {
+                order[i] = i;
+            }
+            shuffle(order.begin(), order.end(), shuffle_rng);
+
+            // Shuffled creation order, so the renderer numbers them
+            // differently, then explicit keys redrawn concurrently
+            renderer.setRandomSeed(1000 + num_threads);
+            vector<Environment> shuffled;
+            for (uint32_t i = 0; i < num_envs; i++) {
+                shuffled.emplace_back(renderer.makeEnvironment(scene));
+            }
+
+            parallelFor(num_envs, num_threads, [&](uint32_t i) {
+                shuffled[i].setRandomKey(RandomKey { seed, order[i], 0 });
+            });
+
+            bool matches = true;
+            for (uint32_t i = 0; i < num_envs; i++) {
+                matches &= materialsOf(shuffled[i]) == reference[order[i]];
+            }
+            passed &= check(matches,
+                "materials independent of creation order and threads");
+        }
+
+        // Concurrent creation numbers every environment exactly once
+        {
+            renderer.setRandomSeed(seed);
+            vector<uint32_t> env_idxs(num_envs);
+            parallelFor(num_envs, 6, [&](uint32_t i) {
+                env_idxs[i] =
+                    renderer.makeEnvironment(scene).getRandomKey().envIdx;
+            });
+
+            sort(env_idxs.begin(), env_idxs.end());
+            bool unique = true;
+            for (uint32_t i = 0; i < num_envs; i++) {
+                unique &= env_idxs[i] == i;
+            }
+            passed &= check(unique, "concurrent creation gives unique keys");
+        }
+
+        // reset() moves to the next episode, reproducibly
+        Environment first = renderer.makeEnvironment(scene);
+        Environment second = renderer.makeEnvironment(scene);
+        first.setRandomKey(RandomKey { seed, 3, 0 });
+        second.setRandomKey(RandomKey { seed, 3, 0 });
+        first.reset();
+        second.reset();
+        passed &= check(first.getRandomKey().episode == 1 &&
+                        materialsOf(first) == materialsOf(second) &&
+                        materialsOf(first) != reference[3],
+                        "reset advances the episode");
+    }
+
+    if (!passed) {
+        return EXIT_FAILURE;
+    }
+
+    cout << "All random checks passed" << endl;
+}
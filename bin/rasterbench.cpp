@@ -0,0 +1,130 @@
+#include <rlpbr.hpp>
+#include <rlpbr_core/scene.hpp>
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace RLpbr;
+
+struct View {
+    glm::vec3 eye;
+    glm::vec3 target;
+};
+
+static vector<View> makeViews(const AABB &bbox, uint32_t num_views,
+                              mt19937 &rng)
+{
+    uniform_real_distribution<float> unit(0.f, 1.f);
+    auto randomPoint = [&]() {
+        return bbox.pMin + (bbox.pMax - bbox.pMin) *
+            glm::vec3(unit(rng), unit(rng), unit(rng));
+    };
+
+    vector<View> views;
+    views.reserve(num_views);
+    for (uint32_t i = 0; i < num_views; i++) {
+        views.push_back({ randomPoint(), randomPoint() });
+    }
+
+    return views;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        cerr << argv[0] << " scene.bps [batch_size] [res] [num_frames]"
+             << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t batch_size = 16;
+    uint32_t res = 128;
+    uint32_t num_frames = 256;
+    if (argc > 2) {
+        batch_size = stoul(argv[2]);
+    }
+    if (argc > 3) {
+        res = stoul(argv[3]);
+    }
+    if (argc > 4) {
+        num_frames = stoul(argv[4]);
+    }
+
+    // Not square, so aspect ratio mixups show up
+    uint32_t width = res;
+    uint32_t height = max(res * 3 / 4, 1u);
+    uint64_t batch_halves = 4 * uint64_t(batch_size) * width * height;
+
+    mt19937 rng(0);
+    vector<View> views;
+
+    // Outputs must not depend on how tiles are spread across threads,
+    // rastertest checks them against traced rays
+    vector<uint16_t> single_thread_output;
+
+    for (uint32_t num_threads : { 1u, 0u }) {
+        Renderer renderer({0, 1, batch_size, width, height, 1, 1, 0,
+            RenderMode::Rasterize, {}, 0.f, BackendSelect::CPU,
+            num_threads});
+
+        auto loader = renderer.makeLoader();
+        auto scene = loader.loadScene(argv[1]);
+
+        if (views.empty()) {
+            views = makeViews(scene->envInit.defaultBBox,
+                              max(num_frames, batch_size), rng);
+        }
+
+        RenderBatch batch = renderer.makeRenderBatch();
+        for (uint32_t batch_idx = 0; batch_idx < batch_size; batch_idx++) {
+            const View &view = views[batch_idx];
+            batch.initEnvironment(batch_idx, renderer.makeEnvironment(
+                scene, view.eye, view.target, glm::vec3(0.f, 1.f, 0.f)));
+        }
+
+        renderer.render(batch);
+        auto output = (const uint16_t *)renderer.getOutputPointer(batch);
+
+        if (num_threads == 1) {
+            single_thread_output.assign(output, output + batch_halves);
+            continue;
+        }
+
+        if (memcmp(output, single_thread_output.data(),
+                   batch_halves * sizeof(uint16_t)) != 0) {
+            cerr << "Multithreaded output differs from single threaded"
+                 << endl;
+            return EXIT_FAILURE;
+        }
+
+        uint32_t num_iters = max(num_frames / batch_size, 1u);
+        uint32_t cur_view = 0;
+
+        auto start = chrono::steady_clock::now();
+        for (uint32_t iter = 0; iter < num_iters; iter++) {
+            for (uint32_t batch_idx = 0; batch_idx < batch_size;
+                 batch_idx++) {
+                const View &view = views[cur_view];
+                cur_view = (cur_view + 1) % views.size();
+
+                batch.getEnvironment(batch_idx).setCameraView(
+                    view.eye, view.target, glm::vec3(0.f, 1.f, 0.f));
+            }
+
+            renderer.render(batch);
+        }
+        auto end = chrono::steady_clock::now();
+
+        double secs = chrono::duration<double>(end - start).count();
+        cout << "Batch size " << batch_size << ", " << width << "x"
+             << height << ", " << batch.getPrepStats().numThreads
+             << " threads: " << num_iters * batch_size / secs
+             << " frames/s" << endl;
+    }
+}
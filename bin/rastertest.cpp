@@ -0,0 +1,192 @@
+#include <rlpbr.hpp>
+
+#include "test_scene.hpp"
+#include "test_util.hpp"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+#include <glm/gtc/packing.hpp>
+
+using namespace std;
+using namespace RLpbr;
+
+// Rasterization and ray tracing may disagree on samples right at triangle
+// edges, vertices are snapped to a subpixel grid
+constexpr double max_mismatch_fraction = 1e-3;
+// Depth is stored as a half
+constexpr float max_depth_error = 2e-3f;
+
+// Traces the path tracer's ray through each pixel center and compares
+// with the rasterized depth and IDs. Returns the number of pixels that
+// differ.
+static uint64_t checkEnvironment(Environment &env, const uint16_t *output,
+                                 uint32_t width, uint32_t height)
+{
+    const Scene &scene = *env.getScene();
+    const Camera &cam = env.getCamera();
+
+    float aspect = float(width) / float(height);
+    glm::vec3 right = cam.right * aspect * cam.tanFOV;
+    glm::vec3 up = -cam.up * cam.tanFOV;
+    float view_len = glm::length(cam.view);
+
+    vector<RayQuery> rays;
+    rays.reserve(width * height);
+    for (uint32_t y = 0; y < height; y++) {
+        for (uint32_t x = 0; x < width; x++) {
+            glm::vec2 screen((2.f * (x + 0.5f)) / width - 1.f,
+                             (2.f * (y + 0.5f)) / height - 1.f);
+
+            // Unnormalized so t is the depth in units of view
+            rays.push_back({
+                cam.position,
+                1e16f,
+                right * screen.x + up * screen.y + cam.view,
+                VisibilityMask::opaque,
+            });
+        }
+    }
+
+    vector<RayQueryHit> hits(rays.size());
+    if (!env.traceRays(rays.data(), rays.size(), hits.data())) {
+        return rays.size();
+    }
+
+    unordered_map<uint32_t, uint32_t> id_to_idx;
+    for (uint32_t inst_idx = 0; inst_idx < env.getNumInstances();
+         inst_idx++) {
+        id_to_idx.emplace(env.getInstanceID(inst_idx), inst_idx);
+    }
+
+    uint64_t num_mismatches = 0;
+    for (uint32_t pixel = 0; pixel < rays.size(); pixel++) {
+        const uint16_t *out = output + 4 * pixel;
+        const RayQueryHit &hit = hits[pixel];
+
+        if (hit.instanceID == ~0u) {
+            if (out[0] != 0 || out[1] != 0xFFFF || out[2] != 0xFFFF ||
+                out[3] != 0xFFFF) {
+                num_mismatches++;
+            }
+            continue;
+        }
+
+        uint32_t inst_idx = id_to_idx.at(hit.instanceID);
+        const ObjectInstance &inst = env.getInstances()[inst_idx];
+        uint32_t geo_idx =
+            hit.meshIndex - scene.objectInfo[inst.objectIndex].meshIndex;
+        uint32_t material_idx =
+            env.getInstanceMaterials()[inst.materialOffset + geo_idx];
+
+        float depth = glm::unpackHalf1x16(out[0]);
+        float ref_depth = hit.t * view_len;
+
+        if (out[1] != uint16_t(inst.objectIndex) ||
+            out[2] != uint16_t(material_idx) ||
+            out[3] != uint16_t(inst_idx) ||
+            fabsf(depth - ref_depth) > max_depth_error * ref_depth) {
+            num_mismatches++;
+        }
+    }
+
+    return num_mismatches;
+}
+
+int main()
+{
+    bool passed = true;
+
+    // Not square, so aspect ratio mixups show up
+    const uint32_t batch_size = 12;
+    const uint32_t width = 96;
+    const uint32_t height = 72;
+    const uint64_t env_pixels = uint64_t(width) * height;
+    const uint64_t batch_halves = 4 * batch_size * env_pixels;
+
+    auto scene = makeTestScene({ 10, 6, 250, 6.f, 31, {}, false });
+    const AABB &bbox = scene->envInit.defaultBBox;
+
+    mt19937 rng(12);
+    uniform_real_distribution<float> unit(0.f, 1.f);
+    auto randomPoint = [&]() {
+        return bbox.pMin + (bbox.pMax - bbox.pMin) *
+            glm::vec3(unit(rng), unit(rng), unit(rng));
+    };
+
+    vector<glm::vec3> eyes, targets;
+    for (uint32_t i = 0; i < batch_size; i++) {
+        eyes.push_back(randomPoint());
+        targets.push_back(randomPoint());
+    }
+
+    // Outputs must not depend on how tiles are spread across threads
+    vector<uint16_t> single_thread_output;
+
+    for (uint32_t num_threads : { 1u, 4u }) {
+        Renderer renderer({0, 1, batch_size, width, height, 1, 1, 0,
+            RenderMode::Rasterize, {}, 0.f, BackendSelect::CPU,
+            num_threads});
+
+        RenderBatch batch = renderer.makeRenderBatch();
+        for (uint32_t batch_idx = 0; batch_idx < batch_size; batch_idx++) {
+            batch.initEnvironment(batch_idx, renderer.makeEnvironment(
+                scene, eyes[batch_idx], targets[batch_idx],
+                glm::vec3(0.f, 1.f, 0.f)));
+        }
+
+        // Instances added and removed, so instance indices move
+        for (uint32_t batch_idx = 0; batch_idx < batch_size;
+             batch_idx += 2) {
+            Environment &env = batch.getEnvironment(batch_idx);
+            for (uint32_t i = 0; i < 10; i++) {
+                env.deleteInstance(env.getInstanceID(i * 7));
+            }
+
+            uint32_t mats[3] = { 2, 3, 4 };
+            env.addInstance(1, mats, scene->objectInfo[1].numMeshes,
+                            targets[batch_idx], glm::quat(1.f, 0.f, 0.f, 0.f));
+        }
+
+        renderer.render(batch);
+        auto output = (const uint16_t *)renderer.getOutputPointer(batch);
+
+        if (num_threads != 1) {
+            passed &= check(memcmp(output, single_thread_output.data(),
+                batch_halves * sizeof(uint16_t)) == 0,
+                "multithreaded output matches single threaded");
+            continue;
+        }
+
+        single_thread_output.assign(output, output + batch_halves);
+
+        uint64_t num_mismatches = 0;
+        uint64_t num_hits = 0;
+        for (uint32_t batch_idx = 0; batch_idx < batch_size; batch_idx++) {
+            const uint16_t *env_output = output + 4 * batch_idx * env_pixels;
+            num_mismatches += checkEnvironment(
+                batch.getEnvironment(batch_idx), env_output, width, height);
+
+            for (uint64_t pixel = 0; pixel < env_pixels; pixel++) {
+                num_hits += env_output[4 * pixel + 3] != 0xFFFF;
+            }
+        }
+
+        uint64_t num_pixels = batch_size * env_pixels;
+        passed &= check(num_mismatches <= max_mismatch_fraction * num_pixels,
+                        "depth and IDs match traced rays");
+        // Otherwise the comparison above proves little
+        passed &= check(num_hits > num_pixels / 4, "most pixels hit");
+    }
+
+    if (!passed) {
+        return EXIT_FAILURE;
+    }
+
+    cout << "All rasterization checks passed" << endl;
+}
@@ -0,0 +1,179 @@
+#include <rlpbr.hpp>
+#include <rlpbr_core/scene.hpp>
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace RLpbr;
+
+// Spinning lidar at the center of the scene: one column of elevations per
+// azimuth step, consecutive rays differing by a small angle
+static vector<RayQuery> makeScanRays(const AABB &bbox, uint32_t num_rays)
+{
+    constexpr uint32_t num_elevations = 64;
+    uint32_t num_azimuths = max(num_rays / num_elevations, 1u);
+
+    glm::vec3 origin = 0.5f * (bbox.pMin + bbox.pMax);
+    float max_t = glm::length(bbox.pMax - bbox.pMin);
+
+    vector<RayQuery> rays;
+    rays.reserve(num_rays);
+    for (uint32_t i = 0; i < num_rays; i++) {
+        float azimuth = 2.f * float(M_PI) * (i / num_elevations) /
+            num_azimuths;
+        float elevation = float(M_PI) / 3.f *
+            (float(i % num_elevations) / num_elevations - 0.5f);
+
+        glm::vec3 dir(cosf(elevation) * cosf(azimuth),
+                      sinf(elevation),
+                      cosf(elevation) * sinf(azimuth));
+
+        rays.push_back({ origin, max_t, dir, VisibilityMask::all });
+    }
+
+    return rays;
+}
+
+// Unrelated rays between random points of the scene bounds
+static vector<RayQuery> makeRandomRays(const AABB &bbox, uint32_t num_rays,
+                                       mt19937 &rng)
+{
+    uniform_real_distribution<float> unit(0.f, 1.f);
+    auto randomPoint = [&]() {
+        return bbox.pMin + (bbox.pMax - bbox.pMin) *
+            glm::vec3(unit(rng), unit(rng), unit(rng));
+    };
+
+    vector<RayQuery> rays;
+    rays.reserve(num_rays);
+    for (uint32_t i = 0; i < num_rays; i++) {
+        glm::vec3 origin = randomPoint();
+        glm::vec3 target = randomPoint();
+
+        // Distances in units of target - origin, ending at target
+        rays.push_back({ origin, 1.f, target - origin,
+                         VisibilityMask::all });
+    }
+
+    return rays;
+}
+
+// Rays per second tracing rays repeatedly on num_threads threads, each
+// with its own environment and output buffer
+template <typename OutT, typename Fn>
+static double measureRate(vector<Environment> &envs,
+                          const vector<RayQuery> &rays,
+                          uint32_t num_threads, uint32_t num_iters, Fn &&fn)
+{
+    auto start = chrono::steady_clock::now();
+
+    vector<thread> threads;
+    threads.reserve(num_threads);
+    for (uint32_t thread_idx = 0; thread_idx < num_threads; thread_idx++) {
+        threads.emplace_back([&, thread_idx]() {
+            vector<OutT> out(rays.size());
+            for (uint32_t iter = 0; iter < num_iters; iter++) {
+                fn(envs[thread_idx], rays, out.data());
+            }
+        });
+    }
+
+    for (thread &t : threads) {
+        t.join();
+    }
+
+    auto end = chrono::steady_clock::now();
+    double secs = chrono::duration<double>(end - start).count();
+
+    return double(rays.size()) * num_iters * num_threads / secs;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        cerr << argv[0] << " scene.bps [num_rays] [num_threads]" << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t num_rays = 1 << 16;
+    uint32_t num_threads = thread::hardware_concurrency();
+    if (argc > 2) {
+        num_rays = stoul(argv[2]);
+    }
+    if (argc > 3) {
+        num_threads = stoul(argv[3]);
+    }
+    num_threads = max(num_threads, 1u);
+
+    constexpr uint32_t num_iters = 10;
+
+    Renderer renderer({0, 1, 1, 64, 64, 1, 1, 0,
+        RenderMode::PathTracer, {}, 0.f, BackendSelect::CPU});
+
+    auto loader = renderer.makeLoader();
+    auto scene = loader.loadScene(argv[1]);
+
+    vector<Environment> envs;
+    envs.reserve(num_threads);
+    for (uint32_t i = 0; i < num_threads; i++) {
+        envs.emplace_back(renderer.makeEnvironment(scene));
+    }
+
+    mt19937 rng(0);
+    const AABB &bbox = scene->envInit.defaultBBox;
+
+    vector<RayQueryHit> hits(num_rays);
+    vector<uint8_t> occluded(num_rays);
+
+    auto traceClosest = [](Environment &env, const vector<RayQuery> &rays,
+                           RayQueryHit *out) {
+        env.traceRays(rays.data(), rays.size(), out);
+    };
+
+    auto traceOcclusion = [](Environment &env,
+                             const vector<RayQuery> &rays, uint8_t *out) {
+        env.traceOcclusion(rays.data(), rays.size(), out);
+    };
+
+    for (auto &[name, rays] : {
+            make_pair("Scan", makeScanRays(bbox, num_rays)),
+            make_pair("Random", makeRandomRays(bbox, num_rays, rng)) }) {
+        // Builds every environment's acceleration structure up front
+        for (Environment &env : envs) {
+            env.traceOcclusion(rays.data(), 1, occluded.data());
+        }
+
+        envs[0].traceRays(rays.data(), rays.size(), hits.data());
+        uint32_t num_hits = 0;
+        for (const RayQueryHit &hit : hits) {
+            num_hits += hit.instanceID != ~0u;
+        }
+
+        cout << name << ": " << rays.size() << " rays, " << num_hits
+             << " hits" << endl;
+
+        for (uint32_t threads : { 1u, num_threads }) {
+            double closest_rate = measureRate<RayQueryHit>(envs, rays,
+                threads, num_iters, traceClosest);
+            double occlusion_rate = measureRate<uint8_t>(envs, rays,
+                threads, num_iters, traceOcclusion);
+
+            cout << "  " << threads << " threads: closest hit "
+                 << closest_rate / 1e6 << " Mrays/s ("
+                 << closest_rate / threads / 1e6 << " per thread), "
+                 << "occlusion " << occlusion_rate / 1e6 << " Mrays/s ("
+                 << occlusion_rate / threads / 1e6 << " per thread)"
+                 << endl;
+
+            if (num_threads == 1) {
+                break;
+            }
+        }
+    }
+}
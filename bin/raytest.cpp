@@ -0,0 +1,276 @@
+#include <rlpbr.hpp>
+#include <cpu/scene.hpp>
+
+#include "test_scene.hpp"
+#include "test_util.hpp"
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+using namespace std;
+using namespace RLpbr;
+
+// Closest hit over every world space triangle, in double precision and
+// independent of the backend's BVHs and object space triangles
+struct RefHit {
+    bool found;
+    double t;
+    uint32_t instIdx;
+    uint32_t meshIdx;
+    uint32_t triIdx;
+    glm::dvec2 barys;
+    glm::dvec3 normal;
+};
+
+static RefHit bruteForce(const cpu::CPUScene &scene, const Environment &env,
+                         const RayQuery &ray)
+{
+    const CowArray<ObjectInstance> &instances = env.getInstances();
+    const CowArray<InstanceTransform> &transforms = env.getTransforms();
+    const CowArray<InstanceFlags> &flags = env.getInstanceFlags();
+
+    glm::dvec3 o(ray.origin);
+    glm::dvec3 d(ray.direction);
+
+    RefHit hit {};
+    hit.found = false;
+    hit.t = ray.maxT;
+
+    for (uint32_t inst_idx = 0; inst_idx < env.getNumInstances();
+         inst_idx++) {
+        if ((cpu::instanceMask(flags[inst_idx]) & ray.visibilityMask) == 0) {
+            continue;
+        }
+
+        const ObjectInfo &obj =
+            scene.objectInfo[instances[inst_idx].objectIndex];
+        const glm::mat4x3 &o2w = transforms[inst_idx].mat;
+
+        for (uint32_t mesh_idx = obj.meshIndex;
+             mesh_idx < obj.meshIndex + obj.numMeshes; mesh_idx++) {
+            const MeshInfo &mesh = scene.meshInfo[mesh_idx];
+
+            for (uint32_t tri_idx = 0; tri_idx < mesh.numTriangles;
+                 tri_idx++) {
+                const uint32_t *tri_indices =
+                    scene.indices + mesh.indexOffset + 3 * tri_idx;
+
+                glm::dvec3 verts[3];
+                for (int i = 0; i < 3; i++) {
+                    verts[i] = glm::dvec3(o2w * glm::vec4(
+                        scene.vertices[tri_indices[i]].position, 1.f));
+                }
+
+                glm::dvec3 e1 = verts[1] - verts[0];
+                glm::dvec3 e2 = verts[2] - verts[0];
+                glm::dvec3 pvec = glm::cross(d, e2);
+                double det = glm::dot(e1, pvec);
+                if (det == 0.0) {
+                    continue;
+                }
+
+                glm::dvec3 tvec = o - verts[0];
+                double u = glm::dot(tvec, pvec) / det;
+                glm::dvec3 qvec = glm::cross(tvec, e1);
+                double v = glm::dot(d, qvec) / det;
+                double t = glm::dot(e2, qvec) / det;
+
+                if (u < 0.0 || v < 0.0 || u + v > 1.0 || t <= 0.0 ||
+                    t >= hit.t) {
+                    continue;
+                }
+
+                glm::dvec3 normal = glm::normalize(glm::cross(e1, e2));
+                if (glm::dot(normal, d) > 0.0) {
+                    normal = -normal;
+                }
+
+                hit = RefHit {
+                    true,
+                    t,
+                    inst_idx,
+                    mesh_idx,
+                    tri_idx,
+                    glm::dvec2(u, v),
+                    normal,
+                };
+            }
+        }
+    }
+
+    return hit;
+}
+
+// Hits agree up to float precision. A different triangle is only allowed
+// at the same distance, where both are a closest hit.
+static bool sameHit(const Environment &env, const RayQuery &ray,
+                    const RayQueryHit &hit, const RefHit &ref)
+{
+    bool found = hit.instanceID != ~0u;
+    if (found != ref.found) {
+        return false;
+    }
+
+    if (!found) {
+        return hit.t == ray.maxT;
+    }
+
+    double scale = glm::length(glm::dvec3(ray.direction));
+    if (fabs(hit.t - ref.t) * scale > 1e-4 * (1.0 + ref.t * scale)) {
+        return false;
+    }
+
+    if (hit.instanceID != env.getInstanceID(ref.instIdx) ||
+        hit.meshIndex != ref.meshIdx || hit.triangleIndex != ref.triIdx) {
+        return true;
+    }
+
+    return glm::all(glm::lessThan(
+            glm::abs(glm::dvec2(hit.barycentrics) - ref.barys),
+            glm::dvec2(1e-3))) &&
+        glm::dot(glm::dvec3(hit.normal), ref.normal) > 0.999;
+}
+
+// Rays aimed at the inside of random triangles, so most of them hit
+// something, and rays in random directions, some ending early
+static vector<RayQuery> makeRays(const cpu::CPUScene &scene,
+                                 const Environment &env, mt19937 &rng,
+                                 uint32_t num_rays)
+{
+    const AABB &bbox = scene.envInit.defaultBBox;
+    float diagonal = glm::length(bbox.pMax - bbox.pMin);
+    uniform_real_distribution<float> unit(0.f, 1.f);
+    normal_distribution<float> gauss;
+
+    const uint32_t masks[] = {
+        VisibilityMask::opaque,
+        VisibilityMask::transparent,
+        VisibilityMask::all,
+    };
+
+    vector<RayQuery> rays;
+    rays.reserve(num_rays);
+    for (uint32_t ray_idx = 0; ray_idx < num_rays; ray_idx++) {
+        glm::vec3 origin = bbox.pMin + (bbox.pMax - bbox.pMin) *
+            glm::vec3(unit(rng), unit(rng), unit(rng));
+        uint32_t mask = masks[ray_idx % 3];
+
+        glm::vec3 dir;
+        float max_t = 1e16f;
+        if (ray_idx % 2 == 0) {
+            uint32_t inst_idx = rng() % env.getNumInstances();
+            const ObjectInfo &obj = scene.objectInfo[
+                env.getInstances()[inst_idx].objectIndex];
+            const MeshInfo &mesh =
+                scene.meshInfo[obj.meshIndex + rng() % obj.numMeshes];
+            const uint32_t *tri_indices = scene.indices + mesh.indexOffset +
+                3 * (rng() % mesh.numTriangles);
+
+            float u = 0.05f + 0.4f * unit(rng);
+            float v = 0.05f + 0.4f * unit(rng);
+            glm::vec3 target = env.getTransforms()[inst_idx].mat * glm::vec4(
+                (1.f - u - v) * scene.vertices[tri_indices[0]].position +
+                u * scene.vertices[tri_indices[1]].position +
+                v * scene.vertices[tri_indices[2]].position, 1.f);
+
+            // Unnormalized, distances are in units of the direction
+            dir = (target - origin) * (0.5f + unit(rng));
+        } else {
+            dir = glm::normalize(
+                glm::vec3(gauss(rng), gauss(rng), gauss(rng)));
+            if (ray_idx % 4 == 1) {
+                max_t = unit(rng) * diagonal;
+            }
+        }
+
+        rays.push_back({ origin, max_t, dir, mask });
+    }
+
+    return rays;
+}
+
+static bool checkEnvironment(const cpu::CPUScene &scene, Environment &env,
+                             mt19937 &rng, uint32_t num_rays)
+{
+    vector<RayQuery> rays = makeRays(scene, env, rng, num_rays);
+
+    vector<RayQueryHit> hits(rays.size());
+    vector<uint8_t> occluded(rays.size());
+    if (!env.traceRays(rays.data(), rays.size(), hits.data()) ||
+        !env.traceOcclusion(rays.data(), rays.size(), occluded.data())) {
+        return false;
+    }
+
+    bool matches = true;
+    for (uint32_t i = 0; i < rays.size(); i++) {
+        RefHit ref = bruteForce(scene, env, rays[i]);
+
+        matches &= sameHit(env, rays[i], hits[i], ref) &&
+            bool(occluded[i]) == ref.found;
+
+        // Single rays take the scalar path instead of a full packet
+        RayQueryHit single;
+        env.traceRays(&rays[i], 1, &single);
+        matches &= sameHit(env, rays[i], single, ref);
+    }
+
+    return matches;
+}
+
+int main()
+{
+    bool passed = true;
+
+    vector<uint32_t> parents(150, Environment::noParent);
+    for (uint32_t inst_idx = 2; inst_idx < parents.size(); inst_idx += 5) {
+        parents[inst_idx] = inst_idx - 2;
+    }
+
+    auto scene = makeTestScene({ 7, 3, 150, 6.f, 23, parents, false });
+    const auto &cpu_scene = *static_cast<const cpu::CPUScene *>(scene.get());
+    Renderer renderer(testRenderConfig());
+    mt19937 rng(8);
+    uniform_real_distribution<float> unit(-1.f, 1.f);
+
+    Environment env = renderer.makeEnvironment(scene);
+    passed &= check(checkEnvironment(cpu_scene, env, rng, 2000),
+                    "scene defaults match brute force");
+
+    // Moved parents carry their children, which traceRays has to pick up
+    // through updateHierarchy
+    for (uint32_t i = 0; i < 40; i++) {
+        uint32_t inst_id = env.getInstanceID(rng() % env.getNumInstances());
+        env.moveInstance(inst_id, glm::vec3(unit(rng), unit(rng), unit(rng)));
+        env.rotateInstance(inst_id, glm::angleAxis(unit(rng),
+            glm::normalize(glm::vec3(unit(rng), 1.f, unit(rng)))));
+    }
+    for (uint32_t i = 0; i < 20; i++) {
+        uint32_t obj_idx = rng() % scene->objectInfo.size();
+        uint32_t mats[3] = { 0, 1, 2 };
+        env.addInstance(obj_idx, mats, scene->objectInfo[obj_idx].numMeshes,
+                        6.f * glm::vec3(unit(rng), unit(rng), unit(rng)),
+                        glm::quat(1.f, 0.f, 0.f, 0.f));
+    }
+    passed &= check(checkEnvironment(cpu_scene, env, rng, 2000),
+                    "modified environment matches brute force");
+
+    {
+        Environment forked = renderer.forkEnvironment(env);
+        for (uint32_t i = 0; i < 30; i++) {
+            forked.deleteInstance(
+                forked.getInstanceID(rng() % forked.getNumInstances()));
+        }
+        passed &= check(checkEnvironment(cpu_scene, forked, rng, 1000) &&
+                        checkEnvironment(cpu_scene, env, rng, 1000),
+                        "fork and its source trace independently");
+    }
+
+    if (!passed) {
+        return EXIT_FAILURE;
+    }
+
+    cout << "All ray query checks passed" << endl;
+}
@@ -1,4 +1,7 @@
 #include <rlpbr.hpp>
+#include <rlpbr_core/batch_prep.hpp>
+#include <rlpbr_core/dataset.hpp>
+#include <rlpbr_core/observations.hpp>
 #include <iostream>
 #include <cstdlib>
 #include <chrono>
@@ -7,7 +10,7 @@
 
 #include <glm/gtx/transform.hpp>
 
-#include "oiio_bridge.hpp"
+#include "image_writer.hpp"
 
 using namespace std;
 using namespace RLpbr;
@@ -26,17 +29,9 @@ static vector<T> copyToHost(const T *dev_ptr, uint32_t width,
     return buffer;
 }
 
-float toSRGB(float v)
-{
-    if (v <= 0.00031308f) {
-        return 12.92f * v;
-    } else {
-        return 1.055f*powf(v,(1.f / 2.4f)) - 0.055f;
-    }
-}
-
 void saveFrame(string fprefix, const half *dev_ptr,
-               uint32_t width, uint32_t height, uint32_t num_channels)
+               uint32_t width, uint32_t height, uint32_t num_channels,
+               BatchPrepPool &pool, AsyncImageWriter &writer)
 {
     auto buffer = copyToHost(dev_ptr, width, height, num_channels);
 
@@ -44,32 +39,33 @@ void saveFrame(string fprefix, const half *dev_ptr,
     vector<uint8_t> sdr_buffer(num_pixels * 3);
     vector<half> hdr_buffer(num_pixels * 3);
 
-    for (unsigned pixel = 0; pixel < num_pixels; pixel++) {
-        uint32_t i = pixel * num_channels;
-        uint32_t k = pixel * 3;
+    ObservationSource src {
+        reinterpret_cast<const uint16_t *>(buffer.data()),
+        1, width, height, num_channels,
+    };
 
-        glm::vec3 rgb {
-            float(buffer[i]),
-            float(buffer[i + 1]),
-            float(buffer[i + 2]),
-        };
+    ObservationFormat sdr_format {
+        ObservationType::SRGB8, ObservationLayout::HWC,
+        { 0, 1, 2 }, 3, 1, -1, 0.f, 0.f,
+    };
+
+    convertObservations(src, sdr_format, sdr_buffer.data(), pool);
 
+    for (unsigned pixel = 0; pixel < num_pixels; pixel++) {
         for (int j = 0; j < 3; j++) {
-            float v = toSRGB(rgb[j]);
-            if (v < 0) v = 0.f;
-            if (v > 1) v = 1.f;
-            sdr_buffer[k + j] = uint8_t(v * 255.f);
-            hdr_buffer[k + j] = buffer[i + j];
+            hdr_buffer[pixel * 3 + j] = buffer[pixel * num_channels + j];
         }
     }
 
-    saveSDR((fprefix + ".png").c_str(), width, height, sdr_buffer.data());
-    saveHDR((fprefix + ".exr").c_str(), width, height, hdr_buffer.data(), true);
+    writer.write(fprefix + ".png", ImageFileFormat::PNG, width, height, 3,
+                 sdr_buffer.data());
+    writer.write(fprefix + ".exr", ImageFileFormat::EXR, width, height, 3,
+                 hdr_buffer.data());
 }
 
 int main(int argc, char *argv[]) {
     if (argc < 3) {
-        cerr << argv[0] << "scene batch_size [spp] [depth]" << endl;
+        cerr << argv[0] << "scene batch_size [spp] [depth] [dataset_dir]" << endl;
         exit(EXIT_FAILURE);
     }
 
@@ -224,21 +220,80 @@ int main(int argc, char *argv[]) {
     auto [base_normal_ptr, base_albedo_ptr] =
         renderer.getAuxiliaryOutputs(batch);
 
+    BatchPrepPool pool(0);
+    AsyncImageWriter writer;
+
     for (uint32_t batch_idx = 0; batch_idx < batch_size; batch_idx++) {
         saveFrame("/tmp/out_color_" + to_string(batch_idx),
                   base_out_ptr + batch_idx * out_dim.x * out_dim.y * 4,
-                  out_dim.x, out_dim.y, 4);
+                  out_dim.x, out_dim.y, 4, pool, writer);
     }
 
     for (uint32_t batch_idx = 0; batch_idx < batch_size; batch_idx++) {
         saveFrame("/tmp/out_normal_" + to_string(batch_idx),
                   base_normal_ptr + batch_idx * out_dim.x * out_dim.y * 3,
-                  out_dim.x, out_dim.y, 3);
+                  out_dim.x, out_dim.y, 3, pool, writer);
     }
 
     for (uint32_t batch_idx = 0; batch_idx < batch_size; batch_idx++) {
         saveFrame("/tmp/out_albedo_" + to_string(batch_idx),
                   base_albedo_ptr + batch_idx * out_dim.x * out_dim.y * 3,
-                  out_dim.x, out_dim.y, 3);
+                  out_dim.x, out_dim.y, 3, pool, writer);
+    }
+
+    // Also append the batch to a dataset, one sample per environment
+    if (argc > 5) {
+        uint32_t image_pixels = out_dim.x * out_dim.y;
+        auto color = copyToHost(base_out_ptr, out_dim.x,
+                                out_dim.y * batch_size, 4);
+        auto normal = copyToHost(base_normal_ptr, out_dim.x,
+                                 out_dim.y * batch_size, 3);
+        auto albedo = copyToHost(base_albedo_ptr, out_dim.x,
+                                 out_dim.y * batch_size, 3);
+
+        DatasetCodec codec = datasetCodecSupported(DatasetCodec::Deflate) ?
+            DatasetCodec::Deflate : DatasetCodec::None;
+
+        DatasetSchema schema {
+            {
+                // RGB + instance ID
+                { "color", DatasetType::Float16, codec,
+                  out_dim.x, out_dim.y, 4 },
+                { "normal", DatasetType::Float16, codec,
+                  out_dim.x, out_dim.y, 3 },
+                { "albedo", DatasetType::Float16, codec,
+                  out_dim.x, out_dim.y, 3 },
+            },
+            DatasetConstants::defaultShardBytes,
+        };
+
+        DatasetWriter dataset(argv[5], schema);
+
+        vector<SampleMetadata> metadata;
+        vector<const void *> tensors;
+        for (uint32_t batch_idx = 0; batch_idx < batch_size; batch_idx++) {
+            const Environment &env = batch.getEnvironment(batch_idx);
+            const Camera &cam = env.getCamera();
+            metadata.push_back({
+                argv[1],
+                cam.position,
+                cam.view,
+                cam.up,
+                cam.right,
+                spp,
+                env.getRandomKey(),
+            });
+
+            tensors.push_back(color.data() + batch_idx * image_pixels * 4);
+            tensors.push_back(normal.data() + batch_idx * image_pixels * 3);
+            tensors.push_back(albedo.data() + batch_idx * image_pixels * 3);
+        }
+
+        dataset.appendBatch(metadata.data(), tensors.data(), batch_size,
+                            pool);
+    }
+
+    if (!writer.flush()) {
+        exit(EXIT_FAILURE);
     }
 }
@@ -0,0 +1,486 @@
+#include <cpu/shading.hpp>
+#include <rlpbr_core/shading.hpp>
+
+#include "test_util.hpp"
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+using namespace std;
+using namespace RLpbr;
+using namespace RLpbr::cpu;
+
+// Monte Carlo comparisons allow this many standard errors
+constexpr double max_std_errors = 5.0;
+
+// Mean and standard error per color channel
+struct Estimate {
+    double sum[3] {};
+    double sumSq[3] {};
+    uint64_t count = 0;
+
+    void add(const glm::vec3 &v)
+    {
+        for (int i = 0; i < 3; i++) {
+            sum[i] += v[i];
+            sumSq[i] += double(v[i]) * v[i];
+        }
+        count++;
+    }
+
+    double mean(int c) const
+    {
+        return sum[c] / count;
+    }
+
+    double stdError(int c) const
+    {
+        double m = mean(c);
+        return sqrt(max(sumSq[c] / count - m * m, 0.0) / count);
+    }
+};
+
+static glm::vec3 dirFromCos(float cos_theta, float phi)
+{
+    float sin_theta = sqrtf(max(0.f, 1.f - cos_theta * cos_theta));
+    return glm::vec3(sin_theta * cosf(phi), sin_theta * sinf(phi),
+                     cos_theta);
+}
+
+static BSDFParams makeLobes(float diffuse, float microfacet,
+                            float transmission)
+{
+    BSDFParams params {};
+    params.diffuseProb = diffuse;
+    params.microfacetProb = microfacet;
+    params.transmissionProb = transmission;
+
+    return params;
+}
+
+// Directional albedo of params at wo, estimated with sampleBSDF's weights
+// and with evalBSDF over uniformly sampled directions. The two must agree
+// and a single lobe must not reflect more than comes in.
+static bool checkAlbedo(const BSDFParams &params, const glm::vec3 &wo,
+                        uint32_t num_samples, mt19937 &rng,
+                        const glm::vec3 &max_albedo, bool compare_eval)
+{
+    uniform_real_distribution<float> unit(0.f, 1.f);
+
+    Estimate sampled, evaluated;
+    float max_weight = 0.f;
+    for (uint32_t i = 0; i < num_samples; i++) {
+        SampleResult sample = sampleBSDF(params, wo, unit(rng),
+            glm::vec2(unit(rng), unit(rng)));
+
+        sampled.add(sample.weight);
+        max_weight = max(max_weight, glm::max(sample.weight.x,
+            glm::max(sample.weight.y, sample.weight.z)));
+
+        glm::vec3 wi = sampleSphereUniform(glm::vec2(unit(rng), unit(rng)));
+
+        float pdf;
+        evaluated.add(evalBSDF(params, wo, wi, pdf) *
+                      (4.f * float(M_PI)));
+    }
+
+    bool passed = true;
+    for (int c = 0; c < 3; c++) {
+        double a = sampled.mean(c), b = evaluated.mean(c);
+
+        passed &= a <= max_albedo[c] + max_std_errors * sampled.stdError(c) +
+            1e-4;
+
+        if (compare_eval) {
+            double se = sqrt(sampled.stdError(c) * sampled.stdError(c) +
+                             evaluated.stdError(c) * evaluated.stdError(c));
+            passed &= fabs(a - b) <= max_std_errors * se + 1e-3;
+        }
+    }
+
+    // Fresnel and G / G1 are both at most 1, other lobes are scaled by
+    // their selection probability
+    bool single_lobe = params.diffuseProb == 1.f ||
+        params.microfacetProb == 1.f || params.transmissionProb == 1.f;
+    if (single_lobe && max_albedo == glm::vec3(1.f)) {
+        passed &= max_weight <= 1.f + 1e-4f;
+    }
+
+    return passed;
+}
+
+// White furnace: with reflectances of 1 no lobe may gain energy, and the
+// diffuse lobe must return exactly its albedo. The full material is not
+// checked because the host diffuse lobe is plain Lambertian (see
+// cpu/shading.hpp), without the multiple scattering compensation.
+static bool checkEnergy(uint32_t num_samples, mt19937 &rng)
+{
+    bool passed = true;
+
+    BSDFParams diffuse = makeLobes(1.f, 0.f, 0.f);
+    diffuse.rhoDiffuse = glm::vec3(0.2f, 0.5f, 1.f);
+
+    for (float cos_theta : { 0.1f, 0.5f, 1.f }) {
+        glm::vec3 wo = dirFromCos(cos_theta, 0.3f);
+        passed &= checkAlbedo(diffuse, wo, num_samples, rng,
+                              diffuse.rhoDiffuse, true);
+    }
+
+    for (float alpha : { 0.05f, 0.3f, 0.6f, 1.f }) {
+        BSDFParams conductor = makeLobes(0.f, 1.f, 0.f);
+        conductor.sharedF0 = glm::vec3(1.f);
+        conductor.sharedF90 = 1.f;
+        conductor.alpha = alpha;
+
+        BSDFParams transmissive = makeLobes(0.f, 0.f, 1.f);
+        transmissive.rhoTransmissive = glm::vec3(1.f);
+        transmissive.transmissiveF0 = glm::vec3(0.f);
+        transmissive.transmissiveF90 = 0.f;
+        transmissive.alpha = alpha;
+
+        // Reflection and transmission split the same microfacets
+        BSDFParams dielectric = makeLobes(0.f, 0.5f, 0.5f);
+        dielectric.rhoTransmissive = glm::vec3(1.f);
+        dielectric.sharedF0 = dielectric.transmissiveF0 = glm::vec3(0.04f);
+        dielectric.sharedF90 = dielectric.transmissiveF90 = 1.f;
+        dielectric.alpha = alpha;
+
+        // Uniform sampling can't resolve sharp lobes
+        bool compare_eval = alpha >= 0.3f;
+
+        for (float cos_theta : { 0.1f, 0.5f, 1.f }) {
+            glm::vec3 wo = dirFromCos(cos_theta, 1.1f);
+
+            for (const BSDFParams *params :
+                    { &conductor, &transmissive, &dielectric }) {
+                passed &= checkAlbedo(*params, wo, num_samples, rng,
+                                      glm::vec3(1.f), compare_eval);
+            }
+        }
+    }
+
+    return check(passed, "energy conservation");
+}
+
+// Reflection lobes with parameters that don't depend on wo must satisfy
+// f(wo, wi) = f(wi, wo). evalBSDF includes the cosine of wi.
+static bool checkReciprocity(uint32_t num_samples, mt19937 &rng)
+{
+    uniform_real_distribution<float> unit(0.f, 1.f);
+
+    uint32_t num_failures = 0;
+    for (uint32_t i = 0; i < num_samples; i++) {
+        BSDFParams params = makeLobes(0.5f, 0.5f, 0.f);
+        params.rhoDiffuse = glm::vec3(unit(rng), unit(rng), unit(rng));
+        params.sharedF0 = glm::vec3(unit(rng), unit(rng), unit(rng));
+        params.sharedF90 = 1.f;
+        params.alpha = max(unit(rng), ShadingMinAlpha);
+
+        glm::vec3 wo = dirFromCos(0.05f + 0.95f * unit(rng),
+                                  2.f * float(M_PI) * unit(rng));
+        glm::vec3 wi = dirFromCos(0.05f + 0.95f * unit(rng),
+                                  2.f * float(M_PI) * unit(rng));
+
+        float pdf;
+        glm::vec3 forward = evalBSDF(params, wo, wi, pdf) / wi.z;
+        glm::vec3 backward = evalBSDF(params, wi, wo, pdf) / wo.z;
+
+        for (int c = 0; c < 3; c++) {
+            if (fabsf(forward[c] - backward[c]) >
+                    1e-4f * max(forward[c], 1.f)) {
+                num_failures++;
+                break;
+            }
+        }
+    }
+
+    return check(num_failures == 0, "reciprocity");
+}
+
+// Histograms sampleBSDF's directions over the sphere and compares each bin
+// with the integral of pdfBSDF over it. Bins are equal area: uniform in
+// cos theta and phi.
+static bool checkSamplePDF(uint32_t num_samples, mt19937 &rng)
+{
+    constexpr uint32_t bins_z = 16, bins_phi = 16;
+    constexpr uint32_t pdf_points = 16;
+
+    uniform_real_distribution<float> unit(0.f, 1.f);
+
+    auto binPoint = [&](uint32_t z, uint32_t p, float uz, float up) {
+        return dirFromCos(-1.f + 2.f * (z + uz) / bins_z,
+                          2.f * float(M_PI) * (p + up) / bins_phi);
+    };
+
+    bool passed = true;
+    for (uint32_t material_idx = 0; material_idx < 8; material_idx++) {
+        Material material {};
+        material.rho = glm::vec3(unit(rng), unit(rng), unit(rng));
+        material.transmission = material_idx % 2 ? unit(rng) : 0.f;
+        material.rhoSpecular = glm::vec3(1.f);
+        material.specularScale = 1.f;
+        material.ior = 1.f + unit(rng);
+        material.metallic = material_idx % 4 < 2 ? unit(rng) : 0.f;
+        // Keeps lobes wide enough for the bins
+        material.roughness = 0.5f + 0.5f * unit(rng);
+
+        glm::vec3 wo = dirFromCos(0.1f + 0.9f * unit(rng),
+                                  2.f * float(M_PI) * unit(rng));
+        BSDFParams params = buildBSDF(material, wo);
+
+        vector<double> expected(bins_z * bins_phi, 0.0);
+        float bin_area = 4.f * float(M_PI) / (bins_z * bins_phi);
+        for (uint32_t z = 0; z < bins_z; z++) {
+            for (uint32_t p = 0; p < bins_phi; p++) {
+                double sum = 0.0;
+                for (uint32_t i = 0; i < pdf_points * pdf_points; i++) {
+                    glm::vec3 wi = binPoint(z, p,
+                        (i % pdf_points + 0.5f) / pdf_points,
+                        (i / pdf_points + 0.5f) / pdf_points);
+                    sum += pdfBSDF(params, wo, wi);
+                }
+
+                expected[z * bins_phi + p] = num_samples * bin_area *
+                    sum / (pdf_points * pdf_points);
+            }
+        }
+
+        vector<uint32_t> observed(bins_z * bins_phi, 0);
+        uint32_t num_zero_pdf_weights = 0;
+        for (uint32_t i = 0; i < num_samples; i++) {
+            SampleResult sample = sampleBSDF(params, wo, unit(rng),
+                glm::vec2(unit(rng), unit(rng)));
+
+            // Samples without weight end the path, so they aren't part
+            // of the density pdfBSDF describes. The rest must be covered.
+            if (sample.weight == glm::vec3(0.f)) {
+                continue;
+            }
+
+            if (pdfBSDF(params, wo, sample.dir) == 0.f) {
+                num_zero_pdf_weights++;
+                continue;
+            }
+
+            glm::vec3 wi = normalize(sample.dir);
+            uint32_t z = min(uint32_t((wi.z + 1.f) * 0.5f * bins_z),
+                             bins_z - 1);
+            float phi = atan2f(wi.y, wi.x);
+            if (phi < 0.f) {
+                phi += 2.f * float(M_PI);
+            }
+            uint32_t p = min(uint32_t(phi / (2.f * float(M_PI)) * bins_phi),
+                             bins_phi - 1);
+
+            observed[z * bins_phi + p]++;
+        }
+
+        passed &= num_zero_pdf_weights == 0;
+
+        for (uint32_t bin = 0; bin < expected.size(); bin++) {
+            double diff = fabs(observed[bin] - expected[bin]);
+            passed &= diff <= max_std_errors * sqrt(expected[bin]) +
+                1e-3 * num_samples;
+        }
+    }
+
+    return check(passed, "sample / pdf consistency");
+}
+
+// Host copy of samplerGet1D / samplerGet2D in sampler.glsl
+struct ZSobolPixel {
+    uint32_t seed;
+    uint32_t mortonIdx;
+    uint32_t dim;
+    uint32_t numBase4;
+    bool oddPower;
+
+    float get1D()
+    {
+        uint32_t idx = Shader::zSobolCurrentSampleIndex(dim, mortonIdx,
+                                                        numBase4, oddPower);
+        uint32_t hash_seed = Shader::mix32(dim ^ seed);
+        dim++;
+
+        return Shader::zSobolSequenceDimZero(idx, hash_seed);
+    }
+
+    glm::vec2 get2D()
+    {
+        uint32_t idx = Shader::zSobolCurrentSampleIndex(dim, mortonIdx,
+                                                        numBase4, oddPower);
+        uint64_t hash_seed = Shader::mix64(dim ^ seed);
+        dim += 2;
+
+        return glm::vec2(
+            Shader::zSobolSequenceDimZero(idx, uint32_t(hash_seed >> 32)),
+            Shader::zSobolSequenceDimOne(idx, uint32_t(hash_seed)));
+    }
+};
+
+static uint32_t log2Down(uint32_t v)
+{
+    uint32_t l = 0;
+    while (v >>= 1) {
+        l++;
+    }
+    return l;
+}
+
+// Every pixel's samples, in each dimension, must form a (0, m, 2)-net:
+// each elementary interval of area 1 / spp holds exactly one sample.
+// Also checks the shared building blocks against their definitions.
+static bool checkSampler(mt19937 &rng)
+{
+    bool passed = true;
+
+    for (uint32_t p = 0; p < 24; p++) {
+        uint32_t seen = 0;
+        for (uint32_t d = 0; d < 4; d++) {
+            seen |= 1u << Shader::zSobolPermutationDigit(p, d);
+        }
+        passed &= seen == 0xF;
+    }
+
+    for (uint32_t i = 0; i < 1000; i++) {
+        uint32_t idx = rng();
+
+        uint32_t ref = 0;
+        for (uint32_t bit = 0; bit < 32; bit++) {
+            if (idx & (1u << bit)) {
+                ref ^= 1u << (31 - bit);
+            }
+        }
+        passed &= Shader::sobolDimZero(idx) == ref;
+    }
+
+    constexpr uint32_t res_x = 64, res_y = 48;
+    constexpr uint32_t num_dims = 12;
+
+    for (uint32_t log2_spp = 0; log2_spp <= 8; log2_spp++) {
+        uint32_t spp = 1u << log2_spp;
+
+        // Same as the ZSOBOL_* defines in vulkan/render.cpp
+        bool odd_power = log2_spp & 1;
+        uint32_t index_shift = odd_power ? log2_spp + 1 : log2_spp;
+        uint32_t num_base4 = log2Down(max(res_x, res_y) - 1) + 1 +
+            (log2_spp + 1) / 2;
+
+        for (uint32_t pixel = 0; pixel < 16; pixel++) {
+            uint32_t x = rng() % res_x, y = rng() % res_y;
+            uint32_t seed = rng();
+
+            vector<ZSobolPixel> samplers;
+            for (uint32_t s = 0; s < spp; s++) {
+                samplers.push_back({
+                    seed,
+                    Shader::zSobolMortonIndex(x, y, s, index_shift,
+                                              odd_power),
+                    0,
+                    num_base4,
+                    odd_power,
+                });
+            }
+
+            for (uint32_t dim = 0; dim < num_dims; dim++) {
+                vector<glm::vec2> points;
+                for (ZSobolPixel &sampler : samplers) {
+                    if (dim % 3 == 0) {
+                        points.emplace_back(sampler.get1D(), 0.f);
+                    } else {
+                        points.push_back(sampler.get2D());
+                    }
+                }
+
+                // 1D samples only get the x splits
+                uint32_t max_x_bits = dim % 3 == 0 ? log2_spp : 0;
+                for (uint32_t x_bits = max_x_bits; x_bits <= log2_spp;
+                     x_bits++) {
+                    uint32_t y_bits = log2_spp - x_bits;
+                    vector<uint32_t> counts(spp, 0);
+                    for (const glm::vec2 &pt : points) {
+                        uint32_t cx = uint32_t(pt.x * (1u << x_bits));
+                        uint32_t cy = uint32_t(pt.y * (1u << y_bits));
+                        counts[(cy << x_bits) | cx]++;
+                    }
+
+                    for (uint32_t count : counts) {
+                        passed &= count == 1;
+                    }
+                }
+            }
+        }
+    }
+
+    return check(passed, "sampler stratification");
+}
+
+// Points from sampleSphereCone must lie on the part of the sphere visible
+// from the origin, inside the cone, and be uniform over the cone's solid
+// angle.
+static bool checkSphereCone(uint32_t num_samples, mt19937 &rng)
+{
+    uniform_real_distribution<float> unit(0.f, 1.f);
+
+    bool passed = true;
+    for (float sin_theta_max : { 0.01f, 0.1f, 0.5f, 0.9f, 0.99f }) {
+        float cos_theta_max = sqrtf(1.f - sin_theta_max * sin_theta_max);
+        // Unit distance to the center along z
+        float radius = sin_theta_max;
+
+        double cos_sum = 0.0;
+        for (uint32_t i = 0; i < num_samples; i++) {
+            float u = (i + unit(rng)) / num_samples;
+            float phi = 2.f * float(M_PI) * unit(rng);
+
+            Shader::SphereConeSample cone =
+                Shader::sampleSphereCone(sin_theta_max, u);
+
+            passed &= fabsf(cone.invPdf - 2.f * float(M_PI) *
+                            (1.f - cos_theta_max)) <= 1e-4f;
+
+            glm::vec3 normal(cone.sinAlpha * cosf(phi),
+                             cone.sinAlpha * sinf(phi), -cone.cosAlpha);
+            glm::vec3 point = glm::vec3(0.f, 0.f, 1.f) + radius * normal;
+
+            glm::vec3 dir = normalize(point);
+            passed &= dir.z >= cos_theta_max - 1e-4f;
+            passed &= dot(normal, -point) >= -1e-4f;
+
+            cos_sum += dir.z;
+        }
+
+        // Stratified, so the error is far below the Monte Carlo bound
+        double mean_cos = cos_sum / num_samples;
+        passed &= fabs(mean_cos - 0.5 * (1.0 + cos_theta_max)) <=
+            (1.0 - cos_theta_max) * 1e-2 + 1e-5;
+    }
+
+    return check(passed, "sphere light cone sampling");
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t num_samples = 1 << 17;
+    if (argc > 1) {
+        num_samples = stoul(argv[1]);
+    }
+
+    mt19937 rng(0);
+
+    bool passed = true;
+    passed &= checkEnergy(num_samples, rng);
+    passed &= checkReciprocity(num_samples, rng);
+    passed &= checkSamplePDF(num_samples, rng);
+    passed &= checkSampler(rng);
+    passed &= checkSphereCone(num_samples, rng);
+
+    if (!passed) {
+        return EXIT_FAILURE;
+    }
+
+    cout << "All shading checks passed" << endl;
+}
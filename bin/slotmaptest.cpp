@@ -0,0 +1,404 @@
+#include <rlpbr.hpp>
+
+#include "test_scene.hpp"
+#include "test_util.hpp"
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+using namespace RLpbr;
+
+// What the environment should hold for one live instance
+struct RefInstance {
+    uint32_t objectIndex;
+    vector<uint32_t> materials;
+    glm::vec3 position;
+};
+
+struct Model {
+    unordered_map<uint32_t, RefInstance> live;
+    // Handles of deleted instances
+    vector<uint32_t> stale;
+};
+
+static bool nearlyEqual(const glm::vec3 &a, const glm::vec3 &b)
+{
+    return glm::all(glm::lessThan(glm::abs(a - b), glm::vec3(1e-4f)));
+}
+
+// Compares every dense array and handle mapping with the model
+static bool checkModel(const Environment &env, const Scene &scene,
+                       const Model &model)
+{
+    if (env.getNumInstances() != model.live.size()) {
+        cerr << env.getNumInstances() << " instances, expected " <<
+            model.live.size() << endl;
+        return false;
+    }
+
+    const auto &instances = env.getInstances();
+    const auto &materials = env.getInstanceMaterials();
+    const auto &transforms = env.getTransforms();
+
+    vector<bool> material_used(materials.size(), false);
+
+    for (uint32_t idx = 0; idx < env.getNumInstances(); idx++) {
+        uint32_t inst_id = env.getInstanceID(idx);
+        auto iter = model.live.find(inst_id);
+        if (iter == model.live.end() || !env.isValidInstance(inst_id) ||
+            env.getInstanceIndex(inst_id) != idx) {
+            return false;
+        }
+
+        const RefInstance &ref = iter->second;
+        const ObjectInstance &inst = instances[idx];
+        if (inst.objectIndex != ref.objectIndex ||
+            !nearlyEqual(glm::vec3(transforms[idx].mat[3]), ref.position)) {
+            return false;
+        }
+
+        uint32_t num_meshes = scene.objectInfo[inst.objectIndex].numMeshes;
+        if (inst.materialOffset + num_meshes > materials.size()) {
+            return false;
+        }
+
+        // Material ranges of live instances never overlap
+        for (uint32_t i = 0; i < num_meshes; i++) {
+            uint32_t offset = inst.materialOffset + i;
+            if (material_used[offset] ||
+                materials[offset] != ref.materials[i]) {
+                return false;
+            }
+            material_used[offset] = true;
+        }
+    }
+
+    // Garbage from deleted instances is compacted away eventually
+    uint32_t num_live_materials = 0;
+    for (bool used : material_used) {
+        num_live_materials += used;
+    }
+    if (materials.size() > 2 * num_live_materials + 3) {
+        cerr << materials.size() << " material entries for " <<
+            num_live_materials << " live" << endl;
+        return false;
+    }
+
+    for (uint32_t inst_id : model.stale) {
+        if (env.isValidInstance(inst_id)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int main()
+{
+    bool passed = true;
+
+    auto scene = makeTestScene({ 8, 6, 30, 5.f, 2, {}, false });
+    Renderer renderer(testRenderConfig());
+    Environment env = renderer.makeEnvironment(scene);
+
+    Model model;
+    for (uint32_t idx = 0; idx < env.getNumInstances(); idx++) {
+        const ObjectInstance &inst = env.getInstances()[idx];
+        uint32_t num_meshes = scene->objectInfo[inst.objectIndex].numMeshes;
+
+        RefInstance ref {
+            inst.objectIndex,
+            {},
+            env.getTransforms()[idx].mat[3],
+        };
+        for (uint32_t i = 0; i < num_meshes; i++) {
+            ref.materials.push_back(
+                env.getInstanceMaterials()[inst.materialOffset + i]);
+        }
+
+        model.live.emplace(env.getInstanceID(idx), move(ref));
+    }
+
+    passed &= check(checkModel(env, *scene, model), "initial state");
+
+    mt19937 rng(5678);
+    uniform_real_distribution<float> unit(-1.f, 1.f);
+
+    auto randomLive = [&]() {
+        uint32_t idx = rng() % env.getNumInstances();
+        return env.getInstanceID(idx);
+    };
+
+    auto randomStale = [&]() {
+        return model.stale[rng() % model.stale.size()];
+    };
+
+    // Handles whose slot was never allocated, up to the 24 bit limit
+    const uint32_t out_of_range[] = {
+        InstanceID::make(InstanceID::slotMask - 1, 0),
+        InstanceID::make(1000000, 3),
+        ~0u,
+    };
+
+    bool model_matches = true;
+    bool stale_ignored = true;
+
+    for (uint32_t iter = 0; iter < 20000; iter++) {
+        uint32_t op = rng() % 12;
+        bool have_live = env.getNumInstances() > 0;
+        bool have_stale = !model.stale.empty();
+
+        // Grow while small, shrink while large, so slots get reused a lot
+        uint32_t num_live = env.getNumInstances();
+        bool prefer_add = num_live < 10 || (num_live < 200 && rng() % 2);
+
+        if (op < 3 && (prefer_add || !have_live)) {
+            uint32_t obj_idx = rng() % scene->objectInfo.size();
+            uint32_t num_meshes = scene->objectInfo[obj_idx].numMeshes;
+
+            RefInstance ref {
+                obj_idx,
+                {},
+                5.f * glm::vec3(unit(rng), unit(rng), unit(rng)),
+            };
+            for (uint32_t i = 0; i < num_meshes; i++) {
+                ref.materials.push_back(rng() % 6);
+            }
+
+            uint32_t inst_id = env.addInstance(obj_idx, ref.materials.data(),
+                num_meshes, ref.position, glm::quat(1.f, 0.f, 0.f, 0.f));
+
+            stale_ignored &= model.live.count(inst_id) == 0;
+            model.live.emplace(inst_id, move(ref));
+        } else if (op < 6 && have_live) {
+            uint32_t inst_id = randomLive();
+            env.deleteInstance(inst_id);
+            model.live.erase(inst_id);
+            model.stale.push_back(inst_id);
+
+            // Generations wrap after 256 reuses of a slot, only keep
+            // recent handles
+            if (model.stale.size() > 1000) {
+                model.stale.erase(model.stale.begin());
+            }
+        } else if (op == 6 && have_live) {
+            uint32_t inst_id = randomLive();
+            glm::vec3 delta(unit(rng), unit(rng), unit(rng));
+            env.moveInstance(inst_id, delta);
+            model.live[inst_id].position += delta;
+        } else if (op == 7 && have_live) {
+            uint32_t inst_id = randomLive();
+            RefInstance &ref = model.live[inst_id];
+            for (uint32_t &mat : ref.materials) {
+                mat = rng() % 6;
+            }
+            env.setInstanceMaterials(&inst_id, ref.materials.data(),
+                                     ref.materials.size(), 1);
+        } else if (op == 8 && have_stale) {
+            // Every setter ignores a stale handle
+            uint32_t inst_id = randomStale();
+            glm::vec3 pos(unit(rng), unit(rng), unit(rng));
+            glm::quat rot = glm::angleAxis(unit(rng), glm::vec3(0, 1, 0));
+
+            env.moveInstance(inst_id, pos);
+            env.rotateInstance(inst_id, rot);
+            env.setInstanceTransform(inst_id, pos, rot);
+            env.setInstanceLocalTransform(inst_id, pos, rot);
+            env.setInstanceMaterial<1>(inst_id, { 5 });
+            env.deleteInstance(inst_id);
+
+            uint32_t mats[3] = { 5, 5, 5 };
+            env.setInstanceMaterials(&inst_id, mats, 1, 1);
+        } else if (op == 9 && have_live && have_stale) {
+            // Batches mixing live and stale handles only touch the live
+            uint32_t ids[4] = { randomLive(), randomStale(), randomLive(),
+                                out_of_range[rng() % 3] };
+            glm::vec3 positions[4];
+            glm::quat rotations[4];
+            for (uint32_t i = 0; i < 4; i++) {
+                positions[i] = 5.f * glm::vec3(unit(rng), unit(rng),
+                                               unit(rng));
+                rotations[i] = glm::quat(1.f, 0.f, 0.f, 0.f);
+            }
+
+            env.setInstanceTransforms(ids, positions, rotations, 4);
+
+            // The later entry wins if both live handles are the same
+            model.live[ids[0]].position = positions[0];
+            model.live[ids[2]].position = positions[2];
+        } else if (op == 10) {
+            uint32_t inst_id = out_of_range[rng() % 3];
+            stale_ignored &= !env.isValidInstance(inst_id);
+            env.moveInstance(inst_id, glm::vec3(1.f));
+            env.setInstanceTransform(inst_id, glm::vec3(1.f),
+                                     glm::quat(1.f, 0.f, 0.f, 0.f));
+            env.setInstanceMaterial<1>(inst_id, { 1 });
+            env.deleteInstance(inst_id);
+        } else if (op == 11) {
+            env.clearDirty();
+        }
+
+        if (iter % 100 == 99) {
+            model_matches &= checkModel(env, *scene, model);
+        }
+    }
+
+    passed &= check(model_matches, "environment matches reference model");
+    passed &= check(stale_ignored, "stale and out of range handles");
+    passed &= check(checkModel(env, *scene, model), "final state");
+
+    // A freed slot is reused with a new generation, the old handle stays
+    // invalid
+    {
+        uint32_t inst_id = env.getInstanceID(0);
+        env.deleteInstance(inst_id);
+        model.live.erase(inst_id);
+
+        uint32_t mat = 0;
+        uint32_t new_id = env.addInstance(0, &mat, 1, glm::vec3(0.f),
+                                          glm::quat(1.f, 0.f, 0.f, 0.f));
+        passed &= check(InstanceID::slot(new_id) ==
+                            InstanceID::slot(inst_id) &&
+                        new_id != inst_id && !env.isValidInstance(inst_id),
+                        "slot reuse bumps generation");
+    }
+
+    // Compaction and randomization only write entries that change, so
+    // untouched chunks keep reading through to the scene defaults or
+    // stay shared with a fork
+    auto sharesChunks = [](const auto &a, const auto &b) {
+        if (a.numChunks() != b.numChunks()) {
+            return false;
+        }
+
+        for (uint32_t chunk_idx = 0; chunk_idx < a.numChunks();
+             chunk_idx++) {
+            if (a.chunkData(chunk_idx) != b.chunkData(chunk_idx)) {
+                return false;
+            }
+        }
+
+        return true;
+    };
+
+    {
+        auto large_scene = makeTestScene({ 8, 6, 300, 5.f, 3, {}, false });
+        Environment large_env = renderer.makeEnvironment(large_scene);
+        Environment fresh_env = renderer.makeEnvironment(large_scene);
+
+        // Deleting from the back leaves the remaining offsets in place
+        uint32_t num_mats = large_env.getInstanceMaterials().size();
+        while (large_env.getInstanceMaterials().size() == num_mats) {
+            large_env.deleteInstance(
+                large_env.getInstanceID(large_env.getNumInstances() - 1));
+        }
+
+        const Environment &const_env = large_env;
+        const Environment &const_fresh = fresh_env;
+        uint32_t num_live = large_env.getInstanceMaterials().size();
+        bool shared = true;
+        for (uint32_t chunk_idx = 0;
+             (chunk_idx + 1) * CowArray<uint32_t>::chunkSize <= num_live;
+             chunk_idx++) {
+            shared &= const_env.getInstanceMaterials().chunkData(chunk_idx) ==
+                const_fresh.getInstanceMaterials().chunkData(chunk_idx);
+        }
+        passed &= check(num_live < num_mats && shared,
+                        "compaction keeps unmoved material chunks shared");
+    }
+
+    {
+        RenderConfig cfg = testRenderConfig();
+        cfg.flags = RenderFlags::RandomizeMaterials;
+        Renderer random_renderer(cfg);
+
+        Environment src_env = random_renderer.makeEnvironment(scene);
+        src_env.setRandomKey({ 7, 0, 0 });
+
+        Environment forked = random_renderer.forkEnvironment(src_env);
+        forked.setRandomKey({ 7, 0, 0 });
+
+        const Environment &const_src = src_env;
+        const Environment &const_fork = forked;
+        passed &= check(sharesChunks(const_src.getInstanceMaterials(),
+                                     const_fork.getInstanceMaterials()),
+                        "redrawing the same materials keeps chunks shared");
+    }
+
+    // Setting materials to their current values doesn't copy any chunk,
+    // and a material count not matching the object's meshes is rejected
+    {
+        Environment set_env = renderer.makeEnvironment(scene);
+        const Environment &const_set = set_env;
+        Environment forked = renderer.forkEnvironment(set_env);
+        const Environment &const_fork = forked;
+
+        set_env.clearDirty();
+        for (uint32_t inst_idx = 0; inst_idx < set_env.getNumInstances();
+             inst_idx++) {
+            const ObjectInstance &inst = const_set.getInstances()[inst_idx];
+            uint32_t num_meshes =
+                scene->objectInfo[inst.objectIndex].numMeshes;
+
+            vector<uint32_t> mats;
+            for (uint32_t i = 0; i < num_meshes; i++) {
+                mats.push_back(
+                    const_set.getInstanceMaterials()[inst.materialOffset + i]);
+            }
+
+            uint32_t inst_id = set_env.getInstanceID(inst_idx);
+            set_env.setInstanceMaterials(&inst_id, mats.data(), num_meshes, 1);
+        }
+
+        passed &= check(sharesChunks(const_set.getInstanceMaterials(),
+                                     const_fork.getInstanceMaterials()) &&
+                        set_env.getUpdates().materials.empty(),
+                        "unchanged materials keep chunks shared");
+
+        // An instance with more than one mesh and materials after its own
+        uint32_t inst_idx = 0;
+        uint32_t mat_offset, num_meshes;
+        while (true) {
+            const ObjectInstance &inst = const_set.getInstances()[inst_idx];
+            mat_offset = inst.materialOffset;
+            num_meshes = scene->objectInfo[inst.objectIndex].numMeshes;
+            if (num_meshes > 1 && mat_offset + num_meshes <
+                    const_set.getInstanceMaterials().size()) {
+                break;
+            }
+            inst_idx++;
+        }
+
+        uint32_t inst_id = set_env.getInstanceID(inst_idx);
+        uint32_t next_mat =
+            const_set.getInstanceMaterials()[mat_offset + num_meshes];
+        // The emissive material, no instance starts out with it
+        uint32_t mats[4] = { 6, 6, 6, 6 };
+        set_env.setInstanceMaterials(&inst_id, mats, num_meshes + 1, 1);
+        set_env.setInstanceMaterial<1>(inst_id, { 6 });
+        passed &= check(
+            const_set.getInstanceMaterials()[mat_offset + num_meshes] ==
+                next_mat &&
+            const_set.getInstanceMaterials()[mat_offset] != 6 &&
+            set_env.getUpdates().materials.empty(),
+            "mismatched material count rejected");
+
+        set_env.setInstanceMaterials(&inst_id, mats, num_meshes, 1);
+        passed &= check(const_set.getInstanceMaterials()[mat_offset] == 6 &&
+                        set_env.getUpdates().materials.begin == mat_offset &&
+                        set_env.getUpdates().materials.end ==
+                            mat_offset + num_meshes,
+                        "matching material count written");
+    }
+
+    if (!passed) {
+        return EXIT_FAILURE;
+    }
+
+    cout << "All slot map checks passed" << endl;
+}
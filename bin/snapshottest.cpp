@@ -0,0 +1,150 @@
+#include <rlpbr.hpp>
+
+#include "test_scene.hpp"
+#include "test_util.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <vector>
+
+using namespace std;
+using namespace RLpbr;
+
+// Every handle of the environment and the operations that index with
+// them, so a restore that let a bad index through reads out of bounds
+static void exercise(Environment &env, vector<uint32_t> &scratch)
+{
+    for (uint32_t inst_idx = 0; inst_idx < env.getNumInstances();
+         inst_idx++) {
+        uint32_t inst_id = env.getInstanceID(inst_idx);
+        env.moveInstance(inst_id, glm::vec3(0.01f));
+        env.getInstanceParent(inst_id);
+    }
+
+    env.updateHierarchy();
+
+    scratch.clear();
+    env.queryInstancesRadius(glm::vec3(0.f), 3.f, scratch);
+
+    uint32_t light_id = env.addLight(glm::vec3(1.f), glm::vec3(2.f));
+    env.removeLight(light_id);
+    env.getLightSampler();
+
+    env.snapshot();
+}
+
+int main()
+{
+    bool passed = true;
+
+    vector<uint32_t> parents(200, Environment::noParent);
+    for (uint32_t inst_idx = 1; inst_idx < parents.size(); inst_idx += 3) {
+        parents[inst_idx] = inst_idx - 1;
+    }
+
+    auto scene = makeTestScene({ 8, 6, 200, 5.f, 5, parents, true });
+    Renderer renderer(testRenderConfig());
+    mt19937 rng(5);
+
+    // Instances and lights added and removed, links changed, so every
+    // map in the snapshot has entries away from the scene defaults
+    Environment env = renderer.makeEnvironment(scene);
+    for (uint32_t i = 0; i < 40; i++) {
+        env.deleteInstance(env.getInstanceID(rng() % env.getNumInstances()));
+    }
+    for (uint32_t i = 0; i < 20; i++) {
+        uint32_t mats[3] = { 1, 2, 3 };
+        uint32_t obj_idx = rng() % 8;
+        env.addInstance(obj_idx, mats, scene->objectInfo[obj_idx].numMeshes,
+                        glm::vec3(float(i), 0.f, 0.f),
+                        glm::quat(1.f, 0.f, 0.f, 0.f));
+    }
+    for (uint32_t i = 0; i < 20; i++) {
+        env.setInstanceParent(env.getInstanceID(rng() % env.getNumInstances()),
+                              env.getInstanceID(rng() % env.getNumInstances()));
+    }
+    env.removeLight(1);
+    uint32_t added_light = env.addLight(glm::vec3(1.f), glm::vec3(3.f));
+    env.addLight(glm::vec3(2.f), glm::vec3(1.f));
+    env.removeLight(added_light);
+
+    EnvironmentSnapshot snapshot = env.snapshot();
+
+    Environment target = renderer.makeEnvironment(scene);
+    EnvironmentSnapshot target_snapshot = target.snapshot();
+
+    passed &= check(target.restore(snapshot) &&
+                    target.snapshot() == snapshot,
+                    "snapshot round trip");
+    passed &= check(renderer.forkEnvironment(env).snapshot() == snapshot,
+                    "fork matches the snapshot");
+    passed &= check(target.restore(target_snapshot) &&
+                    target.snapshot() == target_snapshot,
+                    "restore back to the scene defaults");
+
+    // Every truncation fails and leaves the environment untouched
+    bool truncation_rejected = true;
+    for (size_t num_bytes = 0; num_bytes < snapshot.data.size();
+         num_bytes++) {
+        EnvironmentSnapshot truncated {
+            vector<uint8_t>(snapshot.data.begin(),
+                            snapshot.data.begin() + num_bytes),
+        };
+
+        truncation_rejected &= !target.restore(truncated);
+    }
+    passed &= check(truncation_rejected &&
+                    target.snapshot() == target_snapshot,
+                    "truncated snapshots rejected");
+
+    // Overwritten words: restore either rejects the snapshot, leaving
+    // the environment as it was, or yields an environment every handle
+    // of which can be used
+    vector<uint32_t> scratch;
+    uint32_t num_rejected = 0;
+    bool unchanged_on_reject = true;
+    for (uint32_t iter = 0; iter < 3000; iter++) {
+        EnvironmentSnapshot corrupt = snapshot;
+        uint32_t num_words = corrupt.data.size() / sizeof(uint32_t);
+
+        uint32_t num_writes = 1 + rng() % 3;
+        for (uint32_t i = 0; i < num_writes; i++) {
+            // Past magic, version and scene info, which are compared as a
+            // whole
+            uint32_t word_idx = 8 + rng() % (num_words - 8);
+            uint32_t value;
+            memcpy(&value, &corrupt.data[word_idx * sizeof(uint32_t)],
+                   sizeof(uint32_t));
+
+            switch (rng() % 4) {
+                case 0: value += 1; break;
+                case 1: value -= 1; break;
+                case 2: value = ~0u; break;
+                case 3: value = rng() % 512; break;
+            }
+
+            memcpy(&corrupt.data[word_idx * sizeof(uint32_t)], &value,
+                   sizeof(uint32_t));
+        }
+
+        if (target.restore(corrupt)) {
+            exercise(target, scratch);
+            target.restore(target_snapshot);
+        } else {
+            num_rejected++;
+            unchanged_on_reject &= target.snapshot() == target_snapshot;
+        }
+    }
+    passed &= check(unchanged_on_reject,
+                    "rejected snapshots leave the environment untouched");
+    passed &= check(num_rejected > 0, "corrupted snapshots rejected");
+
+    if (!passed) {
+        return EXIT_FAILURE;
+    }
+
+    cout << "All snapshot checks passed (" << num_rejected <<
+        " of 3000 corrupted snapshots rejected)" << endl;
+}
@@ -0,0 +1,221 @@
+#pragma once
+
+#include <cpu/scene.hpp>
+#include <rlpbr_core/scene.hpp>
+
+#include <glm/gtc/packing.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include <glm/gtx/transform.hpp>
+
+#include <cstring>
+#include <memory>
+#include <random>
+#include <vector>
+
+namespace RLpbr {
+
+// Scene built in memory and loaded through the CPU backend, for tests that
+// need a Scene without preprocessed files or a GPU. Object i has
+// i % 3 + 1 meshes, each an axis aligned box stacked above the object
+// origin. Default instances get a random object, random materials and a
+// random rigid transform within extent of the origin.
+struct TestSceneDesc {
+    uint32_t numObjects;
+    uint32_t numMaterials;
+    uint32_t numInstances;
+    float extent;
+    uint32_t seed;
+    // Parent instance per default instance (~0u for none), empty for a
+    // flat scene
+    std::vector<uint32_t> parents;
+    // Adds a sphere, a triangle and a portal light, in that order
+    bool withLights;
+};
+
+inline std::shared_ptr<Scene> makeTestScene(const TestSceneDesc &desc)
+{
+    std::mt19937 rng(desc.seed);
+    std::uniform_real_distribution<float> unit(-1.f, 1.f);
+
+    std::vector<PackedVertex> vertices;
+    std::vector<uint32_t> indices;
+    std::vector<MeshInfo> meshes;
+    std::vector<ObjectInfo> objects;
+    std::vector<AABB> object_bounds;
+
+    auto addVertex = [&](const glm::vec3 &pos) {
+        PackedVertex v {};
+        v.position = pos;
+        vertices.push_back(v);
+    };
+
+    for (uint32_t obj_idx = 0; obj_idx < desc.numObjects; obj_idx++) {
+        uint32_t num_meshes = obj_idx % 3 + 1;
+        objects.push_back({ uint32_t(meshes.size()), num_meshes });
+
+        glm::vec3 half(0.2f + 0.1f * float(obj_idx % 4), 0.25f,
+                       0.3f - 0.05f * float(obj_idx % 3));
+        AABB bounds { glm::vec3(-half.x, 0.f, -half.z),
+                      glm::vec3(half.x, 2.f * half.y * num_meshes, half.z) };
+        object_bounds.push_back(bounds);
+
+        for (uint32_t mesh_idx = 0; mesh_idx < num_meshes; mesh_idx++) {
+            glm::vec3 center(0.f, half.y * float(2 * mesh_idx + 1), 0.f);
+            uint32_t base = vertices.size();
+            for (uint32_t corner = 0; corner < 8; corner++) {
+                addVertex(center + half * glm::vec3(
+                    corner & 1 ? 1.f : -1.f,
+                    corner & 2 ? 1.f : -1.f,
+                    corner & 4 ? 1.f : -1.f));
+            }
+
+            meshes.push_back({ uint32_t(indices.size()), 12, 8 });
+
+            const uint32_t faces[6][4] = {
+                { 0, 2, 6, 4 }, { 1, 5, 7, 3 }, { 0, 4, 5, 1 },
+                { 2, 3, 7, 6 }, { 0, 1, 3, 2 }, { 4, 6, 7, 5 },
+            };
+            for (const auto &face : faces) {
+                uint32_t tris[6] = { face[0], face[1], face[2],
+                                     face[0], face[2], face[3] };
+                for (uint32_t idx : tris) {
+                    indices.push_back(base + idx);
+                }
+            }
+        }
+    }
+
+    // Last material is emissive, for the lights
+    std::vector<MaterialParams> materials(desc.numMaterials + 1);
+    for (uint32_t mat_idx = 0; mat_idx < materials.size(); mat_idx++) {
+        MaterialParams &mat = materials[mat_idx];
+        mat = {};
+        mat.baseColor = glm::u8vec3(40 + 50 * (mat_idx % 4));
+        mat.baseRoughness = 200;
+        mat.ior = 85;
+    }
+
+    uint32_t emissive_mat = desc.numMaterials;
+    materials[emissive_mat].flags = uint16_t(MaterialFlags::Complex);
+    uint16_t emittance = glm::packHalf1x16(4.f);
+    materials[emissive_mat].baseEmittance =
+        glm::u16vec3(emittance, emittance, emittance);
+
+    std::vector<LightProperties> lights;
+    if (desc.withLights) {
+        LightProperties sphere {};
+        sphere.type = LightType::Sphere;
+        sphere.sphereVertIdx = vertices.size();
+        sphere.sphereMatIdx = emissive_mat;
+        sphere.radius = 0.5f;
+        addVertex(glm::vec3(0.f, 3.f, 0.f));
+        lights.push_back(sphere);
+
+        LightProperties tri {};
+        tri.type = LightType::Triangle;
+        tri.triIdxOffset = indices.size();
+        tri.triMatIdx = emissive_mat;
+        for (uint32_t i = 0; i < 3; i++) {
+            indices.push_back(vertices.size());
+            addVertex(glm::vec3(float(i == 1), 4.f, float(i == 2)));
+        }
+        lights.push_back(tri);
+
+        LightProperties portal {};
+        portal.type = LightType::Portal;
+        portal.portalIdxOffset = indices.size();
+        for (uint32_t i = 0; i < 4; i++) {
+            indices.push_back(vertices.size());
+            addVertex(glm::vec3(float(i == 1 || i == 2) * 2.f, 5.f,
+                                float(i >= 2) * 2.f));
+        }
+        lights.push_back(portal);
+    }
+
+    StagingHeader hdr {};
+    hdr.numMeshes = meshes.size();
+    hdr.numObjects = objects.size();
+    hdr.numVertices = vertices.size();
+    hdr.numIndices = indices.size();
+    hdr.numMaterials = materials.size();
+    hdr.indexOffset = vertices.size() * sizeof(PackedVertex);
+    hdr.materialOffset = alignOffset(
+        hdr.indexOffset + indices.size() * sizeof(uint32_t), 16);
+    hdr.totalBytes = hdr.materialOffset +
+        materials.size() * sizeof(MaterialParams);
+
+    std::vector<char> data(hdr.totalBytes);
+    memcpy(data.data(), vertices.data(), hdr.indexOffset);
+    memcpy(data.data() + hdr.indexOffset, indices.data(),
+           indices.size() * sizeof(uint32_t));
+    memcpy(data.data() + hdr.materialOffset, materials.data(),
+           materials.size() * sizeof(MaterialParams));
+
+    std::vector<ObjectInstance> instances;
+    std::vector<uint32_t> instance_materials;
+    std::vector<InstanceTransform> transforms;
+    std::vector<InstanceFlags> flags;
+    for (uint32_t inst_idx = 0; inst_idx < desc.numInstances; inst_idx++) {
+        uint32_t obj_idx = rng() % desc.numObjects;
+        instances.push_back({ obj_idx, uint32_t(instance_materials.size()) });
+        for (uint32_t i = 0; i < objects[obj_idx].numMeshes; i++) {
+            instance_materials.push_back(rng() % desc.numMaterials);
+        }
+
+        glm::vec3 position = desc.extent *
+            glm::vec3(unit(rng), unit(rng), unit(rng));
+        glm::quat rotation = glm::normalize(
+            glm::quat(unit(rng), unit(rng), unit(rng), unit(rng)));
+
+        glm::mat4 rot_matrix = glm::mat4_cast(rotation);
+        transforms.push_back({
+            glm::translate(position) * rot_matrix,
+            glm::transpose(rot_matrix) * glm::translate(-position),
+        });
+
+        flags.push_back(inst_idx % 5 == 0 ?
+            InstanceFlags::Transparent : InstanceFlags {});
+    }
+
+    AABB scene_bounds { glm::vec3(-desc.extent - 2.f),
+                        glm::vec3(desc.extent + 2.f) };
+
+    SceneLoadData load {
+        hdr,
+        std::move(meshes),
+        std::move(objects),
+        {},
+        {},
+        EnvironmentInit(scene_bounds,
+                        std::move(instances),
+                        std::move(instance_materials),
+                        std::move(transforms),
+                        std::move(flags),
+                        std::move(lights),
+                        desc.parents,
+                        std::move(object_bounds)),
+        PhysicsMetadata {
+            {},
+            DynArray<PhysicsInstance>(0),
+            DynArray<PhysicsInstance>(0),
+            DynArray<PhysicsTransform>(0),
+        },
+        "",
+        0,
+        std::move(data),
+    };
+
+    cpu::CPULoader loader(0);
+    return loader.loadScene(std::move(load));
+}
+
+// Renderer on the CPU backend for environments of test scenes
+inline RenderConfig testRenderConfig(uint32_t batch_size = 1)
+{
+    return RenderConfig {
+        0, 1, batch_size, 16, 16, 1, 1, 0,
+        RenderMode::PathTracer, RenderFlags {}, 0.f, BackendSelect::CPU, 1,
+    };
+}
+
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <iostream>
+
+namespace RLpbr {
+
+// Reports a failed check by name, tests accumulate the results with &=
+inline bool check(bool passed, const char *what)
+{
+    if (!passed) {
+        std::cerr << "FAILED: " << what << std::endl;
+    }
+
+    return passed;
+}
+
+}
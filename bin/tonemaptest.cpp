@@ -0,0 +1,306 @@
+#include <rlpbr_core/tonemap.hpp>
+
+#include "test_util.hpp"
+
+#include <glm/gtc/packing.hpp>
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <vector>
+
+using namespace std;
+using namespace RLpbr;
+
+using Exp = ExposureConstants;
+
+static void setPixel(float *hdr, const glm::vec3 &rgb, uint32_t instance_id)
+{
+    hdr[0] = rgb.x;
+    hdr[1] = rgb.y;
+    hdr[2] = rgb.z;
+    memcpy(hdr + 3, &instance_id, sizeof(uint32_t));
+}
+
+// Luminance whose bin is exactly bin
+static float binLuminance(float bin)
+{
+    return exp2f(bin / float(Exp::numBins - 1) * Exp::logLuminanceRange +
+                 Exp::minLogLuminance);
+}
+
+// Histogram of num_pixels gray pixels of luminance lum. Odd counts cover
+// both the SSE and scalar paths.
+static vector<float> grayHistogram(float lum, uint32_t num_pixels)
+{
+    vector<float> hdr(num_pixels * 4);
+    for (uint32_t i = 0; i < num_pixels; i++) {
+        setPixel(hdr.data() + 4 * i, glm::vec3(lum), i);
+    }
+
+    vector<float> bins(Exp::numBins, 0.f);
+    accumulateExposureHistogram(hdr.data(), num_pixels, bins.data());
+
+    return bins;
+}
+
+static bool checkBins(const vector<float> &bins,
+                      uint32_t low_bin, float low_weight,
+                      uint32_t high_bin, float high_weight)
+{
+    const float eps = 1e-3f;
+
+    float total = 0.f;
+    for (uint32_t i = 0; i < Exp::numBins; i++) {
+        float expected = 0.f;
+        if (i == low_bin) expected += low_weight;
+        if (i == high_bin) expected += high_weight;
+
+        if (fabsf(bins[i] - expected) > eps) {
+            cerr << "Bin " << i << ": " << bins[i] << " != " <<
+                expected << endl;
+            return false;
+        }
+
+        total += bins[i];
+    }
+
+    return fabsf(total - 1.f) < 1e-4f;
+}
+
+static bool checkHistogram()
+{
+    bool passed = true;
+
+    const uint32_t num_pixels = 4 * 33 + 3;
+
+    passed &= check(exposureBin(0.f) == 0.f, "zero luminance bin");
+    passed &= check(exposureBin(Exp::minLuminance * 0.5f) == 0.f,
+                    "below minimum luminance bin");
+    passed &= check(fabsf(exposureBin(binLuminance(127.f)) - 127.f) < 1e-3f,
+                    "maximum luminance bin");
+
+    passed &= check(checkBins(grayHistogram(0.f, num_pixels),
+                              0, 1.f, 1, 0.f), "black histogram");
+
+    // Bin centers, either side of the rounding the weights must sum to 1
+    for (uint32_t bin : { 1u, 37u, 64u, 126u }) {
+        float lum = binLuminance(float(bin));
+        float frac_bin = exposureBin(lum);
+        passed &= check(fabsf(frac_bin - float(bin)) < 1e-3f,
+                        "bin center");
+
+        passed &= check(checkBins(grayHistogram(lum, num_pixels),
+                                  bin, 1.f, bin + 1, 0.f) ||
+                        checkBins(grayHistogram(lum, num_pixels),
+                                  bin - 1, 0.f, bin, 1.f),
+                        "bin center histogram");
+    }
+
+    // Halfway between two bins splits evenly
+    passed &= check(checkBins(grayHistogram(binLuminance(20.5f), num_pixels),
+                              20, 0.5f, 21, 0.5f), "bin split");
+
+    // The top bin and above saturate into it
+    for (float bin : { 127.f, 130.f }) {
+        passed &= check(checkBins(grayHistogram(binLuminance(bin),
+                                                num_pixels),
+                                  127, 1.f, 127, 0.f), "top bin clamp");
+    }
+
+    // Luminance weights
+    vector<float> hdr(4 * 4);
+    setPixel(hdr.data(), glm::vec3(1.f, 0.f, 0.f), 0);
+    setPixel(hdr.data() + 4, glm::vec3(0.f, 1.f, 0.f), 0);
+    setPixel(hdr.data() + 8, glm::vec3(0.f, 0.f, 1.f), 0);
+    setPixel(hdr.data() + 12, glm::vec3(0.2f, 0.7f, 0.1f), 0);
+    vector<float> simd_bins(Exp::numBins, 0.f);
+    accumulateExposureHistogram(hdr.data(), 4, simd_bins.data());
+
+    vector<float> scalar_bins(Exp::numBins, 0.f);
+    for (uint32_t i = 0; i < 4; i++) {
+        accumulateExposureHistogram(hdr.data() + 4 * i, 1,
+                                    scalar_bins.data());
+    }
+
+    bool match = true;
+    for (uint32_t i = 0; i < Exp::numBins; i++) {
+        match &= fabsf(simd_bins[i] * 4.f - scalar_bins[i]) < 1e-5f;
+    }
+    passed &= check(match, "vector and scalar luminance");
+
+    return passed;
+}
+
+static bool checkExposure()
+{
+    bool passed = true;
+
+    // A uniform image maps to middle gray
+    for (uint32_t bin : { 10u, 50u, 100u }) {
+        float lum = binLuminance(float(bin));
+        vector<float> bins(Exp::numBins, 0.f);
+        bins[bin] = 1.f;
+
+        float exposure = exposureFromHistogram(bins.data());
+        passed &= check(fabsf(exposure * lum / Exp::middleGray - 1.f) <
+                        1e-3f, "uniform exposure");
+    }
+
+    // The darkest 40% and brightest 5% are ignored
+    {
+        vector<float> bins(Exp::numBins, 0.f);
+        bins[0] = 0.4f;
+        bins[60] = 0.55f;
+        bins[127] = 0.05f;
+
+        float exposure = exposureFromHistogram(bins.data());
+        passed &= check(fabsf(exposure * binLuminance(60.f) /
+                              Exp::middleGray - 1.f) < 1e-3f,
+                        "outlier drop");
+    }
+
+    // Everything in the bottom bin
+    {
+        vector<float> bins(Exp::numBins, 0.f);
+        bins[0] = 1.f;
+
+        float exposure = exposureFromHistogram(bins.data());
+        passed &= check(fabsf(exposure * Exp::minLuminance /
+                              Exp::middleGray - 1.f) < 1e-3f,
+                        "darkest exposure");
+    }
+
+    return passed;
+}
+
+static bool checkOperators(mt19937 &rng)
+{
+    bool passed = true;
+
+    passed &= check(eaTonemap(glm::vec3(0.f)) == glm::vec3(0.f),
+                    "black stays black");
+
+    // Gray ramp must be monotonic and stay in range for every operator
+    glm::vec3 (*ops[])(const glm::vec3 &) = {
+        eaTonemap, uc2Tonemap, acesFittedTonemap, reinhardTonemap,
+        lottesTonemap,
+    };
+
+    for (auto op : ops) {
+        float prev = -1.f;
+        bool monotonic = true, in_range = true;
+        for (float v = 1e-3f; v < 1e3f; v *= 1.1f) {
+            glm::vec3 mapped = op(glm::vec3(v));
+            for (int c = 0; c < 3; c++) {
+                in_range &= mapped[c] >= 0.f && mapped[c] <= 1.f;
+            }
+
+            // The ICtCp round trip is noisy near white
+            monotonic &= mapped.y >= prev - 1e-3f;
+            prev = mapped.y;
+        }
+
+        passed &= check(monotonic, "monotonic gray ramp");
+        passed &= check(in_range, "operator range");
+    }
+
+    uniform_real_distribution<float> color(0.f, 100.f);
+    bool in_range = true;
+    for (int i = 0; i < 10000; i++) {
+        glm::vec3 mapped = eaTonemap(
+            glm::vec3(color(rng), color(rng), color(rng)));
+        for (int c = 0; c < 3; c++) {
+            in_range &= mapped[c] >= 0.f && mapped[c] <= 1.f;
+        }
+    }
+    passed &= check(in_range, "random colors in range");
+
+    // Dim inputs are below the shoulder
+    glm::vec3 dim = eaTonemap(glm::vec3(0.05f));
+    passed &= check(fabsf(dim.y - 0.05f) < 0.01f, "linear segment");
+
+    passed &= check(linearToSRGB(0.f) == 0.f, "sRGB zero");
+    passed &= check(fabsf(linearToSRGB(1.f) - 1.f) < 1e-6f, "sRGB one");
+    passed &= check(fabsf(linearToSRGB(0.0031308f) -
+                          linearToSRGB(0.0031309f)) < 1e-5f,
+                    "sRGB continuity");
+
+    return passed;
+}
+
+static bool checkPacking()
+{
+    bool passed = true;
+
+    auto unpack = [](const uint32_t packed[2], glm::vec3 &rgb,
+                     uint32_t &instance_id) {
+        glm::vec2 ab = glm::unpackHalf2x16(packed[0]);
+        glm::vec2 cd = glm::unpackHalf2x16(packed[1] & 0xFFFF);
+        rgb = glm::vec3(ab.x, ab.y, cd.x);
+        instance_id = packed[1] >> 16;
+    };
+
+    uint32_t packed[2];
+    glm::vec3 rgb;
+    uint32_t instance_id;
+
+    packTonemapped(glm::vec3(1.f, 0.5f, 0.25f), 1234, packed);
+    unpack(packed, rgb, instance_id);
+    passed &= check(rgb == glm::vec3(1.f, 0.5f, 0.25f) &&
+                    instance_id == 1234, "exact pack");
+
+    packTonemapped(glm::vec3(1e6f, 65504.f, 0.f), 0xFFFF, packed);
+    unpack(packed, rgb, instance_id);
+    passed &= check(rgb == glm::vec3(65504.f, 65504.f, 0.f) &&
+                    instance_id == 0xFFFF, "clamped pack");
+
+    // Layout matches the untonemapped output: halves r, g, b, id
+    uint16_t halves[4];
+    memcpy(halves, packed, sizeof(halves));
+    passed &= check(halves[0] == glm::packHalf1x16(65504.f) &&
+                    halves[2] == 0 && halves[3] == 0xFFFF,
+                    "half layout");
+
+    // Instance IDs come from the 4th float of each HDR pixel
+    const uint32_t num_pixels = 7;
+    vector<float> hdr(num_pixels * 4);
+    for (uint32_t i = 0; i < num_pixels; i++) {
+        setPixel(hdr.data() + 4 * i, glm::vec3(0.1f * i), 100 + i);
+    }
+
+    vector<uint32_t> out(num_pixels * 2);
+    float exposure = tonemapImage(hdr.data(), num_pixels, out.data());
+
+    bool ids_match = true, values_match = true;
+    for (uint32_t i = 0; i < num_pixels; i++) {
+        unpack(out.data() + 2 * i, rgb, instance_id);
+        ids_match &= instance_id == 100 + i;
+
+        glm::vec3 expected = eaTonemap(glm::vec3(0.1f * i) * exposure);
+        values_match &= fabsf(rgb.x - expected.x) < 1e-3f;
+    }
+    passed &= check(ids_match, "instance ID passthrough");
+    passed &= check(values_match, "tonemapped values");
+
+    return passed;
+}
+
+int main()
+{
+    mt19937 rng(0);
+
+    bool passed = true;
+    passed &= checkHistogram();
+    passed &= checkExposure();
+    passed &= checkOperators(rng);
+    passed &= checkPacking();
+
+    if (!passed) {
+        return EXIT_FAILURE;
+    }
+
+    cout << "All tonemap checks passed" << endl;
+}
@@ -0,0 +1,170 @@
+#include "image_writer.hpp"
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <glm/gtc/packing.hpp>
+
+using namespace std;
+using namespace RLpbr;
+
+// Smooth gradients plus noise, roughly as compressible as rendered frames
+static vector<uint8_t> makeImage(ImageFileFormat format, uint32_t res,
+                                 mt19937 &rng)
+{
+    uniform_real_distribution<float> noise(-0.05f, 0.05f);
+    uniform_real_distribution<float> unit(0.f, 1.f);
+    float phase = unit(rng) * 10.f;
+
+    uint32_t num_values = res * res * 3;
+    vector<uint8_t> data(format == ImageFileFormat::PNG ?
+                         num_values : num_values * sizeof(uint16_t));
+
+    for (uint32_t i = 0; i < num_values; i++) {
+        uint32_t pixel = i / 3;
+        float x = float(pixel % res) / res;
+        float y = float(pixel / res) / res;
+        float v = 0.5f + 0.5f * sinf(phase + 6.f * x + (i % 3) * y * 4.f) +
+            noise(rng);
+        v = fminf(fmaxf(v, 0.f), 1.f);
+
+        if (format == ImageFileFormat::PNG) {
+            data[i] = uint8_t(v * 255.f);
+        } else {
+            uint16_t h = glm::packHalf1x16(v * 4.f);
+            memcpy(data.data() + i * sizeof(uint16_t), &h, sizeof(uint16_t));
+        }
+    }
+
+    return data;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        cerr << argv[0] <<
+            " out_dir [exr|png|raw] [res] [num_images] [num_threads]" << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    string out_dir = argv[1];
+    ImageFileFormat format = ImageFileFormat::EXR;
+    uint32_t res = 256;
+    uint32_t num_images = 256;
+    uint32_t num_threads = 0;
+
+    if (argc > 2) {
+        string name = argv[2];
+        if (name == "png") {
+            format = ImageFileFormat::PNG;
+        } else if (name == "raw") {
+            format = ImageFileFormat::Raw;
+        } else if (name != "exr") {
+            cerr << "Unknown format " << name << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (argc > 3) {
+        res = stoul(argv[3]);
+    }
+    if (argc > 4) {
+        num_images = stoul(argv[4]);
+    }
+    if (argc > 5) {
+        num_threads = stoul(argv[5]);
+    }
+
+    const char *extension = format == ImageFileFormat::EXR ? ".exr" :
+        format == ImageFileFormat::PNG ? ".png" : ".bin";
+
+    // A handful of distinct images cycled through, like a batch of
+    // environments
+    mt19937 rng(0);
+    vector<vector<uint8_t>> images;
+    for (uint32_t i = 0; i < 8; i++) {
+        images.push_back(makeImage(format, res, rng));
+    }
+
+    bool passed = true;
+
+    // Only touched by callbacks until the writer is flushed
+    struct CallbackCheck {
+        uint64_t nextExpected = 0;
+        bool ordered = true;
+    };
+
+    auto runWriter = [&](AsyncImageWriter &writer, bool sync,
+                         const CallbackCheck &check) {
+        auto start = chrono::steady_clock::now();
+        for (uint32_t i = 0; i < num_images; i++) {
+            string path = out_dir + "/writebench_" + to_string(i) +
+                extension;
+            const vector<uint8_t> &image = images[i % images.size()];
+
+            if (format == ImageFileFormat::Raw) {
+                writer.writeRaw(path, image.data(), image.size());
+            } else {
+                writer.write(path, format, res, res, 3, image.data());
+            }
+
+            if (sync) {
+                passed &= writer.flush();
+            }
+        }
+        passed &= writer.flush();
+        auto end = chrono::steady_clock::now();
+
+        if (!check.ordered) {
+            cerr << "Callbacks out of order" << endl;
+            passed = false;
+        }
+
+        if (check.nextExpected != num_images) {
+            cerr << "Only " << check.nextExpected << " of " << num_images <<
+                " callbacks ran" << endl;
+            passed = false;
+        }
+
+        return chrono::duration<double>(end - start).count();
+    };
+
+    auto makeCallback = [](CallbackCheck &check) {
+        return [&check](uint64_t id, const string &, bool) {
+            check.ordered &= id == check.nextExpected;
+            check.nextExpected = id + 1;
+        };
+    };
+
+    double image_mb = double(images[0].size()) / (1024 * 1024);
+
+    auto report = [&](const char *name, uint32_t threads, double secs) {
+        cout << name << ", " << threads << " threads: " <<
+            num_images / secs << " images/s, " <<
+            num_images * image_mb / secs << " MiB/s" << endl;
+    };
+
+    // Baseline: one image at a time, the render loop waits on each
+    {
+        CallbackCheck check;
+        AsyncImageWriter writer(1, 1, makeCallback(check));
+        double secs = runWriter(writer, true, check);
+        report("Synchronous", 1, secs);
+    }
+
+    {
+        CallbackCheck check;
+        AsyncImageWriter writer(num_threads, 0, makeCallback(check));
+        double secs = runWriter(writer, false, check);
+        report("Async", writer.numThreads(), secs);
+    }
+
+    if (!passed) {
+        return EXIT_FAILURE;
+    }
+}
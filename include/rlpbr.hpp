@@ -7,7 +7,9 @@
 #include <rlpbr/environment.hpp>
 #include <rlpbr/render.hpp>
 
+#include <atomic>
 #include <string_view>
+#include <vector>
 
 namespace RLpbr {
 
@@ -17,6 +19,17 @@ public:
 
     std::shared_ptr<Scene> loadScene(std::string_view scene_path);
 
+    // Loads many scenes at once, overlapping disk reads, texture decoding
+    // and staging of later scenes with the upload of earlier ones
+    std::vector<std::shared_ptr<Scene>> loadScenes(
+        const char **scene_paths, uint32_t num_scenes,
+        LoadPipelineStats *stats = nullptr);
+
+    std::vector<std::shared_ptr<Scene>> loadScenes(
+        const char **scene_paths, uint32_t num_scenes,
+        const LoadPipelineConfig &cfg,
+        LoadPipelineStats *stats = nullptr);
+
     std::shared_ptr<EnvironmentMapGroup> loadEnvironmentMaps(
             const char **paths, uint32_t num_maps);
 
@@ -52,6 +65,17 @@ public:
                                 float vertical_fov = 90.f,
                                 float aspect_ratio = 0.f);
 
+    // Copy of env with its own backend state. Instance state is shared
+    // copy-on-write, see Environment::fork.
+    Environment forkEnvironment(const Environment &env);
+
+    // Environments made after this get RandomKey { seed, 0, 0 },
+    // RandomKey { seed, 1, 0 }, ... in creation order. Environments may be
+    // made from several threads, each gets a distinct envIdx, but which
+    // one is only deterministic when creation is serial. Use
+    // Environment::setRandomKey when it isn't.
+    void setRandomSeed(uint64_t seed);
+
     void setActiveEnvironmentMaps(
         std::shared_ptr<EnvironmentMapGroup> env_maps);
 
@@ -68,9 +92,13 @@ public:
     AuxiliaryOutputs getAuxiliaryOutputs(RenderBatch &batch) const;
 
 private:
+    RandomKey nextRandomKey();
+
     RendererImpl backend_;
     float aspect_ratio_;
     uint32_t batch_size_;
+    uint64_t random_seed_;
+    std::atomic<uint32_t> next_env_idx_;
 };
 
 }
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <vector>
+
+namespace RLpbr {
+
+// Dynamic bounding volume hierarchy over axis aligned boxes. Leaves store
+// their box enlarged by a margin, so small movements don't touch the tree.
+// Inserting picks the sibling with the lowest surface area cost and
+// rotations keep the tree balanced.
+class AABBTree {
+public:
+    static constexpr uint32_t nullNode = ~0u;
+
+    AABBTree(float margin = 0.1f);
+
+    uint32_t insert(const glm::vec3 &min, const glm::vec3 &max,
+                    uint32_t user_data);
+    void remove(uint32_t leaf);
+
+    // Returns true if the leaf had to be reinserted because the new box
+    // no longer fits in the enlarged one
+    bool update(uint32_t leaf, const glm::vec3 &min, const glm::vec3 &max);
+
+    void clear();
+
+    inline uint32_t getUserData(uint32_t leaf) const;
+    inline uint32_t getNumLeaves() const;
+    inline size_t getNumBytes() const;
+
+    // Calls leaf_fn(user_data) for every leaf whose enlarged box passes
+    // overlaps(min, max). Internal nodes failing overlaps are skipped.
+    template <typename OverlapFn, typename LeafFn>
+    inline void query(OverlapFn &&overlaps, LeafFn &&leaf_fn);
+
+    // Visits leaves whose enlarged box the ray enters before max_t.
+    // leaf_fn(user_data) returns the new max_t, so a closest hit search
+    // prunes everything behind the current hit.
+    template <typename LeafFn>
+    inline void raycast(const glm::vec3 &origin, const glm::vec3 &dir,
+                        float max_t, LeafFn &&leaf_fn);
+
+    // Slab test, t is where the ray enters the box (0 if it starts inside)
+    static inline bool intersectRay(const glm::vec3 &min,
+                                    const glm::vec3 &max,
+                                    const glm::vec3 &origin,
+                                    const glm::vec3 &inv_dir,
+                                    float max_t, float &t);
+
+private:
+    struct Node {
+        glm::vec3 min;
+        glm::vec3 max;
+        // Next free node while on the free list
+        uint32_t parent;
+        uint32_t children[2];
+        uint32_t userData;
+        // 0 for leaves, -1 for free nodes
+        int32_t height;
+
+        inline bool isLeaf() const { return children[0] == nullNode; }
+    };
+
+    uint32_t allocateNode();
+    void freeNode(uint32_t node_idx);
+
+    void insertLeaf(uint32_t leaf);
+    void removeLeaf(uint32_t leaf);
+    void refitAncestors(uint32_t node_idx);
+    uint32_t balance(uint32_t node_idx);
+
+    std::vector<Node> nodes_;
+    std::vector<uint32_t> stack_;
+    uint32_t root_;
+    uint32_t free_list_;
+    uint32_t num_leaves_;
+    float margin_;
+};
+
+}
+
+#include <rlpbr/aabb_tree.inl>
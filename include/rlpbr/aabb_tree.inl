@@ -0,0 +1,127 @@
+#pragma once
+
+#include <algorithm>
+
+namespace RLpbr {
+
+uint32_t AABBTree::getUserData(uint32_t leaf) const
+{
+    return nodes_[leaf].userData;
+}
+
+uint32_t AABBTree::getNumLeaves() const
+{
+    return num_leaves_;
+}
+
+size_t AABBTree::getNumBytes() const
+{
+    return nodes_.capacity() * sizeof(Node) +
+        stack_.capacity() * sizeof(uint32_t);
+}
+
+template <typename OverlapFn, typename LeafFn>
+void AABBTree::query(OverlapFn &&overlaps, LeafFn &&leaf_fn)
+{
+    if (root_ == nullNode) {
+        return;
+    }
+
+    stack_.clear();
+    stack_.push_back(root_);
+
+    while (!stack_.empty()) {
+        uint32_t node_idx = stack_.back();
+        stack_.pop_back();
+
+        const Node &node = nodes_[node_idx];
+        if (!overlaps(node.min, node.max)) {
+            continue;
+        }
+
+        if (node.isLeaf()) {
+            leaf_fn(node.userData);
+        } else {
+            stack_.push_back(node.children[0]);
+            stack_.push_back(node.children[1]);
+        }
+    }
+}
+
+template <typename LeafFn>
+void AABBTree::raycast(const glm::vec3 &origin, const glm::vec3 &dir,
+                       float max_t, LeafFn &&leaf_fn)
+{
+    if (root_ == nullNode) {
+        return;
+    }
+
+    glm::vec3 inv_dir = 1.f / dir;
+
+    stack_.clear();
+    stack_.push_back(root_);
+
+    while (!stack_.empty()) {
+        uint32_t node_idx = stack_.back();
+        stack_.pop_back();
+
+        const Node &node = nodes_[node_idx];
+
+        float t;
+        if (!intersectRay(node.min, node.max, origin, inv_dir, max_t, t)) {
+            continue;
+        }
+
+        if (node.isLeaf()) {
+            max_t = leaf_fn(node.userData);
+            continue;
+        }
+
+        // Visit the nearer child first so later ones can be pruned
+        float t0, t1;
+        bool hit0 = intersectRay(nodes_[node.children[0]].min,
+                                 nodes_[node.children[0]].max,
+                                 origin, inv_dir, max_t, t0);
+        bool hit1 = intersectRay(nodes_[node.children[1]].min,
+                                 nodes_[node.children[1]].max,
+                                 origin, inv_dir, max_t, t1);
+
+        if (hit0 && hit1) {
+            if (t0 <= t1) {
+                stack_.push_back(node.children[1]);
+                stack_.push_back(node.children[0]);
+            } else {
+                stack_.push_back(node.children[0]);
+                stack_.push_back(node.children[1]);
+            }
+        } else if (hit0) {
+            stack_.push_back(node.children[0]);
+        } else if (hit1) {
+            stack_.push_back(node.children[1]);
+        }
+    }
+}
+
+bool AABBTree::intersectRay(const glm::vec3 &min,
+                            const glm::vec3 &max,
+                            const glm::vec3 &origin,
+                            const glm::vec3 &inv_dir,
+                            float max_t, float &t)
+{
+    // NaNs from 0 * inf (ray in a slab's plane) compare false and are
+    // ignored by the min / max below
+    float t_near = 0.f;
+    float t_far = max_t;
+    for (int axis = 0; axis < 3; axis++) {
+        float t1 = (min[axis] - origin[axis]) * inv_dir[axis];
+        float t2 = (max[axis] - origin[axis]) * inv_dir[axis];
+
+        t_near = std::max(t_near, std::min(t1, t2));
+        t_far = std::min(t_far, std::max(t1, t2));
+    }
+
+    t = t_near;
+    return t_near <= t_far;
+}
+
+}
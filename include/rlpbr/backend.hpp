@@ -5,22 +5,44 @@
 
 #include <glm/glm.hpp>
 
+#ifdef RLPBR_HOST_ONLY
+#include <cstdint>
+#else
 #include <cuda_fp16.h>
+#endif
 
 #include <memory>
 #include <string_view>
 
 namespace RLpbr {
 
+#ifdef RLPBR_HOST_ONLY
+// Builds without CUDA only need half for storage, outputs are IEEE
+// binary16 bit patterns like cuda_fp16's half
+struct half {
+    uint16_t bits;
+};
+#endif
+
 class EnvironmentImpl {
 public:
     typedef void(*DestroyType)(EnvironmentBackend *);
     typedef uint32_t(EnvironmentBackend::*AddLightType)(
         const glm::vec3 &, const glm::vec3 &);
+    typedef uint32_t(EnvironmentBackend::*AddSceneLightType)(uint32_t);
     typedef void(EnvironmentBackend::*RemoveLightType)(uint32_t);
+    typedef void(EnvironmentBackend::*RandomizeType)(const RandomKey &);
+    typedef bool(EnvironmentBackend::*TraceRaysType)(
+        const Environment &, const RayQuery *, uint32_t, RayQueryHit *);
+    typedef bool(EnvironmentBackend::*TraceOcclusionType)(
+        const Environment &, const RayQuery *, uint32_t, uint8_t *);
 
     EnvironmentImpl(DestroyType destroy_ptr, AddLightType add_light_ptr,
+                    AddSceneLightType add_scene_light_ptr,
                     RemoveLightType remove_light_ptr,
+                    RandomizeType randomize_ptr,
+                    TraceRaysType trace_rays_ptr,
+                    TraceOcclusionType trace_occlusion_ptr,
                     EnvironmentBackend *state);
     EnvironmentImpl(const EnvironmentImpl &) = delete;
     EnvironmentImpl(EnvironmentImpl &&);
@@ -32,15 +54,29 @@ public:
 
     inline uint32_t addLight(const glm::vec3 &position,
                              const glm::vec3 &color);
+    // Appends a copy of EnvironmentInit::lights[scene_light_idx]
+    inline uint32_t addSceneLight(uint32_t scene_light_idx);
     inline void removeLight(uint32_t idx);
 
+    inline void randomize(const RandomKey &key);
+
+    inline bool traceRays(const Environment &env, const RayQuery *rays,
+                          uint32_t num_rays, RayQueryHit *hits);
+    inline bool traceOcclusion(const Environment &env,
+                               const RayQuery *rays, uint32_t num_rays,
+                               uint8_t *occluded);
+
     inline EnvironmentBackend *getState() { return state_; };
     inline const EnvironmentBackend *getState() const  { return state_; };
 
 private:
     DestroyType destroy_ptr_;
     AddLightType add_light_ptr_;
+    AddSceneLightType add_scene_light_ptr_;
     RemoveLightType remove_light_ptr_;
+    RandomizeType randomize_ptr_;
+    TraceRaysType trace_rays_ptr_;
+    TraceOcclusionType trace_occlusion_ptr_;
     EnvironmentBackend *state_;
 };
 
@@ -74,9 +110,11 @@ public:
         SceneLoadData &&);
     typedef std::shared_ptr<EnvironmentMapGroup>(LoaderBackend::*LoadEnvMapsType)(
         const char **, uint32_t);
+    typedef SceneUploadSink *(LoaderBackend::*GetUploadSinkType)();
 
     LoaderImpl(DestroyType destroy_ptr, LoadSceneType load_scene_ptr,
-               LoadEnvMapsType load_env_maps_ptr, LoaderBackend *state);
+               LoadEnvMapsType load_env_maps_ptr,
+               GetUploadSinkType get_upload_sink_ptr, LoaderBackend *state);
     LoaderImpl(const LoaderImpl &) = delete;
     LoaderImpl(LoaderImpl &&);
 
@@ -90,10 +128,13 @@ public:
     inline std::shared_ptr<EnvironmentMapGroup> loadEnvironmentMaps(
         const char **paths, uint32_t num_maps);
 
+    inline SceneUploadSink *getUploadSink();
+
 private:
     DestroyType destroy_ptr_;
     LoadSceneType load_scene_ptr_;
     LoadEnvMapsType load_env_maps_ptr_;
+    GetUploadSinkType get_upload_sink_ptr_;
     LoaderBackend *state_;
 };
 
@@ -7,11 +7,19 @@ namespace RLpbr {
 enum class BackendSelect : uint32_t {
     Optix,
     Vulkan,
+    CPU,
 };
 
 enum class RenderMode : uint32_t {
     PathTracer,
     Biased,
+    // No shading, CPU backend only. Each pixel's 4 halves hold the linear
+    // depth along the camera's view direction (0 if nothing was hit),
+    // then the object, material and instance index as 16 bit integers
+    // (0xFFFF if nothing was hit). The instance index is where the shaded
+    // modes put it. Rendering aborts for scenes or environments with more
+    // than 0xFFFE objects, materials or instances.
+    Rasterize,
 };
 
 enum class RenderFlags : uint32_t {
@@ -38,6 +46,42 @@ struct RenderConfig {
     RenderFlags flags;
     float clampThreshold;
     BackendSelect backend;
+    // Threads (including the caller) preparing environments for render.
+    // 0 picks one per hardware thread.
+    uint32_t numPrepThreads;
+};
+
+// Worker counts for AssetLoader::loadScenes. Uploads always run on the
+// calling thread since each loader owns a single set of command buffers.
+struct LoadPipelineConfig {
+    uint32_t numReadWorkers;
+    uint32_t numDecodeWorkers;
+    uint32_t numStageWorkers;
+    uint32_t maxScenesInFlight;
+};
+
+struct LoadStageStats {
+    uint64_t numItems;
+    uint64_t numBytes;
+    double busySeconds;
+};
+
+struct LoadPipelineStats {
+    LoadStageStats read;
+    LoadStageStats decode;
+    LoadStageStats stage;
+    LoadStageStats upload;
+    double totalSeconds;
+};
+
+// Host side time spent in Renderer::render before submission
+struct BatchPrepStats {
+    uint32_t numThreads;
+    // Serial part: staging offsets, acceleration structure allocation and
+    // command recording
+    double layoutSeconds;
+    // Per environment copies into staging, split across threads
+    double stageSeconds;
 };
 
 inline RenderFlags & operator|=(RenderFlags &a, RenderFlags b)
@@ -0,0 +1,248 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <vector>
+
+namespace RLpbr {
+
+// Array that reads through to an immutable base (owned by someone else,
+// must outlive the array) and copies fixed size chunks on first write.
+// Elements past the end of the base always live in owned chunks. Owned
+// chunks can be shared with forks of the array, whichever side writes to
+// a shared chunk first copies it again.
+template <typename T>
+class CowArray {
+public:
+    static constexpr uint32_t chunkShift = 6;
+    static constexpr uint32_t chunkSize = 1u << chunkShift;
+    static constexpr uint32_t chunkMask = chunkSize - 1;
+
+    class ConstIterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T *;
+        using reference = const T &;
+
+        ConstIterator(const CowArray *arr, uint32_t idx)
+            : arr_(arr), idx_(idx)
+        {}
+
+        const T &operator*() const { return (*arr_)[idx_]; }
+        const T *operator->() const { return &(*arr_)[idx_]; }
+        ConstIterator &operator++() { idx_++; return *this; }
+        bool operator==(const ConstIterator &o) const { return idx_ == o.idx_; }
+        bool operator!=(const ConstIterator &o) const { return idx_ != o.idx_; }
+
+    private:
+        const CowArray *arr_;
+        uint32_t idx_;
+    };
+
+    CowArray()
+        : base_(nullptr),
+          base_size_(0),
+          size_(0),
+          chunks_(),
+          owned_chunks_()
+    {}
+
+    CowArray(const std::vector<T> &base)
+        : base_(base.data()),
+          base_size_(base.size()),
+          size_(base_size_),
+          chunks_(numChunksFor(base_size_)),
+          owned_chunks_()
+    {}
+
+    CowArray(CowArray &&) = default;
+    CowArray & operator=(CowArray &&) = default;
+
+    uint32_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    const T &operator[](uint32_t idx) const
+    {
+        const T *chunk = chunks_[idx >> chunkShift].get();
+        if (chunk) {
+            return chunk[idx & chunkMask];
+        }
+
+        return base_[idx];
+    }
+
+    const T &back() const { return (*this)[size_ - 1]; }
+
+    // Write access, copies the containing chunk out of the base if needed
+    T &mut(uint32_t idx)
+    {
+        return ownChunk(idx >> chunkShift)[idx & chunkMask];
+    }
+
+    // Copy of this array that shares the base and all owned chunks
+    CowArray fork() const
+    {
+        CowArray copy;
+        copy.base_ = base_;
+        copy.base_size_ = base_size_;
+        copy.size_ = size_;
+        copy.chunks_ = chunks_;
+        copy.owned_chunks_ = owned_chunks_;
+
+        return copy;
+    }
+
+    void push_back(const T &v)
+    {
+        uint32_t chunk_idx = size_ >> chunkShift;
+        if (chunk_idx >= chunks_.size()) {
+            chunks_.emplace_back();
+        }
+
+        ownChunk(chunk_idx)[size_ & chunkMask] = v;
+        size_++;
+    }
+
+    void pop_back() { size_--; }
+
+    // New elements past the end of the base are left uninitialized
+    void resize(uint32_t new_size)
+    {
+        uint32_t num_chunks = numChunksFor(new_size);
+        if (num_chunks > chunks_.size()) {
+            chunks_.resize(num_chunks);
+        }
+
+        if (new_size > base_size_) {
+            for (uint32_t chunk_idx = base_size_ >> chunkShift;
+                 chunk_idx < num_chunks; chunk_idx++) {
+                ownChunk(chunk_idx);
+            }
+        }
+
+        size_ = new_size;
+    }
+
+    ConstIterator begin() const { return ConstIterator(this, 0); }
+    ConstIterator end() const { return ConstIterator(this, size_); }
+
+    // Chunk granularity access for bulk copies
+    uint32_t numChunks() const { return numChunksFor(size_); }
+
+    const T *chunkData(uint32_t chunk_idx) const
+    {
+        const T *chunk = chunks_[chunk_idx].get();
+        if (chunk) {
+            return chunk;
+        }
+
+        return base_ + (chunk_idx << chunkShift);
+    }
+
+    uint32_t chunkLength(uint32_t chunk_idx) const
+    {
+        return std::min(size_ - (chunk_idx << chunkShift), chunkSize);
+    }
+
+    // fn(const T *src, uint32_t offset, uint32_t num_elems) for each
+    // contiguous piece of [begin_idx, end_idx), offset is relative to
+    // begin_idx
+    template <typename Fn>
+    void visitRange(uint32_t begin_idx, uint32_t end_idx, Fn &&fn) const
+    {
+        uint32_t offset = 0;
+        while (begin_idx < end_idx) {
+            uint32_t chunk_idx = begin_idx >> chunkShift;
+            uint32_t chunk_end =
+                std::min((chunk_idx + 1) << chunkShift, end_idx);
+            uint32_t num_elems = chunk_end - begin_idx;
+
+            fn(chunkData(chunk_idx) + (begin_idx & chunkMask), offset,
+               num_elems);
+
+            offset += num_elems;
+            begin_idx = chunk_end;
+        }
+    }
+
+    void copyRange(T *dst, uint32_t begin_idx, uint32_t end_idx) const
+    {
+        visitRange(begin_idx, end_idx,
+            [dst](const T *src, uint32_t offset, uint32_t num_elems) {
+                std::copy(src, src + num_elems, dst + offset);
+            });
+    }
+
+    void copyTo(T *dst) const { copyRange(dst, 0, size_); }
+
+    // Back to the base contents, O(number of owned chunks)
+    void reset()
+    {
+        for (uint32_t chunk_idx : owned_chunks_) {
+            chunks_[chunk_idx].reset();
+        }
+        owned_chunks_.clear();
+
+        chunks_.resize(numChunksFor(base_size_));
+        size_ = base_size_;
+    }
+
+    uint32_t numOwnedChunks() const { return owned_chunks_.size(); }
+
+    // Indices of chunks that may differ from the base, in the order they
+    // were first written. May include chunks past numChunks() after a
+    // pop_back / resize.
+    const std::vector<uint32_t> &ownedChunks() const { return owned_chunks_; }
+
+    // Host memory held by this array on top of the shared base, chunks
+    // shared with forks are counted by every owner
+    size_t numOwnedBytes() const
+    {
+        return owned_chunks_.size() * chunkSize * sizeof(T) +
+            chunks_.capacity() * sizeof(std::shared_ptr<T[]>) +
+            owned_chunks_.capacity() * sizeof(uint32_t);
+    }
+
+private:
+    static uint32_t numChunksFor(uint32_t num_elems)
+    {
+        return (num_elems + chunkMask) >> chunkShift;
+    }
+
+    T *ownChunk(uint32_t chunk_idx)
+    {
+        std::shared_ptr<T[]> &chunk = chunks_[chunk_idx];
+        if (!chunk) {
+            chunk.reset(new T[chunkSize]);
+
+            uint32_t chunk_start = chunk_idx << chunkShift;
+            if (chunk_start < base_size_) {
+                uint32_t num_base =
+                    std::min(base_size_ - chunk_start, chunkSize);
+                std::copy(base_ + chunk_start,
+                          base_ + chunk_start + num_base, chunk.get());
+            }
+
+            owned_chunks_.push_back(chunk_idx);
+        } else if (chunk.use_count() > 1) {
+            // Shared with a fork
+            std::shared_ptr<T[]> copy(new T[chunkSize]);
+            std::copy(chunk.get(), chunk.get() + chunkSize, copy.get());
+            chunk = std::move(copy);
+        }
+
+        return chunk.get();
+    }
+
+    const T *base_;
+    uint32_t base_size_;
+    uint32_t size_;
+    std::vector<std::shared_ptr<T[]>> chunks_;
+    std::vector<uint32_t> owned_chunks_;
+};
+
+}
@@ -1,10 +1,14 @@
 #pragma once 
 
 #include <rlpbr/fwd.hpp>
+#include <rlpbr/aabb_tree.hpp>
 #include <rlpbr/backend.hpp>
+#include <rlpbr/cow_array.hpp>
+#include <rlpbr/light_sampler.hpp>
 #include <rlpbr/utils.hpp>
 
 #include <glm/glm.hpp>
+#include <limits>
 #include <vector>
 
 namespace RLpbr {
@@ -21,10 +25,123 @@ struct InstanceTransform {
     glm::mat4x3 inv;
 };
 
+// Translation * rotation * per axis scale in 32 bytes, versus 96 for
+// InstanceTransform. The rotation is a quaternion (x y z w) scaled so its
+// largest component is +-32767, see packTransforms. Used to upload
+// transforms, instance state stays in InstanceTransform.
+struct CompactTransform {
+    glm::vec3 position;
+    int16_t rotation[4];
+    glm::vec3 scale;
+};
+
 enum class InstanceFlags : uint32_t {
     Transparent = 1 << 0,
 };
 
+// Instances are visible to rays whose mask shares a bit with theirs:
+// transparent for instances with InstanceFlags::Transparent, opaque for
+// the rest. Rendered rays only see opaque instances.
+namespace VisibilityMask {
+
+constexpr uint32_t opaque = 1;
+constexpr uint32_t transparent = 2;
+constexpr uint32_t all = opaque | transparent;
+
+}
+
+// Ray for Environment::traceRays / traceOcclusion. Distances are in units
+// of direction, which doesn't need to be normalized.
+struct RayQuery {
+    glm::vec3 origin;
+    float maxT;
+    glm::vec3 direction;
+    uint32_t visibilityMask;
+};
+
+struct RayQueryHit {
+    // maxT if the ray missed
+    float t;
+    // InstanceID of the hit instance, ~0u if the ray missed
+    uint32_t instanceID;
+    // Index into the scene's meshes and triangle within the mesh
+    uint32_t meshIndex;
+    uint32_t triangleIndex;
+    // Weights of the triangle's second and third vertex
+    glm::vec2 barycentrics;
+    // World space geometric normal, facing the ray origin
+    glm::vec3 normal;
+};
+
+// Half open range of indices modified since the backend last consumed
+// the environment
+struct DirtyRange {
+    uint32_t begin;
+    uint32_t end;
+
+    inline void add(uint32_t idx);
+    inline void add(uint32_t range_begin, uint32_t range_end);
+    inline bool empty() const;
+    inline void clear();
+};
+
+struct EnvironmentUpdates {
+    // Indices into getTransforms() / getInstanceFlags()
+    DirtyRange transforms;
+    DirtyRange flags;
+    // Indices into getInstanceMaterials()
+    DirtyRange materials;
+    // Instances were added or removed, everything must be reuploaded
+    // and the TLAS rebuilt
+    bool structural;
+};
+
+// Instance handles returned by Environment::addInstance. The low bits
+// select a slot, the high bits hold the slot's generation, which is bumped
+// whenever the slot is freed so stale handles can be detected.
+namespace InstanceID {
+
+constexpr uint32_t slotBits = 24;
+constexpr uint32_t slotMask = (1u << slotBits) - 1;
+constexpr uint32_t generationMask = (1u << (32 - slotBits)) - 1;
+
+inline constexpr uint32_t make(uint32_t slot, uint32_t generation)
+{
+    return (generation << slotBits) | slot;
+}
+
+inline constexpr uint32_t slot(uint32_t inst_id)
+{
+    return inst_id & slotMask;
+}
+
+inline constexpr uint32_t generation(uint32_t inst_id)
+{
+    return inst_id >> slotBits;
+}
+
+}
+
+// Selects the random streams used for an environment's material and domain
+// randomization. Draws only depend on the key, not on which thread built
+// the environment or how many environments were built before it.
+struct RandomKey {
+    uint64_t seed;
+    uint32_t envIdx;
+    uint32_t episode;
+};
+
+// Serialized state of an Environment, see Environment::snapshot. Can be
+// stored and restored in another process running the same scene.
+struct EnvironmentSnapshot {
+    std::vector<uint8_t> data;
+};
+
+inline bool operator==(const EnvironmentSnapshot &a,
+                       const EnvironmentSnapshot &b);
+inline bool operator!=(const EnvironmentSnapshot &a,
+                       const EnvironmentSnapshot &b);
+
 struct Camera {
     inline Camera(const glm::vec3 &eye, const glm::vec3 &target,
                   const glm::vec3 &up_vec, float vertical_fov,
@@ -63,7 +180,8 @@ class Environment {
 public:
     Environment(EnvironmentImpl &&backend,
                 const std::shared_ptr<Scene> &scene,
-                const Camera &cam);
+                const Camera &cam,
+                const RandomKey &random_key = {});
 
     Environment(const Environment &) = delete;
     Environment & operator=(const Environment &) = delete;
@@ -80,15 +198,112 @@ public:
                                 bool dynamic = true,
                                 bool kinematic = false);
 
+    // Stale handles are ignored
     void deleteInstance(uint32_t inst_id);
 
+    inline bool isValidInstance(uint32_t inst_id) const;
+
+    // Position of the instance in getInstances() / getTransforms(), only
+    // stable until the next deleteInstance. inst_id must be valid, the
+    // setters below ignore stale handles.
+    inline uint32_t getInstanceIndex(uint32_t inst_id) const;
+    inline uint32_t getInstanceID(uint32_t instance_idx) const;
+
     inline void moveInstance(uint32_t inst_id, const glm::vec3 &delta);
     inline void rotateInstance(uint32_t inst_id, const glm::quat &rot);
 
+    // Absolute rigid transform, same convention as addInstance
+    inline void setInstanceTransform(uint32_t inst_id,
+                                     const glm::vec3 &position,
+                                     const glm::quat &rotation);
+
     template <int N>
     inline void setInstanceMaterial(uint32_t inst_id,
                                     const std::array<uint32_t, N> &material_idxs);
 
+    // Batched updates for many instances at once. positions / rotations
+    // are parallel arrays indexed like inst_ids; material_idxs holds
+    // num_mats_per_instance entries per instance. Stale handles, and for
+    // materials instances whose object doesn't have exactly
+    // num_mats_per_instance meshes, are skipped.
+    void setInstanceTransforms(const uint32_t *inst_ids,
+                               const glm::vec3 *positions,
+                               const glm::quat *rotations,
+                               size_t num_instances);
+
+    // Same with compact transforms, scales must be nonzero
+    void setInstanceTransforms(const uint32_t *inst_ids,
+                               const CompactTransform *transforms,
+                               size_t num_instances);
+
+    void setInstanceMaterials(const uint32_t *inst_ids,
+                              const uint32_t *material_idxs,
+                              uint32_t num_mats_per_instance,
+                              size_t num_instances);
+
+    // Optional transform hierarchy. A child keeps its transform relative
+    // to its parent: when the parent moves, updateHierarchy recomputes the
+    // child's transform as parent * local. Setting a child's transform
+    // directly updates its local transform instead. Linking and unlinking
+    // keep the child where it is. Returns false for stale handles or if
+    // the link would create a cycle.
+    static constexpr uint32_t noParent = ~0u;
+
+    bool setInstanceParent(uint32_t child_id, uint32_t parent_id);
+
+    // InstanceID of the parent or noParent
+    inline uint32_t getInstanceParent(uint32_t inst_id) const;
+
+    // Transform relative to the parent, same as setInstanceTransform for
+    // instances without one
+    inline void setInstanceLocalTransform(uint32_t inst_id,
+                                          const glm::vec3 &position,
+                                          const glm::quat &rotation);
+
+    // Propagates changes down the hierarchy, parents before children.
+    // Called by Renderer::render / bake, call manually before reading
+    // getTransforms() of children.
+    void updateHierarchy();
+
+    // Spatial queries against instance world space bounds, host only.
+    // The first query builds a dynamic AABB tree, which later queries
+    // update for the instances changed in between. Matching InstanceIDs
+    // are appended to out in no particular order.
+    void queryInstancesOverlap(const glm::vec3 &min, const glm::vec3 &max,
+                               std::vector<uint32_t> &out);
+
+    void queryInstancesRadius(const glm::vec3 &center, float radius,
+                              std::vector<uint32_t> &out);
+
+    // Instances whose bounds are not entirely behind one of the planes.
+    // dot(plane.xyz, p) + plane.w >= 0 is in front.
+    void queryInstancesFrustum(const glm::vec4 *planes, uint32_t num_planes,
+                               std::vector<uint32_t> &out);
+
+    // Frustum of cam, up to far_dist along the view direction
+    void queryInstancesFrustum(const Camera &cam, float far_dist,
+                               std::vector<uint32_t> &out);
+
+    // Closest instance whose bounds the ray enters before max_t, or
+    // ~0u. hit_t receives the entry distance in units of dir.
+    uint32_t pickInstance(const glm::vec3 &origin, const glm::vec3 &dir,
+                          float max_t = std::numeric_limits<float>::infinity(), float *hit_t = nullptr);
+
+    // Batched ray casts against the instances' triangles, for depth scans,
+    // semantics under a crosshair and the like. Runs on the calling thread
+    // against the backend's host acceleration structure, which is brought
+    // up to date first. Neighbouring rays are traced together, so coherent
+    // batches (scan lines) are fastest. Only the CPU backend keeps geometry
+    // on the host: the others return false without writing hits.
+    bool traceRays(const RayQuery *rays, uint32_t num_rays,
+                   RayQueryHit *hits);
+
+    // Line of sight: occluded[i] is 1 if ray i hits anything before its
+    // maxT, 0 otherwise. Cheaper than traceRays. Returns false like
+    // traceRays.
+    bool traceOcclusion(const RayQuery *rays, uint32_t num_rays,
+                        uint8_t *occluded);
+
     inline void setCameraView(const glm::vec3 &eye, const glm::vec3 &target,
                               const glm::vec3 &up);
 
@@ -99,58 +314,200 @@ public:
 
     inline void setCameraView(const glm::mat4 &camera_to_world);
 
+    // Lights start out as the scene's lights, with IDs equal to their
+    // index in EnvironmentInit::lights. IDs stay valid until the light is
+    // removed, later removes / recolours of that ID are ignored.
     uint32_t addLight(const glm::vec3 &position, const glm::vec3 &color);
     void removeLight(uint32_t light_id);
 
+    // Color of a light from addLight, also sets its selection weight
+    void setLightColor(uint32_t light_id, const glm::vec3 &color);
+
+    inline bool isValidLight(uint32_t light_id) const;
+    inline uint32_t getNumLights() const;
+
+    // Power proportional light selection over the dense light order of
+    // the backends. Rebuilds the tables of lights changed since the last
+    // call, called by Renderer::render / bake.
+    void updateLightSampling();
+    inline const LightSampler &getLightSampler() const;
+
     inline const std::shared_ptr<Scene> &getScene() const;
     inline const EnvironmentBackend *getBackend() const;
     inline EnvironmentBackend *getBackend();
     inline const Camera &getCamera() const;
 
-    inline const std::vector<ObjectInstance> &
+    // Per instance state reads through to the scene's EnvironmentInit
+    // defaults, only chunks modified in this environment are stored
+    inline const CowArray<ObjectInstance> &
         getInstances() const;
 
-    inline const std::vector<uint32_t> &
+    inline const CowArray<uint32_t> &
         getInstanceMaterials() const;
 
-    inline std::vector<uint32_t> &
+    inline CowArray<uint32_t> &
         getInstanceMaterials();
 
-    inline const std::vector<InstanceTransform> &
+    inline const CowArray<InstanceTransform> &
         getTransforms() const;
 
-    inline const std::vector<InstanceFlags> &
+    inline const CowArray<InstanceFlags> &
         getInstanceFlags() const;
 
     inline uint32_t getNumInstances() const;
 
     inline bool isDirty() const;
+    inline const EnvironmentUpdates &getUpdates() const;
+
+    // Changes on every clearDirty() and is unique across environments.
+    // Backends caching per environment uploads can only apply getUpdates()
+    // on top of their copy if they were the last consumer.
+    inline uint64_t getUpdateEpoch() const;
+
+    // Forces a full reupload, needed after modifying the arrays returned
+    // by the non-const getters
     inline void setDirty() const;
     inline void clearDirty() const;
 
-    // Reset environment to default instances / materials
+    // Reset environment to default instances / materials. Cost scales with
+    // the amount of state modified since construction / the last reset.
+    // Advances the episode of the random key, so randomized materials and
+    // domain parameters are redrawn.
     void reset();
 
+    // Redraws randomized materials and domain parameters from key
+    void setRandomKey(const RandomKey &key);
+    inline const RandomKey &getRandomKey() const;
+
+    // Host memory held on top of the shared scene defaults
+    size_t getOverrideBytes() const;
+
+    // Captures instances, materials, transforms, flags, hierarchy, lights,
+    // camera and random key. Only state that differs from the scene
+    // defaults is stored, environments in the same state produce equal
+    // snapshots. Applies pending hierarchy updates first.
+    EnvironmentSnapshot snapshot();
+
+    // Returns to the state captured by snapshot() on any environment of
+    // the same scene. Instance and light handles from the snapshotted
+    // environment are valid again afterwards. Returns false and leaves the
+    // environment untouched if the snapshot is malformed or from another
+    // scene.
+    bool restore(const EnvironmentSnapshot &snapshot);
+
+    // Copy of this environment on top of a fresh backend for the same
+    // scene, see Renderer::forkEnvironment. Modified state is shared
+    // copy-on-write until either environment writes to it.
+    Environment fork(EnvironmentImpl &&backend) const;
+
 private:
+    Environment(EnvironmentImpl &&backend, const Environment &src);
+
     EnvironmentImpl backend_;
     std::shared_ptr<Scene> scene_;
 
     Camera camera_;
 
-    std::vector<ObjectInstance> instances_;
-    std::vector<uint32_t> instance_materials_;
-    std::vector<InstanceTransform> transforms_;
-    std::vector<InstanceFlags> instance_flags_;
+    CowArray<ObjectInstance> instances_;
+    CowArray<uint32_t> instance_materials_;
+    CowArray<InstanceTransform> transforms_;
+    CowArray<InstanceFlags> instance_flags_;
+
+    void compactInstanceMaterials();
 
-    std::vector<uint32_t> index_map_;
-    std::vector<uint32_t> reverse_id_map_;
+    // Slot -> InstanceID::make(dense index, slot generation). Free slots
+    // keep their generation with InstanceID::slotMask as the index.
+    CowArray<uint32_t> index_map_;
+    // Dense instance index -> slot
+    CowArray<uint32_t> reverse_id_map_;
     std::vector<uint32_t> free_ids_;
+    // Entries of instance_materials_ owned by deleted instances
+    uint32_t num_free_materials_;
+
+    // Destinations for the batched setters, kept to avoid reallocating.
+    // Stale handles write to batch_discard_.
+    std::vector<InstanceTransform *> batch_dsts_;
+    InstanceTransform batch_discard_;
+
+    // Transform hierarchy, indexed by slot. Empty unless the scene or
+    // setInstanceParent introduced a link, slots past the end have no
+    // parent or children.
+    CowArray<uint32_t> parents_;
+    CowArray<InstanceTransform> local_transforms_;
+    CowArray<uint32_t> num_children_;
+
+    // Scene's order until the first setInstanceParent
+    bool custom_hierarchy_order_;
+    bool hierarchy_order_valid_;
+    std::vector<uint32_t> hierarchy_order_;
+    std::vector<uint32_t> hierarchy_levels_;
+
+    enum HierarchyDirty : uint8_t {
+        HierarchyLocalDirty = 1 << 0,
+        HierarchyWorldDirty = 1 << 1,
+        HierarchyParentMoved = 1 << 2,
+    };
+
+    // Per slot HierarchyDirty bits, nonzero entries are listed in
+    // hierarchy_dirty_slots_
+    std::vector<uint8_t> hierarchy_dirty_;
+    std::vector<uint32_t> hierarchy_dirty_slots_;
+    std::vector<const InstanceTransform *> hierarchy_parents_;
+    std::vector<const InstanceTransform *> hierarchy_srcs_;
+    std::vector<InstanceTransform *> hierarchy_dsts_;
+
+    inline void markHierarchyDirty(uint32_t slot, uint8_t flags);
+    void growHierarchy(uint32_t num_slots);
+    void detachFromHierarchy(uint32_t slot);
+
+    // Spatial index, leaves hold slots. Only maintained once a query
+    // has built it.
+    AABBTree spatial_tree_;
+    bool spatial_built_;
+    // Slot -> leaf in spatial_tree_
+    std::vector<uint32_t> spatial_leaves_;
+    std::vector<uint8_t> spatial_dirty_;
+    std::vector<uint32_t> spatial_dirty_slots_;
+
+    inline void markSpatialDirty(uint32_t slot);
+    inline void markTransformDirty(uint32_t slot);
+    // Drops pending hierarchy updates and the spatial index, for when all
+    // instance state is replaced at once
+    void clearDerivedState();
+    void syncSpatialIndex();
+    void computeWorldBounds(uint32_t instance_idx, glm::vec3 &min,
+                            glm::vec3 &max) const;
 
     std::vector<uint32_t> free_light_ids_;
-    std::vector<uint32_t> light_ids_;
-    std::vector<uint32_t> light_reverse_ids_;
-
-    mutable bool dirty_;
+    CowArray<uint32_t> light_ids_;
+    // Dense light index -> light ID, same order as the backend's lights
+    CowArray<uint32_t> light_reverse_ids_;
+
+    // Per light ID, so restore / fork can re-add lights to a backend.
+    // Scene lights are re-added from EnvironmentInit::lights by index,
+    // sceneLightIdx is ~0u for lights from addLight.
+    struct LightParams {
+        glm::vec3 position;
+        glm::vec3 color;
+        uint32_t sceneLightIdx;
+    };
+    std::vector<LightParams> light_params_;
+    static std::vector<LightParams> sceneLightParams(const Scene &scene);
+    // Selection weights by dense light index
+    LightSampler light_sampler_;
+
+    // Brings the backend's lights from the current order to the target
+    // one, call before replacing light_reverse_ids_ / light_params_
+    void syncBackendLights(const CowArray<uint32_t> &target_reverse_ids,
+                           const std::vector<LightParams> &target_params);
+
+    RandomKey random_key_;
+    void randomize();
+
+    static uint64_t nextUpdateEpoch();
+
+    mutable EnvironmentUpdates updates_;
+    mutable uint64_t update_epoch_;
 };
 
 inline InstanceFlags & operator|=(InstanceFlags &a, InstanceFlags b)
@@ -4,8 +4,33 @@
 #include <glm/gtx/transform.hpp>
 #include <glm/gtc/quaternion.hpp>
 
+#include <algorithm>
+#include <cassert>
+
 namespace RLpbr {
 
+void DirtyRange::add(uint32_t idx)
+{
+    add(idx, idx + 1);
+}
+
+void DirtyRange::add(uint32_t range_begin, uint32_t range_end)
+{
+    begin = std::min(begin, range_begin);
+    end = std::max(end, range_end);
+}
+
+bool DirtyRange::empty() const
+{
+    return begin >= end;
+}
+
+void DirtyRange::clear()
+{
+    begin = ~0u;
+    end = 0;
+}
+
 namespace CameraHelper {
 
 static inline glm::vec3 computeViewVector(const glm::vec3 &eye,
@@ -51,6 +76,16 @@ static inline float convertFOV(float fov)
     return tanf(glm::radians(fov) / 2.f);
 }
 
+bool operator==(const EnvironmentSnapshot &a, const EnvironmentSnapshot &b)
+{
+    return a.data == b.data;
+}
+
+bool operator!=(const EnvironmentSnapshot &a, const EnvironmentSnapshot &b)
+{
+    return !(a == b);
+}
+
 Camera::Camera(const glm::vec3 &eye, const glm::vec3 &target,
                const glm::vec3 &up_vec, float vertical_fov,
                float aspect_ratio)
@@ -147,51 +182,206 @@ uint32_t Environment::addInstance(uint32_t obj_idx,
     transforms_.push_back({model_matrix, inv_model});
     instance_flags_.push_back(InstanceFlags {});
 
-    return instances_.size() - 1;
-
-    // FIXME
-#if 0
     uint32_t instance_idx = instances_.size() - 1;
 
-    uint32_t outer_id;
+    uint32_t slot;
+    uint32_t generation;
     if (free_ids_.size() > 0) {
-        uint32_t free_id = free_ids_.back();
+        slot = free_ids_.back();
         free_ids_.pop_back();
-        index_map_[free_id] = instance_idx;
 
-        outer_id = free_id;
+        generation = InstanceID::generation(index_map_[slot]);
+        index_map_.mut(slot) = InstanceID::make(instance_idx, generation);
     } else {
-        index_map_.push_back(instance_idx);
-        outer_id = index_map_.size() - 1;
+        slot = index_map_.size();
+        generation = 0;
+        index_map_.push_back(InstanceID::make(instance_idx, generation));
+    }
+
+    reverse_id_map_.push_back(slot);
+    markSpatialDirty(slot);
+
+    return InstanceID::make(slot, generation);
+}
+
+bool Environment::isValidInstance(uint32_t inst_id) const
+{
+    uint32_t slot = InstanceID::slot(inst_id);
+    if (slot >= index_map_.size()) {
+        return false;
     }
 
-    reverse_id_map_.emplace_back(outer_id);
+    uint32_t entry = index_map_[slot];
 
-    return outer_id;
-#endif
+    return InstanceID::slot(entry) != InstanceID::slotMask &&
+        InstanceID::generation(entry) == InstanceID::generation(inst_id);
+}
+
+uint32_t Environment::getInstanceIndex(uint32_t inst_id) const
+{
+    assert(isValidInstance(inst_id));
+    return InstanceID::slot(index_map_[InstanceID::slot(inst_id)]);
+}
+
+uint32_t Environment::getInstanceID(uint32_t instance_idx) const
+{
+    uint32_t slot = reverse_id_map_[instance_idx];
+    return InstanceID::make(slot,
+                            InstanceID::generation(index_map_[slot]));
 }
 
 void Environment::moveInstance(uint32_t inst_id, const glm::vec3 &delta)
 {
-    (void)inst_id;
-    (void)delta;
+    if (!isValidInstance(inst_id)) {
+        return;
+    }
+
+    uint32_t idx = getInstanceIndex(inst_id);
+    InstanceTransform &txfm = transforms_.mut(idx);
+
+    // inv = [A^-1 | -A^-1 t], so only the translation columns change
+    txfm.mat[3] += delta;
+    txfm.inv[3] -= glm::mat3(txfm.inv) * delta;
+
+    updates_.transforms.add(idx);
+    markTransformDirty(InstanceID::slot(inst_id));
 }
 
 void Environment::rotateInstance(uint32_t inst_id, const glm::quat &rot)
 {
-    (void)inst_id;
-    (void)rot;
+    if (!isValidInstance(inst_id)) {
+        return;
+    }
+
+    uint32_t idx = getInstanceIndex(inst_id);
+    InstanceTransform &txfm = transforms_.mut(idx);
+
+    // Rotate in place around the instance origin: A' = R A,
+    // A'^-1 = A^-1 R^T
+    glm::mat3 rot_matrix = glm::mat3_cast(rot);
+    glm::mat3 new_linear = rot_matrix * glm::mat3(txfm.mat);
+    glm::mat3 new_inv_linear =
+        glm::mat3(txfm.inv) * glm::transpose(rot_matrix);
+
+    glm::vec3 translation = txfm.mat[3];
+    txfm.mat = glm::mat4x3(new_linear[0], new_linear[1], new_linear[2],
+                           translation);
+    txfm.inv = glm::mat4x3(new_inv_linear[0], new_inv_linear[1],
+                           new_inv_linear[2],
+                           -(new_inv_linear * translation));
+
+    updates_.transforms.add(idx);
+    markTransformDirty(InstanceID::slot(inst_id));
+}
+
+void Environment::setInstanceTransform(uint32_t inst_id,
+                                       const glm::vec3 &position,
+                                       const glm::quat &rotation)
+{
+    if (!isValidInstance(inst_id)) {
+        return;
+    }
+
+    uint32_t idx = getInstanceIndex(inst_id);
+
+    glm::mat4 rot_matrix = glm::mat4_cast(rotation);
+
+    glm::mat4 model_matrix = glm::translate(position) * rot_matrix;
+    glm::mat4 inv_model = glm::transpose(rot_matrix) *
+        glm::translate(-position);
+
+    transforms_.mut(idx) = {model_matrix, inv_model};
+
+    updates_.transforms.add(idx);
+    markTransformDirty(InstanceID::slot(inst_id));
+}
+
+uint32_t Environment::getInstanceParent(uint32_t inst_id) const
+{
+    uint32_t slot = InstanceID::slot(inst_id);
+    if (!isValidInstance(inst_id) || slot >= parents_.size()) {
+        return noParent;
+    }
+
+    uint32_t parent = parents_[slot];
+    if (parent == noParent) {
+        return noParent;
+    }
+
+    return InstanceID::make(parent,
+                            InstanceID::generation(index_map_[parent]));
+}
+
+void Environment::setInstanceLocalTransform(uint32_t inst_id,
+                                            const glm::vec3 &position,
+                                            const glm::quat &rotation)
+{
+    if (!isValidInstance(inst_id)) {
+        return;
+    }
+
+    uint32_t slot = InstanceID::slot(inst_id);
+    if (slot >= parents_.size() || parents_[slot] == noParent) {
+        setInstanceTransform(inst_id, position, rotation);
+        return;
+    }
+
+    glm::mat4 rot_matrix = glm::mat4_cast(rotation);
+
+    glm::mat4 model_matrix = glm::translate(position) * rot_matrix;
+    glm::mat4 inv_model = glm::transpose(rot_matrix) *
+        glm::translate(-position);
+
+    local_transforms_.mut(slot) = {model_matrix, inv_model};
+
+    markHierarchyDirty(slot, HierarchyLocalDirty);
+}
+
+void Environment::markHierarchyDirty(uint32_t slot, uint8_t flags)
+{
+    // Only instances with a parent or children take part
+    if (slot >= parents_.size() ||
+        (parents_[slot] == noParent && num_children_[slot] == 0)) {
+        return;
+    }
+
+    if (hierarchy_dirty_.size() <= slot) {
+        hierarchy_dirty_.resize(parents_.size(), 0);
+    }
+
+    if (hierarchy_dirty_[slot] == 0) {
+        hierarchy_dirty_slots_.push_back(slot);
+    }
+    hierarchy_dirty_[slot] |= flags;
+}
+
+void Environment::markSpatialDirty(uint32_t slot)
+{
+    if (!spatial_built_) {
+        return;
+    }
+
+    if (spatial_dirty_.size() <= slot) {
+        spatial_dirty_.resize(index_map_.size(), 0);
+    }
+
+    if (!spatial_dirty_[slot]) {
+        spatial_dirty_[slot] = 1;
+        spatial_dirty_slots_.push_back(slot);
+    }
+}
+
+void Environment::markTransformDirty(uint32_t slot)
+{
+    markHierarchyDirty(slot, HierarchyWorldDirty);
+    markSpatialDirty(slot);
 }
 
 template <int N>
 void Environment::setInstanceMaterial(uint32_t inst_id,
                                       const std::array<uint32_t, N> &material_idxs)
 {
-    uint32_t idx = index_map_[inst_id];
-    uint32_t *mats = &instance_materials_[instances_[idx].materialOffset];
-    for (int i = 0; i < N; i++) {
-        mats[i] = material_idxs[i];
-    }
+    setInstanceMaterials(&inst_id, material_idxs.data(), N, 1);
 }
 
 void Environment::setCameraView(const glm::vec3 &eye, const glm::vec3 &target,
@@ -233,31 +423,53 @@ const Camera &Environment::getCamera() const
     return camera_;
 }
 
-const std::vector<ObjectInstance> &
+bool Environment::isValidLight(uint32_t light_id) const
+{
+    return light_id < light_ids_.size() && light_ids_[light_id] != ~0u;
+}
+
+uint32_t Environment::getNumLights() const
+{
+    return light_reverse_ids_.size();
+}
+
+const LightSampler &Environment::getLightSampler() const
+{
+    return light_sampler_;
+}
+
+const RandomKey &Environment::getRandomKey() const
+{
+    return random_key_;
+}
+
+const CowArray<ObjectInstance> &
     Environment::getInstances() const
 {
     return instances_;
 }
 
-const std::vector<uint32_t> &
+const CowArray<uint32_t> &
     Environment::getInstanceMaterials() const
 {
     return instance_materials_;
 }
 
-std::vector<uint32_t> &
+CowArray<uint32_t> &
     Environment::getInstanceMaterials()
 {
+    // Caller may write anywhere
+    updates_.materials.add(0, instance_materials_.size());
     return instance_materials_;
 }
 
-const std::vector<InstanceTransform> &
+const CowArray<InstanceTransform> &
     Environment::getTransforms() const
 {
     return transforms_;
 }
 
-const std::vector<InstanceFlags> &
+const CowArray<InstanceFlags> &
     Environment::getInstanceFlags() const
 {
     return instance_flags_;
@@ -270,17 +482,32 @@ uint32_t Environment::getNumInstances() const
 
 bool Environment::isDirty() const
 {
-    return dirty_;
+    return updates_.structural || !updates_.transforms.empty() ||
+        !updates_.flags.empty() || !updates_.materials.empty();
+}
+
+const EnvironmentUpdates &Environment::getUpdates() const
+{
+    return updates_;
+}
+
+uint64_t Environment::getUpdateEpoch() const
+{
+    return update_epoch_;
 }
 
 void Environment::setDirty() const
 {
-    dirty_ = true;
+    updates_.structural = true;
 }
 
 void Environment::clearDirty() const
 {
-    dirty_ = false;
+    updates_.transforms.clear();
+    updates_.flags.clear();
+    updates_.materials.clear();
+    updates_.structural = false;
+    update_epoch_ = nextUpdateEpoch();
 }
 
 }
@@ -3,6 +3,9 @@
 namespace RLpbr {
 
 struct Camera;
+struct RandomKey;
+struct RayQuery;
+struct RayQueryHit;
 struct SceneLoadData;
 struct Scene;
 struct EnvironmentMapGroup;
@@ -16,5 +19,6 @@ class RenderBatch;
 class Environment;
 class AssetLoader;
 class Renderer;
+class SceneUploadSink;
 
 }
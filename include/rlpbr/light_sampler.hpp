@@ -0,0 +1,111 @@
+#pragma once
+
+#include <rlpbr/cow_array.hpp>
+
+#include <cstdint>
+#include <vector>
+
+namespace RLpbr {
+
+// Slot of an alias table: the slot's own index is kept with probability
+// keep, otherwise alias is picked
+struct AliasEntry {
+    float keep;
+    uint32_t alias;
+};
+
+// Walker / Vose alias table, table[i] for weights[i]. Picking a slot
+// uniformly and then following it selects i with probability
+// weights[i] / sum. Negative and non finite weights count as 0, all zero
+// weights give a uniform table. alias_base is added to every alias, so
+// tables over a sub range can store absolute indices. Returns the sum.
+float buildAliasTable(const float *weights, uint32_t num_weights,
+                      AliasEntry *table, uint32_t alias_base = 0);
+
+// Scene defaults for LightSampler, built once per scene
+struct LightSamplerInit {
+    LightSamplerInit(std::vector<float> light_powers);
+
+    std::vector<float> powers;
+    std::vector<AliasEntry> entries;
+    std::vector<float> blockPowers;
+    std::vector<AliasEntry> blockEntries;
+    float totalPower;
+};
+
+// Power proportional light selection that updates incrementally. Lights
+// (by dense light index) are grouped into blocks of blockSize, each block
+// has an alias table over its lights and a top level table picks the
+// block. Changing a light only marks its block, update() then rebuilds
+// the marked block tables and the top level table. All arrays are copy on
+// write over the scene's LightSamplerInit.
+class LightSampler {
+public:
+    static constexpr uint32_t blockShift = CowArray<float>::chunkShift;
+    static constexpr uint32_t blockSize = 1u << blockShift;
+
+    LightSampler(const LightSamplerInit &init);
+    LightSampler(LightSampler &&) = default;
+    LightSampler & operator=(LightSampler &&) = default;
+
+    LightSampler fork() const;
+
+    // Back to the scene's lights
+    void reset();
+
+    // Same order of operations as the backend light lists: lights are
+    // appended and removed by moving the last one into their place
+    void push(float power);
+    void set(uint32_t light_idx, float power);
+    void swapRemove(uint32_t light_idx);
+
+    // Replaces every power, only blocks that differ from the scene's are
+    // rebuilt
+    void assign(CowArray<float> &&powers);
+
+    // Rebuilds the tables of changed blocks, O(blockSize) per block plus
+    // O(number of blocks) if anything changed
+    void update();
+
+    inline uint32_t size() const { return powers_.size(); }
+    inline uint32_t numBlocks() const { return block_powers_.size(); }
+    inline bool needsUpdate() const { return top_dirty_; }
+
+    // The accessors below reflect the last update()
+    inline float totalPower() const { return total_power_; }
+    inline const CowArray<float> &getPowers() const { return powers_; }
+
+    // Tables per light and per block. Light aliases are dense light
+    // indices, block aliases are block indices.
+    inline const CowArray<AliasEntry> &getEntries() const { return entries_; }
+    inline const CowArray<AliasEntry> &getBlockEntries() const
+    {
+        return block_entries_;
+    }
+
+    // Probability of sample() returning light_idx
+    float pdf(uint32_t light_idx) const;
+
+    // u_block picks the block and u_light the light inside it, both in
+    // [0, 1). Same steps as the shaders' sampleLightIndex.
+    uint32_t sample(float u_block, float u_light) const;
+
+    size_t numOwnedBytes() const;
+
+private:
+    void markBlock(uint32_t block_idx);
+    void resizeBlocks();
+
+    const LightSamplerInit *init_;
+    CowArray<float> powers_;
+    CowArray<AliasEntry> entries_;
+    CowArray<float> block_powers_;
+    CowArray<AliasEntry> block_entries_;
+    std::vector<uint32_t> dirty_blocks_;
+    std::vector<float> block_scratch_;
+    std::vector<AliasEntry> table_scratch_;
+    float total_power_;
+    bool top_dirty_;
+};
+
+}
@@ -16,7 +16,8 @@ public:
                       const glm::mat4 &base_txfm,
                       std::optional<std::string_view> data_dir,
                       bool process_textures,
-                      bool build_sdfs);
+                      bool build_sdfs,
+                      bool keep_hierarchy = false);
 
     void dump(std::string_view out_path);
 
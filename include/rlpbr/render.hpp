@@ -1,9 +1,11 @@
 #pragma once
 
 #include <rlpbr/fwd.hpp>
+#include <rlpbr/config.hpp>
 #include <rlpbr/environment.hpp>
 #include <rlpbr/utils.hpp>
 #include <memory>
+#include <vector>
 
 namespace RLpbr {
 
@@ -29,9 +31,53 @@ public:
 
     inline BatchBackend *getBackend() { return backend_.get(); }
 
+    // Camera poses of environments [0, num_envs) in one call, camera to
+    // world as a position and rotation (glm::quat, x y z w) or a matrix,
+    // same convention as Environment::setCameraView(camera_to_world).
+    // Rotations need not be normalized. Poses with non finite components
+    // or a degenerate rotation leave their camera unchanged, returns the
+    // number of such poses.
+    uint32_t setCameraViews(const glm::vec3 *positions,
+                            const glm::quat *rotations,
+                            uint32_t num_envs);
+
+    uint32_t setCameraViews(const glm::mat4 *camera_to_worlds,
+                            uint32_t num_envs);
+
+    // Restricts Renderer::render to the environments in env_idxs, given
+    // in any order. The other environments keep their previous outputs,
+    // their pending changes are uploaded by the next render that includes
+    // them. A new batch has every environment active. The OptiX backend
+    // only renders whole batches and aborts if any environment is
+    // inactive.
+    void setActiveEnvironments(const uint32_t *env_idxs,
+                               uint32_t num_active);
+
+    // Same, from one flag per environment
+    void setActiveMask(const bool *mask);
+
+    void activateAllEnvironments();
+
+    // Active environment indices, in ascending order
+    inline const uint32_t *getActiveEnvironments() const
+    {
+        return active_.data();
+    }
+    inline uint32_t getNumActive() const { return active_.size(); }
+    inline bool allActive() const { return active_.size() == envs_.size(); }
+
+    // Timing of the last Renderer::render call, set by the backend
+    inline const BatchPrepStats &getPrepStats() const { return prep_stats_; }
+    inline void setPrepStats(const BatchPrepStats &stats)
+    {
+        prep_stats_ = stats;
+    }
+
 private:
     Handle backend_;
     DynArray<Environment> envs_;
+    std::vector<uint32_t> active_;
+    BatchPrepStats prep_stats_;
 };
 
 }
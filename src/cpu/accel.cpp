@@ -0,0 +1,581 @@
+#include "accel.hpp"
+#include "config.hpp"
+
+#include <algorithm>
+#include <limits>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define RLPBR_ACCEL_SSE
+#endif
+
+using namespace std;
+
+namespace RLpbr {
+namespace cpu {
+
+// Transformed center, extents projected onto the world axes
+static AABB transformBounds(const AABB &bounds, const glm::mat4x3 &txfm)
+{
+    glm::vec3 center = 0.5f * (bounds.pMin + bounds.pMax);
+    glm::vec3 extent = 0.5f * (bounds.pMax - bounds.pMin);
+
+    glm::vec3 world_center = txfm * glm::vec4(center, 1.f);
+    glm::vec3 world_extent =
+        glm::abs(txfm[0]) * extent.x +
+        glm::abs(txfm[1]) * extent.y +
+        glm::abs(txfm[2]) * extent.z;
+
+    return AABB {
+        world_center - world_extent,
+        world_center + world_extent,
+    };
+}
+
+TLAS::TLAS()
+    : bvh(),
+      instanceBounds(),
+      instanceMasks(),
+      buildCost(0.f),
+      numRefits(0)
+{}
+
+static void writeInstances(const ObjectAccel *objects,
+                           const CowArray<ObjectInstance> &instances,
+                           const CowArray<InstanceTransform> &transforms,
+                           const CowArray<InstanceFlags> &flags,
+                           uint32_t begin, uint32_t end,
+                           AABB *inst_bounds, uint32_t *inst_masks)
+{
+    for (uint32_t inst_idx = begin; inst_idx < end; inst_idx++) {
+        const ObjectAccel &obj = objects[instances[inst_idx].objectIndex];
+
+        inst_bounds[inst_idx] = transformBounds(obj.bvh.getBounds(),
+                                                transforms[inst_idx].mat);
+        inst_masks[inst_idx] = instanceMask(flags[inst_idx]);
+    }
+}
+
+void TLAS::build(const ObjectAccel *objects,
+                 const CowArray<ObjectInstance> &instances,
+                 const CowArray<InstanceTransform> &transforms,
+                 const CowArray<InstanceFlags> &flags,
+                 uint32_t num_instances)
+{
+    instanceBounds.resize(num_instances);
+    instanceMasks.resize(num_instances);
+
+    writeInstances(objects, instances, transforms, flags, 0, num_instances,
+                   instanceBounds.data(), instanceMasks.data());
+
+    bvh = BVH::build(instanceBounds.data(), num_instances);
+    buildCost = bvh.sahCost();
+    numRefits = 0;
+}
+
+bool TLAS::refit(const ObjectAccel *objects,
+                 const CowArray<ObjectInstance> &instances,
+                 const CowArray<InstanceTransform> &transforms,
+                 const CowArray<InstanceFlags> &flags,
+                 uint32_t begin, uint32_t end)
+{
+    writeInstances(objects, instances, transforms, flags, begin, end,
+                   instanceBounds.data(), instanceMasks.data());
+
+    bvh.refit(instanceBounds.data());
+    numRefits++;
+
+    return bvh.sahCost() <= buildCost * CPUConfig::tlas_rebuild_cost_ratio;
+}
+
+bool TLAS::canRefit(uint32_t num_instances) const
+{
+    return num_instances == instanceBounds.size();
+}
+
+namespace {
+
+// One float per packet ray. Comparisons return a bit per ray. Operations
+// are the same as in the single ray code, including the NaN handling of
+// std::min / std::max, so both find the same hits.
+#ifdef RLPBR_ACCEL_SSE
+static_assert(rayPacketSize == 4);
+
+struct Lanes {
+    __m128 v;
+};
+
+inline Lanes splat(float x) { return { _mm_set1_ps(x) }; }
+inline Lanes operator+(Lanes a, Lanes b) { return { _mm_add_ps(a.v, b.v) }; }
+inline Lanes operator-(Lanes a, Lanes b) { return { _mm_sub_ps(a.v, b.v) }; }
+inline Lanes operator*(Lanes a, Lanes b) { return { _mm_mul_ps(a.v, b.v) }; }
+inline Lanes operator/(Lanes a, Lanes b) { return { _mm_div_ps(a.v, b.v) }; }
+
+// std::min(a, b) = b < a ? b : a
+inline Lanes minLanes(Lanes a, Lanes b) { return { _mm_min_ps(b.v, a.v) }; }
+// std::max(a, b) = a < b ? b : a
+inline Lanes maxLanes(Lanes a, Lanes b) { return { _mm_max_ps(b.v, a.v) }; }
+
+inline uint32_t lessLanes(Lanes a, Lanes b)
+{
+    return _mm_movemask_ps(_mm_cmplt_ps(a.v, b.v));
+}
+
+inline uint32_t lessEqualLanes(Lanes a, Lanes b)
+{
+    return _mm_movemask_ps(_mm_cmple_ps(a.v, b.v));
+}
+
+inline uint32_t equalLanes(Lanes a, Lanes b)
+{
+    return _mm_movemask_ps(_mm_cmpeq_ps(a.v, b.v));
+}
+
+// a where bit i of ray_bits is set, b elsewhere
+inline Lanes selectLanes(uint32_t ray_bits, Lanes a, Lanes b)
+{
+    const __m128i lane_bits = _mm_setr_epi32(1, 2, 4, 8);
+    __m128 mask = _mm_castsi128_ps(_mm_cmpeq_epi32(
+        _mm_and_si128(_mm_set1_epi32(ray_bits), lane_bits), lane_bits));
+
+    return { _mm_or_ps(_mm_and_ps(mask, a.v), _mm_andnot_ps(mask, b.v)) };
+}
+
+inline void storeLanes(float *dst, Lanes a) { _mm_storeu_ps(dst, a.v); }
+#else
+struct Lanes {
+    float v[rayPacketSize];
+};
+
+template <typename Fn>
+inline Lanes mapLanes(Fn &&fn)
+{
+    Lanes r;
+    for (uint32_t i = 0; i < rayPacketSize; i++) {
+        r.v[i] = fn(i);
+    }
+
+    return r;
+}
+
+template <typename Fn>
+inline uint32_t testLanes(Fn &&fn)
+{
+    uint32_t bits = 0;
+    for (uint32_t i = 0; i < rayPacketSize; i++) {
+        bits |= uint32_t(fn(i)) << i;
+    }
+
+    return bits;
+}
+
+inline Lanes splat(float x)
+{
+    return mapLanes([&](uint32_t) { return x; });
+}
+
+inline Lanes operator+(Lanes a, Lanes b)
+{
+    return mapLanes([&](uint32_t i) { return a.v[i] + b.v[i]; });
+}
+
+inline Lanes operator-(Lanes a, Lanes b)
+{
+    return mapLanes([&](uint32_t i) { return a.v[i] - b.v[i]; });
+}
+
+inline Lanes operator*(Lanes a, Lanes b)
+{
+    return mapLanes([&](uint32_t i) { return a.v[i] * b.v[i]; });
+}
+
+inline Lanes operator/(Lanes a, Lanes b)
+{
+    return mapLanes([&](uint32_t i) { return a.v[i] / b.v[i]; });
+}
+
+inline Lanes minLanes(Lanes a, Lanes b)
+{
+    return mapLanes([&](uint32_t i) { return std::min(a.v[i], b.v[i]); });
+}
+
+inline Lanes maxLanes(Lanes a, Lanes b)
+{
+    return mapLanes([&](uint32_t i) { return std::max(a.v[i], b.v[i]); });
+}
+
+inline uint32_t lessLanes(Lanes a, Lanes b)
+{
+    return testLanes([&](uint32_t i) { return a.v[i] < b.v[i]; });
+}
+
+inline uint32_t lessEqualLanes(Lanes a, Lanes b)
+{
+    return testLanes([&](uint32_t i) { return a.v[i] <= b.v[i]; });
+}
+
+inline uint32_t equalLanes(Lanes a, Lanes b)
+{
+    return testLanes([&](uint32_t i) { return a.v[i] == b.v[i]; });
+}
+
+inline Lanes selectLanes(uint32_t ray_bits, Lanes a, Lanes b)
+{
+    return mapLanes([&](uint32_t i) {
+        return ((ray_bits >> i) & 1) ? a.v[i] : b.v[i];
+    });
+}
+
+inline void storeLanes(float *dst, Lanes a)
+{
+    for (uint32_t i = 0; i < rayPacketSize; i++) {
+        dst[i] = a.v[i];
+    }
+}
+#endif
+
+constexpr uint32_t all_rays = (1u << rayPacketSize) - 1;
+
+// Structure of arrays version of rayPacketSize rays
+struct PacketRays {
+    Lanes origin[3];
+    Lanes dir[3];
+    Lanes invDir[3];
+};
+
+struct PacketStackEntry {
+    uint32_t slot;
+    uint32_t rays;
+    // Nearest entry distance of the rays, orders the children
+    float t;
+    Lanes tNear;
+};
+
+}
+
+static inline float minLane(Lanes a, uint32_t ray_bits)
+{
+    float vals[rayPacketSize];
+    storeLanes(vals, a);
+
+    float min_val = numeric_limits<float>::infinity();
+    for (uint32_t i = 0; i < rayPacketSize; i++) {
+        if ((ray_bits >> i) & 1) {
+            min_val = std::min(min_val, vals[i]);
+        }
+    }
+
+    return min_val;
+}
+
+// AABBTree::intersectRay on every ray
+static inline uint32_t intersectBoxPacket(const BVHChild &child,
+                                          const PacketRays &rays,
+                                          Lanes max_t, Lanes &t_near)
+{
+    t_near = splat(0.f);
+    Lanes t_far = max_t;
+    for (int axis = 0; axis < 3; axis++) {
+        Lanes t1 = (splat(child.min[axis]) - rays.origin[axis]) *
+            rays.invDir[axis];
+        Lanes t2 = (splat(child.max[axis]) - rays.origin[axis]) *
+            rays.invDir[axis];
+
+        t_near = maxLanes(t_near, minLanes(t1, t2));
+        t_far = minLanes(t_far, maxLanes(t1, t2));
+    }
+
+    return lessEqualLanes(t_near, t_far);
+}
+
+// intersectTriangle on every ray, without the early outs
+static inline uint32_t intersectTrianglePacket(const ObjectTriangle &tri,
+                                               const PacketRays &rays,
+                                               Lanes max_t, Lanes &t,
+                                               Lanes &u, Lanes &v)
+{
+    const Lanes *d = rays.dir;
+    Lanes e1[3] { splat(tri.e1.x), splat(tri.e1.y), splat(tri.e1.z) };
+    Lanes e2[3] { splat(tri.e2.x), splat(tri.e2.y), splat(tri.e2.z) };
+
+    auto cross = [](const Lanes *a, const Lanes *b, Lanes *out) {
+        out[0] = a[1] * b[2] - a[2] * b[1];
+        out[1] = a[2] * b[0] - a[0] * b[2];
+        out[2] = a[0] * b[1] - a[1] * b[0];
+    };
+
+    auto dot = [](const Lanes *a, const Lanes *b) {
+        return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+    };
+
+    Lanes pvec[3];
+    cross(d, e2, pvec);
+    Lanes det = dot(e1, pvec);
+    uint32_t valid = ~equalLanes(det, splat(0.f));
+    Lanes inv_det = splat(1.f) / det;
+
+    Lanes tvec[3] {
+        rays.origin[0] - splat(tri.a.x),
+        rays.origin[1] - splat(tri.a.y),
+        rays.origin[2] - splat(tri.a.z),
+    };
+    u = dot(tvec, pvec) * inv_det;
+    valid &= ~(lessLanes(u, splat(0.f)) | lessLanes(splat(1.f), u));
+
+    Lanes qvec[3];
+    cross(tvec, e1, qvec);
+    v = dot(d, qvec) * inv_det;
+    valid &= ~(lessLanes(v, splat(0.f)) | lessLanes(splat(1.f), u + v));
+
+    t = dot(e2, qvec) * inv_det;
+    valid &= lessLanes(splat(0.f), t) & lessLanes(t, max_t);
+
+    return valid & all_rays;
+}
+
+// BVH::traverse for a packet. Children are entered with the rays that hit
+// them and popped near to far by their nearest entry distance.
+// leaf_fn(prim_idx, ray_bits) tests the primitive against those rays,
+// updates max_t and returns the rays that are done (any hit queries).
+template <typename LeafFn>
+static void traversePacket(const BVH &bvh, const PacketRays &rays,
+                           const Lanes &max_t, uint32_t active,
+                           LeafFn &&leaf_fn)
+{
+    if (bvh.children.empty()) {
+        return;
+    }
+
+    PacketStackEntry stack[BVH::maxDepth * (BVH::maxWidth - 1) + 1];
+    uint32_t stack_size = 0;
+
+    uint32_t node_idx = 0;
+    uint32_t node_rays = active;
+    while (true) {
+        const uint32_t base = node_idx * bvh.width;
+
+        PacketStackEntry hits[BVH::maxWidth];
+        uint32_t num_hits = 0;
+        for (uint32_t i = 0; i < bvh.width; i++) {
+            const BVHChild &child = bvh.children[base + i];
+            if (child.isEmpty()) {
+                break;
+            }
+
+            Lanes t_near;
+            uint32_t hit_rays =
+                intersectBoxPacket(child, rays, max_t, t_near) & node_rays;
+            if (hit_rays == 0) {
+                continue;
+            }
+
+            float t = minLane(t_near, hit_rays);
+
+            uint32_t insert_idx = num_hits++;
+            while (insert_idx > 0 && hits[insert_idx - 1].t < t) {
+                hits[insert_idx] = hits[insert_idx - 1];
+                insert_idx--;
+            }
+            hits[insert_idx] = { base + i, hit_rays, t, t_near };
+        }
+
+        for (uint32_t i = 0; i < num_hits; i++) {
+            stack[stack_size++] = hits[i];
+        }
+
+        while (true) {
+            if (stack_size == 0) {
+                return;
+            }
+
+            PacketStackEntry entry = stack[--stack_size];
+            // Rays finished or with max_t shrunk below the entry since
+            // the push
+            uint32_t entry_rays = entry.rays & active &
+                lessEqualLanes(entry.tNear, max_t);
+            if (entry_rays == 0) {
+                continue;
+            }
+
+            const BVHChild &child = bvh.children[entry.slot];
+            if (!child.isLeaf()) {
+                node_idx = child.offset;
+                node_rays = entry_rays;
+                break;
+            }
+
+            for (uint32_t i = 0; i < child.numPrims; i++) {
+                active &= ~leaf_fn(bvh.primIndices[child.offset + i],
+                                   entry_rays);
+                if (active == 0) {
+                    return;
+                }
+
+                entry_rays &= active;
+                if (entry_rays == 0) {
+                    break;
+                }
+            }
+        }
+    }
+}
+
+template <bool any_hit>
+static uint32_t tracePacketImpl(const TLAS &tlas,
+                                const ObjectAccel *objects,
+                                const CowArray<ObjectInstance> &instances,
+                                const CowArray<InstanceTransform> &transforms,
+                                const RayQuery *queries, uint32_t num_rays,
+                                RayHit *hits)
+{
+    // Unused rays repeat the first one and are never active
+    float vals[9][rayPacketSize];
+    float max_t_vals[rayPacketSize];
+    uint32_t ray_masks[rayPacketSize];
+    for (uint32_t i = 0; i < rayPacketSize; i++) {
+        const RayQuery &query = queries[i < num_rays ? i : 0];
+        glm::vec3 inv_dir = 1.f / query.direction;
+
+        for (int axis = 0; axis < 3; axis++) {
+            vals[axis][i] = query.origin[axis];
+            vals[3 + axis][i] = query.direction[axis];
+            vals[6 + axis][i] = inv_dir[axis];
+        }
+
+        max_t_vals[i] = query.maxT;
+        ray_masks[i] = query.visibilityMask;
+    }
+
+    auto loadLanes = [](const float *src) {
+        Lanes r;
+#ifdef RLPBR_ACCEL_SSE
+        r.v = _mm_loadu_ps(src);
+#else
+        for (uint32_t i = 0; i < rayPacketSize; i++) {
+            r.v[i] = src[i];
+        }
+#endif
+        return r;
+    };
+
+    PacketRays rays;
+    for (int axis = 0; axis < 3; axis++) {
+        rays.origin[axis] = loadLanes(vals[axis]);
+        rays.dir[axis] = loadLanes(vals[3 + axis]);
+        rays.invDir[axis] = loadLanes(vals[6 + axis]);
+    }
+
+    Lanes max_t = loadLanes(max_t_vals);
+    uint32_t found = 0;
+
+    traversePacket(tlas.bvh, rays, max_t, (1u << num_rays) - 1,
+            [&](uint32_t inst_idx, uint32_t inst_rays) {
+        for (uint32_t i = 0; i < rayPacketSize; i++) {
+            if ((ray_masks[i] & tlas.instanceMasks[inst_idx]) == 0) {
+                inst_rays &= ~(1u << i);
+            }
+        }
+
+        const ObjectAccel &obj = objects[instances[inst_idx].objectIndex];
+        if (inst_rays == 0 || obj.bvh.empty()) {
+            return 0u;
+        }
+
+        // Same as w2o * glm::vec4(v, 1 or 0) in traceRay
+        const glm::mat4x3 &w2o = transforms[inst_idx].inv;
+        PacketRays obj_rays;
+        for (int row = 0; row < 3; row++) {
+            Lanes c0 = splat(w2o[0][row]);
+            Lanes c1 = splat(w2o[1][row]);
+            Lanes c2 = splat(w2o[2][row]);
+
+            obj_rays.origin[row] = c0 * rays.origin[0] +
+                c1 * rays.origin[1] + c2 * rays.origin[2] +
+                splat(w2o[3][row]);
+            obj_rays.dir[row] = c0 * rays.dir[0] + c1 * rays.dir[1] +
+                c2 * rays.dir[2] + splat(w2o[3][row]) * splat(0.f);
+            obj_rays.invDir[row] = splat(1.f) / obj_rays.dir[row];
+        }
+
+        uint32_t inst_found = 0;
+        traversePacket(obj.bvh, obj_rays, max_t, inst_rays,
+                [&](uint32_t tri_prim, uint32_t tri_rays) {
+            const ObjectTriangle &tri = obj.triangles[tri_prim];
+
+            Lanes t, u, v;
+            uint32_t hit_rays = tri_rays &
+                intersectTrianglePacket(tri, obj_rays, max_t, t, u, v);
+            if (hit_rays == 0) {
+                return 0u;
+            }
+
+            inst_found |= hit_rays;
+            if constexpr (any_hit) {
+                return hit_rays;
+            } else {
+                max_t = selectLanes(hit_rays, t, max_t);
+
+                float t_vals[rayPacketSize];
+                float u_vals[rayPacketSize];
+                float v_vals[rayPacketSize];
+                storeLanes(t_vals, t);
+                storeLanes(u_vals, u);
+                storeLanes(v_vals, v);
+
+                for (uint32_t i = 0; i < rayPacketSize; i++) {
+                    if ((hit_rays >> i) & 1) {
+                        hits[i] = RayHit {
+                            t_vals[i],
+                            inst_idx,
+                            tri.geoIdx,
+                            tri.triIdx,
+                            glm::vec2(u_vals[i], v_vals[i]),
+                        };
+                    }
+                }
+
+                return 0u;
+            }
+        });
+
+        found |= inst_found;
+        if constexpr (any_hit) {
+            return inst_found;
+        } else {
+            return 0u;
+        }
+    });
+
+    return found;
+}
+
+void TLAS::tracePacket(const ObjectAccel *objects,
+                       const CowArray<ObjectInstance> &instances,
+                       const CowArray<InstanceTransform> &transforms,
+                       const RayQuery *rays, uint32_t num_rays,
+                       RayHit *hits, bool *found) const
+{
+    uint32_t found_rays = tracePacketImpl<false>(*this, objects, instances,
+        transforms, rays, num_rays, hits);
+
+    for (uint32_t i = 0; i < num_rays; i++) {
+        found[i] = (found_rays >> i) & 1;
+    }
+}
+
+void TLAS::tracePacketOcclusion(const ObjectAccel *objects,
+                                const CowArray<ObjectInstance> &instances,
+                                const CowArray<InstanceTransform> &transforms,
+                                const RayQuery *rays, uint32_t num_rays,
+                                bool *occluded) const
+{
+    uint32_t found_rays = tracePacketImpl<true>(*this, objects, instances,
+        transforms, rays, num_rays, nullptr);
+
+    for (uint32_t i = 0; i < num_rays; i++) {
+        occluded[i] = (found_rays >> i) & 1;
+    }
+}
+
+}
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <rlpbr/environment.hpp>
+#include <rlpbr_core/bvh.hpp>
+
+#include <glm/glm.hpp>
+
+#include <vector>
+
+namespace RLpbr {
+namespace cpu {
+
+// Object space triangle, geoIdx / triIdx match the geometry and primitive
+// indices a BLAS would report
+struct ObjectTriangle {
+    glm::vec3 a;
+    glm::vec3 e1;
+    glm::vec3 e2;
+    uint32_t geoIdx;
+    uint32_t triIdx;
+};
+
+// Equivalent of a BLAS, one per object over all of its meshes. Shared by
+// every environment of the scene.
+struct ObjectAccel {
+    BVH bvh;
+    std::vector<ObjectTriangle> triangles;
+};
+
+// VisibilityMask of an instance, same as the vulkan backend's TLAS
+// instance masks
+inline uint32_t instanceMask(InstanceFlags flags);
+
+struct RayHit {
+    float t;
+    uint32_t instIdx;
+    uint32_t geoIdx;
+    uint32_t triIdx;
+    glm::vec2 barys;
+};
+
+// Moller-Trumbore, two sided like the GPU BLASes
+inline bool intersectTriangle(const ObjectTriangle &tri,
+                              const glm::vec3 &o, const glm::vec3 &d,
+                              float max_t, float &t, glm::vec2 &barys);
+
+// Rays TLAS::tracePacket traces together, the SIMD width of its box and
+// triangle tests
+constexpr uint32_t rayPacketSize = 4;
+
+// Host equivalent of the vulkan backend's TLAS: a BVH over the world
+// bounds of all instances, primitive i being instance i so the dirty
+// ranges of EnvironmentUpdates apply directly. Like on the GPU,
+// transparent instances stay in the tree and are skipped by mask, so
+// flag changes only need a refit.
+struct TLAS {
+    BVH bvh;
+    std::vector<AABB> instanceBounds;
+    std::vector<uint32_t> instanceMasks;
+    // bvh.sahCost() after the last build
+    float buildCost;
+    uint32_t numRefits;
+
+    TLAS();
+
+    void build(const ObjectAccel *objects,
+               const CowArray<ObjectInstance> &instances,
+               const CowArray<InstanceTransform> &transforms,
+               const CowArray<InstanceFlags> &flags,
+               uint32_t num_instances);
+
+    // Instances [begin, end) moved or changed flags since the last build
+    // or refit. Returns false once the refit tree is enough worse than a
+    // fresh build that it should be rebuilt.
+    bool refit(const ObjectAccel *objects,
+               const CowArray<ObjectInstance> &instances,
+               const CowArray<InstanceTransform> &transforms,
+               const CowArray<InstanceFlags> &flags,
+               uint32_t begin, uint32_t end);
+
+    bool canRefit(uint32_t num_instances) const;
+
+    // Closest hit (or any hit) before max_t among instances matching
+    // mask. Instances are traced in object space with an unnormalized
+    // direction, so hit distances are in units of dir. hit is only
+    // written for closest hit queries.
+    template <bool any_hit>
+    inline bool traceRay(const ObjectAccel *objects,
+                         const CowArray<ObjectInstance> &instances,
+                         const CowArray<InstanceTransform> &transforms,
+                         const glm::vec3 &origin, const glm::vec3 &dir,
+                         float max_t, uint32_t mask, RayHit *hit) const;
+
+    // Up to rayPacketSize rays traced together: nodes are entered if any
+    // of the rays hits them, box and triangle tests run on all rays at
+    // once. Same results as traceRay for each ray. found[i] tells whether
+    // hits[i] was written.
+    void tracePacket(const ObjectAccel *objects,
+                     const CowArray<ObjectInstance> &instances,
+                     const CowArray<InstanceTransform> &transforms,
+                     const RayQuery *rays, uint32_t num_rays,
+                     RayHit *hits, bool *found) const;
+
+    // Any hit version, rays stop at their first hit
+    void tracePacketOcclusion(const ObjectAccel *objects,
+                              const CowArray<ObjectInstance> &instances,
+                              const CowArray<InstanceTransform> &transforms,
+                              const RayQuery *rays, uint32_t num_rays,
+                              bool *occluded) const;
+};
+
+}
+}
+
+#include "accel.inl"
@@ -0,0 +1,111 @@
+#pragma once
+
+namespace RLpbr {
+namespace cpu {
+
+uint32_t instanceMask(InstanceFlags flags)
+{
+    return (flags & InstanceFlags::Transparent) ?
+        VisibilityMask::transparent : VisibilityMask::opaque;
+}
+
+bool intersectTriangle(const ObjectTriangle &tri,
+                       const glm::vec3 &o, const glm::vec3 &d,
+                       float max_t, float &t, glm::vec2 &barys)
+{
+    glm::vec3 pvec = cross(d, tri.e2);
+    float det = dot(tri.e1, pvec);
+    if (det == 0.f) {
+        return false;
+    }
+    float inv_det = 1.f / det;
+
+    glm::vec3 tvec = o - tri.a;
+    float u = dot(tvec, pvec) * inv_det;
+    if (u < 0.f || u > 1.f) {
+        return false;
+    }
+
+    glm::vec3 qvec = cross(tvec, tri.e1);
+    float v = dot(d, qvec) * inv_det;
+    if (v < 0.f || u + v > 1.f) {
+        return false;
+    }
+
+    float hit_t = dot(tri.e2, qvec) * inv_det;
+    if (!(hit_t > 0.f && hit_t < max_t)) {
+        return false;
+    }
+
+    t = hit_t;
+    barys = glm::vec2(u, v);
+
+    return true;
+}
+
+template <bool any_hit>
+bool TLAS::traceRay(const ObjectAccel *objects,
+                    const CowArray<ObjectInstance> &instances,
+                    const CowArray<InstanceTransform> &transforms,
+                    const glm::vec3 &origin, const glm::vec3 &dir,
+                    float max_t, uint32_t mask, RayHit *hit) const
+{
+    bool found = false;
+
+    bvh.traverse(origin, 1.f / dir, max_t,
+            [&](uint32_t inst_idx, float inst_max_t) {
+        if ((instanceMasks[inst_idx] & mask) == 0) {
+            return inst_max_t;
+        }
+
+        const ObjectAccel &obj = objects[instances[inst_idx].objectIndex];
+        const glm::mat4x3 &w2o = transforms[inst_idx].inv;
+
+        glm::vec3 obj_origin = w2o * glm::vec4(origin, 1.f);
+        glm::vec3 obj_dir = w2o * glm::vec4(dir, 0.f);
+
+        bool inst_found = false;
+        obj.bvh.traverse(obj_origin, 1.f / obj_dir, inst_max_t,
+                [&](uint32_t tri_prim, float tri_max_t) {
+            const ObjectTriangle &tri = obj.triangles[tri_prim];
+
+            float t;
+            glm::vec2 barys;
+            if (!intersectTriangle(tri, obj_origin, obj_dir, tri_max_t,
+                                   t, barys)) {
+                return tri_max_t;
+            }
+
+            inst_found = true;
+            if constexpr (any_hit) {
+                return -1.f;
+            } else {
+                *hit = RayHit {
+                    t,
+                    inst_idx,
+                    tri.geoIdx,
+                    tri.triIdx,
+                    barys,
+                };
+
+                return t;
+            }
+        });
+
+        if (!inst_found) {
+            return inst_max_t;
+        }
+
+        found = true;
+        if constexpr (any_hit) {
+            return -1.f;
+        } else {
+            return hit->t;
+        }
+    });
+
+    return found;
+}
+
+}
+}
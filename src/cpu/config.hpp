@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+
+namespace RLpbr {
+namespace cpu {
+
+namespace CPUConfig {
+
+// Pixels are handed out to threads in square tiles of this size
+constexpr uint32_t tile_size = 16;
+
+// Shadow rays stop this fraction short of the light, so they don't hit
+// the emitter itself
+constexpr float shadow_ray_shorten = 1e-4f;
+
+// TLAS refits are kept until their SAH cost exceeds the last build's by
+// this factor, then the TLAS is rebuilt
+constexpr float tlas_rebuild_cost_ratio = 1.5f;
+
+// RenderMode::Rasterize clips triangles this close to the camera, in
+// units of the camera's view vector
+constexpr float raster_near_depth = 1e-3f;
+
+// Triangles are also clipped this far outside the screen (1 being the
+// screen's edge), keeping fixed point vertex coordinates in range
+constexpr float raster_guard_band = 16.f;
+
+// Fractional bits of fixed point vertex coordinates
+constexpr int32_t raster_subpixel_bits = 8;
+
+// RenderMode::Rasterize writes object, material and instance indices as
+// 16 bit integers with 0xFFFF marking misses, so scenes and environments
+// may have at most this many of each
+constexpr uint32_t raster_max_ids = 0xFFFE;
+
+}
+
+}
+}
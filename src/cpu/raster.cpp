@@ -0,0 +1,476 @@
+#include "raster.hpp"
+#include "config.hpp"
+#include "scene.hpp"
+
+#include <rlpbr_core/utils.hpp>
+
+#include <glm/gtc/packing.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <iostream>
+
+using namespace std;
+
+namespace RLpbr {
+namespace cpu {
+
+// Camera space: p - camera position = x * right + y * up + z * view, with
+// right and up scaled like the path tracer's camera rays so the screen
+// spans [-z, z] in x and y. Clipping keeps z >= raster_near_depth and x, y
+// within the guard band.
+static constexpr uint32_t num_clip_planes = 5;
+
+static constexpr int64_t subpixel_scale =
+    int64_t(1) << CPUConfig::raster_subpixel_bits;
+
+static inline float clipDistance(const glm::vec3 &v, uint32_t plane)
+{
+    constexpr float guard = CPUConfig::raster_guard_band;
+
+    switch (plane) {
+        case 0: return v.z - CPUConfig::raster_near_depth;
+        case 1: return guard * v.z - v.x;
+        case 2: return guard * v.z + v.x;
+        case 3: return guard * v.z - v.y;
+        default: return guard * v.z + v.y;
+    }
+}
+
+// NaNs count as outside, so degenerate cameras produce nothing
+static inline bool needsClipping(const glm::vec3 &v)
+{
+    for (uint32_t plane = 0; plane < num_clip_planes; plane++) {
+        if (!(clipDistance(v, plane) >= 0.f)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// A bit per screen edge and the near plane that v is outside of
+static inline uint32_t outcode(const glm::vec3 &v)
+{
+    return uint32_t(v.z < CPUConfig::raster_near_depth) |
+        (uint32_t(v.x > v.z) << 1) |
+        (uint32_t(v.x < -v.z) << 2) |
+        (uint32_t(v.y > v.z) << 3) |
+        (uint32_t(v.y < -v.z) << 4);
+}
+
+// Sutherland-Hodgman. Each plane adds at most one vertex to the convex
+// polygon, verts needs room for 3 + num_clip_planes.
+static uint32_t clipPolygon(glm::vec3 *verts, uint32_t num_verts)
+{
+    glm::vec3 clipped[3 + num_clip_planes];
+
+    for (uint32_t plane = 0; plane < num_clip_planes; plane++) {
+        uint32_t num_clipped = 0;
+        for (uint32_t i = 0; i < num_verts; i++) {
+            const glm::vec3 &cur = verts[i];
+            const glm::vec3 &next = verts[(i + 1) % num_verts];
+
+            float cur_dist = clipDistance(cur, plane);
+            float next_dist = clipDistance(next, plane);
+
+            bool cur_inside = cur_dist >= 0.f;
+            if (cur_inside) {
+                clipped[num_clipped++] = cur;
+            }
+
+            if (cur_inside != (next_dist >= 0.f)) {
+                float t = cur_dist / (cur_dist - next_dist);
+                clipped[num_clipped++] = cur + t * (next - cur);
+            }
+        }
+
+        if (num_clipped < 3) {
+            return 0;
+        }
+
+        copy_n(clipped, num_clipped, verts);
+        num_verts = num_clipped;
+    }
+
+    return num_verts;
+}
+
+static inline int64_t floorDiv(int64_t a, int64_t b)
+{
+    int64_t q = a / b;
+    return (a % b != 0 && a < 0) ? q - 1 : q;
+}
+
+// Twice the signed area of (from, to, p), positive if p is left of the
+// edge. Exact, and exactly negated for the reversed edge.
+static inline int64_t edgeFunction(const glm::ivec2 &from,
+                                   const glm::ivec2 &to,
+                                   const glm::ivec2 &p)
+{
+    return int64_t(to.x - from.x) * int64_t(p.y - from.y) -
+        int64_t(to.y - from.y) * int64_t(p.x - from.x);
+}
+
+Rasterizer::Rasterizer(uint32_t width, uint32_t height,
+                       uint32_t batch_size)
+    : width_(width),
+      height_(height),
+      tiles_wide_((width + CPUConfig::tile_size - 1) / CPUConfig::tile_size),
+      tiles_tall_((height + CPUConfig::tile_size - 1) / CPUConfig::tile_size),
+      bins_(batch_size)
+{}
+
+namespace {
+
+// Builds RasterTriangles of one environment from camera space vertices
+struct TriangleSetup {
+    uint32_t width;
+    uint32_t height;
+    uint32_t tilesWide;
+    RasterBins &bins;
+
+    glm::ivec2 toFixed(const glm::vec3 &v) const
+    {
+        float inv_z = 1.f / v.z;
+        float x = (v.x * inv_z + 1.f) * 0.5f * float(width);
+        float y = (v.y * inv_z + 1.f) * 0.5f * float(height);
+
+        return glm::ivec2(lroundf(x * float(subpixel_scale)),
+                          lroundf(y * float(subpixel_scale)));
+    }
+
+    void emit(const glm::vec3 &a, const glm::vec3 &b, const glm::vec3 &c,
+              uint32_t inst_idx, uint32_t material_idx)
+    {
+        glm::ivec2 verts[3] { toFixed(a), toFixed(b), toFixed(c) };
+        float inv_depths[3] { 1.f / a.z, 1.f / b.z, 1.f / c.z };
+
+        int64_t area = edgeFunction(verts[0], verts[1], verts[2]);
+
+        if (area == 0) {
+            return;
+        }
+
+        // Two sided, flip back facing triangles
+        if (area < 0) {
+            swap(verts[1], verts[2]);
+            swap(inv_depths[1], inv_depths[2]);
+            area = -area;
+        }
+
+        glm::ivec2 fixed_min = glm::min(verts[0], glm::min(verts[1], verts[2]));
+        glm::ivec2 fixed_max = glm::max(verts[0], glm::max(verts[1], verts[2]));
+
+        // Pixel x is sampled at x * scale + scale / 2
+        auto firstPixel = [](int32_t fixed_coord) {
+            return floorDiv(fixed_coord - subpixel_scale / 2 +
+                            subpixel_scale - 1, subpixel_scale);
+        };
+        auto lastPixel = [](int32_t fixed_coord) {
+            return floorDiv(fixed_coord - subpixel_scale / 2, subpixel_scale);
+        };
+
+        glm::ivec2 pixel_min(max(firstPixel(fixed_min.x), int64_t(0)),
+                             max(firstPixel(fixed_min.y), int64_t(0)));
+        glm::ivec2 pixel_max(
+            min(lastPixel(fixed_max.x), int64_t(width) - 1),
+            min(lastPixel(fixed_max.y), int64_t(height) - 1));
+
+        if (pixel_min.x > pixel_max.x || pixel_min.y > pixel_max.y) {
+            return;
+        }
+
+        // Barycentric i is edge function i (opposite vertex i) over the
+        // area, 1 / depth interpolates linearly in screen space
+        double inv_depth_plane[3] { 0.0, 0.0, 0.0 };
+        for (int i = 0; i < 3; i++) {
+            const glm::ivec2 &from = verts[(i + 1) % 3];
+            const glm::ivec2 &to = verts[(i + 2) % 3];
+            double dx = double(to.x) - double(from.x);
+            double dy = double(to.y) - double(from.y);
+            double weight = double(inv_depths[i]) / double(area);
+
+            inv_depth_plane[0] -= dy * subpixel_scale * weight;
+            inv_depth_plane[1] += dx * subpixel_scale * weight;
+            inv_depth_plane[2] +=
+                (dy * double(from.x) - dx * double(from.y)) * weight;
+        }
+
+        uint32_t tri_idx = bins.triangles.size();
+        bins.triangles.push_back({
+            { verts[0], verts[1], verts[2] },
+            glm::vec3(inv_depth_plane[0], inv_depth_plane[1],
+                      inv_depth_plane[2]),
+            pixel_min,
+            pixel_max,
+            inst_idx,
+            material_idx,
+        });
+
+        constexpr uint32_t tile_size = CPUConfig::tile_size;
+        for (uint32_t tile_y = pixel_min.y / tile_size;
+             tile_y <= pixel_max.y / tile_size; tile_y++) {
+            for (uint32_t tile_x = pixel_min.x / tile_size;
+                 tile_x <= pixel_max.x / tile_size; tile_x++) {
+                bins.tiles[tile_y * tilesWide + tile_x].push_back(tri_idx);
+            }
+        }
+    }
+
+    // Triangles crossing the near plane or guard band are clipped and
+    // split into a fan
+    void add(const glm::vec3 &a, const glm::vec3 &b, const glm::vec3 &c,
+             uint32_t inst_idx, uint32_t material_idx)
+    {
+        if ((outcode(a) & outcode(b) & outcode(c)) != 0) {
+            return;
+        }
+
+        if (!needsClipping(a) && !needsClipping(b) && !needsClipping(c)) {
+            emit(a, b, c, inst_idx, material_idx);
+            return;
+        }
+
+        glm::vec3 poly[3 + num_clip_planes] { a, b, c };
+        uint32_t num_verts = clipPolygon(poly, 3);
+
+        for (uint32_t i = 1; i + 1 < num_verts; i++) {
+            emit(poly[0], poly[i], poly[i + 1], inst_idx, material_idx);
+        }
+    }
+};
+
+}
+
+void Rasterizer::setupEnvironment(const Environment &env,
+                                  RasterBins &bins) const
+{
+    const CPUScene &scene = *static_cast<const CPUScene *>(
+        env.getScene().get());
+    const Camera &cam = env.getCamera();
+
+    // Larger indices would be truncated or read as misses
+    if (scene.objectInfo.size() > CPUConfig::raster_max_ids ||
+        scene.numMaterials > CPUConfig::raster_max_ids ||
+        env.getNumInstances() > CPUConfig::raster_max_ids) {
+        cerr << "CPU backend: rasterization supports at most "
+             << CPUConfig::raster_max_ids
+             << " objects, materials and instances" << endl;
+        fatalExit();
+    }
+
+    const float aspect = float(width_) / float(height_);
+    glm::mat3 cam_basis(cam.right * aspect * cam.tanFOV,
+                        -cam.up * cam.tanFOV,
+                        cam.view);
+    glm::mat3 world_to_cam = glm::inverse(cam_basis);
+
+    bins.viewLength = glm::length(cam.view);
+    bins.triangles.clear();
+    bins.tiles.resize(tiles_wide_ * tiles_tall_);
+    for (vector<uint32_t> &tile : bins.tiles) {
+        tile.clear();
+    }
+
+    TriangleSetup tri_setup {
+        width_,
+        height_,
+        tiles_wide_,
+        bins,
+    };
+
+    const CowArray<ObjectInstance> &instances = env.getInstances();
+    const CowArray<uint32_t> &instance_materials =
+        env.getInstanceMaterials();
+    const CowArray<InstanceTransform> &transforms = env.getTransforms();
+    const CowArray<InstanceFlags> &flags = env.getInstanceFlags();
+
+    for (uint32_t inst_idx = 0; inst_idx < env.getNumInstances();
+         inst_idx++) {
+        if (flags[inst_idx] & InstanceFlags::Transparent) {
+            continue;
+        }
+
+        const ObjectInstance &inst = instances[inst_idx];
+        const glm::mat4x3 &o2w = transforms[inst_idx].mat;
+
+        glm::mat4x3 obj_to_cam(
+            world_to_cam * o2w[0],
+            world_to_cam * o2w[1],
+            world_to_cam * o2w[2],
+            world_to_cam * (o2w[3] - cam.position));
+
+        // Whole instances outside one side of the frustum
+        AABB obj_bounds = scene.objectAccels[inst.objectIndex].bvh.getBounds();
+        uint32_t corner_codes = ~0u;
+        for (uint32_t corner = 0; corner < 8; corner++) {
+            glm::vec3 pos(
+                (corner & 1) ? obj_bounds.pMax.x : obj_bounds.pMin.x,
+                (corner & 2) ? obj_bounds.pMax.y : obj_bounds.pMin.y,
+                (corner & 4) ? obj_bounds.pMax.z : obj_bounds.pMin.z);
+
+            corner_codes &= outcode(obj_to_cam * glm::vec4(pos, 1.f));
+        }
+
+        if (corner_codes != 0) {
+            continue;
+        }
+
+        const ObjectInfo &obj = scene.objectInfo[inst.objectIndex];
+        for (uint32_t geo_idx = 0; geo_idx < obj.numMeshes; geo_idx++) {
+            const MeshInfo &mesh = scene.meshInfo[obj.meshIndex + geo_idx];
+            uint32_t material_idx =
+                instance_materials[inst.materialOffset + geo_idx];
+
+            const uint32_t *tri_indices = scene.indices + mesh.indexOffset;
+            for (uint32_t tri_idx = 0; tri_idx < mesh.numTriangles;
+                 tri_idx++, tri_indices += 3) {
+                glm::vec3 verts[3];
+                for (int i = 0; i < 3; i++) {
+                    verts[i] = obj_to_cam * glm::vec4(
+                        scene.vertices[tri_indices[i]].position, 1.f);
+                }
+
+                tri_setup.add(verts[0], verts[1], verts[2], inst_idx,
+                              material_idx);
+            }
+        }
+    }
+}
+
+void Rasterizer::setup(const Environment *envs, const uint32_t *active,
+                       uint32_t num_active, BatchPrepPool &pool)
+{
+    pool.run(num_active, [&](uint32_t begin, uint32_t end) {
+        for (uint32_t i = begin; i < end; i++) {
+            setupEnvironment(envs[active[i]], bins_[active[i]]);
+        }
+    }, 1);
+}
+
+void Rasterizer::rasterizeTile(const Environment &env,
+                               const RasterBins &bins, uint32_t tile_idx,
+                               uint16_t *output) const
+{
+    constexpr uint32_t tile_size = CPUConfig::tile_size;
+
+    const int32_t tile_x = (tile_idx % tiles_wide_) * tile_size;
+    const int32_t tile_y = (tile_idx / tiles_wide_) * tile_size;
+    const int32_t end_x = min(tile_x + int32_t(tile_size), int32_t(width_));
+    const int32_t end_y = min(tile_y + int32_t(tile_size), int32_t(height_));
+
+    // Nearest triangle so far per pixel. Ties keep the earlier triangle,
+    // so results don't depend on scheduling.
+    float nearest_inv_depth[tile_size * tile_size];
+    uint32_t nearest_tri[tile_size * tile_size];
+    fill_n(nearest_inv_depth, tile_size * tile_size, 0.f);
+    fill_n(nearest_tri, tile_size * tile_size, ~0u);
+
+    for (uint32_t tri_idx : bins.tiles[tile_idx]) {
+        const RasterTriangle &tri = bins.triangles[tri_idx];
+
+        int32_t min_x = max(tri.pixelMin.x, tile_x);
+        int32_t min_y = max(tri.pixelMin.y, tile_y);
+        int32_t max_x = min(tri.pixelMax.x, end_x - 1);
+        int32_t max_y = min(tri.pixelMax.y, end_y - 1);
+
+        glm::ivec2 sample(min_x * subpixel_scale + subpixel_scale / 2,
+                          min_y * subpixel_scale + subpixel_scale / 2);
+
+        // Edge functions are exact, stepping through pixels included.
+        // Samples exactly on an edge go to one of the two triangles
+        // sharing it.
+        int64_t row_edges[3], step_x[3], step_y[3], min_edge[3];
+        for (int i = 0; i < 3; i++) {
+            const glm::ivec2 &from = tri.verts[(i + 1) % 3];
+            const glm::ivec2 &to = tri.verts[(i + 2) % 3];
+            int64_t dx = to.x - from.x;
+            int64_t dy = to.y - from.y;
+
+            row_edges[i] = edgeFunction(from, to, sample);
+            step_x[i] = -dy * subpixel_scale;
+            step_y[i] = dx * subpixel_scale;
+            min_edge[i] = (dy > 0 || (dy == 0 && dx < 0)) ? 0 : 1;
+        }
+
+        for (int32_t y = min_y; y <= max_y; y++) {
+            int64_t edges[3] { row_edges[0], row_edges[1], row_edges[2] };
+
+            for (int32_t x = min_x; x <= max_x; x++) {
+                if (edges[0] >= min_edge[0] && edges[1] >= min_edge[1] &&
+                    edges[2] >= min_edge[2]) {
+                    float inv_depth = tri.invDepth.x * (float(x) + 0.5f) +
+                        tri.invDepth.y * (float(y) + 0.5f) + tri.invDepth.z;
+
+                    uint32_t pixel = (y - tile_y) * tile_size + (x - tile_x);
+                    if (inv_depth > nearest_inv_depth[pixel]) {
+                        nearest_inv_depth[pixel] = inv_depth;
+                        nearest_tri[pixel] = tri_idx;
+                    }
+                }
+
+                for (int i = 0; i < 3; i++) {
+                    edges[i] += step_x[i];
+                }
+            }
+
+            for (int i = 0; i < 3; i++) {
+                row_edges[i] += step_y[i];
+            }
+        }
+    }
+
+    const CowArray<ObjectInstance> &instances = env.getInstances();
+
+    for (int32_t y = tile_y; y < end_y; y++) {
+        for (int32_t x = tile_x; x < end_x; x++) {
+            uint32_t pixel = (y - tile_y) * tile_size + (x - tile_x);
+            uint16_t *out = output + 4 * (uint64_t(y) * width_ + x);
+
+            uint32_t tri_idx = nearest_tri[pixel];
+            if (tri_idx == ~0u) {
+                out[0] = 0;
+                out[1] = 0xFFFF;
+                out[2] = 0xFFFF;
+                out[3] = 0xFFFF;
+                continue;
+            }
+
+            const RasterTriangle &tri = bins.triangles[tri_idx];
+
+            out[0] = glm::packHalf1x16(
+                bins.viewLength / nearest_inv_depth[pixel]);
+            out[1] = uint16_t(instances[tri.instIdx].objectIndex);
+            out[2] = uint16_t(tri.materialIdx);
+            out[3] = uint16_t(tri.instIdx);
+        }
+    }
+}
+
+void Rasterizer::rasterize(const Environment *envs, const uint32_t *active,
+                           uint32_t num_active, BatchPrepPool &pool,
+                           uint16_t *output) const
+{
+    const uint32_t tiles_per_env = tiles_wide_ * tiles_tall_;
+    const uint32_t num_tiles = tiles_per_env * num_active;
+    const uint64_t env_pixels = uint64_t(width_) * height_;
+
+    // Tiles are claimed dynamically, triangle counts vary a lot
+    atomic_uint32_t next_tile(0);
+    pool.run(num_tiles, [&](uint32_t, uint32_t) {
+        uint32_t tile_idx;
+        while ((tile_idx = next_tile.fetch_add(1, memory_order_relaxed)) <
+               num_tiles) {
+            uint32_t batch_idx = active[tile_idx / tiles_per_env];
+
+            rasterizeTile(envs[batch_idx], bins_[batch_idx],
+                          tile_idx % tiles_per_env,
+                          output + 4 * batch_idx * env_pixels);
+        }
+    }, 1);
+}
+
+}
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <rlpbr/environment.hpp>
+#include <rlpbr_core/batch_prep.hpp>
+
+#include <glm/glm.hpp>
+
+#include <vector>
+
+namespace RLpbr {
+namespace cpu {
+
+// Triangle ready for rasterization. Vertices are in fixed point pixel
+// coordinates, ordered so that edge functions are positive inside. The
+// guard band keeps them within 32 bits, edge functions use 64. 1 / depth
+// is a plane over pixel coordinates.
+struct RasterTriangle {
+    glm::ivec2 verts[3];
+    glm::vec3 invDepth;
+    glm::ivec2 pixelMin;
+    glm::ivec2 pixelMax;
+    uint32_t instIdx;
+    uint32_t materialIdx;
+};
+
+// Triangles of one environment, and per screen tile the triangles
+// overlapping it in submission order
+struct RasterBins {
+    std::vector<RasterTriangle> triangles;
+    std::vector<std::vector<uint32_t>> tiles;
+    float viewLength;
+};
+
+// RenderMode::Rasterize. Samples the path tracer's camera rays through
+// pixel centers: triangles are clipped in camera space and rasterized
+// with watertight fixed point edge functions, two sided and skipping
+// transparent instances like the opaque ray mask. Environments are set up
+// in parallel, then their screen tiles are rasterized independently.
+class Rasterizer {
+public:
+    Rasterizer(uint32_t width, uint32_t height, uint32_t batch_size);
+
+    // Transforms, clips and bins the triangles of the active environments
+    void setup(const Environment *envs, const uint32_t *active,
+               uint32_t num_active, BatchPrepPool &pool);
+
+    // output holds 4 halves per pixel, see RenderMode::Rasterize
+    void rasterize(const Environment *envs, const uint32_t *active,
+                   uint32_t num_active, BatchPrepPool &pool,
+                   uint16_t *output) const;
+
+private:
+    void setupEnvironment(const Environment &env, RasterBins &bins) const;
+
+    void rasterizeTile(const Environment &env, const RasterBins &bins,
+                       uint32_t tile_idx, uint16_t *output) const;
+
+    uint32_t width_;
+    uint32_t height_;
+    uint32_t tiles_wide_;
+    uint32_t tiles_tall_;
+
+    // Per batch slot, kept across frames to reuse allocations
+    std::vector<RasterBins> bins_;
+};
+
+}
+}
@@ -0,0 +1,875 @@
+#include "render.hpp"
+#include "config.hpp"
+#include "shading.hpp"
+
+#include <rlpbr_core/random.hpp>
+#include <rlpbr_core/tonemap.hpp>
+#include <rlpbr_core/utils.hpp>
+
+#include <glm/gtc/packing.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+using namespace std;
+
+namespace RLpbr {
+namespace cpu {
+
+static constexpr float large_distance = 1e16f;
+
+namespace {
+
+// Counter based (philox), so every pixel sample is independent of how
+// tiles are scheduled across threads
+class PixelSampler {
+public:
+    PixelSampler(uint32_t pixel_idx, uint32_t sample_idx,
+                 uint32_t frame_idx)
+        : counter_ { 0, pixel_idx, sample_idx, frame_idx },
+          vals_ {},
+          cur_(4)
+    {}
+
+    float get1D()
+    {
+        if (cur_ == 4) {
+            constexpr uint32_t key[2] { 0x6b8b4567, 0x327b23c6 };
+            philox4x32(counter_, key, vals_);
+            counter_[0]++;
+            cur_ = 0;
+        }
+
+        // 24 bits so the result is < 1
+        return float(vals_[cur_++] >> 8) * (1.f / 16777216.f);
+    }
+
+    glm::vec2 get2D()
+    {
+        float x = get1D();
+        return glm::vec2(x, get1D());
+    }
+
+private:
+    uint32_t counter_[4];
+    uint32_t vals_[4];
+    uint32_t cur_;
+};
+
+// Everything a ray needs from one environment
+struct TraceContext {
+    const CPUScene &scene;
+    const CPUEnvironment &envBackend;
+    const CowArray<ObjectInstance> &instances;
+    const CowArray<uint32_t> &instanceMaterials;
+    const CowArray<InstanceTransform> &transforms;
+    const LightSampler &lightSampler;
+    const CPUEnvMapGroup::Map *envMap;
+};
+
+struct HitInfo {
+    glm::vec3 position;
+    glm::vec3 geoNormal;
+    TangentFrame tangentFrame;
+    Material material;
+};
+
+struct LightSample {
+    glm::vec3 toLight;
+    glm::vec3 radiance;
+    float pdf;
+};
+
+struct LightInfo {
+    LightSample lightSample;
+    glm::vec3 shadowRayOrigin;
+    float shadowRayLength;
+};
+
+struct PathVertexState {
+    glm::vec3 radiance;
+    glm::vec3 bounceOrigin;
+    glm::vec3 bounceDir;
+    glm::vec3 bounceWeight;
+    uint32_t bounceFlags;
+};
+
+}
+
+// All rays trace with the opaque mask, like the GPU shaders
+template <bool any_hit>
+static inline bool traceRay(const TraceContext &ctx,
+                            const glm::vec3 &origin, const glm::vec3 &dir,
+                            float max_t, RayHit *hit)
+{
+    return ctx.envBackend.tlas.traceRay<any_hit>(
+        ctx.scene.objectAccels.data(), ctx.instances, ctx.transforms,
+        origin, dir, max_t, VisibilityMask::opaque, hit);
+}
+
+static inline bool traceShadowRay(const TraceContext &ctx,
+                                  const glm::vec3 &origin,
+                                  const glm::vec3 &dir, float len)
+{
+    return traceRay<true>(ctx, origin, dir,
+        len * (1.f - CPUConfig::shadow_ray_shorten), nullptr);
+}
+
+// Bilinear lookup in the lat-long map, repeating at the borders like the
+// GPU sampler
+static glm::vec3 evalEnvMap(const CPUEnvMapGroup::Map *map,
+                            const glm::vec3 &dir)
+{
+    if (map == nullptr || map->texels.empty()) {
+        return glm::vec3(0.f);
+    }
+
+    int32_t width = map->width;
+    int32_t height = map->height;
+
+    glm::vec2 uv = dirToLatLong(dir);
+    float x = uv.x * width - 0.5f;
+    float y = uv.y * height - 0.5f;
+
+    float fx = floorf(x);
+    float fy = floorf(y);
+    float tx = x - fx;
+    float ty = y - fy;
+
+    auto fetch = [&](int32_t px, int32_t py) {
+        px = ((px % width) + width) % width;
+        py = ((py % height) + height) % height;
+
+        return glm::vec3(map->texels[py * width + px]);
+    };
+
+    int32_t x0 = int32_t(fx);
+    int32_t y0 = int32_t(fy);
+
+    glm::vec3 top = glm::mix(fetch(x0, y0), fetch(x0 + 1, y0), tx);
+    glm::vec3 bottom = glm::mix(fetch(x0, y0 + 1), fetch(x0 + 1, y0 + 1), tx);
+
+    return glm::mix(top, bottom, ty);
+}
+
+static HitInfo processHit(const TraceContext &ctx, const RayHit &hit,
+                          const glm::vec3 &ray_dir)
+{
+    const CPUScene &scene = ctx.scene;
+
+    const ObjectInstance &inst = ctx.instances[hit.instIdx];
+    const InstanceTransform &txfm = ctx.transforms[hit.instIdx];
+
+    const ObjectInfo &obj = scene.objectInfo[inst.objectIndex];
+    const MeshInfo &mesh = scene.meshInfo[obj.meshIndex + hit.geoIdx];
+
+    const uint32_t *tri_indices =
+        scene.indices + mesh.indexOffset + 3 * hit.triIdx;
+    const PackedVertex &a = scene.vertices[tri_indices[0]];
+    const PackedVertex &b = scene.vertices[tri_indices[1]];
+    const PackedVertex &c = scene.vertices[tri_indices[2]];
+
+    glm::vec3 world_a = transformPosition(txfm.mat, a.position);
+    glm::vec3 world_b = transformPosition(txfm.mat, b.position);
+    glm::vec3 world_c = transformPosition(txfm.mat, c.position);
+
+    glm::vec3 world_geo_normal =
+        normalize(cross(world_b - world_a, world_c - world_a));
+
+    if (dot(world_geo_normal, -ray_dir) < 0.f) {
+        world_geo_normal *= -1.f;
+    }
+
+    glm::vec3 world_position = world_a +
+        hit.barys.x * (world_b - world_a) + hit.barys.y * (world_c - world_a);
+
+    uint32_t material_id =
+        ctx.instanceMaterials[inst.materialOffset + hit.geoIdx];
+
+    TangentFrame world_tangent_frame = tangentFrameToWorld(txfm.mat,
+        txfm.inv, computeTangentFrame(a, b, c, hit.barys), world_geo_normal);
+
+    return HitInfo {
+        world_position,
+        world_geo_normal,
+        world_tangent_frame,
+        unpackMaterial(scene.materials[material_id]),
+    };
+}
+
+// Light sampling functions below follow lighting.glsl
+
+static void sampleSphereLight(const glm::vec3 &position, float radius,
+                              const glm::vec3 &emittance,
+                              const glm::vec3 &origin,
+                              float inv_selection_pdf, const glm::vec2 &uv,
+                              LightSample &light_sample,
+                              float &dist_to_light)
+{
+    // Code from pbrt-v3
+    // Compute coordinate system for sphere sampling
+    float dc = distance(origin, position);
+    float inv_dc = 1.f / dc;
+    glm::vec3 wc = (position - origin) * inv_dc;
+
+    glm::vec3 wc_x, wc_y;
+    if (fabsf(wc.x) > fabsf(wc.y)) {
+        wc_x = glm::vec3(-wc.z, 0.f, wc.x) /
+            sqrtf(wc.x * wc.x + wc.z * wc.z);
+    } else {
+        wc_x = glm::vec3(0.f, wc.z, -wc.y) /
+            sqrtf(wc.y * wc.y + wc.z * wc.z);
+    }
+    wc_y = cross(wc, wc_x);
+
+    float sin_theta_max = radius * inv_dc;
+    Shader::SphereConeSample cone =
+        Shader::sampleSphereCone(sin_theta_max, uv.x);
+
+    float phi = uv.y * 2.f * float(M_PI);
+
+    // Compute surface normal and sampled point on sphere
+    glm::vec3 normal =
+        cone.sinAlpha * cosf(phi) * -wc_x +
+        cone.sinAlpha * sinf(phi) * -wc_y +
+        cone.cosAlpha * -wc;
+
+    glm::vec3 light_point = position + radius * normal;
+
+    glm::vec3 to_light = light_point - origin;
+
+    dist_to_light = length(to_light);
+
+    if (dist_to_light > 0.f) {
+        light_sample.toLight = to_light / dist_to_light;
+        light_sample.radiance = emittance;
+        light_sample.pdf = 1.f / (cone.invPdf * inv_selection_pdf);
+    } else {
+        light_sample = LightSample { glm::vec3(0.f), glm::vec3(0.f), 0.f };
+    }
+}
+
+static void sampleTriangleLight(const glm::vec3 *verts,
+                                const glm::vec3 &emittance,
+                                const glm::vec3 &origin,
+                                const glm::vec3 &sampled_position,
+                                float inv_selection_pdf,
+                                LightSample &light_sample,
+                                float &dist_to_light)
+{
+    glm::vec3 c = cross(verts[1] - verts[0], verts[2] - verts[0]);
+
+    glm::vec3 n = normalize(c);
+    float area = 0.5f * length(c);
+
+    glm::vec3 to_light = sampled_position - origin;
+
+    float dist_to_light2 = dot(to_light, to_light);
+    dist_to_light = sqrtf(dist_to_light2);
+    to_light /= dist_to_light;
+
+    float cos_theta = fabsf(dot(to_light, n));
+
+    if (dist_to_light > 0.f && cos_theta > 0.f) {
+        light_sample.toLight = to_light;
+        light_sample.radiance = emittance;
+        light_sample.pdf = Shader::areaToSolidAnglePDF(
+            1.f / (area * inv_selection_pdf), dist_to_light2, cos_theta);
+    } else {
+        light_sample = LightSample { glm::vec3(0.f), glm::vec3(0.f), 0.f };
+    }
+}
+
+static LightSample samplePortal(const glm::vec3 *corners,
+                                const CPUEnvMapGroup::Map *env_map,
+                                const glm::vec3 &to_light,
+                                float inv_selection_pdf)
+{
+    float len2 = dot(to_light, to_light);
+    glm::vec3 dir = to_light / sqrtf(len2);
+
+    glm::vec3 side_a = corners[3] - corners[0];
+    glm::vec3 side_b = corners[1] - corners[0];
+
+    float area = length(side_a) * length(side_b);
+    glm::vec3 portal_normal = normalize(cross(side_a, side_b));
+
+    float cos_theta = fabsf(dot(portal_normal, dir));
+
+    float inv_pdf = (len2 < NearZero) ? 0 : (cos_theta * area / len2);
+
+    return LightSample {
+        dir,
+        evalEnvMap(env_map, dir),
+        1.f / (inv_pdf * inv_selection_pdf),
+    };
+}
+
+// The environment map and the lights as a whole are picked uniformly,
+// individual lights proportional to their power
+static LightInfo sampleLights(PixelSampler &rng, const TraceContext &ctx,
+                              const glm::vec3 &origin,
+                              const glm::vec3 &base_normal)
+{
+    const CPUScene &scene = ctx.scene;
+    const vector<CPULight> &lights = ctx.envBackend.lights;
+
+    uint32_t num_lights = lights.size();
+    uint32_t total_lights = num_lights + 1;
+
+    uint32_t light_idx = min(uint32_t(rng.get1D() * total_lights),
+                             total_lights - 1);
+
+    glm::vec2 light_sample_uv = rng.get2D();
+
+    float inv_selection_pdf = float(total_lights);
+    if (light_idx < num_lights) {
+        glm::vec2 selection_uv = rng.get2D();
+        light_idx = ctx.lightSampler.sample(selection_uv.x, selection_uv.y);
+        float light_pdf = ctx.lightSampler.pdf(light_idx);
+
+        inv_selection_pdf = light_pdf == 0.f ? 0.f :
+            float(total_lights) / (float(num_lights) * light_pdf);
+    }
+
+    const LightProperties *props = nullptr;
+    const PointLight *point = nullptr;
+    if (light_idx < num_lights) {
+        props = get_if<LightProperties>(&lights[light_idx]);
+        point = get_if<PointLight>(&lights[light_idx]);
+    }
+
+    auto vertexPosition = [&](uint32_t idx) {
+        return scene.vertices[idx].position;
+    };
+
+    glm::vec3 verts[4];
+    glm::vec3 light_position(0.f);
+    glm::vec3 dir_check(0.f);
+    LightSample light_sample { glm::vec3(0.f), glm::vec3(0.f), 0.f };
+
+    if (point) {
+        light_position = point->position;
+        dir_check = light_position - origin;
+    } else if (props && props->type == LightType::Sphere) {
+        light_position = vertexPosition(props->sphereVertIdx);
+        dir_check = light_position - origin;
+    } else if (props && props->type == LightType::Triangle) {
+        for (int i = 0; i < 3; i++) {
+            verts[i] = vertexPosition(
+                scene.indices[props->triIdxOffset + i]);
+        }
+
+        float su0 = sqrtf(light_sample_uv.x);
+        glm::vec2 b(1.f - su0, light_sample_uv.y * su0);
+        light_position = (1.f - b.x - b.y) * verts[0] +
+            b.x * verts[1] + b.y * verts[2];
+        dir_check = light_position - origin;
+    } else if (props && props->type == LightType::Portal) {
+        for (int i = 0; i < 4; i++) {
+            verts[i] = vertexPosition(
+                scene.indices[props->portalIdxOffset + i]);
+        }
+
+        glm::vec3 upper = glm::mix(verts[0], verts[3], light_sample_uv.x);
+        glm::vec3 lower = glm::mix(verts[1], verts[2], light_sample_uv.x);
+        light_position = glm::mix(lower, upper, light_sample_uv.y);
+        dir_check = light_position - origin;
+    } else {
+        // No importance map on the host, sample the sphere uniformly
+        glm::vec3 dir = sampleSphereUniform(light_sample_uv);
+
+        light_sample = LightSample {
+            dir,
+            evalEnvMap(ctx.envMap, dir),
+            1.f / (4.f * float(M_PI) * inv_selection_pdf),
+        };
+
+        dir_check = dir;
+    }
+
+    glm::vec3 shadow_offset_normal =
+        dot(dir_check, base_normal) > 0 ? base_normal : -base_normal;
+
+    glm::vec3 shadow_origin = offsetRayOrigin(origin, shadow_offset_normal);
+
+    float shadow_len = large_distance;
+    if (point) {
+        glm::vec3 to_light = light_position - shadow_origin;
+        float dist2 = dot(to_light, to_light);
+        shadow_len = sqrtf(dist2);
+
+        if (shadow_len > 0.f) {
+            light_sample = LightSample {
+                to_light / shadow_len,
+                point->color / dist2,
+                1.f / inv_selection_pdf,
+            };
+        }
+    } else if (props && props->type == LightType::Sphere) {
+        sampleSphereLight(light_position, props->radius,
+                          getMaterialEmittance(
+                              scene.materials[props->sphereMatIdx]),
+                          shadow_origin, inv_selection_pdf,
+                          light_sample_uv, light_sample, shadow_len);
+    } else if (props && props->type == LightType::Triangle) {
+        sampleTriangleLight(verts,
+                            getMaterialEmittance(
+                                scene.materials[props->triMatIdx]),
+                            shadow_origin, light_position,
+                            inv_selection_pdf, light_sample, shadow_len);
+    } else if (props && props->type == LightType::Portal) {
+        light_sample = samplePortal(verts, ctx.envMap,
+                                    light_position - shadow_origin,
+                                    inv_selection_pdf);
+    }
+
+    return LightInfo {
+        light_sample,
+        shadow_origin,
+        shadow_len,
+    };
+}
+
+// Emittance (if requested), next event estimation and the next bounce
+static PathVertexState processPathVertex(PixelSampler &rng,
+                                         const TraceContext &ctx,
+                                         const HitInfo &hit,
+                                         const glm::vec3 &ray_dir,
+                                         bool add_emittance)
+{
+    PathVertexState result;
+    result.radiance = add_emittance ? hit.material.emittance : glm::vec3(0.f);
+
+    LightInfo light_info =
+        sampleLights(rng, ctx, hit.position, hit.geoNormal);
+    const LightSample &light_sample = light_info.lightSample;
+
+    // These normalizations shouldn't be necessary, but z component
+    // needs to be accurate for cos angle
+    glm::vec3 wo =
+        normalize(worldToLocalOutgoing(-ray_dir, hit.tangentFrame));
+
+    BSDFParams bsdf = buildBSDF(hit.material, wo);
+
+    if (light_sample.pdf > 0.f) {
+        glm::vec3 wi = normalize(
+            worldToLocalIncoming(light_sample.toLight, hit.tangentFrame));
+
+        float bsdf_pdf;
+        glm::vec3 bsdf_response = evalBSDF(bsdf, wo, wi, bsdf_pdf);
+
+        glm::vec3 nee =
+            bsdf_response * light_sample.radiance / light_sample.pdf;
+
+        if (nee != glm::vec3(0.f) &&
+            !traceShadowRay(ctx, light_info.shadowRayOrigin,
+                            light_sample.toLight,
+                            light_info.shadowRayLength)) {
+            result.radiance += nee;
+        }
+    }
+
+    float selector = rng.get1D();
+    SampleResult bounce = sampleBSDF(bsdf, wo, selector, rng.get2D());
+
+    result.bounceDir = localToWorld(bounce.dir, hit.tangentFrame);
+    glm::vec3 bounce_offset_normal =
+        dot(result.bounceDir, hit.geoNormal) > 0 ?
+            hit.geoNormal : -hit.geoNormal;
+    result.bounceOrigin = offsetRayOrigin(hit.position, bounce_offset_normal);
+    result.bounceWeight = bounce.weight;
+    result.bounceFlags = bounce.flags;
+
+    return result;
+}
+
+static glm::vec3 indirectLighting(PixelSampler &rng, const TraceContext &ctx,
+                                  glm::vec3 ray_origin, glm::vec3 ray_dir,
+                                  uint32_t bounce_flags, uint32_t max_depth,
+                                  float clamp_threshold)
+{
+    glm::vec3 indirect_contrib(0.f);
+    glm::vec3 path_weight(1.f);
+
+    for (uint32_t path_depth = 1; path_depth < max_depth; path_depth++) {
+        if (path_weight == glm::vec3(0.f)) {
+            break;
+        }
+
+        RayHit ray_hit;
+        if (!traceRay<false>(ctx, ray_origin, ray_dir, large_distance,
+                             &ray_hit)) {
+            // Without MIS the env map is only reachable by delta bounces,
+            // other directions are covered by light sampling
+            if (bounce_flags & BSDFFlagsDelta) {
+                indirect_contrib += path_weight * evalEnvMap(ctx.envMap,
+                                                             ray_dir);
+            }
+            break;
+        }
+
+        HitInfo hit = processHit(ctx, ray_hit, ray_dir);
+
+        PathVertexState bounce_state = processPathVertex(rng, ctx, hit,
+            ray_dir, bounce_flags & BSDFFlagsDelta);
+
+        glm::vec3 vert_contrib = path_weight * bounce_state.radiance;
+        if (clamp_threshold > 0.f) {
+            vert_contrib = glm::min(vert_contrib, glm::vec3(clamp_threshold));
+        }
+        indirect_contrib += vert_contrib;
+
+        ray_origin = bounce_state.bounceOrigin;
+        ray_dir = normalize(bounce_state.bounceDir);
+        path_weight *= bounce_state.bounceWeight;
+        bounce_flags = bounce_state.bounceFlags;
+    }
+
+    return indirect_contrib;
+}
+
+static inline bool isFinite(const glm::vec3 &v)
+{
+    return isfinite(v.x) && isfinite(v.y) && isfinite(v.z);
+}
+
+static inline void storeHalf3(uint16_t *dst, const glm::vec3 &v)
+{
+    dst[0] = glm::packHalf1x16(v.x);
+    dst[1] = glm::packHalf1x16(v.y);
+    dst[2] = glm::packHalf1x16(v.z);
+}
+
+CPUBackend::CPUBackend(const RenderConfig &cfg)
+    : cfg_(cfg),
+      aux_outputs_((cfg.flags & RenderFlags::AuxiliaryOutputs) &&
+                   cfg.mode != RenderMode::Rasterize),
+      tonemap_((cfg.flags & RenderFlags::Tonemap) &&
+               cfg.mode != RenderMode::Rasterize),
+      pool_(cfg.numPrepThreads),
+      raster_(cfg.imgWidth, cfg.imgHeight, cfg.batchSize),
+      cur_env_maps_(nullptr),
+      frame_counter_(0)
+{
+    if (cfg.flags & RenderFlags::Denoise ||
+        cfg.flags & RenderFlags::AdaptiveSample) {
+        cerr << "CPU backend: denoising and adaptive "
+            "sampling are not supported, ignoring" << endl;
+    }
+
+    if (cfg.mode == RenderMode::Rasterize &&
+        cfg.flags & RenderFlags::AuxiliaryOutputs) {
+        cerr << "CPU backend: rasterization has no auxiliary outputs, "
+            "ignoring" << endl;
+    }
+
+    if (cfg.mode == RenderMode::Rasterize &&
+        cfg.flags & RenderFlags::Tonemap) {
+        cerr << "CPU backend: rasterization outputs are not tonemapped, "
+            "ignoring" << endl;
+    }
+}
+
+LoaderImpl CPUBackend::makeLoader()
+{
+    auto loader = new CPULoader(cfg_.maxTextureResolution);
+
+    return makeLoaderImpl<CPULoader>(loader);
+}
+
+EnvironmentImpl CPUBackend::makeEnvironment(const shared_ptr<Scene> &scene,
+                                            const Camera &)
+{
+    const CPUScene &cpu_scene = *static_cast<CPUScene *>(scene.get());
+    CPUEnvironment *environment = new CPUEnvironment(cpu_scene);
+
+    return makeEnvironmentImpl<CPUEnvironment>(environment);
+}
+
+void CPUBaker::init()
+{
+    cerr << "CPU backend: probe baking is not supported" << endl;
+    fatalExit();
+}
+
+void CPUBaker::bake(RenderBatch &)
+{
+    cerr << "CPU backend: probe baking is not supported" << endl;
+    fatalExit();
+}
+
+BakerImpl CPUBackend::makeBaker()
+{
+    return makeBakerImpl<CPUBaker>(new CPUBaker());
+}
+
+void CPUBackend::setActiveEnvironmentMaps(
+    shared_ptr<EnvironmentMapGroup> env_maps)
+{
+    cur_env_maps_ = static_pointer_cast<CPUEnvMapGroup>(move(env_maps));
+}
+
+RenderBatch::Handle CPUBackend::makeRenderBatch()
+{
+    auto deleter = [](void *, BatchBackend *base_ptr) {
+        auto ptr = static_cast<CPUBatch *>(base_ptr);
+        delete ptr;
+    };
+
+    uint64_t num_pixels =
+        uint64_t(cfg_.batchSize) * cfg_.imgHeight * cfg_.imgWidth;
+
+    auto backend = new CPUBatch {
+        {},
+        vector<uint16_t>(num_pixels * 4),
+        vector<uint16_t>(aux_outputs_ ? num_pixels * 3 : 0),
+        vector<uint16_t>(aux_outputs_ ? num_pixels * 3 : 0),
+        vector<float>(tonemap_ ? num_pixels * 4 : 0),
+    };
+
+    return RenderBatch::Handle(backend, {nullptr, deleter});
+}
+
+void CPUBackend::render(RenderBatch &batch)
+{
+    CPUBatch &batch_backend = *static_cast<CPUBatch *>(batch.getBackend());
+    Environment *envs = batch.getEnvironments();
+    const uint32_t *active = batch.getActiveEnvironments();
+    uint32_t num_active = batch.getNumActive();
+
+    const bool rasterize = cfg_.mode == RenderMode::Rasterize;
+
+    auto stage_start = chrono::steady_clock::now();
+
+    if (rasterize) {
+        raster_.setup(envs, active, num_active, pool_);
+    } else {
+        pool_.run(num_active, [&](uint32_t begin, uint32_t end) {
+            for (uint32_t i = begin; i < end; i++) {
+                Environment &env = envs[active[i]];
+                static_cast<CPUEnvironment *>(env.getBackend())->
+                    updateAccel(env);
+            }
+        });
+    }
+
+    auto stage_end = chrono::steady_clock::now();
+
+    batch.setPrepStats({
+        pool_.numThreads(),
+        0,
+        chrono::duration<double>(stage_end - stage_start).count(),
+    });
+
+    if (rasterize) {
+        raster_.rasterize(envs, active, num_active, pool_,
+                          batch_backend.output.data());
+        frame_counter_ += cfg_.batchSize;
+
+        return;
+    }
+
+    const uint32_t width = cfg_.imgWidth;
+    const uint32_t height = cfg_.imgHeight;
+    const uint32_t spp = cfg_.spp;
+    const float sample_div = 1.f / float(spp);
+    const float aspect = float(width) / float(height);
+
+    const CPUEnvMapGroup::Map *env_map =
+        (cur_env_maps_ && !cur_env_maps_->maps.empty()) ?
+            &cur_env_maps_->maps[0] : nullptr;
+
+    constexpr uint32_t tile_size = CPUConfig::tile_size;
+    const uint32_t tiles_wide = (width + tile_size - 1) / tile_size;
+    const uint32_t tiles_tall = (height + tile_size - 1) / tile_size;
+    const uint32_t tiles_per_env = tiles_wide * tiles_tall;
+    const uint32_t num_tiles = tiles_per_env * num_active;
+
+    const uint32_t base_frame = frame_counter_;
+
+    auto renderTile = [&](uint32_t tile_idx) {
+        uint32_t batch_idx = active[tile_idx / tiles_per_env];
+        uint32_t env_tile = tile_idx % tiles_per_env;
+        uint32_t tile_x = (env_tile % tiles_wide) * tile_size;
+        uint32_t tile_y = (env_tile / tiles_wide) * tile_size;
+
+        const Environment &env = envs[batch_idx];
+        const Camera &cam = env.getCamera();
+
+        TraceContext ctx {
+            *static_cast<const CPUScene *>(env.getScene().get()),
+            *static_cast<const CPUEnvironment *>(env.getBackend()),
+            env.getInstances(),
+            env.getInstanceMaterials(),
+            env.getTransforms(),
+            env.getLightSampler(),
+            env_map,
+        };
+
+        glm::vec3 right = cam.right * aspect * cam.tanFOV;
+        glm::vec3 up = -cam.up * cam.tanFOV;
+
+        glm::vec3 aux_right = normalize(cam.right);
+        glm::vec3 aux_up = normalize(cam.up) * -1.f;
+        glm::vec3 aux_view = normalize(cam.view) * -1.f;
+
+        uint32_t end_x = min(tile_x + tile_size, width);
+        uint32_t end_y = min(tile_y + tile_size, height);
+
+        for (uint32_t y = tile_y; y < end_y; y++) {
+            for (uint32_t x = tile_x; x < end_x; x++) {
+                uint32_t pixel_idx = y * width + x;
+                uint64_t linear_idx =
+                    uint64_t(batch_idx) * height * width + pixel_idx;
+
+                glm::vec3 pixel_avg(0.f);
+                glm::vec3 aux_normal(0.f);
+                glm::vec3 aux_albedo(0.f);
+                uint32_t instance_id = 0xFFFF;
+
+                for (uint32_t sample_idx = 0; sample_idx < spp;
+                     sample_idx++) {
+                    PixelSampler rng(pixel_idx, sample_idx,
+                                     base_frame + batch_idx);
+
+                    glm::vec2 jitter = rng.get2D();
+                    glm::vec2 screen(
+                        (2.f * (x + jitter.x)) / width - 1.f,
+                        (2.f * (y + jitter.y)) / height - 1.f);
+
+                    glm::vec3 ray_dir = normalize(
+                        right * screen.x + up * screen.y + cam.view);
+
+                    glm::vec3 sample_radiance(0.f);
+
+                    RayHit primary_hit;
+                    if (!traceRay<false>(ctx, cam.position, ray_dir,
+                                         large_distance, &primary_hit)) {
+                        sample_radiance = evalEnvMap(env_map, ray_dir);
+                        instance_id = 0xFFFF;
+                        aux_albedo += sample_radiance * sample_div;
+                    } else {
+                        HitInfo hit = processHit(ctx, primary_hit, ray_dir);
+                        instance_id = primary_hit.instIdx;
+
+                        glm::vec3 view_normal(
+                            dot(aux_right, hit.tangentFrame.normal),
+                            dot(aux_up, hit.tangentFrame.normal),
+                            dot(aux_view, hit.tangentFrame.normal));
+                        float view_normal_len = length(view_normal);
+                        if (view_normal_len > 0.f) {
+                            view_normal /= view_normal_len;
+                        }
+                        aux_normal += view_normal * sample_div;
+                        aux_albedo += hit.material.rho * sample_div;
+
+                        PathVertexState primary = processPathVertex(
+                            rng, ctx, hit, ray_dir, true);
+
+                        sample_radiance = primary.radiance;
+
+                        if (primary.bounceWeight != glm::vec3(0.f)) {
+                            sample_radiance += primary.bounceWeight *
+                                indirectLighting(rng, ctx,
+                                    primary.bounceOrigin,
+                                    normalize(primary.bounceDir),
+                                    primary.bounceFlags, cfg_.maxDepth,
+                                    cfg_.clampThreshold);
+                        }
+                    }
+
+                    // A NaN or inf sample would poison the whole pixel
+                    if (isFinite(sample_radiance)) {
+                        pixel_avg += sample_radiance * sample_div;
+                    }
+                }
+
+                if (tonemap_) {
+                    float *hdr = batch_backend.hdr.data() + 4 * linear_idx;
+                    hdr[0] = pixel_avg.x;
+                    hdr[1] = pixel_avg.y;
+                    hdr[2] = pixel_avg.z;
+                    memcpy(hdr + 3, &instance_id, sizeof(uint32_t));
+                } else {
+                    uint16_t *out =
+                        batch_backend.output.data() + 4 * linear_idx;
+                    storeHalf3(out, pixel_avg);
+                    out[3] = uint16_t(instance_id);
+                }
+
+                if (aux_outputs_) {
+                    storeHalf3(batch_backend.normal.data() + 3 * linear_idx,
+                               aux_normal);
+                    storeHalf3(batch_backend.albedo.data() + 3 * linear_idx,
+                               aux_albedo);
+                }
+            }
+        }
+    };
+
+    // Tiles are claimed dynamically, costs vary a lot across the image
+    atomic_uint32_t next_tile(0);
+    pool_.run(num_tiles, [&](uint32_t, uint32_t) {
+        uint32_t tile_idx;
+        while ((tile_idx = next_tile.fetch_add(1, memory_order_relaxed)) <
+               num_tiles) {
+            renderTile(tile_idx);
+        }
+    }, 1);
+
+    if (tonemap_) {
+        // Same exposure histogram and operator as tonemap.comp, per image
+        const uint32_t num_pixels = width * height;
+        pool_.run(num_active, [&](uint32_t begin, uint32_t end) {
+            for (uint32_t i = begin; i < end; i++) {
+                uint64_t offset = uint64_t(active[i]) * num_pixels;
+                tonemapImage(batch_backend.hdr.data() + 4 * offset,
+                    num_pixels, reinterpret_cast<uint32_t *>(
+                        batch_backend.output.data() + 4 * offset));
+            }
+        }, 1);
+    }
+
+    frame_counter_ += cfg_.batchSize;
+}
+
+void CPUBackend::bake(RenderBatch &)
+{
+    cerr << "CPU backend: probe baking is not supported" << endl;
+    fatalExit();
+}
+
+void CPUBackend::waitForBatch(RenderBatch &)
+{}
+
+half *CPUBackend::getOutputPointer(RenderBatch &batch)
+{
+    auto &batch_backend = *static_cast<CPUBatch *>(batch.getBackend());
+
+    return reinterpret_cast<half *>(batch_backend.output.data());
+}
+
+half *CPUBackend::getBakeOutputPointer()
+{
+    return nullptr;
+}
+
+AuxiliaryOutputs CPUBackend::getAuxiliaryOutputs(RenderBatch &batch)
+{
+    auto &batch_backend = *static_cast<CPUBatch *>(batch.getBackend());
+
+    if (!aux_outputs_) {
+        return { nullptr, nullptr };
+    }
+
+    return {
+        reinterpret_cast<half *>(batch_backend.normal.data()),
+        reinterpret_cast<half *>(batch_backend.albedo.data()),
+    };
+}
+
+}
+}
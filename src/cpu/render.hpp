@@ -0,0 +1,79 @@
+#pragma once
+
+#include <rlpbr/config.hpp>
+#include <rlpbr/render.hpp>
+#include <rlpbr_core/batch_prep.hpp>
+#include <rlpbr_core/common.hpp>
+
+#include <memory>
+#include <vector>
+
+#include "raster.hpp"
+#include "scene.hpp"
+
+namespace RLpbr {
+namespace cpu {
+
+// Output buffers in the same layout as the GPU backends: 4 halves per
+// pixel (RGB + instance ID bits) and 3 per auxiliary pixel. With
+// RenderFlags::Tonemap the path tracer writes 4 floats per pixel to hdr,
+// which are then tonemapped into output.
+struct CPUBatch : public BatchBackend {
+    std::vector<uint16_t> output;
+    std::vector<uint16_t> normal;
+    std::vector<uint16_t> albedo;
+    std::vector<float> hdr;
+};
+
+// Probe baking needs the GPU bake pipeline
+struct CPUBaker : public BakerBackend {
+    void init();
+    void bake(RenderBatch &batch);
+};
+
+// Reference path tracer on the host. Follows pathtracer.comp with next
+// event estimation and no MIS. RenderMode::Rasterize uses Rasterizer
+// instead. Rendering is synchronous: render() returns once the batch's
+// outputs are written, waitForBatch() is a no-op.
+class CPUBackend : public RenderBackend {
+public:
+    CPUBackend(const RenderConfig &cfg);
+
+    LoaderImpl makeLoader();
+
+    EnvironmentImpl makeEnvironment(const std::shared_ptr<Scene> &scene,
+                                    const Camera &cam);
+
+    BakerImpl makeBaker();
+
+    void setActiveEnvironmentMaps(
+        std::shared_ptr<EnvironmentMapGroup> env_maps);
+
+    RenderBatch::Handle makeRenderBatch();
+
+    void render(RenderBatch &batch);
+
+    void bake(RenderBatch &batch);
+
+    void waitForBatch(RenderBatch &batch);
+
+    half *getOutputPointer(RenderBatch &batch);
+    half *getBakeOutputPointer();
+    AuxiliaryOutputs getAuxiliaryOutputs(RenderBatch &batch);
+
+private:
+    const RenderConfig cfg_;
+    const bool aux_outputs_;
+    const bool tonemap_;
+
+    // Environment updates and pixel tiles both run on these threads
+    BatchPrepPool pool_;
+
+    Rasterizer raster_;
+
+    std::shared_ptr<CPUEnvMapGroup> cur_env_maps_;
+    uint32_t frame_counter_;
+};
+
+}
+}
@@ -0,0 +1,441 @@
+#include "scene.hpp"
+
+#include <rlpbr_core/utils.hpp>
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <optional>
+
+using namespace std;
+
+namespace RLpbr {
+namespace cpu {
+
+CPUScene::CPUScene(Scene &&base, vector<char> &&scene_data,
+                   const StagingHeader &hdr,
+                   vector<ObjectAccel> &&object_accels)
+    : Scene(move(base)),
+      data(move(scene_data)),
+      vertices((const PackedVertex *)data.data()),
+      indices((const uint32_t *)(data.data() + hdr.indexOffset)),
+      materials((const MaterialParams *)(data.data() + hdr.materialOffset)),
+      objectAccels(move(object_accels))
+{}
+
+CPUEnvironment::CPUEnvironment(const CPUScene &scene)
+    : EnvironmentBackend {},
+      sceneLights(scene.envInit.lights),
+      lights(sceneLights.begin(), sceneLights.end()),
+      tlas(),
+      accelEpoch(~0ull)
+{}
+
+uint32_t CPUEnvironment::addLight(const glm::vec3 &position,
+                                  const glm::vec3 &color)
+{
+    lights.push_back(PointLight {
+        position,
+        color,
+    });
+
+    return lights.size() - 1;
+}
+
+uint32_t CPUEnvironment::addSceneLight(uint32_t scene_light_idx)
+{
+    lights.push_back(sceneLights[scene_light_idx]);
+
+    return lights.size() - 1;
+}
+
+void CPUEnvironment::removeLight(uint32_t idx)
+{
+    lights[idx] = lights.back();
+    lights.pop_back();
+}
+
+void CPUEnvironment::randomize(const RandomKey &)
+{
+    // No domain randomization on the host: env map 0, unrotated
+}
+
+// Same decisions as planEnvironmentTLAS in the vulkan backend, plus a
+// rebuild once refits degrade the tree too much
+void CPUEnvironment::updateAccel(const Environment &env)
+{
+    uint64_t epoch = env.getUpdateEpoch();
+    if (!env.isDirty() && epoch == accelEpoch) {
+        return;
+    }
+
+    const CPUScene &scene = *static_cast<const CPUScene *>(
+        env.getScene().get());
+    const ObjectAccel *objects = scene.objectAccels.data();
+
+    const EnvironmentUpdates &updates = env.getUpdates();
+    uint32_t num_instances = env.getNumInstances();
+
+    // Updates are relative to the last consumer of the environment, only
+    // usable if that was this TLAS
+    bool rebuild = updates.structural || epoch != accelEpoch ||
+        !tlas.canRefit(num_instances);
+
+    if (!rebuild) {
+        DirtyRange refit_range = updates.transforms;
+        refit_range.add(updates.flags.begin, updates.flags.end);
+
+        // Material only changes don't touch the TLAS
+        if (!refit_range.empty()) {
+            rebuild = !tlas.refit(objects, env.getInstances(),
+                                  env.getTransforms(),
+                                  env.getInstanceFlags(),
+                                  refit_range.begin, refit_range.end);
+        }
+    }
+
+    if (rebuild) {
+        tlas.build(objects, env.getInstances(), env.getTransforms(),
+                   env.getInstanceFlags(), num_instances);
+    }
+
+    env.clearDirty();
+    accelEpoch = env.getUpdateEpoch();
+}
+
+bool CPUEnvironment::traceRays(const Environment &env, const RayQuery *rays,
+                               uint32_t num_rays, RayQueryHit *hits)
+{
+    updateAccel(env);
+
+    const CPUScene &scene = *static_cast<const CPUScene *>(
+        env.getScene().get());
+    const CowArray<ObjectInstance> &instances = env.getInstances();
+    const CowArray<InstanceTransform> &transforms = env.getTransforms();
+
+    for (uint32_t base = 0; base < num_rays; base += rayPacketSize) {
+        uint32_t packet_size = min(num_rays - base, rayPacketSize);
+
+        RayHit packet_hits[rayPacketSize];
+        bool found[rayPacketSize];
+        tlas.tracePacket(scene.objectAccels.data(), instances, transforms,
+                         rays + base, packet_size, packet_hits, found);
+
+        for (uint32_t i = 0; i < packet_size; i++) {
+            const RayQuery &ray = rays[base + i];
+            RayQueryHit &out = hits[base + i];
+
+            if (!found[i]) {
+                out = RayQueryHit {
+                    ray.maxT,
+                    ~0u,
+                    0,
+                    0,
+                    glm::vec2(0.f),
+                    glm::vec3(0.f),
+                };
+
+                continue;
+            }
+
+            const RayHit &hit = packet_hits[i];
+            const ObjectInstance &inst = instances[hit.instIdx];
+            const glm::mat4x3 &o2w = transforms[hit.instIdx].mat;
+
+            uint32_t mesh_idx =
+                scene.objectInfo[inst.objectIndex].meshIndex + hit.geoIdx;
+            const MeshInfo &mesh = scene.meshInfo[mesh_idx];
+
+            const uint32_t *tri_indices =
+                scene.indices + mesh.indexOffset + 3 * hit.triIdx;
+            glm::vec3 a = o2w *
+                glm::vec4(scene.vertices[tri_indices[0]].position, 1.f);
+            glm::vec3 b = o2w *
+                glm::vec4(scene.vertices[tri_indices[1]].position, 1.f);
+            glm::vec3 c = o2w *
+                glm::vec4(scene.vertices[tri_indices[2]].position, 1.f);
+
+            glm::vec3 normal = glm::normalize(glm::cross(b - a, c - a));
+            if (glm::dot(normal, ray.direction) > 0.f) {
+                normal = -normal;
+            }
+
+            out = RayQueryHit {
+                hit.t,
+                env.getInstanceID(hit.instIdx),
+                mesh_idx,
+                hit.triIdx,
+                hit.barys,
+                normal,
+            };
+        }
+    }
+
+    return true;
+}
+
+bool CPUEnvironment::traceOcclusion(const Environment &env,
+                                    const RayQuery *rays, uint32_t num_rays,
+                                    uint8_t *occluded)
+{
+    updateAccel(env);
+
+    const CPUScene &scene = *static_cast<const CPUScene *>(
+        env.getScene().get());
+
+    for (uint32_t base = 0; base < num_rays; base += rayPacketSize) {
+        uint32_t packet_size = min(num_rays - base, rayPacketSize);
+
+        bool packet_occluded[rayPacketSize];
+        tlas.tracePacketOcclusion(scene.objectAccels.data(),
+                                  env.getInstances(), env.getTransforms(),
+                                  rays + base, packet_size, packet_occluded);
+
+        for (uint32_t i = 0; i < packet_size; i++) {
+            occluded[base + i] = packet_occluded[i];
+        }
+    }
+
+    return true;
+}
+
+CPULoader::CPULoader(uint32_t max_texture_resolution)
+    : LoaderBackend {},
+      max_texture_resolution_(max_texture_resolution)
+{}
+
+shared_ptr<Scene> CPULoader::loadScene(SceneLoadData &&load_info)
+{
+    PreparedScene scene {
+        move(load_info),
+        {},
+        nullptr,
+    };
+
+    stage(scene);
+
+    return upload(scene);
+}
+
+// The stored mesh BVHs under one root, primitive indices offset to the
+// object's triangle list. Nothing if the meshes don't fit in one node.
+static optional<BVH> mergeMeshBVHs(const BVH *mesh_bvhs,
+                                   const uint32_t *tri_offsets,
+                                   uint32_t num_meshes)
+{
+    uint32_t width = mesh_bvhs[0].width;
+
+    vector<uint32_t> nonempty;
+    for (uint32_t i = 0; i < num_meshes; i++) {
+        if (mesh_bvhs[i].width != width) {
+            return optional<BVH>();
+        }
+
+        if (!mesh_bvhs[i].empty()) {
+            nonempty.push_back(i);
+        }
+    }
+
+    BVH merged;
+    merged.width = width;
+
+    if (nonempty.size() > width) {
+        return optional<BVH>();
+    }
+
+    if (nonempty.empty()) {
+        return merged;
+    }
+
+    // With one mesh its root is the object's root
+    bool add_root = nonempty.size() > 1;
+    if (add_root) {
+        merged.children.resize(width, BVHChild {
+            glm::vec3(0.f),
+            0,
+            glm::vec3(0.f),
+            BVHChild::emptySlot,
+        });
+    }
+
+    for (uint32_t i = 0; i < nonempty.size(); i++) {
+        const BVH &mesh_bvh = mesh_bvhs[nonempty[i]];
+        uint32_t node_offset = merged.numNodes();
+        uint32_t prim_offset = merged.primIndices.size();
+
+        if (add_root) {
+            AABB bounds = mesh_bvh.getBounds();
+            merged.children[i] = BVHChild {
+                bounds.pMin,
+                node_offset,
+                bounds.pMax,
+                0,
+            };
+        }
+
+        for (BVHChild child : mesh_bvh.children) {
+            if (child.isLeaf()) {
+                child.offset += prim_offset;
+            } else if (!child.isEmpty()) {
+                child.offset += node_offset;
+            }
+
+            merged.children.push_back(child);
+        }
+
+        for (uint32_t prim_idx : mesh_bvh.primIndices) {
+            merged.primIndices.push_back(
+                tri_offsets[nonempty[i]] + prim_idx);
+        }
+    }
+
+    return merged;
+}
+
+static ObjectAccel buildObjectAccel(const ObjectInfo &obj,
+                                    const MeshInfo *meshes,
+                                    const PackedVertex *vertices,
+                                    const uint32_t *indices,
+                                    const BVH *mesh_bvhs)
+{
+    ObjectAccel accel;
+    vector<AABB> tri_bounds;
+    vector<uint32_t> tri_offsets;
+
+    for (uint32_t geo_idx = 0; geo_idx < obj.numMeshes; geo_idx++) {
+        const MeshInfo &mesh = meshes[obj.meshIndex + geo_idx];
+        tri_offsets.push_back(accel.triangles.size());
+
+        for (uint32_t tri_idx = 0; tri_idx < mesh.numTriangles; tri_idx++) {
+            const uint32_t *tri_indices =
+                indices + mesh.indexOffset + 3 * tri_idx;
+
+            glm::vec3 a = vertices[tri_indices[0]].position;
+            glm::vec3 b = vertices[tri_indices[1]].position;
+            glm::vec3 c = vertices[tri_indices[2]].position;
+
+            accel.triangles.push_back({
+                a,
+                b - a,
+                c - a,
+                geo_idx,
+                tri_idx,
+            });
+
+            tri_bounds.push_back({
+                glm::min(a, glm::min(b, c)),
+                glm::max(a, glm::max(b, c)),
+            });
+        }
+    }
+
+    optional<BVH> stored;
+    if (mesh_bvhs != nullptr && obj.numMeshes > 0) {
+        stored = mergeMeshBVHs(mesh_bvhs + obj.meshIndex, tri_offsets.data(),
+                               obj.numMeshes);
+    }
+
+    if (stored.has_value()) {
+        accel.bvh = move(*stored);
+    } else {
+        accel.bvh = BVH::build(tri_bounds.data(), tri_bounds.size());
+    }
+
+    return accel;
+}
+
+void CPULoader::stage(PreparedScene &scene)
+{
+    SceneLoadData &load_info = scene.loadData;
+    const StagingHeader &hdr = load_info.hdr;
+
+    // Textures aren't requested (needsDecodedTextures)
+    scene.textures.clear();
+
+    auto staged = make_unique<CPUStagedScene>();
+    staged->data.resize(hdr.totalBytes);
+    load_info.readData(staged->data.data());
+
+    const char *data = staged->data.data();
+    auto vertices = (const PackedVertex *)data;
+    auto indices = (const uint32_t *)(data + hdr.indexOffset);
+
+    load_info.envInit.lightSampling = LightSamplerInit(computeLightPowers(
+        load_info.envInit.lights, vertices, indices,
+        (const MaterialParams *)(data + hdr.materialOffset)));
+
+    vector<BVH> mesh_bvhs = load_info.readMeshBVHs();
+
+    staged->objectAccels.reserve(load_info.objectInfo.size());
+    for (const ObjectInfo &obj : load_info.objectInfo) {
+        staged->objectAccels.push_back(buildObjectAccel(obj,
+            load_info.meshInfo.data(), vertices, indices,
+            mesh_bvhs.empty() ? nullptr : mesh_bvhs.data()));
+    }
+
+    scene.staged = move(staged);
+}
+
+shared_ptr<Scene> CPULoader::upload(PreparedScene &scene)
+{
+    SceneLoadData &load_info = scene.loadData;
+    CPUStagedScene &staged =
+        *static_cast<CPUStagedScene *>(scene.staged.get());
+
+    return make_shared<CPUScene>(
+        Scene {
+            move(load_info.meshInfo),
+            move(load_info.objectInfo),
+            move(load_info.envInit),
+            load_info.hdr.numMaterials,
+        },
+        move(staged.data),
+        load_info.hdr,
+        move(staged.objectAccels));
+}
+
+uint32_t CPULoader::getMaxTextureResolution() const
+{
+    return max_texture_resolution_;
+}
+
+// Only the top mip of the first section (the radiance map) is used, see
+// loadEnvironmentMapsFromDisk in the vulkan backend for the layout
+shared_ptr<EnvironmentMapGroup> CPULoader::loadEnvironmentMaps(
+    const char **paths, uint32_t num_paths)
+{
+    constexpr uint64_t section_header_bytes =
+        3 * sizeof(uint32_t) + sizeof(uint64_t);
+
+    auto group = make_shared<CPUEnvMapGroup>();
+    group->maps.reserve(num_paths);
+
+    for (uint32_t i = 0; i < num_paths; i++) {
+        ifstream file(paths[i], ios::binary);
+
+        char header[section_header_bytes];
+        file.read(header, section_header_bytes);
+
+        uint32_t width, height;
+        memcpy(&width, header + sizeof(uint32_t), sizeof(uint32_t));
+        memcpy(&height, header + 2 * sizeof(uint32_t), sizeof(uint32_t));
+
+        CPUEnvMapGroup::Map &map = group->maps.emplace_back();
+        map.width = width;
+        map.height = height;
+        map.texels.resize(uint64_t(width) * height);
+
+        file.read((char *)map.texels.data(),
+                  map.texels.size() * sizeof(glm::vec4));
+
+        if (!file) {
+            cerr << "Failed to read environment map " << paths[i] << endl;
+            fatalExit();
+        }
+    }
+
+    return group;
+}
+
+}
+}
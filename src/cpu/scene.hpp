@@ -0,0 +1,113 @@
+#pragma once
+
+#include <rlpbr_core/common.hpp>
+#include <rlpbr_core/load_pipeline.hpp>
+#include <rlpbr_core/scene.hpp>
+
+#include <glm/glm.hpp>
+
+#include <variant>
+#include <vector>
+
+#include "accel.hpp"
+
+namespace RLpbr {
+namespace cpu {
+
+struct CPUScene : public Scene {
+    CPUScene(Scene &&base, std::vector<char> &&data,
+             const StagingHeader &hdr,
+             std::vector<ObjectAccel> &&object_accels);
+    CPUScene(const CPUScene &) = delete;
+
+    // Geometry and materials in the staged layout, the pointers below
+    // point into it
+    std::vector<char> data;
+    const PackedVertex *vertices;
+    const uint32_t *indices;
+    const MaterialParams *materials;
+
+    std::vector<ObjectAccel> objectAccels;
+};
+
+struct CPUEnvMapGroup : public EnvironmentMapGroup {
+    // Top mip level of each map, RGBA32F lat-long
+    struct Map {
+        uint32_t width;
+        uint32_t height;
+        std::vector<glm::vec4> texels;
+    };
+
+    std::vector<Map> maps;
+};
+
+// Lights added through Environment::addLight
+struct PointLight {
+    glm::vec3 position;
+    glm::vec3 color;
+};
+
+// Same order as the environment's LightSampler
+using CPULight = std::variant<LightProperties, PointLight>;
+
+struct CPUEnvironment : public EnvironmentBackend {
+    CPUEnvironment(const CPUScene &scene);
+    CPUEnvironment(const CPUEnvironment &) = delete;
+
+    uint32_t addLight(const glm::vec3 &position, const glm::vec3 &color);
+    uint32_t addSceneLight(uint32_t scene_light_idx);
+
+    void removeLight(uint32_t light_idx);
+
+    void randomize(const RandomKey &key);
+
+    // Refits or rebuilds the TLAS if the environment changed since the
+    // last call, following the vulkan backend's rules. Safe to call
+    // concurrently for different environments.
+    void updateAccel(const Environment &env);
+
+    // Rays are traced in packets of rayPacketSize on the calling thread
+    bool traceRays(const Environment &env, const RayQuery *rays,
+                   uint32_t num_rays, RayQueryHit *hits);
+    bool traceOcclusion(const Environment &env, const RayQuery *rays,
+                        uint32_t num_rays, uint8_t *occluded);
+
+    const std::vector<LightProperties> &sceneLights;
+    std::vector<CPULight> lights;
+
+    TLAS tlas;
+    // Update epoch of the environment when tlas was last updated
+    uint64_t accelEpoch;
+};
+
+struct CPUStagedScene : public StagedScene {
+    std::vector<char> data;
+    std::vector<ObjectAccel> objectAccels;
+};
+
+class CPULoader : public LoaderBackend, public SceneUploadSink {
+public:
+    CPULoader(uint32_t max_texture_resolution);
+
+    std::shared_ptr<Scene> loadScene(SceneLoadData &&load_info);
+
+    std::shared_ptr<EnvironmentMapGroup> loadEnvironmentMaps(
+        const char **paths, uint32_t num_paths);
+
+    // Reads the geometry and the mesh BVHs stored in the scene, object
+    // BVHs are only built for scenes without them
+    void stage(PreparedScene &scene) override;
+    std::shared_ptr<Scene> upload(PreparedScene &scene) override;
+
+    // Materials are untextured on the host
+    bool needsDecodedTextures() const override { return false; }
+    uint32_t getMaxTextureResolution() const override;
+
+    SceneUploadSink *getUploadSink() { return this; }
+
+private:
+    uint32_t max_texture_resolution_;
+};
+
+}
+}
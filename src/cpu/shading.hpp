@@ -0,0 +1,124 @@
+#pragma once
+
+#include <rlpbr_core/scene.hpp>
+#include <rlpbr_core/shading.hpp>
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+
+namespace RLpbr {
+namespace cpu {
+
+// Host versions of the shader functions the CPU backend needs, kept in the
+// same order and with the same names as the GLSL (bsdf.glsl, utils.glsl,
+// geometry.glsl, materials.glsl) so the two can be diffed against each
+// other. The scalar GGX, Fresnel and light math isn't copied, it comes from
+// rlpbr_core/shading.h like in the shaders. Material textures and the
+// multiple scattering lookup tables are not available on the host: texture
+// flags are ignored and the diffuse lobe is plain Lambertian.
+
+constexpr float NearZero = 1e-6f;
+constexpr float ShadingMinAlpha = 0.0064f;
+
+// BSDFFlags "enum"
+constexpr uint32_t BSDFFlagsInvalid = 1 << 0;
+constexpr uint32_t BSDFFlagsDelta = 1 << 1;
+constexpr uint32_t BSDFFlagsDiffuse = 1 << 2;
+constexpr uint32_t BSDFFlagsMicrofacetReflection = 1 << 3;
+constexpr uint32_t BSDFFlagsMicrofacetTransmission = 1 << 4;
+
+struct Material {
+    glm::vec3 rho;
+    float transmission;
+    glm::vec3 rhoSpecular;
+    float specularScale;
+    float ior;
+    float metallic;
+    float roughness;
+    glm::vec3 emittance;
+};
+
+struct BSDFParams {
+    glm::vec3 rhoDiffuse;
+    glm::vec3 rhoTransmissive;
+    glm::vec3 sharedF0;
+    float sharedF90;
+    glm::vec3 transmissiveF0;
+    float transmissiveF90;
+    float alpha;
+
+    float diffuseProb;
+    float microfacetProb;
+    float transmissionProb;
+};
+
+struct SampleResult {
+    glm::vec3 dir;
+    glm::vec3 weight;
+    uint32_t flags;
+};
+
+struct TangentFrame {
+    glm::vec3 tangent;
+    glm::vec3 bitangent;
+    glm::vec3 normal;
+};
+
+// materials.glsl: unpackMaterialParams + processMaterial without textures
+inline Material unpackMaterial(const MaterialParams &params);
+inline glm::vec3 getMaterialEmittance(const MaterialParams &params);
+
+inline BSDFParams buildBSDF(const Material &material, const glm::vec3 &wo);
+
+// Includes the cosine term, like the shaders
+inline glm::vec3 evalBSDF(const BSDFParams &params, const glm::vec3 &wo,
+                          const glm::vec3 &wi, float &pdf);
+inline float pdfBSDF(const BSDFParams &params, const glm::vec3 &wo,
+                     const glm::vec3 &wi);
+
+// selector picks the lobe, uv samples it
+inline SampleResult sampleBSDF(const BSDFParams &params, const glm::vec3 &wo,
+                               float selector, const glm::vec2 &uv);
+
+// Vertex attributes packed by the preprocessor
+inline void decodeNormalTangent(const PackedVertex &vert, glm::vec3 &normal,
+                                glm::vec4 &tangent_and_sign);
+
+// Object space shading frame at barys of the triangle abc
+inline TangentFrame computeTangentFrame(const PackedVertex &a,
+                                        const PackedVertex &b,
+                                        const PackedVertex &c,
+                                        const glm::vec2 &barys);
+
+// geo_normal must already face the outgoing direction
+inline TangentFrame tangentFrameToWorld(const glm::mat4x3 &o2w,
+                                        const glm::mat4x3 &w2o,
+                                        const TangentFrame &frame,
+                                        const glm::vec3 &geo_normal);
+
+inline glm::vec3 worldToLocalIncoming(const glm::vec3 &v,
+                                      const TangentFrame &frame);
+inline glm::vec3 worldToLocalOutgoing(const glm::vec3 &v,
+                                      const TangentFrame &frame);
+inline glm::vec3 localToWorld(const glm::vec3 &v, const TangentFrame &frame);
+
+inline glm::vec3 transformPosition(const glm::mat4x3 &o2w,
+                                   const glm::vec3 &p);
+inline glm::vec3 transformVector(const glm::mat4x3 &o2w, const glm::vec3 &v);
+inline glm::vec3 transformNormal(const glm::mat4x3 &w2o, const glm::vec3 &n);
+
+// Moves o off the surface with normal geo_normal, see Ray Tracing Gems
+// chapter 6, "A Fast and Robust Method for Avoiding Self-Intersection"
+inline glm::vec3 offsetRayOrigin(const glm::vec3 &o,
+                                 const glm::vec3 &geo_normal);
+
+inline glm::vec3 concentricHemisphere(const glm::vec2 &uv);
+inline glm::vec3 sampleSphereUniform(const glm::vec2 &uv);
+inline glm::vec3 getOrthogonalVec(const glm::vec3 &v);
+inline glm::vec2 dirToLatLong(const glm::vec3 &dir);
+
+}
+}
+
+#include "shading.inl"
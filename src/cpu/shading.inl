@@ -0,0 +1,626 @@
+#pragma once
+
+#include <glm/gtc/packing.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace RLpbr {
+namespace cpu {
+
+namespace ShadingHelpers {
+
+constexpr float pi = M_PI;
+constexpr float invPi = M_1_PI;
+
+inline float unpackUnorm8(uint8_t v)
+{
+    return float(v) / 255.f;
+}
+
+inline float inversesqrt(float v)
+{
+    return 1.f / sqrtf(v);
+}
+
+using Shader::ggxG1;
+using Shader::ggxLambda;
+using Shader::ggxMasking;
+using Shader::ggxNDF;
+
+template <typename T>
+inline T computeFresnel(T f0, T f90, float cos_theta)
+{
+    return f0 + (f90 - f0) * Shader::fresnelWeight(cos_theta);
+}
+
+inline glm::vec3 evalGGX(float wo_dot_n, float wi_dot_n, float n_dot_h,
+                         const glm::vec3 &F, float alpha, float &pdf)
+{
+    float a2 = alpha * alpha;
+    float D = ggxNDF(a2, n_dot_h);
+    float G = ggxMasking(a2, wo_dot_n, wi_dot_n);
+
+    float common_weight = 0.25f * D / wo_dot_n;
+    glm::vec3 specular = common_weight * F * G;
+    pdf = common_weight * ggxG1(wo_dot_n, a2);
+
+    if (alpha == 0.f || std::min(wo_dot_n, wi_dot_n) < NearZero) {
+        specular = glm::vec3(0.f);
+        pdf = 0.f;
+    }
+
+    return specular;
+}
+
+// Half vector terms without normalizing wo + wi (Hammon 2017)
+inline void halfVectorTerms(const glm::vec3 &wo, const glm::vec3 &wi,
+                            float &n_dot_h, float &dir_dot_h)
+{
+    float wi_dot_wo = dot(wo, wi);
+
+    float len_sq_io = 2.f + 2.f * wi_dot_wo;
+    float rlen_io = inversesqrt(len_sq_io);
+
+    n_dot_h = (wo.z + wi.z) * rlen_io;
+    dir_dot_h = rlen_io + rlen_io * wi_dot_wo;
+}
+
+inline glm::vec3 diffuseBSDF(const BSDFParams &params, float wo_dot_n,
+                             float wi_dot_n, float &pdf)
+{
+    if (std::min(wo_dot_n, wi_dot_n) < NearZero) {
+        pdf = 0.f;
+        return glm::vec3(0.f);
+    }
+
+    pdf = invPi * wi_dot_n;
+    return params.rhoDiffuse * pdf;
+}
+
+inline glm::vec3 microfacetBSDF(const BSDFParams &params, float wo_dot_n,
+                                float wi_dot_n, float n_dot_h,
+                                float dir_dot_h, float &pdf)
+{
+    glm::vec3 F = computeFresnel(params.sharedF0, glm::vec3(params.sharedF90),
+                                 dir_dot_h);
+
+    return evalGGX(wo_dot_n, wi_dot_n, n_dot_h, F, params.alpha, pdf);
+}
+
+inline glm::vec3 microfacetTransmissiveBSDF(const BSDFParams &params,
+                                            const glm::vec3 &wo,
+                                            glm::vec3 wi, float &pdf)
+{
+    wi.z *= -1.f;
+
+    float n_dot_h, dir_dot_h;
+    halfVectorTerms(wo, wi, n_dot_h, dir_dot_h);
+
+    glm::vec3 F = 1.f - computeFresnel(params.transmissiveF0,
+                                       glm::vec3(params.transmissiveF90),
+                                       dir_dot_h);
+
+    glm::vec3 microfacet_response = evalGGX(wo.z, wi.z,
+        n_dot_h, F, params.alpha, pdf);
+
+    return microfacet_response * params.rhoTransmissive;
+}
+
+inline float diffusePDF(float wi_dot_n)
+{
+    if (wi_dot_n < NearZero) {
+        return 0.f;
+    } else {
+        return invPi * wi_dot_n;
+    }
+}
+
+inline float microfacetPDF(const BSDFParams &params, float wo_dot_n,
+                           float wi_dot_n, float n_dot_h, float dir_dot_h)
+{
+    float a2 = params.alpha * params.alpha;
+    float D = ggxNDF(a2, n_dot_h);
+    float G1 = ggxG1(wo_dot_n, a2);
+
+    float pdf = 0.25f * D * G1 / wo_dot_n;
+
+    if (dir_dot_h <= 0.f || params.alpha == 0.f ||
+        std::min(wo_dot_n, wi_dot_n) < NearZero) {
+        pdf = 0.f;
+    }
+
+    return pdf;
+}
+
+inline float microfacetTransmissivePDF(const BSDFParams &params,
+                                       const glm::vec3 &wo, glm::vec3 wi)
+{
+    wi.z *= -1.f;
+
+    float n_dot_h, dir_dot_h;
+    halfVectorTerms(wo, wi, n_dot_h, dir_dot_h);
+
+    return microfacetPDF(params, wo.z, wi.z, n_dot_h, dir_dot_h);
+}
+
+inline glm::vec3 sampleGGX(float alpha, const glm::vec3 &wo,
+                           const glm::vec2 &sample_uv)
+{
+    glm::vec3 Vh = normalize(glm::vec3(alpha * wo.x, alpha * wo.y, wo.z));
+
+    // Construct orthonormal basis (Vh,T1,T2).
+    glm::vec3 T1 = (Vh.z < 0.9999f) ?
+        normalize(cross(glm::vec3(0.f, 0.f, 1.f), Vh)) :
+        glm::vec3(1.f, 0.f, 0.f);
+
+    glm::vec3 T2 = cross(Vh, T1);
+
+    float r = sqrtf(sample_uv.x);
+    float phi = (2.f * pi) * sample_uv.y;
+    float t1 = r * cosf(phi);
+    float t2 = r * sinf(phi);
+    float s = 0.5f * (1.f + Vh.z);
+    t2 = (1.f - s) * sqrtf(1.f - t1 * t1) + s * t2;
+
+    glm::vec3 Nh = t1 * T1 + t2 * T2 +
+        sqrtf(std::max(0.f, 1.f - t1 * t1 - t2 * t2)) * Vh;
+    glm::vec3 h = normalize(glm::vec3(alpha * Nh.x, alpha * Nh.y,
+                                      std::max(0.f, Nh.z)));
+
+    return h;
+}
+
+inline SampleResult sampleMicrofacet(const glm::vec3 &wo,
+                                     const glm::vec2 &sample_uv,
+                                     const glm::vec3 &F0,
+                                     const glm::vec3 &F90, float alpha,
+                                     bool transmission)
+{
+    SampleResult result {
+        glm::vec3(0.f),
+        glm::vec3(0.f),
+        0,
+    };
+
+    if (wo.z < NearZero) {
+        result.flags |= BSDFFlagsInvalid;
+    } else if (alpha == 0.f) {
+        result.dir = glm::vec3(-wo.x, -wo.y, wo.z);
+        glm::vec3 F = computeFresnel(F0, F90, wo.z);
+        if (transmission) {
+            result.weight = 1.f - F;
+        } else {
+            result.weight = F;
+        }
+
+        result.flags |= BSDFFlagsDelta;
+    } else {
+        glm::vec3 h = sampleGGX(alpha, wo, sample_uv);
+        float cos_half_out = dot(wo, h);
+        glm::vec3 wi = 2.f * cos_half_out * h - wo;
+        result.dir = wi;
+
+        float a2 = alpha * alpha;
+
+        float G = ggxMasking(a2, wo.z, wi.z);
+        float GG1_out = G * (1.f + ggxLambda(wo.z, a2));
+        glm::vec3 F = computeFresnel(F0, F90, cos_half_out);
+
+        if (wi.z >= NearZero) {
+            if (transmission) {
+                result.weight = (1.f - F) * GG1_out;
+            } else {
+                result.weight = F * GG1_out;
+            }
+        }
+
+        if (transmission) {
+            result.flags |= BSDFFlagsMicrofacetTransmission;
+        } else {
+            result.flags |= BSDFFlagsMicrofacetReflection;
+        }
+    }
+
+    return result;
+}
+
+inline SampleResult sampleDiffuse(const BSDFParams &params,
+                                  const glm::vec3 &wo,
+                                  const glm::vec2 &sample_uv)
+{
+    glm::vec3 wi = concentricHemisphere(sample_uv);
+
+    glm::vec3 weight = std::min(wo.z, wi.z) < NearZero ?
+        glm::vec3(0.f) : params.rhoDiffuse;
+
+    return SampleResult {
+        wi,
+        weight,
+        BSDFFlagsDiffuse,
+    };
+}
+
+inline glm::vec3 octahedralVectorDecode(glm::vec2 f)
+{
+    f = f * 2.f - 1.f;
+    glm::vec3 n(f.x, f.y, 1.f - fabsf(f.x) - fabsf(f.y));
+    float t = std::clamp(-n.z, 0.f, 1.f);
+    n.x += n.x >= 0.f ? -t : t;
+    n.y += n.y >= 0.f ? -t : t;
+    return normalize(n);
+}
+
+inline float signOf(float v)
+{
+    return v > 0.f ? 1.f : (v < 0.f ? -1.f : 0.f);
+}
+
+}
+
+Material unpackMaterial(const MaterialParams &params)
+{
+    using namespace ShadingHelpers;
+
+    glm::vec3 base_color(unpackUnorm8(params.baseColor.x),
+                         unpackUnorm8(params.baseColor.y),
+                         unpackUnorm8(params.baseColor.z));
+
+    return Material {
+        base_color * base_color,
+        unpackUnorm8(params.baseTransmission),
+        glm::vec3(glm::unpackHalf1x16(params.baseSpecular.x),
+                  glm::unpackHalf1x16(params.baseSpecular.y),
+                  glm::unpackHalf1x16(params.baseSpecular.z)),
+        unpackUnorm8(params.specularScale),
+        float(params.ior) / 170.f + 1.f,
+        unpackUnorm8(params.baseMetallic),
+        unpackUnorm8(params.baseRoughness),
+        getMaterialEmittance(params),
+    };
+}
+
+glm::vec3 getMaterialEmittance(const MaterialParams &params)
+{
+    if (!(params.flags & uint16_t(MaterialFlags::Complex))) {
+        return glm::vec3(0.f);
+    }
+
+    return glm::vec3(glm::unpackHalf1x16(params.baseEmittance.x),
+                     glm::unpackHalf1x16(params.baseEmittance.y),
+                     glm::unpackHalf1x16(params.baseEmittance.z));
+}
+
+BSDFParams buildBSDF(const Material &material, const glm::vec3 &wo)
+{
+    using namespace ShadingHelpers;
+
+    const float prior_ior = 1.f;
+    float ior_ratio = (material.ior - prior_ior) / (material.ior + prior_ior);
+    float base_f0 = ior_ratio * ior_ratio;
+
+    glm::vec3 dielectric_f0 = glm::min(glm::vec3(1.f), base_f0 *
+        material.rhoSpecular) * material.specularScale;
+    float dielectric_f90 = material.specularScale;
+
+    // Core weights
+    float transmission_weight = material.transmission;
+    float opaque_weight = (1.f - material.transmission);
+    float dielectric_weight = (1.f - material.metallic);
+
+    glm::vec3 base_dielectric = material.rho * dielectric_weight;
+
+    // Microfacet params
+    // Scale between specular and metallic fresnel
+    glm::vec3 shared_f0 = glm::mix(material.rho, dielectric_f0,
+                                   dielectric_weight);
+    float shared_f90 = dielectric_weight * dielectric_f90 + material.metallic;
+
+    glm::vec3 ss_fresnel_estimate =
+        computeFresnel(shared_f0, glm::vec3(shared_f90), wo.z);
+    glm::vec3 ss_transmissive_fresnel_estimate =
+        1.f - computeFresnel(dielectric_f0, glm::vec3(dielectric_f90), wo.z);
+
+    float alpha = material.roughness * material.roughness;
+    if (alpha < ShadingMinAlpha) {
+        alpha = 0;
+    }
+
+    // Compute importance sampling weights
+    float dielectric_luminance = rgbLuminance(base_dielectric);
+    float diffuse_prob = dielectric_luminance * opaque_weight;
+    float microfacet_prob = rgbLuminance(ss_fresnel_estimate);
+    float transmission_prob = dielectric_luminance * transmission_weight *
+        rgbLuminance(ss_transmissive_fresnel_estimate);
+
+    float prob_sum = diffuse_prob + microfacet_prob + transmission_prob;
+
+    float inv_prob = prob_sum > 0.f ? 1.f / prob_sum : 0.f;
+    diffuse_prob *= inv_prob;
+    microfacet_prob *= inv_prob;
+    transmission_prob *= inv_prob;
+
+    return BSDFParams {
+        base_dielectric * opaque_weight,
+        base_dielectric * transmission_weight,
+        shared_f0,
+        shared_f90,
+        dielectric_f0,
+        dielectric_f90,
+        alpha,
+        diffuse_prob,
+        microfacet_prob,
+        transmission_prob,
+    };
+}
+
+glm::vec3 evalBSDF(const BSDFParams &params, const glm::vec3 &wo,
+                   const glm::vec3 &wi, float &pdf)
+{
+    using namespace ShadingHelpers;
+
+    float n_dot_h, dir_dot_h;
+    halfVectorTerms(wo, wi, n_dot_h, dir_dot_h);
+
+    float diffuse_pdf;
+    glm::vec3 diffuse = diffuseBSDF(params, wo.z, wi.z, diffuse_pdf);
+
+    float microfacet_pdf;
+    glm::vec3 microfacet =
+        microfacetBSDF(params, wo.z, wi.z, n_dot_h, dir_dot_h, microfacet_pdf);
+
+    float transmissive_pdf;
+    glm::vec3 transmissive =
+        microfacetTransmissiveBSDF(params, wo, wi, transmissive_pdf);
+
+    pdf = params.diffuseProb * diffuse_pdf +
+          params.microfacetProb * microfacet_pdf +
+          params.transmissionProb * transmissive_pdf;
+
+    return diffuse + microfacet + transmissive;
+}
+
+float pdfBSDF(const BSDFParams &params, const glm::vec3 &wo,
+              const glm::vec3 &wi)
+{
+    using namespace ShadingHelpers;
+
+    float n_dot_h, dir_dot_h;
+    halfVectorTerms(wo, wi, n_dot_h, dir_dot_h);
+
+    float diffuse = diffusePDF(wi.z);
+    float microfacet = microfacetPDF(params, wo.z, wi.z, n_dot_h, dir_dot_h);
+    float transmissive = microfacetTransmissivePDF(params, wo, wi);
+
+    return params.diffuseProb * diffuse +
+        params.microfacetProb * microfacet +
+        params.transmissionProb * transmissive;
+}
+
+SampleResult sampleBSDF(const BSDFParams &params, const glm::vec3 &wo,
+                        float selector, const glm::vec2 &uv)
+{
+    using namespace ShadingHelpers;
+
+    float cdf[] = {
+        params.diffuseProb,
+        params.microfacetProb,
+        params.transmissionProb,
+    };
+
+    cdf[1] += cdf[0];
+    cdf[2] += cdf[1];
+
+    SampleResult result {
+        glm::vec3(0.f),
+        glm::vec3(0.f),
+        BSDFFlagsInvalid,
+    };
+
+    if (selector < cdf[0]) {
+        result = sampleDiffuse(params, wo, uv);
+        result.weight /= params.diffuseProb;
+    } else if (selector < cdf[1]) {
+        result = sampleMicrofacet(wo, uv, params.sharedF0,
+            glm::vec3(params.sharedF90), params.alpha, false);
+        result.weight /= params.microfacetProb;
+    } else if (selector < cdf[2]) {
+        result = sampleMicrofacet(wo, uv, params.transmissiveF0,
+            glm::vec3(params.transmissiveF90), params.alpha, true);
+        result.dir.z *= -1.f;
+        result.weight *= params.rhoTransmissive / params.transmissionProb;
+    }
+
+    return result;
+}
+
+void decodeNormalTangent(const PackedVertex &vert, glm::vec3 &normal,
+                         glm::vec4 &tangent_and_sign)
+{
+    uint32_t packed[3];
+    memcpy(packed, &vert.normalTangentPacked, sizeof(packed));
+
+    glm::vec2 ab = glm::unpackHalf2x16(packed[0]);
+    glm::vec2 cd = glm::unpackHalf2x16(packed[1]);
+
+    normal = glm::vec3(ab.x, ab.y, cd.x);
+    float sign = cd.y;
+
+    glm::vec2 oct_tan = glm::unpackSnorm2x16(packed[2]);
+    glm::vec3 tangent = ShadingHelpers::octahedralVectorDecode(oct_tan);
+
+    tangent_and_sign = glm::vec4(tangent, sign);
+}
+
+TangentFrame computeTangentFrame(const PackedVertex &a,
+                                 const PackedVertex &b,
+                                 const PackedVertex &c,
+                                 const glm::vec2 &barys)
+{
+    glm::vec3 na, nb, nc;
+    glm::vec4 ta, tb, tc;
+    decodeNormalTangent(a, na, ta);
+    decodeNormalTangent(b, nb, tb);
+    decodeNormalTangent(c, nc, tc);
+
+    glm::vec3 n = na + barys.x * (nb - na) + barys.y * (nc - na);
+    glm::vec4 combined = ta + barys.x * (tb - ta) + barys.y * (tc - ta);
+
+    glm::vec3 t(combined.x, combined.y, combined.z);
+
+    // Need to extend to 1 or -1 (or 0) since interpolation can produce
+    // something in between
+    float bitangent_sign = ShadingHelpers::signOf(combined.w);
+
+    // No normal maps on the host, so the perturbed normal is n itself
+    n = normalize(n);
+
+    float n_d_t = dot(n, t);
+
+    if (n_d_t > 0.9999f || bitangent_sign == 0.f) {
+        bitangent_sign = 1.f;
+        t = normalize(getOrthogonalVec(n));
+    } else {
+        // Make tangent perpendicular to the normal
+        t = normalize(t - n * n_d_t);
+    }
+
+    return TangentFrame {
+        t,
+        cross(n, t) * bitangent_sign,
+        n,
+    };
+}
+
+TangentFrame tangentFrameToWorld(const glm::mat4x3 &o2w,
+                                 const glm::mat4x3 &w2o,
+                                 const TangentFrame &frame,
+                                 const glm::vec3 &geo_normal)
+{
+    TangentFrame world {
+        normalize(transformVector(o2w, frame.tangent)),
+        normalize(transformVector(o2w, frame.bitangent)),
+        normalize(transformNormal(w2o, frame.normal)),
+    };
+
+    // Flip based on the geo normal (already aligned with the outgoing
+    // vector) rather than the ray, see geometry.glsl
+    if (dot(world.normal, geo_normal) < 0.f) {
+        world.tangent *= -1.f;
+        world.bitangent *= -1.f;
+        world.normal *= -1.f;
+    }
+
+    return world;
+}
+
+glm::vec3 worldToLocalIncoming(const glm::vec3 &v, const TangentFrame &frame)
+{
+    return glm::vec3(dot(v, frame.tangent), dot(v, frame.bitangent),
+                     dot(v, frame.normal));
+}
+
+glm::vec3 worldToLocalOutgoing(const glm::vec3 &v, const TangentFrame &frame)
+{
+    return glm::vec3(dot(v, frame.tangent), dot(v, frame.bitangent),
+                     fabsf(dot(v, frame.normal)) + 1e-5f);
+}
+
+glm::vec3 localToWorld(const glm::vec3 &v, const TangentFrame &frame)
+{
+    return v.x * frame.tangent + v.y * frame.bitangent +
+        v.z * frame.normal;
+}
+
+glm::vec3 transformPosition(const glm::mat4x3 &o2w, const glm::vec3 &p)
+{
+    return o2w[0] * p.x + o2w[1] * p.y + o2w[2] * p.z + o2w[3];
+}
+
+glm::vec3 transformVector(const glm::mat4x3 &o2w, const glm::vec3 &v)
+{
+    return o2w[0] * v.x + o2w[1] * v.y + o2w[2] * v.z;
+}
+
+glm::vec3 transformNormal(const glm::mat4x3 &w2o, const glm::vec3 &n)
+{
+    return glm::vec3(dot(w2o[0], n), dot(w2o[1], n), dot(w2o[2], n));
+}
+
+glm::vec3 offsetRayOrigin(const glm::vec3 &o, const glm::vec3 &geo_normal)
+{
+    constexpr float global_origin = 1.f / 32.f;
+    constexpr float float_scale = 1.f / 65536.f;
+    constexpr float int_scale = 256.f;
+
+    glm::vec3 result;
+    for (int i = 0; i < 3; i++) {
+        if (fabsf(o[i]) < global_origin) {
+            result[i] = o[i] + float_scale * geo_normal[i];
+            continue;
+        }
+
+        int32_t int_offset = int32_t(geo_normal[i] * int_scale);
+        int32_t bits;
+        memcpy(&bits, &o[i], sizeof(float));
+        bits += o[i] < 0 ? -int_offset : int_offset;
+        memcpy(&result[i], &bits, sizeof(float));
+    }
+
+    return result;
+}
+
+glm::vec3 concentricHemisphere(const glm::vec2 &uv)
+{
+    using ShadingHelpers::pi;
+
+    glm::vec2 c = 2.f * uv - 1.f;
+    glm::vec2 d;
+    if (c.x == 0.f && c.y == 0.f) {
+        d = glm::vec2(0.f);
+    } else {
+        float phi, r;
+        if (fabsf(c.x) > fabsf(c.y)) {
+            r = c.x;
+            phi = (c.y / c.x) * (pi / 4.f);
+        } else {
+            r = c.y;
+            phi = (pi / 2.f) - (c.x / c.y) * (pi / 4.f);
+        }
+
+        d = r * glm::vec2(cosf(phi), sinf(phi));
+    }
+
+    float z = sqrtf(std::max(0.f, 1.f - dot(d, d)));
+
+    return glm::vec3(d.x, d.y, z);
+}
+
+glm::vec3 sampleSphereUniform(const glm::vec2 &uv)
+{
+    float z = 1.f - 2.f * uv.x;
+    float r = sqrtf(std::max(0.f, 1.f - z * z));
+    float phi = 2.f * ShadingHelpers::pi * uv.y;
+    return glm::vec3(r * cosf(phi), r * sinf(phi), z);
+}
+
+glm::vec3 getOrthogonalVec(const glm::vec3 &v)
+{
+    return fabsf(v.x) > fabsf(v.z) ?
+        glm::vec3(-v.y, v.x, 0.f) :
+        glm::vec3(0.f, -v.z, v.y);
+}
+
+glm::vec2 dirToLatLong(const glm::vec3 &dir)
+{
+    using namespace ShadingHelpers;
+
+    glm::vec3 n = normalize(dir);
+
+    return glm::vec2(atan2f(n.x, -n.z) * (invPi / 2.f) + 0.5f,
+                     acosf(std::clamp(n.y, -1.f, 1.f)) * invPi);
+}
+
+}
+}
@@ -1,6 +1,9 @@
 #include <rlpbr.hpp>
+#include <rlpbr_core/batch_prep.hpp>
+#include <rlpbr_core/dataset.hpp>
 #include <iostream>
 #include <fstream>
+#include <memory>
 #include <string>
 #include <random>
 
@@ -9,7 +12,7 @@
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtx/string_cast.hpp>
 #include <cuda_runtime.h>
-#include <../../bin/oiio_bridge.hpp>
+#include <../../bin/image_writer.hpp>
 
 using namespace std;
 using namespace RLpbr;
@@ -25,7 +28,7 @@ struct DataPointers {
 
 int main(int argc, char *argv[]) {
     if (argc < 10) {
-        cerr << argv[0] << " scene_list out_dir batch_size res src_spp src_path_depth ref_spp ref_path_depth points_per_env" << endl;
+        cerr << argv[0] << " scene_list out_dir batch_size res src_spp src_path_depth ref_spp ref_path_depth points_per_env [exr|dataset]" << endl;
         exit(EXIT_FAILURE);
     }
 
@@ -42,6 +45,8 @@ int main(int argc, char *argv[]) {
 
     uint32_t batches_per_env = vk::divideRoundUp(points_per_env, batch_size);
 
+    bool use_dataset = argc > 10 && string(argv[10]) == "dataset";
+
     Renderer src_renderer({0, 1, batch_size, res, res, src_spp, src_path_depth,
         128, RenderMode::PathTracer,
         RenderFlags::AuxiliaryOutputs, 0.f,
@@ -126,10 +131,49 @@ int main(int argc, char *argv[]) {
     uniform_real_distribution<float> rot_dist(0.f, 1.f);
     srand(1792582337);
 
-    auto saveBatch = [num_pixels, batch_size, res, out_dir](
+    // EXR compression runs on the writer's threads, the render loop only
+    // waits when too many images are queued
+    AsyncImageWriter writer;
+
+    // Alternatively one dataset per pass, sample i of both is the same view
+    auto makeSchema = [res](bool save_normal) {
+        DatasetCodec codec =
+            datasetCodecSupported(DatasetCodec::Deflate) ?
+                DatasetCodec::Deflate : DatasetCodec::None;
+
+        DatasetSchema schema {
+            {
+                { "color", DatasetType::Float16, codec, res, res, 3 },
+                { "albedo", DatasetType::Float16, codec, res, res, 3 },
+            },
+            DatasetConstants::defaultShardBytes,
+        };
+
+        if (save_normal) {
+            schema.tensors.push_back(
+                { "normal", DatasetType::Float16, codec, res, res, 3 });
+        }
+
+        return schema;
+    };
+
+    unique_ptr<DatasetWriter> src_dataset, ref_dataset;
+    if (use_dataset) {
+        src_dataset = make_unique<DatasetWriter>(
+            string(out_dir) + "src_dataset", makeSchema(true));
+        ref_dataset = make_unique<DatasetWriter>(
+            string(out_dir) + "ref_dataset", makeSchema(false));
+    }
+
+    BatchPrepPool pool(0);
+
+    auto saveBatch = [num_pixels, batch_size, res, out_dir, &writer, &pool,
+                      &src_batch](
             const DataPointers &ptrs,
             const char *prefix,
-            int offset, bool save_normal) {
+            int offset, bool save_normal,
+            DatasetWriter *dataset, const string &scene_path,
+            uint32_t spp) {
         cudaMemcpy2D(ptrs.colorHost, sizeof(half) * 3,
                      ptrs.color, sizeof(half) * 4,
                      sizeof(half) * 3, num_pixels,
@@ -142,6 +186,36 @@ int main(int argc, char *argv[]) {
                        num_pixels * sizeof(half) * 3, cudaMemcpyDeviceToHost);
         }
 
+        if (dataset) {
+            vector<SampleMetadata> metadata;
+            vector<const void *> tensors;
+            for (uint32_t batch_idx = 0; batch_idx < batch_size; batch_idx++) {
+                const Environment &env = src_batch.getEnvironment(batch_idx);
+                const Camera &cam = env.getCamera();
+                metadata.push_back({
+                    scene_path,
+                    cam.position,
+                    cam.view,
+                    cam.up,
+                    cam.right,
+                    spp,
+                    env.getRandomKey(),
+                });
+
+                uint64_t image_offset = uint64_t(batch_idx) * res * res * 3;
+                tensors.push_back(ptrs.colorHost + image_offset);
+                tensors.push_back(ptrs.albedoHost + image_offset);
+                if (save_normal) {
+                    tensors.push_back(ptrs.normalHost + image_offset);
+                }
+            }
+
+            dataset->appendBatch(metadata.data(), tensors.data(), batch_size,
+                                 pool);
+
+            return;
+        }
+
         for (int batch_idx = 0; batch_idx < (int)batch_size; batch_idx++) {
             string color_name = out_dir + string(prefix) +
                 "color_" + to_string(offset + batch_idx) + ".exr";
@@ -150,14 +224,15 @@ int main(int argc, char *argv[]) {
             string normal_name = out_dir + string(prefix) +
                 "normal_" + to_string(offset + batch_idx) + ".exr";
 
-            saveHDR(color_name.c_str(), res, res,
-                    ptrs.colorHost + batch_idx * res * res * 3, true);
-            saveHDR(albedo_name.c_str(), res, res,
-                    ptrs.albedoHost + batch_idx * res * res * 3, true);
+            writer.write(move(color_name), ImageFileFormat::EXR, res, res, 3,
+                         ptrs.colorHost + batch_idx * res * res * 3);
+            writer.write(move(albedo_name), ImageFileFormat::EXR, res, res, 3,
+                         ptrs.albedoHost + batch_idx * res * res * 3);
 
             if (save_normal) {
-                saveHDR(normal_name.c_str(), res, res,
-                        ptrs.normalHost + batch_idx * res * res * 3, true);
+                writer.write(move(normal_name), ImageFileFormat::EXR,
+                             res, res, 3,
+                             ptrs.normalHost + batch_idx * res * res * 3);
             }
         }
     };
@@ -210,7 +285,8 @@ int main(int argc, char *argv[]) {
             src_renderer.render(src_batch);
             src_renderer.waitForBatch(src_batch);
 
-            saveBatch(src_ptrs, "src_", img_count, true);
+            saveBatch(src_ptrs, "src_", img_count, true, src_dataset.get(),
+                      scene_path, src_spp);
 
             src_renderer.render(src_batch);
             src_renderer.waitForBatch(src_batch);
@@ -218,9 +294,16 @@ int main(int argc, char *argv[]) {
             //ref_renderer.render(ref_batch);
             //ref_renderer.waitForBatch(ref_batch);
 
-            saveBatch(src_ptrs, "ref_", img_count, false);
+            // The reference pass currently reuses the source renderer
+            saveBatch(src_ptrs, "ref_", img_count, false, ref_dataset.get(),
+                      scene_path, src_spp);
 
             img_count += batch_size;
         }
     }
+
+    if (!writer.flush()) {
+        cerr << "Failed to write some images" << endl;
+        exit(EXIT_FAILURE);
+    }
 }
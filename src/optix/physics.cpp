@@ -1,6 +1,7 @@
 #include "physics.hpp"
 #include "scene.hpp"
 #include "rlpbr_core/physics.hpp"
+#include "rlpbr_core/io.hpp"
 #include "utils.hpp"
 
 #include <iostream>
@@ -72,18 +73,20 @@ ScenePhysicsData ScenePhysicsData::make(const PhysicsMetadata &metadata,
         Texture volume = tex_mgr.load(sdf_path, TextureFormat::R32_SFLOAT,
             cudaAddressModeClamp, cpy_strm,
             [&host_data](const string &tex_path) {
-                ifstream sdf_file(tex_path);
+                IOEngine &io = IOEngine::get();
+                IOFile sdf_file(tex_path);
 
                 glm::u32vec3 sdf_dims;
-                sdf_file.read(reinterpret_cast<char *>(&sdf_dims),
-                              sizeof(glm::u32vec3));
+                io.read(sdf_file.getFD(), &sdf_dims, 0,
+                        sizeof(glm::u32vec3));
                 size_t sdf_bytes = sizeof(float) * sdf_dims.x *
                     sdf_dims.y * sdf_dims.z;
 
                 void *sdf_data = allocCUHost(sdf_bytes,
                     cudaHostAllocMapped | cudaHostAllocWriteCombined);
 
-                sdf_file.read(reinterpret_cast<char *>(sdf_data), sdf_bytes);
+                io.read(sdf_file.getFD(), sdf_data, sizeof(glm::u32vec3),
+                        sdf_bytes);
 
                 host_data.push_back(sdf_data);
 
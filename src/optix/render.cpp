@@ -569,6 +569,12 @@ OptixBackend::OptixBackend(const RenderConfig &cfg, bool validate)
         abort();
     }
 
+    if (cfg.mode == RenderMode::Rasterize) {
+        cerr << "Optix backend: RenderMode::Rasterize is only supported "
+            "by the CPU backend" << endl;
+        abort();
+    }
+
     for (int i = 0; i < (int)getNumFrames(cfg); i++) {
         render_state_.shaderBuffers[i].launchInput->precomputed =
             bsdf_luts_.deviceHandles;
@@ -638,8 +644,9 @@ static PackedEnv packEnv(const Environment &env,
     *instance_buffer = cur_instance;
 
     PackedTransforms *env_txfm_start = *instance_transforms;
-    memcpy(*instance_transforms, env.getTransforms().data(),
-           sizeof(PackedTransforms) * env.getTransforms().size());
+    static_assert(sizeof(PackedTransforms) == sizeof(InstanceTransform));
+    env.getTransforms().copyTo(
+        reinterpret_cast<InstanceTransform *>(*instance_transforms));
     *instance_transforms += env.getTransforms().size();
 
     uint32_t *cur_inst_materials = *instance_materials;
@@ -669,6 +676,14 @@ static PackedEnv packEnv(const Environment &env,
 
 void OptixBackend::render(RenderBatch &batch)
 {
+    // The launch covers the whole batch and would overwrite the outputs
+    // of inactive environments
+    if (!batch.allActive()) {
+        cerr << "Optix backend: rendering a subset of the batch is not "
+            "supported, call activateAllEnvironments" << endl;
+        abort();
+    }
+
     const Environment *envs = batch.getEnvironments();
     //physics_->simulate(envs);
 
@@ -1,7 +1,10 @@
 #include "scene.hpp"
 #include "utils.hpp"
 
+#include <rlpbr_core/utils.hpp>
+
 #include <optix_stubs.h>
+#include <algorithm>
 #include <iostream>
 
 #include <glm/gtc/type_ptr.hpp>
@@ -38,9 +41,9 @@ static void assignInstanceTransform(OptixInstance &inst,
 
 void TLAS::build(
     OptixDeviceContext ctx,
-    const vector<ObjectInstance> &instances,
-    const vector<InstanceTransform> &instance_transforms,
-    const vector<InstanceFlags> &instance_flags,
+    const CowArray<ObjectInstance> &instances,
+    const CowArray<InstanceTransform> &instance_transforms,
+    const CowArray<InstanceFlags> &instance_flags,
     const OptixTraversableHandle *blases,
     cudaStream_t build_stream)
 {
@@ -256,6 +259,13 @@ uint32_t OptixEnvironment::addLight(const glm::vec3 &position,
 #endif
 }
 
+// Lights are fixed on the device, like addLight / removeLight
+uint32_t OptixEnvironment::addSceneLight(uint32_t scene_light_idx)
+{
+    (void)scene_light_idx;
+    return 0;
+}
+
 void OptixEnvironment::removeLight(uint32_t light_idx)
 {
     (void)light_idx;
@@ -266,6 +276,19 @@ void OptixEnvironment::removeLight(uint32_t light_idx)
 #endif
 }
 
+bool OptixEnvironment::traceRays(const Environment &, const RayQuery *,
+                                 uint32_t, RayQueryHit *)
+{
+    return false;
+}
+
+bool OptixEnvironment::traceOcclusion(const Environment &,
+                                      const RayQuery *, uint32_t,
+                                      uint8_t *)
+{
+    return false;
+}
+
 void OptixEnvironment::queueTLASRebuild(const Environment &env,
     OptixDeviceContext ctx, cudaStream_t strm)
 {
@@ -307,13 +330,16 @@ static LoadedTextures loadTextures(const TextureInfo &texture_info,
 
             Texture tex = mgr.load(full_path, fmt, cudaAddressModeWrap,
                 cpy_strm, [&](const string &tex_path) {
-                    ifstream tex_file(tex_path, ios::in | ios::binary);
+                    IOEngine &io = IOEngine::get();
+                    IOFile tex_file(tex_path);
 
-                    auto read_uint = [&tex_file]() {
-                        uint32_t v;
-                        tex_file.read((char *)&v, sizeof(uint32_t));
-                        return v;
-                    };
+                    // Magic, level count and up to maxHeaderLevels level
+                    // descriptors in a single read
+                    constexpr uint32_t maxHeaderLevels = 32;
+                    uint32_t header[2 + maxHeaderLevels * 4];
+                    io.read(tex_file.getFD(), header, 0,
+                            min<uint64_t>(tex_file.numBytes(),
+                                          sizeof(header)));
 
                     uint32_t bytes_per_pixel;
                     if (fmt == TextureFormat::R8G8B8A8_SRGB) {
@@ -327,13 +353,17 @@ static LoadedTextures loadTextures(const TextureInfo &texture_info,
                         abort();
                     }
 
-                    auto magic = read_uint();
+                    auto magic = header[0];
                     if (magic != 0x50505050) {
                         cerr << "Invalid texture file" << endl;
                         abort();
                     }
-                    auto total_num_levels = read_uint();
-                    
+                    auto total_num_levels = header[1];
+                    if (total_num_levels > maxHeaderLevels) {
+                        cerr << "Texture has too many mip levels" << endl;
+                        abort();
+                    }
+
                     uint32_t x = 0;
                     uint32_t y = 0;
                     uint32_t num_compressed_bytes = 0;
@@ -344,10 +374,11 @@ static LoadedTextures loadTextures(const TextureInfo &texture_info,
 
                     uint32_t num_skip_levels = 0;
                     for (int i = 0; i < (int)total_num_levels; i++) {
-                        uint32_t level_x = read_uint();
-                        uint32_t level_y = read_uint();
-                        uint32_t offset = read_uint();
-                        uint32_t lvl_compressed_bytes = read_uint();
+                        const uint32_t *level_info = header + 2 + i * 4;
+                        uint32_t level_x = level_info[0];
+                        uint32_t level_y = level_info[1];
+                        uint32_t offset = level_info[2];
+                        uint32_t lvl_compressed_bytes = level_info[3];
 
                         if (level_x > max_texture_resolution &&
                             level_y > max_texture_resolution) {
@@ -371,11 +402,13 @@ static LoadedTextures loadTextures(const TextureInfo &texture_info,
                     int num_levels = total_num_levels - num_skip_levels;
 
                     uint8_t *img_data = (uint8_t *)malloc(num_decompressed_bytes);
-                    tex_file.ignore(skip_bytes);
+                    uint64_t cur_file_offset = 2 * sizeof(uint32_t) +
+                        total_num_levels * 4 * sizeof(uint32_t) + skip_bytes;
 
                     uint8_t *compressed_data =
                         (uint8_t *)malloc(num_compressed_bytes);
-                    tex_file.read((char *)compressed_data, num_compressed_bytes);
+                    io.read(tex_file.getFD(), compressed_data,
+                            cur_file_offset, num_compressed_bytes);
 
                     uint8_t *cur_ptr = img_data;
                     for (int i = 0; i < (int)num_levels; i++) {
@@ -456,6 +489,16 @@ static LoadedTextures loadTextures(const TextureInfo &texture_info,
     return loaded;
 }
 
+shared_ptr<Scene> OptixLoader::upload(PreparedScene &scene)
+{
+    return loadScene(move(scene.loadData));
+}
+
+uint32_t OptixLoader::getMaxTextureResolution() const
+{
+    return max_texture_resolution_;
+}
+
 shared_ptr<Scene> OptixLoader::loadScene(SceneLoadData &&load_info)
 {
     auto textures = loadTextures(load_info.textureInfo, stream_,
@@ -490,13 +533,12 @@ shared_ptr<Scene> OptixLoader::loadScene(SceneLoadData &&load_info)
     char *data_src = nullptr;
     bool cuda_staging = false;
 
-    if (holds_alternative<ifstream>(load_info.data)) {
+    if (holds_alternative<SceneDataFile>(load_info.data)) {
         REQ_CUDA(cudaHostAlloc((void **)&data_src, load_info.hdr.totalBytes,
                                cudaHostAllocWriteCombined));
         cuda_staging = true;
 
-        ifstream &file = *get_if<ifstream>(&load_info.data);
-        file.read(data_src, load_info.hdr.totalBytes);
+        load_info.readData(data_src);
     } else {
         data_src = get_if<vector<char>>(&load_info.data)->data();
     }
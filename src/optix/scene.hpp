@@ -1,6 +1,7 @@
 #pragma once
 
 #include <rlpbr_core/common.hpp>
+#include <rlpbr_core/load_pipeline.hpp>
 #include <rlpbr_core/scene.hpp>
 #include <rlpbr_core/utils.hpp>
 
@@ -30,9 +31,9 @@ struct TLAS {
     std::vector<OptixTraversableHandle> instanceBLASStaging;
 
     void build(OptixDeviceContext ctx,
-               const std::vector<ObjectInstance> &instances,
-               const std::vector<InstanceTransform> &instance_transforms,
-               const std::vector<InstanceFlags> &instance_flags,
+               const CowArray<ObjectInstance> &instances,
+               const CowArray<InstanceTransform> &instance_transforms,
+               const CowArray<InstanceFlags> &instance_flags,
                const OptixTraversableHandle *blases,
                cudaStream_t build_stream);
 
@@ -88,9 +89,19 @@ public:
 
     uint32_t addLight(const glm::vec3 &position,
                       const glm::vec3 &color);
+    uint32_t addSceneLight(uint32_t scene_light_idx);
 
     void removeLight(uint32_t light_idx);
 
+    // No domain randomization support
+    void randomize(const RandomKey &) {}
+
+    // Geometry only lives on the GPU, both return false
+    bool traceRays(const Environment &env, const RayQuery *rays,
+                   uint32_t num_rays, RayQueryHit *hits);
+    bool traceOcclusion(const Environment &env, const RayQuery *rays,
+                        uint32_t num_rays, uint8_t *occluded);
+
     void queueTLASRebuild(const Environment &env,
         OptixDeviceContext ctx, cudaStream_t strm);
 
@@ -101,13 +112,22 @@ public:
     std::optional<PhysicsEnvironment> physics;
 };
 
-class OptixLoader : public LoaderBackend {
+class OptixLoader : public LoaderBackend, public SceneUploadSink {
 public:
     OptixLoader(OptixDeviceContext ctx, TextureManager &texture_mgr,
                 uint32_t max_texture_resolution, bool need_physics);
 
     std::shared_ptr<Scene> loadScene(SceneLoadData &&load_info);
 
+    // Textures go through the TextureManager cache, so only the scene
+    // read overlaps with uploads
+    void stage(PreparedScene &) override {}
+    std::shared_ptr<Scene> upload(PreparedScene &scene) override;
+    bool needsDecodedTextures() const override { return false; }
+    uint32_t getMaxTextureResolution() const override;
+
+    SceneUploadSink *getUploadSink() { return this; }
+
 private:
     cudaStream_t stream_;
     OptixDeviceContext ctx_;
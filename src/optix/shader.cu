@@ -27,6 +27,12 @@ using namespace RLpbr;
 using namespace RLpbr::optix;
 using namespace cuda::std;
 
+#define SHADER_CONST static constexpr
+#define SHADER_FUNC __forceinline__
+#include "rlpbr_core/shading.h"
+#undef SHADER_FUNC
+#undef SHADER_CONST
+
 extern "C" {
 __constant__ LaunchInput launchInput;
 }
@@ -415,10 +421,7 @@ __forceinline__ float rgbToLuminance(float3 rgb)
 template <typename T>
 __forceinline__ T computeFresnel(T f0, T f90, float cos_theta)
 {
-    float complement = max(1.f - cos_theta, 0.f);
-    return f0 + (f90 - f0) * complement * complement * complement *
-        complement * complement;
-
+    return f0 + (f90 - f0) * fresnelWeight(cos_theta);
 }
 
 template <typename T> __forceinline__ T makeZeroVec();
@@ -879,36 +882,12 @@ __forceinline__ SampleResult<float3> sampleDiffuse(
     };
 }
 
-// Single scattering GGX Microfacet BRDF
-__forceinline__ float ggxLambda(float cos_theta, float a2)
-{
-    float cos2 = cos_theta * cos_theta;
-    float tan2 = max(1.f - cos2, 0.f) / cos2;
-    float l = 0.5f * (-1.f + sqrtf(1.f + a2 * tan2));
-
-    return cos_theta <= 0.f ? 0.f : l;
-}
-
-__forceinline__ float ggxNDF(float alpha, float cos_theta)
-{
-    float a2 = alpha * alpha;
-    float d = ((cos_theta * a2 - cos_theta) * cos_theta + 1.f);
-    return a2 / (d * d * M_PI);
-}
-
-__forceinline__ float ggxMasking(float a2, float out_cos, float in_cos)
-{
-    float in_lambda = ggxLambda(in_cos, a2);
-    float out_lambda = ggxLambda(out_cos, a2);
-    return 1.f / (1.f + in_lambda + out_lambda);
-}
-
 template <typename T>
 __forceinline__ T evalGGX(float wo_dot_n, float wi_dot_n, float n_dot_h,
                           T F, float alpha)
 {
     float a2 = alpha * alpha;
-    float D = ggxNDF(alpha, n_dot_h);
+    float D = ggxNDF(a2, n_dot_h);
     float G = ggxMasking(a2, wo_dot_n, wi_dot_n);
 
     T specular = 0.25f * F * D * G / wo_dot_n;
@@ -9,6 +9,7 @@
 
 #include <fstream>
 #include <iostream>
+#include <tuple>
 #include <type_traits>
 #include <unordered_set>
 
@@ -926,24 +927,29 @@ static std::vector<InstanceProperties> gltfParseInstances(
     const glm::mat4 &coordinate_txfm,
     const vector<MaterialType> &materials)
 {
-    vector<pair<uint32_t, glm::mat4>> node_stack;
+    // Node, parent's transform, closest ancestor that is an instance
+    vector<tuple<uint32_t, glm::mat4, uint32_t>> node_stack;
     for (uint32_t root_node : scene.rootNodes) {
-        node_stack.emplace_back(root_node, coordinate_txfm);
+        node_stack.emplace_back(root_node, coordinate_txfm, ~0u);
     }
 
     vector<InstanceProperties> instances;
     while (!node_stack.empty()) {
-        auto [node_idx, parent_txfm] = node_stack.back();
+        auto [node_idx, parent_txfm, parent_inst] = node_stack.back();
         node_stack.pop_back();
 
         const GLTFNode &cur_node = scene.nodes[node_idx];
         glm::mat4 cur_txfm = parent_txfm * cur_node.transform;
 
+        bool is_instance = cur_node.meshIdx < scene.meshes.size();
+        uint32_t child_parent_inst =
+            is_instance ? uint32_t(instances.size()) : parent_inst;
+
         for (const uint32_t child_idx : cur_node.children) {
-            node_stack.emplace_back(child_idx, cur_txfm);
+            node_stack.emplace_back(child_idx, cur_txfm, child_parent_inst);
         }
 
-        if (cur_node.meshIdx < scene.meshes.size()) {
+        if (is_instance) {
             // Decompose transform
             glm::vec3 position(cur_txfm[3]);
 
@@ -995,6 +1001,7 @@ static std::vector<InstanceProperties> gltfParseInstances(
                 scale,
                 false,
                 is_transparent,
+                parent_inst,
             });
         }
     }
@@ -57,6 +57,9 @@ struct InstanceProperties {
     glm::vec3 scale;
     bool dynamic;
     bool transparent;
+    // Index of the parent instance, which comes earlier in the same list.
+    // Only kept when preprocessing with keep_hierarchy.
+    uint32_t parentIdx = ~0u;
 };
 
 template <typename VertexType, typename MaterialType>
@@ -25,6 +25,7 @@
 #include "import.hpp"
 #include "physics.hpp"
 #include "physics.inl"
+#include "rlpbr_core/batch_prep.hpp"
 #include "rlpbr_core/scene.hpp"
 
 
@@ -180,7 +181,8 @@ static PreprocessData parseSceneData(string_view scene_path,
                                      const glm::mat4 &base_txfm,
                                      optional<string_view> data_dir,
                                      bool process_textures,
-                                     bool build_sdfs)
+                                     bool build_sdfs,
+                                     bool keep_hierarchy)
 {
     string serialized_data_dir;
     if (!data_dir.has_value()) {
@@ -198,6 +200,12 @@ static PreprocessData parseSceneData(string_view scene_path,
     auto scene_desc = SceneDescription<Vertex, Material>::parseScene(
         scene_path, base_txfm, texture_cb);
 
+    if (!keep_hierarchy) {
+        for (auto &inst : scene_desc.defaultInstances) {
+            inst.parentIdx = ~0u;
+        }
+    }
+
     return PreprocessData {
         move(scene_desc),
         serialized_data_dir,
@@ -209,9 +217,10 @@ ScenePreprocessor::ScenePreprocessor(string_view gltf_path,
                                      const glm::mat4 &base_txfm,
                                      optional<string_view> data_dir,
                                      bool process_textures,
-                                     bool build_sdfs)
+                                     bool build_sdfs,
+                                     bool keep_hierarchy)
     : scene_data_(new PreprocessData(parseSceneData(gltf_path,
-        base_txfm, data_dir, process_textures, build_sdfs)))
+        base_txfm, data_dir, process_textures, build_sdfs, keep_hierarchy)))
 {}
 
 template <typename VertexType>
@@ -629,17 +638,30 @@ SceneDescription<VertexType, MaterialType> mergeStaticInstances(
 
     vector<uint32_t> static_object_usage(orig_desc.objects.size());
 
-    for (const auto &inst : orig_desc.defaultInstances) {
+    // Instances in a hierarchy move with their parent, so can't be merged
+    vector<bool> in_hierarchy(orig_desc.defaultInstances.size(), false);
+
+    for (int inst_idx = 0; inst_idx < (int)orig_desc.defaultInstances.size();
+         inst_idx++) {
+        const auto &inst = orig_desc.defaultInstances[inst_idx];
         if (!inst.dynamic) {
             static_object_usage[inst.objectIndex]++;
         } 
+
+        if (inst.parentIdx != ~0u) {
+            in_hierarchy[inst_idx] = true;
+            in_hierarchy[inst.parentIdx] = true;
+        }
     }
 
     vector<uint32_t> obj_remap(orig_desc.objects.size(), ~0u);
     vector<bool> obj_merged(orig_desc.objects.size(), false);
+    vector<uint32_t> inst_remap(orig_desc.defaultInstances.size(), ~0u);
 
-    for (const auto &inst : orig_desc.defaultInstances) {
-        if (!inst.dynamic &&
+    for (int inst_idx = 0; inst_idx < (int)orig_desc.defaultInstances.size();
+         inst_idx++) {
+        const auto &inst = orig_desc.defaultInstances[inst_idx];
+        if (!inst.dynamic && !in_hierarchy[inst_idx] &&
             static_object_usage[inst.objectIndex] < duplication_threshold) {
             if (inst.transparent) {
                 static_transparent_desc.objects.push_back(
@@ -656,7 +678,13 @@ SceneDescription<VertexType, MaterialType> mergeStaticInstances(
             obj_merged[inst.objectIndex] = true;
         } else {
             uint32_t remapped = obj_remap[inst.objectIndex];
+            inst_remap[inst_idx] = new_desc.defaultInstances.size();
             new_desc.defaultInstances.push_back(inst);
+            if (inst.parentIdx != ~0u) {
+                new_desc.defaultInstances.back().parentIdx =
+                    inst_remap[inst.parentIdx];
+            }
+
             if (remapped == ~0u) {
                 new_desc.objects.push_back(orig_desc.objects[inst.objectIndex]);
                 uint32_t new_idx = new_desc.objects.size() - 1;
@@ -1041,9 +1069,22 @@ processScene(const SceneDescription<VertexType, MaterialType> &orig_desc)
     auto [geometry, obj_remap, removed_meshes] =
         processGeometry<VertexType, MaterialType>(desc.objects, obj_scales);
 
+    // Children of dropped instances attach to the closest kept ancestor
+    vector<uint32_t> inst_remap(desc.defaultInstances.size(), ~0u);
+
     vector<InstanceProperties> new_insts;
-    for (const auto &inst : desc.defaultInstances) {
-        if (obj_remap[inst.objectIndex].empty()) continue;
+    for (int inst_idx = 0; inst_idx < (int)desc.defaultInstances.size();
+         inst_idx++) {
+        const auto &inst = desc.defaultInstances[inst_idx];
+        uint32_t new_parent =
+            inst.parentIdx == ~0u ? ~0u : inst_remap[inst.parentIdx];
+
+        if (obj_remap[inst.objectIndex].empty()) {
+            inst_remap[inst_idx] = new_parent;
+            continue;
+        }
+
+        inst_remap[inst_idx] = new_insts.size();
 
         auto iter = obj_remap[inst.objectIndex].find(inst.scale);
         string new_name = inst.name;
@@ -1061,6 +1102,7 @@ processScene(const SceneDescription<VertexType, MaterialType> &orig_desc)
             glm::vec3(1.f),
             inst.dynamic,
             inst.transparent,
+            new_parent,
         };
 
         const auto &obj_removed_meshes = removed_meshes[new_inst.objectIndex];
@@ -1473,6 +1515,39 @@ void ScenePreprocessor::dump(string_view out_path_name)
         assert(out.tellp() == int64_t(hdr.totalBytes + stage_beginning));
     };
 
+    // Driver independent, unlike the .blas_cache the vulkan backend keeps
+    // next to the scene
+    auto write_mesh_bvhs = [&](const auto &geometry) {
+        write_pad(256);
+
+        BatchPrepPool build_pool(0);
+
+        write(uint32_t(geometry.meshInfos.size()));
+        for (const MeshInfo &mesh : geometry.meshInfos) {
+            vector<AABB> tri_bounds;
+            tri_bounds.reserve(mesh.numTriangles);
+
+            for (uint32_t tri_idx = 0; tri_idx < mesh.numTriangles;
+                 tri_idx++) {
+                const uint32_t *tri_indices =
+                    &geometry.indices[mesh.indexOffset + 3 * tri_idx];
+
+                glm::vec3 a = geometry.vertices[tri_indices[0]].position;
+                glm::vec3 b = geometry.vertices[tri_indices[1]].position;
+                glm::vec3 c = geometry.vertices[tri_indices[2]].position;
+
+                tri_bounds.push_back({
+                    glm::min(a, glm::min(b, c)),
+                    glm::max(a, glm::max(b, c)),
+                });
+            }
+
+            BVH bvh = BVH::build(tri_bounds.data(), tri_bounds.size(),
+                                 BVH::defaultConfig(), &build_pool);
+            writeBVH(out, bvh);
+        }
+    };
+
     auto write_lights = [&](const auto &lights) {
         write(uint32_t(lights.size()));
         for (const auto &light : lights) {
@@ -1529,6 +1604,8 @@ void ScenePreprocessor::dump(string_view out_path_name)
         vector<ObjectInstance> instances;
         vector<uint32_t> instance_materials;
         vector<InstanceFlags> instance_flags;
+        vector<uint32_t> instance_parents;
+        bool has_hierarchy = false;
 
         for (int inst_id = 0; inst_id < (int)num_instances; inst_id++) {
             const InstanceProperties &inst_props = instance_props[inst_id];
@@ -1544,6 +1621,9 @@ void ScenePreprocessor::dump(string_view out_path_name)
             }
             instance_flags.push_back(flags);
 
+            instance_parents.push_back(inst_props.parentIdx);
+            has_hierarchy |= inst_props.parentIdx != ~0u;
+
             for (uint32_t mat_idx : inst_props.materials) {
                 instance_materials.push_back(mat_idx);
             }
@@ -1600,6 +1680,15 @@ void ScenePreprocessor::dump(string_view out_path_name)
         out.write(reinterpret_cast<const char *>(instance_flags.data()),
                   sizeof(InstanceFlags) * instance_flags.size());
 
+        // Flat scenes skip the parent array
+        if (!has_hierarchy) {
+            instance_parents.clear();
+        }
+
+        write(uint32_t(instance_parents.size()));
+        out.write(reinterpret_cast<const char *>(instance_parents.data()),
+                  sizeof(uint32_t) * instance_parents.size());
+
         write(uint32_t(static_instances.size()));
         write(uint32_t(dynamic_instances.size()));
 
@@ -1640,6 +1729,29 @@ void ScenePreprocessor::dump(string_view out_path_name)
         out.write(reinterpret_cast<const char *>(geometry.objectInfos.data()),
                   geometry.objectInfos.size() * sizeof(ObjectInfo));
 
+        // Object space bounds for host side spatial queries
+        for (const ObjectInfo &obj : geometry.objectInfos) {
+            AABB obj_bounds {
+                glm::vec3(INFINITY, INFINITY, INFINITY),
+                glm::vec3(-INFINITY, -INFINITY, -INFINITY),
+            };
+
+            for (uint32_t mesh_offset = 0; mesh_offset < obj.numMeshes;
+                 mesh_offset++) {
+                const MeshInfo &mesh =
+                    geometry.meshInfos[obj.meshIndex + mesh_offset];
+
+                for (uint32_t i = 0; i < mesh.numTriangles * 3; i++) {
+                    const glm::vec3 &pos = geometry.vertices[
+                        geometry.indices[mesh.indexOffset + i]].position;
+
+                    obj_bounds.pMin = glm::min(obj_bounds.pMin, pos);
+                    obj_bounds.pMax = glm::max(obj_bounds.pMax, pos);
+                }
+            }
+
+            write(obj_bounds);
+        }
     };
 
     auto write_scene = [&](const auto &geometry,
@@ -1667,10 +1779,13 @@ void ScenePreprocessor::dump(string_view out_path_name)
 
         write_staging(geometry, material_metadata, processed_physics_state,
                       hdr);
+
+        write_mesh_bvhs(geometry);
     };
 
-    // Header: magic
-    write(uint32_t(0x55555555));
+    // Header: magic, 0x55555556 has the instance hierarchy, 0x55555557
+    // object bounds, 0x55555558 mesh BVHs
+    write(uint32_t(0x55555558));
     write_scene(processed_geometry, processed_instances, default_bbox,
                 processed_lights, materials, scene_data_->dataDir);
     out.close();
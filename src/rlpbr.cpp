@@ -1,17 +1,28 @@
 #include <rlpbr.hpp>
 #include <rlpbr_core/common.hpp>
+#include <rlpbr_core/load_pipeline.hpp>
+#include <rlpbr_core/random.hpp>
 #include <rlpbr_core/scene.hpp>
+#include <rlpbr_core/snapshot.hpp>
+#include <rlpbr_core/transforms.hpp>
 #include <rlpbr_core/utils.hpp>
 
 #ifdef OPTIX_ENABLED
 #include "optix/render.hpp"
 #endif
 
+#ifdef VULKAN_ENABLED
 #include "vulkan/render.hpp"
+#endif
+
+#include "cpu/render.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
 #include <functional>
 #include <iostream>
-#include <random>
 
 #include <glm/gtc/quaternion.hpp>
 #include <glm/gtx/transform.hpp>
@@ -32,6 +43,23 @@ shared_ptr<Scene> AssetLoader::loadScene(string_view scene_path)
     return backend_.loadScene(move(load_data));
 }
 
+vector<shared_ptr<Scene>> AssetLoader::loadScenes(const char **scene_paths,
+                                                  uint32_t num_scenes,
+                                                  LoadPipelineStats *stats)
+{
+    return loadScenes(scene_paths, num_scenes,
+                      SceneLoadPipeline::defaultConfig(), stats);
+}
+
+vector<shared_ptr<Scene>> AssetLoader::loadScenes(const char **scene_paths,
+    uint32_t num_scenes, const LoadPipelineConfig &cfg,
+    LoadPipelineStats *stats)
+{
+    SceneLoadPipeline pipeline(*backend_.getUploadSink(), cfg);
+
+    return pipeline.load(scene_paths, num_scenes, stats);
+}
+
 
 shared_ptr<EnvironmentMapGroup> AssetLoader::loadEnvironmentMaps(
     const char **paths, uint32_t num_maps)
@@ -56,7 +84,7 @@ static bool enableValidation()
 
 static RendererImpl makeBackend(const RenderConfig &cfg)
 {
-    bool validate = enableValidation();
+    [[maybe_unused]] bool validate = enableValidation();
 
     switch(cfg.backend) {
         case BackendSelect::Optix: {
@@ -68,8 +96,16 @@ static RendererImpl makeBackend(const RenderConfig &cfg)
             abort();
         }
         case BackendSelect::Vulkan: {
+#ifdef VULKAN_ENABLED
             auto *renderer = new vk::VulkanBackend(cfg, validate);
             return makeRendererImpl<vk::VulkanBackend>(renderer);
+#endif
+            cerr << "Vulkan support not enabled at compile time." << endl;
+            abort();
+        }
+        case BackendSelect::CPU: {
+            auto *renderer = new cpu::CPUBackend(cfg);
+            return makeRendererImpl<cpu::CPUBackend>(renderer);
         }
     }
 
@@ -82,7 +118,9 @@ static bool gRandomizeMaterials;
 Renderer::Renderer(const RenderConfig &cfg)
     : backend_(makeBackend(cfg)),
       aspect_ratio_(float(cfg.imgWidth) / float(cfg.imgHeight)),
-      batch_size_(cfg.batchSize)
+      batch_size_(cfg.batchSize),
+      random_seed_(0),
+      next_env_idx_(0)
 {
     // hack hack hack
     gRandomizeMaterials = cfg.flags & RenderFlags::RandomizeMaterials;
@@ -98,7 +136,8 @@ Environment Renderer::makeEnvironment(const shared_ptr<Scene> &scene)
     Camera cam(glm::vec3(0.f), glm::vec3(0.f, 0.f, 1.f),
                glm::vec3(0.f, 1.f, 0.f), 90.f, aspect_ratio_);
 
-    Environment env(backend_.makeEnvironment(scene, cam), scene, cam);
+    Environment env(backend_.makeEnvironment(scene, cam), scene, cam,
+                    nextRandomKey());
 
     return env;
 }
@@ -111,7 +150,8 @@ Environment Renderer::makeEnvironment(const shared_ptr<Scene> &scene,
     Camera cam(eye, target, up, vertical_fov,
                aspect_ratio == 0.f ? aspect_ratio_ : aspect_ratio);
 
-    return Environment(backend_.makeEnvironment(scene, cam), scene, cam);
+    return Environment(backend_.makeEnvironment(scene, cam), scene, cam,
+                       nextRandomKey());
 }
 
 Environment Renderer::makeEnvironment(const shared_ptr<Scene> &scene,
@@ -121,7 +161,8 @@ Environment Renderer::makeEnvironment(const shared_ptr<Scene> &scene,
     Camera cam(camera_to_world, vertical_fov, 
                aspect_ratio == 0.f ? aspect_ratio_ : aspect_ratio);
 
-    return Environment(backend_.makeEnvironment(scene, cam), scene, cam);
+    return Environment(backend_.makeEnvironment(scene, cam), scene, cam,
+                       nextRandomKey());
 }
 
 Environment Renderer::makeEnvironment(const std::shared_ptr<Scene> &scene,
@@ -134,7 +175,29 @@ Environment Renderer::makeEnvironment(const std::shared_ptr<Scene> &scene,
     Camera cam(pos, fwd, up, right, vertical_fov,
                aspect_ratio == 0.f ? aspect_ratio_ : aspect_ratio);
 
-    return Environment(backend_.makeEnvironment(scene, cam), scene, cam);
+    return Environment(backend_.makeEnvironment(scene, cam), scene, cam,
+                       nextRandomKey());
+}
+
+Environment Renderer::forkEnvironment(const Environment &env)
+{
+    return env.fork(backend_.makeEnvironment(env.getScene(),
+                                             env.getCamera()));
+}
+
+void Renderer::setRandomSeed(uint64_t seed)
+{
+    random_seed_ = seed;
+    next_env_idx_.store(0, memory_order_relaxed);
+}
+
+RandomKey Renderer::nextRandomKey()
+{
+    return RandomKey {
+        random_seed_,
+        next_env_idx_.fetch_add(1, memory_order_relaxed),
+        0,
+    };
 }
 
 void Renderer::setActiveEnvironmentMaps(
@@ -145,8 +208,100 @@ void Renderer::setActiveEnvironmentMaps(
 
 RenderBatch::RenderBatch(Handle &&backend, uint32_t batch_size)
     : backend_(move(backend)),
-      envs_(batch_size)
+      envs_(batch_size),
+      active_(),
+      prep_stats_ {}
+{
+    activateAllEnvironments();
+}
+
+void RenderBatch::setActiveEnvironments(const uint32_t *env_idxs,
+                                        uint32_t num_active)
+{
+    active_.assign(env_idxs, env_idxs + num_active);
+    sort(active_.begin(), active_.end());
+    active_.erase(unique(active_.begin(), active_.end()), active_.end());
+
+    if (!active_.empty() && active_.back() >= envs_.size()) {
+        cerr << "Active environment " << active_.back()
+             << " out of range for batch of " << envs_.size() << endl;
+        abort();
+    }
+}
+
+void RenderBatch::setActiveMask(const bool *mask)
+{
+    active_.clear();
+    for (uint32_t env_idx = 0; env_idx < envs_.size(); env_idx++) {
+        if (mask[env_idx]) {
+            active_.push_back(env_idx);
+        }
+    }
+}
+
+void RenderBatch::activateAllEnvironments()
+{
+    active_.resize(envs_.size());
+    for (uint32_t env_idx = 0; env_idx < envs_.size(); env_idx++) {
+        active_[env_idx] = env_idx;
+    }
+}
+
+// Converts poses a block at a time, keeping the bases in cache until
+// they are copied into the cameras
+template <typename Fn>
+static uint32_t setBatchCameraViews(Environment *envs, uint32_t num_envs,
+                                    Fn &&compute_bases)
+{
+    constexpr uint32_t block_size = 64;
+    CameraBasis bases[block_size];
+    uint8_t valid[block_size];
+
+    uint32_t num_invalid = 0;
+    for (uint32_t block_start = 0; block_start < num_envs;
+         block_start += block_size) {
+        uint32_t num_block = min(num_envs - block_start, block_size);
+        compute_bases(block_start, num_block, bases, valid);
+
+        for (uint32_t i = 0; i < num_block; i++) {
+            if (!valid[i]) {
+                num_invalid++;
+                continue;
+            }
+
+            const CameraBasis &basis = bases[i];
+            envs[block_start + i].setCameraView(basis.position, basis.view,
+                                                basis.up, basis.right);
+        }
+    }
+
+    return num_invalid;
+}
+
+uint32_t RenderBatch::setCameraViews(const glm::vec3 *positions,
+                                     const glm::quat *rotations,
+                                     uint32_t num_envs)
 {
+    assert(num_envs <= envs_.size());
+
+    return setBatchCameraViews(envs_.data(), num_envs,
+        [&](uint32_t offset, uint32_t num, CameraBasis *bases,
+            uint8_t *valid) {
+            computeCameraBases(positions + offset, rotations + offset,
+                               bases, valid, num);
+        });
+}
+
+uint32_t RenderBatch::setCameraViews(const glm::mat4 *camera_to_worlds,
+                                     uint32_t num_envs)
+{
+    assert(num_envs <= envs_.size());
+
+    return setBatchCameraViews(envs_.data(), num_envs,
+        [&](uint32_t offset, uint32_t num, CameraBasis *bases,
+            uint8_t *valid) {
+            computeCameraBases(camera_to_worlds + offset, bases, valid, num);
+        });
 }
 
 RenderBatch Renderer::makeRenderBatch()
@@ -156,11 +311,24 @@ RenderBatch Renderer::makeRenderBatch()
 
 void Renderer::render(RenderBatch &batch)
 {
+    const uint32_t *active = batch.getActiveEnvironments();
+    for (uint32_t i = 0; i < batch.getNumActive(); i++) {
+        Environment &env = batch.getEnvironment(active[i]);
+        env.updateHierarchy();
+        env.updateLightSampling();
+    }
+
     backend_.render(batch);
 }
 
 void Renderer::bake(RenderBatch &batch)
 {
+    for (uint32_t env_idx = 0; env_idx < batch_size_; env_idx++) {
+        Environment &env = batch.getEnvironment(env_idx);
+        env.updateHierarchy();
+        env.updateLightSampling();
+    }
+
     backend_.bake(batch);
 }
 
@@ -184,24 +352,28 @@ AuxiliaryOutputs Renderer::getAuxiliaryOutputs(RenderBatch &batch) const
     return backend_.getAuxiliaryOutputs(batch);
 }
 
-static void randomizeMaterials(vector<uint32_t> &inst_materials, int num_materials)
+static void randomizeMaterials(CowArray<uint32_t> &inst_materials,
+                               uint32_t num_materials,
+                               const RandomKey &key)
 {
     if (gRandomizeMaterials) {
-        // FIXME: allow seeding, get rid of thread_local, need some kind of
-        // VulkanBackend thread context
-        static thread_local mt19937 rand_gen {random_device {}() + 5};
-
-        uniform_int_distribution<> rand_dist(0, num_materials - 1);
+        RandomStream rng(key, RandomPurpose::InstanceMaterials);
 
+        // Only write entries that change, so chunks shared with the scene
+        // defaults or a forked environment stay shared
         for (int i = 0; i < (int)inst_materials.size(); i++) {
-            inst_materials[i] = rand_dist(rand_gen);
+            uint32_t mat_idx = rng.uniformInt(num_materials);
+            if (inst_materials[i] != mat_idx) {
+                inst_materials.mut(i) = mat_idx;
+            }
         }
     }
 }
 
 Environment::Environment(EnvironmentImpl &&backend,
                          const shared_ptr<Scene> &scene,
-                         const Camera &cam)
+                         const Camera &cam,
+                         const RandomKey &random_key)
     : backend_(move(backend)),
       scene_(scene),
       camera_(cam),
@@ -212,50 +384,1206 @@ Environment::Environment(EnvironmentImpl &&backend,
       index_map_(scene_->envInit.indexMap),
       reverse_id_map_(scene_->envInit.reverseIDMap),
       free_ids_(),
+      num_free_materials_(0),
+      batch_dsts_(),
+      batch_discard_(),
+      parents_(scene_->envInit.defaultParents),
+      local_transforms_(scene_->envInit.defaultLocalTransforms),
+      num_children_(scene_->envInit.defaultNumChildren),
+      custom_hierarchy_order_(false),
+      hierarchy_order_valid_(true),
+      hierarchy_order_(),
+      hierarchy_levels_(),
+      hierarchy_dirty_(),
+      hierarchy_dirty_slots_(),
+      hierarchy_parents_(),
+      hierarchy_srcs_(),
+      hierarchy_dsts_(),
+      spatial_tree_(),
+      spatial_built_(false),
+      spatial_leaves_(),
+      spatial_dirty_(),
+      spatial_dirty_slots_(),
       free_light_ids_(),
       light_ids_(scene_->envInit.lightIDs),
       light_reverse_ids_(scene_->envInit.lightReverseIDs),
-      dirty_(true)
+      light_params_(sceneLightParams(*scene_)),
+      light_sampler_(scene_->envInit.lightSampling),
+      random_key_(random_key),
+      updates_ {
+          { ~0u, 0 },
+          { ~0u, 0 },
+          { ~0u, 0 },
+          true,
+      },
+      update_epoch_(nextUpdateEpoch())
 {
-    // FIXME use EnvironmentInit lights
- 
-    randomizeMaterials(instance_materials_, scene_->numMaterials);
+    randomize();
 }
 
 void Environment::reset()
 {
-    instances_ = scene_->envInit.defaultInstances;
-    instance_materials_ = scene_->envInit.defaultInstanceMaterials;
-    transforms_ = scene_->envInit.defaultTransforms;
-    instance_flags_ = scene_->envInit.defaultInstanceFlags;
-    index_map_ = scene_->envInit.indexMap;
-    reverse_id_map_ = scene_->envInit.reverseIDMap;
+    instances_.reset();
+    instance_materials_.reset();
+    transforms_.reset();
+    instance_flags_.reset();
+    reverse_id_map_.reset();
+    num_free_materials_ = 0;
+
+    // Default instances get their original handles back. Slots added
+    // since are retired with a new generation so handles from before the
+    // reset don't alias instances added after it.
+    uint32_t num_default_slots = scene_->envInit.indexMap.size();
+    uint32_t num_slots = index_map_.size();
+
+    vector<uint32_t> retired_slots;
+    retired_slots.reserve(num_slots - num_default_slots);
+    for (uint32_t slot = num_default_slots; slot < num_slots; slot++) {
+        uint32_t entry = index_map_[slot];
+        uint32_t generation = InstanceID::generation(entry);
+        if (InstanceID::slot(entry) != InstanceID::slotMask) {
+            generation = (generation + 1) & InstanceID::generationMask;
+        }
+
+        retired_slots.push_back(
+            InstanceID::make(InstanceID::slotMask, generation));
+    }
+
+    index_map_.reset();
+    for (uint32_t entry : retired_slots) {
+        index_map_.push_back(entry);
+    }
+
     free_ids_.clear();
+    for (uint32_t slot = num_slots; slot > num_default_slots; slot--) {
+        free_ids_.push_back(slot - 1);
+    }
+
+    parents_.reset();
+    local_transforms_.reset();
+    num_children_.reset();
+    custom_hierarchy_order_ = false;
+    hierarchy_order_valid_ = true;
+
+    clearDerivedState();
+
+    vector<LightParams> scene_params = sceneLightParams(*scene_);
+    syncBackendLights(CowArray<uint32_t>(scene_->envInit.lightReverseIDs),
+                      scene_params);
+    light_params_ = move(scene_params);
     free_light_ids_.clear();
-    light_ids_ = scene_->envInit.lightIDs;
-    light_reverse_ids_ = scene_->envInit.lightReverseIDs;
+    light_ids_.reset();
+    light_reverse_ids_.reset();
+    light_sampler_.reset();
+
+    random_key_.episode++;
+    randomize();
+
+    setDirty();
+}
 
-    randomizeMaterials(instance_materials_, scene_->numMaterials);
+void Environment::clearDerivedState()
+{
+    for (uint32_t slot : hierarchy_dirty_slots_) {
+        hierarchy_dirty_[slot] = 0;
+    }
+    hierarchy_dirty_slots_.clear();
+
+    // Rebuilt by the next query
+    spatial_tree_.clear();
+    spatial_built_ = false;
+    spatial_leaves_.clear();
+    spatial_dirty_.clear();
+    spatial_dirty_slots_.clear();
+}
+
+void Environment::setRandomKey(const RandomKey &key)
+{
+    random_key_ = key;
+    randomize();
 
     setDirty();
 }
 
+void Environment::randomize()
+{
+    randomizeMaterials(instance_materials_, scene_->numMaterials,
+                       random_key_);
+
+    // Host only environments (benchmarks) have no backend state
+    if (backend_.getState()) {
+        backend_.randomize(random_key_);
+    }
+}
+
+size_t Environment::getOverrideBytes() const
+{
+    return instances_.numOwnedBytes() + instance_materials_.numOwnedBytes() +
+        transforms_.numOwnedBytes() + instance_flags_.numOwnedBytes() +
+        index_map_.numOwnedBytes() + reverse_id_map_.numOwnedBytes() +
+        free_ids_.capacity() * sizeof(uint32_t) +
+        batch_dsts_.capacity() * sizeof(InstanceTransform *) +
+        parents_.numOwnedBytes() + local_transforms_.numOwnedBytes() +
+        num_children_.numOwnedBytes() +
+        (hierarchy_order_.capacity() + hierarchy_levels_.capacity() +
+         hierarchy_dirty_slots_.capacity()) * sizeof(uint32_t) +
+        hierarchy_dirty_.capacity() +
+        spatial_tree_.getNumBytes() +
+        (spatial_leaves_.capacity() + spatial_dirty_slots_.capacity()) *
+            sizeof(uint32_t) +
+        spatial_dirty_.capacity() +
+        free_light_ids_.capacity() * sizeof(uint32_t) +
+        light_ids_.numOwnedBytes() + light_reverse_ids_.numOwnedBytes() +
+        light_params_.capacity() * sizeof(LightParams) +
+        light_sampler_.numOwnedBytes();
+}
+
+static constexpr uint32_t snapshotMagic = 0x534e4150;
+static constexpr uint32_t snapshotVersion = 3;
+
+// Snapshots only restore onto environments of a scene that matches in
+// these counts
+struct SnapshotSceneInfo {
+    uint32_t numInstances;
+    uint32_t numInstanceMaterials;
+    uint32_t numHierarchySlots;
+    uint32_t numLights;
+    uint32_t numObjects;
+    uint32_t numMaterials;
+};
+
+static SnapshotSceneInfo makeSnapshotSceneInfo(const Scene &scene)
+{
+    const EnvironmentInit &init = scene.envInit;
+
+    return SnapshotSceneInfo {
+        uint32_t(init.defaultInstances.size()),
+        uint32_t(init.defaultInstanceMaterials.size()),
+        uint32_t(init.defaultParents.size()),
+        uint32_t(init.lightIDs.size()),
+        uint32_t(scene.objectInfo.size()),
+        scene.numMaterials,
+    };
+}
+
+// ids maps each ID to a dense index (get_idx extracts it from the entry)
+// or free_idx, reverse_ids maps dense indices back to IDs. Checks both
+// directions agree and free_ids lists every other ID exactly once.
+template <typename IndexFn>
+static bool validIDMap(const CowArray<uint32_t> &ids,
+                       const CowArray<uint32_t> &reverse_ids,
+                       const vector<uint32_t> &free_ids,
+                       uint32_t free_idx,
+                       IndexFn &&get_idx)
+{
+    if (ids.size() >= free_idx ||
+        reverse_ids.size() + free_ids.size() != ids.size()) {
+        return false;
+    }
+
+    for (uint32_t idx = 0; idx < reverse_ids.size(); idx++) {
+        uint32_t id = reverse_ids[idx];
+        if (id >= ids.size() || get_idx(ids[id]) != idx) {
+            return false;
+        }
+    }
+
+    vector<uint8_t> seen(ids.size(), 0);
+    for (uint32_t id : free_ids) {
+        if (id >= ids.size() || seen[id] || get_idx(ids[id]) != free_idx) {
+            return false;
+        }
+        seen[id] = 1;
+    }
+
+    return true;
+}
+
+// Links only between live slots, child counts matching the links and no
+// cycles, which updateHierarchy would never leave
+static bool validHierarchy(const CowArray<uint32_t> &parents,
+                           const CowArray<uint32_t> &num_children,
+                           const CowArray<uint32_t> &index_map)
+{
+    uint32_t num_slots = parents.size();
+    auto isLive = [&](uint32_t slot) {
+        return InstanceID::slot(index_map[slot]) != InstanceID::slotMask;
+    };
+
+    vector<uint32_t> counts(num_slots, 0);
+    for (uint32_t slot = 0; slot < num_slots; slot++) {
+        uint32_t parent = parents[slot];
+        if (parent == Environment::noParent) {
+            continue;
+        }
+
+        if (parent >= num_slots || !isLive(slot) || !isLive(parent)) {
+            return false;
+        }
+        counts[parent]++;
+    }
+
+    for (uint32_t slot = 0; slot < num_slots; slot++) {
+        if (num_children[slot] != counts[slot]) {
+            return false;
+        }
+    }
+
+    // 1 while on the current path up, 2 once known to reach a root
+    vector<uint8_t> state(num_slots, 0);
+    vector<uint32_t> path;
+    for (uint32_t slot = 0; slot < num_slots; slot++) {
+        uint32_t cur = slot;
+        while (cur != Environment::noParent && state[cur] == 0) {
+            state[cur] = 1;
+            path.push_back(cur);
+            cur = parents[cur];
+        }
+
+        if (cur != Environment::noParent && state[cur] == 1) {
+            return false;
+        }
+
+        for (uint32_t path_slot : path) {
+            state[path_slot] = 2;
+        }
+        path.clear();
+    }
+
+    return true;
+}
+
+EnvironmentSnapshot Environment::snapshot()
+{
+    updateHierarchy();
+
+    const EnvironmentInit &init = scene_->envInit;
+
+    EnvironmentSnapshot snapshot;
+    SnapshotWriter writer(snapshot.data);
+
+    writer.write(snapshotMagic);
+    writer.write(snapshotVersion);
+    writer.write(makeSnapshotSceneInfo(*scene_));
+
+    writer.write(camera_);
+    writer.write(random_key_);
+
+    writer.writeCow(instances_, init.defaultInstances);
+    writer.writeCow(instance_materials_, init.defaultInstanceMaterials);
+    writer.writeCow(transforms_, init.defaultTransforms);
+    writer.writeCow(instance_flags_, init.defaultInstanceFlags);
+    writer.writeCow(index_map_, init.indexMap);
+    writer.writeCow(reverse_id_map_, init.reverseIDMap);
+    writer.writeVector(free_ids_);
+    writer.write(num_free_materials_);
+
+    writer.write(uint8_t(custom_hierarchy_order_));
+    writer.writeCow(parents_, init.defaultParents);
+    writer.writeCow(local_transforms_, init.defaultLocalTransforms);
+    writer.writeCow(num_children_, init.defaultNumChildren);
+
+    writer.writeCow(light_ids_, init.lightIDs);
+    writer.writeCow(light_reverse_ids_, init.lightReverseIDs);
+    writer.writeVector(free_light_ids_);
+    writer.writeVector(light_params_);
+    writer.writeCow(light_sampler_.getPowers(), init.lightSampling.powers);
+
+    return snapshot;
+}
+
+bool Environment::restore(const EnvironmentSnapshot &snapshot)
+{
+    const EnvironmentInit &init = scene_->envInit;
+    SnapshotReader reader(snapshot.data.data(), snapshot.data.size());
+
+    uint32_t magic, version;
+    SnapshotSceneInfo scene_info;
+    if (!reader.read(magic) || magic != snapshotMagic ||
+        !reader.read(version) || version != snapshotVersion ||
+        !reader.read(scene_info)) {
+        return false;
+    }
+
+    SnapshotSceneInfo expected_info = makeSnapshotSceneInfo(*scene_);
+    if (memcmp(&scene_info, &expected_info, sizeof(SnapshotSceneInfo))) {
+        return false;
+    }
+
+    // Everything is read into temporaries, so a malformed snapshot leaves
+    // the environment untouched
+    Camera camera = camera_;
+    RandomKey random_key;
+    CowArray<ObjectInstance> instances;
+    CowArray<uint32_t> instance_materials;
+    CowArray<InstanceTransform> transforms;
+    CowArray<InstanceFlags> instance_flags;
+    CowArray<uint32_t> index_map;
+    CowArray<uint32_t> reverse_id_map;
+    vector<uint32_t> free_ids;
+    uint32_t num_free_materials = 0;
+    uint8_t custom_hierarchy_order = 0;
+    CowArray<uint32_t> parents;
+    CowArray<InstanceTransform> local_transforms;
+    CowArray<uint32_t> num_children;
+    CowArray<uint32_t> light_ids;
+    CowArray<uint32_t> light_reverse_ids;
+    vector<uint32_t> free_light_ids;
+    vector<LightParams> light_params;
+    CowArray<float> light_powers;
+
+    bool valid = reader.read(camera) &&
+        reader.read(random_key) &&
+        reader.readCow(instances, init.defaultInstances) &&
+        reader.readCow(instance_materials, init.defaultInstanceMaterials) &&
+        reader.readCow(transforms, init.defaultTransforms) &&
+        reader.readCow(instance_flags, init.defaultInstanceFlags) &&
+        reader.readCow(index_map, init.indexMap) &&
+        reader.readCow(reverse_id_map, init.reverseIDMap) &&
+        reader.readVector(free_ids) &&
+        reader.read(num_free_materials) &&
+        reader.read(custom_hierarchy_order) &&
+        reader.readCow(parents, init.defaultParents) &&
+        reader.readCow(local_transforms, init.defaultLocalTransforms) &&
+        reader.readCow(num_children, init.defaultNumChildren) &&
+        reader.readCow(light_ids, init.lightIDs) &&
+        reader.readCow(light_reverse_ids, init.lightReverseIDs) &&
+        reader.readVector(free_light_ids) &&
+        reader.readVector(light_params) &&
+        reader.readCow(light_powers, init.lightSampling.powers) &&
+        reader.remaining() == 0;
+
+    uint32_t num_instances = instances.size();
+    valid = valid &&
+        transforms.size() == num_instances &&
+        instance_flags.size() == num_instances &&
+        reverse_id_map.size() == num_instances &&
+        index_map.size() == num_instances + free_ids.size() &&
+        num_free_materials <= instance_materials.size() &&
+        local_transforms.size() == parents.size() &&
+        num_children.size() == parents.size() &&
+        parents.size() <= index_map.size() &&
+        light_params.size() == light_ids.size() &&
+        light_reverse_ids.size() + free_light_ids.size() == light_ids.size() &&
+        light_powers.size() == light_reverse_ids.size();
+
+    if (!valid) {
+        return false;
+    }
+
+    // Everything below is used as an index without further checks
+    for (uint32_t inst_idx = 0; inst_idx < num_instances; inst_idx++) {
+        const ObjectInstance &inst = instances[inst_idx];
+        if (inst.objectIndex >= scene_->objectInfo.size() ||
+            uint64_t(inst.materialOffset) +
+                scene_->objectInfo[inst.objectIndex].numMeshes >
+                instance_materials.size()) {
+            return false;
+        }
+    }
+
+    for (uint32_t mat_idx : instance_materials) {
+        if (mat_idx >= scene_->numMaterials) {
+            return false;
+        }
+    }
+
+    if (!validIDMap(index_map, reverse_id_map, free_ids,
+                    InstanceID::slotMask, [](uint32_t entry) {
+                        return InstanceID::slot(entry);
+                    }) ||
+        !validHierarchy(parents, num_children, index_map) ||
+        !validIDMap(light_ids, light_reverse_ids, free_light_ids, ~0u,
+                    [](uint32_t entry) { return entry; })) {
+        return false;
+    }
+
+    for (const LightParams &params : light_params) {
+        if (params.sceneLightIdx != ~0u &&
+            params.sceneLightIdx >= init.lights.size()) {
+            return false;
+        }
+    }
+
+    for (float power : light_powers) {
+        if (!(power >= 0.f) || !isfinite(power)) {
+            return false;
+        }
+    }
+
+    camera_ = camera;
+
+    instances_ = move(instances);
+    instance_materials_ = move(instance_materials);
+    transforms_ = move(transforms);
+    instance_flags_ = move(instance_flags);
+    index_map_ = move(index_map);
+    reverse_id_map_ = move(reverse_id_map);
+    free_ids_ = move(free_ids);
+    num_free_materials_ = num_free_materials;
+
+    parents_ = move(parents);
+    local_transforms_ = move(local_transforms);
+    num_children_ = move(num_children);
+    custom_hierarchy_order_ = custom_hierarchy_order != 0;
+    hierarchy_order_valid_ = !custom_hierarchy_order_;
+
+    clearDerivedState();
+
+    syncBackendLights(light_reverse_ids, light_params);
+    light_params_ = move(light_params);
+    light_ids_ = move(light_ids);
+    light_reverse_ids_ = move(light_reverse_ids);
+    free_light_ids_ = move(free_light_ids);
+    light_sampler_.assign(move(light_powers));
+
+    // Materials come from the snapshot, only domain parameters are redrawn
+    random_key_ = random_key;
+    if (backend_.getState()) {
+        backend_.randomize(random_key_);
+    }
+
+    setDirty();
+
+    return true;
+}
+
+Environment::Environment(EnvironmentImpl &&backend, const Environment &src)
+    : backend_(move(backend)),
+      scene_(src.scene_),
+      camera_(src.camera_),
+      instances_(src.instances_.fork()),
+      instance_materials_(src.instance_materials_.fork()),
+      transforms_(src.transforms_.fork()),
+      instance_flags_(src.instance_flags_.fork()),
+      index_map_(src.index_map_.fork()),
+      reverse_id_map_(src.reverse_id_map_.fork()),
+      free_ids_(src.free_ids_),
+      num_free_materials_(src.num_free_materials_),
+      batch_dsts_(),
+      batch_discard_(),
+      parents_(src.parents_.fork()),
+      local_transforms_(src.local_transforms_.fork()),
+      num_children_(src.num_children_.fork()),
+      custom_hierarchy_order_(src.custom_hierarchy_order_),
+      hierarchy_order_valid_(src.hierarchy_order_valid_),
+      hierarchy_order_(src.hierarchy_order_),
+      hierarchy_levels_(src.hierarchy_levels_),
+      hierarchy_dirty_(src.hierarchy_dirty_),
+      hierarchy_dirty_slots_(src.hierarchy_dirty_slots_),
+      hierarchy_parents_(),
+      hierarchy_srcs_(),
+      hierarchy_dsts_(),
+      spatial_tree_(),
+      spatial_built_(false),
+      spatial_leaves_(),
+      spatial_dirty_(),
+      spatial_dirty_slots_(),
+      free_light_ids_(src.free_light_ids_),
+      // The new backend starts out with the scene's lights
+      light_ids_(scene_->envInit.lightIDs),
+      light_reverse_ids_(scene_->envInit.lightReverseIDs),
+      light_params_(sceneLightParams(*scene_)),
+      light_sampler_(src.light_sampler_.fork()),
+      random_key_(src.random_key_),
+      updates_ {
+          { ~0u, 0 },
+          { ~0u, 0 },
+          { ~0u, 0 },
+          true,
+      },
+      update_epoch_(nextUpdateEpoch())
+{
+    syncBackendLights(src.light_reverse_ids_, src.light_params_);
+    light_params_ = src.light_params_;
+    light_ids_ = src.light_ids_.fork();
+    light_reverse_ids_ = src.light_reverse_ids_.fork();
+
+    if (backend_.getState()) {
+        backend_.randomize(random_key_);
+    }
+}
+
+Environment Environment::fork(EnvironmentImpl &&backend) const
+{
+    return Environment(move(backend), *this);
+}
+
+vector<Environment::LightParams> Environment::sceneLightParams(
+    const Scene &scene)
+{
+    uint32_t num_lights = scene.envInit.lights.size();
+
+    vector<LightParams> params;
+    params.reserve(num_lights);
+    for (uint32_t light_idx = 0; light_idx < num_lights; light_idx++) {
+        params.push_back({ glm::vec3(0.f), glm::vec3(0.f), light_idx });
+    }
+
+    return params;
+}
+
+void Environment::syncBackendLights(
+    const CowArray<uint32_t> &target_reverse_ids,
+    const vector<LightParams> &target_params)
+{
+    if (!backend_.getState()) {
+        return;
+    }
+
+    // Backend lights are swap removed, so only the common prefix of the
+    // two orders can be kept. IDs are reused, so the prefix compares what
+    // the backend holds rather than IDs. Everything after it is popped and
+    // re-added, scene lights with their original descriptors.
+    auto sameLight = [](const LightParams &a, const LightParams &b) {
+        if (a.sceneLightIdx != ~0u || b.sceneLightIdx != ~0u) {
+            return a.sceneLightIdx == b.sceneLightIdx;
+        }
+
+        return a.position == b.position && a.color == b.color;
+    };
+
+    uint32_t num_cur = light_reverse_ids_.size();
+    uint32_t num_target = target_reverse_ids.size();
+
+    uint32_t num_kept = 0;
+    while (num_kept < num_cur && num_kept < num_target &&
+           sameLight(light_params_[light_reverse_ids_[num_kept]],
+                     target_params[target_reverse_ids[num_kept]])) {
+        num_kept++;
+    }
+
+    for (uint32_t light_idx = num_cur; light_idx > num_kept; light_idx--) {
+        backend_.removeLight(light_idx - 1);
+    }
+
+    for (uint32_t light_idx = num_kept; light_idx < num_target;
+         light_idx++) {
+        const LightParams &params =
+            target_params[target_reverse_ids[light_idx]];
+        if (params.sceneLightIdx != ~0u) {
+            backend_.addSceneLight(params.sceneLightIdx);
+        } else {
+            backend_.addLight(params.position, params.color);
+        }
+    }
+}
+
+uint64_t Environment::nextUpdateEpoch()
+{
+    static atomic_uint64_t next_epoch(0);
+
+    return next_epoch.fetch_add(1, memory_order_relaxed);
+}
+
 void Environment::deleteInstance(uint32_t inst_id)
 {
-    // FIXME, deal with instance_materials_
-    uint32_t instance_idx = index_map_[inst_id];
-    if (instances_.size() > 1) {
+    if (!isValidInstance(inst_id)) {
+        return;
+    }
+
+    uint32_t slot = InstanceID::slot(inst_id);
+    detachFromHierarchy(slot);
+
+    if (slot < spatial_leaves_.size() &&
+        spatial_leaves_[slot] != AABBTree::nullNode) {
+        spatial_tree_.remove(spatial_leaves_[slot]);
+        spatial_leaves_[slot] = AABBTree::nullNode;
+    }
+
+    uint32_t instance_idx = getInstanceIndex(inst_id);
+    uint32_t last_idx = instances_.size() - 1;
+
+    num_free_materials_ +=
+        scene_->objectInfo[instances_[instance_idx].objectIndex].numMeshes;
+
+    if (instance_idx != last_idx) {
         // Keep contiguous
-        instances_[instance_idx] = instances_.back();
-        transforms_[instance_idx] = transforms_.back();
-        reverse_id_map_[instance_idx] = reverse_id_map_.back();
-        index_map_[reverse_id_map_[instance_idx]] = instance_idx;
+        instances_.mut(instance_idx) = instances_[last_idx];
+        transforms_.mut(instance_idx) = transforms_[last_idx];
+        instance_flags_.mut(instance_idx) = instance_flags_[last_idx];
+
+        uint32_t moved_slot = reverse_id_map_[last_idx];
+        reverse_id_map_.mut(instance_idx) = moved_slot;
+        index_map_.mut(moved_slot) = InstanceID::make(instance_idx,
+            InstanceID::generation(index_map_[moved_slot]));
     }
     instances_.pop_back();
     transforms_.pop_back();
+    instance_flags_.pop_back();
     reverse_id_map_.pop_back();
 
-    free_ids_.push_back(inst_id);
+    uint32_t next_generation =
+        (InstanceID::generation(inst_id) + 1) & InstanceID::generationMask;
+    index_map_.mut(slot) =
+        InstanceID::make(InstanceID::slotMask, next_generation);
+    free_ids_.push_back(slot);
+
+    // Amortized O(1): only compact once at least half of the material
+    // entries are garbage
+    if (num_free_materials_ * 2 > instance_materials_.size()) {
+        compactInstanceMaterials();
+    }
+
+    setDirty();
+}
+
+void Environment::compactInstanceMaterials()
+{
+    vector<uint32_t> compacted;
+    compacted.reserve(instance_materials_.size() - num_free_materials_);
+
+    // Deleted instances are swapped with the last one, so offsets aren't
+    // in instance order and the materials can't be moved in place
+    for (uint32_t inst_idx = 0; inst_idx < instances_.size(); inst_idx++) {
+        const ObjectInstance &inst = instances_[inst_idx];
+        uint32_t num_mats = scene_->objectInfo[inst.objectIndex].numMeshes;
+
+        uint32_t new_offset = compacted.size();
+        for (uint32_t i = 0; i < num_mats; i++) {
+            compacted.push_back(instance_materials_[inst.materialOffset + i]);
+        }
+
+        if (inst.materialOffset != new_offset) {
+            instances_.mut(inst_idx).materialOffset = new_offset;
+        }
+    }
+
+    // Compare before writing, entries that land where they already were
+    // keep sharing their chunk
+    for (uint32_t mat_idx = 0; mat_idx < compacted.size(); mat_idx++) {
+        if (instance_materials_[mat_idx] != compacted[mat_idx]) {
+            instance_materials_.mut(mat_idx) = compacted[mat_idx];
+        }
+    }
+
+    while (instance_materials_.size() > compacted.size()) {
+        instance_materials_.pop_back();
+    }
+
+    num_free_materials_ = 0;
+}
+
+void Environment::setInstanceTransforms(const uint32_t *inst_ids,
+                                        const glm::vec3 *positions,
+                                        const glm::quat *rotations,
+                                        size_t num_instances)
+{
+    if (num_instances == 0) {
+        return;
+    }
+
+    batch_dsts_.resize(num_instances);
+
+    uint32_t min_idx = ~0u;
+    uint32_t max_idx = 0;
+    for (size_t i = 0; i < num_instances; i++) {
+        if (!isValidInstance(inst_ids[i])) {
+            batch_dsts_[i] = &batch_discard_;
+            continue;
+        }
+
+        uint32_t idx = getInstanceIndex(inst_ids[i]);
+        batch_dsts_[i] = &transforms_.mut(idx);
+
+        min_idx = min(min_idx, idx);
+        max_idx = max(max_idx, idx);
+
+        markTransformDirty(InstanceID::slot(inst_ids[i]));
+    }
+
+    computeRigidTransforms(positions, rotations, batch_dsts_.data(),
+                           num_instances);
+
+    if (min_idx <= max_idx) {
+        updates_.transforms.add(min_idx, max_idx + 1);
+    }
+}
+
+void Environment::setInstanceTransforms(const uint32_t *inst_ids,
+                                        const CompactTransform *transforms,
+                                        size_t num_instances)
+{
+    if (num_instances == 0) {
+        return;
+    }
+
+    batch_dsts_.resize(num_instances);
+
+    uint32_t min_idx = ~0u;
+    uint32_t max_idx = 0;
+    for (size_t i = 0; i < num_instances; i++) {
+        if (!isValidInstance(inst_ids[i])) {
+            batch_dsts_[i] = &batch_discard_;
+            continue;
+        }
+
+        uint32_t idx = getInstanceIndex(inst_ids[i]);
+        batch_dsts_[i] = &transforms_.mut(idx);
+
+        min_idx = min(min_idx, idx);
+        max_idx = max(max_idx, idx);
+
+        markTransformDirty(InstanceID::slot(inst_ids[i]));
+    }
+
+    expandTransforms(transforms, batch_dsts_.data(), num_instances);
+
+    if (min_idx <= max_idx) {
+        updates_.transforms.add(min_idx, max_idx + 1);
+    }
+}
+
+void Environment::setInstanceMaterials(const uint32_t *inst_ids,
+                                       const uint32_t *material_idxs,
+                                       uint32_t num_mats_per_instance,
+                                       size_t num_instances)
+{
+    for (size_t i = 0; i < num_instances; i++) {
+        if (!isValidInstance(inst_ids[i])) {
+            continue;
+        }
+
+        const ObjectInstance &inst = instances_[getInstanceIndex(inst_ids[i])];
+        if (scene_->objectInfo[inst.objectIndex].numMeshes !=
+                num_mats_per_instance) {
+            continue;
+        }
+
+        // Only write entries that change, so chunks shared with the scene
+        // defaults or a forked environment stay shared
+        uint32_t mat_offset = inst.materialOffset;
+        const uint32_t *src = material_idxs + i * num_mats_per_instance;
+        bool changed = false;
+        for (uint32_t j = 0; j < num_mats_per_instance; j++) {
+            if (instance_materials_[mat_offset + j] != src[j]) {
+                instance_materials_.mut(mat_offset + j) = src[j];
+                changed = true;
+            }
+        }
+
+        if (changed) {
+            updates_.materials.add(mat_offset,
+                                   mat_offset + num_mats_per_instance);
+        }
+    }
+}
+
+bool Environment::setInstanceParent(uint32_t child_id, uint32_t parent_id)
+{
+    if (!isValidInstance(child_id) ||
+        (parent_id != noParent && !isValidInstance(parent_id))) {
+        return false;
+    }
+
+    uint32_t child_slot = InstanceID::slot(child_id);
+    uint32_t parent_slot =
+        parent_id == noParent ? noParent : InstanceID::slot(parent_id);
+
+    // Walking up from the new parent must not reach the child
+    uint32_t ancestor = parent_slot;
+    while (ancestor != noParent) {
+        if (ancestor == child_slot) {
+            return false;
+        }
+
+        ancestor = ancestor < parents_.size() ? parents_[ancestor] : noParent;
+    }
+
+    // Local transforms are relative to the up to date parent transform
+    updateHierarchy();
+    growHierarchy(index_map_.size());
+
+    uint32_t old_parent = parents_[child_slot];
+    if (old_parent == parent_slot) {
+        return true;
+    }
+
+    if (old_parent != noParent) {
+        num_children_.mut(old_parent)--;
+    }
+
+    parents_.mut(child_slot) = parent_slot;
+
+    if (parent_slot != noParent) {
+        num_children_.mut(parent_slot)++;
+
+        const InstanceTransform *parent_txfm =
+            &transforms_[getInstanceIndex(parent_id)];
+        const InstanceTransform *child_txfm =
+            &transforms_[getInstanceIndex(child_id)];
+        InstanceTransform *local_txfm = &local_transforms_.mut(child_slot);
+
+        relativeTransforms(&parent_txfm, &child_txfm, &local_txfm, 1);
+    }
+
+    custom_hierarchy_order_ = true;
+    hierarchy_order_valid_ = false;
+
+    return true;
+}
+
+void Environment::updateHierarchy()
+{
+    if (hierarchy_dirty_slots_.empty()) {
+        return;
+    }
+
+    if (custom_hierarchy_order_ && !hierarchy_order_valid_) {
+        buildHierarchyOrder(parents_, hierarchy_order_, hierarchy_levels_);
+        hierarchy_order_valid_ = true;
+    }
+
+    const EnvironmentInit &init = scene_->envInit;
+    const vector<uint32_t> &order =
+        custom_hierarchy_order_ ? hierarchy_order_ : init.hierarchyOrder;
+    const vector<uint32_t> &levels =
+        custom_hierarchy_order_ ? hierarchy_levels_ : init.hierarchyLevels;
+
+    hierarchy_dirty_.resize(parents_.size(), 0);
+
+    auto denseIndex = [this](uint32_t slot) {
+        return InstanceID::slot(index_map_[slot]);
+    };
+
+    // Roots are left alone, so start at depth 1. Each depth only reads
+    // transforms finalized by the previous one.
+    for (uint32_t level = 1; level + 1 < levels.size(); level++) {
+        uint32_t level_begin = levels[level];
+        uint32_t level_end = levels[level + 1];
+
+        // Children written directly: local = parent^-1 * world
+        hierarchy_parents_.clear();
+        hierarchy_srcs_.clear();
+        hierarchy_dsts_.clear();
+        for (uint32_t idx = level_begin; idx < level_end; idx++) {
+            uint32_t slot = order[idx];
+            if (!(hierarchy_dirty_[slot] & HierarchyWorldDirty)) {
+                continue;
+            }
+
+            hierarchy_parents_.push_back(
+                &transforms_[denseIndex(parents_[slot])]);
+            hierarchy_srcs_.push_back(&transforms_[denseIndex(slot)]);
+            hierarchy_dsts_.push_back(&local_transforms_.mut(slot));
+        }
+
+        relativeTransforms(hierarchy_parents_.data(), hierarchy_srcs_.data(),
+                           hierarchy_dsts_.data(), hierarchy_dsts_.size());
+
+        // Everything else below a changed parent: world = parent * local
+        hierarchy_parents_.clear();
+        hierarchy_srcs_.clear();
+        hierarchy_dsts_.clear();
+        for (uint32_t idx = level_begin; idx < level_end; idx++) {
+            uint32_t slot = order[idx];
+            uint32_t parent = parents_[slot];
+            uint8_t &dirty = hierarchy_dirty_[slot];
+
+            if ((dirty & HierarchyWorldDirty) ||
+                (!(dirty & HierarchyLocalDirty) &&
+                 hierarchy_dirty_[parent] == 0)) {
+                continue;
+            }
+
+            if (dirty == 0) {
+                hierarchy_dirty_slots_.push_back(slot);
+            }
+            dirty |= HierarchyParentMoved;
+
+            uint32_t dense_idx = denseIndex(slot);
+            hierarchy_parents_.push_back(&transforms_[denseIndex(parent)]);
+            hierarchy_srcs_.push_back(&local_transforms_[slot]);
+            hierarchy_dsts_.push_back(&transforms_.mut(dense_idx));
+
+            updates_.transforms.add(dense_idx);
+            markSpatialDirty(slot);
+        }
+
+        composeTransforms(hierarchy_parents_.data(), hierarchy_srcs_.data(),
+                          hierarchy_dsts_.data(), hierarchy_dsts_.size());
+    }
+
+    for (uint32_t slot : hierarchy_dirty_slots_) {
+        hierarchy_dirty_[slot] = 0;
+    }
+    hierarchy_dirty_slots_.clear();
+}
+
+void Environment::growHierarchy(uint32_t num_slots)
+{
+    while (parents_.size() < num_slots) {
+        parents_.push_back(noParent);
+        local_transforms_.push_back({
+            glm::mat4x3(1.f),
+            glm::mat4x3(1.f),
+        });
+        num_children_.push_back(0);
+    }
+}
+
+void Environment::detachFromHierarchy(uint32_t slot)
+{
+    if (slot >= parents_.size() ||
+        (parents_[slot] == noParent && num_children_[slot] == 0)) {
+        return;
+    }
+
+    // Children stay where the pending updates would have put them
+    updateHierarchy();
+
+    uint32_t parent = parents_[slot];
+    if (parent != noParent) {
+        num_children_.mut(parent)--;
+        parents_.mut(slot) = noParent;
+    }
+
+    // Children become roots, their transforms are already final
+    if (num_children_[slot] > 0) {
+        for (uint32_t child = 0; child < parents_.size(); child++) {
+            if (parents_[child] == slot) {
+                parents_.mut(child) = noParent;
+            }
+        }
+
+        num_children_.mut(slot) = 0;
+    }
+
+    custom_hierarchy_order_ = true;
+    hierarchy_order_valid_ = false;
+}
+
+void Environment::computeWorldBounds(uint32_t instance_idx, glm::vec3 &min,
+                                     glm::vec3 &max) const
+{
+    const glm::mat4x3 &txfm = transforms_[instance_idx].mat;
+    const vector<AABB> &obj_bounds = scene_->envInit.objectBounds;
+
+    if (obj_bounds.size() == 0) {
+        min = txfm[3];
+        max = txfm[3];
+        return;
+    }
+
+    const AABB &bounds = obj_bounds[instances_[instance_idx].objectIndex];
+
+    // Transformed center, extents projected onto the world axes
+    glm::vec3 center = 0.5f * (bounds.pMin + bounds.pMax);
+    glm::vec3 extent = 0.5f * (bounds.pMax - bounds.pMin);
+
+    glm::vec3 world_center = txfm * glm::vec4(center, 1.f);
+    glm::vec3 world_extent =
+        glm::abs(txfm[0]) * extent.x +
+        glm::abs(txfm[1]) * extent.y +
+        glm::abs(txfm[2]) * extent.z;
+
+    min = world_center - world_extent;
+    max = world_center + world_extent;
+}
+
+void Environment::syncSpatialIndex()
+{
+    updateHierarchy();
+
+    glm::vec3 min, max;
+
+    if (!spatial_built_) {
+        spatial_tree_.clear();
+        spatial_leaves_.assign(index_map_.size(), AABBTree::nullNode);
+
+        for (uint32_t inst_idx = 0; inst_idx < instances_.size();
+             inst_idx++) {
+            uint32_t slot = reverse_id_map_[inst_idx];
+            computeWorldBounds(inst_idx, min, max);
+            spatial_leaves_[slot] = spatial_tree_.insert(min, max, slot);
+        }
+
+        spatial_built_ = true;
+        return;
+    }
+
+    spatial_leaves_.resize(index_map_.size(), AABBTree::nullNode);
+
+    for (uint32_t slot : spatial_dirty_slots_) {
+        spatial_dirty_[slot] = 0;
+
+        uint32_t inst_idx = InstanceID::slot(index_map_[slot]);
+        if (inst_idx == InstanceID::slotMask) {
+            continue;
+        }
+
+        computeWorldBounds(inst_idx, min, max);
+
+        uint32_t &leaf = spatial_leaves_[slot];
+        if (leaf == AABBTree::nullNode) {
+            leaf = spatial_tree_.insert(min, max, slot);
+        } else {
+            spatial_tree_.update(leaf, min, max);
+        }
+    }
+    spatial_dirty_slots_.clear();
+}
+
+void Environment::queryInstancesOverlap(const glm::vec3 &min,
+                                        const glm::vec3 &max,
+                                        vector<uint32_t> &out)
+{
+    syncSpatialIndex();
+
+    auto overlaps = [&](const glm::vec3 &box_min, const glm::vec3 &box_max) {
+        return glm::all(glm::lessThanEqual(box_min, max)) &&
+            glm::all(glm::lessThanEqual(min, box_max));
+    };
+
+    spatial_tree_.query(overlaps, [&](uint32_t slot) {
+        uint32_t inst_idx = InstanceID::slot(index_map_[slot]);
+
+        glm::vec3 inst_min, inst_max;
+        computeWorldBounds(inst_idx, inst_min, inst_max);
+        if (overlaps(inst_min, inst_max)) {
+            out.push_back(getInstanceID(inst_idx));
+        }
+    });
+}
+
+void Environment::queryInstancesRadius(const glm::vec3 &center, float radius,
+                                       vector<uint32_t> &out)
+{
+    syncSpatialIndex();
+
+    float radius2 = radius * radius;
+    auto overlaps = [&](const glm::vec3 &box_min, const glm::vec3 &box_max) {
+        glm::vec3 closest = glm::clamp(center, box_min, box_max);
+        glm::vec3 delta = closest - center;
+        return glm::dot(delta, delta) <= radius2;
+    };
+
+    spatial_tree_.query(overlaps, [&](uint32_t slot) {
+        uint32_t inst_idx = InstanceID::slot(index_map_[slot]);
+
+        glm::vec3 inst_min, inst_max;
+        computeWorldBounds(inst_idx, inst_min, inst_max);
+        if (overlaps(inst_min, inst_max)) {
+            out.push_back(getInstanceID(inst_idx));
+        }
+    });
+}
+
+void Environment::queryInstancesFrustum(const glm::vec4 *planes,
+                                        uint32_t num_planes,
+                                        vector<uint32_t> &out)
+{
+    syncSpatialIndex();
+
+    // Outside if the corner furthest along the plane normal is behind it
+    auto overlaps = [&](const glm::vec3 &box_min, const glm::vec3 &box_max) {
+        for (uint32_t i = 0; i < num_planes; i++) {
+            const glm::vec4 &plane = planes[i];
+            glm::vec3 normal(plane);
+            glm::vec3 corner = glm::mix(box_min, box_max,
+                glm::greaterThanEqual(normal, glm::vec3(0.f)));
+
+            if (glm::dot(normal, corner) + plane.w < 0.f) {
+                return false;
+            }
+        }
+
+        return true;
+    };
+
+    spatial_tree_.query(overlaps, [&](uint32_t slot) {
+        uint32_t inst_idx = InstanceID::slot(index_map_[slot]);
+
+        glm::vec3 inst_min, inst_max;
+        computeWorldBounds(inst_idx, inst_min, inst_max);
+        if (overlaps(inst_min, inst_max)) {
+            out.push_back(getInstanceID(inst_idx));
+        }
+    });
+}
+
+void Environment::queryInstancesFrustum(const Camera &cam, float far_dist,
+                                        vector<uint32_t> &out)
+{
+    float tan_x = cam.tanFOV * cam.aspectRatio;
+    float tan_y = cam.tanFOV;
+
+    // Inward facing side planes through the camera position
+    glm::vec3 normals[] = {
+        cam.view * tan_x + cam.right,
+        cam.view * tan_x - cam.right,
+        cam.view * tan_y + cam.up,
+        cam.view * tan_y - cam.up,
+        cam.view,
+        -cam.view,
+    };
+
+    glm::vec4 planes[6];
+    for (int i = 0; i < 5; i++) {
+        planes[i] = glm::vec4(normals[i],
+                              -glm::dot(normals[i], cam.position));
+    }
+    planes[5] = glm::vec4(normals[5],
+        glm::dot(cam.view, cam.position) + far_dist);
+
+    queryInstancesFrustum(planes, 6, out);
+}
+
+uint32_t Environment::pickInstance(const glm::vec3 &origin,
+                                   const glm::vec3 &dir,
+                                   float max_t, float *hit_t)
+{
+    syncSpatialIndex();
+
+    glm::vec3 inv_dir = 1.f / dir;
+
+    uint32_t closest = ~0u;
+    float closest_t = max_t;
+    spatial_tree_.raycast(origin, dir, max_t, [&](uint32_t slot) {
+        uint32_t inst_idx = InstanceID::slot(index_map_[slot]);
+
+        glm::vec3 inst_min, inst_max;
+        computeWorldBounds(inst_idx, inst_min, inst_max);
+
+        float t;
+        if (AABBTree::intersectRay(inst_min, inst_max, origin, inv_dir,
+                                   closest_t, t) &&
+            (closest == ~0u || t < closest_t)) {
+            closest = getInstanceID(inst_idx);
+            closest_t = t;
+        }
+
+        return closest_t;
+    });
+
+    if (hit_t && closest != ~0u) {
+        *hit_t = closest_t;
+    }
+
+    return closest;
+}
+
+bool Environment::traceRays(const RayQuery *rays, uint32_t num_rays,
+                            RayQueryHit *hits)
+{
+    updateHierarchy();
+
+    return backend_.traceRays(*this, rays, num_rays, hits);
+}
+
+bool Environment::traceOcclusion(const RayQuery *rays, uint32_t num_rays,
+                                 uint8_t *occluded)
+{
+    updateHierarchy();
+
+    return backend_.traceOcclusion(*this, rays, num_rays, occluded);
+}
+
+// Point lights radiate over the whole sphere, same units as the area
+// light powers from computeLightPowers
+static float pointLightPower(const glm::vec3 &color)
+{
+    return 4.f * float(M_PI) * rgbLuminance(color);
 }
 
 uint32_t Environment::addLight(const glm::vec3 &position,
@@ -268,43 +1596,92 @@ uint32_t Environment::addLight(const glm::vec3 &position,
     if (free_light_ids_.size() > 0) {
         uint32_t free_id = free_light_ids_.back();
         free_light_ids_.pop_back();
-        light_ids_[free_id] = light_idx;
+        light_ids_.mut(free_id) = light_idx;
 
         light_id = free_id;
     } else {
         light_ids_.push_back(light_idx);
         light_id = light_ids_.size() - 1;
+        light_params_.emplace_back();
     }
 
-    light_reverse_ids_.push_back(light_idx);
+    light_reverse_ids_.push_back(light_id);
+    light_params_[light_id] = { position, color, ~0u };
+    light_sampler_.push(pointLightPower(color));
+
     return light_id;
 }
 
 void Environment::removeLight(uint32_t light_id)
 {
+    if (!isValidLight(light_id)) {
+        return;
+    }
+
     uint32_t light_idx = light_ids_[light_id];
     backend_.removeLight(light_idx);
+    light_sampler_.swapRemove(light_idx);
 
     if (light_reverse_ids_.size() > 1) {
-        light_reverse_ids_[light_idx] = light_reverse_ids_.back();
-        light_ids_[light_reverse_ids_[light_idx]] = light_idx;
+        light_reverse_ids_.mut(light_idx) = light_reverse_ids_.back();
+        light_ids_.mut(light_reverse_ids_[light_idx]) = light_idx;
     }
     light_reverse_ids_.pop_back();
 
+    light_ids_.mut(light_id) = ~0u;
     free_light_ids_.push_back(light_id);
 }
 
+void Environment::setLightColor(uint32_t light_id, const glm::vec3 &color)
+{
+    if (!isValidLight(light_id)) {
+        return;
+    }
+
+    light_params_[light_id].color = color;
+    light_sampler_.set(light_ids_[light_id], pointLightPower(color));
+}
+
+void Environment::updateLightSampling()
+{
+    light_sampler_.update();
+}
+
 uint32_t EnvironmentImpl::addLight(const glm::vec3 &position,
                                    const glm::vec3 &color)
 {
     return invoke(add_light_ptr_, state_, position, color);
 }
 
+uint32_t EnvironmentImpl::addSceneLight(uint32_t scene_light_idx)
+{
+    return invoke(add_scene_light_ptr_, state_, scene_light_idx);
+}
+
 void EnvironmentImpl::removeLight(uint32_t idx)
 {
     invoke(remove_light_ptr_, state_, idx);
 }
 
+void EnvironmentImpl::randomize(const RandomKey &key)
+{
+    invoke(randomize_ptr_, state_, key);
+}
+
+bool EnvironmentImpl::traceRays(const Environment &env,
+                                const RayQuery *rays, uint32_t num_rays,
+                                RayQueryHit *hits)
+{
+    return invoke(trace_rays_ptr_, state_, env, rays, num_rays, hits);
+}
+
+bool EnvironmentImpl::traceOcclusion(const Environment &env,
+                                     const RayQuery *rays,
+                                     uint32_t num_rays, uint8_t *occluded)
+{
+    return invoke(trace_occlusion_ptr_, state_, env, rays, num_rays, occluded);
+}
+
 shared_ptr<Scene> LoaderImpl::loadScene(SceneLoadData &&scene_data)
 {
     return invoke(load_scene_ptr_, state_, move(scene_data));
@@ -316,6 +1693,11 @@ shared_ptr<EnvironmentMapGroup> LoaderImpl::loadEnvironmentMaps(
     return invoke(load_env_maps_ptr_, state_, paths, num_maps);
 }
 
+SceneUploadSink *LoaderImpl::getUploadSink()
+{
+    return invoke(get_upload_sink_ptr_, state_);
+}
+
 LoaderImpl RendererImpl::makeLoader()
 {
     return invoke(make_loader_ptr_, state_);
@@ -378,6 +1760,12 @@ void BatchDeleter::operator()(BatchBackend *ptr) const
     deletePtr(state, ptr);
 }
 
+// Comes from vulkan/utils.hpp when the vulkan backend is built
+#ifndef STRINGIFY
+#define STRINGIFY_HELPER(m) #m
+#define STRINGIFY(m) STRINGIFY_HELPER(m)
+#endif
+
 namespace defaults {
 const char * getEnvironmentMap()
 {
@@ -0,0 +1,301 @@
+#include <rlpbr/aabb_tree.hpp>
+
+#include <cassert>
+
+using namespace std;
+
+namespace RLpbr {
+
+// Half the surface area, enough for comparing insertion costs
+static inline float boxCost(const glm::vec3 &min, const glm::vec3 &max)
+{
+    glm::vec3 d = max - min;
+    return d.x * d.y + d.y * d.z + d.z * d.x;
+}
+
+static inline float unionCost(const glm::vec3 &a_min, const glm::vec3 &a_max,
+                              const glm::vec3 &b_min, const glm::vec3 &b_max)
+{
+    return boxCost(glm::min(a_min, b_min), glm::max(a_max, b_max));
+}
+
+AABBTree::AABBTree(float margin)
+    : nodes_(),
+      stack_(),
+      root_(nullNode),
+      free_list_(nullNode),
+      num_leaves_(0),
+      margin_(margin)
+{}
+
+uint32_t AABBTree::insert(const glm::vec3 &min, const glm::vec3 &max,
+                          uint32_t user_data)
+{
+    uint32_t leaf = allocateNode();
+
+    Node &node = nodes_[leaf];
+    node.min = min - margin_;
+    node.max = max + margin_;
+    node.userData = user_data;
+    node.height = 0;
+
+    insertLeaf(leaf);
+    num_leaves_++;
+
+    return leaf;
+}
+
+void AABBTree::remove(uint32_t leaf)
+{
+    assert(nodes_[leaf].isLeaf());
+
+    removeLeaf(leaf);
+    freeNode(leaf);
+    num_leaves_--;
+}
+
+bool AABBTree::update(uint32_t leaf, const glm::vec3 &min,
+                      const glm::vec3 &max)
+{
+    Node &node = nodes_[leaf];
+    if (glm::all(glm::lessThanEqual(node.min, min)) &&
+        glm::all(glm::lessThanEqual(max, node.max))) {
+        return false;
+    }
+
+    removeLeaf(leaf);
+
+    node.min = min - margin_;
+    node.max = max + margin_;
+
+    insertLeaf(leaf);
+
+    return true;
+}
+
+void AABBTree::clear()
+{
+    nodes_.clear();
+    root_ = nullNode;
+    free_list_ = nullNode;
+    num_leaves_ = 0;
+}
+
+uint32_t AABBTree::allocateNode()
+{
+    uint32_t node_idx;
+    if (free_list_ != nullNode) {
+        node_idx = free_list_;
+        free_list_ = nodes_[node_idx].parent;
+    } else {
+        node_idx = nodes_.size();
+        nodes_.emplace_back();
+    }
+
+    Node &node = nodes_[node_idx];
+    node.parent = nullNode;
+    node.children[0] = nullNode;
+    node.children[1] = nullNode;
+    node.userData = ~0u;
+    node.height = 0;
+
+    return node_idx;
+}
+
+void AABBTree::freeNode(uint32_t node_idx)
+{
+    nodes_[node_idx].parent = free_list_;
+    nodes_[node_idx].height = -1;
+    free_list_ = node_idx;
+}
+
+void AABBTree::insertLeaf(uint32_t leaf)
+{
+    if (root_ == nullNode) {
+        root_ = leaf;
+        nodes_[leaf].parent = nullNode;
+        return;
+    }
+
+    glm::vec3 leaf_min = nodes_[leaf].min;
+    glm::vec3 leaf_max = nodes_[leaf].max;
+
+    // Descend towards the sibling that grows the total area the least
+    uint32_t sibling = root_;
+    while (!nodes_[sibling].isLeaf()) {
+        const Node &cur = nodes_[sibling];
+
+        float area = boxCost(cur.min, cur.max);
+        float combined_area =
+            unionCost(cur.min, cur.max, leaf_min, leaf_max);
+
+        // Pairing with cur creates a parent of combined_area
+        float cost = 2.f * combined_area;
+        // Descending grows cur and everything above it
+        float inheritance_cost = 2.f * (combined_area - area);
+
+        float child_costs[2];
+        for (int i = 0; i < 2; i++) {
+            const Node &child = nodes_[cur.children[i]];
+            float child_union =
+                unionCost(child.min, child.max, leaf_min, leaf_max);
+
+            if (child.isLeaf()) {
+                child_costs[i] = child_union + inheritance_cost;
+            } else {
+                child_costs[i] = child_union - boxCost(child.min, child.max) +
+                    inheritance_cost;
+            }
+        }
+
+        if (cost < child_costs[0] && cost < child_costs[1]) {
+            break;
+        }
+
+        sibling = child_costs[0] < child_costs[1] ?
+            cur.children[0] : cur.children[1];
+    }
+
+    uint32_t old_parent = nodes_[sibling].parent;
+    uint32_t new_parent = allocateNode();
+
+    Node &parent_node = nodes_[new_parent];
+    parent_node.parent = old_parent;
+    parent_node.min = glm::min(leaf_min, nodes_[sibling].min);
+    parent_node.max = glm::max(leaf_max, nodes_[sibling].max);
+    parent_node.height = nodes_[sibling].height + 1;
+    parent_node.children[0] = sibling;
+    parent_node.children[1] = leaf;
+
+    if (old_parent != nullNode) {
+        Node &old_parent_node = nodes_[old_parent];
+        if (old_parent_node.children[0] == sibling) {
+            old_parent_node.children[0] = new_parent;
+        } else {
+            old_parent_node.children[1] = new_parent;
+        }
+    } else {
+        root_ = new_parent;
+    }
+
+    nodes_[sibling].parent = new_parent;
+    nodes_[leaf].parent = new_parent;
+
+    refitAncestors(new_parent);
+}
+
+void AABBTree::removeLeaf(uint32_t leaf)
+{
+    if (leaf == root_) {
+        root_ = nullNode;
+        return;
+    }
+
+    uint32_t parent = nodes_[leaf].parent;
+    uint32_t grand_parent = nodes_[parent].parent;
+    uint32_t sibling = nodes_[parent].children[0] == leaf ?
+        nodes_[parent].children[1] : nodes_[parent].children[0];
+
+    freeNode(parent);
+
+    if (grand_parent == nullNode) {
+        root_ = sibling;
+        nodes_[sibling].parent = nullNode;
+        return;
+    }
+
+    Node &grand_parent_node = nodes_[grand_parent];
+    if (grand_parent_node.children[0] == parent) {
+        grand_parent_node.children[0] = sibling;
+    } else {
+        grand_parent_node.children[1] = sibling;
+    }
+    nodes_[sibling].parent = grand_parent;
+
+    refitAncestors(grand_parent);
+}
+
+void AABBTree::refitAncestors(uint32_t node_idx)
+{
+    while (node_idx != nullNode) {
+        node_idx = balance(node_idx);
+
+        Node &node = nodes_[node_idx];
+        const Node &child0 = nodes_[node.children[0]];
+        const Node &child1 = nodes_[node.children[1]];
+
+        node.height = 1 + max(child0.height, child1.height);
+        node.min = glm::min(child0.min, child1.min);
+        node.max = glm::max(child0.max, child1.max);
+
+        node_idx = node.parent;
+    }
+}
+
+// If one child of a is more than one level taller than the other, promote
+// that child (c) into a's place and move a below it, keeping c's taller
+// child in c. Returns the index of the subtree root.
+uint32_t AABBTree::balance(uint32_t a)
+{
+    Node &node_a = nodes_[a];
+    if (node_a.isLeaf() || node_a.height < 2) {
+        return a;
+    }
+
+    uint32_t b = node_a.children[0];
+    uint32_t c = node_a.children[1];
+
+    int32_t height_diff = nodes_[c].height - nodes_[b].height;
+    if (height_diff >= -1 && height_diff <= 1) {
+        return a;
+    }
+
+    // Promote the taller child, mirror image when b is taller
+    int taller_slot = height_diff > 1 ? 1 : 0;
+    uint32_t promoted = node_a.children[taller_slot];
+    uint32_t other = node_a.children[1 - taller_slot];
+
+    Node &node_p = nodes_[promoted];
+    uint32_t f = node_p.children[0];
+    uint32_t g = node_p.children[1];
+
+    // a takes the promoted node's place under a's old parent
+    node_p.children[0] = a;
+    node_p.parent = node_a.parent;
+    node_a.parent = promoted;
+
+    if (node_p.parent != nullNode) {
+        Node &parent_node = nodes_[node_p.parent];
+        if (parent_node.children[0] == a) {
+            parent_node.children[0] = promoted;
+        } else {
+            parent_node.children[1] = promoted;
+        }
+    } else {
+        root_ = promoted;
+    }
+
+    // The taller grandchild stays with the promoted node, the other one
+    // replaces the promoted node under a
+    uint32_t keep = nodes_[f].height > nodes_[g].height ? f : g;
+    uint32_t move_down = keep == f ? g : f;
+
+    node_p.children[1] = keep;
+    node_a.children[taller_slot] = move_down;
+    nodes_[move_down].parent = a;
+
+    const Node &other_node = nodes_[other];
+    const Node &moved_node = nodes_[move_down];
+    node_a.min = glm::min(other_node.min, moved_node.min);
+    node_a.max = glm::max(other_node.max, moved_node.max);
+    node_a.height = 1 + max(other_node.height, moved_node.height);
+
+    const Node &keep_node = nodes_[keep];
+    node_p.min = glm::min(node_a.min, keep_node.min);
+    node_p.max = glm::max(node_a.max, keep_node.max);
+    node_p.height = 1 + max(node_a.height, keep_node.height);
+
+    return promoted;
+}
+
+}
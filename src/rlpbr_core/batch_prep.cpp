@@ -0,0 +1,205 @@
+#include "batch_prep.hpp"
+#include "transforms.hpp"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace RLpbr {
+
+void stageTransforms(const CowArray<InstanceTransform> &env_transforms,
+                     CompactTransform *transforms,
+                     uint32_t begin, uint32_t end)
+{
+    env_transforms.visitRange(begin, end,
+        [transforms](const InstanceTransform *src, uint32_t offset,
+                     uint32_t num_transforms) {
+            packTransforms(src, transforms + offset, num_transforms);
+        });
+}
+
+void stageEnvironment(const Environment &env,
+                      EnvStagingCache &cache,
+                      CompactTransform *transforms,
+                      uint32_t *materials,
+                      uint32_t inst_offset,
+                      uint32_t material_offset)
+{
+    const auto &env_transforms = env.getTransforms();
+    const auto &env_mats = env.getInstanceMaterials();
+    uint32_t num_instances = env_transforms.size();
+    uint32_t num_materials = env_mats.size();
+
+    const EnvironmentUpdates &updates = env.getUpdates();
+
+    bool cached = cache.env == &env &&
+        cache.updateEpoch == env.getUpdateEpoch() &&
+        !updates.structural &&
+        cache.instanceOffset == inst_offset &&
+        cache.numInstances == num_instances &&
+        cache.materialOffset == material_offset &&
+        cache.numMaterials == num_materials;
+
+    if (!cached) {
+        stageTransforms(env_transforms, &transforms[inst_offset], 0,
+                        num_instances);
+        env_mats.copyTo(&materials[material_offset]);
+    } else {
+        const DirtyRange &txfms = updates.transforms;
+        if (!txfms.empty()) {
+            stageTransforms(env_transforms,
+                            &transforms[inst_offset + txfms.begin],
+                            txfms.begin, txfms.end);
+        }
+
+        const DirtyRange &mats = updates.materials;
+        if (!mats.empty()) {
+            env_mats.copyRange(&materials[material_offset + mats.begin],
+                               mats.begin, mats.end);
+        }
+    }
+
+    env.clearDirty();
+
+    cache.env = &env;
+    cache.updateEpoch = env.getUpdateEpoch();
+    cache.instanceOffset = inst_offset;
+    cache.numInstances = num_instances;
+    cache.materialOffset = material_offset;
+    cache.numMaterials = num_materials;
+}
+
+void skipEnvironment(const Environment &env,
+                     EnvStagingCache &cache,
+                     uint32_t inst_offset,
+                     uint32_t material_offset)
+{
+    bool moved = cache.instanceOffset != inst_offset ||
+        cache.numInstances != env.getNumInstances() ||
+        cache.materialOffset != material_offset ||
+        cache.numMaterials != env.getInstanceMaterials().size();
+
+    if (moved) {
+        cache.env = nullptr;
+    }
+}
+
+void activeRanges(const uint32_t *active, uint32_t num_active,
+                  vector<BatchRange> &ranges)
+{
+    ranges.clear();
+    for (uint32_t i = 0; i < num_active; i++) {
+        if (ranges.empty() || ranges.back().end != active[i]) {
+            ranges.push_back({ active[i], active[i] + 1 });
+        } else {
+            ranges.back().end++;
+        }
+    }
+}
+
+BatchPrepPool::BatchPrepPool(uint32_t num_threads)
+    : lock_(),
+      start_cv_(),
+      done_cv_(),
+      job_id_(0),
+      num_pending_(0),
+      exit_(false),
+      shard_fn_(nullptr),
+      shard_data_(nullptr),
+      num_shards_(0),
+      shard_size_(0),
+      num_items_(0),
+      workers_()
+{
+    if (num_threads == 0) {
+        num_threads = max(thread::hardware_concurrency(), 1u);
+    }
+
+    workers_.reserve(num_threads - 1);
+    for (uint32_t i = 1; i < num_threads; i++) {
+        workers_.emplace_back([this, i]() {
+            workerLoop(i);
+        });
+    }
+}
+
+BatchPrepPool::~BatchPrepPool()
+{
+    {
+        lock_guard<mutex> lock(lock_);
+        exit_ = true;
+    }
+    start_cv_.notify_all();
+
+    for (thread &t : workers_) {
+        t.join();
+    }
+}
+
+void BatchPrepPool::runShards(uint32_t num_items, uint32_t min_shard_items,
+                              ShardFn fn, void *data)
+{
+    min_shard_items = max(min_shard_items, 1u);
+    uint32_t max_shards =
+        max((num_items + min_shard_items - 1) / min_shard_items, 1u);
+    uint32_t num_shards = min(numThreads(), max_shards);
+
+    if (num_shards == 1) {
+        fn(data, 0, num_items);
+        return;
+    }
+
+    {
+        lock_guard<mutex> lock(lock_);
+        shard_fn_ = fn;
+        shard_data_ = data;
+        num_shards_ = num_shards;
+        shard_size_ = (num_items + num_shards - 1) / num_shards;
+        num_items_ = num_items;
+        num_pending_ = num_shards - 1;
+        job_id_++;
+    }
+    start_cv_.notify_all();
+
+    fn(data, 0, min(shard_size_, num_items));
+
+    unique_lock<mutex> lock(lock_);
+    done_cv_.wait(lock, [this]() { return num_pending_ == 0; });
+}
+
+void BatchPrepPool::workerLoop(uint32_t worker_idx)
+{
+    uint64_t last_job = 0;
+
+    while (true) {
+        unique_lock<mutex> lock(lock_);
+        start_cv_.wait(lock, [&]() {
+            return exit_ || job_id_ != last_job;
+        });
+
+        if (exit_) {
+            return;
+        }
+
+        last_job = job_id_;
+
+        if (worker_idx >= num_shards_) {
+            continue;
+        }
+
+        ShardFn fn = shard_fn_;
+        void *data = shard_data_;
+        uint32_t begin = min(worker_idx * shard_size_, num_items_);
+        uint32_t end = min(begin + shard_size_, num_items_);
+        lock.unlock();
+
+        fn(data, begin, end);
+
+        lock.lock();
+        if (--num_pending_ == 0) {
+            done_cv_.notify_one();
+        }
+    }
+}
+
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <rlpbr/environment.hpp>
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace RLpbr {
+
+// transforms[0, num_transforms) = packTransforms(env_transforms[begin, end))
+void stageTransforms(const CowArray<InstanceTransform> &env_transforms,
+                     CompactTransform *transforms,
+                     uint32_t begin, uint32_t end);
+
+// What a batch slot's staging memory held after the last frame, lets
+// stageEnvironment only copy the ranges modified since
+struct EnvStagingCache {
+    const Environment *env;
+    uint64_t updateEpoch;
+    uint32_t instanceOffset;
+    uint32_t numInstances;
+    uint32_t materialOffset;
+    uint32_t numMaterials;
+};
+
+// Packs transforms into transforms[inst_offset], copies instance
+// materials to materials[material_offset] and clears the environment's
+// dirty state. Safe to call concurrently for different environments /
+// caches.
+void stageEnvironment(const Environment &env,
+                      EnvStagingCache &cache,
+                      CompactTransform *transforms,
+                      uint32_t *materials,
+                      uint32_t inst_offset,
+                      uint32_t material_offset);
+
+// Stands in for stageEnvironment when the slot isn't rendered this
+// frame. Nothing is copied and the environment stays dirty, but if the
+// slot's region moved, other slots may be staged over its old one, so the
+// cache is dropped.
+void skipEnvironment(const Environment &env,
+                     EnvStagingCache &cache,
+                     uint32_t inst_offset,
+                     uint32_t material_offset);
+
+// Batch indices [begin, end)
+struct BatchRange {
+    uint32_t begin;
+    uint32_t end;
+};
+
+// Splits ascending batch indices into runs of consecutive indices, so
+// work over a sparse batch can be issued one run at a time
+void activeRanges(const uint32_t *active, uint32_t num_active,
+                  std::vector<BatchRange> &ranges);
+
+// Persistent workers for the per environment host work of a render call.
+// run() splits [0, num_items) into contiguous shards, one per thread, and
+// the calling thread works on the first one. Small batches stay on the
+// calling thread.
+class BatchPrepPool {
+public:
+    // Below this many environments per shard waking up workers costs more
+    // than the copies themselves
+    static constexpr uint32_t defaultShardItems = 8;
+
+    BatchPrepPool(uint32_t num_threads);
+    BatchPrepPool(const BatchPrepPool &) = delete;
+    ~BatchPrepPool();
+
+    // fn(begin, end), returns once every shard is done. Shards get at
+    // least min_shard_items items where possible.
+    template <typename Fn>
+    inline void run(uint32_t num_items, Fn &&fn,
+                    uint32_t min_shard_items = defaultShardItems);
+
+    inline uint32_t numThreads() const { return workers_.size() + 1; }
+
+private:
+    typedef void(*ShardFn)(void *, uint32_t, uint32_t);
+
+    void runShards(uint32_t num_items, uint32_t min_shard_items,
+                   ShardFn fn, void *data);
+    void workerLoop(uint32_t worker_idx);
+
+    std::mutex lock_;
+    std::condition_variable start_cv_;
+    std::condition_variable done_cv_;
+    uint64_t job_id_;
+    uint32_t num_pending_;
+    bool exit_;
+
+    ShardFn shard_fn_;
+    void *shard_data_;
+    uint32_t num_shards_;
+    uint32_t shard_size_;
+    uint32_t num_items_;
+
+    std::vector<std::thread> workers_;
+};
+
+template <typename Fn>
+void BatchPrepPool::run(uint32_t num_items, Fn &&fn,
+                        uint32_t min_shard_items)
+{
+    runShards(num_items, min_shard_items,
+              [](void *data, uint32_t begin, uint32_t end) {
+        (*static_cast<std::remove_reference_t<Fn> *>(data))(begin, end);
+    }, &fn);
+}
+
+}
@@ -0,0 +1,774 @@
+#include "bvh.hpp"
+#include "batch_prep.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <istream>
+#include <limits>
+#include <mutex>
+#include <ostream>
+
+using namespace std;
+
+namespace RLpbr {
+
+// Past this depth splits are at the median, which bounds the depth of the
+// rest of the tree by log2 of the number of primitives
+static constexpr uint32_t max_sah_depth = 32;
+
+static_assert(max_sah_depth + 32 <= BVH::maxDepth);
+
+static constexpr uint32_t max_bins = 64;
+
+// Parallel builds split ranges larger than this on the calling thread,
+// with bounds and binning spread over the pool, and hand out the subtrees
+// below them as tasks
+static constexpr uint32_t min_task_prims = 4096;
+
+// Primitives per shard when binning on the pool
+static constexpr uint32_t bin_shard_prims = 1024;
+
+namespace {
+
+struct Bin {
+    AABB bounds;
+    uint32_t numPrims;
+};
+
+// Binary tree, collapsed into the wide layout once complete
+struct BuildNode {
+    AABB bounds;
+    // Interior nodes
+    uint32_t children[2];
+    // Leaves: range of BVH::primIndices
+    uint32_t begin;
+    uint32_t end;
+    bool leaf;
+};
+
+struct BuildState {
+    const AABB *primBounds;
+    BVHBuildConfig cfg;
+    vector<glm::vec3> centroids;
+    uint32_t *indices;
+};
+
+struct SubtreeTask {
+    // Placeholder in the upper level nodes, replaced by the subtree root
+    uint32_t nodeIdx;
+    uint32_t begin;
+    uint32_t end;
+    uint32_t depth;
+    vector<BuildNode> nodes;
+};
+
+struct Split {
+    int axis;
+    uint32_t bin;
+};
+
+}
+
+static inline AABB emptyBounds()
+{
+    constexpr float inf = numeric_limits<float>::infinity();
+
+    return AABB {
+        glm::vec3(inf),
+        glm::vec3(-inf),
+    };
+}
+
+static inline void growBounds(AABB &bounds, const AABB &other)
+{
+    bounds.pMin = glm::min(bounds.pMin, other.pMin);
+    bounds.pMax = glm::max(bounds.pMax, other.pMax);
+}
+
+static inline void growBounds(AABB &bounds, const glm::vec3 &point)
+{
+    bounds.pMin = glm::min(bounds.pMin, point);
+    bounds.pMax = glm::max(bounds.pMax, point);
+}
+
+static inline float surfaceArea(const AABB &bounds)
+{
+    glm::vec3 d = bounds.pMax - bounds.pMin;
+    return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+static inline uint32_t binIndex(float centroid, float cmin, float bin_scale,
+                                uint32_t num_bins)
+{
+    return min(uint32_t((centroid - cmin) * bin_scale), num_bins - 1);
+}
+
+// Bounds and centroid bounds of indices[begin, end)
+static void rangeBounds(const BuildState &state, uint32_t begin,
+                        uint32_t end, AABB &bounds, AABB &centroid_bounds)
+{
+    for (uint32_t i = begin; i < end; i++) {
+        uint32_t prim_idx = state.indices[i];
+        growBounds(bounds, state.primBounds[prim_idx]);
+        growBounds(centroid_bounds, state.centroids[prim_idx]);
+    }
+}
+
+// bins[axis * max_bins + bin_idx]
+static void binPrims(const BuildState &state, uint32_t begin, uint32_t end,
+                     const AABB &centroid_bounds, Bin *bins)
+{
+    const uint32_t num_bins = state.cfg.numBins;
+
+    for (int axis = 0; axis < 3; axis++) {
+        float cmin = centroid_bounds.pMin[axis];
+        float extent = centroid_bounds.pMax[axis] - cmin;
+        if (!(extent > 0.f)) {
+            continue;
+        }
+        float bin_scale = float(num_bins) / extent;
+
+        Bin *axis_bins = bins + axis * max_bins;
+        for (uint32_t i = begin; i < end; i++) {
+            uint32_t prim_idx = state.indices[i];
+            Bin &bin = axis_bins[binIndex(state.centroids[prim_idx][axis],
+                                          cmin, bin_scale, num_bins)];
+
+            growBounds(bin.bounds, state.primBounds[prim_idx]);
+            bin.numPrims++;
+        }
+    }
+}
+
+static void resetBins(Bin *bins)
+{
+    for (uint32_t i = 0; i < 3 * max_bins; i++) {
+        bins[i] = { emptyBounds(), 0 };
+    }
+}
+
+// Cheapest split after one of the bins, axis -1 if no bin boundary
+// separates the primitives
+static Split findSplit(const Bin *bins, uint32_t num_bins,
+                       uint32_t num_prims, const AABB &centroid_bounds)
+{
+    constexpr float inf = numeric_limits<float>::infinity();
+
+    Split best { -1, 0 };
+    float best_cost = inf;
+
+    for (int axis = 0; axis < 3; axis++) {
+        if (!(centroid_bounds.pMax[axis] > centroid_bounds.pMin[axis])) {
+            continue;
+        }
+
+        const Bin *axis_bins = bins + axis * max_bins;
+
+        // Right side costs of splitting after bin i, swept from the back
+        float right_costs[max_bins];
+        AABB right = emptyBounds();
+        uint32_t num_right = 0;
+        for (uint32_t i = num_bins - 1; i > 0; i--) {
+            growBounds(right, axis_bins[i].bounds);
+            num_right += axis_bins[i].numPrims;
+            right_costs[i - 1] = num_right > 0 ?
+                surfaceArea(right) * float(num_right) : inf;
+        }
+
+        AABB left = emptyBounds();
+        uint32_t num_left = 0;
+        for (uint32_t i = 0; i < num_bins - 1; i++) {
+            growBounds(left, axis_bins[i].bounds);
+            num_left += axis_bins[i].numPrims;
+            if (num_left == 0 || num_left == num_prims) {
+                continue;
+            }
+
+            float cost = surfaceArea(left) * float(num_left) +
+                right_costs[i];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best = { axis, i };
+            }
+        }
+    }
+
+    return best;
+}
+
+static uint32_t partitionPrims(BuildState &state, uint32_t begin,
+                               uint32_t end, const AABB &centroid_bounds,
+                               const Split &split)
+{
+    const uint32_t num_bins = state.cfg.numBins;
+    float cmin = centroid_bounds.pMin[split.axis];
+    float bin_scale = float(num_bins) /
+        (centroid_bounds.pMax[split.axis] - cmin);
+
+    uint32_t *mid = partition(state.indices + begin, state.indices + end,
+                              [&](uint32_t prim_idx) {
+        return binIndex(state.centroids[prim_idx][split.axis], cmin,
+                        bin_scale, num_bins) <= split.bin;
+    });
+
+    return mid - state.indices;
+}
+
+// Along the longest centroid axis
+static uint32_t medianSplit(BuildState &state, uint32_t begin, uint32_t end,
+                            const AABB &centroid_bounds)
+{
+    glm::vec3 extent = centroid_bounds.pMax - centroid_bounds.pMin;
+    int axis = extent.x > extent.y ?
+        (extent.x > extent.z ? 0 : 2) :
+        (extent.y > extent.z ? 1 : 2);
+
+    uint32_t mid = begin + (end - begin) / 2;
+    nth_element(state.indices + begin, state.indices + mid,
+                state.indices + end, [&](uint32_t a, uint32_t b) {
+        return state.centroids[a][axis] < state.centroids[b][axis];
+    });
+
+    return mid;
+}
+
+// Kept out of buildSubtree so the bins aren't on the stack of every level
+static uint32_t splitRange(BuildState &state, uint32_t begin, uint32_t end,
+                           const AABB &centroid_bounds, uint32_t depth)
+{
+    uint32_t mid = end;
+    if (depth < max_sah_depth) {
+        Bin bins[3 * max_bins];
+        resetBins(bins);
+        binPrims(state, begin, end, centroid_bounds, bins);
+
+        Split split = findSplit(bins, state.cfg.numBins, end - begin,
+                                centroid_bounds);
+        if (split.axis != -1) {
+            mid = partitionPrims(state, begin, end, centroid_bounds, split);
+        }
+    }
+
+    if (mid == begin || mid == end) {
+        mid = medianSplit(state, begin, end, centroid_bounds);
+    }
+
+    return mid;
+}
+
+static uint32_t buildSubtree(BuildState &state, vector<BuildNode> &nodes,
+                             uint32_t begin, uint32_t end, uint32_t depth)
+{
+    uint32_t node_idx = nodes.size();
+    nodes.emplace_back();
+
+    AABB bounds = emptyBounds();
+    AABB centroid_bounds = emptyBounds();
+    rangeBounds(state, begin, end, bounds, centroid_bounds);
+
+    nodes[node_idx].bounds = bounds;
+
+    if (end - begin <= state.cfg.maxLeafPrims) {
+        nodes[node_idx].begin = begin;
+        nodes[node_idx].end = end;
+        nodes[node_idx].leaf = true;
+
+        return node_idx;
+    }
+
+    uint32_t mid = splitRange(state, begin, end, centroid_bounds, depth);
+
+    uint32_t left = buildSubtree(state, nodes, begin, mid, depth + 1);
+    uint32_t right = buildSubtree(state, nodes, mid, end, depth + 1);
+
+    // Not a reference across the calls above, nodes may have grown
+    nodes[node_idx].children[0] = left;
+    nodes[node_idx].children[1] = right;
+    nodes[node_idx].leaf = false;
+
+    return node_idx;
+}
+
+// Upper levels of a parallel build. Only the calling thread recurses, the
+// pool is used for the bounds and bins of each range.
+static uint32_t buildUpperLevels(BuildState &state, BatchPrepPool &pool,
+                                 vector<BuildNode> &nodes,
+                                 vector<SubtreeTask> &tasks,
+                                 uint32_t begin, uint32_t end,
+                                 uint32_t depth, uint32_t task_prims)
+{
+    uint32_t node_idx = nodes.size();
+    nodes.emplace_back();
+
+    if (end - begin <= task_prims) {
+        tasks.push_back({ node_idx, begin, end, depth, {} });
+
+        return node_idx;
+    }
+
+    mutex merge_lock;
+
+    AABB bounds = emptyBounds();
+    AABB centroid_bounds = emptyBounds();
+    pool.run(end - begin, [&](uint32_t shard_begin, uint32_t shard_end) {
+        AABB shard_bounds = emptyBounds();
+        AABB shard_centroids = emptyBounds();
+        rangeBounds(state, begin + shard_begin, begin + shard_end,
+                    shard_bounds, shard_centroids);
+
+        lock_guard<mutex> lock(merge_lock);
+        growBounds(bounds, shard_bounds);
+        growBounds(centroid_bounds, shard_centroids);
+    }, bin_shard_prims);
+
+    nodes[node_idx].bounds = bounds;
+
+    vector<Bin> bins(3 * max_bins);
+    resetBins(bins.data());
+    pool.run(end - begin, [&](uint32_t shard_begin, uint32_t shard_end) {
+        Bin shard_bins[3 * max_bins];
+        resetBins(shard_bins);
+        binPrims(state, begin + shard_begin, begin + shard_end,
+                 centroid_bounds, shard_bins);
+
+        lock_guard<mutex> lock(merge_lock);
+        for (uint32_t i = 0; i < 3 * max_bins; i++) {
+            growBounds(bins[i].bounds, shard_bins[i].bounds);
+            bins[i].numPrims += shard_bins[i].numPrims;
+        }
+    }, bin_shard_prims);
+
+    Split split = findSplit(bins.data(), state.cfg.numBins, end - begin,
+                            centroid_bounds);
+
+    uint32_t mid = end;
+    if (split.axis != -1) {
+        mid = partitionPrims(state, begin, end, centroid_bounds, split);
+    }
+
+    if (mid == begin || mid == end) {
+        mid = medianSplit(state, begin, end, centroid_bounds);
+    }
+
+    uint32_t left = buildUpperLevels(state, pool, nodes, tasks, begin, mid,
+                                     depth + 1, task_prims);
+    uint32_t right = buildUpperLevels(state, pool, nodes, tasks, mid, end,
+                                      depth + 1, task_prims);
+
+    nodes[node_idx].children[0] = left;
+    nodes[node_idx].children[1] = right;
+    nodes[node_idx].leaf = false;
+
+    return node_idx;
+}
+
+static vector<BuildNode> buildParallel(BuildState &state, BatchPrepPool &pool,
+                                       uint32_t num_prims,
+                                       uint32_t task_prims)
+{
+    vector<BuildNode> nodes;
+    vector<SubtreeTask> tasks;
+    buildUpperLevels(state, pool, nodes, tasks, 0, num_prims, 0,
+                     task_prims);
+
+    // Subtree sizes vary, so tasks are claimed one at a time
+    atomic_uint32_t next_task(0);
+    pool.run(tasks.size(), [&](uint32_t, uint32_t) {
+        uint32_t task_idx;
+        while ((task_idx = next_task.fetch_add(1, memory_order_relaxed)) <
+               tasks.size()) {
+            SubtreeTask &task = tasks[task_idx];
+            buildSubtree(state, task.nodes, task.begin, task.end,
+                         task.depth);
+        }
+    }, 1);
+
+    // Splice each subtree in: its root replaces the placeholder, the
+    // rest is appended
+    for (SubtreeTask &task : tasks) {
+        uint32_t base = nodes.size() - 1;
+        auto globalIdx = [&](uint32_t local_idx) {
+            return local_idx == 0 ? task.nodeIdx : base + local_idx;
+        };
+
+        for (uint32_t local_idx = 0; local_idx < task.nodes.size();
+             local_idx++) {
+            BuildNode node = task.nodes[local_idx];
+            if (!node.leaf) {
+                node.children[0] = globalIdx(node.children[0]);
+                node.children[1] = globalIdx(node.children[1]);
+            }
+
+            if (local_idx == 0) {
+                nodes[task.nodeIdx] = node;
+            } else {
+                nodes.push_back(node);
+            }
+        }
+    }
+
+    return nodes;
+}
+
+static BVHChild makeEmptyChild()
+{
+    return BVHChild {
+        glm::vec3(0.f),
+        0,
+        glm::vec3(0.f),
+        BVHChild::emptySlot,
+    };
+}
+
+// Each wide node takes the two children of a binary node, then repeatedly
+// replaces its largest interior child by that child's children until full
+static void collapse(const vector<BuildNode> &nodes, BVH &bvh)
+{
+    const uint32_t width = bvh.width;
+
+    bvh.children.assign(width, makeEmptyChild());
+
+    const BuildNode &root = nodes[0];
+    if (root.leaf) {
+        bvh.children[0] = BVHChild {
+            root.bounds.pMin,
+            root.begin,
+            root.bounds.pMax,
+            root.end - root.begin,
+        };
+
+        return;
+    }
+
+    struct Pending {
+        uint32_t buildIdx;
+        uint32_t nodeIdx;
+    };
+
+    vector<Pending> pending;
+    pending.push_back({ 0, 0 });
+
+    while (!pending.empty()) {
+        Pending cur = pending.back();
+        pending.pop_back();
+
+        uint32_t candidates[BVH::maxWidth];
+        candidates[0] = nodes[cur.buildIdx].children[0];
+        candidates[1] = nodes[cur.buildIdx].children[1];
+        uint32_t num_candidates = 2;
+
+        while (num_candidates < width) {
+            int largest = -1;
+            float largest_area = -1.f;
+            for (uint32_t i = 0; i < num_candidates; i++) {
+                const BuildNode &candidate = nodes[candidates[i]];
+                if (candidate.leaf) {
+                    continue;
+                }
+
+                float area = surfaceArea(candidate.bounds);
+                if (area > largest_area) {
+                    largest = i;
+                    largest_area = area;
+                }
+            }
+
+            if (largest == -1) {
+                break;
+            }
+
+            const BuildNode &opened = nodes[candidates[largest]];
+            candidates[largest] = opened.children[0];
+            candidates[num_candidates++] = opened.children[1];
+        }
+
+        for (uint32_t i = 0; i < num_candidates; i++) {
+            const BuildNode &node = nodes[candidates[i]];
+
+            BVHChild child;
+            child.min = node.bounds.pMin;
+            child.max = node.bounds.pMax;
+
+            if (node.leaf) {
+                child.offset = node.begin;
+                child.numPrims = node.end - node.begin;
+            } else {
+                uint32_t child_node_idx = bvh.numNodes();
+                bvh.children.resize(bvh.children.size() + width,
+                                    makeEmptyChild());
+
+                child.offset = child_node_idx;
+                child.numPrims = 0;
+
+                pending.push_back({ candidates[i], child_node_idx });
+            }
+
+            bvh.children[cur.nodeIdx * width + i] = child;
+        }
+    }
+}
+
+BVHBuildConfig BVH::defaultConfig()
+{
+    return {
+        4,
+        4,
+        16,
+    };
+}
+
+BVH BVH::build(const AABB *prim_bounds, uint32_t num_prims,
+               const BVHBuildConfig &cfg, BatchPrepPool *pool)
+{
+    BVH bvh;
+    bvh.width = clamp(cfg.width, 2u, maxWidth);
+
+    if (num_prims == 0) {
+        return bvh;
+    }
+
+    bvh.primIndices.resize(num_prims);
+
+    BuildState state {
+        prim_bounds,
+        {
+            bvh.width,
+            max(cfg.maxLeafPrims, 1u),
+            clamp(cfg.numBins, 2u, max_bins),
+        },
+        vector<glm::vec3>(num_prims),
+        bvh.primIndices.data(),
+    };
+
+    auto initPrims = [&](uint32_t begin, uint32_t end) {
+        for (uint32_t i = begin; i < end; i++) {
+            bvh.primIndices[i] = i;
+            state.centroids[i] =
+                0.5f * (prim_bounds[i].pMin + prim_bounds[i].pMax);
+        }
+    };
+
+    uint32_t task_prims = num_prims;
+    if (pool != nullptr && pool->numThreads() > 1) {
+        // A few tasks per thread to even out subtree sizes
+        task_prims = max(num_prims / (4 * pool->numThreads()),
+                         min_task_prims);
+    }
+
+    vector<BuildNode> nodes;
+    if (task_prims < num_prims) {
+        pool->run(num_prims, initPrims, bin_shard_prims);
+        nodes = buildParallel(state, *pool, num_prims, task_prims);
+    } else {
+        initPrims(0, num_prims);
+        nodes.reserve(2 * ((num_prims + state.cfg.maxLeafPrims - 1) /
+            state.cfg.maxLeafPrims));
+        buildSubtree(state, nodes, 0, num_prims, 0);
+    }
+
+    collapse(nodes, bvh);
+
+    return bvh;
+}
+
+void BVH::refit(const AABB *prim_bounds)
+{
+    // Children are visited before their parents in reverse node order
+    for (uint32_t node_idx = numNodes(); node_idx-- > 0;) {
+        for (uint32_t i = 0; i < width; i++) {
+            BVHChild &child = children[node_idx * width + i];
+            if (child.isEmpty()) {
+                break;
+            }
+
+            AABB bounds = emptyBounds();
+            if (child.isLeaf()) {
+                for (uint32_t j = 0; j < child.numPrims; j++) {
+                    growBounds(bounds,
+                               prim_bounds[primIndices[child.offset + j]]);
+                }
+            } else {
+                for (uint32_t j = 0; j < width; j++) {
+                    const BVHChild &grandchild =
+                        children[child.offset * width + j];
+                    if (grandchild.isEmpty()) {
+                        break;
+                    }
+
+                    growBounds(bounds,
+                               AABB { grandchild.min, grandchild.max });
+                }
+            }
+
+            child.min = bounds.pMin;
+            child.max = bounds.pMax;
+        }
+    }
+}
+
+float BVH::sahCost() const
+{
+    if (children.empty()) {
+        return 0.f;
+    }
+
+    float root_area = surfaceArea(getBounds());
+
+    // The root is always visited
+    float cost = 1.f;
+    for (const BVHChild &child : children) {
+        if (child.isEmpty()) {
+            continue;
+        }
+
+        float area_ratio = root_area > 0.f ?
+            surfaceArea(AABB { child.min, child.max }) / root_area : 1.f;
+
+        cost += area_ratio * (child.isLeaf() ? float(child.numPrims) : 1.f);
+    }
+
+    return cost;
+}
+
+bool BVH::validate(uint32_t num_prims, const AABB *prim_bounds) const
+{
+    if (children.empty()) {
+        return primIndices.empty() && num_prims == 0;
+    }
+
+    if (width < 2 || width > maxWidth || children.size() % width != 0 ||
+        primIndices.size() != num_prims) {
+        return false;
+    }
+
+    vector<bool> prim_seen(num_prims, false);
+    vector<bool> node_seen(numNodes(), false);
+
+    auto contains = [](const BVHChild &child, const AABB &bounds) {
+        return glm::all(glm::lessThanEqual(child.min, bounds.pMin)) &&
+            glm::all(glm::greaterThanEqual(child.max, bounds.pMax));
+    };
+
+    struct StackEntry {
+        uint32_t node;
+        uint32_t depth;
+    };
+
+    vector<StackEntry> stack { { 0, 1 } };
+    node_seen[0] = true;
+    while (!stack.empty()) {
+        StackEntry entry = stack.back();
+        stack.pop_back();
+
+        bool seen_empty = false;
+        for (uint32_t i = 0; i < width; i++) {
+            const BVHChild &child = children[entry.node * width + i];
+            if (child.isEmpty()) {
+                seen_empty = true;
+                continue;
+            } else if (seen_empty) {
+                return false;
+            }
+
+            if (!child.isLeaf()) {
+                if (child.offset >= numNodes() || node_seen[child.offset] ||
+                    entry.depth >= maxDepth) {
+                    return false;
+                }
+                node_seen[child.offset] = true;
+
+                if (prim_bounds) {
+                    for (uint32_t j = 0; j < width; j++) {
+                        const BVHChild &grandchild =
+                            children[child.offset * width + j];
+                        if (!grandchild.isEmpty() && !contains(child,
+                                { grandchild.min, grandchild.max })) {
+                            return false;
+                        }
+                    }
+                }
+
+                stack.push_back({ child.offset, entry.depth + 1 });
+                continue;
+            }
+
+            if (uint64_t(child.offset) + child.numPrims > num_prims) {
+                return false;
+            }
+
+            for (uint32_t j = 0; j < child.numPrims; j++) {
+                uint32_t prim_idx = primIndices[child.offset + j];
+                if (prim_idx >= num_prims || prim_seen[prim_idx] ||
+                    (prim_bounds &&
+                     !contains(child, prim_bounds[prim_idx]))) {
+                    return false;
+                }
+                prim_seen[prim_idx] = true;
+            }
+        }
+    }
+
+    for (bool seen : prim_seen) {
+        if (!seen) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void writeBVH(ostream &out, const BVH &bvh)
+{
+    uint32_t header[3] {
+        bvh.width,
+        bvh.numNodes(),
+        uint32_t(bvh.primIndices.size()),
+    };
+
+    out.write(reinterpret_cast<const char *>(header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(bvh.children.data()),
+              sizeof(BVHChild) * bvh.children.size());
+    out.write(reinterpret_cast<const char *>(bvh.primIndices.data()),
+              sizeof(uint32_t) * bvh.primIndices.size());
+}
+
+BVH readBVH(istream &in)
+{
+    uint32_t header[3];
+    in.read(reinterpret_cast<char *>(header), sizeof(header));
+
+    BVH bvh;
+    bvh.width = 0;
+
+    // Checked before sizing anything from the header
+    if (!in || header[0] < 2 || header[0] > BVH::maxWidth) {
+        in.setstate(ios::failbit);
+        return bvh;
+    }
+
+    uint64_t num_bytes =
+        sizeof(BVHChild) * uint64_t(header[0]) * header[1] +
+        sizeof(uint32_t) * uint64_t(header[2]);
+
+    auto data_start = in.tellg();
+    in.seekg(0, ios::end);
+    auto data_end = in.tellg();
+    in.seekg(data_start);
+    if (!in || uint64_t(data_end - data_start) < num_bytes) {
+        in.setstate(ios::failbit);
+        return bvh;
+    }
+
+    bvh.width = header[0];
+    bvh.children.resize(uint64_t(header[0]) * header[1]);
+    bvh.primIndices.resize(header[2]);
+
+    in.read(reinterpret_cast<char *>(bvh.children.data()),
+            sizeof(BVHChild) * bvh.children.size());
+    in.read(reinterpret_cast<char *>(bvh.primIndices.data()),
+            sizeof(uint32_t) * bvh.primIndices.size());
+
+    return bvh;
+}
+
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "physics.hpp"
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <iosfwd>
+#include <vector>
+
+namespace RLpbr {
+
+class BatchPrepPool;
+
+// One child slot of a BVH node
+struct BVHChild {
+    glm::vec3 min;
+    // Interior children: node index. Leaves: first entry in
+    // BVH::primIndices.
+    uint32_t offset;
+    glm::vec3 max;
+    // 0 for interior children, emptySlot for unused slots
+    uint32_t numPrims;
+
+    static constexpr uint32_t emptySlot = ~0u;
+
+    inline bool isEmpty() const { return numPrims == emptySlot; }
+    inline bool isLeaf() const
+    {
+        return numPrims > 0 && numPrims != emptySlot;
+    }
+};
+
+struct BVHBuildConfig {
+    // Children per node, 2 to BVH::maxWidth
+    uint32_t width;
+    // Nodes are split until they hold at most this many primitives
+    uint32_t maxLeafPrims;
+    uint32_t numBins;
+};
+
+// Wide BVH over primitive bounds with no pointers or device specific
+// data, so it can be stored in .bps files as is (writeBVH / readBVH).
+// Node n's children are children[n * width, (n + 1) * width), node 0 is
+// the root, child nodes come after their parents and empty slots come
+// last. Any number of threads can traverse it between updates.
+struct BVH {
+    static constexpr uint32_t maxWidth = 8;
+    // Deepest leaf, build() falls back to median splits before this
+    static constexpr uint32_t maxDepth = 64;
+
+    uint32_t width;
+    std::vector<BVHChild> children;
+    std::vector<uint32_t> primIndices;
+
+    static BVHBuildConfig defaultConfig();
+
+    // Binned SAH build, the binary tree is collapsed into width wide nodes
+    // afterwards. With a pool, binning of the upper levels and the
+    // subtrees below them are spread over its threads.
+    static BVH build(const AABB *prim_bounds, uint32_t num_prims,
+                     const BVHBuildConfig &cfg = defaultConfig(),
+                     BatchPrepPool *pool = nullptr);
+
+    // Recomputes all bounds from moved primitives, keeping the tree. The
+    // tree degrades as primitives move away from where they were built,
+    // compare sahCost() against the build's to decide when to rebuild.
+    void refit(const AABB *prim_bounds);
+
+    inline bool empty() const { return children.empty(); }
+    inline uint32_t numNodes() const;
+    inline AABB getBounds() const;
+
+    // Structure traverse() relies on: width in 2 to maxWidth, child nodes
+    // inside children and reached exactly once, no deeper than maxDepth,
+    // empty slots last and every primitive below num_prims referenced
+    // exactly once. With prim_bounds, also that children contain their
+    // primitives and grandchildren.
+    bool validate(uint32_t num_prims,
+                  const AABB *prim_bounds = nullptr) const;
+
+    // Expected cost of a ray through the root bounds, counting 1 per node
+    // visited and 1 per primitive tested
+    float sahCost() const;
+
+    // Visits primitives in leaves the ray enters before max_t, nearer
+    // children first. prim_fn(prim_idx, max_t) returns the new max_t, a
+    // negative value ends traversal (any hit queries).
+    template <typename PrimFn>
+    inline void traverse(const glm::vec3 &origin, const glm::vec3 &inv_dir,
+                         float max_t, PrimFn &&prim_fn) const;
+};
+
+// Width, node count and primitive count as uint32_t, then children and
+// primIndices as stored. readBVH sets failbit on in for a header it can't
+// read, the result still needs validate().
+void writeBVH(std::ostream &out, const BVH &bvh);
+BVH readBVH(std::istream &in);
+
+}
+
+#include "bvh.inl"
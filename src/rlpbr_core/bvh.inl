@@ -0,0 +1,112 @@
+#pragma once
+
+#include <rlpbr/aabb_tree.hpp>
+
+namespace RLpbr {
+
+uint32_t BVH::numNodes() const
+{
+    return children.empty() ? 0 : children.size() / width;
+}
+
+AABB BVH::getBounds() const
+{
+    AABB bounds {
+        glm::vec3(0.f),
+        glm::vec3(0.f),
+    };
+
+    for (uint32_t i = 0; i < width && i < children.size(); i++) {
+        const BVHChild &child = children[i];
+        if (child.isEmpty()) {
+            break;
+        }
+
+        if (i == 0) {
+            bounds = AABB { child.min, child.max };
+        } else {
+            bounds.pMin = glm::min(bounds.pMin, child.min);
+            bounds.pMax = glm::max(bounds.pMax, child.max);
+        }
+    }
+
+    return bounds;
+}
+
+template <typename PrimFn>
+void BVH::traverse(const glm::vec3 &origin, const glm::vec3 &inv_dir,
+                   float max_t, PrimFn &&prim_fn) const
+{
+    if (children.empty()) {
+        return;
+    }
+
+    // Each node pushes at most width - 1 more entries than it pops
+    struct StackEntry {
+        uint32_t slot;
+        float t;
+    };
+
+    StackEntry stack[maxDepth * (maxWidth - 1) + 1];
+    uint32_t stack_size = 0;
+
+    uint32_t node_idx = 0;
+    while (true) {
+        const uint32_t base = node_idx * width;
+
+        // Entered children sorted far to near, so the nearest is popped
+        // first
+        StackEntry hits[maxWidth];
+        uint32_t num_hits = 0;
+        for (uint32_t i = 0; i < width; i++) {
+            const BVHChild &child = children[base + i];
+            if (child.isEmpty()) {
+                break;
+            }
+
+            float t;
+            if (!AABBTree::intersectRay(child.min, child.max, origin,
+                                        inv_dir, max_t, t)) {
+                continue;
+            }
+
+            uint32_t insert_idx = num_hits++;
+            while (insert_idx > 0 && hits[insert_idx - 1].t < t) {
+                hits[insert_idx] = hits[insert_idx - 1];
+                insert_idx--;
+            }
+            hits[insert_idx] = { base + i, t };
+        }
+
+        for (uint32_t i = 0; i < num_hits; i++) {
+            stack[stack_size++] = hits[i];
+        }
+
+        while (true) {
+            if (stack_size == 0) {
+                return;
+            }
+
+            StackEntry entry = stack[--stack_size];
+            // Pushed before max_t shrank
+            if (entry.t > max_t) {
+                continue;
+            }
+
+            const BVHChild &child = children[entry.slot];
+            if (!child.isLeaf()) {
+                node_idx = child.offset;
+                break;
+            }
+
+            for (uint32_t i = 0; i < child.numPrims; i++) {
+                max_t = prim_fn(primIndices[child.offset + i], max_t);
+                if (max_t < 0.f) {
+                    return;
+                }
+            }
+        }
+    }
+}
+
+}
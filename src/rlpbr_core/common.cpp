@@ -9,18 +9,30 @@ namespace RLpbr {
 
 EnvironmentImpl::EnvironmentImpl(
     DestroyType destroy_ptr, AddLightType add_light_ptr,
+    AddSceneLightType add_scene_light_ptr,
     RemoveLightType remove_light_ptr,
+    RandomizeType randomize_ptr,
+    TraceRaysType trace_rays_ptr,
+    TraceOcclusionType trace_occlusion_ptr,
     EnvironmentBackend *state)
     : destroy_ptr_(destroy_ptr),
       add_light_ptr_(add_light_ptr),
+      add_scene_light_ptr_(add_scene_light_ptr),
       remove_light_ptr_(remove_light_ptr),
+      randomize_ptr_(randomize_ptr),
+      trace_rays_ptr_(trace_rays_ptr),
+      trace_occlusion_ptr_(trace_occlusion_ptr),
       state_(state)
 {}
 
 EnvironmentImpl::EnvironmentImpl(EnvironmentImpl &&o)
     : destroy_ptr_(o.destroy_ptr_),
       add_light_ptr_(o.add_light_ptr_),
+      add_scene_light_ptr_(o.add_scene_light_ptr_),
       remove_light_ptr_(o.remove_light_ptr_),
+      randomize_ptr_(o.randomize_ptr_),
+      trace_rays_ptr_(o.trace_rays_ptr_),
+      trace_occlusion_ptr_(o.trace_occlusion_ptr_),
       state_(o.state_)
 {
     o.state_ = nullptr;
@@ -41,7 +53,11 @@ EnvironmentImpl & EnvironmentImpl::operator=(EnvironmentImpl &&o)
 
     destroy_ptr_ = o.destroy_ptr_;
     add_light_ptr_ = o.add_light_ptr_;
+    add_scene_light_ptr_ = o.add_scene_light_ptr_;
     remove_light_ptr_ = o.remove_light_ptr_;
+    randomize_ptr_ = o.randomize_ptr_;
+    trace_rays_ptr_ = o.trace_rays_ptr_;
+    trace_occlusion_ptr_ = o.trace_occlusion_ptr_;
     state_ = o.state_;
 
     o.state_ = nullptr;
@@ -62,10 +78,12 @@ BakerImpl::BakerImpl(DestroyType destroy_ptr, InitType init_ptr,
 LoaderImpl::LoaderImpl(DestroyType destroy_ptr,
                        LoadSceneType load_scene_ptr,
                        LoadEnvMapsType load_env_maps_ptr,
+                       GetUploadSinkType get_upload_sink_ptr,
                        LoaderBackend *state)
     : destroy_ptr_(destroy_ptr),
       load_scene_ptr_(load_scene_ptr),
       load_env_maps_ptr_(load_env_maps_ptr),
+      get_upload_sink_ptr_(get_upload_sink_ptr),
       state_(state)
 {}
 
@@ -73,6 +91,7 @@ LoaderImpl::LoaderImpl(LoaderImpl &&o)
     : destroy_ptr_(o.destroy_ptr_),
       load_scene_ptr_(o.load_scene_ptr_),
       load_env_maps_ptr_(o.load_env_maps_ptr_),
+      get_upload_sink_ptr_(o.get_upload_sink_ptr_),
       state_(o.state_)
 {
     o.state_ = nullptr;
@@ -93,6 +112,8 @@ LoaderImpl & LoaderImpl::operator=(LoaderImpl &&o)
 
     destroy_ptr_ = o.destroy_ptr_;
     load_scene_ptr_ = o.load_scene_ptr_;
+    load_env_maps_ptr_ = o.load_env_maps_ptr_;
+    get_upload_sink_ptr_ = o.get_upload_sink_ptr_;
     state_ = o.state_;
 
     o.state_ = nullptr;
@@ -47,6 +47,8 @@ LoaderImpl makeLoaderImpl(LoaderBackend *ptr)
         static_cast<LoaderImpl::LoadSceneType>(&LoaderType::loadScene),
         static_cast<LoaderImpl::LoadEnvMapsType>(
             &LoaderType::loadEnvironmentMaps),
+        static_cast<LoaderImpl::GetUploadSinkType>(
+            &LoaderType::getUploadSink),
         ptr);
 }
 
@@ -62,7 +64,13 @@ EnvironmentImpl makeEnvironmentImpl(EnvironmentBackend *ptr)
 {
     return EnvironmentImpl(destroyEnvironment<EnvType>,
         static_cast<EnvironmentImpl::AddLightType>(&EnvType::addLight),
+        static_cast<EnvironmentImpl::AddSceneLightType>(
+            &EnvType::addSceneLight),
         static_cast<EnvironmentImpl::RemoveLightType>(&EnvType::removeLight),
+        static_cast<EnvironmentImpl::RandomizeType>(&EnvType::randomize),
+        static_cast<EnvironmentImpl::TraceRaysType>(&EnvType::traceRays),
+        static_cast<EnvironmentImpl::TraceOcclusionType>(
+            &EnvType::traceOcclusion),
         ptr);
 }
 
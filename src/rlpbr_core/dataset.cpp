@@ -0,0 +1,967 @@
+#include "dataset.hpp"
+#include "batch_prep.hpp"
+#include "io.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The SSE 4.2 CRC is compiled for that target regardless of the build
+// flags and only called when the CPU supports it
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define RLPBR_CRC_SSE
+#endif
+
+#ifdef RLPBR_ZLIB
+#include <zlib.h>
+#endif
+
+using namespace std;
+
+namespace RLpbr {
+
+using Consts = DatasetConstants;
+
+namespace DatasetFormat {
+// "RLPBRDS\0"
+constexpr uint64_t magic = 0x0053445242504C52;
+constexpr uint32_t version = 1;
+constexpr const char *indexName = "index.bin";
+constexpr const char *scenesName = "scenes.txt";
+// Datasets are written while rendering, favour speed
+constexpr int deflateLevel = 2;
+}
+
+namespace {
+
+struct TensorHeader {
+    char name[Consts::maxNameLength + 1];
+    uint32_t type;
+    uint32_t codec;
+    uint32_t width;
+    uint32_t height;
+    uint32_t numChannels;
+};
+
+struct IndexHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t numTensors;
+    uint64_t shardBytes;
+    TensorHeader tensors[Consts::maxTensors];
+    uint32_t checksum;
+    uint32_t pad;
+};
+
+struct IndexRecord {
+    uint64_t offset;
+    uint32_t shard;
+    uint32_t sceneIdx;
+    uint32_t storedBytes[Consts::maxTensors];
+    uint32_t checksums[Consts::maxTensors];
+    // position, view, up, right
+    float camera[12];
+    uint32_t spp;
+    uint32_t envIdx;
+    uint32_t episode;
+    uint32_t pad;
+    uint64_t seed;
+    uint32_t checksum;
+    uint32_t pad2;
+};
+
+static_assert(sizeof(IndexHeader) == 448);
+static_assert(sizeof(IndexRecord) == 160);
+
+struct EncodedTensor {
+    const uint8_t *data;
+    uint32_t numBytes;
+    uint32_t checksum;
+};
+
+}
+
+struct CRC32CTable {
+    uint32_t values[256];
+
+    constexpr CRC32CTable()
+        : values()
+    {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int j = 0; j < 8; j++) {
+                crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1)));
+            }
+            values[i] = crc;
+        }
+    }
+};
+
+static constexpr CRC32CTable crc32c_table;
+
+#ifdef RLPBR_CRC_SSE
+
+// Whole 8 byte words of bytes, the number of bytes consumed goes to
+// num_done
+__attribute__((target("sse4.2")))
+static uint32_t crc32cSSE(uint32_t crc, const uint8_t *bytes,
+                          uint64_t num_bytes, uint64_t *num_done)
+{
+    uint64_t crc64 = crc;
+    uint64_t i = 0;
+    for (; i + 8 <= num_bytes; i += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(uint64_t));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+
+    *num_done = i;
+    return uint32_t(crc64);
+}
+
+#endif
+
+bool crc32cHardware()
+{
+#ifdef RLPBR_CRC_SSE
+    static const bool supported = []() {
+        __builtin_cpu_init();
+        return bool(__builtin_cpu_supports("sse4.2"));
+    }();
+
+    return supported;
+#else
+    return false;
+#endif
+}
+
+uint32_t crc32c(const void *data, uint64_t num_bytes, bool hardware)
+{
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    uint32_t crc = ~0u;
+    uint64_t i = 0;
+
+#ifdef RLPBR_CRC_SSE
+    if (hardware && crc32cHardware()) {
+        crc = crc32cSSE(crc, bytes, num_bytes, &i);
+    }
+#else
+    (void)hardware;
+#endif
+
+    for (; i < num_bytes; i++) {
+        crc = crc32c_table.values[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
+
+uint64_t tensorBytes(const DatasetTensor &tensor)
+{
+    uint64_t elem_bytes = tensor.type == DatasetType::Float16 ? 2 : 1;
+
+    return uint64_t(tensor.width) * tensor.height * tensor.numChannels *
+        elem_bytes;
+}
+
+bool datasetCodecSupported(DatasetCodec codec)
+{
+    switch (codec) {
+        case DatasetCodec::None: return true;
+#ifdef RLPBR_ZLIB
+        case DatasetCodec::Deflate: return true;
+#endif
+        default: return false;
+    }
+}
+
+static string shardName(uint32_t shard_idx)
+{
+    ostringstream name;
+    name << "shard_" << setw(5) << setfill('0') << shard_idx << ".bin";
+
+    return name.str();
+}
+
+static uint32_t headerChecksum(const IndexHeader &header)
+{
+    return crc32c(&header, offsetof(IndexHeader, checksum));
+}
+
+static uint32_t recordChecksum(const IndexRecord &record)
+{
+    return crc32c(&record, offsetof(IndexRecord, checksum));
+}
+
+static uint64_t recordOffset(uint64_t record_idx)
+{
+    return sizeof(IndexHeader) + record_idx * sizeof(IndexRecord);
+}
+
+static const IndexRecord &getRecord(const uint8_t *index,
+                                    uint64_t record_idx)
+{
+    return *reinterpret_cast<const IndexRecord *>(
+        index + recordOffset(record_idx));
+}
+
+static uint64_t storedBytes(const IndexRecord &record, uint32_t num_tensors)
+{
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < num_tensors; i++) {
+        total += record.storedBytes[i];
+    }
+
+    return total;
+}
+
+static void validateSchema(const DatasetSchema &schema)
+{
+    auto fail = [](const string &msg) {
+        cerr << "Dataset: " << msg << endl;
+        fatalExit();
+    };
+
+    if (schema.tensors.empty() ||
+        schema.tensors.size() > Consts::maxTensors) {
+        fail("between 1 and " + to_string(Consts::maxTensors) +
+             " tensors are supported");
+    }
+
+    if (schema.shardBytes == 0) {
+        fail("shard size must be positive");
+    }
+
+    for (const DatasetTensor &tensor : schema.tensors) {
+        if (tensor.name.empty() ||
+            tensor.name.size() > Consts::maxNameLength) {
+            fail("tensor names must be 1 to " +
+                 to_string(Consts::maxNameLength) + " characters");
+        }
+
+        uint64_t num_bytes = tensorBytes(tensor);
+        // Leaves room for incompressible data to grow in storedBytes
+        if (num_bytes == 0 || num_bytes > (1ull << 31)) {
+            fail(tensor.name + " must hold between 1 byte and 2 GiB");
+        }
+
+        if (!datasetCodecSupported(tensor.codec)) {
+            fail(tensor.name + ": codec not supported by this build");
+        }
+    }
+}
+
+static IndexHeader makeHeader(const DatasetSchema &schema)
+{
+    IndexHeader header {};
+    header.magic = DatasetFormat::magic;
+    header.version = DatasetFormat::version;
+    header.numTensors = schema.tensors.size();
+    header.shardBytes = schema.shardBytes;
+
+    for (uint32_t i = 0; i < schema.tensors.size(); i++) {
+        const DatasetTensor &tensor = schema.tensors[i];
+        TensorHeader &dst = header.tensors[i];
+
+        memcpy(dst.name, tensor.name.data(), tensor.name.size());
+        dst.type = uint32_t(tensor.type);
+        dst.codec = uint32_t(tensor.codec);
+        dst.width = tensor.width;
+        dst.height = tensor.height;
+        dst.numChannels = tensor.numChannels;
+    }
+
+    header.checksum = headerChecksum(header);
+
+    return header;
+}
+
+static DatasetSchema parseHeader(const uint8_t *data, uint64_t num_bytes,
+                                 const string &path)
+{
+    IndexHeader header;
+    if (num_bytes < sizeof(IndexHeader)) {
+        cerr << path << " is not a dataset index" << endl;
+        fatalExit();
+    }
+    memcpy(&header, data, sizeof(IndexHeader));
+
+    if (header.magic != DatasetFormat::magic) {
+        cerr << path << " is not a dataset index" << endl;
+        fatalExit();
+    }
+
+    if (header.version != DatasetFormat::version) {
+        cerr << path << ": unsupported dataset version " <<
+            header.version << endl;
+        fatalExit();
+    }
+
+    if (header.checksum != headerChecksum(header) ||
+        header.numTensors > Consts::maxTensors) {
+        cerr << path << ": corrupt dataset header" << endl;
+        fatalExit();
+    }
+
+    DatasetSchema schema;
+    schema.shardBytes = header.shardBytes;
+    for (uint32_t i = 0; i < header.numTensors; i++) {
+        const TensorHeader &src = header.tensors[i];
+        schema.tensors.push_back({
+            string(src.name, strnlen(src.name, sizeof(src.name))),
+            DatasetType(src.type),
+            DatasetCodec(src.codec),
+            src.width,
+            src.height,
+            src.numChannels,
+        });
+    }
+
+    return schema;
+}
+
+// Records with a valid checksum. Only the last record may be damaged,
+// by a crash while it was being appended.
+static uint64_t numValidRecords(const uint8_t *index, uint64_t num_bytes,
+                                const string &path)
+{
+    uint64_t num_records =
+        (num_bytes - sizeof(IndexHeader)) / sizeof(IndexRecord);
+
+    for (uint64_t i = 0; i < num_records; i++) {
+        const IndexRecord &record = getRecord(index, i);
+        if (record.checksum == recordChecksum(record)) {
+            continue;
+        }
+
+        if (i + 1 == num_records) {
+            return i;
+        }
+
+        cerr << path << ": corrupt record " << i << endl;
+        fatalExit();
+    }
+
+    return num_records;
+}
+
+// Size of a file that may not exist yet
+static uint64_t fileBytes(const string &path)
+{
+    struct stat file_stat;
+    if (stat(path.c_str(), &file_stat) != 0) {
+        return 0;
+    }
+
+    return file_stat.st_size;
+}
+
+// Records before the first one whose scene or stored data is missing.
+// Nothing orders the writes to the shards, scenes.txt and the index on
+// disk, so after a crash any number of trailing records may point past
+// the end of their shard, or at a shard that was never created.
+static uint64_t numCompleteRecords(const uint8_t *index,
+                                   uint64_t num_records,
+                                   uint32_t num_tensors,
+                                   uint64_t num_scenes,
+                                   const string &dir)
+{
+    vector<uint64_t> shard_bytes;
+    for (uint64_t i = 0; i < num_records; i++) {
+        const IndexRecord &record = getRecord(index, i);
+        while (shard_bytes.size() <= record.shard) {
+            shard_bytes.push_back(
+                fileBytes(dir + "/" + shardName(shard_bytes.size())));
+        }
+
+        bool complete = record.sceneIdx < num_scenes &&
+            record.offset + storedBytes(record, num_tensors) <=
+                shard_bytes[record.shard];
+
+        if (!complete) {
+            return i;
+        }
+    }
+
+    return num_records;
+}
+
+static vector<uint8_t> readFile(const string &path)
+{
+    ifstream file(path, ios::binary);
+    if (!file.is_open()) {
+        cerr << "Failed to open " << path << endl;
+        fatalExit();
+    }
+
+    return vector<uint8_t>(istreambuf_iterator<char>(file),
+                           istreambuf_iterator<char>());
+}
+
+// Complete lines only, a crash may have cut off the last one
+static vector<string> readLines(const string &path, uint64_t *num_bytes)
+{
+    vector<uint8_t> data = readFile(path);
+    vector<string> lines;
+
+    uint64_t line_start = 0;
+    for (uint64_t i = 0; i < data.size(); i++) {
+        if (data[i] == '\n') {
+            lines.emplace_back((const char *)data.data() + line_start,
+                               i - line_start);
+            line_start = i + 1;
+        }
+    }
+
+    if (num_bytes) {
+        *num_bytes = line_start;
+    }
+
+    return lines;
+}
+
+static int openFile(const string &path, int flags)
+{
+    int fd = open(path.c_str(), flags | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        cerr << "Failed to open " << path << ": " << strerror(errno) <<
+            endl;
+        fatalExit();
+    }
+
+    return fd;
+}
+
+static void truncateFile(int fd, uint64_t num_bytes, const string &path)
+{
+    if (ftruncate(fd, num_bytes) != 0) {
+        cerr << "Failed to truncate " << path << ": " << strerror(errno) <<
+            endl;
+        fatalExit();
+    }
+}
+
+static void writeAll(int fd, const void *data, uint64_t num_bytes,
+                     uint64_t offset, const string &path)
+{
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    while (num_bytes > 0) {
+        ssize_t num_written = pwrite(fd, bytes, num_bytes, offset);
+        if (num_written < 0) {
+            if (errno == EINTR) continue;
+
+            cerr << "Failed to write " << path << ": " << strerror(errno) <<
+                endl;
+            fatalExit();
+        }
+
+        bytes += num_written;
+        offset += num_written;
+        num_bytes -= num_written;
+    }
+}
+
+// Channel byte planes delta coded, then deflated into scratch
+static EncodedTensor encodeTensor(const DatasetTensor &tensor,
+                                  const void *data,
+                                  vector<uint8_t> &scratch)
+{
+    const uint8_t *src = static_cast<const uint8_t *>(data);
+    uint64_t num_bytes = tensorBytes(tensor);
+
+    if (tensor.codec == DatasetCodec::None) {
+        return {
+            src,
+            uint32_t(num_bytes),
+            crc32c(src, num_bytes),
+        };
+    }
+
+#ifdef RLPBR_ZLIB
+    uint32_t stride = num_bytes / (uint64_t(tensor.width) * tensor.height);
+    uint64_t num_pixels = num_bytes / stride;
+
+    vector<uint8_t> planes(num_bytes);
+    uint8_t prev = 0;
+    uint64_t out_idx = 0;
+    for (uint32_t plane = 0; plane < stride; plane++) {
+        for (uint64_t pixel = 0; pixel < num_pixels; pixel++) {
+            uint8_t v = src[pixel * stride + plane];
+            planes[out_idx++] = v - prev;
+            prev = v;
+        }
+    }
+
+    uLongf num_compressed = compressBound(num_bytes);
+    scratch.resize(num_compressed);
+    if (compress2(scratch.data(), &num_compressed, planes.data(), num_bytes,
+                  DatasetFormat::deflateLevel) != Z_OK) {
+        cerr << "Dataset: failed to compress " << tensor.name << endl;
+        fatalExit();
+    }
+
+    return {
+        scratch.data(),
+        uint32_t(num_compressed),
+        crc32c(scratch.data(), num_compressed),
+    };
+#else
+    (void)scratch;
+    unreachable();
+#endif
+}
+
+static bool decodeTensor(const DatasetTensor &tensor, const uint8_t *stored,
+                         uint32_t stored_bytes, uint8_t *dst)
+{
+    uint64_t num_bytes = tensorBytes(tensor);
+
+    if (tensor.codec == DatasetCodec::None) {
+        if (stored_bytes != num_bytes) {
+            return false;
+        }
+
+        memcpy(dst, stored, num_bytes);
+        return true;
+    }
+
+#ifdef RLPBR_ZLIB
+    uint32_t stride = num_bytes / (uint64_t(tensor.width) * tensor.height);
+    uint64_t num_pixels = num_bytes / stride;
+
+    vector<uint8_t> planes(num_bytes);
+    uLongf num_decompressed = num_bytes;
+    if (uncompress(planes.data(), &num_decompressed, stored,
+                   stored_bytes) != Z_OK ||
+        num_decompressed != num_bytes) {
+        return false;
+    }
+
+    uint8_t prev = 0;
+    uint64_t in_idx = 0;
+    for (uint32_t plane = 0; plane < stride; plane++) {
+        for (uint64_t pixel = 0; pixel < num_pixels; pixel++) {
+            prev += planes[in_idx++];
+            dst[pixel * stride + plane] = prev;
+        }
+    }
+
+    return true;
+#else
+    unreachable();
+#endif
+}
+
+static bool sameTensors(const DatasetSchema &a, const DatasetSchema &b)
+{
+    if (a.tensors.size() != b.tensors.size()) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < a.tensors.size(); i++) {
+        const DatasetTensor &x = a.tensors[i];
+        const DatasetTensor &y = b.tensors[i];
+        if (x.name != y.name || x.type != y.type || x.codec != y.codec ||
+            x.width != y.width || x.height != y.height ||
+            x.numChannels != y.numChannels) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+DatasetWriter::DatasetWriter(string_view dir, const DatasetSchema &schema)
+    : dir_(dir),
+      schema_(schema),
+      lock_(),
+      index_fd_(-1),
+      scenes_fd_(-1),
+      shard_fd_(-1),
+      scenes_bytes_(0),
+      shard_idx_(0),
+      shard_offset_(0),
+      num_samples_(0),
+      scene_ids_()
+{
+    validateSchema(schema_);
+
+    if (mkdir(dir_.c_str(), 0755) != 0 && errno != EEXIST) {
+        cerr << "Failed to create " << dir_ << ": " << strerror(errno) <<
+            endl;
+        fatalExit();
+    }
+
+    string index_path = dir_ + "/" + DatasetFormat::indexName;
+    string scenes_path = dir_ + "/" + DatasetFormat::scenesName;
+
+    struct stat index_stat;
+    bool exists = stat(index_path.c_str(), &index_stat) == 0 &&
+        index_stat.st_size > 0;
+
+    index_fd_ = openFile(index_path, O_WRONLY | O_CREAT);
+
+    if (!exists) {
+        IndexHeader header = makeHeader(schema_);
+        writeAll(index_fd_, &header, sizeof(IndexHeader), 0, index_path);
+
+        scenes_fd_ = openFile(scenes_path, O_WRONLY | O_CREAT | O_TRUNC);
+        openShard(0, 0);
+
+        return;
+    }
+
+    vector<uint8_t> index = readFile(index_path);
+    DatasetSchema existing = parseHeader(index.data(), index.size(),
+                                         index_path);
+    if (!sameTensors(existing, schema_)) {
+        cerr << dir_ << " holds a dataset with different tensors" << endl;
+        fatalExit();
+    }
+
+    if (existing.shardBytes != schema_.shardBytes) {
+        cerr << dir_ << " holds a dataset with " << existing.shardBytes <<
+            " byte shards, not " << schema_.shardBytes << endl;
+        fatalExit();
+    }
+
+    vector<string> scenes = readLines(scenes_path, &scenes_bytes_);
+    for (uint32_t i = 0; i < scenes.size(); i++) {
+        scene_ids_.emplace(scenes[i], i);
+    }
+
+    // Same samples DatasetReader sees, the rest are overwritten
+    num_samples_ = numCompleteRecords(index.data(),
+        numValidRecords(index.data(), index.size(), index_path),
+        schema_.tensors.size(), scenes.size(), dir_);
+    truncateFile(index_fd_, recordOffset(num_samples_), index_path);
+
+    scenes_fd_ = openFile(scenes_path, O_WRONLY);
+    truncateFile(scenes_fd_, scenes_bytes_, scenes_path);
+
+    // Drops whatever a crash left past the last complete sample
+    if (num_samples_ > 0) {
+        const IndexRecord &last = getRecord(index.data(), num_samples_ - 1);
+        openShard(last.shard, last.offset +
+                  storedBytes(last, schema_.tensors.size()));
+    } else {
+        openShard(0, 0);
+    }
+}
+
+DatasetWriter::~DatasetWriter()
+{
+    close(index_fd_);
+    close(scenes_fd_);
+    close(shard_fd_);
+}
+
+void DatasetWriter::openShard(uint32_t shard_idx, uint64_t num_bytes)
+{
+    if (shard_fd_ != -1) {
+        close(shard_fd_);
+    }
+
+    string path = dir_ + "/" + shardName(shard_idx);
+    shard_fd_ = openFile(path, O_WRONLY | O_CREAT);
+    truncateFile(shard_fd_, num_bytes, path);
+
+    shard_idx_ = shard_idx;
+    shard_offset_ = num_bytes;
+}
+
+// Stored form of a sample, everything but its location and scene index
+struct DatasetWriter::EncodedSample {
+    vector<uint8_t> scratch[Consts::maxTensors];
+    EncodedTensor tensors[Consts::maxTensors];
+    IndexRecord record;
+    uint64_t numBytes;
+};
+
+void DatasetWriter::encode(const SampleMetadata &metadata,
+                           const void * const *tensors,
+                           EncodedSample &encoded) const
+{
+    if (metadata.scene.find('\n') != string::npos) {
+        cerr << "Dataset: scene names can't contain newlines" << endl;
+        fatalExit();
+    }
+
+    IndexRecord &record = encoded.record;
+    record = {};
+    encoded.numBytes = 0;
+
+    for (uint32_t i = 0; i < schema_.tensors.size(); i++) {
+        EncodedTensor &tensor = encoded.tensors[i];
+        tensor = encodeTensor(schema_.tensors[i], tensors[i],
+                              encoded.scratch[i]);
+
+        record.storedBytes[i] = tensor.numBytes;
+        record.checksums[i] = tensor.checksum;
+        encoded.numBytes += tensor.numBytes;
+    }
+
+    const glm::vec3 *camera[] = {
+        &metadata.position, &metadata.view, &metadata.up, &metadata.right,
+    };
+    for (uint32_t i = 0; i < 4; i++) {
+        for (uint32_t j = 0; j < 3; j++) {
+            record.camera[i * 3 + j] = (*camera[i])[j];
+        }
+    }
+
+    record.spp = metadata.spp;
+    record.envIdx = metadata.randomKey.envIdx;
+    record.episode = metadata.randomKey.episode;
+    record.seed = metadata.randomKey.seed;
+}
+
+// Caller holds lock_
+uint64_t DatasetWriter::commit(const string &scene, EncodedSample &encoded)
+{
+    if (shard_offset_ > 0 &&
+        shard_offset_ + encoded.numBytes > schema_.shardBytes) {
+        openShard(shard_idx_ + 1, 0);
+    }
+
+    string shard_path = dir_ + "/" + shardName(shard_idx_);
+    uint64_t offset = shard_offset_;
+    for (uint32_t i = 0; i < schema_.tensors.size(); i++) {
+        const EncodedTensor &tensor = encoded.tensors[i];
+        writeAll(shard_fd_, tensor.data, tensor.numBytes, offset,
+                 shard_path);
+        offset += tensor.numBytes;
+    }
+
+    auto [scene_iter, new_scene] = scene_ids_.emplace(scene,
+                                                      scene_ids_.size());
+    if (new_scene) {
+        string line = scene + "\n";
+        writeAll(scenes_fd_, line.data(), line.size(), scenes_bytes_,
+                 dir_ + "/" + DatasetFormat::scenesName);
+        scenes_bytes_ += line.size();
+    }
+
+    IndexRecord &record = encoded.record;
+    record.shard = shard_idx_;
+    record.offset = shard_offset_;
+    record.sceneIdx = scene_iter->second;
+    record.checksum = recordChecksum(record);
+
+    writeAll(index_fd_, &record, sizeof(IndexRecord),
+             recordOffset(num_samples_),
+             dir_ + "/" + DatasetFormat::indexName);
+
+    shard_offset_ = offset;
+
+    return num_samples_++;
+}
+
+uint64_t DatasetWriter::append(const SampleMetadata &metadata,
+                               const void * const *tensors)
+{
+    EncodedSample encoded;
+    encode(metadata, tensors, encoded);
+
+    lock_guard<mutex> lock(lock_);
+    return commit(metadata.scene, encoded);
+}
+
+uint64_t DatasetWriter::appendBatch(const SampleMetadata *metadata,
+                                    const void * const *tensors,
+                                    uint32_t num_samples,
+                                    BatchPrepPool &pool)
+{
+    uint32_t num_tensors = schema_.tensors.size();
+    vector<EncodedSample> encoded(num_samples);
+
+    pool.run(num_samples, [&](uint32_t begin, uint32_t end) {
+        for (uint32_t i = begin; i < end; i++) {
+            encode(metadata[i], tensors + i * num_tensors, encoded[i]);
+        }
+    }, 1);
+
+    lock_guard<mutex> lock(lock_);
+
+    uint64_t first_idx = num_samples_;
+    for (uint32_t i = 0; i < num_samples; i++) {
+        commit(metadata[i].scene, encoded[i]);
+    }
+
+    return first_idx;
+}
+
+void DatasetWriter::sync()
+{
+    lock_guard<mutex> lock(lock_);
+
+    fsync(shard_fd_);
+    fsync(scenes_fd_);
+    fsync(index_fd_);
+}
+
+uint64_t DatasetWriter::numSamples() const
+{
+    lock_guard<mutex> lock(lock_);
+    return num_samples_;
+}
+
+static void unmap(const uint8_t *data, uint64_t num_bytes)
+{
+    if (num_bytes > 0) {
+        munmap(const_cast<uint8_t *>(data), num_bytes);
+    }
+}
+
+static void mapFile(const string &path, bool random_access,
+                    const uint8_t **data, uint64_t *num_bytes)
+{
+    IOFile file(path);
+    *num_bytes = file.numBytes();
+    if (*num_bytes == 0) {
+        *data = nullptr;
+        return;
+    }
+
+    void *mapped = mmap(nullptr, *num_bytes, PROT_READ, MAP_PRIVATE,
+                        file.getFD(), 0);
+    if (mapped == MAP_FAILED) {
+        cerr << "Failed to map " << path << ": " << strerror(errno) << endl;
+        fatalExit();
+    }
+
+    if (random_access) {
+        madvise(mapped, *num_bytes, MADV_RANDOM);
+    }
+
+    *data = static_cast<const uint8_t *>(mapped);
+}
+
+DatasetReader::DatasetReader(string_view dir)
+    : dir_(dir),
+      schema_(),
+      scenes_(),
+      index_(),
+      shards_(),
+      num_samples_(0)
+{
+    string index_path = dir_ + "/" + DatasetFormat::indexName;
+    mapFile(index_path, false, &index_.data, &index_.numBytes);
+
+    schema_ = parseHeader(index_.data, index_.numBytes, index_path);
+    for (const DatasetTensor &tensor : schema_.tensors) {
+        if (!datasetCodecSupported(tensor.codec)) {
+            cerr << dir_ << ": " << tensor.name <<
+                " uses a codec not supported by this build" << endl;
+            fatalExit();
+        }
+    }
+
+    scenes_ = readLines(dir_ + "/" + DatasetFormat::scenesName, nullptr);
+
+    num_samples_ = numCompleteRecords(index_.data,
+        numValidRecords(index_.data, index_.numBytes, index_path),
+        schema_.tensors.size(), scenes_.size(), dir_);
+
+    uint32_t num_shards = 0;
+    for (uint64_t i = 0; i < num_samples_; i++) {
+        num_shards = max(num_shards,
+                         getRecord(index_.data, i).shard + 1);
+    }
+
+    shards_.resize(num_shards);
+    for (uint32_t i = 0; i < num_shards; i++) {
+        mapFile(dir_ + "/" + shardName(i), true, &shards_[i].data,
+                &shards_[i].numBytes);
+    }
+
+    // The shards may have been truncated since they were measured
+    uint32_t num_tensors = schema_.tensors.size();
+    for (uint64_t i = 0; i < num_samples_; i++) {
+        const IndexRecord &record = getRecord(index_.data, i);
+        if (record.offset + storedBytes(record, num_tensors) >
+                shards_[record.shard].numBytes) {
+            cerr << dir_ << ": sample " << i << " points past its shard" <<
+                endl;
+            fatalExit();
+        }
+    }
+}
+
+DatasetReader::~DatasetReader()
+{
+    unmap(index_.data, index_.numBytes);
+
+    for (const Mapping &shard : shards_) {
+        unmap(shard.data, shard.numBytes);
+    }
+}
+
+SampleMetadata DatasetReader::getMetadata(uint64_t sample_idx) const
+{
+    if (sample_idx >= num_samples_) {
+        cerr << "Dataset sample " << sample_idx << " out of range" << endl;
+        fatalExit();
+    }
+
+    const IndexRecord &record = getRecord(index_.data, sample_idx);
+
+    SampleMetadata metadata;
+    metadata.scene = scenes_[record.sceneIdx];
+
+    glm::vec3 *camera[] = {
+        &metadata.position, &metadata.view, &metadata.up, &metadata.right,
+    };
+    for (uint32_t i = 0; i < 4; i++) {
+        *camera[i] = glm::vec3(record.camera[i * 3],
+                               record.camera[i * 3 + 1],
+                               record.camera[i * 3 + 2]);
+    }
+
+    metadata.spp = record.spp;
+    metadata.randomKey = {
+        record.seed,
+        record.envIdx,
+        record.episode,
+    };
+
+    return metadata;
+}
+
+bool DatasetReader::read(uint64_t sample_idx, uint32_t tensor_idx,
+                         void *dst) const
+{
+    if (sample_idx >= num_samples_ ||
+        tensor_idx >= schema_.tensors.size()) {
+        cerr << "Dataset sample " << sample_idx << " tensor " <<
+            tensor_idx << " out of range" << endl;
+        fatalExit();
+    }
+
+    const IndexRecord &record = getRecord(index_.data, sample_idx);
+
+    const uint8_t *stored = shards_[record.shard].data + record.offset +
+        storedBytes(record, tensor_idx);
+    uint32_t num_bytes = record.storedBytes[tensor_idx];
+
+    if (crc32c(stored, num_bytes) != record.checksums[tensor_idx]) {
+        return false;
+    }
+
+    return decodeTensor(schema_.tensors[tensor_idx], stored, num_bytes,
+                        static_cast<uint8_t *>(dst));
+}
+
+}
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <rlpbr/environment.hpp>
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace RLpbr {
+
+class BatchPrepPool;
+
+// Rendered samples packed into a directory instead of one file per image:
+//   index.bin      header with the schema, then one fixed size record per
+//                  sample: shard, offset, stored size and CRC32C of each
+//                  tensor, metadata and the record's own CRC32C
+//   scenes.txt     scene names, one per line, referenced by index
+//   shard_N.bin    stored tensors of consecutive samples back to back
+// Files are only ever appended to, samples are written to their shard
+// before their record. Without DatasetWriter::sync nothing orders those
+// writes on disk, so a crash can leave a partial last record and any
+// number of trailing records whose scene or data never arrived. Both the
+// reader and an appending writer drop them. Little endian.
+
+enum class DatasetType : uint32_t {
+    Float16,
+    Uint8,
+};
+
+enum class DatasetCodec : uint32_t {
+    None,
+    // Byte planes of each channel, delta coded, then zlib. Only available
+    // when built with zlib, see datasetCodecSupported.
+    Deflate,
+};
+
+struct DatasetConstants {
+    static constexpr uint32_t maxTensors = 8;
+    static constexpr uint32_t maxNameLength = 31;
+    static constexpr uint64_t defaultShardBytes = 1ull << 30;
+};
+
+// One image per sample, width x height x numChannels, HWC
+struct DatasetTensor {
+    std::string name;
+    DatasetType type;
+    DatasetCodec codec;
+    uint32_t width;
+    uint32_t height;
+    uint32_t numChannels;
+};
+
+struct DatasetSchema {
+    std::vector<DatasetTensor> tensors;
+    // A new shard is started once the current one would grow past this
+    uint64_t shardBytes;
+};
+
+struct SampleMetadata {
+    std::string scene;
+    glm::vec3 position;
+    glm::vec3 view;
+    glm::vec3 up;
+    glm::vec3 right;
+    uint32_t spp;
+    RandomKey randomKey;
+};
+
+uint64_t tensorBytes(const DatasetTensor &tensor);
+
+bool datasetCodecSupported(DatasetCodec codec);
+
+// Castagnoli CRC, using the SSE 4.2 crc32 instruction when the CPU
+// supports it unless hardware is false
+uint32_t crc32c(const void *data, uint64_t num_bytes, bool hardware = true);
+
+// Whether crc32c uses the SSE 4.2 instruction
+bool crc32cHardware();
+
+// Creates a dataset in dir or, if dir already holds one with the same
+// schema (including shardBytes), appends to it.
+class DatasetWriter {
+public:
+    DatasetWriter(std::string_view dir, const DatasetSchema &schema);
+    DatasetWriter(const DatasetWriter &) = delete;
+    ~DatasetWriter();
+
+    // tensors[i] is schema.tensors[i]'s data. Returns the sample's index.
+    // Safe to call from multiple threads, compression runs outside the
+    // lock so samples are numbered in the order they finish encoding.
+    uint64_t append(const SampleMetadata &metadata,
+                    const void * const *tensors);
+
+    // Encodes num_samples samples on pool and appends them in order,
+    // tensors[i * numTensors + j] is tensor j of sample i. Returns the
+    // first sample's index.
+    uint64_t appendBatch(const SampleMetadata *metadata,
+                         const void * const *tensors,
+                         uint32_t num_samples, BatchPrepPool &pool);
+
+    // Flushes everything appended so far to disk
+    void sync();
+
+    uint64_t numSamples() const;
+    inline const DatasetSchema &getSchema() const { return schema_; }
+
+private:
+    struct EncodedSample;
+
+    void openShard(uint32_t shard_idx, uint64_t num_bytes);
+    void encode(const SampleMetadata &metadata,
+                const void * const *tensors,
+                EncodedSample &encoded) const;
+    uint64_t commit(const std::string &scene, EncodedSample &encoded);
+
+    std::string dir_;
+    DatasetSchema schema_;
+    mutable std::mutex lock_;
+
+    int index_fd_;
+    int scenes_fd_;
+    int shard_fd_;
+    uint64_t scenes_bytes_;
+    uint32_t shard_idx_;
+    uint64_t shard_offset_;
+    uint64_t num_samples_;
+    std::unordered_map<std::string, uint32_t> scene_ids_;
+};
+
+// Read only view of a dataset with the index and shards memory mapped.
+// Sees the samples present when it was opened. All methods are const and
+// safe to call concurrently.
+class DatasetReader {
+public:
+    DatasetReader(std::string_view dir);
+    DatasetReader(const DatasetReader &) = delete;
+    ~DatasetReader();
+
+    inline uint64_t numSamples() const { return num_samples_; }
+    inline const DatasetSchema &getSchema() const { return schema_; }
+
+    SampleMetadata getMetadata(uint64_t sample_idx) const;
+
+    // Decodes tensor_idx of sample_idx into dst, which holds
+    // tensorBytes(getSchema().tensors[tensor_idx]) bytes. Returns false if
+    // the stored data fails its checksum or doesn't decode.
+    bool read(uint64_t sample_idx, uint32_t tensor_idx, void *dst) const;
+
+private:
+    struct Mapping {
+        const uint8_t *data;
+        uint64_t numBytes;
+    };
+
+    std::string dir_;
+    DatasetSchema schema_;
+    std::vector<std::string> scenes_;
+    Mapping index_;
+    std::vector<Mapping> shards_;
+    uint64_t num_samples_;
+};
+
+}
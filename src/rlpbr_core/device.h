@@ -24,4 +24,7 @@ SHADER_CONST uint32_t MaterialFlagsHasTransmissionTexture = 1 << 7;
 SHADER_CONST uint32_t MaterialFlagsHasClearcoatTexture    = 1 << 8;
 SHADER_CONST uint32_t MaterialFlagsHasAnisotropicTexture  = 1 << 9;
 
+// Lights per block of the two level light alias tables (LightSampler)
+SHADER_CONST uint32_t LightSamplerBlockSize = 64;
+
 #endif
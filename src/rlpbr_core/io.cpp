@@ -0,0 +1,548 @@
+#include "io.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef RLPBR_IO_URING
+#include <liburing.h>
+#endif
+
+using namespace std;
+
+namespace RLpbr {
+
+namespace IOConfig {
+constexpr uint64_t chunkBytes = 4 * 1024 * 1024;
+constexpr uint32_t maxThreads = 16;
+constexpr uint32_t minThreads = 4;
+}
+
+IOFile::IOFile(string_view path)
+    : fd_(-1),
+      num_bytes_(0)
+{
+    string path_str(path);
+    fd_ = open(path_str.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd_ == -1) {
+        cerr << "Failed to open " << path_str << ": " << strerror(errno)
+             << endl;
+        fatalExit();
+    }
+
+    struct stat file_stat;
+    if (fstat(fd_, &file_stat) != 0) {
+        cerr << "Failed to stat " << path_str << ": " << strerror(errno)
+             << endl;
+        fatalExit();
+    }
+
+    num_bytes_ = file_stat.st_size;
+}
+
+IOFile::IOFile(IOFile &&o)
+    : fd_(o.fd_),
+      num_bytes_(o.num_bytes_)
+{
+    o.fd_ = -1;
+}
+
+IOFile::~IOFile()
+{
+    if (fd_ == -1) return;
+
+    close(fd_);
+}
+
+IOFile & IOFile::operator=(IOFile &&o)
+{
+    if (this == &o) {
+        return *this;
+    }
+
+    if (fd_ != -1) {
+        close(fd_);
+    }
+
+    fd_ = o.fd_;
+    num_bytes_ = o.num_bytes_;
+    o.fd_ = -1;
+
+    return *this;
+}
+
+IOBatch::IOBatch()
+    : lock_(),
+      cv_(),
+      num_pending_(0),
+      failed_(false)
+{}
+
+bool IOBatch::wait()
+{
+    unique_lock lock(lock_);
+    cv_.wait(lock, [this]() { return num_pending_ == 0; });
+
+    return !failed_;
+}
+
+void IOBatch::add(uint32_t num_reads)
+{
+    lock_guard lock(lock_);
+    num_pending_ += num_reads;
+}
+
+void IOBatch::finish(bool success)
+{
+    // Notified under the lock: once wait() sees no pending reads the
+    // batch may be destroyed, so it must not be touched after unlocking
+    lock_guard lock(lock_);
+    num_pending_--;
+    failed_ |= !success;
+
+    if (num_pending_ == 0) {
+        cv_.notify_all();
+    }
+}
+
+// In flight state for a single read
+struct IOCompletion {
+    IORead read;
+    IOBatch *batch;
+    uint64_t numRead;
+
+    static void finish(IOCompletion *completion, bool success)
+    {
+        if (success && completion->read.onComplete) {
+            completion->read.onComplete();
+        }
+
+        completion->batch->finish(success);
+
+        delete completion;
+    }
+};
+
+class IOBackend {
+public:
+    virtual ~IOBackend() = default;
+    virtual void submit(IOCompletion **reqs, uint32_t num_reqs) = 0;
+};
+
+namespace {
+
+class ThreadPoolIO : public IOBackend {
+public:
+    ThreadPoolIO(uint32_t num_threads);
+    ~ThreadPoolIO();
+
+    void submit(IOCompletion **reqs, uint32_t num_reqs) override;
+
+private:
+    void workerLoop();
+
+    mutex lock_;
+    condition_variable cv_;
+    deque<IOCompletion *> queue_;
+    bool should_exit_;
+    vector<thread> workers_;
+};
+
+ThreadPoolIO::ThreadPoolIO(uint32_t num_threads)
+    : lock_(),
+      cv_(),
+      queue_(),
+      should_exit_(false),
+      workers_()
+{
+    workers_.reserve(num_threads);
+    for (int i = 0; i < (int)num_threads; i++) {
+        workers_.emplace_back([this]() { workerLoop(); });
+    }
+}
+
+ThreadPoolIO::~ThreadPoolIO()
+{
+    {
+        lock_guard lock(lock_);
+        should_exit_ = true;
+    }
+    cv_.notify_all();
+
+    for (thread &t : workers_) {
+        t.join();
+    }
+}
+
+void ThreadPoolIO::submit(IOCompletion **reqs, uint32_t num_reqs)
+{
+    {
+        lock_guard lock(lock_);
+        for (int i = 0; i < (int)num_reqs; i++) {
+            queue_.push_back(reqs[i]);
+        }
+    }
+
+    if (num_reqs == 1) {
+        cv_.notify_one();
+    } else {
+        cv_.notify_all();
+    }
+}
+
+static bool preadFully(IOCompletion &req)
+{
+    const IORead &read = req.read;
+    while (req.numRead < read.numBytes) {
+        ssize_t res = pread(read.fd, (char *)read.dst + req.numRead,
+                            read.numBytes - req.numRead,
+                            read.offset + req.numRead);
+
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return false;
+        }
+
+        // Unexpected EOF. Zero byte reads never get here and succeed.
+        if (res == 0) {
+            return false;
+        }
+
+        req.numRead += res;
+    }
+
+    return true;
+}
+
+void ThreadPoolIO::workerLoop()
+{
+    while (true) {
+        IOCompletion *req;
+        {
+            unique_lock lock(lock_);
+            cv_.wait(lock, [this]() {
+                return should_exit_ || !queue_.empty();
+            });
+
+            if (queue_.empty()) {
+                return;
+            }
+
+            req = queue_.front();
+            queue_.pop_front();
+        }
+
+        bool success = preadFully(*req);
+        IOCompletion::finish(req, success);
+    }
+}
+
+#ifdef RLPBR_IO_URING
+
+// Submissions happen on the caller's thread under sq_lock_, a single
+// reaper thread drains the completion queue and resubmits short reads.
+// Completion callbacks run on the reaper, so submissions made from them
+// never wait for queue space: past queue_depth_ they are parked in
+// overflow_ and the reaper issues them as earlier reads complete.
+class URingIO : public IOBackend {
+public:
+    static unique_ptr<URingIO> make(uint32_t queue_depth);
+    ~URingIO();
+
+    void submit(IOCompletion **reqs, uint32_t num_reqs) override;
+
+private:
+    URingIO(uint32_t queue_depth);
+
+    void prepRead(IOCompletion *req);
+    void reapLoop();
+
+    io_uring ring_;
+    uint32_t queue_depth_;
+    mutex sq_lock_;
+    condition_variable sq_cv_;
+    uint32_t num_inflight_;
+    deque<IOCompletion *> overflow_;
+    thread reaper_;
+};
+
+URingIO::URingIO(uint32_t queue_depth)
+    : ring_(),
+      queue_depth_(queue_depth),
+      sq_lock_(),
+      sq_cv_(),
+      num_inflight_(0),
+      overflow_(),
+      reaper_()
+{}
+
+unique_ptr<URingIO> URingIO::make(uint32_t queue_depth)
+{
+    unique_ptr<URingIO> uring(new URingIO(queue_depth));
+
+    // Fails on old kernels or when io_uring is blocked by seccomp
+    int res = io_uring_queue_init(queue_depth, &uring->ring_, 0);
+    if (res < 0) {
+        return nullptr;
+    }
+
+    uring->reaper_ = thread([ptr = uring.get()]() {
+        ptr->reapLoop();
+    });
+
+    return uring;
+}
+
+URingIO::~URingIO()
+{
+    unique_lock lock(sq_lock_);
+    sq_cv_.wait(lock, [this]() {
+        return num_inflight_ == 0 && overflow_.empty();
+    });
+
+    // Null user data signals the reaper to exit
+    io_uring_sqe *sqe = io_uring_get_sqe(&ring_);
+    io_uring_prep_nop(sqe);
+    io_uring_sqe_set_data(sqe, nullptr);
+    io_uring_submit(&ring_);
+    lock.unlock();
+
+    reaper_.join();
+
+    io_uring_queue_exit(&ring_);
+}
+
+void URingIO::prepRead(IOCompletion *req)
+{
+    io_uring_sqe *sqe = io_uring_get_sqe(&ring_);
+    if (sqe == nullptr) {
+        io_uring_submit(&ring_);
+        sqe = io_uring_get_sqe(&ring_);
+    }
+
+    const IORead &read = req->read;
+    uint64_t num_remaining = read.numBytes - req->numRead;
+
+    io_uring_prep_read(sqe, read.fd, (char *)read.dst + req->numRead,
+                       min<uint64_t>(num_remaining, 1u << 30),
+                       read.offset + req->numRead);
+    io_uring_sqe_set_data(sqe, req);
+}
+
+void URingIO::submit(IOCompletion **reqs, uint32_t num_reqs)
+{
+    bool on_reaper = this_thread::get_id() == reaper_.get_id();
+
+    unique_lock lock(sq_lock_);
+
+    for (int i = 0; i < (int)num_reqs; i++) {
+        // The reaper can't wait on itself to free a slot
+        if (on_reaper && num_inflight_ >= queue_depth_) {
+            overflow_.push_back(reqs[i]);
+            continue;
+        }
+
+        // Bound in flight requests so the CQ can never overflow
+        while (num_inflight_ >= queue_depth_) {
+            io_uring_submit(&ring_);
+            sq_cv_.wait(lock);
+        }
+
+        prepRead(reqs[i]);
+        num_inflight_++;
+    }
+
+    io_uring_submit(&ring_);
+}
+
+void URingIO::reapLoop()
+{
+    while (true) {
+        io_uring_cqe *cqe;
+        int res = io_uring_wait_cqe(&ring_, &cqe);
+        if (res == -EINTR) {
+            continue;
+        } else if (res < 0) {
+            cerr << "io_uring wait failed: " << strerror(-res) << endl;
+            fatalExit();
+        }
+
+        auto *req = (IOCompletion *)io_uring_cqe_get_data(cqe);
+        int read_res = cqe->res;
+        io_uring_cqe_seen(&ring_, cqe);
+
+        if (req == nullptr) {
+            return;
+        }
+
+        bool success = true;
+        bool resubmit = false;
+        if (read_res < 0) {
+            if (read_res == -EAGAIN || read_res == -EINTR) {
+                resubmit = true;
+            } else {
+                success = false;
+            }
+        } else if (read_res == 0) {
+            // Zero byte reads complete immediately, as in preadFully,
+            // anything else is an unexpected EOF
+            success = req->numRead == req->read.numBytes;
+        } else {
+            req->numRead += read_res;
+            resubmit = req->numRead < req->read.numBytes;
+        }
+
+        if (resubmit) {
+            lock_guard lock(sq_lock_);
+            prepRead(req);
+            io_uring_submit(&ring_);
+
+            continue;
+        }
+
+        {
+            lock_guard lock(sq_lock_);
+            // Hand the slot to a parked request, if any
+            if (overflow_.empty()) {
+                num_inflight_--;
+            } else {
+                prepRead(overflow_.front());
+                overflow_.pop_front();
+                io_uring_submit(&ring_);
+            }
+        }
+        sq_cv_.notify_all();
+
+        IOCompletion::finish(req, success);
+    }
+}
+
+#endif
+
+}
+
+IOEngine::IOEngine(Mode mode, uint32_t queue_depth, uint32_t num_threads)
+    : mode_(mode),
+      backend_()
+{
+    if (num_threads == 0) {
+        num_threads = clamp(thread::hardware_concurrency(),
+                            IOConfig::minThreads, IOConfig::maxThreads);
+    }
+
+#ifdef RLPBR_IO_URING
+    if (mode != Mode::ThreadPool) {
+        backend_ = URingIO::make(queue_depth);
+
+        if (backend_) {
+            mode_ = Mode::IOURing;
+        } else if (mode == Mode::IOURing) {
+            cerr << "io_uring unavailable, falling back to thread pool I/O"
+                 << endl;
+        }
+    }
+#else
+    (void)queue_depth;
+    if (mode == Mode::IOURing) {
+        cerr << "io_uring support not enabled at compile time, " <<
+            "falling back to thread pool I/O" << endl;
+    }
+#endif
+
+    if (!backend_) {
+        backend_ = make_unique<ThreadPoolIO>(num_threads);
+        mode_ = Mode::ThreadPool;
+    }
+}
+
+IOEngine::~IOEngine() = default;
+
+void IOEngine::submit(IOBatch &batch, const IORead *reads,
+                      uint32_t num_reads)
+{
+    if (num_reads == 0) return;
+
+    DynArray<IOCompletion *> reqs(num_reads);
+    for (int i = 0; i < (int)num_reads; i++) {
+        reqs[i] = new IOCompletion {
+            reads[i],
+            &batch,
+            0,
+        };
+    }
+
+    batch.add(num_reads);
+    backend_->submit(reqs.data(), num_reads);
+}
+
+void IOEngine::submitChunked(IOBatch &batch, int fd, void *dst,
+                             uint64_t offset, uint64_t num_bytes)
+{
+    vector<IORead> chunks;
+    chunks.reserve(num_bytes / IOConfig::chunkBytes + 1);
+
+    for (uint64_t chunk_offset = 0; chunk_offset < num_bytes;
+         chunk_offset += IOConfig::chunkBytes) {
+        chunks.push_back({
+            fd,
+            (char *)dst + chunk_offset,
+            offset + chunk_offset,
+            min(IOConfig::chunkBytes, num_bytes - chunk_offset),
+            {},
+        });
+    }
+
+    submit(batch, chunks.data(), chunks.size());
+}
+
+void IOEngine::read(int fd, void *dst, uint64_t offset, uint64_t num_bytes)
+{
+    IOBatch batch;
+    submitChunked(batch, fd, dst, offset, num_bytes);
+
+    if (!batch.wait()) {
+        cerr << "Failed to read " << num_bytes << " bytes at offset "
+             << offset << endl;
+        fatalExit();
+    }
+}
+
+static IOEngine::Mode getDefaultIOMode()
+{
+    char *mode_env = getenv("RLPBR_IO_MODE");
+    if (!mode_env) {
+        return IOEngine::Mode::Auto;
+    }
+
+    string_view mode_str(mode_env);
+    if (mode_str == "uring") {
+        return IOEngine::Mode::IOURing;
+    } else if (mode_str == "threads") {
+        return IOEngine::Mode::ThreadPool;
+    }
+
+    return IOEngine::Mode::Auto;
+}
+
+IOEngine &IOEngine::get()
+{
+    static IOEngine engine(getDefaultIOMode());
+
+    return engine;
+}
+
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string_view>
+
+namespace RLpbr {
+
+class IOFile {
+public:
+    IOFile(std::string_view path);
+    IOFile(const IOFile &) = delete;
+    IOFile(IOFile &&o);
+    ~IOFile();
+
+    IOFile & operator=(const IOFile &) = delete;
+    IOFile & operator=(IOFile &&o);
+
+    inline int getFD() const { return fd_; }
+    inline uint64_t numBytes() const { return num_bytes_; }
+
+private:
+    int fd_;
+    uint64_t num_bytes_;
+};
+
+struct IORead {
+    int fd;
+    void *dst;
+    uint64_t offset;
+    uint64_t numBytes;
+
+    // Invoked on an engine thread once all numBytes have arrived. May
+    // submit further reads, but must not wait on a batch.
+    std::function<void()> onComplete;
+};
+
+// Completion group for a set of reads. Reads from any number of
+// submit calls can be attached to a single batch.
+class IOBatch {
+public:
+    IOBatch();
+    IOBatch(const IOBatch &) = delete;
+
+    // Blocks until every attached read has completed. Returns false
+    // if any read failed or hit EOF before numBytes were read.
+    bool wait();
+
+private:
+    void add(uint32_t num_reads);
+    void finish(bool success);
+
+    std::mutex lock_;
+    std::condition_variable cv_;
+    uint32_t num_pending_;
+    bool failed_;
+
+friend class IOEngine;
+friend struct IOCompletion;
+};
+
+class IOBackend;
+
+class IOEngine {
+public:
+    enum class Mode : uint32_t {
+        Auto,
+        IOURing,
+        ThreadPool,
+    };
+
+    IOEngine(Mode mode = Mode::Auto,
+             uint32_t queue_depth = 128,
+             uint32_t num_threads = 0);
+    IOEngine(const IOEngine &) = delete;
+    ~IOEngine();
+
+    // Queue num_reads reads in one submission. Returns immediately,
+    // use batch.wait() to block on completion.
+    void submit(IOBatch &batch, const IORead *reads, uint32_t num_reads);
+
+    // Split a large read into chunks so multiple requests are in
+    // flight at once.
+    void submitChunked(IOBatch &batch, int fd, void *dst,
+                       uint64_t offset, uint64_t num_bytes);
+
+    // Blocking convenience wrapper, aborts on failure
+    void read(int fd, void *dst, uint64_t offset, uint64_t num_bytes);
+
+    Mode getMode() const { return mode_; }
+
+    // Process wide engine shared by all loaders. The implementation can
+    // be forced with RLPBR_IO_MODE=uring|threads.
+    static IOEngine &get();
+
+private:
+    Mode mode_;
+    std::unique_ptr<IOBackend> backend_;
+};
+
+}
@@ -0,0 +1,354 @@
+#include <rlpbr/light_sampler.hpp>
+
+#include "device.hpp"
+
+#include <cmath>
+
+using namespace std;
+
+namespace RLpbr {
+
+static_assert(LightSampler::blockSize == Shader::LightSamplerBlockSize);
+
+static inline float sanitizePower(float power)
+{
+    return isfinite(power) && power > 0.f ? power : 0.f;
+}
+
+float buildAliasTable(const float *weights, uint32_t num_weights,
+                      AliasEntry *table, uint32_t alias_base)
+{
+    double sum = 0.0;
+    for (uint32_t i = 0; i < num_weights; i++) {
+        sum += sanitizePower(weights[i]);
+    }
+
+    if (sum <= 0.0) {
+        for (uint32_t i = 0; i < num_weights; i++) {
+            table[i] = { 1.f, alias_base + i };
+        }
+
+        return 0.f;
+    }
+
+    // Small slots stack up from the front of work, large ones from the
+    // back. A slot is on at most one stack so they never meet.
+    uint32_t stack_work[LightSampler::blockSize];
+    vector<uint32_t> heap_work;
+    uint32_t *work = stack_work;
+    if (num_weights > LightSampler::blockSize) {
+        heap_work.resize(num_weights);
+        work = heap_work.data();
+    }
+
+    uint32_t num_small = 0;
+    uint32_t large_start = num_weights;
+
+    double scale = double(num_weights) / sum;
+    for (uint32_t i = 0; i < num_weights; i++) {
+        float scaled = float(sanitizePower(weights[i]) * scale);
+        table[i] = { scaled, alias_base + i };
+
+        if (scaled < 1.f) {
+            work[num_small++] = i;
+        } else {
+            work[--large_start] = i;
+        }
+    }
+
+    while (num_small > 0 && large_start < num_weights) {
+        uint32_t small = work[--num_small];
+        uint32_t large = work[large_start];
+
+        table[small].alias = alias_base + large;
+        table[large].keep = (table[large].keep + table[small].keep) - 1.f;
+
+        if (table[large].keep < 1.f) {
+            large_start++;
+            work[num_small++] = large;
+        }
+    }
+
+    // Leftovers only differ from 1 by rounding
+    while (num_small > 0) {
+        table[work[--num_small]].keep = 1.f;
+    }
+    for (uint32_t i = large_start; i < num_weights; i++) {
+        table[work[i]].keep = 1.f;
+    }
+
+    return float(sum);
+}
+
+static inline uint32_t numBlocksFor(uint32_t num_lights)
+{
+    return (num_lights + LightSampler::blockSize - 1) >>
+        LightSampler::blockShift;
+}
+
+static inline uint32_t blockLength(uint32_t block_idx, uint32_t num_lights)
+{
+    return min(num_lights - (block_idx << LightSampler::blockShift),
+               LightSampler::blockSize);
+}
+
+// Top level table. Without any power every light is equally likely, so
+// blocks are weighted by their number of lights.
+static float buildBlockTable(const float *block_powers, uint32_t num_blocks,
+                             uint32_t num_lights, AliasEntry *table,
+                             vector<float> &scratch)
+{
+    float total = buildAliasTable(block_powers, num_blocks, table);
+    if (total > 0.f) {
+        return total;
+    }
+
+    scratch.resize(num_blocks);
+    for (uint32_t block_idx = 0; block_idx < num_blocks; block_idx++) {
+        scratch[block_idx] = float(blockLength(block_idx, num_lights));
+    }
+    buildAliasTable(scratch.data(), num_blocks, table);
+
+    return 0.f;
+}
+
+LightSamplerInit::LightSamplerInit(vector<float> light_powers)
+    : powers(move(light_powers)),
+      entries(powers.size()),
+      blockPowers(numBlocksFor(powers.size())),
+      blockEntries(blockPowers.size()),
+      totalPower(0.f)
+{
+    uint32_t num_lights = powers.size();
+    for (float &power : powers) {
+        power = sanitizePower(power);
+    }
+
+    for (uint32_t block_idx = 0; block_idx < blockPowers.size();
+         block_idx++) {
+        uint32_t begin = block_idx << LightSampler::blockShift;
+        blockPowers[block_idx] = buildAliasTable(&powers[begin],
+            blockLength(block_idx, num_lights), &entries[begin], begin);
+    }
+
+    vector<float> scratch;
+    totalPower = buildBlockTable(blockPowers.data(), blockPowers.size(),
+                                 num_lights, blockEntries.data(), scratch);
+}
+
+LightSampler::LightSampler(const LightSamplerInit &init)
+    : init_(&init),
+      powers_(init.powers),
+      entries_(init.entries),
+      block_powers_(init.blockPowers),
+      block_entries_(init.blockEntries),
+      dirty_blocks_(),
+      block_scratch_(),
+      table_scratch_(),
+      total_power_(init.totalPower),
+      top_dirty_(false)
+{}
+
+LightSampler LightSampler::fork() const
+{
+    LightSampler forked(*init_);
+    forked.powers_ = powers_.fork();
+    forked.entries_ = entries_.fork();
+    forked.block_powers_ = block_powers_.fork();
+    forked.block_entries_ = block_entries_.fork();
+    forked.dirty_blocks_ = dirty_blocks_;
+    forked.total_power_ = total_power_;
+    forked.top_dirty_ = top_dirty_;
+
+    return forked;
+}
+
+void LightSampler::reset()
+{
+    powers_.reset();
+    entries_.reset();
+    block_powers_.reset();
+    block_entries_.reset();
+    dirty_blocks_.clear();
+    total_power_ = init_->totalPower;
+    top_dirty_ = false;
+}
+
+void LightSampler::markBlock(uint32_t block_idx)
+{
+    dirty_blocks_.push_back(block_idx);
+    top_dirty_ = true;
+}
+
+void LightSampler::resizeBlocks()
+{
+    uint32_t num_blocks = numBlocksFor(powers_.size());
+    if (num_blocks != block_powers_.size()) {
+        block_powers_.resize(num_blocks);
+        block_entries_.resize(num_blocks);
+        top_dirty_ = true;
+    }
+}
+
+void LightSampler::push(float power)
+{
+    uint32_t light_idx = powers_.size();
+    powers_.push_back(sanitizePower(power));
+    entries_.push_back({ 1.f, light_idx });
+    resizeBlocks();
+
+    markBlock(light_idx >> blockShift);
+}
+
+void LightSampler::set(uint32_t light_idx, float power)
+{
+    powers_.mut(light_idx) = sanitizePower(power);
+    markBlock(light_idx >> blockShift);
+}
+
+void LightSampler::swapRemove(uint32_t light_idx)
+{
+    uint32_t last_idx = powers_.size() - 1;
+    if (light_idx != last_idx) {
+        powers_.mut(light_idx) = powers_[last_idx];
+        markBlock(light_idx >> blockShift);
+    }
+
+    powers_.pop_back();
+    entries_.pop_back();
+    resizeBlocks();
+
+    // Unless the last block went away with it
+    if ((last_idx & (blockSize - 1)) != 0) {
+        markBlock(last_idx >> blockShift);
+    }
+}
+
+void LightSampler::assign(CowArray<float> &&powers)
+{
+    reset();
+
+    uint32_t num_lights = powers.size();
+    uint32_t num_base = init_->powers.size();
+
+    for (uint32_t chunk_idx : powers.ownedChunks()) {
+        if (chunk_idx < numBlocksFor(num_lights)) {
+            markBlock(chunk_idx);
+        }
+    }
+
+    powers_ = move(powers);
+    entries_.resize(num_lights);
+    resizeBlocks();
+
+    // A block cut short, or new past the scene's lights, can't reuse the
+    // scene's table even if its powers weren't written
+    if (num_lights != num_base && num_lights > 0) {
+        uint32_t first_changed = min(num_lights, num_base) >> blockShift;
+        for (uint32_t block_idx = first_changed;
+             block_idx < numBlocksFor(num_lights); block_idx++) {
+            markBlock(block_idx);
+        }
+    }
+
+    if (num_lights != num_base) {
+        top_dirty_ = true;
+    }
+}
+
+void LightSampler::update()
+{
+    if (!top_dirty_) {
+        return;
+    }
+
+    uint32_t num_lights = powers_.size();
+    uint32_t num_blocks = block_powers_.size();
+
+    sort(dirty_blocks_.begin(), dirty_blocks_.end());
+    dirty_blocks_.erase(unique(dirty_blocks_.begin(), dirty_blocks_.end()),
+                        dirty_blocks_.end());
+
+    float weights[blockSize];
+    AliasEntry table[blockSize];
+    for (uint32_t block_idx : dirty_blocks_) {
+        if (block_idx >= num_blocks) {
+            continue;
+        }
+
+        uint32_t begin = block_idx << blockShift;
+        uint32_t len = blockLength(block_idx, num_lights);
+
+        powers_.copyRange(weights, begin, begin + len);
+        block_powers_.mut(block_idx) =
+            buildAliasTable(weights, len, table, begin);
+
+        AliasEntry *dst = &entries_.mut(begin);
+        for (uint32_t i = 0; i < len; i++) {
+            dst[i] = table[i];
+        }
+    }
+    dirty_blocks_.clear();
+
+    block_scratch_.resize(num_blocks);
+    block_powers_.copyTo(block_scratch_.data());
+    table_scratch_.resize(num_blocks);
+
+    vector<float> length_scratch;
+    total_power_ = buildBlockTable(block_scratch_.data(), num_blocks,
+        num_lights, table_scratch_.data(), length_scratch);
+
+    for (uint32_t block_idx = 0; block_idx < num_blocks; block_idx++) {
+        const AliasEntry &entry = table_scratch_[block_idx];
+        const AliasEntry &cur = block_entries_[block_idx];
+        if (cur.keep != entry.keep || cur.alias != entry.alias) {
+            block_entries_.mut(block_idx) = entry;
+        }
+    }
+
+    top_dirty_ = false;
+}
+
+float LightSampler::pdf(uint32_t light_idx) const
+{
+    if (total_power_ > 0.f) {
+        return powers_[light_idx] / total_power_;
+    } else {
+        return 1.f / float(powers_.size());
+    }
+}
+
+uint32_t LightSampler::sample(float u_block, float u_light) const
+{
+    uint32_t num_blocks = block_powers_.size();
+
+    float scaled = u_block * float(num_blocks);
+    uint32_t block_idx = min(uint32_t(scaled), num_blocks - 1);
+    const AliasEntry &block_entry = block_entries_[block_idx];
+    if (scaled - float(block_idx) >= block_entry.keep) {
+        block_idx = block_entry.alias;
+    }
+
+    uint32_t begin = block_idx << blockShift;
+    uint32_t len = blockLength(block_idx, powers_.size());
+
+    scaled = u_light * float(len);
+    uint32_t offset = min(uint32_t(scaled), len - 1);
+    const AliasEntry &entry = entries_[begin + offset];
+    if (scaled - float(offset) >= entry.keep) {
+        return entry.alias;
+    }
+
+    return begin + offset;
+}
+
+size_t LightSampler::numOwnedBytes() const
+{
+    return powers_.numOwnedBytes() + entries_.numOwnedBytes() +
+        block_powers_.numOwnedBytes() + block_entries_.numOwnedBytes() +
+        dirty_blocks_.capacity() * sizeof(uint32_t) +
+        block_scratch_.capacity() * sizeof(float) +
+        table_scratch_.capacity() * sizeof(AliasEntry);
+}
+
+}
@@ -0,0 +1,415 @@
+#include "load_pipeline.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+using namespace std;
+
+namespace RLpbr {
+
+namespace PipelineConfig {
+// Texture files open at once across all read workers
+constexpr uint32_t maxOpenTextureFiles = 256;
+}
+
+namespace {
+
+template <typename T>
+class WorkQueue {
+public:
+    WorkQueue()
+        : lock_(),
+          cv_(),
+          items_(),
+          closed_(false)
+    {}
+
+    void push(T item)
+    {
+        {
+            lock_guard lock(lock_);
+            items_.push_back(move(item));
+        }
+        cv_.notify_one();
+    }
+
+    // Returns nullopt once the queue is closed and drained
+    optional<T> pop()
+    {
+        unique_lock lock(lock_);
+        cv_.wait(lock, [this]() { return closed_ || !items_.empty(); });
+
+        if (items_.empty()) {
+            return optional<T>();
+        }
+
+        T item = move(items_.front());
+        items_.pop_front();
+
+        return item;
+    }
+
+    void close()
+    {
+        {
+            lock_guard lock(lock_);
+            closed_ = true;
+        }
+        cv_.notify_all();
+    }
+
+private:
+    mutex lock_;
+    condition_variable cv_;
+    deque<T> items_;
+    bool closed_;
+};
+
+class SlotLimiter {
+public:
+    SlotLimiter(uint32_t num_slots)
+        : lock_(),
+          cv_(),
+          num_free_(num_slots)
+    {}
+
+    void acquire()
+    {
+        unique_lock lock(lock_);
+        cv_.wait(lock, [this]() { return num_free_ > 0; });
+        num_free_--;
+    }
+
+    void release()
+    {
+        {
+            lock_guard lock(lock_);
+            num_free_++;
+        }
+        cv_.notify_one();
+    }
+
+private:
+    mutex lock_;
+    condition_variable cv_;
+    uint32_t num_free_;
+};
+
+struct StageCounters {
+    atomic_uint64_t numItems;
+    atomic_uint64_t numBytes;
+    atomic_uint64_t busyNanoseconds;
+
+    StageCounters()
+        : numItems(0),
+          numBytes(0),
+          busyNanoseconds(0)
+    {}
+
+    template <typename Fn>
+    void time(Fn &&fn)
+    {
+        auto start = chrono::steady_clock::now();
+        uint64_t num_bytes = fn();
+        auto end = chrono::steady_clock::now();
+
+        numItems.fetch_add(1, memory_order_relaxed);
+        numBytes.fetch_add(num_bytes, memory_order_relaxed);
+        busyNanoseconds.fetch_add(
+            chrono::duration_cast<chrono::nanoseconds>(end - start).count(),
+            memory_order_relaxed);
+    }
+
+    LoadStageStats getStats() const
+    {
+        return LoadStageStats {
+            numItems.load(memory_order_relaxed),
+            numBytes.load(memory_order_relaxed),
+            double(busyNanoseconds.load(memory_order_relaxed)) / 1e9,
+        };
+    }
+};
+
+struct PipelineJob {
+    uint32_t sceneIdx;
+    optional<PreparedScene> scene;
+    vector<CompressedTexture> compressed;
+    atomic_uint32_t numPendingTextures;
+};
+
+struct DecodeTask {
+    PipelineJob *job;
+    uint32_t texIdx;
+};
+
+struct NullStagedScene : public StagedScene {
+    vector<char> staging;
+};
+
+}
+
+NullUploadSink::NullUploadSink(uint32_t max_texture_resolution)
+    : max_texture_resolution_(max_texture_resolution)
+{}
+
+void NullUploadSink::stage(PreparedScene &scene)
+{
+    // Mirror the staging copies a real backend makes so the stage
+    // throughput numbers stay meaningful
+    auto staged = make_unique<NullStagedScene>();
+
+    uint64_t num_staging_bytes = scene.loadData.hdr.totalBytes;
+    for (const DecodedTexture &tex : scene.textures) {
+        num_staging_bytes = alignOffset(num_staging_bytes,
+                                        max(tex.texelBytes, 4u));
+        num_staging_bytes += tex.numBytes;
+    }
+
+    staged->staging.resize(num_staging_bytes);
+    scene.loadData.readData(staged->staging.data());
+
+    uint64_t cur_offset = scene.loadData.hdr.totalBytes;
+    for (DecodedTexture &tex : scene.textures) {
+        cur_offset = alignOffset(cur_offset, max(tex.texelBytes, 4u));
+        memcpy(staged->staging.data() + cur_offset, tex.data, tex.numBytes);
+        cur_offset += tex.numBytes;
+
+        free(tex.data);
+        tex.data = nullptr;
+    }
+
+    scene.staged = move(staged);
+}
+
+shared_ptr<Scene> NullUploadSink::upload(PreparedScene &scene)
+{
+    scene.staged.reset();
+
+    return nullptr;
+}
+
+uint32_t NullUploadSink::getMaxTextureResolution() const
+{
+    return max_texture_resolution_;
+}
+
+LoadPipelineConfig SceneLoadPipeline::defaultConfig()
+{
+    uint32_t num_cpus = max(thread::hardware_concurrency(), 4u);
+
+    return LoadPipelineConfig {
+        2,
+        num_cpus - 2,
+        1,
+        4,
+    };
+}
+
+SceneLoadPipeline::SceneLoadPipeline(SceneUploadSink &sink,
+                                     const LoadPipelineConfig &cfg)
+    : sink_(sink),
+      cfg_(cfg)
+{
+    cfg_.numReadWorkers = max(cfg_.numReadWorkers, 1u);
+    cfg_.numDecodeWorkers = max(cfg_.numDecodeWorkers, 1u);
+    cfg_.numStageWorkers = max(cfg_.numStageWorkers, 1u);
+    cfg_.maxScenesInFlight = max(cfg_.maxScenesInFlight, 1u);
+}
+
+vector<shared_ptr<Scene>> SceneLoadPipeline::load(const char **scene_paths,
+                                                  uint32_t num_scenes,
+                                                  LoadPipelineStats *stats)
+{
+    auto start = chrono::steady_clock::now();
+
+    vector<unique_ptr<PipelineJob>> jobs(num_scenes);
+    for (int i = 0; i < (int)num_scenes; i++) {
+        jobs[i] = make_unique<PipelineJob>();
+        jobs[i]->sceneIdx = i;
+    }
+
+    SlotLimiter in_flight(cfg_.maxScenesInFlight);
+    atomic_uint32_t next_scene(0);
+
+    WorkQueue<DecodeTask> decode_queue;
+    WorkQueue<PipelineJob *> stage_queue;
+    WorkQueue<PipelineJob *> upload_queue;
+
+    StageCounters read_counters, decode_counters, stage_counters,
+                  upload_counters;
+
+    const bool decode_textures = sink_.needsDecodedTextures();
+    const uint32_t max_texture_resolution = sink_.getMaxTextureResolution();
+    const uint32_t max_open_files = max(
+        PipelineConfig::maxOpenTextureFiles / cfg_.numReadWorkers, 1u);
+
+    auto readLoop = [&]() {
+        while (true) {
+            uint32_t scene_idx =
+                next_scene.fetch_add(1, memory_order_relaxed);
+            if (scene_idx >= num_scenes) {
+                return;
+            }
+
+            in_flight.acquire();
+
+            PipelineJob &job = *jobs[scene_idx];
+            read_counters.time([&]() {
+                job.scene.emplace(PreparedScene {
+                    SceneLoadData::loadFromDisk(scene_paths[scene_idx],
+                                                true),
+                    {},
+                    nullptr,
+                });
+
+                uint64_t num_bytes = job.scene->loadData.hdr.totalBytes;
+
+                if (decode_textures) {
+                    vector<TextureLoadRequest> tex_reqs =
+                        getSceneTextureRequests(
+                            job.scene->loadData.textureInfo);
+
+                    job.compressed = readTextures(tex_reqs.data(),
+                        tex_reqs.size(), max_texture_resolution,
+                        max_open_files);
+
+                    for (const CompressedTexture &tex : job.compressed) {
+                        num_bytes += tex.numBytes;
+                    }
+                }
+
+                return num_bytes;
+            });
+
+            uint32_t num_textures = job.compressed.size();
+            job.scene->textures.resize(num_textures);
+            job.numPendingTextures.store(num_textures,
+                                         memory_order_release);
+
+            if (num_textures == 0) {
+                stage_queue.push(&job);
+            } else {
+                for (int i = 0; i < (int)num_textures; i++) {
+                    decode_queue.push(DecodeTask {
+                        &job,
+                        uint32_t(i),
+                    });
+                }
+            }
+        }
+    };
+
+    auto decodeLoop = [&]() {
+        while (true) {
+            optional<DecodeTask> task = decode_queue.pop();
+            if (!task.has_value()) {
+                return;
+            }
+
+            PipelineJob &job = *task->job;
+            decode_counters.time([&]() {
+                DecodedTexture decoded =
+                    decodeTexture(job.compressed[task->texIdx]);
+                job.scene->textures[task->texIdx] = decoded;
+
+                return decoded.numBytes;
+            });
+
+            // Last texture of the scene hands it off to staging
+            if (job.numPendingTextures.fetch_sub(1,
+                    memory_order_acq_rel) == 1) {
+                job.compressed.clear();
+                stage_queue.push(&job);
+            }
+        }
+    };
+
+    auto stageLoop = [&]() {
+        while (true) {
+            optional<PipelineJob *> job = stage_queue.pop();
+            if (!job.has_value()) {
+                return;
+            }
+
+            PreparedScene &scene = *(*job)->scene;
+            stage_counters.time([&]() {
+                uint64_t num_bytes = scene.loadData.hdr.totalBytes;
+                for (const DecodedTexture &tex : scene.textures) {
+                    num_bytes += tex.numBytes;
+                }
+
+                sink_.stage(scene);
+
+                return num_bytes;
+            });
+
+            upload_queue.push(*job);
+        }
+    };
+
+    vector<thread> workers;
+    workers.reserve(cfg_.numReadWorkers + cfg_.numDecodeWorkers +
+                    cfg_.numStageWorkers);
+
+    for (int i = 0; i < (int)cfg_.numReadWorkers; i++) {
+        workers.emplace_back(readLoop);
+    }
+
+    for (int i = 0; i < (int)cfg_.numDecodeWorkers; i++) {
+        workers.emplace_back(decodeLoop);
+    }
+
+    for (int i = 0; i < (int)cfg_.numStageWorkers; i++) {
+        workers.emplace_back(stageLoop);
+    }
+
+    vector<shared_ptr<Scene>> scenes(num_scenes);
+    for (int i = 0; i < (int)num_scenes; i++) {
+        PipelineJob *job = *upload_queue.pop();
+
+        upload_counters.time([&]() {
+            uint64_t num_bytes = job->scene->loadData.hdr.totalBytes;
+            for (const DecodedTexture &tex : job->scene->textures) {
+                num_bytes += tex.numBytes;
+            }
+
+            scenes[job->sceneIdx] = sink_.upload(*job->scene);
+
+            return num_bytes;
+        });
+
+        job->scene.reset();
+        in_flight.release();
+    }
+
+    decode_queue.close();
+    stage_queue.close();
+    upload_queue.close();
+
+    for (thread &t : workers) {
+        t.join();
+    }
+
+    if (stats) {
+        auto end = chrono::steady_clock::now();
+
+        stats->read = read_counters.getStats();
+        stats->decode = decode_counters.getStats();
+        stats->stage = stage_counters.getStats();
+        stats->upload = upload_counters.getStats();
+        stats->totalSeconds =
+            chrono::duration<double>(end - start).count();
+    }
+
+    return scenes;
+}
+
+}
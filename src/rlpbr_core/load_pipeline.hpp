@@ -0,0 +1,79 @@
+#pragma once
+
+#include <rlpbr/config.hpp>
+
+#include "scene.hpp"
+#include "textures.hpp"
+
+#include <memory>
+#include <vector>
+
+namespace RLpbr {
+
+// Backend owned state produced by the stage step, consumed by upload
+struct StagedScene {
+    virtual ~StagedScene() = default;
+};
+
+struct PreparedScene {
+    SceneLoadData loadData;
+
+    // Same order as getSceneTextureRequests, empty if the sink
+    // doesn't consume decoded textures
+    std::vector<DecodedTexture> textures;
+
+    std::unique_ptr<StagedScene> staged;
+};
+
+class SceneUploadSink {
+public:
+    virtual ~SceneUploadSink() = default;
+
+    // Copy geometry & textures into backend staging memory. Called
+    // concurrently from every stage worker.
+    virtual void stage(PreparedScene &scene) = 0;
+
+    // Record / submit GPU work and build the final Scene. Only ever
+    // called from one thread.
+    virtual std::shared_ptr<Scene> upload(PreparedScene &scene) = 0;
+
+    // Backends that load textures themselves skip the read / decode
+    // stages for texture data
+    virtual bool needsDecodedTextures() const { return true; }
+
+    virtual uint32_t getMaxTextureResolution() const = 0;
+};
+
+// Runs the CPU stages for real and drops the results, used for testing and
+// benchmarking the pipeline without a GPU
+class NullUploadSink : public SceneUploadSink {
+public:
+    NullUploadSink(uint32_t max_texture_resolution);
+
+    void stage(PreparedScene &scene) override;
+    std::shared_ptr<Scene> upload(PreparedScene &scene) override;
+    uint32_t getMaxTextureResolution() const override;
+
+private:
+    uint32_t max_texture_resolution_;
+};
+
+// read (IOEngine) -> decode (per texture) -> stage -> upload.
+// At most maxScenesInFlight scenes are between read and the end of
+// upload at any point, which bounds staging memory.
+class SceneLoadPipeline {
+public:
+    SceneLoadPipeline(SceneUploadSink &sink, const LoadPipelineConfig &cfg);
+
+    std::vector<std::shared_ptr<Scene>> load(const char **scene_paths,
+                                             uint32_t num_scenes,
+                                             LoadPipelineStats *stats);
+
+    static LoadPipelineConfig defaultConfig();
+
+private:
+    SceneUploadSink &sink_;
+    LoadPipelineConfig cfg_;
+};
+
+}
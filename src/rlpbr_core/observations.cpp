@@ -0,0 +1,688 @@
+#include "observations.hpp"
+#include "batch_prep.hpp"
+#include "tonemap.hpp"
+#include "utils.hpp"
+
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define RLPBR_OBSERVATIONS_SSE
+// The AVX2 + F16C kernels are compiled for that target regardless of the
+// build flags and only called when the CPU supports it
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define RLPBR_OBSERVATIONS_AVX2
+#define RLPBR_AVX2_TARGET __attribute__((target("avx2,f16c")))
+#endif
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define RLPBR_OBSERVATIONS_NEON
+#endif
+
+using namespace std;
+
+namespace RLpbr {
+
+static inline uint32_t floatBits(float v)
+{
+    uint32_t bits;
+    memcpy(&bits, &v, sizeof(uint32_t));
+    return bits;
+}
+
+static inline float bitsToFloat(uint32_t bits)
+{
+    float v;
+    memcpy(&v, &bits, sizeof(float));
+    return v;
+}
+
+static inline float halfToFloatScalar(uint16_t h)
+{
+    uint32_t sign = uint32_t(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1F;
+    uint32_t mant = h & 0x3FF;
+
+    uint32_t bits;
+    if (exp == 0x1F) {
+        // NaNs are quieted, as the F16C and NEON conversions do
+        bits = sign | 0x7F800000 | (mant << 13) | (mant != 0 ? 0x400000 : 0);
+    } else if (exp != 0) {
+        bits = sign | ((exp + 112) << 23) | (mant << 13);
+    } else if (mant == 0) {
+        bits = sign;
+    } else {
+        // Denormal: normalize so the leading 1 becomes implicit
+        uint32_t shift = 0;
+        while ((mant & 0x400) == 0) {
+            mant <<= 1;
+            shift++;
+        }
+
+        bits = sign | ((113 - shift) << 23) | ((mant & 0x3FF) << 13);
+    }
+
+    return bitsToFloat(bits);
+}
+
+static inline uint8_t quantizeUnorm8Scalar(float v)
+{
+    // NaN fails both comparisons and becomes 0
+    v = v > 0.f ? v : 0.f;
+    v = v < 1.f ? v : 1.f;
+
+    // Round to nearest even, like the vector conversions
+    return uint8_t(nearbyintf(v * 255.f));
+}
+
+namespace {
+
+// One linear segment per 1/32 octave of [2^-13, 1): the float's exponent
+// and top 5 mantissa bits pick the segment, the next 12 mantissa bits
+// interpolate. Values are sRGB * 255 + 0.5 in 9.23 fixed point, so the
+// result truncates to the rounded 8 bit value.
+struct SRGBTable {
+    static constexpr uint32_t minBits = 0x39000000; // 2^-13
+    static constexpr uint32_t maxBits = 0x3F7FFFFF; // Below 1
+    static constexpr uint32_t segmentShift = 18;
+    static constexpr uint32_t numSegments = 13 << (23 - segmentShift);
+    static constexpr uint32_t fractionShift = segmentShift - 12;
+
+    int32_t bias[numSegments];
+    // Below 2^15 so the vector paths can multiply in 16 bits
+    int32_t scale[numSegments];
+
+    SRGBTable()
+    {
+        auto fixedSRGB = [](uint32_t bits) {
+            return (double(linearToSRGB(bitsToFloat(bits))) * 255.0 + 0.5) *
+                double(1 << 23);
+        };
+
+        for (uint32_t i = 0; i < numSegments; i++) {
+            uint32_t start = minBits + (i << segmentShift);
+            double y0 = fixedSRGB(start);
+            double y1 = fixedSRGB(start + (1 << segmentShift));
+            double slope = (y1 - y0) / 4096.0;
+
+            // The curve is concave, so the chord lies below it. Shift by
+            // half the largest gap to split the error evenly.
+            double max_gap = 0.0;
+            for (uint32_t t = 0; t < 4096; t += 16) {
+                double gap = fixedSRGB(start + (t << fractionShift)) - y0 -
+                    slope * t;
+                max_gap = max(max_gap, gap);
+            }
+
+            bias[i] = int32_t(y0 + max_gap * 0.5 + 0.5);
+            scale[i] = int32_t(slope + 0.5);
+        }
+    }
+
+    static const SRGBTable &get()
+    {
+        static const SRGBTable table;
+        return table;
+    }
+};
+
+}
+
+static constexpr int segment_shift = SRGBTable::segmentShift;
+static constexpr int fraction_shift = SRGBTable::fractionShift;
+
+static inline uint8_t quantizeSRGB8Scalar(const SRGBTable &table, float v)
+{
+    const float min_v = bitsToFloat(SRGBTable::minBits);
+    const float max_v = bitsToFloat(SRGBTable::maxBits);
+
+    v = v > min_v ? v : min_v;
+    v = v < max_v ? v : max_v;
+
+    uint32_t bits = floatBits(v);
+    uint32_t segment = (bits - SRGBTable::minBits) >> segment_shift;
+    int32_t t = (bits >> fraction_shift) & 0xFFF;
+
+    return uint8_t((table.bias[segment] + table.scale[segment] * t) >> 23);
+}
+
+#ifdef RLPBR_OBSERVATIONS_SSE
+
+// Exact conversion with integer ops and one multiply that rescales the
+// exponent (denormal halves become normal floats).
+// https://gist.github.com/rygorous/2144712
+static inline __m128 halfToFloatSSE(__m128i h)
+{
+    const __m128i mask_nosign = _mm_set1_epi32(0x7FFF);
+    const __m128 magic = _mm_castsi128_ps(_mm_set1_epi32((254 - 15) << 23));
+    const __m128i was_infnan = _mm_set1_epi32(0x7BFF);
+    const __m128i was_nan = _mm_set1_epi32(0x7C00);
+    const __m128i exp_infnan = _mm_set1_epi32(255 << 23);
+    const __m128i quiet_bit = _mm_set1_epi32(0x400000);
+
+    __m128i expmant = _mm_and_si128(mask_nosign, h);
+    __m128i justsign = _mm_xor_si128(h, expmant);
+    __m128i shifted = _mm_slli_epi32(expmant, 13);
+    __m128 scaled = _mm_mul_ps(_mm_castsi128_ps(shifted), magic);
+    __m128i b_wasinfnan = _mm_cmpgt_epi32(expmant, was_infnan);
+    __m128i b_wasnan = _mm_cmpgt_epi32(expmant, was_nan);
+    __m128i sign = _mm_slli_epi32(justsign, 16);
+    __m128i infnanexp = _mm_and_si128(b_wasinfnan, exp_infnan);
+    __m128i quiet = _mm_and_si128(b_wasnan, quiet_bit);
+    __m128i sign_inf = _mm_or_si128(_mm_or_si128(sign, infnanexp), quiet);
+
+    return _mm_or_ps(scaled, _mm_castsi128_ps(sign_inf));
+}
+
+#endif
+
+#ifdef RLPBR_OBSERVATIONS_AVX2
+
+// AVX2 + F16C versions of the vector loops below, each returning how many
+// values it converted. They stop within 8 values of the end, so the SSE
+// loops after them only leave the scalar tail.
+
+RLPBR_AVX2_TARGET
+static uint32_t halfToFloatAVX2(const uint16_t *src, uint32_t num_values,
+                                float *dst)
+{
+    uint32_t idx = 0;
+
+    for (; idx + 8 <= num_values; idx += 8) {
+        __m128i h = _mm_loadu_si128(
+            reinterpret_cast<const __m128i *>(src + idx));
+        _mm256_storeu_ps(dst + idx, _mm256_cvtph_ps(h));
+    }
+
+    return idx;
+}
+
+RLPBR_AVX2_TARGET
+static uint32_t quantizeUnorm8AVX2(const float *src, uint32_t num_values,
+                                   uint8_t *dst)
+{
+    uint32_t idx = 0;
+
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.f);
+    const __m256 scale = _mm256_set1_ps(255.f);
+    for (; idx + 8 <= num_values; idx += 8) {
+        __m256 v = _mm256_max_ps(_mm256_loadu_ps(src + idx), zero);
+        v = _mm256_min_ps(v, one);
+        __m256i q = _mm256_cvtps_epi32(_mm256_mul_ps(v, scale));
+
+        __m128i q16 = _mm_packs_epi32(_mm256_castsi256_si128(q),
+                                      _mm256_extracti128_si256(q, 1));
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(dst + idx),
+                         _mm_packus_epi16(q16, q16));
+    }
+
+    return idx;
+}
+
+RLPBR_AVX2_TARGET
+static uint32_t quantizeSRGB8AVX2(const SRGBTable &table, const float *src,
+                                  uint32_t num_values, uint8_t *dst)
+{
+    uint32_t idx = 0;
+
+    const __m256 min_v = _mm256_castsi256_ps(
+        _mm256_set1_epi32(SRGBTable::minBits));
+    const __m256 max_v = _mm256_castsi256_ps(
+        _mm256_set1_epi32(SRGBTable::maxBits));
+    const __m256i min_bits = _mm256_set1_epi32(SRGBTable::minBits);
+    const __m256i t_mask = _mm256_set1_epi32(0xFFF);
+    for (; idx + 8 <= num_values; idx += 8) {
+        // max(v, min) is min for NaN
+        __m256 v = _mm256_max_ps(_mm256_loadu_ps(src + idx), min_v);
+        v = _mm256_min_ps(v, max_v);
+
+        __m256i bits = _mm256_castps_si256(v);
+        __m256i segment = _mm256_srli_epi32(
+            _mm256_sub_epi32(bits, min_bits), segment_shift);
+        __m256i t = _mm256_and_si256(
+            _mm256_srli_epi32(bits, fraction_shift), t_mask);
+
+        __m256i bias = _mm256_i32gather_epi32(table.bias, segment, 4);
+        __m256i scale = _mm256_i32gather_epi32(table.scale, segment, 4);
+
+        __m256i q = _mm256_srli_epi32(
+            _mm256_add_epi32(bias, _mm256_madd_epi16(scale, t)), 23);
+
+        __m128i q16 = _mm_packs_epi32(_mm256_castsi256_si128(q),
+                                      _mm256_extracti128_si256(q, 1));
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(dst + idx),
+                         _mm_packus_epi16(q16, q16));
+    }
+
+    return idx;
+}
+
+static bool cpuHasAVX2()
+{
+    static const bool supported = []() {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") &&
+            __builtin_cpu_supports("f16c");
+    }();
+
+    return supported;
+}
+
+#endif
+
+bool observationKernelsAVX2()
+{
+#ifdef RLPBR_OBSERVATIONS_AVX2
+    return cpuHasAVX2();
+#else
+    return false;
+#endif
+}
+
+static bool useAVX2(ObservationKernels kernels)
+{
+    return kernels == ObservationKernels::Vector && observationKernelsAVX2();
+}
+
+void halfToFloat(const uint16_t *src, uint32_t num_values, float *dst,
+                 ObservationKernels kernels)
+{
+    uint32_t idx = 0;
+
+    if (kernels != ObservationKernels::Scalar) {
+#if defined(RLPBR_OBSERVATIONS_SSE)
+#if defined(RLPBR_OBSERVATIONS_AVX2)
+        if (useAVX2(kernels)) {
+            idx = halfToFloatAVX2(src, num_values, dst);
+        }
+#endif
+        const __m128i zero = _mm_setzero_si128();
+        for (; idx + 8 <= num_values; idx += 8) {
+            __m128i h = _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(src + idx));
+            _mm_storeu_ps(dst + idx,
+                          halfToFloatSSE(_mm_unpacklo_epi16(h, zero)));
+            _mm_storeu_ps(dst + idx + 4,
+                          halfToFloatSSE(_mm_unpackhi_epi16(h, zero)));
+        }
+#elif defined(RLPBR_OBSERVATIONS_NEON)
+        for (; idx + 4 <= num_values; idx += 4) {
+            float16x4_t h = vreinterpret_f16_u16(vld1_u16(src + idx));
+            vst1q_f32(dst + idx, vcvt_f32_f16(h));
+        }
+#endif
+    }
+
+    for (; idx < num_values; idx++) {
+        dst[idx] = halfToFloatScalar(src[idx]);
+    }
+}
+
+void quantizeUnorm8(const float *src, uint32_t num_values, uint8_t *dst,
+                    ObservationKernels kernels)
+{
+    uint32_t idx = 0;
+
+    // max(v, 0) is 0 for NaN on all paths. The float to int conversions
+    // round to nearest even under the default rounding mode.
+    if (kernels != ObservationKernels::Scalar) {
+#if defined(RLPBR_OBSERVATIONS_SSE)
+#if defined(RLPBR_OBSERVATIONS_AVX2)
+        if (useAVX2(kernels)) {
+            idx = quantizeUnorm8AVX2(src, num_values, dst);
+        }
+#endif
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 one = _mm_set1_ps(1.f);
+        const __m128 scale = _mm_set1_ps(255.f);
+        for (; idx + 8 <= num_values; idx += 8) {
+            __m128 a = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(src + idx), zero),
+                                  one);
+            __m128 b = _mm_min_ps(
+                _mm_max_ps(_mm_loadu_ps(src + idx + 4), zero), one);
+
+            __m128i q16 = _mm_packs_epi32(
+                _mm_cvtps_epi32(_mm_mul_ps(a, scale)),
+                _mm_cvtps_epi32(_mm_mul_ps(b, scale)));
+            _mm_storel_epi64(reinterpret_cast<__m128i *>(dst + idx),
+                             _mm_packus_epi16(q16, q16));
+        }
+#elif defined(RLPBR_OBSERVATIONS_NEON)
+        const float32x4_t zero = vdupq_n_f32(0.f);
+        const float32x4_t one = vdupq_n_f32(1.f);
+        for (; idx + 8 <= num_values; idx += 8) {
+            // maxnm returns the number when one operand is NaN
+            float32x4_t a = vminq_f32(
+                vmaxnmq_f32(vld1q_f32(src + idx), zero), one);
+            float32x4_t b = vminq_f32(
+                vmaxnmq_f32(vld1q_f32(src + idx + 4), zero), one);
+
+            uint32x4_t qa = vreinterpretq_u32_s32(
+                vcvtnq_s32_f32(vmulq_n_f32(a, 255.f)));
+            uint32x4_t qb = vreinterpretq_u32_s32(
+                vcvtnq_s32_f32(vmulq_n_f32(b, 255.f)));
+
+            vst1_u8(dst + idx, vmovn_u16(vcombine_u16(vmovn_u32(qa),
+                                                      vmovn_u32(qb))));
+        }
+#endif
+    }
+
+    for (; idx < num_values; idx++) {
+        dst[idx] = quantizeUnorm8Scalar(src[idx]);
+    }
+}
+
+void quantizeSRGB8(const float *src, uint32_t num_values, uint8_t *dst,
+                   ObservationKernels kernels)
+{
+    const SRGBTable &table = SRGBTable::get();
+
+    uint32_t idx = 0;
+
+    if (kernels != ObservationKernels::Scalar) {
+#if defined(RLPBR_OBSERVATIONS_SSE)
+#if defined(RLPBR_OBSERVATIONS_AVX2)
+        if (useAVX2(kernels)) {
+            idx = quantizeSRGB8AVX2(table, src, num_values, dst);
+        }
+#endif
+        const __m128 min_v = _mm_castsi128_ps(
+            _mm_set1_epi32(SRGBTable::minBits));
+        const __m128 max_v = _mm_castsi128_ps(
+            _mm_set1_epi32(SRGBTable::maxBits));
+        const __m128i min_bits = _mm_set1_epi32(SRGBTable::minBits);
+        const __m128i t_mask = _mm_set1_epi32(0xFFF);
+
+        // No gathers in SSE2, the table lookups go through memory
+        auto quantize4 = [&](const float *values) {
+            __m128 v = _mm_max_ps(_mm_loadu_ps(values), min_v);
+            v = _mm_min_ps(v, max_v);
+
+            __m128i bits = _mm_castps_si128(v);
+            alignas(16) uint32_t segments[4];
+            _mm_store_si128(reinterpret_cast<__m128i *>(segments),
+                _mm_srli_epi32(_mm_sub_epi32(bits, min_bits), segment_shift));
+            __m128i t = _mm_and_si128(_mm_srli_epi32(bits, fraction_shift),
+                                      t_mask);
+
+            __m128i bias = _mm_setr_epi32(
+                table.bias[segments[0]], table.bias[segments[1]],
+                table.bias[segments[2]], table.bias[segments[3]]);
+            __m128i scale = _mm_setr_epi32(
+                table.scale[segments[0]], table.scale[segments[1]],
+                table.scale[segments[2]], table.scale[segments[3]]);
+
+            return _mm_srli_epi32(
+                _mm_add_epi32(bias, _mm_madd_epi16(scale, t)), 23);
+        };
+
+        for (; idx + 8 <= num_values; idx += 8) {
+            __m128i q16 = _mm_packs_epi32(quantize4(src + idx),
+                                          quantize4(src + idx + 4));
+            _mm_storel_epi64(reinterpret_cast<__m128i *>(dst + idx),
+                             _mm_packus_epi16(q16, q16));
+        }
+#elif defined(RLPBR_OBSERVATIONS_NEON)
+        const float32x4_t min_v =
+            vdupq_n_f32(bitsToFloat(SRGBTable::minBits));
+        const float32x4_t max_v =
+            vdupq_n_f32(bitsToFloat(SRGBTable::maxBits));
+        const uint32x4_t min_bits = vdupq_n_u32(SRGBTable::minBits);
+        const uint32x4_t t_mask = vdupq_n_u32(0xFFF);
+
+        auto quantize4 = [&](const float *values) {
+            float32x4_t v = vminq_f32(
+                vmaxnmq_f32(vld1q_f32(values), min_v), max_v);
+
+            uint32x4_t bits = vreinterpretq_u32_f32(v);
+            uint32_t segments[4];
+            vst1q_u32(segments,
+                      vshrq_n_u32(vsubq_u32(bits, min_bits), segment_shift));
+            uint32x4_t t = vandq_u32(vshrq_n_u32(bits, fraction_shift),
+                                     t_mask);
+
+            uint32_t bias[4], scale[4];
+            for (int i = 0; i < 4; i++) {
+                bias[i] = table.bias[segments[i]];
+                scale[i] = table.scale[segments[i]];
+            }
+
+            return vshrq_n_u32(
+                vmlaq_u32(vld1q_u32(bias), vld1q_u32(scale), t), 23);
+        };
+
+        for (; idx + 8 <= num_values; idx += 8) {
+            uint32x4_t qa = quantize4(src + idx);
+            uint32x4_t qb = quantize4(src + idx + 4);
+            vst1_u8(dst + idx, vmovn_u16(vcombine_u16(vmovn_u32(qa),
+                                                      vmovn_u32(qb))));
+        }
+#endif
+    }
+
+    for (; idx < num_values; idx++) {
+        dst[idx] = quantizeSRGB8Scalar(table, src[idx]);
+    }
+}
+
+static uint32_t typeBytes(ObservationType type)
+{
+    return type == ObservationType::Float32 ? sizeof(float) : 1;
+}
+
+uint64_t observationBytes(const ObservationSource &src,
+                          const ObservationFormat &fmt)
+{
+    uint64_t out_width = src.width / fmt.downsample;
+    uint64_t out_height = src.height / fmt.downsample;
+
+    return uint64_t(src.batchSize) * out_height * out_width *
+        fmt.numChannels * typeBytes(fmt.type);
+}
+
+static void validateFormat(const ObservationSource &src,
+                           const ObservationFormat &fmt)
+{
+    bool valid = fmt.numChannels >= 1 && fmt.numChannels <= 4 &&
+        fmt.downsample >= 1 &&
+        src.width % fmt.downsample == 0 &&
+        src.height % fmt.downsample == 0 &&
+        fmt.depthChannel < int32_t(src.numChannels);
+
+    // An empty depth range would turn every depth into NaN or infinity
+    if (fmt.depthChannel >= 0) {
+        valid = valid && isfinite(1.f / (fmt.depthFar - fmt.depthNear));
+    }
+
+    for (uint32_t c = 0; c < fmt.numChannels && valid; c++) {
+        valid = fmt.channels[c] < src.numChannels;
+    }
+
+    if (!valid) {
+        cerr << "Invalid observation format: " << fmt.numChannels <<
+            " channels of " << src.numChannels << ", " << src.width <<
+            "x" << src.height << " downsampled by " << fmt.downsample <<
+            ", depth channel " << fmt.depthChannel << " over [" <<
+            fmt.depthNear << ", " << fmt.depthFar << "]" << endl;
+        fatalExit();
+    }
+}
+
+namespace {
+
+// Converts output rows [begin, end), counted across the whole batch. The
+// channel selection, depth mapping and box filter are shared scalar code;
+// kernels only picks the row kernels.
+class RowConverter {
+public:
+    RowConverter(const ObservationSource &src, const ObservationFormat &fmt,
+                 void *dst, ObservationKernels kernels)
+        : src_(src),
+          fmt_(fmt),
+          dst_(static_cast<uint8_t *>(dst)),
+          kernels_(kernels),
+          out_width_(src.width / fmt.downsample),
+          out_height_(src.height / fmt.downsample),
+          src_rows_(size_t(fmt.downsample) * src.width * src.numChannels),
+          planes_(size_t(fmt.numChannels) * out_width_),
+          staging_(out_width_)
+    {}
+
+    void convert(uint32_t begin, uint32_t end)
+    {
+        for (uint32_t row_idx = begin; row_idx < end; row_idx++) {
+            convertRow(row_idx / out_height_, row_idx % out_height_);
+        }
+    }
+
+private:
+    void convertRow(uint32_t img_idx, uint32_t out_y)
+    {
+        const uint32_t ds = fmt_.downsample;
+        const uint32_t src_row_values = src_.width * src_.numChannels;
+
+        for (uint32_t dy = 0; dy < ds; dy++) {
+            uint64_t src_y = uint64_t(img_idx) * src_.height +
+                out_y * ds + dy;
+            halfToFloat(src_.data + src_y * src_row_values, src_row_values,
+                        src_rows_.data() + dy * src_row_values, kernels_);
+        }
+
+        const float inv_area = 1.f / float(ds * ds);
+        const float inv_depth_range = 1.f / (fmt_.depthFar - fmt_.depthNear);
+
+        for (uint32_t c = 0; c < fmt_.numChannels; c++) {
+            const uint32_t src_c = fmt_.channels[c];
+            const bool is_depth = int32_t(src_c) == fmt_.depthChannel;
+
+            auto sample = [&](uint32_t x, uint32_t dy) {
+                float v = src_rows_[dy * src_row_values +
+                    x * src_.numChannels + src_c];
+
+                if (is_depth) {
+                    v = v == 0.f ? 1.f :
+                        min(max((v - fmt_.depthNear) * inv_depth_range,
+                                0.f), 1.f);
+                }
+
+                return v;
+            };
+
+            float *plane = planes_.data() + size_t(c) * out_width_;
+            for (uint32_t out_x = 0; out_x < out_width_; out_x++) {
+                uint32_t src_x = out_x * ds;
+                if (ds == 1) {
+                    plane[out_x] = sample(src_x, 0);
+                    continue;
+                }
+
+                float sum = 0.f;
+                for (uint32_t dy = 0; dy < ds; dy++) {
+                    for (uint32_t dx = 0; dx < ds; dx++) {
+                        sum += sample(src_x + dx, dy);
+                    }
+                }
+
+                plane[out_x] = sum * inv_area;
+            }
+        }
+
+        if (fmt_.type == ObservationType::Float32) {
+            writeRow<float>(img_idx, out_y, [&](uint32_t c, float *out) {
+                memcpy(out, planes_.data() + size_t(c) * out_width_,
+                       sizeof(float) * out_width_);
+            });
+        } else {
+            writeRow<uint8_t>(img_idx, out_y, [&](uint32_t c, uint8_t *out) {
+                const float *plane = planes_.data() + size_t(c) * out_width_;
+                if (fmt_.type == ObservationType::SRGB8) {
+                    quantizeSRGB8(plane, out_width_, out, kernels_);
+                } else {
+                    quantizeUnorm8(plane, out_width_, out, kernels_);
+                }
+            });
+        }
+    }
+
+    // fn(c, out) writes out_width_ values of channel c contiguously,
+    // straight into the output for CHW and through a staging row for HWC
+    template <typename T, typename Fn>
+    void writeRow(uint32_t img_idx, uint32_t out_y, Fn &&fn)
+    {
+        T *dst = reinterpret_cast<T *>(dst_);
+        const uint32_t num_channels = fmt_.numChannels;
+        const uint64_t img_values =
+            uint64_t(out_width_) * out_height_ * num_channels;
+        dst += img_idx * img_values;
+
+        if (fmt_.layout == ObservationLayout::CHW) {
+            for (uint32_t c = 0; c < num_channels; c++) {
+                fn(c, dst + (uint64_t(c) * out_height_ + out_y) *
+                   out_width_);
+            }
+
+            return;
+        }
+
+        T *staging = reinterpret_cast<T *>(staging_.data());
+
+        T *out_row = dst + uint64_t(out_y) * out_width_ * num_channels;
+        for (uint32_t c = 0; c < num_channels; c++) {
+            fn(c, staging);
+
+            for (uint32_t x = 0; x < out_width_; x++) {
+                out_row[x * num_channels + c] = staging[x];
+            }
+        }
+    }
+
+    const ObservationSource &src_;
+    const ObservationFormat &fmt_;
+    uint8_t *dst_;
+    ObservationKernels kernels_;
+    uint32_t out_width_;
+    uint32_t out_height_;
+
+    std::vector<float> src_rows_;
+    std::vector<float> planes_;
+    // One channel of a row for HWC outputs, float or uint8
+    std::vector<float> staging_;
+};
+
+}
+
+void convertObservations(const ObservationSource &src,
+                         const ObservationFormat &fmt,
+                         void *dst, BatchPrepPool &pool,
+                         ObservationKernels kernels)
+{
+    validateFormat(src, fmt);
+
+    uint32_t num_rows = src.batchSize * (src.height / fmt.downsample);
+
+    pool.run(num_rows, [&](uint32_t begin, uint32_t end) {
+        RowConverter converter(src, fmt, dst, kernels);
+        converter.convert(begin, end);
+    }, 16);
+}
+
+void convertObservationsScalar(const ObservationSource &src,
+                               const ObservationFormat &fmt,
+                               void *dst)
+{
+    validateFormat(src, fmt);
+
+    uint32_t num_rows = src.batchSize * (src.height / fmt.downsample);
+
+    RowConverter converter(src, fmt, dst,
+                           ObservationKernels::Scalar);
+    converter.convert(0, num_rows);
+}
+
+}
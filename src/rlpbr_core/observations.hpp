@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstdint>
+
+namespace RLpbr {
+
+class BatchPrepPool;
+
+enum class ObservationType : uint32_t {
+    Float32,
+    // [0, 1] to [0, 255], rounded to nearest
+    Unorm8,
+    // sRGB encoded, see quantizeSRGB8
+    SRGB8,
+};
+
+enum class ObservationLayout : uint32_t {
+    HWC,
+    CHW,
+};
+
+// A batch of rendered images in host memory: batchSize images of height
+// rows of width pixels, each pixel numChannels IEEE halves. This is the
+// layout of Renderer::getOutputPointer (4 channels, RGB + instance ID, or
+// depth + IDs with RenderMode::Rasterize) and of the auxiliary outputs
+// (3 channels).
+struct ObservationSource {
+    const uint16_t *data;
+    uint32_t batchSize;
+    uint32_t width;
+    uint32_t height;
+    uint32_t numChannels;
+};
+
+struct ObservationFormat {
+    ObservationType type;
+    ObservationLayout layout;
+    // Source channel of each output channel
+    uint32_t channels[4];
+    uint32_t numChannels;
+    // Each output pixel averages a downsample x downsample block of source
+    // pixels. The source resolution must be a multiple of it.
+    uint32_t downsample;
+    // Source channel holding linear depth or -1. Depth is mapped from
+    // [depthNear, depthFar] to [0, 1] before averaging, misses (depth 0)
+    // map to 1.
+    int32_t depthChannel;
+    float depthNear;
+    float depthFar;
+};
+
+// Row kernel implementations. Vector uses AVX2 + F16C when the CPU
+// supports them and SSE2 or NEON otherwise, Baseline always uses the
+// latter. Every choice gives bit identical results.
+enum class ObservationKernels : uint32_t {
+    Scalar,
+    Baseline,
+    Vector,
+};
+
+// Whether ObservationKernels::Vector runs the AVX2 + F16C kernels
+bool observationKernelsAVX2();
+
+// Size of convertObservations' output
+uint64_t observationBytes(const ObservationSource &src,
+                          const ObservationFormat &fmt);
+
+// Converts every image of src into dst, images back to back, rows spread
+// across pool. Results are bit identical to convertObservationsScalar.
+void convertObservations(const ObservationSource &src,
+                         const ObservationFormat &fmt,
+                         void *dst, BatchPrepPool &pool,
+                         ObservationKernels kernels =
+                             ObservationKernels::Vector);
+
+// Single threaded scalar reference
+void convertObservationsScalar(const ObservationSource &src,
+                               const ObservationFormat &fmt,
+                               void *dst);
+
+// Row kernels, Scalar is the reference version
+
+// Exact, including denormals, infinities and NaNs (which are quieted)
+void halfToFloat(const uint16_t *src, uint32_t num_values, float *dst,
+                 ObservationKernels kernels = ObservationKernels::Vector);
+
+// clamp(v, 0, 1) * 255 rounded to nearest even, NaN maps to 0
+void quantizeUnorm8(const float *src, uint32_t num_values, uint8_t *dst,
+                    ObservationKernels kernels = ObservationKernels::Vector);
+
+// Piecewise linear fit of the sRGB curve over 32 segments per octave from
+// 2^-13 to 1, in fixed point. Within one step of rounding
+// linearToSRGB(v) * 255 exactly. NaN maps to 0.
+void quantizeSRGB8(const float *src, uint32_t num_values, uint8_t *dst,
+                   ObservationKernels kernels = ObservationKernels::Vector);
+
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <rlpbr/environment.hpp>
+
+#include <cstdint>
+
+namespace RLpbr {
+
+// Separate streams for each thing randomized per environment, so adding
+// draws to one never shifts the values of another
+enum class RandomPurpose : uint32_t {
+    InstanceMaterials = 0,
+    Domain = 1,
+};
+
+// Philox4x32-10 (Salmon et al., "Parallel Random Numbers: As Easy as
+// 1, 2, 3"). Output only depends on counter and key.
+inline void philox4x32(const uint32_t counter[4], const uint32_t key[2],
+                       uint32_t out[4])
+{
+    constexpr uint32_t mul0 = 0xD2511F53;
+    constexpr uint32_t mul1 = 0xCD9E8D57;
+    constexpr uint32_t weyl0 = 0x9E3779B9;
+    constexpr uint32_t weyl1 = 0xBB67AE85;
+
+    uint32_t c0 = counter[0], c1 = counter[1],
+             c2 = counter[2], c3 = counter[3];
+    uint32_t k0 = key[0], k1 = key[1];
+
+    for (int round = 0; round < 10; round++) {
+        uint64_t p0 = uint64_t(mul0) * c0;
+        uint64_t p1 = uint64_t(mul1) * c2;
+
+        uint32_t n0 = uint32_t(p1 >> 32) ^ c1 ^ k0;
+        uint32_t n1 = uint32_t(p1);
+        uint32_t n2 = uint32_t(p0 >> 32) ^ c3 ^ k1;
+        uint32_t n3 = uint32_t(p0);
+
+        c0 = n0;
+        c1 = n1;
+        c2 = n2;
+        c3 = n3;
+
+        k0 += weyl0;
+        k1 += weyl1;
+    }
+
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
+}
+
+// Sequential view of the Philox stream for (key, purpose). Conversions to
+// floats / ranges are done here rather than with <random> distributions,
+// whose output is implementation defined.
+class RandomStream {
+public:
+    inline RandomStream(const RandomKey &key, RandomPurpose purpose)
+        : key_ { uint32_t(key.seed), uint32_t(key.seed >> 32) },
+          counter_ { 0, key.envIdx, key.episode, uint32_t(purpose) },
+          block_ {},
+          block_idx_(4)
+    {}
+
+    inline uint32_t next()
+    {
+        if (block_idx_ == 4) {
+            philox4x32(counter_, key_, block_);
+            counter_[0]++;
+            block_idx_ = 0;
+        }
+
+        return block_[block_idx_++];
+    }
+
+    // [0, 1)
+    inline float uniform()
+    {
+        return float(next() >> 8) * (1.f / float(1u << 24));
+    }
+
+    // [0, n), multiply-shift range reduction
+    inline uint32_t uniformInt(uint32_t n)
+    {
+        return uint32_t((uint64_t(next()) * n) >> 32);
+    }
+
+private:
+    uint32_t key_[2];
+    uint32_t counter_[4];
+    uint32_t block_[4];
+    uint32_t block_idx_;
+};
+
+}
@@ -0,0 +1,213 @@
+#ifndef RLPBR_CORE_SAMPLING_H_INCLUDED
+#define RLPBR_CORE_SAMPLING_H_INCLUDED
+
+// Sample generation shared by the GLSL, CUDA and host code. Like device.h,
+// includers define SHADER_CONST, plus SHADER_FUNC as the function
+// qualifier, and must provide bitfieldReverse and float min outside of
+// GLSL. Only scalar types are used so the source is valid in all three.
+// Sampler state and the vector valued wrappers stay in each backend.
+
+// https://nullprogram.com/blog/2018/07/31/
+SHADER_FUNC uint32_t mix32(uint32_t v)
+{
+    v ^= v >> 16;
+    v *= 0x7feb352du;
+    v ^= v >> 15;
+    v *= 0x846ca68bu;
+    v ^= v >> 16;
+
+    return v;
+}
+
+// http://zimbry.blogspot.ch/2011/09/better-bit-mixing-improving-on.html
+// The two halves of the result seed a pair of dimensions
+SHADER_FUNC uint64_t mix64(uint32_t v)
+{
+    uint64_t vbig = v;
+    vbig ^= (vbig >> 31);
+    vbig *= 0x7fb5d329728ea185ul;
+    vbig ^= (vbig >> 27);
+    vbig *= 0x81dadef4bc2dd44dul;
+    vbig ^= (vbig >> 33);
+
+    return vbig;
+}
+
+// Space out bottom 16 bits with 0s
+SHADER_FUNC uint32_t mortonSpace16(uint32_t v)
+{
+    v = (v ^ (v << 8)) & 0x00ff00ffu;
+    v = (v ^ (v << 4)) & 0x0f0f0f0fu;
+    v = (v ^ (v << 2)) & 0x33333333u;
+    v = (v ^ (v << 1)) & 0x55555555u;
+
+    return v;
+}
+
+SHADER_FUNC uint32_t morton2D32(uint32_t x, uint32_t y)
+{
+    return (mortonSpace16(y) << 1) | mortonSpace16(x);
+}
+
+// http://abdallagafar.com/publications/zsampler/
+// Code is heavily based on ZSobolSampler from pbrt-v4
+// pbrt is Copyright(c) 1998-2020 Matt Pharr, Wenzel Jakob, and Greg Humphreys.
+// The pbrt source code is licensed under the Apache License, Version 2.0.
+//
+// The layout parameters are compile time constants in the GPU backends
+// (ZSOBOL_* defines, SPP / RES_X / RES_Y constexprs) so they fold away:
+// index_shift = log2(spp) rounded up to even, num_base4 = base 4 digits of
+// the morton index and odd_power = log2(spp) is odd.
+
+SHADER_FUNC uint32_t zSobolMortonIndex(uint32_t x, uint32_t y, uint32_t s,
+                                       uint32_t index_shift, bool odd_power)
+{
+    // Add extra bit for odd powers of 2 to round sample index up
+    if (odd_power) {
+        s <<= 1;
+    }
+
+    // Weird idea: what would happen if you expanded the morton code
+    // to 3D and got low discrepancy across the batch?
+    uint32_t morton_2d = morton2D32(x, y);
+
+    return (morton_2d << index_shift) | s;
+}
+
+// Digit d of the p'th of the 24 permutations of 4 elements
+SHADER_FUNC uint32_t zSobolPermutationDigit(uint32_t p, uint32_t d)
+{
+    uint32_t a = 0xe4b4d878u;
+    uint32_t b = 0x6c9ce1b1u;
+    uint32_t c = 0x934b4ec6u;
+
+    uint32_t mid = p & 0x6u;
+
+    uint32_t t = p < 8u ? a : p < 16u ? b : c;
+
+    uint32_t perm_set = bool(p & 1u) ? bitfieldReverse(t) : t;
+
+    uint32_t perm = perm_set >> (mid * 4u);
+
+    return (perm >> (d * 2u)) & 3u;
+}
+
+SHADER_FUNC uint32_t zSobolHashMortonPrefix(uint32_t dim, uint32_t idx)
+{
+    return mix32(idx ^ (0x55555555u * dim));
+}
+
+SHADER_FUNC uint32_t zSobolHashPermute(uint32_t dim, uint32_t idx)
+{
+    uint32_t hash = zSobolHashMortonPrefix(dim, idx);
+    return (hash >> 24) % 24u;
+}
+
+SHADER_FUNC uint32_t zSobolCurrentSampleIndex(uint32_t dim,
+                                              uint32_t morton_idx,
+                                              uint32_t num_base4,
+                                              bool odd_power)
+{
+    uint32_t sample_idx = 0u;
+
+    int last_digit = odd_power ? 1 : 0;
+
+    for (int i = int(num_base4) - 1; i >= last_digit; --i) {
+        int digit_shift = 2 * i;
+        uint32_t digit = (morton_idx >> digit_shift) & 3u;
+        uint32_t p =
+            zSobolHashPermute(dim, morton_idx >> (digit_shift + 2));
+        uint32_t permuted = zSobolPermutationDigit(p, digit);
+        sample_idx |= permuted << digit_shift;
+    }
+
+    if (odd_power) {
+        uint32_t final_digit = morton_idx & 3u;
+        sample_idx |= final_digit;
+        sample_idx >>= 1;
+        sample_idx ^= zSobolHashMortonPrefix(dim, morton_idx >> 2) & 1u;
+    }
+
+    return sample_idx;
+}
+
+SHADER_CONST int zSobolMatrixSize = 32;
+
+// The first Sobol dimension is the van der Corput sequence
+SHADER_FUNC uint32_t sobolDimZero(uint32_t sobol_idx)
+{
+    return bitfieldReverse(sobol_idx);
+}
+
+SHADER_FUNC uint32_t sobolDimOne(uint32_t sobol_idx)
+{
+    uint32_t v = 0u;
+
+    uint32_t prev_vec = 0x80000000u;
+
+    for (int mat_idx = 0; mat_idx < zSobolMatrixSize;
+         sobol_idx >>= 1, mat_idx++) {
+
+        uint32_t cur_vec = prev_vec;
+        prev_vec = prev_vec ^ (prev_vec >> 1);
+
+        if (bool(sobol_idx & 1u)) v ^= cur_vec;
+    }
+
+    return v;
+}
+
+// Random XOR scrambling, then to [0, 1)
+SHADER_FUNC float zSobolFinalize(uint32_t v, uint32_t hash_seed)
+{
+    const float nearest_one = 0.99999994f;
+    const float exp_neg32 = 2.3283064e-10f;
+
+    v ^= hash_seed;
+    return min(float(v) * exp_neg32, nearest_one);
+}
+
+SHADER_FUNC float zSobolSequenceDimZero(uint32_t sobol_idx,
+                                        uint32_t hash_seed)
+{
+    return zSobolFinalize(sobolDimZero(sobol_idx), hash_seed);
+}
+
+SHADER_FUNC float zSobolSequenceDimOne(uint32_t sobol_idx,
+                                       uint32_t hash_seed)
+{
+    return zSobolFinalize(sobolDimOne(sobol_idx), hash_seed);
+}
+
+// Fallback when the morton index doesn't fit (UNIFORM_SAMPLING): TEA
+// hashes the sample's linear index with the seed, then an LCG steps it
+SHADER_FUNC uint32_t uniformSamplerInit(uint32_t linear_idx, uint32_t seed)
+{
+    uint32_t v = linear_idx;
+    uint32_t v1 = seed;
+    uint32_t s0 = 0u;
+
+    for (int n = 0; n < 4; n++) {
+        s0 += 0x9e3779b9u;
+        v += ((v1 << 4) + 0xa341316cu) ^ (v1 + s0) ^ ((v1 >> 5) + 0xc8013ea4u);
+        v1 += ((v << 4) + 0xad90777du) ^ (v + s0) ^ ((v >> 5) + 0x7e95761eu);
+    }
+
+    return v;
+}
+
+SHADER_FUNC uint32_t uniformSamplerStep(uint32_t v)
+{
+    const uint32_t lcg_a = 1664525u;
+    const uint32_t lcg_c = 1013904223u;
+
+    return lcg_a * v + lcg_c;
+}
+
+// 24 bits so the result is < 1
+SHADER_FUNC float uniformSamplerToFloat(uint32_t v)
+{
+    return float(v & 0x00FFFFFFu) / float(0x01000000u);
+}
+
+#endif
@@ -1,11 +1,14 @@
 #include "scene.hpp"
 #include "common.hpp"
+#include "transforms.hpp"
 #include <rlpbr_core/utils.hpp>
 #include <rlpbr_core/physics.hpp>
 
+#include <cstring>
 #include <fstream>
 #include <iostream>
 
+#include <glm/gtc/packing.hpp>
 #include <glm/gtx/string_cast.hpp>
 
 using namespace std;
@@ -27,8 +30,14 @@ SceneLoadData SceneLoadData::loadFromDisk(string_view scene_path_name,
         return val;
     };
 
+    // 0x55555556 adds the instance hierarchy after the instance flags,
+    // 0x55555557 adds object bounds after the object infos, 0x55555558
+    // mesh BVHs after the staging data
     uint32_t magic = read_uint();
-    if (magic != 0x55555555) {
+    bool has_hierarchy = magic >= 0x55555556;
+    bool has_object_bounds = magic >= 0x55555557;
+    bool has_mesh_bvhs = magic >= 0x55555558;
+    if (magic < 0x55555555 || magic > 0x55555558) {
         cerr << "Invalid preprocessed scene" << endl;
         abort();
     }
@@ -54,6 +63,13 @@ SceneLoadData SceneLoadData::loadFromDisk(string_view scene_path_name,
     scene_file.read(reinterpret_cast<char *>(obj_infos.data()),
                     sizeof(ObjectInfo) * hdr.numObjects);
 
+    vector<AABB> obj_bounds;
+    if (has_object_bounds) {
+        obj_bounds.resize(hdr.numObjects);
+        scene_file.read(reinterpret_cast<char *>(obj_bounds.data()),
+                        sizeof(AABB) * hdr.numObjects);
+    }
+
     uint32_t num_lights = read_uint();
     vector<LightProperties> light_props(num_lights);
     scene_file.read(reinterpret_cast<char *>(light_props.data()),
@@ -126,6 +142,27 @@ SceneLoadData SceneLoadData::loadFromDisk(string_view scene_path_name,
     scene_file.read(reinterpret_cast<char *>(default_inst_flags.data()),
                     sizeof(InstanceFlags) * num_instances);
 
+    vector<uint32_t> instance_parents;
+    if (has_hierarchy) {
+        // Zero for flat scenes, otherwise one parent per instance
+        uint32_t num_parents = read_uint();
+        if (num_parents != 0 && num_parents != num_instances) {
+            cerr << "Invalid instance hierarchy" << endl;
+            abort();
+        }
+
+        instance_parents.resize(num_parents);
+        scene_file.read(reinterpret_cast<char *>(instance_parents.data()),
+                        sizeof(uint32_t) * num_parents);
+
+        for (uint32_t parent : instance_parents) {
+            if (parent != ~0u && parent >= num_instances) {
+                cerr << "Invalid instance hierarchy" << endl;
+                abort();
+            }
+        }
+    }
+
     uint32_t num_static = read_uint();
     uint32_t num_dynamic = read_uint();
 
@@ -156,9 +193,22 @@ SceneLoadData SceneLoadData::loadFromDisk(string_view scene_path_name,
 
     alignSkip();
 
+    // Header parsing is done, the bulk staging data is read through the
+    // IOEngine rather than the stream
+    uint64_t data_offset = scene_file.tellg();
+    scene_file.close();
+
+    uint64_t mesh_bvh_offset = 0;
+    if (has_mesh_bvhs) {
+        mesh_bvh_offset = alignOffset(data_offset + hdr.totalBytes, 256);
+    }
+
+    IOFile data_file(scene_path.string());
+
     auto loadRemainingData = [&]() {
         vector<char> file_data(hdr.totalBytes);
-        scene_file.read(file_data.data(), hdr.totalBytes);
+        IOEngine::get().read(data_file.getFD(), file_data.data(),
+                             data_offset, hdr.totalBytes);
 
         return file_data;
     };
@@ -174,7 +224,9 @@ SceneLoadData SceneLoadData::loadFromDisk(string_view scene_path_name,
                         move(instance_materials),
                         move(default_transforms),
                         move(default_inst_flags),
-                        move(light_props)),
+                        move(light_props),
+                        move(instance_parents),
+                        move(obj_bounds)),
         PhysicsMetadata {
             move(sdf_paths),
             move(static_instances),
@@ -182,18 +234,73 @@ SceneLoadData SceneLoadData::loadFromDisk(string_view scene_path_name,
             move(dynamic_transforms),
         },
         scene_path,
+        mesh_bvh_offset,
         load_full_file ? 
-            variant<ifstream, vector<char>>(loadRemainingData()) :
-            variant<ifstream, vector<char>>(move(scene_file)),
+            variant<SceneDataFile, vector<char>>(loadRemainingData()) :
+            variant<SceneDataFile, vector<char>>(SceneDataFile {
+                move(data_file),
+                data_offset,
+            }),
     };
 }
 
+vector<BVH> SceneLoadData::readMeshBVHs() const
+{
+    if (meshBVHOffset == 0) {
+        return {};
+    }
+
+    ifstream scene_file(scenePath, ios::binary);
+    scene_file.seekg(meshBVHOffset);
+
+    uint32_t num_bvhs;
+    scene_file.read(reinterpret_cast<char *>(&num_bvhs), sizeof(uint32_t));
+
+    // Traversal trusts the stored offsets, so a bad BVH fails the load
+    // like any other invalid scene data
+    auto invalid = [&]() {
+        cerr << "Invalid mesh BVHs in " << scenePath << endl;
+        abort();
+    };
+
+    if (!scene_file || num_bvhs != meshInfo.size()) {
+        invalid();
+    }
+
+    vector<BVH> bvhs;
+    bvhs.reserve(num_bvhs);
+    for (uint32_t i = 0; i < num_bvhs; i++) {
+        bvhs.push_back(readBVH(scene_file));
+
+        if (!scene_file ||
+            !bvhs.back().validate(meshInfo[i].numTriangles)) {
+            invalid();
+        }
+    }
+
+    return bvhs;
+}
+
+void SceneLoadData::readData(void *dst)
+{
+    if (holds_alternative<SceneDataFile>(data)) {
+        const SceneDataFile &data_file = *get_if<SceneDataFile>(&data);
+        IOEngine::get().read(data_file.file.getFD(), dst,
+                             data_file.offset, hdr.totalBytes);
+    } else {
+        const vector<char> &loaded = *get_if<vector<char>>(&data);
+        memcpy(dst, loaded.data(), hdr.totalBytes);
+    }
+}
+
 EnvironmentInit::EnvironmentInit(const AABB &bbox,
     vector<ObjectInstance> instances,
     vector<uint32_t> instance_materials,
     vector<InstanceTransform> transforms,
     vector<InstanceFlags> instance_flags,
-    vector<LightProperties> l)
+    vector<LightProperties> l,
+    vector<uint32_t> parents,
+    vector<AABB> object_bounds)
     : defaultBBox(bbox),
       defaultInstances(move(instances)),
       defaultInstanceMaterials(move(instance_materials)),
@@ -201,18 +308,52 @@ EnvironmentInit::EnvironmentInit(const AABB &bbox,
       defaultInstanceFlags(move(instance_flags)),
       indexMap(),
       reverseIDMap(),
+      defaultParents(move(parents)),
+      defaultLocalTransforms(),
+      defaultNumChildren(),
+      hierarchyOrder(),
+      hierarchyLevels(),
+      objectBounds(move(object_bounds)),
       lights(move(l)),
       lightIDs(),
-      lightReverseIDs()
+      lightReverseIDs(),
+      lightSampling(vector<float>(lights.size(), 1.f))
 {
-    indexMap.reserve(instances.size());
-    reverseIDMap.reserve(instances.size());
+    indexMap.reserve(defaultInstances.size());
+    reverseIDMap.reserve(defaultInstances.size());
 
-    for (uint32_t cur_id = 0; cur_id < instances.size(); cur_id++) {
+    for (uint32_t cur_id = 0; cur_id < defaultInstances.size(); cur_id++) {
         indexMap.emplace_back(cur_id);
         reverseIDMap.push_back(cur_id);
     }
 
+    if (defaultParents.size() > 0) {
+        defaultLocalTransforms = defaultTransforms;
+        defaultNumChildren.resize(defaultParents.size(), 0);
+
+        vector<const InstanceTransform *> parent_txfms;
+        vector<const InstanceTransform *> child_txfms;
+        vector<InstanceTransform *> local_txfms;
+        for (uint32_t inst_idx = 0; inst_idx < defaultParents.size();
+             inst_idx++) {
+            uint32_t parent = defaultParents[inst_idx];
+            if (parent == ~0u) {
+                continue;
+            }
+
+            defaultNumChildren[parent]++;
+            parent_txfms.push_back(&defaultTransforms[parent]);
+            child_txfms.push_back(&defaultTransforms[inst_idx]);
+            local_txfms.push_back(&defaultLocalTransforms[inst_idx]);
+        }
+
+        relativeTransforms(parent_txfms.data(), child_txfms.data(),
+                           local_txfms.data(), local_txfms.size());
+
+        buildHierarchyOrder(CowArray<uint32_t>(defaultParents),
+                            hierarchyOrder, hierarchyLevels);
+    }
+
     lightIDs.reserve(lights.size());
     lightReverseIDs.reserve(lights.size());
     for (uint32_t light_idx = 0; light_idx < lights.size(); light_idx++) {
@@ -221,4 +362,63 @@ EnvironmentInit::EnvironmentInit(const AABB &bbox,
     }
 }
 
+vector<float> computeLightPowers(const vector<LightProperties> &lights,
+                                 const PackedVertex *vertices,
+                                 const uint32_t *indices,
+                                 const MaterialParams *materials)
+{
+    auto materialLuminance = [materials](uint32_t mat_idx) {
+        const MaterialParams &mat = materials[mat_idx];
+        if (!(mat.flags & uint16_t(MaterialFlags::Complex))) {
+            return 0.f;
+        }
+
+        glm::vec3 emittance(glm::unpackHalf1x16(mat.baseEmittance.x),
+                            glm::unpackHalf1x16(mat.baseEmittance.y),
+                            glm::unpackHalf1x16(mat.baseEmittance.z));
+
+        return rgbLuminance(emittance);
+    };
+
+    auto position = [vertices, indices](uint32_t idx_offset) {
+        return vertices[indices[idx_offset]].position;
+    };
+
+    vector<float> powers;
+    powers.reserve(lights.size());
+    for (const LightProperties &light : lights) {
+        float power = 0.f;
+        if (light.type == LightType::Sphere) {
+            float area = 4.f * M_PI * light.radius * light.radius;
+            power = M_PI * area * materialLuminance(light.sphereMatIdx);
+        } else if (light.type == LightType::Triangle) {
+            glm::vec3 a = position(light.triIdxOffset);
+            glm::vec3 b = position(light.triIdxOffset + 1);
+            glm::vec3 c = position(light.triIdxOffset + 2);
+
+            float area = 0.5f * glm::length(glm::cross(b - a, c - a));
+            power = M_PI * area * materialLuminance(light.triMatIdx);
+        } else if (light.type == LightType::Portal) {
+            glm::vec3 a = position(light.portalIdxOffset);
+            glm::vec3 b = position(light.portalIdxOffset + 1);
+            glm::vec3 c = position(light.portalIdxOffset + 2);
+            glm::vec3 d = position(light.portalIdxOffset + 3);
+
+            // Radiance comes from the environment map, weight by area
+            float area = 0.5f * (glm::length(glm::cross(b - a, c - a)) +
+                                 glm::length(glm::cross(c - a, d - a)));
+            power = M_PI * area;
+        }
+
+        powers.push_back(power);
+    }
+
+    return powers;
+}
+
+float rgbLuminance(const glm::vec3 &rgb)
+{
+    return 0.2126f * rgb.x + 0.7152f * rgb.y + 0.0722f * rgb.z;
+}
+
 }
@@ -1,9 +1,13 @@
 #pragma once
 
+#include "bvh.hpp"
 #include "common.hpp"
 #include "utils.hpp"
 #include "physics.hpp"
 #include "device.hpp"
+#include "io.hpp"
+
+#include <rlpbr/light_sampler.hpp>
 
 #include <glm/glm.hpp>
 #include <glm/gtc/quaternion.hpp>
@@ -76,13 +80,25 @@ struct LightProperties {
     };
 };
 
+float rgbLuminance(const glm::vec3 &rgb);
+
+// Emitted power per light from the scene's staged geometry and materials,
+// to weight light selection. Portals are weighted by area alone.
+std::vector<float> computeLightPowers(
+    const std::vector<LightProperties> &lights,
+    const PackedVertex *vertices,
+    const uint32_t *indices,
+    const MaterialParams *materials);
+
 struct EnvironmentInit {
     EnvironmentInit(const AABB &bbox,
                     std::vector<ObjectInstance> instances,
                     std::vector<uint32_t> instance_materials,
                     std::vector<InstanceTransform> transforms,
                     std::vector<InstanceFlags> instance_flags,
-                    std::vector<LightProperties> lights);
+                    std::vector<LightProperties> lights,
+                    std::vector<uint32_t> parents = {},
+                    std::vector<AABB> object_bounds = {});
 
     AABB defaultBBox;
     std::vector<ObjectInstance> defaultInstances;
@@ -93,9 +109,27 @@ struct EnvironmentInit {
     std::vector<uint32_t> indexMap;
     std::vector<uint32_t> reverseIDMap;
 
+    // Transform hierarchy, empty for flat scenes. Parent instance per
+    // instance (~0u for none), transforms relative to the parent and
+    // the breadth first order from buildHierarchyOrder.
+    std::vector<uint32_t> defaultParents;
+    std::vector<InstanceTransform> defaultLocalTransforms;
+    std::vector<uint32_t> defaultNumChildren;
+    std::vector<uint32_t> hierarchyOrder;
+    std::vector<uint32_t> hierarchyLevels;
+
+    // Object space bounds per object for spatial queries. Empty for scenes
+    // preprocessed before bounds were stored, instances are then treated
+    // as points at their origin.
+    std::vector<AABB> objectBounds;
+
     std::vector<LightProperties> lights;
     std::vector<uint32_t> lightIDs;
     std::vector<uint32_t> lightReverseIDs;
+
+    // Selection tables over the lights. Every light weighs the same
+    // until a loader with access to the geometry sets real powers.
+    LightSamplerInit lightSampling;
 };
 
 struct ObjectInfo {
@@ -155,6 +189,12 @@ struct StagingHeader {
     uint64_t totalBytes;
 };
 
+// Staging data left on disk, read through the IOEngine by the backend
+struct SceneDataFile {
+    IOFile file;
+    uint64_t offset;
+};
+
 struct SceneLoadData {
     StagingHeader hdr;
     std::vector<MeshInfo> meshInfo;
@@ -164,8 +204,17 @@ struct SceneLoadData {
     EnvironmentInit envInit;
     PhysicsMetadata physics;
     std::string scenePath;
+    // File offset of the per mesh BVHs, 0 if the scene has none
+    uint64_t meshBVHOffset;
+
+    std::variant<SceneDataFile, std::vector<char>> data;
+
+    // Copy hdr.totalBytes of staging data into dst
+    void readData(void *dst);
 
-    std::variant<std::ifstream, std::vector<char>> data;
+    // One BVH over the triangles of each mesh, in meshInfo order. Empty if
+    // the file predates them, aborts if any of them fails BVH::validate.
+    std::vector<BVH> readMeshBVHs() const;
 
     static SceneLoadData loadFromDisk(std::string_view scene_path,
                                       bool load_full_file = false);
@@ -0,0 +1,102 @@
+#ifndef RLPBR_CORE_SHADING_H_INCLUDED
+#define RLPBR_CORE_SHADING_H_INCLUDED
+
+// Scalar BSDF and lighting math shared by the GLSL, CUDA and host code,
+// included the same way as sampling.h. Includers provide float min, max
+// and sqrt outside of GLSL. The vector parts of the BSDFs build on these
+// in each backend, since the vector types differ.
+
+SHADER_CONST float ShadingPi = 3.14159265f;
+
+// Schlick: f0 + (f90 - f0) * fresnelWeight(cos_theta)
+SHADER_FUNC float fresnelWeight(float cos_theta)
+{
+    float complement = max(1.f - cos_theta, 0.f);
+    return complement * complement * complement * complement * complement;
+}
+
+// Single scattering GGX Microfacet BRDF
+SHADER_FUNC float ggxLambda(float cos_theta, float a2)
+{
+    float cos2 = cos_theta * cos_theta;
+    float tan2 = max(1.f - cos2, 0.f) / cos2;
+    float l = 0.5f * (-1.f + sqrt(1.f + a2 * tan2));
+
+    return cos_theta <= 0.f ? 0.f : l;
+}
+
+SHADER_FUNC float ggxG1(float cos_theta, float a2)
+{
+    float cos2 = cos_theta * cos_theta;
+    float tan2 = max(1.f - cos2, 0.f) / cos2;
+    float g1 = 2.f / (1.f + sqrt(1.f + a2 * tan2));
+    return g1;
+}
+
+SHADER_FUNC float ggxNDF(float a2, float cos_theta)
+{
+    float d = ((cos_theta * a2 - cos_theta) * cos_theta + 1.f);
+    return a2 / (d * d * ShadingPi);
+}
+
+SHADER_FUNC float ggxMasking(float a2, float out_cos, float in_cos)
+{
+    float in_lambda = ggxLambda(in_cos, a2);
+    float out_lambda = ggxLambda(out_cos, a2);
+    return 1.f / (1.f + in_lambda + out_lambda);
+}
+
+// Point on a sphere light, relative to the cone of directions the sphere
+// subtends. Code from pbrt-v3.
+struct SphereConeSample {
+    // Angle between the sampled point's normal and the direction from the
+    // sphere towards the shading point
+    float cosAlpha;
+    float sinAlpha;
+    // Solid angle of the cone, 1 / pdf
+    float invPdf;
+};
+
+SHADER_FUNC SphereConeSample sampleSphereCone(float sin_theta_max, float u)
+{
+    float sin_theta_max2 = sin_theta_max * sin_theta_max;
+    float inv_sin_theta_max = 1.f / sin_theta_max;
+    float cos_theta_max = sqrt(max(0.f, 1.f - sin_theta_max2));
+
+    float cos_theta = (cos_theta_max - 1.f) * u + 1.f;
+    float sin_theta2 = 1.f - cos_theta * cos_theta;
+
+    if (sin_theta_max2 < 0.00068523f /* sin^2(1.5 deg) */) {
+        // Fall back to a Taylor series expansion for small angles, where
+        // the standard approach suffers from severe cancellation errors
+        sin_theta2 = sin_theta_max2 * u;
+        cos_theta = sqrt(1.f - sin_theta2);
+    }
+
+    SphereConeSample result;
+
+    // Compute angle alpha from center of sphere to sampled point on surface
+    result.cosAlpha = sin_theta2 * inv_sin_theta_max +
+        cos_theta * sqrt(max(0.f, 1.f - sin_theta2 * inv_sin_theta_max *
+                             inv_sin_theta_max));
+
+    result.sinAlpha = sqrt(max(0.f, 1.f - result.cosAlpha * result.cosAlpha));
+
+    // Uniform cone PDF.
+    result.invPdf = 2.f * ShadingPi * (1.f - cos_theta_max);
+
+    return result;
+}
+
+// Converts an area density on a light to solid angle at the shading point
+SHADER_FUNC float areaToSolidAnglePDF(float area_pdf, float dist2,
+                                      float cos_theta)
+{
+    if (dist2 > 0.f && cos_theta > 0.f) {
+        return area_pdf * dist2 / cos_theta;
+    } else {
+        return 0.f;
+    }
+}
+
+#endif
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+namespace RLpbr {
+
+namespace Shader {
+
+using std::max;
+using std::min;
+using std::sqrt;
+
+// GLSL builtin used by sampling.h
+inline uint32_t bitfieldReverse(uint32_t v)
+{
+    v = ((v >> 1) & 0x55555555u) | ((v & 0x55555555u) << 1);
+    v = ((v >> 2) & 0x33333333u) | ((v & 0x33333333u) << 2);
+    v = ((v >> 4) & 0x0f0f0f0fu) | ((v & 0x0f0f0f0fu) << 4);
+    v = ((v >> 8) & 0x00ff00ffu) | ((v & 0x00ff00ffu) << 8);
+    return (v >> 16) | (v << 16);
+}
+
+#define SHADER_CONST static constexpr
+#define SHADER_FUNC inline
+#include "sampling.h"
+#include "shading.h"
+#undef SHADER_FUNC
+#undef SHADER_CONST
+
+}
+
+}
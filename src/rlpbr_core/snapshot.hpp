@@ -0,0 +1,175 @@
+#pragma once
+
+#include <rlpbr/cow_array.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+namespace RLpbr {
+
+// Appends plain values to an EnvironmentSnapshot blob
+class SnapshotWriter {
+public:
+    SnapshotWriter(std::vector<uint8_t> &out)
+        : out_(out)
+    {}
+
+    template <typename T>
+    void write(const T &v)
+    {
+        writeArray(&v, 1);
+    }
+
+    template <typename T>
+    void writeArray(const T *data, uint32_t num_elems)
+    {
+        static_assert(std::is_trivially_copyable_v<T>);
+
+        size_t offset = out_.size();
+        out_.resize(offset + sizeof(T) * num_elems);
+        if (num_elems > 0) {
+            memcpy(out_.data() + offset, data, sizeof(T) * num_elems);
+        }
+    }
+
+    template <typename T>
+    void writeVector(const std::vector<T> &v)
+    {
+        write(uint32_t(v.size()));
+        writeArray(v.data(), v.size());
+    }
+
+    // Size followed by the chunks that differ from base, in ascending
+    // order, so equal arrays serialize to equal bytes
+    template <typename T>
+    void writeCow(const CowArray<T> &arr, const std::vector<T> &base)
+    {
+        uint32_t num_chunks = arr.numChunks();
+
+        std::vector<uint32_t> &chunks = chunk_scratch_;
+        chunks.clear();
+        for (uint32_t chunk_idx : arr.ownedChunks()) {
+            if (chunk_idx >= num_chunks) {
+                continue;
+            }
+
+            uint32_t start = chunk_idx << CowArray<T>::chunkShift;
+            uint32_t len = arr.chunkLength(chunk_idx);
+            const T *data = arr.chunkData(chunk_idx);
+
+            if (start + len <= base.size() &&
+                memcmp(data, base.data() + start, sizeof(T) * len) == 0) {
+                continue;
+            }
+
+            chunks.push_back(chunk_idx);
+        }
+        std::sort(chunks.begin(), chunks.end());
+
+        write(arr.size());
+        write(uint32_t(chunks.size()));
+        for (uint32_t chunk_idx : chunks) {
+            write(chunk_idx);
+            writeArray(arr.chunkData(chunk_idx), arr.chunkLength(chunk_idx));
+        }
+    }
+
+private:
+    std::vector<uint8_t> &out_;
+    std::vector<uint32_t> chunk_scratch_;
+};
+
+// Reads values written by SnapshotWriter. Every read fails once the
+// blob is exhausted or malformed.
+class SnapshotReader {
+public:
+    SnapshotReader(const uint8_t *data, size_t num_bytes)
+        : cur_(data),
+          end_(data + num_bytes)
+    {}
+
+    template <typename T>
+    bool read(T &v)
+    {
+        return readArray(&v, 1);
+    }
+
+    template <typename T>
+    bool readArray(T *data, uint32_t num_elems)
+    {
+        static_assert(std::is_trivially_copyable_v<T>);
+
+        size_t num_bytes = sizeof(T) * num_elems;
+        if (size_t(end_ - cur_) < num_bytes) {
+            cur_ = end_;
+            return false;
+        }
+
+        if (num_bytes > 0) {
+            memcpy(data, cur_, num_bytes);
+        }
+        cur_ += num_bytes;
+
+        return true;
+    }
+
+    template <typename T>
+    bool readVector(std::vector<T> &v)
+    {
+        uint32_t num_elems;
+        if (!read(num_elems) || remaining() < sizeof(T) * num_elems) {
+            return false;
+        }
+
+        v.resize(num_elems);
+        return readArray(v.data(), num_elems);
+    }
+
+    // Array over base with the chunks stored by SnapshotWriter::writeCow
+    template <typename T>
+    bool readCow(CowArray<T> &arr, const std::vector<T> &base)
+    {
+        uint32_t size, num_stored;
+        if (!read(size) || !read(num_stored)) {
+            return false;
+        }
+
+        // Elements past the base are always stored, bound the size by the
+        // remaining bytes before allocating for it
+        if (size > base.size() &&
+            uint64_t(size - base.size()) * sizeof(T) > remaining()) {
+            return false;
+        }
+
+        arr = CowArray<T>(base);
+        arr.resize(size);
+
+        uint32_t num_chunks = arr.numChunks();
+        uint32_t next_chunk = 0;
+        for (uint32_t i = 0; i < num_stored; i++) {
+            uint32_t chunk_idx;
+            if (!read(chunk_idx) || chunk_idx < next_chunk ||
+                chunk_idx >= num_chunks) {
+                return false;
+            }
+            next_chunk = chunk_idx + 1;
+
+            T *dst = &arr.mut(chunk_idx << CowArray<T>::chunkShift);
+            if (!readArray(dst, arr.chunkLength(chunk_idx))) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    size_t remaining() const { return end_ - cur_; }
+
+private:
+    const uint8_t *cur_;
+    const uint8_t *end_;
+};
+
+}
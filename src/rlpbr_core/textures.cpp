@@ -0,0 +1,242 @@
+#include "textures.hpp"
+#include "io.hpp"
+#include "utils.hpp"
+
+#include <cassert>
+#include <cstdlib>
+#include <iostream>
+
+#define STB_IMAGE_STATIC
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+using namespace std;
+
+namespace RLpbr {
+
+namespace TextureConfig {
+// Level descriptors fetched with the first read of each texture file
+constexpr uint32_t maxHeaderLevels = 32;
+constexpr uint32_t headerBytes = 2 * sizeof(uint32_t) +
+    maxHeaderLevels * 4 * sizeof(uint32_t);
+
+constexpr uint32_t fourCompBytes = 4;
+constexpr uint32_t twoCompBytes = 2;
+constexpr uint32_t oneCompBytes = 1;
+}
+
+vector<TextureLoadRequest> getSceneTextureRequests(
+    const TextureInfo &texture_info)
+{
+    vector<TextureLoadRequest> reqs;
+    reqs.reserve(
+        texture_info.base.size() + texture_info.metallicRoughness.size() +
+        texture_info.specular.size() + texture_info.normal.size() +
+        texture_info.emittance.size() + texture_info.transmission.size() +
+        texture_info.clearcoat.size() + texture_info.anisotropic.size());
+
+    auto requestTextureList = [&](const vector<string> &texture_names,
+                                  uint32_t texel_bytes) {
+        for (const string &tex_name : texture_names) {
+            reqs.push_back({
+                texture_info.textureDir + tex_name,
+                texel_bytes,
+            });
+        }
+    };
+
+    requestTextureList(texture_info.base, TextureConfig::fourCompBytes);
+    requestTextureList(texture_info.metallicRoughness,
+                       TextureConfig::twoCompBytes);
+    requestTextureList(texture_info.specular, TextureConfig::fourCompBytes);
+    requestTextureList(texture_info.normal, TextureConfig::twoCompBytes);
+    requestTextureList(texture_info.emittance, TextureConfig::fourCompBytes);
+    requestTextureList(texture_info.transmission,
+                       TextureConfig::oneCompBytes);
+    requestTextureList(texture_info.clearcoat, TextureConfig::twoCompBytes);
+    requestTextureList(texture_info.anisotropic,
+                       TextureConfig::twoCompBytes);
+
+    return reqs;
+}
+
+vector<CompressedTexture> readTextures(const TextureLoadRequest *reqs,
+                                       uint32_t num_reqs,
+                                       uint32_t max_texture_resolution,
+                                       uint32_t max_open_files)
+{
+    IOEngine &io = IOEngine::get();
+
+    max_open_files = max(max_open_files, 1u);
+    uint32_t window_size = min(num_reqs, max_open_files);
+
+    vector<CompressedTexture> textures;
+    textures.reserve(num_reqs);
+
+    vector<IOFile> files;
+    files.reserve(window_size);
+    vector<uint32_t> headers(window_size *
+        TextureConfig::headerBytes / sizeof(uint32_t));
+    vector<IORead> reads;
+    reads.reserve(window_size);
+
+    // Files are opened max_open_files at a time and closed once their
+    // data has arrived
+    for (uint32_t window_start = 0; window_start < num_reqs;
+         window_start += window_size) {
+        uint32_t window_end = min(window_start + window_size, num_reqs);
+
+        files.clear();
+        reads.clear();
+
+        for (uint32_t tex_idx = window_start; tex_idx < window_end;
+             tex_idx++) {
+            const IOFile &file = files.emplace_back(reqs[tex_idx].path);
+
+            reads.push_back({
+                file.getFD(),
+                headers.data() + (tex_idx - window_start) *
+                    TextureConfig::headerBytes / sizeof(uint32_t),
+                0,
+                min<uint64_t>(file.numBytes(), TextureConfig::headerBytes),
+                {},
+            });
+        }
+
+        IOBatch header_batch;
+        io.submit(header_batch, reads.data(), reads.size());
+        if (!header_batch.wait()) {
+            cerr << "Failed to read texture headers" << endl;
+            fatalExit();
+        }
+
+        reads.clear();
+
+        for (uint32_t tex_idx = window_start; tex_idx < window_end;
+             tex_idx++) {
+            const uint32_t *header = headers.data() +
+                (tex_idx - window_start) *
+                    TextureConfig::headerBytes / sizeof(uint32_t);
+            uint32_t texel_bytes = reqs[tex_idx].texelBytes;
+
+            auto magic = header[0];
+            if (magic != 0x50505050) {
+                cerr << "Invalid texture file" << endl;
+                abort();
+            }
+            auto total_num_levels = header[1];
+            if (total_num_levels > TextureConfig::maxHeaderLevels) {
+                cerr << "Texture has too many mip levels" << endl;
+                abort();
+            }
+
+            CompressedTexture tex {};
+            tex.texelBytes = texel_bytes;
+            tex.levelRanges.reserve(total_num_levels);
+
+            uint32_t skip_bytes = 0;
+            uint32_t level_alignment = max(texel_bytes, 4u);
+
+            for (int i = 0; i < (int)total_num_levels; i++) {
+                const uint32_t *level_info = header + 2 + i * 4;
+                uint32_t level_x = level_info[0];
+                uint32_t level_y = level_info[1];
+                uint32_t offset = level_info[2];
+                uint32_t lvl_compressed_bytes = level_info[3];
+
+                if (level_x > max_texture_resolution &&
+                    level_y > max_texture_resolution) {
+                    skip_bytes += lvl_compressed_bytes;
+                    tex.numSkipLevels++;
+                    continue;
+                }
+
+                tex.numDecompressedBytes = alignOffset(
+                    tex.numDecompressedBytes, level_alignment);
+
+                if (tex.dims.x == 0 && tex.dims.y == 0) {
+                    tex.dims = glm::u32vec2(level_x, level_y);
+                }
+
+                tex.levelRanges.emplace_back(offset - skip_bytes,
+                                             lvl_compressed_bytes);
+                tex.numDecompressedBytes += level_x * level_y * texel_bytes;
+                tex.numBytes += lvl_compressed_bytes;
+            }
+
+            tex.numLevels = total_num_levels - tex.numSkipLevels;
+            tex.data = (uint8_t *)malloc(tex.numBytes);
+
+            uint64_t data_offset = 2 * sizeof(uint32_t) +
+                total_num_levels * 4 * sizeof(uint32_t) + skip_bytes;
+
+            reads.push_back({
+                files[tex_idx - window_start].getFD(),
+                tex.data,
+                data_offset,
+                tex.numBytes,
+                {},
+            });
+
+            textures.emplace_back(move(tex));
+        }
+
+        IOBatch data_batch;
+        io.submit(data_batch, reads.data(), reads.size());
+        if (!data_batch.wait()) {
+            cerr << "Failed to read texture data" << endl;
+            fatalExit();
+        }
+    }
+
+    return textures;
+}
+
+DecodedTexture decodeTexture(CompressedTexture &tex)
+{
+    uint32_t texel_bytes = tex.texelBytes;
+    uint32_t level_alignment = max(texel_bytes, 4u);
+
+    uint8_t *img_data = (uint8_t *)malloc(tex.numDecompressedBytes);
+
+    uint32_t cur_offset = 0;
+    for (int i = 0; i < (int)tex.numLevels; i++) {
+        auto [offset, num_bytes] = tex.levelRanges[i];
+        int lvl_x, lvl_y, tmp_n;
+        uint8_t *decompressed = stbi_load_from_memory(
+            tex.data + offset, num_bytes,
+            &lvl_x, &lvl_y, &tmp_n, 4);
+
+        cur_offset = alignOffset(cur_offset, level_alignment);
+
+        for (int pix_idx = 0; pix_idx < int(lvl_x * lvl_y); pix_idx++) {
+            uint8_t *decompressed_offset = decompressed + pix_idx * 4;
+            uint8_t *out_offset =
+                img_data + cur_offset + pix_idx * texel_bytes;
+
+            for (int byte_idx = 0; byte_idx < (int)texel_bytes;
+                 byte_idx++) {
+                out_offset[byte_idx] = decompressed_offset[byte_idx];
+            }
+        }
+        free(decompressed);
+
+        cur_offset += lvl_x * lvl_y * texel_bytes;
+    }
+
+    assert(cur_offset == tex.numDecompressedBytes);
+
+    free(tex.data);
+    tex.data = nullptr;
+
+    return DecodedTexture {
+        img_data,
+        tex.numDecompressedBytes,
+        tex.dims,
+        tex.numLevels,
+        texel_bytes,
+        -float(tex.numSkipLevels),
+    };
+}
+
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "scene.hpp"
+
+#include <glm/glm.hpp>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace RLpbr {
+
+struct TextureLoadRequest {
+    std::string path;
+    uint32_t texelBytes;
+};
+
+// Mip levels above the resolution cap are dropped at read time,
+// levelRanges are relative to data
+struct CompressedTexture {
+    uint8_t *data;
+    uint32_t numBytes;
+    glm::u32vec2 dims;
+    uint32_t numLevels;
+    uint32_t numSkipLevels;
+    uint32_t numDecompressedBytes;
+    uint32_t texelBytes;
+    std::vector<std::pair<uint32_t, uint32_t>> levelRanges;
+};
+
+// Levels are packed back to back, each aligned to max(texelBytes, 4)
+struct DecodedTexture {
+    uint8_t *data;
+    uint32_t numBytes;
+    glm::u32vec2 dims;
+    uint32_t numLevels;
+    uint32_t texelBytes;
+    float bias;
+};
+
+// Requests for every texture in the scene in TextureInfo order:
+// base, metallicRoughness, specular, normal, emittance, transmission,
+// clearcoat, anisotropic
+std::vector<TextureLoadRequest> getSceneTextureRequests(
+    const TextureInfo &texture_info);
+
+// Reads the requested files with two IOEngine batches (headers, then
+// compressed levels) per group of max_open_files, so at most that many
+// files are open at once
+std::vector<CompressedTexture> readTextures(
+    const TextureLoadRequest *reqs, uint32_t num_reqs,
+    uint32_t max_texture_resolution, uint32_t max_open_files = 64);
+
+// Frees tex.data
+DecodedTexture decodeTexture(CompressedTexture &tex);
+
+}
@@ -0,0 +1,445 @@
+#include "tonemap.hpp"
+
+#include <glm/gtc/packing.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define RLPBR_TONEMAP_SSE
+#endif
+
+using namespace std;
+
+namespace RLpbr {
+
+using Exp = ExposureConstants;
+
+float rgbToLuminance(const glm::vec3 &rgb)
+{
+    return 0.2126f * rgb.x + 0.7152f * rgb.y + 0.0722f * rgb.z;
+}
+
+float exposureBin(float luminance)
+{
+    float log_luminance = (luminance < Exp::minLuminance) ?
+        Exp::minLogLuminance : log2f(luminance);
+
+    float remapped = (log_luminance - Exp::minLogLuminance) *
+        Exp::invLogLuminanceRange;
+    return remapped * float(Exp::numBins - 1);
+}
+
+static inline void addToHistogram(float luminance, float *bins)
+{
+    float bin = exposureBin(luminance);
+    int low_bin = clamp(int(bin), 0, int(Exp::numBins) - 1);
+    int high_bin = min(low_bin + 1, int(Exp::numBins) - 1);
+    float high_weight = bin - floorf(bin);
+
+    bins[low_bin] += 1.f - high_weight;
+    bins[high_bin] += high_weight;
+}
+
+void accumulateExposureHistogram(const float *hdr, uint32_t num_pixels,
+                                 float *bins)
+{
+    // Weights are normalized at the end rather than per pixel, so large
+    // images don't lose small contributions to rounding
+    float counts[Exp::numBins] {};
+
+    uint32_t idx = 0;
+
+#ifdef RLPBR_TONEMAP_SSE
+    // Luminance of 4 pixels at a time: the RGBA pixels transpose into one
+    // register per channel. The log2 and scatter stay scalar.
+    const __m128 r_weight = _mm_set1_ps(0.2126f);
+    const __m128 g_weight = _mm_set1_ps(0.7152f);
+    const __m128 b_weight = _mm_set1_ps(0.0722f);
+
+    for (; idx + 4 <= num_pixels; idx += 4) {
+        const float *src = hdr + 4 * idx;
+        __m128 r = _mm_loadu_ps(src);
+        __m128 g = _mm_loadu_ps(src + 4);
+        __m128 b = _mm_loadu_ps(src + 8);
+        __m128 id = _mm_loadu_ps(src + 12);
+        _MM_TRANSPOSE4_PS(r, g, b, id);
+
+        __m128 lum = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, r_weight),
+                                           _mm_mul_ps(g, g_weight)),
+                                _mm_mul_ps(b, b_weight));
+
+        alignas(16) float lums[4];
+        _mm_store_ps(lums, lum);
+
+        for (float l : lums) {
+            addToHistogram(l, counts);
+        }
+    }
+#endif
+
+    for (; idx < num_pixels; idx++) {
+        const float *src = hdr + 4 * idx;
+        addToHistogram(rgbToLuminance(glm::vec3(src[0], src[1], src[2])),
+                       counts);
+    }
+
+    const float normalize_factor = 1.f / float(num_pixels);
+    for (uint32_t i = 0; i < Exp::numBins; i++) {
+        bins[i] += counts[i] * normalize_factor;
+    }
+}
+
+static float inverseBinIdx(uint32_t idx)
+{
+    float remapped = float(idx) / float(Exp::numBins - 1);
+
+    return remapped * Exp::logLuminanceRange + Exp::minLogLuminance;
+}
+
+// https://knarkowicz.wordpress.com/2016/01/09/automatic-exposure/
+float exposureFromHistogram(const float *bins)
+{
+    const float cutoff_threshold = 1.f - Exp::highDropThreshold;
+
+    // prior_count is the exclusive prefix sum of the unfiltered bins, as
+    // in the shader's subgroup scan
+    float prior_count = 0.f;
+    float filtered_log_lum = 0.f;
+    for (uint32_t i = 0; i < Exp::numBins; i++) {
+        float bin_count = bins[i];
+
+        float filtered_count = max(
+            min(bin_count, cutoff_threshold - prior_count), 0.f);
+
+        float low_drop_amount =
+            max(Exp::lowDropThreshold - prior_count, 0.f);
+
+        filtered_count = max(filtered_count - low_drop_amount, 0.f);
+
+        prior_count += bin_count;
+
+        filtered_log_lum += inverseBinIdx(i) * filtered_count;
+    }
+
+    const float filtered_total =
+        1.f - Exp::highDropThreshold - Exp::lowDropThreshold;
+
+    float log_avg = filtered_log_lum / filtered_total;
+    log_avg = clamp(log_avg, Exp::minLogLuminance, Exp::maxLogLuminance);
+
+    return Exp::middleGray / exp2f(log_avg);
+}
+
+// Applies exponential ("Photographic") luma compression
+static float rangeCompress(float val, float threshold)
+{
+    float compressed = threshold + (1.f - threshold) *
+        (1.f - expf(-(val - threshold) / (1.f - threshold)));
+    return val < threshold ? val : compressed;
+}
+
+static glm::vec3 rangeCompress(const glm::vec3 &val, float threshold)
+{
+    return glm::vec3(
+        rangeCompress(val.x, threshold),
+        rangeCompress(val.y, threshold),
+        rangeCompress(val.z, threshold));
+}
+
+// RGB with sRGB/Rec.709 primaries to CIE XYZ
+static glm::vec3 RGBToXYZ(const glm::vec3 &c)
+{
+    const glm::mat3 mat(
+        glm::vec3(0.4124564f, 0.2126729f, 0.0193339f),
+        glm::vec3(0.3575761f, 0.7151522f, 0.1191920f),
+        glm::vec3(0.1804375f, 0.0721750f, 0.9503041f));
+
+    return mat * c;
+}
+
+static glm::vec3 XYZToRGB(const glm::vec3 &c)
+{
+    const glm::mat3 mat(
+        glm::vec3(3.24045483602140870f, -0.96926638987565370f,
+                  0.05564341960421366f),
+        glm::vec3(-1.53713885010257510f, 1.87601092884249100f,
+                  -0.20402585426769815f),
+        glm::vec3(-0.49853154686848090f, 0.04155608234667354f,
+                  1.05722516245792870f));
+
+    return mat * c;
+}
+
+// LMS cone responses as in the ICtCp specification
+static glm::vec3 XYZToLMS(const glm::vec3 &c)
+{
+    const glm::mat3 mat(
+        glm::vec3(0.3592f, -0.1922f, 0.0070f),
+        glm::vec3(0.6976f, 1.1004f, 0.0749f),
+        glm::vec3(-0.0358f, 0.0755f, 0.8434f));
+
+    return mat * c;
+}
+
+static glm::vec3 LMSToXYZ(const glm::vec3 &c)
+{
+    const glm::mat3 mat(
+        glm::vec3(2.07018005669561320f, 0.36498825003265756f,
+                  -0.04959554223893212f),
+        glm::vec3(-1.32645687610302100f, 0.68046736285223520f,
+                  -0.04942116118675749f),
+        glm::vec3(0.206616006847855170f, -0.045421753075853236f,
+                  1.187995941732803400f));
+
+    return mat * c;
+}
+
+static constexpr float PQ_constant_N = (2610.f / 4096.f / 4.f);
+static constexpr float PQ_constant_M = (2523.f / 4096.f * 128.f);
+static constexpr float PQ_constant_C1 = (3424.f / 4096.f);
+static constexpr float PQ_constant_C2 = (2413.f / 4096.f * 32.f);
+static constexpr float PQ_constant_C3 = (2392.f / 4096.f * 32.f);
+
+// PQ (Perceptual Quantiser; ST.2084) encode / decode
+static glm::vec3 linearToPQ(glm::vec3 linear_col, float max_pq_value)
+{
+    linear_col /= max_pq_value;
+
+    glm::vec3 col_to_pow = glm::pow(linear_col, glm::vec3(PQ_constant_N));
+    glm::vec3 numerator = PQ_constant_C1 + PQ_constant_C2 * col_to_pow;
+    glm::vec3 denominator = glm::vec3(1.f) + PQ_constant_C3 * col_to_pow;
+    return glm::pow(numerator / denominator, glm::vec3(PQ_constant_M));
+}
+
+static glm::vec3 PQToLinear(const glm::vec3 &pq_col, float max_pq_value)
+{
+    glm::vec3 col_to_pow = glm::pow(pq_col, glm::vec3(1.f / PQ_constant_M));
+    glm::vec3 numerator = glm::max(col_to_pow - PQ_constant_C1,
+                                   glm::vec3(0.f));
+    glm::vec3 denominator = PQ_constant_C2 - (PQ_constant_C3 * col_to_pow);
+    glm::vec3 linear_col = glm::pow(numerator / denominator,
+                                    glm::vec3(1.f / PQ_constant_N));
+
+    return linear_col * max_pq_value;
+}
+
+// RGB with sRGB/Rec.709 primaries to ICtCp. 1.0 = 100 nits for the PQ
+// curve.
+static glm::vec3 RGBToICtCp(const glm::vec3 &rgb)
+{
+    glm::vec3 col = XYZToLMS(RGBToXYZ(rgb));
+    col = linearToPQ(glm::max(glm::vec3(0.f), col), 100.f);
+
+    const glm::mat3 mat(
+        glm::vec3(0.5000f, 1.6137f, 4.3780f),
+        glm::vec3(0.5000f, -3.3234f, -4.2455f),
+        glm::vec3(0.0000f, 1.7097f, -0.1325f));
+
+    return mat * col;
+}
+
+static glm::vec3 ICtCpToRGB(const glm::vec3 &ictcp)
+{
+    const glm::mat3 mat(
+        glm::vec3(1.f, 1.f, 1.f),
+        glm::vec3(0.00860514569398152f, -0.00860514569398152f,
+                  0.56004885956263900f),
+        glm::vec3(0.11103560447547328f, -0.11103560447547328f,
+                  -0.32063747023212210f));
+
+    glm::vec3 col = PQToLinear(mat * ictcp, 100.f);
+    return XYZToRGB(LMSToXYZ(col));
+}
+
+// See tonemap.comp for the reasoning behind each step
+static glm::vec3 applyHuePreservingShoulder(glm::vec3 col)
+{
+    glm::vec3 ictcp = RGBToICtCp(col);
+
+    // Luminance adaptive desaturation before compression
+    float saturation_amount =
+        powf(glm::smoothstep(1.f, 0.3f, ictcp.x), 1.3f);
+    col = ICtCpToRGB(
+        ictcp * glm::vec3(1.f, saturation_amount, saturation_amount));
+
+    // Inputs below this are passed through unmodified
+    const float linear_segment_end = 0.25f;
+
+    float max_col = max(col.x, max(col.y, col.z));
+    float mapped_max = rangeCompress(max_col, linear_segment_end);
+    glm::vec3 compressed_hue_preserving = col * mapped_max / max_col;
+
+    glm::vec3 per_channel_compressed = rangeCompress(col, linear_segment_end);
+
+    col = glm::mix(per_channel_compressed, compressed_hue_preserving, 0.6f);
+
+    glm::vec3 ictcp_mapped = RGBToICtCp(col);
+
+    // Re-introduce some of the pre-compression saturation
+    float post_compression_saturation_boost =
+        0.3f * glm::smoothstep(1.f, 0.5f, ictcp.x);
+
+    glm::vec2 orig_chroma(ictcp_mapped.y, ictcp_mapped.z);
+    glm::vec2 chroma_shift = glm::mix(orig_chroma,
+        orig_chroma * ictcp_mapped.x / max(1e-3f, ictcp.x),
+        post_compression_saturation_boost);
+
+    ictcp_mapped.y = chroma_shift.x;
+    ictcp_mapped.z = chroma_shift.y;
+
+    return ICtCpToRGB(ictcp_mapped);
+}
+
+glm::vec3 eaTonemap(const glm::vec3 &v)
+{
+    return glm::clamp(applyHuePreservingShoulder(v), 0.f, 1.f);
+}
+
+glm::vec3 uc2Tonemap(const glm::vec3 &v)
+{
+    const float A = 0.15f;
+    const float B = 0.50f;
+    const float C = 0.10f;
+    const float D = 0.20f;
+    const float E = 0.02f;
+    const float F = 0.30f;
+    const float W = 1.2f;
+
+    glm::vec3 tonemapped = ((v * (A * v + C * B) + D * E) /
+                            (v * (A * v + B) + D * F)) - E / F;
+
+    const float tonemap_W = ((W * (A * W + C * B) + D * E) /
+                             (W * (A * W + B) + D * F)) - E / F;
+
+    tonemapped *= 1.f / tonemap_W;
+
+    return glm::clamp(tonemapped, 0.f, 1.f);
+}
+
+// Modified from
+// https://github.com/TheRealMJP/BakingLab/blob/master/BakingLab/ACES.hlsl
+// MIT License: Stephen Hill
+static glm::vec3 RRTAndODTFit(const glm::vec3 &v)
+{
+    glm::vec3 a = v * (v + 0.0245786f) - 0.000090537f;
+    glm::vec3 b = v * (0.983729f * v + 0.4329510f) + 0.238081f;
+    return a / b;
+}
+
+glm::vec3 acesFittedTonemap(const glm::vec3 &v)
+{
+    const glm::mat3 input_mat(
+        glm::vec3(0.59719f, 0.07600f, 0.02840f),
+        glm::vec3(0.35458f, 0.90834f, 0.13383f),
+        glm::vec3(0.04823f, 0.01566f, 0.83777f));
+
+    const glm::mat3 output_mat(
+        glm::vec3(1.60475f, -0.10208f, -0.00327f),
+        glm::vec3(-0.53108f, 1.10813f, -0.07276f),
+        glm::vec3(-0.07367f, -0.00605f, 1.07602f));
+
+    glm::vec3 fitted = output_mat * RRTAndODTFit(input_mat * v);
+
+    return glm::clamp(fitted, 0.f, 1.f);
+}
+
+glm::vec3 reinhardTonemap(const glm::vec3 &v)
+{
+    float l = rgbToLuminance(v);
+
+    const float white = 5.f;
+
+    float t = l * (1.f + (l / (white * white))) / (1.f + l);
+
+    return glm::clamp(v * t / l, 0.f, 1.f);
+}
+
+// GDC 2016: Advanced Techniques and Optimization of VDR Color Pipelines
+glm::vec3 lottesTonemap(const glm::vec3 &v)
+{
+    const float contrast = 0.31f;
+    const float shoulder = -6.6f;
+    const float mid_in = 0.18f;
+    const float mid_out = 0.1f;
+    const float hdr_max = 1.2f;
+
+    const float b =
+        (-powf(mid_in, contrast) + powf(hdr_max, contrast) * mid_out) /
+        ((powf(hdr_max, contrast * shoulder) -
+            powf(mid_in, contrast * shoulder)) * mid_out);
+
+    const float c =
+        (powf(hdr_max, contrast * shoulder) * powf(mid_in, contrast) -
+            powf(hdr_max, contrast) *
+                powf(mid_in, contrast * shoulder) * mid_out) /
+        ((powf(hdr_max, contrast * shoulder) -
+            powf(mid_in, contrast * shoulder)) * mid_out);
+
+    float peak = max(max(v.x, v.y), v.z);
+
+    glm::vec3 ratio = v / peak;
+
+    float z = powf(peak, contrast);
+
+    float y = z / (powf(z, shoulder) * b + c);
+
+    return glm::clamp(y * ratio, 0.f, 1.f);
+}
+
+glm::vec3 reinhardChannelTonemap(const glm::vec3 &v, float white_sq)
+{
+    return v * (1.f + (v / white_sq)) / (1.f + v);
+}
+
+float linearToSRGB(float v)
+{
+    if (v <= 0.0031308f) {
+        return 12.92f * v;
+    } else {
+        return 1.055f * powf(v, (1.f / 2.4f)) - 0.055f;
+    }
+}
+
+void packTonemapped(const glm::vec3 &rgb, uint32_t instance_id,
+                    uint32_t *out)
+{
+    glm::vec3 clamped = glm::min(rgb, glm::vec3(65504.f));
+
+    uint32_t ab = glm::packHalf2x16(glm::vec2(clamped.x, clamped.y));
+    uint32_t cd = glm::packHalf2x16(glm::vec2(clamped.z, 0.f));
+    cd |= instance_id << 16;
+
+    out[0] = ab;
+    out[1] = cd;
+}
+
+void tonemapPixels(const float *hdr, uint32_t num_pixels, float exposure,
+                   uint32_t *out)
+{
+    for (uint32_t idx = 0; idx < num_pixels; idx++) {
+        const float *src = hdr + 4 * idx;
+
+        uint32_t instance_id;
+        memcpy(&instance_id, src + 3, sizeof(uint32_t));
+
+        glm::vec3 exposed = glm::vec3(src[0], src[1], src[2]) * exposure;
+
+        packTonemapped(eaTonemap(exposed), instance_id, out + 2 * idx);
+    }
+}
+
+float tonemapImage(const float *hdr, uint32_t num_pixels, uint32_t *out)
+{
+    float bins[Exp::numBins] {};
+    accumulateExposureHistogram(hdr, num_pixels, bins);
+
+    float exposure = exposureFromHistogram(bins);
+    tonemapPixels(hdr, num_pixels, exposure, out);
+
+    return exposure;
+}
+
+}
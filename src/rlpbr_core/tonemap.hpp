@@ -0,0 +1,75 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+
+namespace RLpbr {
+
+// Auto exposure parameters, also passed to exposure_histogram.comp as
+// defines. 64 stops of log luminance, split into numBins bins.
+struct ExposureConstants {
+    static constexpr float minLogLuminance = -30.f;
+    static constexpr float maxLogLuminance = 34.f;
+    static constexpr float logLuminanceRange =
+        maxLogLuminance - minLogLuminance;
+    static constexpr float invLogLuminanceRange = 1.f / logLuminanceRange;
+    // exp2(minLogLuminance)
+    static constexpr float minLuminance = 1.f / float(1u << 30);
+    static constexpr uint32_t numBins = 128;
+    static constexpr float bias = 0.f;
+
+    // Fractions of the histogram dropped at each end before averaging
+    static constexpr float lowDropThreshold = 0.4f;
+    static constexpr float highDropThreshold = 0.05f;
+    static constexpr float middleGray = 0.18f;
+};
+
+// Host implementation of exposure_histogram.comp and tonemap.comp, used as
+// the CPU backend's post-process and as a reference for GPU outputs.
+// HDR images hold 4 floats per pixel: RGB followed by the instance ID's
+// bits, as written by the path tracer. Tonemapped images hold 2 uint32s
+// per pixel: packHalf2x16(r, g) and half(b) | instance ID << 16, so
+// 4 halves with the ID last, like the untonemapped outputs.
+
+float rgbToLuminance(const glm::vec3 &rgb);
+
+// Fractional bin of luminance, bin i is centered on log luminance
+// minLogLuminance + i / (numBins - 1) * logLuminanceRange
+float exposureBin(float luminance);
+
+// Adds each pixel's luminance to bins (numBins floats), split between the
+// two nearest bins. Each image contributes a total of 1, so bins should be
+// zeroed per image.
+void accumulateExposureHistogram(const float *hdr, uint32_t num_pixels,
+                                 float *bins);
+
+// Average log luminance of the histogram after dropping the darkest
+// lowDropThreshold and brightest highDropThreshold, mapped to a scale
+// that brings it to middleGray
+float exposureFromHistogram(const float *bins);
+
+// Operators on exposed linear RGB, returning [0, 1]. tonemap.comp uses
+// eaTonemap, the others are kept for comparison.
+glm::vec3 eaTonemap(const glm::vec3 &v);
+glm::vec3 uc2Tonemap(const glm::vec3 &v);
+glm::vec3 acesFittedTonemap(const glm::vec3 &v);
+glm::vec3 reinhardTonemap(const glm::vec3 &v);
+glm::vec3 lottesTonemap(const glm::vec3 &v);
+
+// Per channel extended Reinhard, v * (1 + v / white_sq) / (1 + v)
+glm::vec3 reinhardChannelTonemap(const glm::vec3 &v, float white_sq);
+
+// sRGB transfer function, not clamped
+float linearToSRGB(float v);
+
+void packTonemapped(const glm::vec3 &rgb, uint32_t instance_id,
+                    uint32_t *out);
+
+void tonemapPixels(const float *hdr, uint32_t num_pixels, float exposure,
+                   uint32_t *out);
+
+// Histogram, exposure and tonemap of one image. Returns the exposure.
+float tonemapImage(const float *hdr, uint32_t num_pixels, uint32_t *out);
+
+}
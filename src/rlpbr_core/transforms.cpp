@@ -0,0 +1,823 @@
+#include "transforms.hpp"
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define RLPBR_TRANSFORMS_SSE
+#endif
+
+using namespace std;
+
+namespace RLpbr {
+
+// The SIMD path writes each InstanceTransform as 6 float4 rows
+static_assert(sizeof(InstanceTransform) == sizeof(float) * 24);
+
+void computeRigidTransform(const glm::vec3 &t,
+                           const glm::quat &q,
+                           InstanceTransform &out)
+{
+    float xx = q.x * q.x, yy = q.y * q.y, zz = q.z * q.z;
+    float xy = q.x * q.y, xz = q.x * q.z, yz = q.y * q.z;
+    float wx = q.w * q.x, wy = q.w * q.y, wz = q.w * q.z;
+
+    // Same layout as glm::mat3_cast, r[col][row]
+    float r[3][3] = {
+        { 1.f - 2.f * (yy + zz), 2.f * (xy + wz), 2.f * (xz - wy) },
+        { 2.f * (xy - wz), 1.f - 2.f * (xx + zz), 2.f * (yz + wx) },
+        { 2.f * (xz + wy), 2.f * (yz - wx), 1.f - 2.f * (xx + yy) },
+    };
+
+    for (int col = 0; col < 3; col++) {
+        for (int row = 0; row < 3; row++) {
+            out.mat[col][row] = r[col][row];
+            out.inv[row][col] = r[col][row];
+        }
+
+        out.mat[3][col] = t[col];
+        out.inv[3][col] =
+            -(r[col][0] * t.x + r[col][1] * t.y + r[col][2] * t.z);
+    }
+}
+
+#ifdef RLPBR_TRANSFORMS_SSE
+
+// 4 instances per iteration. Inputs are gathered into one register per
+// component, the 24 output floats are computed lane wise and then
+// transposed back into 6 float4 stores per instance.
+static void computeRigidTransforms4(const glm::vec3 *t,
+                                    const glm::quat *q,
+                                    InstanceTransform * const *dsts)
+{
+    __m128 qx = _mm_setr_ps(q[0].x, q[1].x, q[2].x, q[3].x);
+    __m128 qy = _mm_setr_ps(q[0].y, q[1].y, q[2].y, q[3].y);
+    __m128 qz = _mm_setr_ps(q[0].z, q[1].z, q[2].z, q[3].z);
+    __m128 qw = _mm_setr_ps(q[0].w, q[1].w, q[2].w, q[3].w);
+
+    __m128 tx = _mm_setr_ps(t[0].x, t[1].x, t[2].x, t[3].x);
+    __m128 ty = _mm_setr_ps(t[0].y, t[1].y, t[2].y, t[3].y);
+    __m128 tz = _mm_setr_ps(t[0].z, t[1].z, t[2].z, t[3].z);
+
+    const __m128 one = _mm_set1_ps(1.f);
+    const __m128 two = _mm_set1_ps(2.f);
+
+    __m128 xx = _mm_mul_ps(qx, qx);
+    __m128 yy = _mm_mul_ps(qy, qy);
+    __m128 zz = _mm_mul_ps(qz, qz);
+    __m128 xy = _mm_mul_ps(qx, qy);
+    __m128 xz = _mm_mul_ps(qx, qz);
+    __m128 yz = _mm_mul_ps(qy, qz);
+    __m128 wx = _mm_mul_ps(qw, qx);
+    __m128 wy = _mm_mul_ps(qw, qy);
+    __m128 wz = _mm_mul_ps(qw, qz);
+
+    // r[col][row]
+    __m128 r00 = _mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(yy, zz)));
+    __m128 r01 = _mm_mul_ps(two, _mm_add_ps(xy, wz));
+    __m128 r02 = _mm_mul_ps(two, _mm_sub_ps(xz, wy));
+    __m128 r10 = _mm_mul_ps(two, _mm_sub_ps(xy, wz));
+    __m128 r11 = _mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, zz)));
+    __m128 r12 = _mm_mul_ps(two, _mm_add_ps(yz, wx));
+    __m128 r20 = _mm_mul_ps(two, _mm_add_ps(xz, wy));
+    __m128 r21 = _mm_mul_ps(two, _mm_sub_ps(yz, wx));
+    __m128 r22 = _mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, yy)));
+
+    auto negDot = [&](__m128 a, __m128 b, __m128 c) {
+        __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a, tx),
+                                         _mm_mul_ps(b, ty)),
+                              _mm_mul_ps(c, tz));
+        return _mm_sub_ps(_mm_setzero_ps(), d);
+    };
+
+    __m128 it0 = negDot(r00, r01, r02);
+    __m128 it1 = negDot(r10, r11, r12);
+    __m128 it2 = negDot(r20, r21, r22);
+
+    // Output float order: mat columns then inv columns (inv = R^T)
+    __m128 rows[6][4] = {
+        { r00, r01, r02, r10 },
+        { r11, r12, r20, r21 },
+        { r22, tx, ty, tz },
+        { r00, r10, r20, r01 },
+        { r11, r21, r02, r12 },
+        { r22, it0, it1, it2 },
+    };
+
+    for (auto &row : rows) {
+        _MM_TRANSPOSE4_PS(row[0], row[1], row[2], row[3]);
+    }
+
+    for (int lane = 0; lane < 4; lane++) {
+        float *dst = reinterpret_cast<float *>(dsts[lane]);
+        for (int i = 0; i < 6; i++) {
+            _mm_storeu_ps(dst + 4 * i, rows[i][lane]);
+        }
+    }
+}
+
+#endif
+
+void computeRigidTransforms(const glm::vec3 *positions,
+                            const glm::quat *rotations,
+                            InstanceTransform * const *dsts,
+                            uint32_t num_transforms)
+{
+    uint32_t idx = 0;
+
+#ifdef RLPBR_TRANSFORMS_SSE
+    for (; idx + 4 <= num_transforms; idx += 4) {
+        computeRigidTransforms4(positions + idx, rotations + idx,
+                                dsts + idx);
+    }
+#endif
+
+    for (; idx < num_transforms; idx++) {
+        computeRigidTransform(positions[idx], rotations[idx], *dsts[idx]);
+    }
+}
+
+static_assert(sizeof(CompactTransform) == 32);
+
+static constexpr float compactRotationScale = 32767.f;
+
+static void expandTransform(const CompactTransform &src,
+                            InstanceTransform &out)
+{
+    float qx = src.rotation[0], qy = src.rotation[1];
+    float qz = src.rotation[2], qw = src.rotation[3];
+
+    // 2 / |q|^2 normalizes the stored quaternion
+    float n = 2.f / (qx * qx + qy * qy + qz * qz + qw * qw);
+
+    float xx = qx * qx, yy = qy * qy, zz = qz * qz;
+    float xy = qx * qy, xz = qx * qz, yz = qy * qz;
+    float wx = qw * qx, wy = qw * qy, wz = qw * qz;
+
+    // r[col][row]
+    float r[3][3] = {
+        { 1.f - n * (yy + zz), n * (xy + wz), n * (xz - wy) },
+        { n * (xy - wz), 1.f - n * (xx + zz), n * (yz + wx) },
+        { n * (xz + wy), n * (yz - wx), 1.f - n * (xx + yy) },
+    };
+
+    const glm::vec3 &t = src.position;
+    const glm::vec3 &s = src.scale;
+
+    // mat = T * R * S, inv = S^-1 * R^T * T^-1
+    for (int col = 0; col < 3; col++) {
+        float inv_s = 1.f / s[col];
+        for (int row = 0; row < 3; row++) {
+            out.mat[col][row] = r[col][row] * s[col];
+            out.inv[row][col] = r[col][row] * inv_s;
+        }
+
+        out.mat[3][col] = t[col];
+        out.inv[3][col] =
+            -(r[col][0] * t.x + r[col][1] * t.y + r[col][2] * t.z) * inv_s;
+    }
+}
+
+#ifdef RLPBR_TRANSFORMS_SSE
+
+// Same as computeRigidTransforms4 with the scale applied to the
+// rotation's columns / the inverse's rows
+static void expandTransforms4(const CompactTransform *src,
+                              InstanceTransform * const *dsts)
+{
+    auto gather = [src](auto get) {
+        return _mm_setr_ps(get(src[0]), get(src[1]),
+                           get(src[2]), get(src[3]));
+    };
+
+    __m128 qx = gather([](auto &c) { return float(c.rotation[0]); });
+    __m128 qy = gather([](auto &c) { return float(c.rotation[1]); });
+    __m128 qz = gather([](auto &c) { return float(c.rotation[2]); });
+    __m128 qw = gather([](auto &c) { return float(c.rotation[3]); });
+
+    __m128 tx = gather([](auto &c) { return c.position.x; });
+    __m128 ty = gather([](auto &c) { return c.position.y; });
+    __m128 tz = gather([](auto &c) { return c.position.z; });
+
+    __m128 sx = gather([](auto &c) { return c.scale.x; });
+    __m128 sy = gather([](auto &c) { return c.scale.y; });
+    __m128 sz = gather([](auto &c) { return c.scale.z; });
+
+    const __m128 one = _mm_set1_ps(1.f);
+
+    __m128 xx = _mm_mul_ps(qx, qx);
+    __m128 yy = _mm_mul_ps(qy, qy);
+    __m128 zz = _mm_mul_ps(qz, qz);
+    __m128 ww = _mm_mul_ps(qw, qw);
+    __m128 xy = _mm_mul_ps(qx, qy);
+    __m128 xz = _mm_mul_ps(qx, qz);
+    __m128 yz = _mm_mul_ps(qy, qz);
+    __m128 wx = _mm_mul_ps(qw, qx);
+    __m128 wy = _mm_mul_ps(qw, qy);
+    __m128 wz = _mm_mul_ps(qw, qz);
+
+    __m128 n = _mm_div_ps(_mm_set1_ps(2.f),
+        _mm_add_ps(_mm_add_ps(xx, yy), _mm_add_ps(zz, ww)));
+
+    // r[col][row]
+    __m128 r00 = _mm_sub_ps(one, _mm_mul_ps(n, _mm_add_ps(yy, zz)));
+    __m128 r01 = _mm_mul_ps(n, _mm_add_ps(xy, wz));
+    __m128 r02 = _mm_mul_ps(n, _mm_sub_ps(xz, wy));
+    __m128 r10 = _mm_mul_ps(n, _mm_sub_ps(xy, wz));
+    __m128 r11 = _mm_sub_ps(one, _mm_mul_ps(n, _mm_add_ps(xx, zz)));
+    __m128 r12 = _mm_mul_ps(n, _mm_add_ps(yz, wx));
+    __m128 r20 = _mm_mul_ps(n, _mm_add_ps(xz, wy));
+    __m128 r21 = _mm_mul_ps(n, _mm_sub_ps(yz, wx));
+    __m128 r22 = _mm_sub_ps(one, _mm_mul_ps(n, _mm_add_ps(xx, yy)));
+
+    __m128 isx = _mm_div_ps(one, sx);
+    __m128 isy = _mm_div_ps(one, sy);
+    __m128 isz = _mm_div_ps(one, sz);
+
+    auto negDot = [&](__m128 a, __m128 b, __m128 c, __m128 inv_s) {
+        __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a, tx),
+                                         _mm_mul_ps(b, ty)),
+                              _mm_mul_ps(c, tz));
+        return _mm_sub_ps(_mm_setzero_ps(), _mm_mul_ps(d, inv_s));
+    };
+
+    __m128 it0 = negDot(r00, r01, r02, isx);
+    __m128 it1 = negDot(r10, r11, r12, isy);
+    __m128 it2 = negDot(r20, r21, r22, isz);
+
+    __m128 m00 = _mm_mul_ps(r00, sx), m01 = _mm_mul_ps(r01, sx);
+    __m128 m02 = _mm_mul_ps(r02, sx), m10 = _mm_mul_ps(r10, sy);
+    __m128 m11 = _mm_mul_ps(r11, sy), m12 = _mm_mul_ps(r12, sy);
+    __m128 m20 = _mm_mul_ps(r20, sz), m21 = _mm_mul_ps(r21, sz);
+    __m128 m22 = _mm_mul_ps(r22, sz);
+
+    __m128 i00 = _mm_mul_ps(r00, isx), i01 = _mm_mul_ps(r01, isx);
+    __m128 i02 = _mm_mul_ps(r02, isx), i10 = _mm_mul_ps(r10, isy);
+    __m128 i11 = _mm_mul_ps(r11, isy), i12 = _mm_mul_ps(r12, isy);
+    __m128 i20 = _mm_mul_ps(r20, isz), i21 = _mm_mul_ps(r21, isz);
+    __m128 i22 = _mm_mul_ps(r22, isz);
+
+    // Output float order: mat columns then inv columns (inv = S^-1 R^T)
+    __m128 rows[6][4] = {
+        { m00, m01, m02, m10 },
+        { m11, m12, m20, m21 },
+        { m22, tx, ty, tz },
+        { i00, i10, i20, i01 },
+        { i11, i21, i02, i12 },
+        { i22, it0, it1, it2 },
+    };
+
+    for (auto &row : rows) {
+        _MM_TRANSPOSE4_PS(row[0], row[1], row[2], row[3]);
+    }
+
+    for (int lane = 0; lane < 4; lane++) {
+        float *dst = reinterpret_cast<float *>(dsts[lane]);
+        for (int i = 0; i < 6; i++) {
+            _mm_storeu_ps(dst + 4 * i, rows[i][lane]);
+        }
+    }
+}
+
+#endif
+
+void expandTransforms(const CompactTransform *srcs,
+                      InstanceTransform * const *dsts,
+                      uint32_t num_transforms)
+{
+    uint32_t idx = 0;
+
+#ifdef RLPBR_TRANSFORMS_SSE
+    for (; idx + 4 <= num_transforms; idx += 4) {
+        expandTransforms4(srcs + idx, dsts + idx);
+    }
+#endif
+
+    for (; idx < num_transforms; idx++) {
+        expandTransform(srcs[idx], *dsts[idx]);
+    }
+}
+
+static void packTransform(const InstanceTransform &src,
+                          CompactTransform &out)
+{
+    glm::vec3 axes[3];
+    for (int i = 0; i < 3; i++) {
+        axes[i] = src.mat[i];
+        out.scale[i] = glm::length(axes[i]);
+        axes[i] /= out.scale[i];
+    }
+
+    // Mirroring, flip the x axis to get a rotation
+    if (glm::dot(glm::cross(axes[0], axes[1]), axes[2]) < 0.f) {
+        axes[0] = -axes[0];
+        out.scale.x = -out.scale.x;
+    }
+
+    // m(row, col) = axes[col][row], branch on the largest diagonal term
+    // for precision
+    auto m = [&axes](int row, int col) { return axes[col][row]; };
+
+    float q[4];
+    float trace = m(0, 0) + m(1, 1) + m(2, 2);
+    if (trace > 0.f) {
+        float s = 2.f * sqrtf(trace + 1.f);
+        q[0] = (m(2, 1) - m(1, 2)) / s;
+        q[1] = (m(0, 2) - m(2, 0)) / s;
+        q[2] = (m(1, 0) - m(0, 1)) / s;
+        q[3] = 0.25f * s;
+    } else if (m(0, 0) > m(1, 1) && m(0, 0) > m(2, 2)) {
+        float s = 2.f * sqrtf(1.f + m(0, 0) - m(1, 1) - m(2, 2));
+        q[0] = 0.25f * s;
+        q[1] = (m(0, 1) + m(1, 0)) / s;
+        q[2] = (m(0, 2) + m(2, 0)) / s;
+        q[3] = (m(2, 1) - m(1, 2)) / s;
+    } else if (m(1, 1) > m(2, 2)) {
+        float s = 2.f * sqrtf(1.f + m(1, 1) - m(0, 0) - m(2, 2));
+        q[0] = (m(0, 1) + m(1, 0)) / s;
+        q[1] = 0.25f * s;
+        q[2] = (m(1, 2) + m(2, 1)) / s;
+        q[3] = (m(0, 2) - m(2, 0)) / s;
+    } else {
+        float s = 2.f * sqrtf(1.f + m(2, 2) - m(0, 0) - m(1, 1));
+        q[0] = (m(0, 2) + m(2, 0)) / s;
+        q[1] = (m(1, 2) + m(2, 1)) / s;
+        q[2] = 0.25f * s;
+        q[3] = (m(1, 0) - m(0, 1)) / s;
+    }
+
+    // Scaling by the largest component instead of the length makes
+    // quantization stable: the expanded rotation quantizes back to the
+    // same integers. q and -q are the same rotation, the first nonzero
+    // component is kept positive.
+    float max_comp = max(max(fabsf(q[0]), fabsf(q[1])),
+                         max(fabsf(q[2]), fabsf(q[3])));
+    float quant_scale = compactRotationScale / max_comp;
+
+    int16_t sign = 0;
+    for (int i = 0; i < 4; i++) {
+        int16_t v = int16_t(lrintf(q[i] * quant_scale));
+        if (sign == 0 && v != 0) {
+            sign = v < 0 ? -1 : 1;
+        }
+        out.rotation[i] = v;
+    }
+
+    for (int i = 0; i < 4; i++) {
+        out.rotation[i] *= sign;
+    }
+
+    out.position = src.mat[3];
+}
+
+void packTransforms(const InstanceTransform *srcs,
+                    CompactTransform *dsts,
+                    uint32_t num_transforms)
+{
+    for (uint32_t idx = 0; idx < num_transforms; idx++) {
+        packTransform(srcs[idx], dsts[idx]);
+    }
+}
+
+// Lane wise arithmetic for the scalar and SIMD instantiations below
+static inline float mul(float a, float b) { return a * b; }
+static inline float add(float a, float b) { return a + b; }
+static inline float madd(float a, float b, float c) { return a * b + c; }
+
+#ifdef RLPBR_TRANSFORMS_SSE
+static inline __m128 mul(__m128 a, __m128 b) { return _mm_mul_ps(a, b); }
+static inline __m128 add(__m128 a, __m128 b) { return _mm_add_ps(a, b); }
+static inline __m128 madd(__m128 a, __m128 b, __m128 c)
+{
+    return _mm_add_ps(_mm_mul_ps(a, b), c);
+}
+#endif
+
+// Affine 4x3 matrices as 12 column major components, out = a * b
+template <typename T>
+static inline void affineMul(const T *a, const T *b, T *out)
+{
+    for (int col = 0; col < 4; col++) {
+        for (int row = 0; row < 3; row++) {
+            T v = madd(a[row], b[col * 3],
+                       madd(a[3 + row], b[col * 3 + 1],
+                            mul(a[6 + row], b[col * 3 + 2])));
+            if (col == 3) {
+                v = add(v, a[9 + row]);
+            }
+            out[col * 3 + row] = v;
+        }
+    }
+}
+
+// a and b hold 24 components each: mat followed by inv. With
+// invert_parent, a is used as { a.inv, a.mat }.
+template <bool invert_parent, typename T>
+static inline void composeComponents(const T *a, const T *b, T *out)
+{
+    const T *a_mat = invert_parent ? a + 12 : a;
+    const T *a_inv = invert_parent ? a : a + 12;
+
+    affineMul(a_mat, b, out);
+    affineMul(b + 12, a_inv, out + 12);
+}
+
+template <bool invert_parent>
+static void composeTransform(const InstanceTransform &parent,
+                             const InstanceTransform &child,
+                             InstanceTransform &out)
+{
+    float a[24], b[24], result[24];
+    memcpy(a, &parent, sizeof(a));
+    memcpy(b, &child, sizeof(b));
+
+    composeComponents<invert_parent>(a, b, result);
+
+    memcpy(&out, result, sizeof(result));
+}
+
+#ifdef RLPBR_TRANSFORMS_SSE
+
+// Inverse of the transposed stores in computeRigidTransforms4:
+// comps[i] holds component i of all 4 transforms
+static inline void loadTransforms4(const InstanceTransform * const *srcs,
+                                   __m128 *comps)
+{
+    for (int i = 0; i < 6; i++) {
+        __m128 rows[4];
+        for (int lane = 0; lane < 4; lane++) {
+            rows[lane] = _mm_loadu_ps(
+                reinterpret_cast<const float *>(srcs[lane]) + 4 * i);
+        }
+
+        _MM_TRANSPOSE4_PS(rows[0], rows[1], rows[2], rows[3]);
+
+        for (int j = 0; j < 4; j++) {
+            comps[4 * i + j] = rows[j];
+        }
+    }
+}
+
+static inline void storeTransforms4(__m128 *comps,
+                                    InstanceTransform * const *dsts)
+{
+    for (int i = 0; i < 6; i++) {
+        __m128 *rows = comps + 4 * i;
+        _MM_TRANSPOSE4_PS(rows[0], rows[1], rows[2], rows[3]);
+
+        for (int lane = 0; lane < 4; lane++) {
+            _mm_storeu_ps(reinterpret_cast<float *>(dsts[lane]) + 4 * i,
+                          rows[lane]);
+        }
+    }
+}
+
+template <bool invert_parent>
+static void composeTransforms4(const InstanceTransform * const *parents,
+                               const InstanceTransform * const *children,
+                               InstanceTransform * const *dsts)
+{
+    __m128 a[24], b[24], result[24];
+    loadTransforms4(parents, a);
+    loadTransforms4(children, b);
+
+    composeComponents<invert_parent>(a, b, result);
+
+    storeTransforms4(result, dsts);
+}
+
+#endif
+
+template <bool invert_parent>
+static void composeTransformsImpl(const InstanceTransform * const *parents,
+                                  const InstanceTransform * const *children,
+                                  InstanceTransform * const *dsts,
+                                  uint32_t num_transforms)
+{
+    uint32_t idx = 0;
+
+#ifdef RLPBR_TRANSFORMS_SSE
+    for (; idx + 4 <= num_transforms; idx += 4) {
+        composeTransforms4<invert_parent>(parents + idx, children + idx,
+                                          dsts + idx);
+    }
+#endif
+
+    for (; idx < num_transforms; idx++) {
+        composeTransform<invert_parent>(*parents[idx], *children[idx],
+                                        *dsts[idx]);
+    }
+}
+
+void composeTransforms(const InstanceTransform * const *parents,
+                       const InstanceTransform * const *locals,
+                       InstanceTransform * const *dsts,
+                       uint32_t num_transforms)
+{
+    composeTransformsImpl<false>(parents, locals, dsts, num_transforms);
+}
+
+void relativeTransforms(const InstanceTransform * const *parents,
+                        const InstanceTransform * const *worlds,
+                        InstanceTransform * const *dsts,
+                        uint32_t num_transforms)
+{
+    composeTransformsImpl<true>(parents, worlds, dsts, num_transforms);
+}
+
+void buildHierarchyOrder(const CowArray<uint32_t> &parents,
+                         vector<uint32_t> &order,
+                         vector<uint32_t> &level_offsets)
+{
+    uint32_t num_slots = parents.size();
+
+    // Children grouped by parent, counting sort
+    vector<uint32_t> child_offsets(num_slots + 1, 0);
+    for (uint32_t slot = 0; slot < num_slots; slot++) {
+        uint32_t parent = parents[slot];
+        if (parent != ~0u) {
+            child_offsets[parent + 1]++;
+        }
+    }
+
+    for (uint32_t slot = 0; slot < num_slots; slot++) {
+        child_offsets[slot + 1] += child_offsets[slot];
+    }
+
+    vector<uint32_t> children(child_offsets[num_slots]);
+    vector<uint32_t> cursors(child_offsets.begin(), child_offsets.end() - 1);
+    for (uint32_t slot = 0; slot < num_slots; slot++) {
+        uint32_t parent = parents[slot];
+        if (parent != ~0u) {
+            children[cursors[parent]++] = slot;
+        }
+    }
+
+    order.clear();
+    level_offsets.clear();
+
+    for (uint32_t slot = 0; slot < num_slots; slot++) {
+        if (parents[slot] == ~0u &&
+            child_offsets[slot + 1] > child_offsets[slot]) {
+            order.push_back(slot);
+        }
+    }
+
+    uint32_t level_begin = 0;
+    while (level_begin < order.size()) {
+        level_offsets.push_back(level_begin);
+
+        uint32_t level_end = order.size();
+        for (uint32_t idx = level_begin; idx < level_end; idx++) {
+            uint32_t slot = order[idx];
+            for (uint32_t i = child_offsets[slot];
+                 i < child_offsets[slot + 1]; i++) {
+                order.push_back(children[i]);
+            }
+        }
+
+        level_begin = level_end;
+    }
+
+    level_offsets.push_back(order.size());
+}
+
+static_assert(sizeof(CameraBasis) == sizeof(float) * 12);
+
+// Squared length below which a rotation or axis is degenerate
+static constexpr float minCameraAxisLength2 = 1e-12f;
+
+static inline bool isFiniteSum(float a, float b, float c)
+{
+    float sum = a + b + c;
+    return sum - sum == 0.f;
+}
+
+static bool computeCameraBasis(const glm::vec3 &t, const glm::quat &q,
+                               CameraBasis &out)
+{
+    float n2 = q.x * q.x + q.y * q.y + q.z * q.z + q.w * q.w;
+    if (!(n2 > minCameraAxisLength2 &&
+          n2 < numeric_limits<float>::infinity()) ||
+        !isFiniteSum(t.x, t.y, t.z)) {
+        return false;
+    }
+
+    // 2 / |q|^2 instead of 2 normalizes the rotation
+    float s = 2.f / n2;
+
+    float xx = q.x * q.x, yy = q.y * q.y, zz = q.z * q.z;
+    float xy = q.x * q.y, xz = q.x * q.z, yz = q.y * q.z;
+    float wx = q.w * q.x, wy = q.w * q.y, wz = q.w * q.z;
+
+    out.position = t;
+    out.right = glm::vec3(1.f - s * (yy + zz), s * (xy + wz), s * (xz - wy));
+    out.up = glm::vec3(s * (xy - wz), 1.f - s * (xx + zz), s * (yz + wx));
+    out.view = -glm::vec3(s * (xz + wy), s * (yz - wx), 1.f - s * (xx + yy));
+
+    return true;
+}
+
+static bool computeCameraBasis(const glm::mat4 &m, CameraBasis &out)
+{
+    glm::vec3 axes[3];
+    for (int i = 0; i < 3; i++) {
+        axes[i] = m[i];
+
+        float len2 = glm::dot(axes[i], axes[i]);
+        if (!(len2 > minCameraAxisLength2 &&
+              len2 < numeric_limits<float>::infinity())) {
+            return false;
+        }
+
+        axes[i] /= sqrtf(len2);
+    }
+
+    if (!isFiniteSum(m[3].x, m[3].y, m[3].z)) {
+        return false;
+    }
+
+    out.position = m[3];
+    out.right = axes[0];
+    out.up = axes[1];
+    out.view = -axes[2];
+
+    return true;
+}
+
+#ifdef RLPBR_TRANSFORMS_SSE
+
+// comps holds the 12 CameraBasis components of 4 poses, one register per
+// component. Transposed into 3 float4 stores per pose.
+static void storeCameraBases4(__m128 (&comps)[12], CameraBasis *out)
+{
+    for (int i = 0; i < 3; i++) {
+        _MM_TRANSPOSE4_PS(comps[4 * i], comps[4 * i + 1],
+                          comps[4 * i + 2], comps[4 * i + 3]);
+    }
+
+    float *dst = reinterpret_cast<float *>(out);
+    for (int lane = 0; lane < 4; lane++) {
+        for (int i = 0; i < 3; i++) {
+            _mm_storeu_ps(dst + 12 * lane + 4 * i, comps[4 * i + lane]);
+        }
+    }
+}
+
+static inline __m128 isFiniteSum4(__m128 a, __m128 b, __m128 c)
+{
+    __m128 sum = _mm_add_ps(_mm_add_ps(a, b), c);
+    return _mm_cmpeq_ps(_mm_sub_ps(sum, sum), _mm_setzero_ps());
+}
+
+static inline __m128 isValidLength4(__m128 len2)
+{
+    return _mm_and_ps(
+        _mm_cmpgt_ps(len2, _mm_set1_ps(minCameraAxisLength2)),
+        _mm_cmplt_ps(len2,
+            _mm_set1_ps(numeric_limits<float>::infinity())));
+}
+
+static inline void storeValid4(__m128 mask, uint8_t *valid)
+{
+    int bits = _mm_movemask_ps(mask);
+    for (int lane = 0; lane < 4; lane++) {
+        valid[lane] = (bits >> lane) & 1;
+    }
+}
+
+static void computeCameraBases4(const glm::vec3 *t, const glm::quat *q,
+                                CameraBasis *out, uint8_t *valid)
+{
+    __m128 qx = _mm_setr_ps(q[0].x, q[1].x, q[2].x, q[3].x);
+    __m128 qy = _mm_setr_ps(q[0].y, q[1].y, q[2].y, q[3].y);
+    __m128 qz = _mm_setr_ps(q[0].z, q[1].z, q[2].z, q[3].z);
+    __m128 qw = _mm_setr_ps(q[0].w, q[1].w, q[2].w, q[3].w);
+
+    __m128 tx = _mm_setr_ps(t[0].x, t[1].x, t[2].x, t[3].x);
+    __m128 ty = _mm_setr_ps(t[0].y, t[1].y, t[2].y, t[3].y);
+    __m128 tz = _mm_setr_ps(t[0].z, t[1].z, t[2].z, t[3].z);
+
+    __m128 xx = _mm_mul_ps(qx, qx);
+    __m128 yy = _mm_mul_ps(qy, qy);
+    __m128 zz = _mm_mul_ps(qz, qz);
+    __m128 ww = _mm_mul_ps(qw, qw);
+    __m128 xy = _mm_mul_ps(qx, qy);
+    __m128 xz = _mm_mul_ps(qx, qz);
+    __m128 yz = _mm_mul_ps(qy, qz);
+    __m128 wx = _mm_mul_ps(qw, qx);
+    __m128 wy = _mm_mul_ps(qw, qy);
+    __m128 wz = _mm_mul_ps(qw, qz);
+
+    __m128 n2 = _mm_add_ps(_mm_add_ps(xx, yy), _mm_add_ps(zz, ww));
+    storeValid4(_mm_and_ps(isValidLength4(n2), isFiniteSum4(tx, ty, tz)),
+                valid);
+
+    const __m128 one = _mm_set1_ps(1.f);
+    const __m128 zero = _mm_setzero_ps();
+    __m128 s = _mm_div_ps(_mm_set1_ps(2.f), n2);
+
+    __m128 comps[12] = {
+        tx, ty, tz,
+        // view = -Z
+        _mm_sub_ps(zero, _mm_mul_ps(s, _mm_add_ps(xz, wy))),
+        _mm_sub_ps(zero, _mm_mul_ps(s, _mm_sub_ps(yz, wx))),
+        _mm_sub_ps(_mm_mul_ps(s, _mm_add_ps(xx, yy)), one),
+        // up = +Y
+        _mm_mul_ps(s, _mm_sub_ps(xy, wz)),
+        _mm_sub_ps(one, _mm_mul_ps(s, _mm_add_ps(xx, zz))),
+        _mm_mul_ps(s, _mm_add_ps(yz, wx)),
+        // right = +X
+        _mm_sub_ps(one, _mm_mul_ps(s, _mm_add_ps(yy, zz))),
+        _mm_mul_ps(s, _mm_add_ps(xy, wz)),
+        _mm_mul_ps(s, _mm_sub_ps(xz, wy)),
+    };
+
+    storeCameraBases4(comps, out);
+}
+
+static void computeCameraBases4(const glm::mat4 *m, CameraBasis *out,
+                                uint8_t *valid)
+{
+    __m128 axes[3][3];
+    __m128 mask = _mm_cmpeq_ps(_mm_setzero_ps(), _mm_setzero_ps());
+    for (int i = 0; i < 3; i++) {
+        for (int c = 0; c < 3; c++) {
+            axes[i][c] = _mm_setr_ps(m[0][i][c], m[1][i][c],
+                                     m[2][i][c], m[3][i][c]);
+        }
+
+        __m128 len2 = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(axes[i][0], axes[i][0]),
+                       _mm_mul_ps(axes[i][1], axes[i][1])),
+            _mm_mul_ps(axes[i][2], axes[i][2]));
+        mask = _mm_and_ps(mask, isValidLength4(len2));
+
+        __m128 inv_len = _mm_div_ps(_mm_set1_ps(1.f), _mm_sqrt_ps(len2));
+        for (int c = 0; c < 3; c++) {
+            axes[i][c] = _mm_mul_ps(axes[i][c], inv_len);
+        }
+    }
+
+    __m128 tx = _mm_setr_ps(m[0][3].x, m[1][3].x, m[2][3].x, m[3][3].x);
+    __m128 ty = _mm_setr_ps(m[0][3].y, m[1][3].y, m[2][3].y, m[3][3].y);
+    __m128 tz = _mm_setr_ps(m[0][3].z, m[1][3].z, m[2][3].z, m[3][3].z);
+
+    storeValid4(_mm_and_ps(mask, isFiniteSum4(tx, ty, tz)), valid);
+
+    const __m128 zero = _mm_setzero_ps();
+
+    __m128 comps[12] = {
+        tx, ty, tz,
+        _mm_sub_ps(zero, axes[2][0]),
+        _mm_sub_ps(zero, axes[2][1]),
+        _mm_sub_ps(zero, axes[2][2]),
+        axes[1][0], axes[1][1], axes[1][2],
+        axes[0][0], axes[0][1], axes[0][2],
+    };
+
+    storeCameraBases4(comps, out);
+}
+
+#endif
+
+void computeCameraBases(const glm::vec3 *positions,
+                        const glm::quat *rotations,
+                        CameraBasis *out, uint8_t *valid,
+                        uint32_t num_poses)
+{
+    uint32_t idx = 0;
+
+#ifdef RLPBR_TRANSFORMS_SSE
+    for (; idx + 4 <= num_poses; idx += 4) {
+        computeCameraBases4(positions + idx, rotations + idx,
+                            out + idx, valid + idx);
+    }
+#endif
+
+    for (; idx < num_poses; idx++) {
+        valid[idx] = computeCameraBasis(positions[idx], rotations[idx],
+                                        out[idx]);
+    }
+}
+
+void computeCameraBases(const glm::mat4 *camera_to_worlds,
+                        CameraBasis *out, uint8_t *valid,
+                        uint32_t num_poses)
+{
+    uint32_t idx = 0;
+
+#ifdef RLPBR_TRANSFORMS_SSE
+    for (; idx + 4 <= num_poses; idx += 4) {
+        computeCameraBases4(camera_to_worlds + idx, out + idx, valid + idx);
+    }
+#endif
+
+    for (; idx < num_poses; idx++) {
+        valid[idx] = computeCameraBasis(camera_to_worlds[idx], out[idx]);
+    }
+}
+
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <rlpbr/environment.hpp>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#include <vector>
+
+namespace RLpbr {
+
+// *dsts[i] = { T(positions[i]) * R(rotations[i]), inverse }
+// for i in [0, num_transforms). Rotations must be normalized. Processes
+// SIMD width instances at a time, with a scalar tail.
+void computeRigidTransforms(const glm::vec3 *positions,
+                            const glm::quat *rotations,
+                            InstanceTransform * const *dsts,
+                            uint32_t num_transforms);
+
+// Single instance version of the above
+void computeRigidTransform(const glm::vec3 &position,
+                           const glm::quat &rotation,
+                           InstanceTransform &out);
+
+// *dsts[i] = matrices of srcs[i]. Scales must be nonzero. Processes SIMD
+// width transforms at a time, with a scalar tail.
+void expandTransforms(const CompactTransform *srcs,
+                      InstanceTransform * const *dsts,
+                      uint32_t num_transforms);
+
+// dsts[i] = srcs[i].mat decomposed into translation, rotation and scale.
+// Shear is dropped, mirroring is folded into a negative scale.x. Rotations
+// are quantized relative to their largest component, so
+// packTransforms(expandTransforms(t)) reproduces t's position and rotation
+// exactly and its scale up to float rounding.
+void packTransforms(const InstanceTransform *srcs,
+                    CompactTransform *dsts,
+                    uint32_t num_transforms);
+
+// *dsts[i] = *parents[i] * *locals[i], world transforms of children from
+// their parent's world transform and their transform relative to it.
+// Transforms are general affine, inverses are composed rather than
+// recomputed.
+void composeTransforms(const InstanceTransform * const *parents,
+                       const InstanceTransform * const *locals,
+                       InstanceTransform * const *dsts,
+                       uint32_t num_transforms);
+
+// *dsts[i] = inverse(*parents[i]) * *worlds[i], the inverse of the above
+void relativeTransforms(const InstanceTransform * const *parents,
+                        const InstanceTransform * const *worlds,
+                        InstanceTransform * const *dsts,
+                        uint32_t num_transforms);
+
+// Breadth first order over the slots that have a parent or children.
+// order[level_offsets[d]..level_offsets[d + 1]) holds the slots at depth
+// d, so every parent comes before its children. parents[slot] is the
+// parent slot or ~0u. Slots on cycles are never reached and left out.
+void buildHierarchyOrder(const CowArray<uint32_t> &parents,
+                         std::vector<uint32_t> &order,
+                         std::vector<uint32_t> &level_offsets);
+
+// Same layout as the leading members of Camera
+struct CameraBasis {
+    glm::vec3 position;
+    glm::vec3 view;
+    glm::vec3 up;
+    glm::vec3 right;
+};
+
+// Camera bases for camera to world poses, the vectors
+// Camera::updateView(camera_to_world) would extract: right = +X, up = +Y,
+// view = -Z, normalized. Rotations need not be normalized. valid[i] is 0
+// and out[i] unspecified for poses with non finite components or a (near)
+// zero length rotation / axis. Processes SIMD width poses at a time, with
+// a scalar tail.
+void computeCameraBases(const glm::vec3 *positions,
+                        const glm::quat *rotations,
+                        CameraBasis *out, uint8_t *valid,
+                        uint32_t num_poses);
+
+void computeCameraBases(const glm::mat4 *camera_to_worlds,
+                        CameraBasis *out, uint8_t *valid,
+                        uint32_t num_poses);
+
+}
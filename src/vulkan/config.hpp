@@ -13,6 +13,10 @@ constexpr float transfer_priority = 1.0;
 constexpr uint32_t descriptor_pool_size = 10;
 constexpr uint32_t minibatch_divisor = 4;
 
+// TLAS quality degrades with each in place update, force a full
+// rebuild after this many consecutive refits
+constexpr uint32_t max_tlas_refits = 16;
+
 static constexpr int num_meshlet_vertices = 64;
 static constexpr int num_meshlet_triangles = 126;
 static constexpr int num_meshlets_per_chunk = 32;
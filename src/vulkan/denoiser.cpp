@@ -67,7 +67,8 @@ void Denoiser::denoise(const DeviceState &dev,
                        LocalBuffer &output,
                        const LocalBuffer &albedo,
                        const LocalBuffer &normal,
-                       uint32_t batch_size)
+                       const uint32_t *batch_idxs,
+                       uint32_t num_images)
 {
     REQ_VK(dev.dt.resetCommandPool(dev.hdl, cmd_pool, 0));
 
@@ -130,7 +131,9 @@ void Denoiser::denoise(const DeviceState &dev,
     waitForFenceInfinitely(dev, fence);
     resetFence(dev, fence);
 
-    for (int i = 0; i < (int)batch_size; i++) {
+    // Images not in batch_idxs are copied back unchanged
+    for (uint32_t image_idx = 0; image_idx < num_images; image_idx++) {
+        int i = batch_idxs[image_idx];
         for (int y = 0; y < (int)fb_cfg.imgHeight; y++) {
             for (int x = 0; x < (int)fb_cfg.imgWidth; x++) {
                 for (int c = 0; c < 3; c++) {
@@ -23,7 +23,8 @@ public:
                  LocalBuffer &output,
                  const LocalBuffer &albedo,
                  const LocalBuffer &normal,
-                 uint32_t batch_size);
+                 const uint32_t *batch_idxs,
+                 uint32_t num_images);
 
 private:
     struct Impl;
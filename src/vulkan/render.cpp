@@ -3,9 +3,12 @@
 
 #include "scene.hpp"
 
+#include <rlpbr_core/tonemap.hpp>
+
 #include <iostream>
 #include <sstream>
 #include <glm/gtx/string_cast.hpp>
+#include <chrono>
 #include <cmath>
 #include <filesystem>
 
@@ -41,13 +44,22 @@ static InitConfig getInitConfig(const RenderConfig &cfg, bool validate)
     };
 }
 
+// Number of PackedLights an environment's lights and tables take up
+static uint32_t numLightSlots(uint32_t num_lights)
+{
+    uint32_t num_blocks = (num_lights + LightSampler::blockSize - 1) >>
+        LightSampler::blockShift;
+
+    return 2 * num_lights + num_blocks;
+}
+
 static ParamBufferConfig getParamBufferConfig(uint32_t batch_size,
                                               const MemoryAllocator &alloc)
 {
     ParamBufferConfig cfg {};
 
     cfg.totalTransformBytes =
-        sizeof(InstanceTransform) * VulkanConfig::max_instances;
+        sizeof(CompactTransform) * VulkanConfig::max_instances;
 
     VkDeviceSize cur_offset = cfg.totalTransformBytes;
 
@@ -59,7 +71,10 @@ static ParamBufferConfig getParamBufferConfig(uint32_t batch_size,
     cur_offset = cfg.materialIndicesOffset + cfg.totalMaterialIndexBytes;
 
     cfg.lightsOffset = alloc.alignStorageBufferOffset(cur_offset);
-    cfg.totalLightParamBytes = sizeof(PackedLight) * VulkanConfig::max_lights;
+    // Lights followed by their selection tables, see stageLightSampling.
+    // Every environment may round up to one more partial block.
+    cfg.totalLightParamBytes = sizeof(PackedLight) *
+        (numLightSlots(VulkanConfig::max_lights) + batch_size);
 
     cur_offset = cfg.lightsOffset + cfg.totalLightParamBytes;
 
@@ -302,6 +317,10 @@ static RenderState makeRenderState(const DeviceState &dev,
         case RenderMode::Biased:
             rt_name = "basic.comp";
             break;
+        case RenderMode::Rasterize:
+            cerr << "Vulkan backend: RenderMode::Rasterize is only "
+                "supported by the CPU backend" << endl;
+            fatalExit();
     }
 
     // Give 9 digits of precision for lossless conversion
@@ -313,16 +332,16 @@ static RenderState makeRenderState(const DeviceState &dev,
         return strm.str();
     };
     
-    // 64 stops. Probably overkill, especially on high end
-    float min_log_luminance = -30.f;
-    float max_log_luminance = 34.f;
-    float min_luminance = exp2(min_log_luminance);
+    // 64 stops. Probably overkill, especially on high end. Shared with
+    // the host reference in rlpbr_core/tonemap.hpp
+    float min_log_luminance = ExposureConstants::minLogLuminance;
+    float max_log_luminance = ExposureConstants::maxLogLuminance;
 
-    float log_luminance_range = max_log_luminance - min_log_luminance;
-    float inv_log_luminance_range = 1.f / log_luminance_range;
+    float log_luminance_range = ExposureConstants::logLuminanceRange;
+    float inv_log_luminance_range = ExposureConstants::invLogLuminanceRange;
 
-    int num_exposure_bins = 128;
-    float exposure_bias = 0.f;
+    int num_exposure_bins = ExposureConstants::numBins;
+    float exposure_bias = ExposureConstants::bias;
 
     uint32_t thread_elems_x = divideRoundUp(cfg.imgWidth,
                                             VulkanConfig::localWorkgroupX);
@@ -341,8 +360,8 @@ static RenderState makeRenderState(const DeviceState &dev,
             floatToString(max_log_luminance) + "f)",
         string("EXPOSURE_BIAS (") +
             floatToString(exposure_bias) + "f)",
-        string("MIN_LUMINANCE (") +
-            floatToString(min_luminance) + "f)",
+        // Fixed point printing would round exp2(-30) to 1e-9
+        string("MIN_LUMINANCE (exp2(MIN_LOG_LUMINANCE))"),
         string("RES_X (") + to_string(cfg.imgWidth) + "u)",
         string("RES_Y (") + to_string(cfg.imgHeight) + "u)",
         string("EXPOSURE_THREAD_ELEMS_X (") + to_string(thread_elems_x) + "u)",
@@ -548,7 +567,7 @@ static RenderPipelines makePipelines(const DeviceState &dev,
 
     compute_infos[0].sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
     compute_infos[0].pNext = nullptr;
-    compute_infos[0].flags = 0;
+    compute_infos[0].flags = VK_PIPELINE_CREATE_DISPATCH_BASE_BIT;
     compute_infos[0].stage = {
         VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
         &subgroup_size,
@@ -580,7 +599,7 @@ static RenderPipelines makePipelines(const DeviceState &dev,
 
     compute_infos[1].sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
     compute_infos[1].pNext = nullptr;
-    compute_infos[1].flags = 0;
+    compute_infos[1].flags = VK_PIPELINE_CREATE_DISPATCH_BASE_BIT;
     compute_infos[1].stage = {
         VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
         &subgroup_size,
@@ -596,7 +615,7 @@ static RenderPipelines makePipelines(const DeviceState &dev,
 
     compute_infos[2].sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
     compute_infos[2].pNext = nullptr;
-    compute_infos[2].flags = 0;
+    compute_infos[2].flags = VK_PIPELINE_CREATE_DISPATCH_BASE_BIT;
     compute_infos[2].stage = {
         VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
         &subgroup_size,
@@ -810,8 +829,8 @@ static PerBatchState makePerBatchState(const DeviceState &dev,
     uint8_t *base_ptr =
         reinterpret_cast<uint8_t *>(param_buffer.ptr);
 
-    InstanceTransform *transform_ptr =
-        reinterpret_cast<InstanceTransform *>(base_ptr);
+    CompactTransform *transform_ptr =
+        reinterpret_cast<CompactTransform *>(base_ptr);
 
     uint32_t *material_ptr = reinterpret_cast<uint32_t *>(
         base_ptr + param_cfg.materialIndicesOffset);
@@ -1375,7 +1394,8 @@ VulkanBackend::VulkanBackend(const RenderConfig &cfg,
           optional<PresentationState>()),
       denoiser_((cfg.flags & RenderFlags::Denoise || cfg.mode == RenderMode::Biased) ?
                 make_optional<Denoiser>(alloc, cfg) :
-                optional<Denoiser>())
+                optional<Denoiser>()),
+      prep_pool_(cfg.numPrepThreads)
 {
     if (init_cfg.needPresent) {
         present_->forceTransition(dev, compute_queues_[0], dev.computeQF);
@@ -1403,13 +1423,10 @@ LoaderImpl VulkanBackend::makeLoader()
 EnvironmentImpl VulkanBackend::makeEnvironment(const shared_ptr<Scene> &scene,
                                                const Camera &cam)
 {
-    // FIXME: allow seeding, get rid of thread_local, need some kind of
-    // VulkanBackend thread context
-    static thread_local mt19937 rand_gen {random_device {}()};
-
+    // Domain parameters are drawn by Environment through randomize()
     const VulkanScene &vk_scene = *static_cast<VulkanScene *>(scene.get());
     VulkanEnvironment *environment =
-        new VulkanEnvironment(dev, vk_scene, cam, rand_gen,
+        new VulkanEnvironment(dev, vk_scene, cam,
                               cfg_.enableRandomization,
                               cur_env_maps_->texData.textures.size() / 2);
     return makeEnvironmentImpl<VulkanEnvironment>(environment);
@@ -1473,6 +1490,8 @@ RenderBatch::Handle VulkanBackend::makeRenderBatch()
         move(render_input_dev),
         move(batch_state),
         0,
+        vector<EnvStagingCache>(cfg_.batchSize, EnvStagingCache {}),
+        vector<EnvPrepState>(cfg_.batchSize, EnvPrepState {}),
     };
 
     return RenderBatch::Handle(backend, {nullptr, deleter});
@@ -1577,6 +1596,193 @@ static VulkanBatch *getVkBatch(RenderBatch &batch)
     return static_cast<VulkanBatch *>(batch.getBackend());
 }
 
+// Allocation and command recording for the environment's TLAS update, has
+// to run serially since all environments share one command buffer. The
+// instance data is written later by writeEnvironmentTLAS.
+static void planEnvironmentTLAS(const DeviceState &dev,
+                                MemoryAllocator &alloc,
+                                const Environment &env,
+                                EnvPrepState &prep,
+                                VkCommandBuffer build_cmd)
+{
+    prep.tlasUpdate = TLASUpdate::None;
+
+    if (!env.isDirty()) {
+        return;
+    }
+
+    VulkanEnvironment &env_backend =
+        *(VulkanEnvironment *)(env.getBackend());
+    const EnvironmentUpdates &updates = env.getUpdates();
+    uint32_t num_instances = env.getNumInstances();
+
+    if (updates.structural || !env_backend.tlas.canRefit(num_instances)) {
+        prep.tlasUpdate = TLASUpdate::Build;
+
+        env_backend.tlas.reserve(alloc, num_instances);
+        env_backend.tlas.recordBuild(dev, alloc, num_instances, build_cmd);
+    } else {
+        DirtyRange refit_range = updates.transforms;
+        refit_range.add(updates.flags.begin, updates.flags.end);
+
+        // Material only changes don't touch the TLAS
+        if (!refit_range.empty()) {
+            prep.tlasUpdate = TLASUpdate::Refit;
+            prep.refitRange = refit_range;
+
+            env_backend.tlas.recordRefit(dev, build_cmd);
+        }
+    }
+}
+
+static void writeEnvironmentTLAS(const DeviceState &dev,
+                                 const Environment &env,
+                                 const EnvPrepState &prep)
+{
+    VulkanEnvironment &env_backend =
+        *(VulkanEnvironment *)(env.getBackend());
+
+    if (prep.tlasUpdate == TLASUpdate::Build) {
+        const VulkanScene &scene =
+            *static_cast<const VulkanScene *>(env.getScene().get());
+
+        env_backend.tlas.writeInstances(dev, env.getInstances(),
+                                        env.getTransforms(),
+                                        env.getInstanceFlags(),
+                                        scene.objectInfo, scene.blases);
+    } else if (prep.tlasUpdate == TLASUpdate::Refit) {
+        env_backend.tlas.writeInstanceTransforms(dev, env.getTransforms(),
+                                                 env.getInstanceFlags(),
+                                                 prep.refitRange.begin,
+                                                 prep.refitRange.end);
+    }
+}
+
+static void updateEnvironmentTLAS(const DeviceState &dev,
+                                  MemoryAllocator &alloc,
+                                  const Environment &env,
+                                  VkCommandBuffer build_cmd)
+{
+    EnvPrepState prep;
+    planEnvironmentTLAS(dev, alloc, env, prep, build_cmd);
+    writeEnvironmentTLAS(dev, env, prep);
+}
+
+// Selection tables after the environment's lights, read by
+// sampleLightIndex: one vec4(keep, alias, pdf, 0) per light, then one
+// vec4(keep, alias, 0, 0) per block of LightSampler::blockSize lights.
+// Aliases are stored as float bits.
+static void stageLightSampling(const LightSampler &sampler,
+                               uint32_t num_lights,
+                               PackedLight *dst)
+{
+    uint32_t num_blocks = (num_lights + LightSampler::blockSize - 1) >>
+        LightSampler::blockShift;
+
+    PackedLight *light_entries = dst + num_lights;
+    PackedLight *block_entries = light_entries + num_lights;
+
+    // Backend lights without an Environment behind them, sample uniformly
+    if (sampler.size() != num_lights) {
+        for (uint32_t i = 0; i < num_lights; i++) {
+            light_entries[i].data = glm::vec4(1.f, glm::uintBitsToFloat(i),
+                                              1.f / float(num_lights), 0.f);
+        }
+
+        vector<float> block_lens(num_blocks);
+        for (uint32_t i = 0; i < num_blocks; i++) {
+            block_lens[i] = float(min(
+                num_lights - (i << LightSampler::blockShift),
+                LightSampler::blockSize));
+        }
+
+        vector<AliasEntry> block_table(num_blocks);
+        buildAliasTable(block_lens.data(), num_blocks, block_table.data());
+        for (uint32_t i = 0; i < num_blocks; i++) {
+            block_entries[i].data = glm::vec4(block_table[i].keep,
+                glm::uintBitsToFloat(block_table[i].alias), 0.f, 0.f);
+        }
+
+        return;
+    }
+
+    const CowArray<AliasEntry> &entries = sampler.getEntries();
+    for (uint32_t i = 0; i < num_lights; i++) {
+        const AliasEntry &entry = entries[i];
+        light_entries[i].data = glm::vec4(entry.keep,
+            glm::uintBitsToFloat(entry.alias), sampler.pdf(i), 0.f);
+    }
+
+    const CowArray<AliasEntry> &block_table = sampler.getBlockEntries();
+    for (uint32_t i = 0; i < num_blocks; i++) {
+        const AliasEntry &entry = block_table[i];
+        block_entries[i].data = glm::vec4(entry.keep,
+            glm::uintBitsToFloat(entry.alias), 0.f, 0.f);
+    }
+}
+
+// Everything render() writes for one environment after planning. Only
+// touches the environment's own backend state and its disjoint parts of
+// the staging buffer, so environments are prepared in parallel.
+static void prepareEnvironment(const DeviceState &dev,
+                               const Environment &env,
+                               const EnvPrepState &prep,
+                               EnvStagingCache &staging,
+                               PerBatchState &batch_state,
+                               PackedEnv &packed_env)
+{
+    VulkanEnvironment &env_backend =
+        *(VulkanEnvironment *)(env.getBackend());
+    const VulkanScene &scene_backend =
+        *static_cast<const VulkanScene *>(env.getScene().get());
+
+    writeEnvironmentTLAS(dev, env, prep);
+
+    packed_env.cam = packCamera(env.getCamera());
+    packed_env.prevCam = packCamera(env_backend.prevCam);
+    packed_env.data.x = scene_backend.sceneID->getID();
+
+    // Set prevCam for next iteration
+    env_backend.prevCam = env.getCamera();
+
+    stageEnvironment(env, staging, batch_state.transformPtr,
+                     batch_state.materialPtr, prep.instanceOffset,
+                     prep.materialOffset);
+
+    packed_env.data.y = prep.materialOffset;
+
+    memcpy(&batch_state.lightPtr[prep.lightOffset],
+           env_backend.lights.data(),
+           env_backend.lights.size() * sizeof(PackedLight));
+    stageLightSampling(env.getLightSampler(), env_backend.lights.size(),
+                       &batch_state.lightPtr[prep.lightOffset]);
+
+    packed_env.data.z = prep.lightOffset;
+    packed_env.data.w = env_backend.lights.size();
+
+    packed_env.tlasAddr = env_backend.tlas.tlasStorageDevAddr;
+    //packed_env.reservoirGridAddr = env_backend.reservoirGrid.devAddr;
+    packed_env.reservoirGridAddr = 0;
+
+    packed_env.envMapRotation.x =
+        env_backend.domainRandomization.envRotation.x;
+    packed_env.envMapRotation.y =
+        env_backend.domainRandomization.envRotation.y;
+    packed_env.envMapRotation.z =
+        env_backend.domainRandomization.envRotation.z;
+    packed_env.envMapRotation.w =
+        env_backend.domainRandomization.envRotation.w;
+
+    packed_env.lightFilterAndEnvIdx.x =
+        env_backend.domainRandomization.lightFilter.x;
+    packed_env.lightFilterAndEnvIdx.y =
+        env_backend.domainRandomization.lightFilter.y;
+    packed_env.lightFilterAndEnvIdx.z =
+        env_backend.domainRandomization.lightFilter.z;
+    packed_env.lightFilterAndEnvIdx.w =
+        glm::uintBitsToFloat(env_backend.domainRandomization.envMapIdx);
+}
+
 void VulkanBackend::render(RenderBatch &batch)
 {
     VulkanBatch &batch_backend = *getVkBatch(batch);
@@ -1636,21 +1842,40 @@ void VulkanBackend::render(RenderBatch &batch)
 
     startRenderSetup();
 
-    // TLAS build
-    for (int batch_idx = 0; batch_idx < (int)cfg_.batchSize; batch_idx++) {
-        const Environment &env = envs[batch_idx];
-
-        if (env.isDirty()) {
-            VulkanEnvironment &env_backend =
-                *(VulkanEnvironment *)(env.getBackend());
-            const VulkanScene &scene =
-                *static_cast<const VulkanScene *>(env.getScene().get());
+    auto layout_start = chrono::steady_clock::now();
 
-            env_backend.tlas.build(dev, alloc, env.getInstances(),
-                                   env.getTransforms(), env.getInstanceFlags(),
-                                   scene.objectInfo, scene.blases, render_cmd);
+    const uint32_t *active = batch.getActiveEnvironments();
+    uint32_t num_active = batch.getNumActive();
+    activeRanges(active, num_active, batch_backend.activeRanges);
 
-            env.clearDirty();
+    // Staging offsets, TLAS allocation & command recording. Inactive
+    // environments still get a region, so they keep the same one across
+    // the frames they're skipped.
+    uint32_t inst_offset = 0;
+    uint32_t material_offset = 0;
+    uint32_t light_offset = 0;
+    uint32_t next_active = 0;
+    for (int batch_idx = 0; batch_idx < (int)cfg_.batchSize; batch_idx++) {
+        const Environment &env = envs[batch_idx];
+        const VulkanEnvironment &env_backend =
+            *static_cast<const VulkanEnvironment *>(env.getBackend());
+
+        EnvPrepState &prep = batch_backend.envPrep[batch_idx];
+        prep.instanceOffset = inst_offset;
+        prep.materialOffset = material_offset;
+        prep.lightOffset = light_offset;
+
+        inst_offset += env.getNumInstances();
+        material_offset += env.getInstanceMaterials().size();
+        light_offset += numLightSlots(env_backend.lights.size());
+
+        if (next_active < num_active &&
+            active[next_active] == (uint32_t)batch_idx) {
+            next_active++;
+            planEnvironmentTLAS(dev, alloc, env, prep, render_cmd);
+        } else {
+            skipEnvironment(env, batch_backend.envStaging[batch_idx],
+                            prep.instanceOffset, prep.materialOffset);
         }
     }
 
@@ -1666,70 +1891,26 @@ void VulkanBackend::render(RenderBatch &batch)
         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1,
         &tlas_barrier, 0, nullptr, 0, nullptr);
 
-    uint32_t inst_offset = 0;
-    uint32_t material_offset = 0;
-    uint32_t light_offset = 0;
-
-    // Write environment data into linear buffers
-    for (int batch_idx = 0; batch_idx < (int)cfg_.batchSize; batch_idx++) {
-        Environment &env = envs[batch_idx];
-        VulkanEnvironment &env_backend =
-            *static_cast<VulkanEnvironment *>(env.getBackend());
-        const VulkanScene &scene_backend =
-            *static_cast<const VulkanScene *>(env.getScene().get());
-
-        PackedEnv &packed_env = batch_state.envPtr[batch_idx];
-
-        packed_env.cam = packCamera(env.getCamera());
-        packed_env.prevCam = packCamera(env_backend.prevCam);
-        packed_env.data.x = scene_backend.sceneID->getID();
-
-        // Set prevCam for next iteration
-        env_backend.prevCam = env.getCamera();
-
-        const auto &env_transforms = env.getTransforms();
-        uint32_t num_instances = env.getNumInstances();
-        memcpy(&batch_state.transformPtr[inst_offset], env_transforms.data(),
-               sizeof(InstanceTransform) * num_instances);
-        inst_offset += num_instances;
-
-        const auto &env_mats = env.getInstanceMaterials();
-
-        memcpy(&batch_state.materialPtr[material_offset], env_mats.data(),
-               env_mats.size() * sizeof(uint32_t));
-
-        packed_env.data.y = material_offset;
-        material_offset += env_mats.size();
-
-        memcpy(&batch_state.lightPtr[light_offset], env_backend.lights.data(),
-               env_backend.lights.size() * sizeof(PackedLight));
+    auto stage_start = chrono::steady_clock::now();
 
-        packed_env.data.z = light_offset;
-        packed_env.data.w = env_backend.lights.size();
-        light_offset += env_backend.lights.size();
-
-        packed_env.tlasAddr = env_backend.tlas.tlasStorageDevAddr;
-        //packed_env.reservoirGridAddr = env_backend.reservoirGrid.devAddr;
-        packed_env.reservoirGridAddr = 0;
+    // Write TLAS instances & environment data into linear buffers
+    prep_pool_.run(num_active, [&](uint32_t begin, uint32_t end) {
+        for (uint32_t i = begin; i < end; i++) {
+            uint32_t batch_idx = active[i];
+            prepareEnvironment(dev, envs[batch_idx],
+                               batch_backend.envPrep[batch_idx],
+                               batch_backend.envStaging[batch_idx],
+                               batch_state, batch_state.envPtr[batch_idx]);
+        }
+    });
 
-        packed_env.envMapRotation.x =
-            env_backend.domainRandomization.envRotation.x;
-        packed_env.envMapRotation.y =
-            env_backend.domainRandomization.envRotation.y;
-        packed_env.envMapRotation.z =
-            env_backend.domainRandomization.envRotation.z;
-        packed_env.envMapRotation.w =
-            env_backend.domainRandomization.envRotation.w;
+    auto stage_end = chrono::steady_clock::now();
 
-        packed_env.lightFilterAndEnvIdx.x =
-            env_backend.domainRandomization.lightFilter.x;
-        packed_env.lightFilterAndEnvIdx.y =
-            env_backend.domainRandomization.lightFilter.y;
-        packed_env.lightFilterAndEnvIdx.z =
-            env_backend.domainRandomization.lightFilter.z;
-        packed_env.lightFilterAndEnvIdx.w =
-            glm::uintBitsToFloat(env_backend.domainRandomization.envMapIdx);
-    }
+    batch.setPrepStats({
+        prep_pool_.numThreads(),
+        chrono::duration<double>(stage_start - layout_start).count(),
+        chrono::duration<double>(stage_end - stage_start).count(),
+    });
 
     batch_backend.renderInputStaging.flush(dev);
 
@@ -1789,29 +1970,39 @@ void VulkanBackend::render(RenderBatch &batch)
     comp_barrier.dstAccessMask =
         VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
 
+    // Shaders take the batch index from gl_GlobalInvocationID.z, so each
+    // run of active environments is one dispatch offset to its start
+    static_assert(VulkanConfig::localWorkgroupZ == 1);
+    auto dispatchActive = [&](uint32_t x, uint32_t y) {
+        for (const BatchRange &range : batch_backend.activeRanges) {
+            dev.dt.cmdDispatchBase(render_cmd, 0, 0, range.begin,
+                                   x, y, range.end - range.begin);
+        }
+    };
+
     if (cfg_.adaptiveSampling) {
-        dev.dt.cmdFillBuffer(render_cmd,
-            batch_backend.fb.outputs[batch_backend.fb.adaptiveIdx].buffer,
-            0, fb_cfg_.adaptiveBytes, 0);
+        // Only zero the active environments' slices of each output
+        auto fillActive = [&](uint32_t output_idx, VkDeviceSize num_bytes) {
+            VkDeviceSize env_bytes = num_bytes / cfg_.batchSize;
+            for (const BatchRange &range : batch_backend.activeRanges) {
+                dev.dt.cmdFillBuffer(render_cmd,
+                    batch_backend.fb.outputs[output_idx].buffer,
+                    range.begin * env_bytes,
+                    (range.end - range.begin) * env_bytes, 0);
+            }
+        };
 
-        dev.dt.cmdFillBuffer(render_cmd,
-            batch_backend.fb.outputs[batch_backend.fb.hdrIdx].buffer,
-            0, fb_cfg_.hdrBytes, 0);
+        fillActive(batch_backend.fb.adaptiveIdx, fb_cfg_.adaptiveBytes);
+        fillActive(batch_backend.fb.hdrIdx, fb_cfg_.hdrBytes);
 
         if (cfg_.tonemap) {
-            dev.dt.cmdFillBuffer(render_cmd,
-                batch_backend.fb.outputs[batch_backend.fb.illuminanceIdx].buffer,
-                0, fb_cfg_.illuminanceBytes, 0);
+            fillActive(batch_backend.fb.illuminanceIdx,
+                       fb_cfg_.illuminanceBytes);
         }
 
         if (cfg_.auxiliaryOutputs) {
-            dev.dt.cmdFillBuffer(render_cmd,
-                batch_backend.fb.outputs[batch_backend.fb.normalIdx].buffer,
-                0, fb_cfg_.normalBytes, 0);
-
-            dev.dt.cmdFillBuffer(render_cmd,
-                batch_backend.fb.outputs[batch_backend.fb.albedoIdx].buffer,
-                0, fb_cfg_.albedoBytes, 0);
+            fillActive(batch_backend.fb.normalIdx, fb_cfg_.normalBytes);
+            fillActive(batch_backend.fb.albedoIdx, fb_cfg_.albedoBytes);
         }
 
         VkMemoryBarrier zero_barrier;
@@ -1843,7 +2034,8 @@ void VulkanBackend::render(RenderBatch &batch)
             cur_tile_idx++;
         };
 
-        for (int batch_idx = 0; batch_idx < (int)cfg_.batchSize; batch_idx++) {
+        for (uint32_t i = 0; i < num_active; i++) {
+            int batch_idx = active[i];
             for (int tile_y = 0; tile_y < (int)fb_cfg_.numTilesTall; tile_y++) {
                 for (int tile_x = 0; tile_x < (int)fb_cfg_.numTilesWide;
                      tile_x++) {
@@ -1938,8 +2130,8 @@ void VulkanBackend::render(RenderBatch &batch)
             cur_tile_idx = 0;
             frame_counter_ += cfg_.batchSize;
 
-            for (int batch_idx = 0; batch_idx < (int)cfg_.batchSize;
-                 batch_idx++) {
+            for (uint32_t i = 0; i < num_active; i++) {
+                int batch_idx = active[i];
                 for (int tile_y = 0; tile_y < (int)fb_cfg_.numTilesTall;
                      tile_y++) {
                     for (int tile_x = 0; tile_x < (int)fb_cfg_.numTilesWide;
@@ -1998,11 +2190,7 @@ void VulkanBackend::render(RenderBatch &batch)
                                   1, &param_barrier,
                                   0, nullptr);
 
-        dev.dt.cmdDispatch(
-            render_cmd,
-            launch_size_.x,
-            launch_size_.y,
-            launch_size_.z);
+        dispatchActive(launch_size_.x, launch_size_.y);
 
         frame_counter_ += cfg_.batchSize;
     }
@@ -2017,7 +2205,7 @@ void VulkanBackend::render(RenderBatch &batch)
             batch_backend.fb.outputs[batch_backend.fb.hdrIdx],
             batch_backend.fb.outputs[batch_backend.fb.albedoIdx],
             batch_backend.fb.outputs[batch_backend.fb.normalIdx],
-            cfg_.batchSize);
+            active, num_active);
 
         startRenderSetup();
     }
@@ -2038,11 +2226,7 @@ void VulkanBackend::render(RenderBatch &batch)
                                      &batch_state.exposureSet,
                                      0, nullptr);
 
-        dev.dt.cmdDispatch(
-            render_cmd,
-            1,
-            1,
-            cfg_.batchSize);
+        dispatchActive(1, 1);
 
         dev.dt.cmdPipelineBarrier(render_cmd,
             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
@@ -2057,11 +2241,7 @@ void VulkanBackend::render(RenderBatch &batch)
                                      &batch_state.tonemapSet,
                                      0, nullptr);
 
-        dev.dt.cmdDispatch(
-            render_cmd,
-            launch_size_.x,
-            launch_size_.y,
-            launch_size_.z);
+        dispatchActive(launch_size_.x, launch_size_.y);
     }
 
     submitCmd();
@@ -2110,22 +2290,9 @@ Probe *VulkanBackend::bakeProbe(glm::vec3 position, RenderBatch &batch)
 
     startRenderSetup();
 
-    // TLAS build
+    // TLAS build / refit
     for (int batch_idx = 0; batch_idx < (int)cfg_.batchSize; batch_idx++) {
-        const Environment &env = envs[batch_idx];
-
-        if (env.isDirty()) {
-            VulkanEnvironment &env_backend =
-                *(VulkanEnvironment *)(env.getBackend());
-            const VulkanScene &scene =
-                *static_cast<const VulkanScene *>(env.getScene().get());
-
-            env_backend.tlas.build(dev, alloc, env.getInstances(),
-                                   env.getTransforms(), env.getInstanceFlags(),
-                                   scene.objectInfo, scene.blases, render_cmd);
-
-            env.clearDirty();
-        }
+        updateEnvironmentTLAS(dev, alloc, envs[batch_idx], render_cmd);
     }
 
     VkMemoryBarrier tlas_barrier;
@@ -2177,24 +2344,27 @@ Probe *VulkanBackend::bakeProbe(glm::vec3 position, RenderBatch &batch)
 
         const auto &env_transforms = env.getTransforms();
         uint32_t num_instances = env.getNumInstances();
-        memcpy(&batch_state.transformPtr[inst_offset], env_transforms.data(),
-               sizeof(InstanceTransform) * num_instances);
+        stageTransforms(env_transforms, &batch_state.transformPtr[inst_offset],
+                        0, num_instances);
         inst_offset += num_instances;
 
         const auto &env_mats = env.getInstanceMaterials();
 
-        memcpy(&batch_state.materialPtr[material_offset], env_mats.data(),
-               env_mats.size() * sizeof(uint32_t));
+        env_mats.copyTo(&batch_state.materialPtr[material_offset]);
 
         packed_env.data.y = material_offset;
         material_offset += env_mats.size();
 
+        env.clearDirty();
+
         memcpy(&batch_state.lightPtr[light_offset], env_backend.lights.data(),
                env_backend.lights.size() * sizeof(PackedLight));
+        stageLightSampling(env.getLightSampler(), env_backend.lights.size(),
+                           &batch_state.lightPtr[light_offset]);
 
         packed_env.data.z = light_offset;
         packed_env.data.w = env_backend.lights.size();
-        light_offset += env_backend.lights.size();
+        light_offset += numLightSlots(env_backend.lights.size());
 
         packed_env.tlasAddr = env_backend.tlas.tlasStorageDevAddr;
         //packed_env.reservoirGridAddr = env_backend.reservoirGrid.devAddr;
@@ -2357,7 +2527,7 @@ Probe *VulkanBackend::bakeProbe(glm::vec3 position, RenderBatch &batch)
             batch_backend.fb.outputs[batch_backend.fb.hdrIdx],
             batch_backend.fb.outputs[batch_backend.fb.albedoIdx],
             batch_backend.fb.outputs[batch_backend.fb.normalIdx],
-            cfg_.batchSize);
+            batch.getActiveEnvironments(), batch.getNumActive());
 
         startRenderSetup();
     }
@@ -9,6 +9,7 @@
 
 #include <rlpbr/config.hpp>
 #include <rlpbr/render.hpp>
+#include <rlpbr_core/batch_prep.hpp>
 #include <rlpbr_core/common.hpp>
 
 #include <glm/glm.hpp>
@@ -143,7 +144,7 @@ struct PerBatchState {
     FixedDescriptorPool tonemapPool;
     VkDescriptorSet tonemapSet;
 
-    InstanceTransform *transformPtr;
+    CompactTransform *transformPtr;
     uint32_t *materialPtr;
     PackedLight *lightPtr;
     PackedEnv *envPtr;
@@ -163,6 +164,24 @@ struct BSDFPrecomputed {
     ImgAndView msGGXInverse;
 };
 
+// What was last written into renderInputStaging for one batch slot,
+// lets unchanged environments skip the copy
+enum class TLASUpdate : uint32_t {
+    None,
+    Build,
+    Refit,
+};
+
+// Decided serially at the start of render(), consumed by the staging
+// workers
+struct EnvPrepState {
+    uint32_t instanceOffset;
+    uint32_t materialOffset;
+    uint32_t lightOffset;
+    TLASUpdate tlasUpdate;
+    DirtyRange refitRange;
+};
+
 struct VulkanBatch : public BatchBackend {
     FramebufferState fb;
 
@@ -172,6 +191,10 @@ struct VulkanBatch : public BatchBackend {
     PerBatchState state;
 
     uint32_t curBuffer;
+
+    std::vector<EnvStagingCache> envStaging;
+    std::vector<EnvPrepState> envPrep;
+    std::vector<BatchRange> activeRanges;
 };
 
 struct Probe {
@@ -285,6 +308,8 @@ private:
 
     uint32_t probe_width_;
     uint32_t probe_height_;
+
+    BatchPrepPool prep_pool_;
 };
 
 }
@@ -1,6 +1,7 @@
 #include "scene.hpp"
 #include <vulkan/vulkan_core.h>
 
+#include "rlpbr_core/random.hpp"
 #include "rlpbr_core/utils.hpp"
 #include "shader.hpp"
 #include "utils.hpp"
@@ -16,9 +17,6 @@
 #include <iostream>
 #include <unordered_map>
 
-#define STB_IMAGE_IMPLEMENTATION
-#include "stb_image.h"
-
 using namespace std;
 
 namespace RLpbr {
@@ -74,9 +72,9 @@ static ReservoirGrid makeReservoirGrid(
     };
 }
 
-DomainRandomization randomizeDomain(mt19937 &rand_gen,
-                                    uint32_t num_env_maps,
-                                    bool enable_randomization)
+static DomainRandomization randomizeDomain(RandomStream &rng,
+                                           uint32_t num_env_maps,
+                                           bool enable_randomization)
 {
     if (!enable_randomization) {
         return DomainRandomization {
@@ -86,59 +84,63 @@ DomainRandomization randomizeDomain(mt19937 &rand_gen,
         };
     }
 
-    uniform_real_distribution<float> rand_dist(0, 1.f);
-
-    float env_angle = rand_dist(rand_gen) * 2.f * M_PI;
+    float env_angle = rng.uniform() * 2.f * M_PI;
 
     glm::quat env_rot = glm::angleAxis(env_angle, glm::vec3(0.f, 1.f, 0.f));
 
-    glm::vec3 light_filter(rand_dist(rand_gen),
-                           rand_dist(rand_gen),
-                           rand_dist(rand_gen));
+    glm::vec3 light_filter(rng.uniform(), rng.uniform(), rng.uniform());
 
     light_filter = glm::normalize(light_filter);
 
     // FIXME: Not very useful currently
     light_filter = glm::vec3(1.f);
 
-    uniform_int_distribution<uint32_t> env_map_dist(0, num_env_maps - 1);
-
     return DomainRandomization {
         env_rot,
         light_filter,
-        env_map_dist(rand_gen),
+        rng.uniformInt(num_env_maps),
     };
 }
 
+static PackedLight packLight(const LightProperties &light)
+{
+    PackedLight packed;
+    memcpy(&packed.data.x, &light.type, sizeof(uint32_t));
+    if (light.type == LightType::Sphere) {
+        packed.data.y = glm::uintBitsToFloat(light.sphereVertIdx);
+        packed.data.z = glm::uintBitsToFloat(light.sphereMatIdx);
+        packed.data.w = light.radius;
+    } else if (light.type == LightType::Triangle) {
+        packed.data.y = glm::uintBitsToFloat(light.triIdxOffset);
+        packed.data.z = glm::uintBitsToFloat(light.triMatIdx);
+    } else if (light.type == LightType::Portal) {
+        packed.data.y = glm::uintBitsToFloat(light.portalIdxOffset);
+    }
+
+    return packed;
+}
+
 VulkanEnvironment::VulkanEnvironment(const DeviceState &d,
                                      const VulkanScene &scene,
                                      const Camera &cam,
-                                     mt19937 &rand_gen,
                                      bool should_randomize,
                                      uint32_t num_env_maps)
     : EnvironmentBackend {},
+      sceneLights(scene.envInit.lights),
       lights(),
       dev(d),
       tlas(),
       prevCam(cam),
-      domainRandomization(randomizeDomain(rand_gen, num_env_maps,
-                                          should_randomize))
+      shouldRandomize(should_randomize),
+      numEnvMaps(num_env_maps),
+      domainRandomization {
+          glm::quat(1, 0, 0, 0),
+          glm::vec3(1.f, 1.f, 1.f),
+          0,
+      }
 {
-    for (const LightProperties &light : scene.envInit.lights) {
-        PackedLight packed;
-        memcpy(&packed.data.x, &light.type, sizeof(uint32_t));
-        if (light.type == LightType::Sphere) {
-            packed.data.y = glm::uintBitsToFloat(light.sphereVertIdx);
-            packed.data.z = glm::uintBitsToFloat(light.sphereMatIdx);
-            packed.data.w = light.radius;
-        } else if (light.type == LightType::Triangle) {
-            packed.data.y = glm::uintBitsToFloat(light.triIdxOffset);
-            packed.data.z = glm::uintBitsToFloat(light.triMatIdx);
-        } else if (light.type == LightType::Portal) {
-            packed.data.y = glm::uintBitsToFloat(light.portalIdxOffset);
-        }
-
-        lights.push_back(packed);
+    for (const LightProperties &light : sceneLights) {
+        lights.push_back(packLight(light));
     }
 }
 
@@ -159,12 +161,38 @@ uint32_t VulkanEnvironment::addLight(const glm::vec3 &position,
     return lights.size() - 1;
 }
 
+uint32_t VulkanEnvironment::addSceneLight(uint32_t scene_light_idx)
+{
+    lights.push_back(packLight(sceneLights[scene_light_idx]));
+
+    return lights.size() - 1;
+}
+
 void VulkanEnvironment::removeLight(uint32_t idx)
 {
     lights[idx] = lights.back();
     lights.pop_back();
 }
 
+void VulkanEnvironment::randomize(const RandomKey &key)
+{
+    RandomStream rng(key, RandomPurpose::Domain);
+    domainRandomization = randomizeDomain(rng, numEnvMaps, shouldRandomize);
+}
+
+bool VulkanEnvironment::traceRays(const Environment &, const RayQuery *,
+                                  uint32_t, RayQueryHit *)
+{
+    return false;
+}
+
+bool VulkanEnvironment::traceOcclusion(const Environment &,
+                                       const RayQuery *, uint32_t,
+                                       uint8_t *)
+{
+    return false;
+}
+
 VulkanLoader::VulkanLoader(const DeviceState &d,
                            MemoryAllocator &alc,
                            const QueueState &transfer_queue,
@@ -301,147 +329,123 @@ TextureData::~TextureData()
     dev.dt.freeMemory(dev.hdl, memory, nullptr);
 }
 
-static tuple<uint8_t *, uint32_t, glm::u32vec2, uint32_t, float>
-loadTextureFromDisk(const string &tex_path, uint32_t texel_bytes,
-                    uint32_t max_texture_resolution)
+using LoadedEnvironmentMap = tuple<void *, uint64_t, glm::u32vec3,
+                                   void *, uint64_t, glm::u32vec3>;
+
+// Each .bpsenv is 2 variable sized sections preceded by a 20 byte
+// header (3 x uint32 dims + uint64 size), read in 3 batched phases
+static vector<LoadedEnvironmentMap> loadEnvironmentMapsFromDisk(
+    const char **paths, uint32_t num_paths)
 {
-    ifstream tex_file(tex_path, ios::in | ios::binary);
-    auto read_uint = [&tex_file]() {
-        uint32_t v;
-        tex_file.read((char *)&v, sizeof(uint32_t));
-        return v;
+    constexpr uint64_t section_header_bytes =
+        3 * sizeof(uint32_t) + sizeof(uint64_t);
+
+    struct SectionHeader {
+        glm::u32vec3 dims;
+        uint64_t numBytes;
     };
 
-    auto magic = read_uint();
-    if (magic != 0x50505050) {
-        cerr << "Invalid texture file" << endl;
-        abort();
-    }
-    auto total_num_levels = read_uint();
-    
-    uint32_t x = 0;
-    uint32_t y = 0;
-    uint32_t num_compressed_bytes = 0;
-    uint32_t num_decompressed_bytes = 0;
-    uint32_t skip_bytes = 0;
-    vector<pair<uint32_t, uint32_t>> png_pos;
-    png_pos.reserve(total_num_levels);
-
-    uint32_t level_alignment = max(texel_bytes, 4u);
-
-    uint32_t num_skip_levels = 0;
-    for (int i = 0; i < (int)total_num_levels; i++) {
-        uint32_t level_x = read_uint();
-        uint32_t level_y = read_uint();
-        uint32_t offset = read_uint();
-        uint32_t lvl_compressed_bytes = read_uint();
-
-        if (level_x > max_texture_resolution &&
-            level_y > max_texture_resolution) {
-            skip_bytes += lvl_compressed_bytes;
-            num_skip_levels++;
-            continue;
-        }
+    auto parseHeader = [](const char *raw) {
+        uint32_t num_mips, width, height;
+        uint64_t num_bytes;
+        memcpy(&num_mips, raw, sizeof(uint32_t));
+        memcpy(&width, raw + sizeof(uint32_t), sizeof(uint32_t));
+        memcpy(&height, raw + 2 * sizeof(uint32_t), sizeof(uint32_t));
+        memcpy(&num_bytes, raw + 3 * sizeof(uint32_t), sizeof(uint64_t));
+
+        return SectionHeader {
+            { width, height, num_mips },
+            num_bytes,
+        };
+    };
 
-        num_decompressed_bytes = alignOffset(num_decompressed_bytes,
-                                             level_alignment);
+    IOEngine &io = IOEngine::get();
+
+    vector<IOFile> files;
+    files.reserve(num_paths);
+    vector<char> env_headers(num_paths * section_header_bytes);
+    vector<char> imp_headers(num_paths * section_header_bytes);
+    vector<IORead> reads;
+    reads.reserve(num_paths * 2);
 
-        if (x == 0 && y == 0) {
-            x = level_x;
-            y = level_y;
+    auto waitBatch = [&](IOBatch &batch) {
+        io.submit(batch, reads.data(), reads.size());
+        if (!batch.wait()) {
+            cerr << "Failed to read environment maps" << endl;
+            fatalExit();
         }
+        reads.clear();
+    };
 
-        png_pos.emplace_back(offset - skip_bytes,
-                             lvl_compressed_bytes);
-        num_decompressed_bytes +=
-            level_x * level_y * texel_bytes;
-        num_compressed_bytes += lvl_compressed_bytes;
+    for (int i = 0; i < (int)num_paths; i++) {
+        const IOFile &file = files.emplace_back(paths[i]);
+        reads.push_back({
+            file.getFD(),
+            env_headers.data() + i * section_header_bytes,
+            0,
+            section_header_bytes,
+            {},
+        });
     }
 
-    int num_levels = total_num_levels - num_skip_levels;
+    IOBatch env_header_batch;
+    waitBatch(env_header_batch);
 
-    uint8_t *img_data = (uint8_t *)malloc(num_decompressed_bytes);
-    tex_file.ignore(skip_bytes);
-
-    uint8_t *compressed_data = (uint8_t *)malloc(num_compressed_bytes);
-    tex_file.read((char *)compressed_data, num_compressed_bytes);
-
-    uint32_t cur_offset = 0;
-    for (int i = 0; i < (int)num_levels; i++) {
-        auto [offset, num_bytes] = png_pos[i];
-        int lvl_x, lvl_y, tmp_n;
-        uint8_t *decompressed = stbi_load_from_memory(
-            compressed_data + offset, num_bytes,
-            &lvl_x, &lvl_y, &tmp_n, 4);
+    vector<LoadedEnvironmentMap> loaded(num_paths);
+    for (int i = 0; i < (int)num_paths; i++) {
+        SectionHeader env_hdr =
+            parseHeader(env_headers.data() + i * section_header_bytes);
 
-        cur_offset = alignOffset(cur_offset, level_alignment);
+        void *env_staging = malloc(env_hdr.numBytes);
 
-        for (int pix_idx = 0; pix_idx < int(lvl_x * lvl_y);
-             pix_idx++) {
-            uint8_t *decompressed_offset =
-                decompressed + pix_idx * 4;
-            uint8_t *out_offset =
-                img_data + cur_offset + pix_idx * texel_bytes;
+        get<0>(loaded[i]) = env_staging;
+        get<1>(loaded[i]) = env_hdr.numBytes;
+        get<2>(loaded[i]) = env_hdr.dims;
 
-            for (int byte_idx = 0; byte_idx < (int)texel_bytes;
-                 byte_idx++) {
-                out_offset[byte_idx] =
-                    decompressed_offset[byte_idx];
-            }
-        }
-        free(decompressed);
+        reads.push_back({
+            files[i].getFD(),
+            env_staging,
+            section_header_bytes,
+            env_hdr.numBytes,
+            {},
+        });
 
-        cur_offset += lvl_x * lvl_y * texel_bytes;
+        reads.push_back({
+            files[i].getFD(),
+            imp_headers.data() + i * section_header_bytes,
+            section_header_bytes + env_hdr.numBytes,
+            section_header_bytes,
+            {},
+        });
     }
 
-    assert(cur_offset == num_decompressed_bytes);
-
-    free(compressed_data);
-
-    return make_tuple(img_data, num_decompressed_bytes, glm::u32vec2(x, y),
-                      num_levels, -float(num_skip_levels));
-}
+    IOBatch env_batch;
+    waitBatch(env_batch);
 
-static tuple<void *, uint64_t, glm::u32vec3,
-             void *, uint64_t, glm::u32vec3>
-    loadEnvironmentMapFromDisk(const string &env_path)
-{
-    ifstream tex_file(env_path, ios::in | ios::binary);
+    for (int i = 0; i < (int)num_paths; i++) {
+        SectionHeader imp_hdr =
+            parseHeader(imp_headers.data() + i * section_header_bytes);
+        assert(imp_hdr.dims.x == imp_hdr.dims.y);
+
+        void *imp_staging = malloc(imp_hdr.numBytes);
+
+        get<3>(loaded[i]) = imp_staging;
+        get<4>(loaded[i]) = imp_hdr.numBytes;
+        get<5>(loaded[i]) = imp_hdr.dims;
+
+        reads.push_back({
+            files[i].getFD(),
+            imp_staging,
+            2 * section_header_bytes + get<1>(loaded[i]),
+            imp_hdr.numBytes,
+            {},
+        });
+    }
 
-    auto read_uint = [&tex_file]() {
-        uint32_t v;
-        tex_file.read((char *)&v, sizeof(uint32_t));
-        return v;
-    };
+    IOBatch imp_batch;
+    waitBatch(imp_batch);
 
-    uint32_t num_env_mips = read_uint();
-    uint32_t env_width = read_uint();
-    uint32_t env_height = read_uint();
-    uint64_t env_bytes;
-    tex_file.read((char *)&env_bytes, sizeof(uint64_t));
-
-    void *env_staging = malloc(env_bytes);
-    tex_file.read((char *)env_staging, env_bytes);
-
-    uint32_t num_imp_mips = read_uint();
-    uint32_t imp_width = read_uint();
-    uint32_t imp_height = read_uint();
-
-    assert(imp_width == imp_height);
-    uint64_t imp_bytes;
-    tex_file.read((char *)&imp_bytes, sizeof(uint64_t));
-
-    void *imp_staging = malloc(imp_bytes);
-    tex_file.read((char *)imp_staging, imp_bytes);
-
-    return {
-        env_staging,
-        env_bytes,
-        { env_width, env_height, num_env_mips },
-        imp_staging,
-        imp_bytes,
-        { imp_width, imp_height, num_imp_mips },
-    };
+    return loaded;
 }
 
 struct StagedTextures {
@@ -464,14 +468,10 @@ struct StagedTextures {
 
 static optional<StagedTextures> prepareSceneTextures(const DeviceState &dev,
                                            const TextureInfo &texture_info,
-                                           uint32_t max_texture_resolution,
+                                           vector<DecodedTexture> &decoded,
                                            MemoryAllocator &alloc)
 {
-    uint32_t num_textures =
-        texture_info.base.size() + texture_info.metallicRoughness.size() +
-        texture_info.specular.size() + texture_info.normal.size() +
-        texture_info.emittance.size() + texture_info.transmission.size() +
-        texture_info.clearcoat.size() + texture_info.anisotropic.size();
+    uint32_t num_textures = decoded.size();
 
     if (num_textures == 0) {
         return optional<StagedTextures>();
@@ -517,6 +517,10 @@ static optional<StagedTextures> prepareSceneTextures(const DeviceState &dev,
          return gpu_textures.size() - 1;
     };
 
+    TextureFormat fourCompSRGB = TextureFormat::R8G8B8A8_SRGB;
+
+    TextureFormat twoCompUnorm = TextureFormat::R8G8_UNORM;
+
     auto stageTextureList = [&](const vector<string> &texture_names,
                                 TextureFormat orig_fmt) {
         vector<uint32_t> tex_locs;
@@ -525,23 +529,18 @@ static optional<StagedTextures> prepareSceneTextures(const DeviceState &dev,
         uint32_t texel_bytes = getTexelBytes(orig_fmt);
         VkFormat fmt = alloc.getTextureFormat(orig_fmt);
 
-        for (const string &tex_name : texture_names) {
-            auto [img_data, num_stage_bytes, dims, num_levels, bias] =
-                loadTextureFromDisk(texture_info.textureDir + tex_name,
-                                    texel_bytes, max_texture_resolution);
+        for (int i = 0; i < (int)texture_names.size(); i++) {
+            const DecodedTexture &tex = decoded[gpu_textures.size()];
+            assert(tex.texelBytes == texel_bytes);
 
             tex_locs.push_back(
-                stageTexture(img_data, num_stage_bytes, dims.x, dims.y,
-                             num_levels, fmt, texel_bytes));
+                stageTexture(tex.data, tex.numBytes, tex.dims.x, tex.dims.y,
+                             tex.numLevels, fmt, texel_bytes));
         }
 
         return tex_locs;
     };
 
-    TextureFormat fourCompSRGB = TextureFormat::R8G8B8A8_SRGB;
-
-    TextureFormat twoCompUnorm = TextureFormat::R8G8_UNORM;
-
     auto base_locs = stageTextureList(texture_info.base, fourCompSRGB);
                                    
     auto mr_locs = stageTextureList(texture_info.metallicRoughness,
@@ -937,15 +936,18 @@ static optional<BLASBuildResults> loadCachedBLASes(
         const DeviceState &dev, MemoryAllocator &alloc,
         string_view blas_path, VkCommandBuffer build_cmd)
 {
-    ifstream blases_file(filesystem::path(blas_path), ios::binary);
+    IOEngine &io = IOEngine::get();
+    IOFile blases_file(blas_path);
 
     uint32_t num_blases;
-    blases_file.read((char *)&num_blases, sizeof(uint32_t));
+    io.read(blases_file.getFD(), &num_blases, 0, sizeof(uint32_t));
     uint64_t total_serialized_bytes;
-    blases_file.read((char *)&total_serialized_bytes, sizeof(uint64_t));
+    io.read(blases_file.getFD(), &total_serialized_bytes, sizeof(uint32_t),
+            sizeof(uint64_t));
     HostBuffer staging_buf =
         alloc.makeHostBuffer(total_serialized_bytes, true);
-    blases_file.read((char *)staging_buf.ptr, total_serialized_bytes);
+    io.read(blases_file.getFD(), staging_buf.ptr,
+            sizeof(uint32_t) + sizeof(uint64_t), total_serialized_bytes);
     staging_buf.flush(dev);
 
     uint8_t *staging_ptr = (uint8_t *)staging_buf.ptr;
@@ -1330,44 +1332,121 @@ static optional<BLASBuildResults> getBLASes(
     return blas_results;
 }
 
+static void writeTLASInstanceTransform(
+    VkAccelerationStructureInstanceKHR &inst_info,
+    const InstanceTransform &txfm,
+    InstanceFlags flags)
+{
+    memcpy(&inst_info.transform,
+           glm::value_ptr(glm::transpose(txfm.mat)),
+           sizeof(VkTransformMatrixKHR));
+
+    if (flags & InstanceFlags::Transparent) {
+        inst_info.mask = 2;
+    } else {
+        inst_info.mask = 1;
+    }
+}
+
+static VkAccelerationStructureGeometryKHR makeTLASGeometry(
+    const DeviceState &dev, const HostBuffer &build_storage)
+{
+    VkBufferDeviceAddressInfo inst_build_addr_info {
+        VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,
+        nullptr,
+        build_storage.buffer,
+    };
+    VkDeviceAddress inst_build_data_addr = 
+        dev.dt.getBufferDeviceAddress(dev.hdl, &inst_build_addr_info);
+
+    VkAccelerationStructureGeometryKHR tlas_geometry;
+    tlas_geometry.sType =
+        VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
+    tlas_geometry.pNext = nullptr;
+    tlas_geometry.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
+    tlas_geometry.flags = 0;
+    auto &tlas_instances = tlas_geometry.geometry.instances;
+    tlas_instances.sType =
+        VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR;
+    tlas_instances.pNext = nullptr;
+    tlas_instances.arrayOfPointers = false;
+    tlas_instances.data.deviceAddress = inst_build_data_addr;
+
+    return tlas_geometry;
+}
+
+static VkDeviceAddress getTLASScratchAddress(const DeviceState &dev,
+                                             const LocalBuffer &storage,
+                                             VkDeviceSize accel_bytes)
+{
+    VkBufferDeviceAddressInfoKHR storage_addr_info;
+    storage_addr_info.sType =
+        VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO_KHR;
+    storage_addr_info.pNext = nullptr;
+    storage_addr_info.buffer = storage.buffer;
+    VkDeviceAddress storage_base =
+        dev.dt.getBufferDeviceAddress(dev.hdl, &storage_addr_info);
+
+    return storage_base + accel_bytes;
+}
+
 void TLAS::build(const DeviceState &dev,
                  MemoryAllocator &alloc,
-                 const vector<ObjectInstance> &instances,
-                 const vector<InstanceTransform> &instance_transforms,
-                 const vector<InstanceFlags> &instance_flags,
+                 const CowArray<ObjectInstance> &instances,
+                 const CowArray<InstanceTransform> &instance_transforms,
+                 const CowArray<InstanceFlags> &instance_flags,
                  const vector<ObjectInfo> &objects,
                  const BLASData &blases,
                  VkCommandBuffer build_cmd)
 {
-    int new_num_instances = instances.size();
-    if ((int)numBuildInstances < new_num_instances) {
-        numBuildInstances = new_num_instances;
+    reserve(alloc, instances.size());
+    writeInstances(dev, instances, instance_transforms, instance_flags,
+                   objects, blases);
+    recordBuild(dev, alloc, instances.size(), build_cmd);
+}
+
+void TLAS::refit(const DeviceState &dev,
+                 const CowArray<InstanceTransform> &instance_transforms,
+                 const CowArray<InstanceFlags> &instance_flags,
+                 uint32_t begin, uint32_t end,
+                 VkCommandBuffer build_cmd)
+{
+    writeInstanceTransforms(dev, instance_transforms, instance_flags,
+                            begin, end);
+    recordRefit(dev, build_cmd);
+}
+
+void TLAS::reserve(MemoryAllocator &alloc, uint32_t num_instances)
+{
+    if (numBuildInstances < num_instances) {
+        numBuildInstances = num_instances;
 
         buildStorage = alloc.makeHostBuffer(
             sizeof(VkAccelerationStructureInstanceKHR) * numBuildInstances,
             true);
     }
+}
 
+void TLAS::writeInstances(const DeviceState &dev,
+                          const CowArray<ObjectInstance> &instances,
+                          const CowArray<InstanceTransform> &instance_transforms,
+                          const CowArray<InstanceFlags> &instance_flags,
+                          const vector<ObjectInfo> &objects,
+                          const BLASData &blases)
+{
     VkAccelerationStructureInstanceKHR *accel_insts =
         reinterpret_cast<VkAccelerationStructureInstanceKHR  *>(
             buildStorage->ptr);
 
-    for (int inst_idx = 0; inst_idx < new_num_instances; inst_idx++) {
+    for (int inst_idx = 0; inst_idx < (int)instances.size(); inst_idx++) {
         const ObjectInstance &inst = instances[inst_idx];
-        const InstanceTransform &txfm = instance_transforms[inst_idx];
 
         VkAccelerationStructureInstanceKHR &inst_info =
             accel_insts[inst_idx];
 
-        memcpy(&inst_info.transform,
-               glm::value_ptr(glm::transpose(txfm.mat)),
-               sizeof(VkTransformMatrixKHR));
+        writeTLASInstanceTransform(inst_info, instance_transforms[inst_idx],
+                                   instance_flags[inst_idx]);
 
-        if (instance_flags[inst_idx] & InstanceFlags::Transparent) {
-            inst_info.mask = 2;
-        } else {
-            inst_info.mask = 1;
-        }
         inst_info.instanceCustomIndex = inst.materialOffset;
         inst_info.instanceShaderBindingTableRecordOffset = 
             objects[inst.objectIndex].meshIndex;
@@ -1377,27 +1456,38 @@ void TLAS::build(const DeviceState &dev,
     }
 
     buildStorage->flush(dev);
+}
 
-    VkBufferDeviceAddressInfo inst_build_addr_info {
-        VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,
-        nullptr,
-        buildStorage->buffer,
-    };
-    VkDeviceAddress inst_build_data_addr = 
-        dev.dt.getBufferDeviceAddress(dev.hdl, &inst_build_addr_info);
+void TLAS::writeInstanceTransforms(
+    const DeviceState &dev,
+    const CowArray<InstanceTransform> &instance_transforms,
+    const CowArray<InstanceFlags> &instance_flags,
+    uint32_t begin, uint32_t end)
+{
+    VkAccelerationStructureInstanceKHR *accel_insts =
+        reinterpret_cast<VkAccelerationStructureInstanceKHR  *>(
+            buildStorage->ptr);
 
-    VkAccelerationStructureGeometryKHR tlas_geometry;
-    tlas_geometry.sType =
-        VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
-    tlas_geometry.pNext = nullptr;
-    tlas_geometry.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
-    tlas_geometry.flags = 0;
-    auto &tlas_instances = tlas_geometry.geometry.instances;
-    tlas_instances.sType =
-        VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR;
-    tlas_instances.pNext = nullptr;
-    tlas_instances.arrayOfPointers = false;
-    tlas_instances.data.deviceAddress = inst_build_data_addr;
+    // Everything other than the transform & mask is unchanged since the
+    // last full build
+    for (uint32_t inst_idx = begin; inst_idx < end; inst_idx++) {
+        writeTLASInstanceTransform(accel_insts[inst_idx],
+                                   instance_transforms[inst_idx],
+                                   instance_flags[inst_idx]);
+    }
+
+    buildStorage->flush(dev,
+        begin * sizeof(VkAccelerationStructureInstanceKHR),
+        (end - begin) * sizeof(VkAccelerationStructureInstanceKHR));
+}
+
+void TLAS::recordBuild(const DeviceState &dev,
+                       MemoryAllocator &alloc,
+                       uint32_t num_instances,
+                       VkCommandBuffer build_cmd)
+{
+    VkAccelerationStructureGeometryKHR tlas_geometry =
+        makeTLASGeometry(dev, *buildStorage);
 
     VkAccelerationStructureBuildGeometryInfoKHR build_info;
     build_info.sType =
@@ -1405,7 +1495,8 @@ void TLAS::build(const DeviceState &dev,
     build_info.pNext = nullptr;
     build_info.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
     build_info.flags =
-        VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+        VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR |
+        VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR;
     build_info.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
     build_info.srcAccelerationStructure = VK_NULL_HANDLE;
     build_info.dstAccelerationStructure = VK_NULL_HANDLE;
@@ -1423,11 +1514,18 @@ void TLAS::build(const DeviceState &dev,
         VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
         &build_info, &numBuildInstances, &size_info);
 
-    size_t new_storage_bytes = size_info.accelerationStructureSize +
-        size_info.buildScratchSize;
+    // Scratch space is shared between full builds and refits
+    VkDeviceSize scratch_bytes = max(size_info.buildScratchSize,
+                                     size_info.updateScratchSize);
 
-    if (new_storage_bytes > numStorageBytes) {
-        numStorageBytes = new_storage_bytes;
+    // Only recreate the acceleration structure object when the backing
+    // storage has to grow
+    if (hdl == VK_NULL_HANDLE ||
+        size_info.accelerationStructureSize > accelStructBytes ||
+        accelStructBytes + scratch_bytes > numStorageBytes) {
+        accelStructBytes = max(size_info.accelerationStructureSize,
+                               accelStructBytes);
+        numStorageBytes = accelStructBytes + scratch_bytes;
 
         tlasStorage = alloc.makeLocalBuffer(numStorageBytes, true);
 
@@ -1435,45 +1533,83 @@ void TLAS::build(const DeviceState &dev,
             cerr << "Failed to allocate TLAS storage" << endl;
             fatalExit();
         }
+
+        if (hdl != VK_NULL_HANDLE) {
+            dev.dt.destroyAccelerationStructureKHR(dev.hdl, hdl, nullptr);
+        }
+
+        VkAccelerationStructureCreateInfoKHR create_info;
+        create_info.sType =
+            VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
+        create_info.pNext = nullptr;
+        create_info.createFlags = 0;
+        create_info.buffer = tlasStorage->buffer;
+        create_info.offset = 0;
+        create_info.size = accelStructBytes;
+        create_info.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+        create_info.deviceAddress = 0;
+
+        REQ_VK(dev.dt.createAccelerationStructureKHR(dev.hdl, &create_info,
+                                                     nullptr, &hdl));
+
+        VkAccelerationStructureDeviceAddressInfoKHR accel_addr_info;
+        accel_addr_info.sType =
+            VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR;
+        accel_addr_info.pNext = nullptr;
+        accel_addr_info.accelerationStructure = hdl;
+
+        tlasStorageDevAddr = dev.dt.getAccelerationStructureDeviceAddressKHR(
+            dev.hdl, &accel_addr_info);
     }
 
-    VkAccelerationStructureCreateInfoKHR create_info;
-    create_info.sType =
-        VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
-    create_info.pNext = nullptr;
-    create_info.createFlags = 0;
-    create_info.buffer = tlasStorage->buffer;
-    create_info.offset = 0;
-    create_info.size = size_info.accelerationStructureSize;
-    create_info.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
-    create_info.deviceAddress = 0;
-
-    REQ_VK(dev.dt.createAccelerationStructureKHR(dev.hdl, &create_info,
-                                                 nullptr, &hdl));
-
-    VkAccelerationStructureDeviceAddressInfoKHR accel_addr_info;
-    accel_addr_info.sType =
-        VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR;
-    accel_addr_info.pNext = nullptr;
-    accel_addr_info.accelerationStructure = hdl;
-
-    tlasStorageDevAddr = dev.dt.getAccelerationStructureDeviceAddressKHR(
-        dev.hdl, &accel_addr_info);
+    build_info.dstAccelerationStructure = hdl;
+    build_info.scratchData.deviceAddress =
+        getTLASScratchAddress(dev, *tlasStorage, accelStructBytes);
 
-    VkBufferDeviceAddressInfoKHR storage_addr_info;
-    storage_addr_info.sType =
-        VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO_KHR;
-    storage_addr_info.pNext = nullptr;
-    storage_addr_info.buffer = tlasStorage->buffer;
-    VkDeviceAddress storage_base =
-        dev.dt.getBufferDeviceAddress(dev.hdl, &storage_addr_info);
+    VkAccelerationStructureBuildRangeInfoKHR range_info;
+    range_info.primitiveCount = num_instances;
+    range_info.primitiveOffset = 0;
+    range_info.firstVertex = 0;
+    range_info.transformOffset = 0;
+    const auto *range_info_ptr = &range_info;
 
+    dev.dt.cmdBuildAccelerationStructuresKHR(build_cmd, 1, &build_info,
+                                             &range_info_ptr);
+
+    numInstances = num_instances;
+    numRefits = 0;
+}
+
+bool TLAS::canRefit(uint32_t num_instances) const
+{
+    return hdl != VK_NULL_HANDLE && num_instances == numInstances &&
+        numRefits < VulkanConfig::max_tlas_refits;
+}
+
+void TLAS::recordRefit(const DeviceState &dev, VkCommandBuffer build_cmd)
+{
+    VkAccelerationStructureGeometryKHR tlas_geometry =
+        makeTLASGeometry(dev, *buildStorage);
+
+    VkAccelerationStructureBuildGeometryInfoKHR build_info;
+    build_info.sType =
+        VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+    build_info.pNext = nullptr;
+    build_info.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+    build_info.flags =
+        VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR |
+        VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR;
+    build_info.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR;
+    build_info.srcAccelerationStructure = hdl;
     build_info.dstAccelerationStructure = hdl;
+    build_info.geometryCount = 1;
+    build_info.pGeometries = &tlas_geometry;
+    build_info.ppGeometries = nullptr;
     build_info.scratchData.deviceAddress =
-        storage_base + size_info.accelerationStructureSize;
+        getTLASScratchAddress(dev, *tlasStorage, accelStructBytes);
 
     VkAccelerationStructureBuildRangeInfoKHR range_info;
-    range_info.primitiveCount = numBuildInstances;
+    range_info.primitiveCount = numInstances;
     range_info.primitiveOffset = 0;
     range_info.firstVertex = 0;
     range_info.transformOffset = 0;
@@ -1481,6 +1617,8 @@ void TLAS::build(const DeviceState &dev,
 
     dev.dt.cmdBuildAccelerationStructuresKHR(build_cmd, 1, &build_info,
                                              &range_info_ptr);
+
+    numRefits++;
 }
 
 void TLAS::free(const DeviceState &dev)
@@ -1559,23 +1697,66 @@ SceneID::~SceneID()
     shared_->freeSceneIDs.push_back(id_);
 }
 
+namespace {
+
+struct VulkanStagedScene : public StagedScene {
+    VulkanStagedScene(TextureData &&texture_store,
+                      optional<StagedTextures> &&staged_textures,
+                      LocalBuffer &&geometry,
+                      HostBuffer &&geometry_staging)
+        : textureStore(move(texture_store)),
+          textures(move(staged_textures)),
+          data(move(geometry)),
+          dataStaging(move(geometry_staging))
+    {}
+
+    TextureData textureStore;
+    optional<StagedTextures> textures;
+    LocalBuffer data;
+    HostBuffer dataStaging;
+};
+
+}
+
 shared_ptr<Scene> VulkanLoader::loadScene(SceneLoadData &&load_info)
 {
-    TextureData texture_store(dev, alloc);
+    PreparedScene scene {
+        move(load_info),
+        {},
+        nullptr,
+    };
 
-    vector<LocalTexture> &gpu_textures = texture_store.textures;
-    vector<VkImageView> &texture_views = texture_store.views;
+    vector<TextureLoadRequest> tex_reqs =
+        getSceneTextureRequests(scene.loadData.textureInfo);
+    vector<CompressedTexture> compressed = readTextures(tex_reqs.data(),
+        tex_reqs.size(), max_texture_resolution_);
+
+    scene.textures.reserve(compressed.size());
+    for (CompressedTexture &tex : compressed) {
+        scene.textures.push_back(decodeTexture(tex));
+    }
+
+    stage(scene);
+
+    return upload(scene);
+}
+
+void VulkanLoader::stage(PreparedScene &scene)
+{
+    SceneLoadData &load_info = scene.loadData;
+
+    TextureData texture_store(dev, alloc);
 
     optional<StagedTextures> staged_textures = prepareSceneTextures(dev,
-        load_info.textureInfo, max_texture_resolution_, alloc);
+        load_info.textureInfo, scene.textures, alloc);
 
-    uint32_t num_textures = staged_textures.has_value() ?
-        staged_textures->textures.size() : 0;
+    // Decoded texture memory is released by prepareSceneTextures
+    scene.textures.clear();
 
-    if (num_textures > 0) {
+    if (staged_textures.has_value()) {
         texture_store.memory = staged_textures->texMemory;
-        gpu_textures = move(staged_textures->textures);
-        texture_views = move(staged_textures->textureViews);
+        texture_store.textures = move(staged_textures->textures);
+        texture_store.views = move(staged_textures->textureViews);
     }
 
     // Copy all geometry into single buffer
@@ -1587,18 +1768,38 @@ shared_ptr<Scene> VulkanLoader::loadScene(SceneLoadData &&load_info)
         fatalExit();
     }
 
-    LocalBuffer data = move(data_opt.value());
-
     HostBuffer data_staging =
         alloc.makeStagingBuffer(load_info.hdr.totalBytes);
 
-    if (holds_alternative<ifstream>(load_info.data)) {
-        ifstream &file = *get_if<ifstream>(&load_info.data);
-        file.read((char *)data_staging.ptr, load_info.hdr.totalBytes);
-    } else {
-        char *data_src = get_if<vector<char>>(&load_info.data)->data();
-        memcpy(data_staging.ptr, data_src, load_info.hdr.totalBytes);
-    }
+    load_info.readData(data_staging.ptr);
+
+    // Only place the geometry is on the host, weight light selection now
+    const char *staged_data = (const char *)data_staging.ptr;
+    load_info.envInit.lightSampling = LightSamplerInit(computeLightPowers(
+        load_info.envInit.lights,
+        (const PackedVertex *)staged_data,
+        (const uint32_t *)(staged_data + load_info.hdr.indexOffset),
+        (const MaterialParams *)(staged_data + load_info.hdr.materialOffset)));
+
+    scene.staged = make_unique<VulkanStagedScene>(
+        move(texture_store), move(staged_textures),
+        move(data_opt.value()), move(data_staging));
+}
+
+shared_ptr<Scene> VulkanLoader::upload(PreparedScene &scene)
+{
+    SceneLoadData &load_info = scene.loadData;
+    VulkanStagedScene &staged =
+        *static_cast<VulkanStagedScene *>(scene.staged.get());
+
+    TextureData &texture_store = staged.textureStore;
+    vector<LocalTexture> &gpu_textures = texture_store.textures;
+    vector<VkImageView> &texture_views = texture_store.views;
+    optional<StagedTextures> &staged_textures = staged.textures;
+    uint32_t num_textures = gpu_textures.size();
+
+    LocalBuffer &data = staged.data;
+    HostBuffer &data_staging = staged.dataStaging;
 
     // Reset command buffers
     REQ_VK(dev.dt.resetCommandPool(dev.hdl, transfer_cmd_pool_, 0));
@@ -1939,6 +2140,11 @@ shared_ptr<Scene> VulkanLoader::loadScene(SceneLoadData &&load_info)
     });
 }
 
+uint32_t VulkanLoader::getMaxTextureResolution() const
+{
+    return max_texture_resolution_;
+}
+
 shared_ptr<EnvironmentMapGroup> VulkanLoader::loadEnvironmentMaps(
     const char **paths, uint32_t num_paths)
 {
@@ -1961,12 +2167,14 @@ shared_ptr<EnvironmentMapGroup> VulkanLoader::loadEnvironmentMaps(
     auto env_texel_bytes = getTexelBytes(TextureFormat::R32G32B32A32_SFLOAT);
     auto imp_texel_bytes = getTexelBytes(TextureFormat::R32_SFLOAT);
 
+    vector<LoadedEnvironmentMap> loaded_env_maps =
+        loadEnvironmentMapsFromDisk(paths, num_paths);
+
     uint64_t cur_host_offset = 0;
     uint64_t cur_dev_offset = 0;
     for (int i = 0; i < (int)num_paths; i++) {
         auto [env_data, env_data_bytes, env_dims,
-              imp_data, imp_data_bytes, imp_dims] =
-            loadEnvironmentMapFromDisk(paths[i]);
+              imp_data, imp_data_bytes, imp_dims] = loaded_env_maps[i];
 
         auto [env_gpu_tex, env_tex_reqs] = alloc.makeTexture2D(
             env_dims.x, env_dims.y, env_dims.z, env_fmt);
@@ -2,6 +2,7 @@
 
 #include <rlpbr/config.hpp>
 #include <rlpbr_core/scene.hpp>
+#include <rlpbr_core/load_pipeline.hpp>
 
 #include <filesystem>
 #include <list>
@@ -9,7 +10,6 @@
 #include <optional>
 #include <string_view>
 #include <unordered_map>
-#include <random>
 
 #include "descriptors.hpp"
 #include "utils.hpp"
@@ -50,20 +50,60 @@ struct TLAS {
     VkAccelerationStructureKHR hdl;
     std::optional<HostBuffer> buildStorage;
     uint32_t numBuildInstances;
+    uint32_t numInstances;
+    uint32_t numRefits;
 
     std::optional<LocalBuffer> tlasStorage;
     VkDeviceAddress tlasStorageDevAddr;
     size_t numStorageBytes;
+    VkDeviceSize accelStructBytes;
 
     void build(const DeviceState &dev,
                MemoryAllocator &alloc,
-               const std::vector<ObjectInstance> &instances,
-               const std::vector<InstanceTransform> &instance_transforms,
-               const std::vector<InstanceFlags> &instance_flags,
+               const CowArray<ObjectInstance> &instances,
+               const CowArray<InstanceTransform> &instance_transforms,
+               const CowArray<InstanceFlags> &instance_flags,
                const std::vector<ObjectInfo> &objects,
                const BLASData &blases,
                VkCommandBuffer build_cmd);
 
+    // In place update after only transforms / flags of instances in
+    // [begin, end) changed
+    void refit(const DeviceState &dev,
+               const CowArray<InstanceTransform> &instance_transforms,
+               const CowArray<InstanceFlags> &instance_flags,
+               uint32_t begin, uint32_t end,
+               VkCommandBuffer build_cmd);
+
+    // build() / refit() split into steps, so the host side instance writes
+    // can run on other threads. Commands may be recorded before the
+    // instance data is written, as long as both happen before submission.
+    void reserve(MemoryAllocator &alloc, uint32_t num_instances);
+
+    void recordBuild(const DeviceState &dev,
+                     MemoryAllocator &alloc,
+                     uint32_t num_instances,
+                     VkCommandBuffer build_cmd);
+
+    void recordRefit(const DeviceState &dev, VkCommandBuffer build_cmd);
+
+    // Only touch this TLAS's host buffer, safe to call concurrently for
+    // different TLASes
+    void writeInstances(const DeviceState &dev,
+                        const CowArray<ObjectInstance> &instances,
+                        const CowArray<InstanceTransform> &instance_transforms,
+                        const CowArray<InstanceFlags> &instance_flags,
+                        const std::vector<ObjectInfo> &objects,
+                        const BLASData &blases);
+
+    void writeInstanceTransforms(
+        const DeviceState &dev,
+        const CowArray<InstanceTransform> &instance_transforms,
+        const CowArray<InstanceFlags> &instance_flags,
+        uint32_t begin, uint32_t end);
+
+    bool canRefit(uint32_t num_instances) const;
+
     void free(const DeviceState &dev);
 };
 
@@ -84,16 +124,25 @@ struct VulkanEnvironment : public EnvironmentBackend {
     VulkanEnvironment(const DeviceState &dev,
                       const VulkanScene &scene,
                       const Camera &cam,
-                      std::mt19937 &rand_gen,
                       bool should_randomize,
                       uint32_t num_env_maps);
     VulkanEnvironment(const VulkanEnvironment &) = delete;
     ~VulkanEnvironment();
 
     uint32_t addLight(const glm::vec3 &position, const glm::vec3 &color);
+    uint32_t addSceneLight(uint32_t scene_light_idx);
 
     void removeLight(uint32_t light_idx);
 
+    void randomize(const RandomKey &key);
+
+    // Geometry only lives on the GPU, both return false
+    bool traceRays(const Environment &env, const RayQuery *rays,
+                   uint32_t num_rays, RayQueryHit *hits);
+    bool traceOcclusion(const Environment &env, const RayQuery *rays,
+                        uint32_t num_rays, uint8_t *occluded);
+
+    const std::vector<LightProperties> &sceneLights;
     std::vector<PackedLight> lights;
 
     const DeviceState &dev;
@@ -101,6 +150,8 @@ struct VulkanEnvironment : public EnvironmentBackend {
 
     Camera prevCam;
 
+    bool shouldRandomize;
+    uint32_t numEnvMaps;
     DomainRandomization domainRandomization;
 };
 
@@ -176,7 +227,7 @@ struct VulkanScene : public Scene {
     BLASData blases;
 };
 
-class VulkanLoader : public LoaderBackend {
+class VulkanLoader : public LoaderBackend, public SceneUploadSink {
 public:
     VulkanLoader(const DeviceState &dev,
                  MemoryAllocator &alloc,
@@ -201,6 +252,14 @@ public:
     std::shared_ptr<EnvironmentMapGroup> loadEnvironmentMaps(
         const char **paths, uint32_t num_paths);
 
+    // Allocates device memory, so stage can run concurrently with
+    // another stage or upload on this loader
+    void stage(PreparedScene &scene) override;
+    std::shared_ptr<Scene> upload(PreparedScene &scene) override;
+    uint32_t getMaxTextureResolution() const override;
+
+    SceneUploadSink *getUploadSink() { return this; }
+
 private:
     VulkanLoader(const DeviceState &dev,
                  MemoryAllocator &alloc,
@@ -1,6 +1,12 @@
 #ifndef RLPBR_VK_BSDF_GLSL_INCLUDED
 #define RLPBR_VK_BSDF_GLSL_INCLUDED
 
+#define SHADER_CONST const
+#define SHADER_FUNC
+#include "rlpbr_core/shading.h"
+#undef SHADER_FUNC
+#undef SHADER_CONST
+
 // BSDFFlags "enum"
 const uint32_t BSDFFlagsInvalid = 1 << 0;
 const uint32_t BSDFFlagsDelta = 1 << 1;
@@ -84,9 +90,7 @@ float pdfMSMicrofacetAngle(float dir_albedo_compl, float avg_albedo_compl,
 #define COMPUTE_FRESNEL(T)                                              \
     T computeFresnel(T f0, T f90, float cos_theta)                      \
     {                                                                   \
-        float complement = max(1.f - cos_theta, 0.f);                   \
-        return f0 + (f90 - f0) * complement * complement * complement * \
-            complement * complement;                                    \
+        return f0 + (f90 - f0) * fresnelWeight(cos_theta);              \
     }
 
 COMPUTE_FRESNEL(float)
@@ -280,37 +284,6 @@ SampleResult sampleDiffuse(BSDFParams bsdf_params, vec3 wo, vec2 sample_uv)
     return result;
 }
 
-// Single scattering GGX Microfacet BRDF
-float ggxLambda(float cos_theta, float a2)
-{
-    float cos2 = cos_theta * cos_theta;
-    float tan2 = max(1.f - cos2, 0.f) / cos2;
-    float l = 0.5f * (-1.f + sqrt(1.f + a2 * tan2));
-
-    return cos_theta <= 0.f ? 0.f : l;
-}
-
-float ggxG1(float cos_theta, float a2)
-{
-    float cos2 = cos_theta * cos_theta;
-    float tan2 = max(1.f - cos2, 0.f) / cos2;
-    float g1 = 2.f / (1.f + sqrt(1.f + a2 * tan2));
-    return g1;
-}
-
-float ggxNDF(float a2, float cos_theta)
-{
-    float d = ((cos_theta * a2 - cos_theta) * cos_theta + 1.f);
-    return a2 / (d * d * M_PI);
-}
-
-float ggxMasking(float a2, float out_cos, float in_cos)
-{
-    float in_lambda = ggxLambda(in_cos, a2);
-    float out_lambda = ggxLambda(out_cos, a2);
-    return 1.f / (1.f + in_lambda + out_lambda);
-}
-
 #define EVAL_GGX(T)                                                       \
     T evalGGX(float wo_dot_n, float wi_dot_n, float n_dot_h, T F,         \
               float alpha, out float pdf)                                 \
@@ -6,6 +6,12 @@
 #include "utils.glsl"
 #include "sampler.glsl"
 
+#define SHADER_CONST const
+#define SHADER_FUNC
+#include "rlpbr_core/shading.h"
+#undef SHADER_FUNC
+#undef SHADER_CONST
+
 // LightType "enum"
 const uint32_t LightTypeSphere = 0;
 const uint32_t LightTypeTriangle = 1;
@@ -122,6 +128,41 @@ uint32_t unpackLight(in Environment env,
     return light_type;
 }
 
+// Power proportional light selection, mirrors LightSampler::sample. The
+// tables follow the lights: numLights vec4(keep, alias, pdf, 0) and then
+// one vec4(keep, alias, 0, 0) per block of LightSamplerBlockSize lights.
+uint32_t sampleLightIndex(in Environment env, vec2 u, out float pdf)
+{
+    uint32_t num_lights = env.numLights;
+    uint32_t num_blocks =
+        (num_lights + LightSamplerBlockSize - 1) / LightSamplerBlockSize;
+    uint32_t entries_offset = env.baseLightOffset + num_lights;
+    uint32_t blocks_offset = entries_offset + num_lights;
+
+    float scaled = u.x * float(num_blocks);
+    uint32_t block_idx = min(uint32_t(scaled), num_blocks - 1);
+    vec4 block_entry = lights[nonuniformEXT(blocks_offset + block_idx)].data;
+    if (scaled - float(block_idx) >= block_entry.x) {
+        block_idx = floatBitsToUint(block_entry.y);
+    }
+
+    uint32_t begin = block_idx * LightSamplerBlockSize;
+    uint32_t len = min(num_lights - begin, LightSamplerBlockSize);
+
+    scaled = u.y * float(len);
+    uint32_t offset = min(uint32_t(scaled), len - 1);
+    uint32_t light_idx = begin + offset;
+    vec4 entry = lights[nonuniformEXT(entries_offset + light_idx)].data;
+    if (scaled - float(offset) >= entry.x) {
+        light_idx = floatBitsToUint(entry.y);
+        entry = lights[nonuniformEXT(entries_offset + light_idx)].data;
+    }
+
+    pdf = entry.z;
+
+    return light_idx;
+}
+
 vec3 evalEnvMap(uint32_t map_idx, vec3 dir)
 {
     vec2 uv = dirToLatLong(dir);
@@ -285,41 +326,19 @@ void sampleSphereLight(
     }
     wc_y = cross(wc, wc_x);
 
-    // Compute $\theta$ and $\phi$ values for sample in cone
     float sin_theta_max = light.radius * inv_dc;
-    float sin_theta_max2 = sin_theta_max * sin_theta_max;
-    float inv_sin_theta_max = 1.f / sin_theta_max;
-    float cos_theta_max = sqrt(max(0.f, 1.f - sin_theta_max2));
-
-    float cos_theta  = (cos_theta_max - 1.f) * uv.x + 1.f;
-    float sin_theta2 = 1.f - cos_theta * cos_theta;
-
-    if (sin_theta_max2 < 0.00068523f /* sin^2(1.5 deg) */) {
-        /* Fall back to a Taylor series expansion for small angles, where
-           the standard approach suffers from severe cancellation errors */
-        sin_theta2 = sin_theta_max2 * uv.x;
-        cos_theta = sqrt(1.f - sin_theta2);
-    }
-
-    // Compute angle $\alpha$ from center of sphere to sampled point on surface
-    float cos_alpha = sin_theta2 * inv_sin_theta_max +
-        cos_theta * sqrt(max(0.f, 1.f - sin_theta2 * inv_sin_theta_max *
-                             inv_sin_theta_max));
+    SphereConeSample cone = sampleSphereCone(sin_theta_max, uv.x);
 
-    float sin_alpha = sqrt(max(0.f, 1.f - cos_alpha * cos_alpha));
-    float phi = uv.y * 2.f * M_PI;;
+    float phi = uv.y * 2.f * M_PI;
 
     // Compute surface normal and sampled point on sphere
     vec3 normal =
-        sin_alpha * cos(phi) * -wc_x +
-        sin_alpha * sin(phi) * -wc_y +
-        cos_alpha * -wc;
+        cone.sinAlpha * cos(phi) * -wc_x +
+        cone.sinAlpha * sin(phi) * -wc_y +
+        cone.cosAlpha * -wc;
 
     vec3 light_point = light.position + light.radius * normal;
 
-    // Uniform cone PDF.
-    float inv_pdf = 2.f * M_PI * (1.f - cos_theta_max);
-
     vec3 to_light = light_point - origin;
 
     dist_to_light = length(to_light);
@@ -329,7 +348,7 @@ void sampleSphereLight(
     if (dist_to_light > 0.f) {
         light_sample.toLight = to_light / dist_to_light;
         light_sample.radiance = emittance;
-        light_sample.pdf = 1.f / (inv_pdf * inv_selection_pdf);
+        light_sample.pdf = 1.f / (cone.invPdf * inv_selection_pdf);
     } else {
         light_sample.toLight = vec3(0.f);
         light_sample.radiance = vec3(0.f);
@@ -344,11 +363,8 @@ float pdfTriangleLight(float inv_selection_pdf, vec3 to_light,
 
     float dist_to_light2 = dot(to_light, to_light);
 
-    if (dist_to_light2 > 0.f && cos_theta > 0.f) {
-        return dist_to_light2 / (tri_area * cos_theta * inv_selection_pdf);
-    } else {
-        return 0.f;
-    }
+    return areaToSolidAnglePDF(1.f / (tri_area * inv_selection_pdf),
+                               dist_to_light2, cos_theta);
 }
 
 void sampleTriangleLight(in TriangleLight tri_light,
@@ -375,8 +391,8 @@ void sampleTriangleLight(in TriangleLight tri_light,
 
     float cos_theta = abs(dot(to_light, n));
 
-    float pdf = dist_to_light2 /
-        (area * cos_theta * inv_selection_pdf);
+    float pdf = areaToSolidAnglePDF(1.f / (area * inv_selection_pdf),
+                                    dist_to_light2, cos_theta);
 
     if (dist_to_light > 0.f && cos_theta > 0.f) {
         light_sample.toLight = to_light;
@@ -396,7 +412,6 @@ LightInfo sampleLights(inout Sampler rng, in Environment env,
     in vec3 world_shading_normal)
 {
     uint32_t total_lights = env.numLights;
-    float inv_selection_pdf = float(total_lights);
     
     const int num_ris_lights = 4;
     GPUSceneInfo scene_info = sceneInfos[env.sceneID];
@@ -412,10 +427,11 @@ LightInfo sampleLights(inout Sampler rng, in Environment env,
 
     for (int i = 0; i < num_ris_lights; i++) {
         TriangleLight light;
+        float selection_pdf = 0.f;
+        vec2 light_select_uv = samplerGet2D(rng);
         if (total_lights > 0) {
-            uint32_t light_idx = min(
-                uint32_t(samplerGet1D(rng) * total_lights),
-                total_lights - 1);
+            uint32_t light_idx = sampleLightIndex(env, light_select_uv,
+                                                  selection_pdf);
 
             PackedLight packed =
                 lights[nonuniformEXT(env.baseLightOffset + light_idx)];
@@ -453,7 +469,8 @@ LightInfo sampleLights(inout Sampler rng, in Environment env,
         vec3 tri_normal = c / c_len;
         float tri_area = 0.5f * c_len;
 
-        float inv_source_pdf = tri_area * inv_selection_pdf;
+        float inv_source_pdf = selection_pdf == 0.f ? 0.f :
+            tri_area / selection_pdf;
 
         float cos_theta = abs(dot(tri_normal, to_light));
         float inv_dist2 = dist_to_light2 == 0.f ? 0.f : 1.f / dist_to_light2;
@@ -533,13 +550,27 @@ LightInfo hackySampleLights(inout Sampler rng, in Environment env,
 LightInfo sampleLights(inout Sampler rng, in Environment env, 
     in vec3 origin, in vec3 base_normal, in vec3 shading_normal)
 {
+    // The environment map and the lights as a whole are picked uniformly,
+    // individual lights proportional to their power
     uint32_t total_lights = env.numLights + 1;
 
-    uint32_t light_idx = uint32_t(samplerGet1D(rng) * total_lights);
+    uint32_t light_idx = min(uint32_t(samplerGet1D(rng) * total_lights),
+                             total_lights - 1);
 
     vec2 light_sample_uv = samplerGet2D(rng);
 
+    // Drawn whether or not a light was picked, so every path consumes the
+    // same sampler dimensions
+    vec2 light_select_uv = samplerGet2D(rng);
+
     float inv_selection_pdf = float(total_lights);
+    if (light_idx < env.numLights) {
+        float light_pdf;
+        light_idx = sampleLightIndex(env, light_select_uv, light_pdf);
+
+        inv_selection_pdf = light_pdf == 0.f ? 0.f :
+            float(total_lights) / (float(env.numLights) * light_pdf);
+    }
 
     SphereLight sphere_light = { vec3(0), 0.f, 0 };
     TriangleLight tri_light = {{ vec3(0), vec3(0), vec3(0) }, 0};